@@ -51,6 +51,20 @@ jbig2_generic_stats_size(Jbig2Ctx *ctx, int template)
 }
 
 
+/* 6.2.5.7 3b: a typical line is a copy of the line above it */
+static void
+copy_prev_row(Jbig2Image *image, int row)
+{
+  if (!row) {
+    /* no previous row */
+    memset( image->data, 0, image->stride );
+  } else {
+    /* duplicate data from the previous row */
+    uint8_t *src = image->data + (row - 1) * image->stride;
+    memcpy( src + image->stride, src, image->stride );
+  }
+}
+
 static int
 jbig2_decode_generic_template0(Jbig2Ctx *ctx,
 			       Jbig2Segment *segment,
@@ -63,6 +77,7 @@ jbig2_decode_generic_template0(Jbig2Ctx *ctx,
   const int GBH = image->height;
   const int rowstride = image->stride;
   int x, y;
+  int LTP = 0;
   byte *gbreg_line = (byte *)image->data;
 
   /* todo: currently we only handle the nominal gbat location */
@@ -81,6 +96,21 @@ jbig2_decode_generic_template0(Jbig2Ctx *ctx,
       uint32_t line_m2;
       int padded_width = (GBW + 7) & -8;
 
+      if (params->TPGDON)
+	{
+	  /* 6.2.5.7 3b: decode SLTP and skip typical lines */
+	  bool bit = jbig2_arith_decode(as, &GB_stats[0x9B25]);
+	  if (bit < 0)
+	    return -1;
+	  LTP ^= bit;
+	  if (LTP)
+	    {
+	      copy_prev_row(image, y);
+	      gbreg_line += rowstride;
+	      continue;
+	    }
+	}
+
       line_m1 = (y >= 1) ? gbreg_line[-rowstride] : 0;
       line_m2 = (y >= 2) ? gbreg_line[-(rowstride << 1)] << 6 : 0;
       CONTEXT = (line_m1 & 0x7f0) | (line_m2 & 0xf800);
@@ -184,6 +214,7 @@ jbig2_decode_generic_template1(Jbig2Ctx *ctx,
   const int GBH = image->height;
   const int rowstride = image->stride;
   int x, y;
+  int LTP = 0;
   byte *gbreg_line = (byte *)image->data;
 
   /* todo: currently we only handle the nominal gbat location */
@@ -202,6 +233,21 @@ jbig2_decode_generic_template1(Jbig2Ctx *ctx,
       uint32_t line_m2;
       int padded_width = (GBW + 7) & -8;
 
+      if (params->TPGDON)
+	{
+	  /* 6.2.5.7 3b: decode SLTP and skip typical lines */
+	  bool bit = jbig2_arith_decode(as, &GB_stats[0x0795]);
+	  if (bit < 0)
+	    return -1;
+	  LTP ^= bit;
+	  if (LTP)
+	    {
+	      copy_prev_row(image, y);
+	      gbreg_line += rowstride;
+	      continue;
+	    }
+	}
+
       line_m1 = (y >= 1) ? gbreg_line[-rowstride] : 0;
       line_m2 = (y >= 2) ? gbreg_line[-(rowstride << 1)] << 5 : 0;
       CONTEXT = ((line_m1 >> 1) & 0x1f8) | ((line_m2 >> 1) & 0x1e00);
@@ -257,6 +303,7 @@ jbig2_decode_generic_template2(Jbig2Ctx *ctx,
   const int GBH = image->height;
   const int rowstride = image->stride;
   int x, y;
+  int LTP = 0;
   byte *gbreg_line = (byte *)image->data;
 
   /* todo: currently we only handle the nominal gbat location */
@@ -275,6 +322,21 @@ jbig2_decode_generic_template2(Jbig2Ctx *ctx,
       uint32_t line_m2;
       int padded_width = (GBW + 7) & -8;
 
+      if (params->TPGDON)
+	{
+	  /* 6.2.5.7 3b: decode SLTP and skip typical lines */
+	  bool bit = jbig2_arith_decode(as, &GB_stats[0xE5]);
+	  if (bit < 0)
+	    return -1;
+	  LTP ^= bit;
+	  if (LTP)
+	    {
+	      copy_prev_row(image, y);
+	      gbreg_line += rowstride;
+	      continue;
+	    }
+	}
+
       line_m1 = (y >= 1) ? gbreg_line[-rowstride] : 0;
       line_m2 = (y >= 2) ? gbreg_line[-(rowstride << 1)] << 4 : 0;
       CONTEXT = ((line_m1 >> 3) & 0x7c) | ((line_m2 >> 3) & 0x380);
@@ -330,6 +392,7 @@ jbig2_decode_generic_template2a(Jbig2Ctx *ctx,
   const int GBH = image->height;
   const int rowstride = image->stride;
   int x, y;
+  int LTP = 0;
   byte *gbreg_line = (byte *)image->data;
 
   /* This is a special case for GBATX1 = 3, GBATY1 = -1 */
@@ -348,6 +411,21 @@ jbig2_decode_generic_template2a(Jbig2Ctx *ctx,
       uint32_t line_m2;
       int padded_width = (GBW + 7) & -8;
 
+      if (params->TPGDON)
+	{
+	  /* 6.2.5.7 3b: decode SLTP and skip typical lines */
+	  bool bit = jbig2_arith_decode(as, &GB_stats[0xE5]);
+	  if (bit < 0)
+	    return -1;
+	  LTP ^= bit;
+	  if (LTP)
+	    {
+	      copy_prev_row(image, y);
+	      gbreg_line += rowstride;
+	      continue;
+	    }
+	}
+
       line_m1 = (y >= 1) ? gbreg_line[-rowstride] : 0;
       line_m2 = (y >= 2) ? gbreg_line[-(rowstride << 1)] << 4 : 0;
       CONTEXT = ((line_m1 >> 3) & 0x78) | ((line_m1 >> 2) & 0x4) | ((line_m2 >> 3) & 0x380);
@@ -405,6 +483,7 @@ jbig2_decode_generic_template3(Jbig2Ctx *ctx,
   const int rowstride = image->stride;
   byte *gbreg_line = (byte *)image->data;
   int x, y;
+  int LTP = 0;
 
   /* this routine only handles the nominal AT location */
 
@@ -421,6 +500,21 @@ jbig2_decode_generic_template3(Jbig2Ctx *ctx,
       uint32_t line_m1;
       int padded_width = (GBW + 7) & -8;
 
+      if (params->TPGDON)
+	{
+	  /* 6.2.5.7 3b: decode SLTP and skip typical lines */
+	  bool bit = jbig2_arith_decode(as, &GB_stats[0x0195]);
+	  if (bit < 0)
+	    return -1;
+	  LTP ^= bit;
+	  if (LTP)
+	    {
+	      copy_prev_row(image, y);
+	      gbreg_line += rowstride;
+	      continue;
+	    }
+	}
+
       line_m1 = (y >= 1) ? gbreg_line[-rowstride] : 0;
       CONTEXT = (line_m1 >> 1) & 0x3f0;
 
@@ -445,7 +539,7 @@ jbig2_decode_generic_template3(Jbig2Ctx *ctx,
 		return -1;
 	      result |= bit << (7 - x_minor);
 	      CONTEXT = ((CONTEXT & 0x1f7) << 1) | bit |
-		((line_m1 >> (10 - x_minor)) & 0x010);
+		((line_m1 >> (8 - x_minor)) & 0x010);
 	    }
 	  gbreg_line[x >> 3] = result;
 	}
@@ -497,19 +591,6 @@ jbig2_decode_generic_template3_unopt(Jbig2Ctx *ctx,
   return 0;
 }
 
-static void
-copy_prev_row(Jbig2Image *image, int row)
-{
-  if (!row) {
-    /* no previous row */
-    memset( image->data, 0, image->stride );
-  } else {
-    /* duplicate data from the previous row */
-    uint8_t *src = image->data + (row - 1) * image->stride;
-    memcpy( src + image->stride, src, image->stride );
-  }
-}
-
 static int
 jbig2_decode_generic_template0_TPGDON(Jbig2Ctx *ctx,
 				Jbig2Segment *segment,
@@ -766,9 +847,31 @@ jbig2_decode_generic_region(Jbig2Ctx *ctx,
                        segment->data_length, image->stride * image->height);
   }
 
-  if (!params->MMR && params->TPGDON) 
-     return jbig2_decode_generic_region_TPGDON(ctx, segment, params, 
+  /* the optimized decoders handle TPGDON themselves but only for the
+     nominal AT pixel locations */
+  if (!params->MMR && params->TPGDON) {
+    bool nominal = FALSE;
+    switch (params->GBTEMPLATE) {
+      case 0:
+        nominal = gbat[0] == +3 && gbat[1] == -1 &&
+                  gbat[2] == -3 && gbat[3] == -1 &&
+                  gbat[4] == +2 && gbat[5] == -2 &&
+                  gbat[6] == -2 && gbat[7] == -2;
+        break;
+      case 1:
+        nominal = gbat[0] == 3 && gbat[1] == -1;
+        break;
+      case 2:
+        nominal = (gbat[0] == 2 || gbat[0] == 3) && gbat[1] == -1;
+        break;
+      case 3:
+        nominal = gbat[0] == 2 && gbat[1] == -1;
+        break;
+    }
+    if (!nominal)
+      return jbig2_decode_generic_region_TPGDON(ctx, segment, params,
 		as, image, GB_stats);
+  }
 
   if (!params->MMR && params->GBTEMPLATE == 0) {
     if (gbat[0] == +3 && gbat[1] == -1 &&
@@ -794,7 +897,7 @@ jbig2_decode_generic_region(Jbig2Ctx *ctx,
     }
   else if (!params->MMR && params->GBTEMPLATE == 3) {
    if (gbat[0] == 2 && gbat[1] == -1)
-     return jbig2_decode_generic_template3_unopt(ctx, segment, params,
+     return jbig2_decode_generic_template3(ctx, segment, params,
                                          as, image, GB_stats);
    else
      return jbig2_decode_generic_template3_unopt(ctx, segment, params,
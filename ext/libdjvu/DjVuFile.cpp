@@ -148,6 +148,9 @@ private:
 };
 
 
+/* SumatraPDF: cf. ddjvu_set_bg44_chunk_limit */
+int DjVuFile::bg44_chunk_limit = 0;
+
 DjVuFile::DjVuFile()
 : file_size(0), recover_errors(ABORT), verbose_eof(false), chunks_number(-1),
 initialized(false)
@@ -972,9 +975,9 @@ DjVuFile::decode_chunk( const GUTF8String &id, const GP<ByteStream> &gbs,
 		      bg44->get_width(), bg44->get_height(),
           get_dpi(bg44->get_width(), bg44->get_height()));
     } 
-    else
+    else if (!bg44_chunk_limit || bg44->get_serial() < bg44_chunk_limit)
     {
-      // Refinement chunks
+      // Refinement chunks (SumatraPDF: up to bg44_chunk_limit)
       GP<IW44Image> bg44 = this->bg44;
       bg44->decode_chunk(gbs);
       desc.format( ERR_MSG("DjVuFile.IW44_bg2") "\t%d\t%d",
@@ -1093,9 +1096,9 @@ DjVuFile::decode_chunk( const GUTF8String &id, const GP<ByteStream> &gbs,
                    bg44->get_width(), bg44->get_height(),
                    get_dpi(bg44->get_width(), bg44->get_height()));
     } 
-    else
+    else if (!bg44_chunk_limit || bg44->get_serial() < bg44_chunk_limit)
     {
-      // Refinement chunks
+      // Refinement chunks (SumatraPDF: up to bg44_chunk_limit)
       GP<IW44Image> bg44 = this->bg44;
       bg44->decode_chunk(gbs);
       desc.format( ERR_MSG("DjVuFile.IW44_data2") "\t%d\t%d",
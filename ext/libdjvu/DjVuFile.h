@@ -223,6 +223,9 @@ public:
    GP<DjVuPalette>	fgbc;
       /// Pointer to collected annotation chunks.
    GP<ByteStream>	anno;
+      /* SumatraPDF: maximum number of BG44 chunks decoded per file while
+         this is set (0 for all chunks, cf. ddjvu_set_bg44_chunk_limit) */
+   static int		bg44_chunk_limit;
       /// Pointer to collected hiddentext chunks.
    GP<ByteStream>	text;
       /// Pointer to meta data chunks.
@@ -1092,6 +1092,13 @@ ddjvu_document_create_by_data(ddjvu_context_t *ctx,
   return d;
 }
 
+/* SumatraPDF: ddjvu_set_bg44_chunk_limit */
+void
+ddjvu_set_bg44_chunk_limit(int maxchunks)
+{
+  DjVuFile::bg44_chunk_limit = maxchunks > 0 ? maxchunks : 0;
+}
+
 ddjvu_job_t *
 ddjvu_document_job(ddjvu_document_t *document)
 {
@@ -542,6 +542,17 @@ ddjvu_document_create_by_data(ddjvu_context_t *context,
                               unsigned long datalen);
 
 
+/* SumatraPDF: ddjvu_set_bg44_chunk_limit ---
+   Limits the number of IW44 background chunks decoded for pages
+   while this is set (0 for decoding all chunks). The first chunks
+   contain the coarse wavelet data, which is all that's visible at
+   a heavy subsampling. This setting is shared by all contexts and
+   thus only usable when compiling libdjvu without thread support. */
+
+DDJVUAPI void
+ddjvu_set_bg44_chunk_limit(int maxchunks);
+
+
 /* ddjvu_document_job ---
    Access the job object in charge of decoding the document header. 
    In fact <ddjvu_document_t> is a subclass of <ddjvu_job_t>
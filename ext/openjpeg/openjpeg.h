@@ -1210,6 +1210,17 @@ OPJ_API OPJ_BOOL OPJ_CALLCONV opj_set_error_handler(opj_codec_t * p_codec,
                                                     opj_msg_callback p_callback,
                                                     void * p_user_data);
 
+/**
+ * SumatraPDF: Set a function for running independent decoding jobs concurrently
+ * (used for decoding the code-blocks of large tile components). The runner must
+ * call job(index, data) for all indices in [0, count) and return once all calls
+ * have returned. It may be called from several threads at once.
+ * @param runner        the job runner (or NULL for decoding on the calling thread)
+*/
+typedef void (*opj_job_fn) (OPJ_UINT32 index, void *data);
+typedef void (*opj_run_jobs_fn) (opj_job_fn job, OPJ_UINT32 count, void *data);
+OPJ_API void OPJ_CALLCONV opj_set_job_runner(opj_run_jobs_fn runner);
+
 /* 
 ==========================================================
    codec functions definitions
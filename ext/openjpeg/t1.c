@@ -1260,13 +1260,195 @@ void opj_t1_destroy(opj_t1_t *p_t1)
 	opj_free(p_t1);
 }
 
+/* SumatraPDF: allow decoding code-blocks concurrently (cf. opj_set_job_runner) */
+static opj_run_jobs_fn opj_job_runner = NULL;
+
+void OPJ_CALLCONV opj_set_job_runner(opj_run_jobs_fn runner)
+{
+	opj_job_runner = runner;
+}
+
+/* minimum number of code-blocks in a tile component for decoding them concurrently */
+#define OPJ_T1_MIN_PARALLEL_CBLKS 16
+/* maximum number of jobs the code-blocks are distributed over */
+#define OPJ_T1_MAX_JOBS 16
+
+/* decodes a single code-block into the tile component's data */
+static OPJ_BOOL opj_t1_decode_cblk_into_tile(opj_t1_t* t1,
+                                          opj_tcd_tilecomp_t* tilec,
+                                          opj_tccp_t* tccp,
+                                          OPJ_UINT32 resno,
+                                          opj_tcd_band_t* band,
+                                          opj_tcd_cblk_dec_t* cblk)
+{
+	OPJ_UINT32 tile_w = (OPJ_UINT32)(tilec->x1 - tilec->x0);
+	OPJ_INT32* restrict datap;
+	OPJ_UINT32 cblk_w, cblk_h;
+	OPJ_INT32 x, y;
+	OPJ_UINT32 i, j;
+
+	if (OPJ_FALSE == opj_t1_decode_cblk(
+	                        t1,
+	                        cblk,
+	                        band->bandno,
+	                        (OPJ_UINT32)tccp->roishift,
+	                        tccp->cblksty)) {
+	        return OPJ_FALSE;
+	}
+
+	x = cblk->x0 - band->x0;
+	y = cblk->y0 - band->y0;
+	if (band->bandno & 1) {
+		opj_tcd_resolution_t* pres = &tilec->resolutions[resno - 1];
+		x += pres->x1 - pres->x0;
+	}
+	if (band->bandno & 2) {
+		opj_tcd_resolution_t* pres = &tilec->resolutions[resno - 1];
+		y += pres->y1 - pres->y0;
+	}
+
+	datap=t1->data;
+	cblk_w = t1->w;
+	cblk_h = t1->h;
+
+	if (tccp->roishift) {
+		OPJ_INT32 thresh = 1 << tccp->roishift;
+		for (j = 0; j < cblk_h; ++j) {
+			for (i = 0; i < cblk_w; ++i) {
+				OPJ_INT32 val = datap[(j * cblk_w) + i];
+				OPJ_INT32 mag = abs(val);
+				if (mag >= thresh) {
+					mag >>= tccp->roishift;
+					datap[(j * cblk_w) + i] = val < 0 ? -mag : mag;
+				}
+			}
+		}
+	}
+
+	/*tiledp=(void*)&tilec->data[(y * tile_w) + x];*/
+	if (tccp->qmfbid == 1) {
+	    OPJ_INT32* restrict tiledp = &tilec->data[(OPJ_UINT32)y * tile_w + (OPJ_UINT32)x];
+		for (j = 0; j < cblk_h; ++j) {
+			for (i = 0; i < cblk_w; ++i) {
+				OPJ_INT32 tmp = datap[(j * cblk_w) + i];
+				((OPJ_INT32*)tiledp)[(j * tile_w) + i] = tmp / 2;
+			}
+		}
+	} else {		/* if (tccp->qmfbid == 0) */
+	    OPJ_FLOAT32* restrict tiledp = (OPJ_FLOAT32*) &tilec->data[(OPJ_UINT32)y * tile_w + (OPJ_UINT32)x];
+		for (j = 0; j < cblk_h; ++j) {
+	        OPJ_FLOAT32* restrict tiledp2 = tiledp;
+			for (i = 0; i < cblk_w; ++i) {
+	            OPJ_FLOAT32 tmp = (OPJ_FLOAT32)*datap * band->stepsize;
+	            *tiledp2 = tmp;
+	            datap++;
+	            tiledp2++;
+				/*float tmp = datap[(j * cblk_w) + i] * band->stepsize;
+				((float*)tiledp)[(j * tile_w) + i] = tmp;*/
+
+			}
+	        tiledp += tile_w;
+		}
+	}
+	return OPJ_TRUE;
+}
+
+typedef struct opj_t1_cblk_job {
+	OPJ_UINT32 resno;
+	opj_tcd_band_t* band;
+	opj_tcd_cblk_dec_t* cblk;
+} opj_t1_cblk_job_t;
+
+typedef struct opj_t1_cblk_jobs {
+	opj_tcd_tilecomp_t* tilec;
+	opj_tccp_t* tccp;
+	opj_t1_cblk_job_t* cblks;
+	OPJ_UINT32 count;
+	OPJ_UINT32 jobs;
+	volatile OPJ_BOOL failed;
+} opj_t1_cblk_jobs_t;
+
+/* decodes the index-th share of all code-blocks (with its own T1 handle) */
+static void opj_t1_decode_cblks_job(OPJ_UINT32 index, void* data)
+{
+	opj_t1_cblk_jobs_t* d = (opj_t1_cblk_jobs_t*)data;
+	OPJ_UINT32 i = (OPJ_UINT32)((OPJ_UINT64)d->count * index / d->jobs);
+	OPJ_UINT32 end = (OPJ_UINT32)((OPJ_UINT64)d->count * (index + 1) / d->jobs);
+	opj_t1_t* t1 = opj_t1_create();
+	if (!t1) {
+		d->failed = OPJ_TRUE;
+		return;
+	}
+	for (; i < end && !d->failed; i++) {
+		opj_t1_cblk_job_t* job = &d->cblks[i];
+		if (!opj_t1_decode_cblk_into_tile(t1, d->tilec, d->tccp, job->resno, job->band, job->cblk))
+			d->failed = OPJ_TRUE;
+	}
+	opj_t1_destroy(t1);
+}
+
+/* returns OPJ_FALSE if the code-blocks couldn't be decoded concurrently (and haven't been decoded at all) */
+static OPJ_BOOL opj_t1_decode_cblks_parallel(opj_tcd_tilecomp_t* tilec,
+                                          opj_tccp_t* tccp,
+                                          OPJ_BOOL* ok)
+{
+	OPJ_UINT32 resno, bandno, precno, cblkno;
+	opj_t1_cblk_jobs_t d;
+
+	d.tilec = tilec;
+	d.tccp = tccp;
+	d.count = 0;
+	d.failed = OPJ_FALSE;
+	for (resno = 0; resno < tilec->minimum_num_resolutions; ++resno) {
+		opj_tcd_resolution_t* res = &tilec->resolutions[resno];
+		for (bandno = 0; bandno < res->numbands; ++bandno) {
+			for (precno = 0; precno < res->pw * res->ph; ++precno) {
+				opj_tcd_precinct_t* precinct = &res->bands[bandno].precincts[precno];
+				d.count += precinct->cw * precinct->ch;
+			}
+		}
+	}
+	if (d.count < OPJ_T1_MIN_PARALLEL_CBLKS)
+		return OPJ_FALSE;
+	d.cblks = (opj_t1_cblk_job_t*)opj_malloc(d.count * sizeof(opj_t1_cblk_job_t));
+	if (!d.cblks)
+		return OPJ_FALSE;
+
+	d.count = 0;
+	for (resno = 0; resno < tilec->minimum_num_resolutions; ++resno) {
+		opj_tcd_resolution_t* res = &tilec->resolutions[resno];
+		for (bandno = 0; bandno < res->numbands; ++bandno) {
+			opj_tcd_band_t* band = &res->bands[bandno];
+			for (precno = 0; precno < res->pw * res->ph; ++precno) {
+				opj_tcd_precinct_t* precinct = &band->precincts[precno];
+				for (cblkno = 0; cblkno < precinct->cw * precinct->ch; ++cblkno) {
+					d.cblks[d.count].resno = resno;
+					d.cblks[d.count].band = band;
+					d.cblks[d.count].cblk = &precinct->cblks.dec[cblkno];
+					d.count++;
+				}
+			}
+		}
+	}
+
+	/* at least 4 code-blocks per job */
+	d.jobs = opj_uint_min(d.count / 4, OPJ_T1_MAX_JOBS);
+	opj_job_runner(opj_t1_decode_cblks_job, d.jobs, &d);
+	opj_free(d.cblks);
+	*ok = !d.failed;
+	return OPJ_TRUE;
+}
+
 OPJ_BOOL opj_t1_decode_cblks(   opj_t1_t* t1,
                             opj_tcd_tilecomp_t* tilec,
                             opj_tccp_t* tccp
                             )
 {
 	OPJ_UINT32 resno, bandno, precno, cblkno;
-	OPJ_UINT32 tile_w = (OPJ_UINT32)(tilec->x1 - tilec->x0);
+	OPJ_BOOL ok;
+
+	if (opj_job_runner && opj_t1_decode_cblks_parallel(tilec, tccp, &ok))
+		return ok;
 
 	for (resno = 0; resno < tilec->minimum_num_resolutions; ++resno) {
 		opj_tcd_resolution_t* res = &tilec->resolutions[resno];
@@ -1278,85 +1460,13 @@ OPJ_BOOL opj_t1_decode_cblks(   opj_t1_t* t1,
 				opj_tcd_precinct_t* precinct = &band->precincts[precno];
 
 				for (cblkno = 0; cblkno < precinct->cw * precinct->ch; ++cblkno) {
-					opj_tcd_cblk_dec_t* cblk = &precinct->cblks.dec[cblkno];
-					OPJ_INT32* restrict datap;
-					/*void* restrict tiledp;*/
-					OPJ_UINT32 cblk_w, cblk_h;
-					OPJ_INT32 x, y;
-					OPJ_UINT32 i, j;
-
-                    if (OPJ_FALSE == opj_t1_decode_cblk(
-                                            t1,
-                                            cblk,
-                                            band->bandno,
-                                            (OPJ_UINT32)tccp->roishift,
-                                            tccp->cblksty)) {
-                            return OPJ_FALSE;
-                    }
-
-					x = cblk->x0 - band->x0;
-					y = cblk->y0 - band->y0;
-					if (band->bandno & 1) {
-						opj_tcd_resolution_t* pres = &tilec->resolutions[resno - 1];
-						x += pres->x1 - pres->x0;
-					}
-					if (band->bandno & 2) {
-						opj_tcd_resolution_t* pres = &tilec->resolutions[resno - 1];
-						y += pres->y1 - pres->y0;
-					}
-
-					datap=t1->data;
-					cblk_w = t1->w;
-					cblk_h = t1->h;
-
-					if (tccp->roishift) {
-						OPJ_INT32 thresh = 1 << tccp->roishift;
-						for (j = 0; j < cblk_h; ++j) {
-							for (i = 0; i < cblk_w; ++i) {
-								OPJ_INT32 val = datap[(j * cblk_w) + i];
-								OPJ_INT32 mag = abs(val);
-								if (mag >= thresh) {
-									mag >>= tccp->roishift;
-									datap[(j * cblk_w) + i] = val < 0 ? -mag : mag;
-								}
-							}
-						}
-					}
-
-					/*tiledp=(void*)&tilec->data[(y * tile_w) + x];*/
-					if (tccp->qmfbid == 1) {
-                        OPJ_INT32* restrict tiledp = &tilec->data[(OPJ_UINT32)y * tile_w + (OPJ_UINT32)x];
-						for (j = 0; j < cblk_h; ++j) {
-							for (i = 0; i < cblk_w; ++i) {
-								OPJ_INT32 tmp = datap[(j * cblk_w) + i];
-								((OPJ_INT32*)tiledp)[(j * tile_w) + i] = tmp / 2;
-							}
-						}
-					} else {		/* if (tccp->qmfbid == 0) */
-                        OPJ_FLOAT32* restrict tiledp = (OPJ_FLOAT32*) &tilec->data[(OPJ_UINT32)y * tile_w + (OPJ_UINT32)x];
-						for (j = 0; j < cblk_h; ++j) {
-                            OPJ_FLOAT32* restrict tiledp2 = tiledp;
-							for (i = 0; i < cblk_w; ++i) {
-                                OPJ_FLOAT32 tmp = (OPJ_FLOAT32)*datap * band->stepsize;
-                                *tiledp2 = tmp;
-                                datap++;
-                                tiledp2++;
-								/*float tmp = datap[(j * cblk_w) + i] * band->stepsize;
-								((float*)tiledp)[(j * tile_w) + i] = tmp;*/
-
-							}
-                            tiledp += tile_w;
-						}
-					}
-                    /*opj_free(cblk->data);
-					opj_free(cblk->segs);*/
-					/*cblk->segs = 00;*/
+					if (!opj_t1_decode_cblk_into_tile(t1, tilec, tccp, resno, band, &precinct->cblks.dec[cblkno]))
+						return OPJ_FALSE;
 				} /* cblkno */
-                /*opj_free(precinct->cblks.dec);*/
 			} /* precno */
 		} /* bandno */
 	} /* resno */
-        return OPJ_TRUE;
+	return OPJ_TRUE;
 }
 
 
@@ -61,6 +61,73 @@ local uLong adler32_combine_ OF((uLong adler1, uLong adler2, z_off64_t len2));
 #  define MOD63(a) a %= BASE
 #endif
 
+/* SumatraPDF: sum 16 bytes at a time with SSE2 (used if the CPU supports it) */
+#if (defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))) || defined(__SSE2__)
+#  define ADLER32_SSE2
+#  include <emmintrin.h>
+#  ifdef _MSC_VER
+#    include <intrin.h>
+#  endif
+
+local int adler32_has_sse2()
+{
+#if defined(_M_X64) || defined(__SSE2__)
+    return 1;
+#else
+    static int has_sse2 = -1;
+    if (has_sse2 < 0) {
+        int info[4];
+        __cpuid(info, 1);
+        has_sse2 = (info[3] >> 26) & 1;
+    }
+    return has_sse2;
+#endif
+}
+
+local unsigned long adler32_hsum_sse2(__m128i v)
+{
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return (unsigned long)(unsigned)_mm_cvtsi128_si32(v);
+}
+
+/* adds len bytes (a multiple of 16, at most NMAX) to the sums -- every 16
+   bytes add their sum to adler and 16 * adler plus their sum weighted by
+   16 down to 1 to sum2, so the vector loop only has to keep track of the
+   byte sums, the running total of those and the weighted sums; the caller
+   must still reduce both sums modulo BASE */
+local void adler32_sse2(padler, psum2, buf, len)
+    unsigned long *padler;
+    unsigned long *psum2;
+    const Bytef *buf;
+    unsigned len;
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weights_lo = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+    const __m128i weights_hi = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+    __m128i bytesum = zero, prefixsum = zero, weightedsum = zero;
+    unsigned long adler = *padler, sum2 = *psum2, prefix;
+    unsigned n = len / 16;
+
+    sum2 += (unsigned long)n * 16 * adler;
+    do {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)buf);
+        prefixsum = _mm_add_epi32(prefixsum, bytesum);
+        bytesum = _mm_add_epi32(bytesum, _mm_sad_epu8(bytes, zero));
+        weightedsum = _mm_add_epi32(weightedsum,
+            _mm_madd_epi16(_mm_unpacklo_epi8(bytes, zero), weights_lo));
+        weightedsum = _mm_add_epi32(weightedsum,
+            _mm_madd_epi16(_mm_unpackhi_epi8(bytes, zero), weights_hi));
+        buf += 16;
+    } while (--n);
+
+    prefix = adler32_hsum_sse2(prefixsum);
+    MOD(prefix);                /* 16 * prefix could overflow otherwise */
+    *padler = adler + adler32_hsum_sse2(bytesum);
+    *psum2 = sum2 + 16 * prefix + adler32_hsum_sse2(weightedsum);
+}
+#endif
+
 /* ========================================================================= */
 uLong ZEXPORT adler32(adler, buf, len)
     uLong adler;
@@ -101,6 +168,26 @@ uLong ZEXPORT adler32(adler, buf, len)
         return adler | (sum2 << 16);
     }
 
+#ifdef ADLER32_SSE2
+    if (adler32_has_sse2()) {
+        while (len >= 16) {
+            n = len < NMAX ? len & ~15U : NMAX;
+            adler32_sse2(&adler, &sum2, buf, n);
+            buf += n;
+            len -= n;
+            MOD(adler);
+            MOD(sum2);
+        }
+        while (len--) {
+            adler += *buf++;
+            sum2 += adler;
+        }
+        MOD28(adler);
+        MOD28(sum2);
+        return adler | (sum2 << 16);
+    }
+#endif
+
     /* do length NMAX blocks -- requires just one modulo operation */
     while (len >= NMAX) {
         len -= NMAX;
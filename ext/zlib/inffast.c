@@ -29,6 +29,32 @@
 #  define PUP(a) *++(a)
 #endif
 
+/* SumatraPDF: copy matches with memcpy instead of byte by byte -- matches at
+   least as long as this are copied in chunks, shorter ones are faster to copy
+   bytewise than to hand off to memcpy */
+#define CHUNK_COPY_MIN 16
+
+/* Copy len bytes from dist bytes back in the output to out. If the match
+   overlaps itself (i.e. dist < len, a repeated pattern), the pattern copied
+   so far is doubled until the rest of the match fits into it. Unlike the
+   bytewise loops below, out points to the first byte to write and the
+   pointer past the last written byte is returned. */
+local unsigned char FAR *chunk_copy(out, dist, len)
+unsigned char FAR *out;
+unsigned dist;
+unsigned len;
+{
+    unsigned char FAR *from = out - dist;
+    while (dist < len) {
+        zmemcpy(out, from, dist);
+        out += dist;
+        len -= dist;
+        dist <<= 1;
+    }
+    zmemcpy(out, from, len);
+    return out + len;
+}
+
 /*
    Decode literal, length, and distance codes and write out the resulting
    literal and match bytes until either not enough input or output is
@@ -218,9 +244,8 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
                         from += wsize - op;
                         if (op < len) {         /* some from window */
                             len -= op;
-                            do {
-                                PUP(out) = PUP(from);
-                            } while (--op);
+                            zmemcpy(out + OFF, from + OFF, op);
+                            out += op;
                             from = out - dist;  /* rest from output */
                         }
                     }
@@ -229,16 +254,14 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
                         op -= wnext;
                         if (op < len) {         /* some from end of window */
                             len -= op;
-                            do {
-                                PUP(out) = PUP(from);
-                            } while (--op);
+                            zmemcpy(out + OFF, from + OFF, op);
+                            out += op;
                             from = window - OFF;
                             if (wnext < len) {  /* some from start of window */
                                 op = wnext;
                                 len -= op;
-                                do {
-                                    PUP(out) = PUP(from);
-                                } while (--op);
+                                zmemcpy(out + OFF, from + OFF, op);
+                                out += op;
                                 from = out - dist;      /* rest from output */
                             }
                         }
@@ -247,12 +270,20 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
                         from += wnext - op;
                         if (op < len) {         /* some from window */
                             len -= op;
-                            do {
-                                PUP(out) = PUP(from);
-                            } while (--op);
+                            zmemcpy(out + OFF, from + OFF, op);
+                            out += op;
                             from = out - dist;  /* rest from output */
                         }
                     }
+                    if (len >= CHUNK_COPY_MIN) {
+                        if (from == out - dist)
+                            out = chunk_copy(out + OFF, dist, len) - OFF;
+                        else {
+                            zmemcpy(out + OFF, from + OFF, len);
+                            out += len;
+                        }
+                        continue;
+                    }
                     while (len > 2) {
                         PUP(out) = PUP(from);
                         PUP(out) = PUP(from);
@@ -265,6 +296,9 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
                             PUP(out) = PUP(from);
                     }
                 }
+                else if (len >= CHUNK_COPY_MIN) {
+                    out = chunk_copy(out + OFF, dist, len) - OFF;
+                }
                 else {
                     from = out - dist;          /* copy direct from output */
                     do {                        /* minimum length is three */
@@ -92,6 +92,8 @@ void fz_convert_color(fz_context *ctx, fz_colorspace *dsts, float *dstv, fz_colo
 void fz_new_colorspace_context(fz_context *ctx);
 fz_colorspace_context *fz_keep_colorspace_context(fz_context *ctx);
 void fz_drop_colorspace_context(fz_context *ctx);
+/* SumatraPDF: frees the context's cached color conversion links */
+void fz_drop_color_link_cache(fz_context *ctx);
 
 typedef struct fz_color_converter_s fz_color_converter;
 
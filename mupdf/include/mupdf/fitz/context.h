@@ -14,6 +14,7 @@ typedef struct fz_id_context_s fz_id_context;
 typedef struct fz_warn_context_s fz_warn_context;
 typedef struct fz_font_context_s fz_font_context;
 typedef struct fz_colorspace_context_s fz_colorspace_context;
+typedef struct fz_color_link_cache_s fz_color_link_cache;
 typedef struct fz_aa_context_s fz_aa_context;
 typedef struct fz_locks_context_s fz_locks_context;
 typedef struct fz_store_s fz_store;
@@ -111,6 +112,8 @@ struct fz_context_s
 	fz_warn_context *warn;
 	fz_font_context *font;
 	fz_colorspace_context *colorspace;
+	/* SumatraPDF: not shared between cloned contexts (cf. colorspace.c) */
+	fz_color_link_cache *color_links;
 	fz_aa_context *aa;
 	fz_store *store;
 	fz_glyph_cache *glyph_cache;
@@ -180,6 +183,16 @@ fz_context *fz_new_context_imp(fz_alloc_context *alloc, fz_locks_context *locks,
 */
 fz_context *fz_clone_context(fz_context *ctx);
 
+/*
+	SumatraPDF: fz_clone_context_with_store: Make a clone of an existing
+	context which doesn't share the resource store but has its own one
+	(limited to max_store bytes). Fonts, the glyph cache, the locks and
+	all other global state are shared as for fz_clone_context.
+
+	Does not throw exception, but may return NULL.
+*/
+fz_context *fz_clone_context_with_store(fz_context *ctx, unsigned int max_store);
+
 /*
 	fz_free_context: Free a context and its global state.
 
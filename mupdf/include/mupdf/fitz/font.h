@@ -67,6 +67,15 @@ enum { FZ_ADOBE_CNS_1, FZ_ADOBE_GB_1, FZ_ADOBE_JAPAN_1, FZ_ADOBE_KOREA_1 };
 void fz_new_font_context(fz_context *ctx);
 fz_font_context *fz_keep_font_context(fz_context *ctx);
 void fz_drop_font_context(fz_context *ctx);
+/*
+	SumatraPDF: fz_keep_freetype_library: Keep the FreeType library
+	initialized even while no fonts are loaded (as happens in between
+	documents when a process loads one document after another). The
+	library is released along with the font context.
+
+	Does not throw exceptions, but returns 0 on failure.
+*/
+int fz_keep_freetype_library(fz_context *ctx);
 
 typedef fz_font *(*fz_load_system_font_func)(fz_context *ctx, const char *name, int bold, int italic, int needs_exact_metrics);
 typedef fz_font *(*fz_load_system_cjk_font_func)(fz_context *ctx, const char *name, int ros, int serif);
@@ -18,6 +18,36 @@ fz_glyph_cache *fz_keep_glyph_cache(fz_context *ctx);
 void fz_drop_glyph_cache_context(fz_context *ctx);
 void fz_purge_glyph_cache(fz_context *ctx);
 
+/*
+	SumatraPDF: fz_purge_type3_glyphs: Drop the cached glyphs of all
+	Type 3 fonts belonging to t3doc (and keep all other glyphs).
+*/
+void fz_purge_type3_glyphs(fz_context *ctx, void *t3doc);
+
+/*
+	SumatraPDF: fz_set_glyph_cache_limits: Set the memory budget of the
+	glyph cache (shared by all clones of a context) and the largest
+	glyph size (in pixels) that is still cached. Values <= 0 restore
+	the defaults (1 MB and 256 pixels).
+*/
+void fz_set_glyph_cache_limits(fz_context *ctx, int max_size, int max_glyph_size);
+
+/*
+	SumatraPDF: fz_get_glyph_cache_stats: Retrieve the current size and
+	limits of the glyph cache along with lookup and eviction counters.
+*/
+typedef struct fz_glyph_cache_stats_s
+{
+	unsigned int size;
+	unsigned int max;
+	unsigned int max_glyph_size;
+	unsigned int hits;
+	unsigned int misses;
+	unsigned int evictions;
+} fz_glyph_cache_stats;
+
+void fz_get_glyph_cache_stats(fz_context *ctx, fz_glyph_cache_stats *stats);
+
 fz_path *fz_outline_ft_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *trm);
 fz_path *fz_outline_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *ctm);
 fz_glyph *fz_render_ft_glyph(fz_context *ctx, fz_font *font, int cid, const fz_matrix *trm, int aa);
@@ -81,6 +81,13 @@ struct fz_image_s
 };
 
 fz_pixmap *fz_load_jpx(fz_context *ctx, unsigned char *data, int size, fz_colorspace *cs, int indexed);
+/* SumatraPDF: allow decoding JPX images at a lower resolution */
+fz_pixmap *fz_load_jpx_reduced(fz_context *ctx, unsigned char *data, int size, fz_colorspace *cs, int indexed, int l2factor);
+/* SumatraPDF: allow decoding JPX images on several threads. The runner must call
+   job(i, data) for all i in [0, count) and only return once all jobs have finished. */
+typedef void (fz_jpx_job_fn)(unsigned int index, void *data);
+typedef void (fz_jpx_job_runner)(fz_jpx_job_fn *job, unsigned int count, void *data);
+void fz_set_jpx_job_runner(fz_jpx_job_runner *runner);
 fz_pixmap *fz_load_png(fz_context *ctx, unsigned char *data, int size);
 fz_pixmap *fz_load_tiff(fz_context *ctx, unsigned char *data, int size);
 fz_pixmap *fz_load_jxr(fz_context *ctx, unsigned char *data, int size);
@@ -194,6 +194,27 @@ int fz_store_scavenge(fz_context *ctx, unsigned int size, int *phase);
 */
 int fz_shrink_store(fz_context *ctx, unsigned int percent);
 
+/*
+	SumatraPDF: fz_set_store_max: Change the maximum size of the store,
+	evicting unused items if it is currently larger than that.
+*/
+void fz_set_store_max(fz_context *ctx, unsigned int max);
+
+/*
+	SumatraPDF: fz_get_store_stats: Retrieve the current size and budget
+	of the store along with lookup and eviction counters.
+*/
+typedef struct fz_store_stats_s
+{
+	unsigned int size;
+	unsigned int max;
+	unsigned int hits;
+	unsigned int misses;
+	unsigned int evictions;
+} fz_store_stats;
+
+void fz_get_store_stats(fz_context *ctx, fz_store_stats *stats);
+
 /*
 	fz_print_store: Dump the contents of the store for debugging.
 */
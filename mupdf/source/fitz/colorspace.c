@@ -291,6 +291,100 @@ fz_colorspace_is_indexed(fz_colorspace *cs)
 	return (cs && !strcmp(cs->name, "Indexed"));
 }
 
+/*
+	SumatraPDF: Cache of color conversion links
+
+	Converting a pixmap used to start from scratch for every image (and
+	for each tile an image is drawn into). Instead, each context keeps
+	the colors converted for the most recently used pairs of source and
+	destination colorspace (memoized in a direct mapped table for up to
+	four 8-bit components), so that e.g. the many CMYK images of print
+	ready documents mostly need table lookups. Contexts are only used by
+	a single thread at a time, so the cache doesn't need locking.
+*/
+
+enum { COLOR_LINK_COUNT = 4, COLOR_MEMO_BITS = 12 };
+
+#define COLOR_MEMO_SLOT(key) (((key) * 2654435761U) >> (32 - COLOR_MEMO_BITS))
+
+typedef struct
+{
+	unsigned int key;
+	unsigned char used;
+	unsigned char v[4];
+} fz_color_memo;
+
+typedef struct
+{
+	fz_colorspace *ss, *ds;
+	int last_used;
+	/* for single component sources */
+	int has_lookup;
+	unsigned char lookup[256 * 4];
+	fz_color_memo memo[1 << COLOR_MEMO_BITS];
+} fz_color_link;
+
+struct fz_color_link_cache_s
+{
+	int clock;
+	fz_color_link links[COLOR_LINK_COUNT];
+};
+
+/* returns NULL if the cache couldn't be allocated */
+static fz_color_link *
+fz_find_color_link(fz_context *ctx, fz_colorspace *ds, fz_colorspace *ss)
+{
+	fz_color_link_cache *cache = ctx->color_links;
+	fz_color_link *link;
+	int i;
+
+	if (!cache)
+	{
+		cache = ctx->color_links = fz_calloc_no_throw(ctx, 1, sizeof(fz_color_link_cache));
+		if (!cache)
+			return NULL;
+	}
+
+	link = &cache->links[0];
+	for (i = 0; i < COLOR_LINK_COUNT; i++)
+	{
+		if (cache->links[i].ss == ss && cache->links[i].ds == ds)
+		{
+			link = &cache->links[i];
+			link->last_used = ++cache->clock;
+			return link;
+		}
+		if (cache->links[i].last_used < link->last_used)
+			link = &cache->links[i];
+	}
+
+	/* replace the least recently used link */
+	fz_drop_colorspace(ctx, link->ss);
+	fz_drop_colorspace(ctx, link->ds);
+	memset(link, 0, sizeof(*link));
+	link->ss = fz_keep_colorspace(ctx, ss);
+	link->ds = fz_keep_colorspace(ctx, ds);
+	link->last_used = ++cache->clock;
+	return link;
+}
+
+void
+fz_drop_color_link_cache(fz_context *ctx)
+{
+	fz_color_link_cache *cache = ctx->color_links;
+	int i;
+
+	if (!cache)
+		return;
+	for (i = 0; i < COLOR_LINK_COUNT; i++)
+	{
+		fz_drop_colorspace(ctx, cache->links[i].ss);
+		fz_drop_colorspace(ctx, cache->links[i].ds);
+	}
+	fz_free(ctx, cache);
+	ctx->color_links = NULL;
+}
+
 /* Fast pixmap color conversions */
 
 static void fast_gray_to_rgb(fz_pixmap *dst, fz_pixmap *src)
@@ -606,6 +700,122 @@ fast_cmyk_to_rgb_ARM(unsigned char *dst, unsigned char *src, int n)
 }
 #endif
 
+#ifdef SLOWCMYK
+/* integer version of cmyk_to_rgb for 8-bit components */
+static void
+fast_cmyk_to_rgb_color(unsigned int c, unsigned int m, unsigned int y, unsigned int k, unsigned char *rgb)
+{
+	unsigned int cm, c1m, cm1, c1m1, c1m1y, c1m1y1, c1my, c1my1, cm1y, cm1y1, cmy, cmy1;
+	unsigned int x0, x1, r, g, b;
+
+	if (k == 0 && c == 0 && m == 0 && y == 0)
+	{
+		rgb[0] = rgb[1] = rgb[2] = 255;
+		return;
+	}
+	if (k == 255)
+	{
+		rgb[0] = rgb[1] = rgb[2] = 0;
+		return;
+	}
+
+	c += c>>7;
+	m += m>>7;
+	y += y>>7;
+	k += k>>7;
+	y >>= 1; /* Ditch 1 bit of Y to avoid overflow */
+	cm = c * m;
+	c1m = (m<<8) - cm;
+	cm1 = (c<<8) - cm;
+	c1m1 = ((256 - m)<<8) - cm1;
+	c1m1y = c1m1 * y;
+	c1m1y1 = (c1m1<<7) - c1m1y;
+	c1my = c1m * y;
+	c1my1 = (c1m<<7) - c1my;
+	cm1y = cm1 * y;
+	cm1y1 = (cm1<<7) - cm1y;
+	cmy = cm * y;
+	cmy1 = (cm<<7) - cmy;
+
+	/* this is a matrix multiplication, unrolled for performance */
+	x1 = c1m1y1 * k;	/* 0 0 0 1 */
+	x0 = (c1m1y1<<8) - x1;	/* 0 0 0 0 */
+	x1 = x1>>8;		/* From 23 fractional bits to 15 */
+	r = g = b = x0;
+	r += 35 * x1;	/* 0.1373 */
+	g += 31 * x1;	/* 0.1216 */
+	b += 32 * x1;	/* 0.1255 */
+
+	x1 = c1m1y * k;		/* 0 0 1 1 */
+	x0 = (c1m1y<<8) - x1;	/* 0 0 1 0 */
+	x1 >>= 8;		/* From 23 fractional bits to 15 */
+	r += 28 * x1;	/* 0.1098 */
+	g += 26 * x1;	/* 0.1020 */
+	r += x0;
+	x0 >>= 8;		/* From 23 fractional bits to 15 */
+	g += 243 * x0;	/* 0.9490 */
+
+	x1 = c1my1 * k;		/* 0 1 0 1 */
+	x0 = (c1my1<<8) - x1;	/* 0 1 0 0 */
+	x1 >>= 8;		/* From 23 fractional bits to 15 */
+	x0 >>= 8;		/* From 23 fractional bits to 15 */
+	r += 36 * x1;	/* 0.1412 */
+	r += 237 * x0;	/* 0.9255 */
+	b += 141 * x0;	/* 0.5490 */
+
+	x1 = c1my * k;		/* 0 1 1 1 */
+	x0 = (c1my<<8) - x1;	/* 0 1 1 0 */
+	x1 >>= 8;		/* From 23 fractional bits to 15 */
+	x0 >>= 8;		/* From 23 fractional bits to 15 */
+	r += 34 * x1;	/* 0.1333 */
+	r += 238 * x0;	/* 0.9294 */
+	g += 28 * x0;	/* 0.1098 */
+	b += 36 * x0;	/* 0.1412 */
+
+	x1 = cm1y1 * k;		/* 1 0 0 1 */
+	x0 = (cm1y1<<8) - x1;	/* 1 0 0 0 */
+	x1 >>= 8;		/* From 23 fractional bits to 15 */
+	x0 >>= 8;		/* From 23 fractional bits to 15 */
+	g += 15 * x1;	/* 0.0588 */
+	b += 36 * x1;	/* 0.1412 */
+	g += 174 * x0;	/* 0.6784 */
+	b += 240 * x0;	/* 0.9373 */
+
+	x1 = cm1y * k;		/* 1 0 1 1 */
+	x0 = (cm1y<<8) - x1;	/* 1 0 1 0 */
+	x1 >>= 8;		/* From 23 fractional bits to 15 */
+	x0 >>= 8;		/* From 23 fractional bits to 15 */
+	g += 19 * x1;	/* 0.0745 */
+	g += 167 * x0;	/* 0.6510 */
+	b += 80 * x0;	/* 0.3137 */
+
+	x1 = cmy1 * k;		/* 1 1 0 1 */
+	x0 = (cmy1<<8) - x1;	/* 1 1 0 0 */
+	x1 >>= 8;		/* From 23 fractional bits to 15 */
+	x0 >>= 8;		/* From 23 fractional bits to 15 */
+	b += 2 * x1;	/* 0.0078 */
+	r += 46 * x0;	/* 0.1804 */
+	g += 49 * x0;	/* 0.1922 */
+	b += 147 * x0;	/* 0.5725 */
+
+	x0 = cmy * (256-k);	/* 1 1 1 0 */
+	x0 >>= 8;		/* From 23 fractional bits to 15 */
+	r += 54 * x0;	/* 0.2118 */
+	g += 54 * x0;	/* 0.2119 */
+	b += 57 * x0;	/* 0.2235 */
+
+	r -= (r>>8);
+	g -= (g>>8);
+	b -= (b>>8);
+	r = r>>23;
+	g = g>>23;
+	b = b>>23;
+	rgb[0] = r;
+	rgb[1] = g;
+	rgb[2] = b;
+}
+#endif
+
 static void fast_cmyk_to_rgb(fz_context *ctx, fz_pixmap *dst, fz_pixmap *src)
 {
 	unsigned char *s = src->samples;
@@ -613,153 +823,45 @@ static void fast_cmyk_to_rgb(fz_context *ctx, fz_pixmap *dst, fz_pixmap *src)
 	int n = src->w * src->h;
 #ifdef ARCH_ARM
 	fast_cmyk_to_rgb_ARM(d, s, n);
-#else
-	unsigned int C,M,Y,K,r,g,b;
-
-	C = 0;
-	M = 0;
-	Y = 0;
-	K = 0;
-	r = 255;
-	g = 255;
-	b = 255;
+#elif defined(SLOWCMYK)
+	/* colors are looked up in the context's link for CMYK to RGB first */
+	fz_color_link *link = fz_find_color_link(ctx, dst->colorspace, src->colorspace);
+	unsigned int last = 0;
+	unsigned char rgb[3] = { 255, 255, 255 };
 
 	while (n--)
 	{
-#ifdef SLOWCMYK
-		unsigned int c = s[0];
-		unsigned int m = s[1];
-		unsigned int y = s[2];
-		unsigned int k = s[3];
-		unsigned int cm, c1m, cm1, c1m1, c1m1y, c1m1y1, c1my, c1my1, cm1y, cm1y1, cmy, cmy1;
-		unsigned int x0, x1;
-
-		if (c == C && m == M && y == Y && k == K)
-		{
-			/* Nothing to do */
-		}
-		else if (k == 0 && c == 0 && m == 0 && y == 0)
+		unsigned int key = s[0] | (s[1] << 8) | (s[2] << 16) | ((unsigned int)s[3] << 24);
+		if (key != last)
 		{
-			r = g = b = 255;
-			C = 0;
-			M = 0;
-			Y = 0;
-			K = 0;
-		}
-		else if (k == 255)
-		{
-			r = g = b = 0;
-			C = 0;
-			M = 0;
-			Y = 0;
-			K = 255;
-		}
-		else
-		{
-			c += c>>7;
-			m += m>>7;
-			y += y>>7;
-			k += k>>7;
-			y >>= 1; /* Ditch 1 bit of Y to avoid overflow */
-			cm = c * m;
-			c1m = (m<<8) - cm;
-			cm1 = (c<<8) - cm;
-			c1m1 = ((256 - m)<<8) - cm1;
-			c1m1y = c1m1 * y;
-			c1m1y1 = (c1m1<<7) - c1m1y;
-			c1my = c1m * y;
-			c1my1 = (c1m<<7) - c1my;
-			cm1y = cm1 * y;
-			cm1y1 = (cm1<<7) - cm1y;
-			cmy = cm * y;
-			cmy1 = (cm<<7) - cmy;
-
-			/* this is a matrix multiplication, unrolled for performance */
-			x1 = c1m1y1 * k;	/* 0 0 0 1 */
-			x0 = (c1m1y1<<8) - x1;	/* 0 0 0 0 */
-			x1 = x1>>8;		/* From 23 fractional bits to 15 */
-			r = g = b = x0;
-			r += 35 * x1;	/* 0.1373 */
-			g += 31 * x1;	/* 0.1216 */
-			b += 32 * x1;	/* 0.1255 */
-
-			x1 = c1m1y * k;		/* 0 0 1 1 */
-			x0 = (c1m1y<<8) - x1;	/* 0 0 1 0 */
-			x1 >>= 8;		/* From 23 fractional bits to 15 */
-			r += 28 * x1;	/* 0.1098 */
-			g += 26 * x1;	/* 0.1020 */
-			r += x0;
-			x0 >>= 8;		/* From 23 fractional bits to 15 */
-			g += 243 * x0;	/* 0.9490 */
-
-			x1 = c1my1 * k;		/* 0 1 0 1 */
-			x0 = (c1my1<<8) - x1;	/* 0 1 0 0 */
-			x1 >>= 8;		/* From 23 fractional bits to 15 */
-			x0 >>= 8;		/* From 23 fractional bits to 15 */
-			r += 36 * x1;	/* 0.1412 */
-			r += 237 * x0;	/* 0.9255 */
-			b += 141 * x0;	/* 0.5490 */
-
-			x1 = c1my * k;		/* 0 1 1 1 */
-			x0 = (c1my<<8) - x1;	/* 0 1 1 0 */
-			x1 >>= 8;		/* From 23 fractional bits to 15 */
-			x0 >>= 8;		/* From 23 fractional bits to 15 */
-			r += 34 * x1;	/* 0.1333 */
-			r += 238 * x0;	/* 0.9294 */
-			g += 28 * x0;	/* 0.1098 */
-			b += 36 * x0;	/* 0.1412 */
-
-			x1 = cm1y1 * k;		/* 1 0 0 1 */
-			x0 = (cm1y1<<8) - x1;	/* 1 0 0 0 */
-			x1 >>= 8;		/* From 23 fractional bits to 15 */
-			x0 >>= 8;		/* From 23 fractional bits to 15 */
-			g += 15 * x1;	/* 0.0588 */
-			b += 36 * x1;	/* 0.1412 */
-			g += 174 * x0;	/* 0.6784 */
-			b += 240 * x0;	/* 0.9373 */
-
-			x1 = cm1y * k;		/* 1 0 1 1 */
-			x0 = (cm1y<<8) - x1;	/* 1 0 1 0 */
-			x1 >>= 8;		/* From 23 fractional bits to 15 */
-			x0 >>= 8;		/* From 23 fractional bits to 15 */
-			g += 19 * x1;	/* 0.0745 */
-			g += 167 * x0;	/* 0.6510 */
-			b += 80 * x0;	/* 0.3137 */
-
-			x1 = cmy1 * k;		/* 1 1 0 1 */
-			x0 = (cmy1<<8) - x1;	/* 1 1 0 0 */
-			x1 >>= 8;		/* From 23 fractional bits to 15 */
-			x0 >>= 8;		/* From 23 fractional bits to 15 */
-			b += 2 * x1;	/* 0.0078 */
-			r += 46 * x0;	/* 0.1804 */
-			g += 49 * x0;	/* 0.1922 */
-			b += 147 * x0;	/* 0.5725 */
-
-			x0 = cmy * (256-k);	/* 1 1 1 0 */
-			x0 >>= 8;		/* From 23 fractional bits to 15 */
-			r += 54 * x0;	/* 0.2118 */
-			g += 54 * x0;	/* 0.2119 */
-			b += 57 * x0;	/* 0.2235 */
-
-			r -= (r>>8);
-			g -= (g>>8);
-			b -= (b>>8);
-			r = r>>23;
-			g = g>>23;
-			b = b>>23;
-			C = c;
-			M = m;
-			Y = y;
-			K = k;
+			fz_color_memo *memo = link ? &link->memo[COLOR_MEMO_SLOT(key)] : NULL;
+			if (memo && memo->used && memo->key == key)
+				memcpy(rgb, memo->v, 3);
+			else
+			{
+				fast_cmyk_to_rgb_color(s[0], s[1], s[2], s[3], rgb);
+				if (memo)
+				{
+					memo->key = key;
+					memo->used = 1;
+					memcpy(memo->v, rgb, 3);
+				}
+			}
+			last = key;
 		}
-		d[0] = r;
-		d[1] = g;
-		d[2] = b;
+		d[0] = rgb[0];
+		d[1] = rgb[1];
+		d[2] = rgb[2];
+		d[3] = s[4];
+		s += 5;
+		d += 4;
+	}
 #else
+	while (n--)
+	{
 		d[0] = 255 - (unsigned char)fz_mini(s[0] + s[3], 255);
 		d[1] = 255 - (unsigned char)fz_mini(s[1] + s[3], 255);
 		d[2] = 255 - (unsigned char)fz_mini(s[2] + s[3], 255);
-#endif
 		d[3] = s[4];
 		s += 5;
 		d += 4;
@@ -819,6 +921,7 @@ fz_std_conv_pixmap(fz_context *ctx, fz_pixmap *dst, fz_pixmap *src)
 	int srcn, dstn;
 	int k, i;
 	unsigned int xy;
+	fz_color_link *link = NULL;
 
 	fz_colorspace *ss = src->colorspace;
 	fz_colorspace *ds = dst->colorspace;
@@ -856,6 +959,63 @@ fz_std_conv_pixmap(fz_context *ctx, fz_pixmap *dst, fz_pixmap *src)
 		}
 	}
 
+	/* Look colors up in the context's cached link (and convert them only once) */
+	else if (srcn <= 4 && dstn <= 4 && (link = fz_find_color_link(ctx, ds, ss)) != NULL)
+	{
+		fz_color_converter cc;
+
+		fz_lookup_color_converter(&cc, ctx, ds, ss);
+		if (srcn == 1 && !link->has_lookup)
+		{
+			for (i = 0; i < 256; i++)
+			{
+				srcv[0] = i / 255.0f;
+				cc.convert(&cc, dstv, srcv);
+				for (k = 0; k < dstn; k++)
+					link->lookup[i * dstn + k] = dstv[k] * 255;
+			}
+			link->has_lookup = 1;
+		}
+
+		if (srcn == 1)
+		{
+			for (; xy > 0; xy--)
+			{
+				i = *s++;
+				for (k = 0; k < dstn; k++)
+					*d++ = link->lookup[i * dstn + k];
+				*d++ = *s++;
+			}
+		}
+		else
+		{
+			for (; xy > 0; xy--)
+			{
+				unsigned int key = s[0] | (s[1] << 8);
+				fz_color_memo *memo;
+				if (srcn > 2)
+					key |= s[2] << 16;
+				if (srcn > 3)
+					key |= (unsigned int)s[3] << 24;
+				memo = &link->memo[COLOR_MEMO_SLOT(key)];
+				if (!memo->used || memo->key != key)
+				{
+					for (k = 0; k < srcn; k++)
+						srcv[k] = s[k] / 255.0f;
+					cc.convert(&cc, dstv, srcv);
+					for (k = 0; k < dstn; k++)
+						memo->v[k] = dstv[k] * 255;
+					memo->key = key;
+					memo->used = 1;
+				}
+				memcpy(d, memo->v, dstn);
+				s += srcn;
+				d += dstn;
+				*d++ = *s++;
+			}
+		}
+	}
+
 	/* Brute-force for small images */
 	else if (xy < 256)
 	{
@@ -53,6 +53,7 @@ fz_free_context(fz_context *ctx)
 	fz_drop_glyph_cache_context(ctx);
 	fz_drop_store_context(ctx);
 	fz_free_aa_context(ctx);
+	fz_drop_color_link_cache(ctx);
 	fz_drop_colorspace_context(ctx);
 	fz_drop_font_context(ctx);
 	fz_drop_id_context(ctx);
@@ -203,6 +204,50 @@ fz_clone_context_internal(fz_context *ctx)
 	return new_ctx;
 }
 
+/* SumatraPDF: create a context with its own resource store which shares
+ * everything else (in particular fonts, the glyph cache and the locks) */
+fz_context *
+fz_clone_context_with_store(fz_context *ctx, unsigned int max_store)
+{
+	fz_context *new_ctx;
+
+	/* We cannot safely clone the context without having locking/
+	 * unlocking functions. */
+	if (ctx == NULL || ctx->locks == &fz_locks_default || ctx->alloc == NULL)
+		return NULL;
+
+	new_ctx = new_context_phase1(ctx->alloc, ctx->locks);
+	if (!new_ctx)
+		return NULL;
+
+	/* Inherit AA defaults from old context. */
+	fz_copy_aa_context(new_ctx, ctx);
+
+	fz_try(new_ctx)
+	{
+		fz_new_store_context(new_ctx, max_store);
+	}
+	fz_catch(new_ctx)
+	{
+		fz_free_context(new_ctx);
+		return NULL;
+	}
+
+	/* Keep thread lock checking happy by copying pointers first and locking under new context */
+	new_ctx->glyph_cache = ctx->glyph_cache;
+	new_ctx->glyph_cache = fz_keep_glyph_cache(new_ctx);
+	new_ctx->colorspace = ctx->colorspace;
+	new_ctx->colorspace = fz_keep_colorspace_context(new_ctx);
+	new_ctx->font = ctx->font;
+	new_ctx->font = fz_keep_font_context(new_ctx);
+	new_ctx->id = ctx->id;
+	new_ctx->id = fz_keep_id_context(new_ctx);
+	new_ctx->handler = ctx->handler;
+	new_ctx->handler = fz_keep_document_handler_context(new_ctx);
+
+	return new_ctx;
+}
+
 int
 fz_gen_id(fz_context *ctx)
 {
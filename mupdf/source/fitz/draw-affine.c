@@ -280,6 +280,62 @@ fz_paint_affine_alpha_g2rgb_near(byte *dp, byte *sp, int sw, int sh, int u, int
 
 /* Blend premultiplied source image over destination */
 
+#ifdef FZ_DRAW_SSE2
+
+#include <emmintrin.h>
+
+/* lerp() for 8 16-bit lanes, with signed b - a and unsigned t */
+static inline __m128i
+lerp_sse2(__m128i a, __m128i b, __m128i t)
+{
+	__m128i d = _mm_sub_epi16(b, a);
+	/* _mm_mulhi_epu16 treats negative d as d + 65536, which adds t to the result */
+	__m128i p = _mm_sub_epi16(_mm_mulhi_epu16(d, t), _mm_and_si128(_mm_srai_epi16(d, 15), t));
+	return _mm_add_epi16(a, p);
+}
+
+/* fz_paint_affine_N_lerp for n == 4, interpolating all components of a pixel at once */
+static void
+fz_paint_affine_4_lerp_sse2(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, byte *hp)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i low_byte = _mm_set1_epi16(0xFF);
+
+	while (w--)
+	{
+		int ui = u >> 16;
+		int vi = v >> 16;
+		if (ui >= 0 && ui < sw && vi >= 0 && vi < sh)
+		{
+			byte *a = sample_nearest(sp, sw, sh, 4, ui, vi);
+			byte *b = sample_nearest(sp, sw, sh, 4, ui+1, vi);
+			byte *c = sample_nearest(sp, sw, sh, 4, ui, vi+1);
+			byte *d = sample_nearest(sp, sw, sh, 4, ui+1, vi+1);
+			/* interpolate the rows a-b and c-d at once and then in between them */
+			__m128i ac = _mm_unpacklo_epi32(_mm_cvtsi32_si128(*(int *)a), _mm_cvtsi32_si128(*(int *)c));
+			__m128i bd = _mm_unpacklo_epi32(_mm_cvtsi32_si128(*(int *)b), _mm_cvtsi32_si128(*(int *)d));
+			__m128i rows = lerp_sse2(_mm_unpacklo_epi8(ac, zero), _mm_unpacklo_epi8(bd, zero), _mm_set1_epi16((short)(u & 0xffff)));
+			__m128i x = lerp_sse2(rows, _mm_srli_si128(rows, 8), _mm_set1_epi16((short)(v & 0xffff)));
+			int y = _mm_extract_epi16(x, 3);
+			__m128i t = _mm_set1_epi16((short)(255 - y));
+			/* x + fz_mul255(dp, t), truncated to a byte */
+			__m128i m = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(*(int *)dp), zero), t), _mm_set1_epi16(128));
+			m = _mm_srli_epi16(_mm_add_epi16(m, _mm_srli_epi16(m, 8)), 8);
+			m = _mm_and_si128(_mm_add_epi16(x, m), low_byte);
+			*(int *)dp = _mm_cvtsi128_si32(_mm_packus_epi16(m, m));
+			if (hp)
+				hp[0] = y + fz_mul255(hp[0], 255 - y);
+		}
+		dp += 4;
+		if (hp)
+			hp++;
+		u += fa;
+		v += fb;
+	}
+}
+
+#endif
+
 static inline void
 fz_paint_affine_N_lerp(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, byte *hp)
 {
@@ -709,7 +765,16 @@ fz_paint_affine_lerp(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, i
 		{
 		case 1: fz_paint_affine_N_lerp(dp, sp, sw, sh, u, v, fa, fb, w, 1, hp); break;
 		case 2: fz_paint_affine_N_lerp(dp, sp, sw, sh, u, v, fa, fb, w, 2, hp); break;
-		case 4: fz_paint_affine_N_lerp(dp, sp, sw, sh, u, v, fa, fb, w, 4, hp); break;
+		case 4:
+#ifdef FZ_DRAW_SSE2
+			if (fz_draw_has_sse2())
+			{
+				fz_paint_affine_4_lerp_sse2(dp, sp, sw, sh, u, v, fa, fb, w, hp);
+				break;
+			}
+#endif
+			fz_paint_affine_N_lerp(dp, sp, sw, sh, u, v, fa, fb, w, 4, hp);
+			break;
 		default: fz_paint_affine_N_lerp(dp, sp, sw, sh, u, v, fa, fb, w, n, hp); break;
 		}
 	}
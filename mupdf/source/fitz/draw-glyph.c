@@ -1,8 +1,12 @@
 #include "mupdf/fitz.h"
 #include "draw-imp.h"
 
+/* SumatraPDF: default limits (cf. fz_set_glyph_cache_limits) */
 #define MAX_GLYPH_SIZE 256
 #define MAX_CACHE_SIZE (1024*1024)
+/* SumatraPDF: upper bound for the glyph size limit, as even the largest
+ * cached glyphs should remain cheap to keep around */
+#define MAX_GLYPH_SIZE_LIMIT 2048
 
 #define GLYPH_HASH_LEN 509
 
@@ -34,6 +38,12 @@ struct fz_glyph_cache_s
 {
 	int refs;
 	int total;
+	/* SumatraPDF: configurable limits and lookup counters */
+	int max_size;
+	int max_glyph_size;
+	unsigned int hits;
+	unsigned int misses;
+	unsigned int evictions;
 #ifndef NDEBUG
 	int num_evictions;
 	int evicted;
@@ -51,6 +61,8 @@ fz_new_glyph_cache_context(fz_context *ctx)
 	cache = fz_malloc_struct(ctx, fz_glyph_cache);
 	cache->total = 0;
 	cache->refs = 1;
+	cache->max_size = MAX_CACHE_SIZE;
+	cache->max_glyph_size = MAX_GLYPH_SIZE;
 
 	ctx->glyph_cache = cache;
 }
@@ -104,6 +116,25 @@ fz_purge_glyph_cache(fz_context *ctx)
 	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
 }
 
+/* SumatraPDF: drop only the glyphs of a closing document's Type 3 fonts,
+ * as the glyph cache is shared between documents (cf. pdf_close_document) */
+void
+fz_purge_type3_glyphs(fz_context *ctx, void *t3doc)
+{
+	fz_glyph_cache *cache;
+	fz_glyph_cache_entry *entry, *next;
+
+	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+	cache = ctx->glyph_cache;
+	for (entry = cache->lru_head; entry; entry = next)
+	{
+		next = entry->lru_next;
+		if (entry->key.font->t3doc == t3doc)
+			drop_glyph_cache_entry(ctx, entry);
+	}
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+}
+
 void
 fz_drop_glyph_cache_context(fz_context *ctx)
 {
@@ -130,6 +161,55 @@ fz_keep_glyph_cache(fz_context *ctx)
 	return ctx->glyph_cache;
 }
 
+/* SumatraPDF: allow larger glyphs to be cached for high resolution output */
+static void
+evict_to_size(fz_context *ctx, fz_glyph_cache *cache, int max_size)
+{
+	while (cache->total > max_size && cache->lru_tail)
+	{
+		cache->evictions++;
+#ifndef NDEBUG
+		cache->num_evictions++;
+		cache->evicted += fz_glyph_size(ctx, cache->lru_tail->val);
+#endif
+		drop_glyph_cache_entry(ctx, cache->lru_tail);
+	}
+}
+
+void
+fz_set_glyph_cache_limits(fz_context *ctx, int max_size, int max_glyph_size)
+{
+	fz_glyph_cache *cache = ctx->glyph_cache;
+
+	if (max_size <= 0)
+		max_size = MAX_CACHE_SIZE;
+	if (max_glyph_size <= 0)
+		max_glyph_size = MAX_GLYPH_SIZE;
+	else if (max_glyph_size > MAX_GLYPH_SIZE_LIMIT)
+		max_glyph_size = MAX_GLYPH_SIZE_LIMIT;
+
+	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+	cache->max_size = max_size;
+	cache->max_glyph_size = max_glyph_size;
+	evict_to_size(ctx, cache, max_size);
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+}
+
+void
+fz_get_glyph_cache_stats(fz_context *ctx, fz_glyph_cache_stats *stats)
+{
+	fz_glyph_cache *cache = ctx->glyph_cache;
+
+	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+	stats->size = cache->total;
+	stats->max = cache->max_size;
+	stats->max_glyph_size = cache->max_glyph_size;
+	stats->hits = cache->hits;
+	stats->misses = cache->misses;
+	stats->evictions = cache->evictions;
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+}
+
 float
 fz_subpixel_adjust(fz_matrix *ctm, fz_matrix *subpix_ctm, unsigned char *qe, unsigned char *qf)
 {
@@ -252,14 +332,19 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 	int do_cache, locked, caching;
 	fz_glyph_cache_entry *entry;
 	unsigned hash;
+	int max_glyph_size;
 
 	fz_var(locked);
 	fz_var(caching);
 	fz_var(val);
 
+	cache = ctx->glyph_cache;
+	/* SumatraPDF: only changed by fz_set_glyph_cache_limits between renderings */
+	max_glyph_size = cache->max_glyph_size;
+
 	memset(&key, 0, sizeof key);
 	size = fz_subpixel_adjust(ctm, &subpix_ctm, &key.e, &key.f);
-	if (size <= MAX_GLYPH_SIZE)
+	if (size <= max_glyph_size)
 	{
 		scissor = &fz_infinite_irect;
 		do_cache = 1;
@@ -277,8 +362,6 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 		do_cache = 0;
 	}
 
-	cache = ctx->glyph_cache;
-
 	key.font = font;
 	key.gid = gid;
 	key.a = subpix_ctm.a * 65536;
@@ -296,11 +379,13 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 		{
 			move_to_front(cache, entry);
 			val = fz_keep_glyph(ctx, entry->val);
+			cache->hits++;
 			fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
 			return val;
 		}
 		entry = entry->bucket_next;
 	}
+	cache->misses++;
 
 	locked = 1;
 	caching = 0;
@@ -335,7 +420,7 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 		}
 		if (val && do_cache)
 		{
-			if (val->w < MAX_GLYPH_SIZE && val->h < MAX_GLYPH_SIZE)
+			if (val->w < max_glyph_size && val->h < max_glyph_size)
 			{
 				/* If we throw an exception whilst caching,
 				 * just ignore the exception and carry on. */
@@ -376,15 +461,7 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm, fz_colo
 				cache->lru_head = entry;
 
 				cache->total += fz_glyph_size(ctx, val);
-				while (cache->total > MAX_CACHE_SIZE)
-				{
-#ifndef NDEBUG
-					cache->num_evictions++;
-					cache->evicted += fz_glyph_size(ctx, cache->lru_tail->val);
-#endif
-					drop_glyph_cache_entry(ctx, cache->lru_tail);
-				}
-
+				evict_to_size(ctx, cache, cache->max_size);
 			}
 		}
 unlock_and_return_val:
@@ -415,7 +492,7 @@ fz_render_glyph_pixmap(fz_context *ctx, fz_font *font, int gid, fz_matrix *ctm,
 	fz_matrix subpix_ctm;
 	float size = fz_subpixel_adjust(ctm, &subpix_ctm, &qe, &qf);
 
-	if (size <= MAX_GLYPH_SIZE)
+	if (size <= ctx->glyph_cache->max_glyph_size)
 	{
 		scissor = &fz_infinite_irect;
 	}
@@ -46,4 +46,10 @@ void fz_blend_pixel(unsigned char dp[3], unsigned char bp[3], unsigned char sp[3
 
 void fz_paint_glyph(unsigned char *colorbv, fz_pixmap *dst, unsigned char *dp, fz_glyph *glyph, int w, int h, int skip_x, int skip_y);
 
+/* the most common span painters have SSE2 versions, which are used if the CPU supports them */
+#if (defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))) || defined(__SSE2__)
+#define FZ_DRAW_SSE2
+int fz_draw_has_sse2(void);
+#endif
+
 #endif
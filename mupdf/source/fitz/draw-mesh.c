@@ -155,6 +155,237 @@ fz_paint_triangle(fz_pixmap *pix, float *v[3], int n, const fz_irect *bbox)
 	}
 }
 
+/*
+	The triangles a shading decomposes into (with their vertices already
+	transformed into device space and converted into the destination
+	colorspace) are kept in the store, so that the tiles of a page
+	rendered at the same zoom level don't each have to decode, subdivide
+	and color convert the whole shading again. Only a single mesh is
+	kept per shading, it's replaced whenever the shading is drawn with
+	a different matrix or into a different colorspace.
+*/
+
+/* shadings decomposing into more triangles aren't cached */
+#define MAX_SHADE_MESH_SIZE (8 << 20)
+
+typedef struct shade_mesh_s shade_mesh;
+
+struct shade_mesh_s
+{
+	fz_storable storable;
+	fz_matrix ctm;
+	fz_colorspace *colorspace;
+	int n; /* floats per vertex */
+	int len, cap; /* in triangles */
+	float *v;
+};
+
+typedef struct
+{
+	int refs;
+	fz_shade *shade;
+} shade_mesh_key;
+
+static int
+fz_make_hash_shade_mesh_key(fz_store_hash *hash, void *key_)
+{
+	shade_mesh_key *key = (shade_mesh_key *)key_;
+
+	hash->u.pi.ptr = key->shade;
+	hash->u.pi.i = 0;
+	return 1;
+}
+
+static void *
+fz_keep_shade_mesh_key(fz_context *ctx, void *key_)
+{
+	shade_mesh_key *key = (shade_mesh_key *)key_;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	key->refs++;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	return (void *)key;
+}
+
+static void
+fz_drop_shade_mesh_key(fz_context *ctx, void *key_)
+{
+	shade_mesh_key *key = (shade_mesh_key *)key_;
+	int drop;
+
+	if (key == NULL)
+		return;
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	drop = --key->refs;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (drop == 0)
+	{
+		fz_drop_shade(ctx, key->shade);
+		fz_free(ctx, key);
+	}
+}
+
+static int
+fz_cmp_shade_mesh_key(void *k0_, void *k1_)
+{
+	shade_mesh_key *k0 = (shade_mesh_key *)k0_;
+	shade_mesh_key *k1 = (shade_mesh_key *)k1_;
+
+	return k0->shade == k1->shade;
+}
+
+#ifndef NDEBUG
+static void
+fz_debug_shade_mesh(FILE *out, void *key_)
+{
+	shade_mesh_key *key = (shade_mesh_key *)key_;
+
+	fprintf(out, "(shade mesh %p) ", key->shade);
+}
+#endif
+
+static fz_store_type fz_shade_mesh_store_type =
+{
+	fz_make_hash_shade_mesh_key,
+	fz_keep_shade_mesh_key,
+	fz_drop_shade_mesh_key,
+	fz_cmp_shade_mesh_key,
+#ifndef NDEBUG
+	fz_debug_shade_mesh
+#endif
+};
+
+static void
+fz_free_shade_mesh_imp(fz_context *ctx, fz_storable *storable)
+{
+	shade_mesh *mesh = (shade_mesh *)(void *)storable;
+
+	if (mesh == NULL)
+		return;
+	fz_drop_colorspace(ctx, mesh->colorspace);
+	fz_free(ctx, mesh->v);
+	fz_free(ctx, mesh);
+}
+
+static shade_mesh *
+fz_new_shade_mesh(fz_context *ctx, const fz_matrix *ctm, fz_colorspace *colorspace)
+{
+	shade_mesh *mesh = fz_malloc_struct(ctx, shade_mesh);
+	FZ_INIT_STORABLE(mesh, 1, fz_free_shade_mesh_imp);
+	mesh->ctm = *ctm;
+	mesh->colorspace = fz_keep_colorspace(ctx, colorspace);
+	mesh->n = 2 + colorspace->n;
+	return mesh;
+}
+
+static unsigned int
+fz_shade_mesh_size(shade_mesh *mesh)
+{
+	return sizeof(*mesh) + mesh->cap * 3 * mesh->n * sizeof(float);
+}
+
+/* returns NULL if there's no mesh for drawing shade with ctm into colorspace */
+static shade_mesh *
+fz_find_shade_mesh(fz_context *ctx, fz_shade *shade, const fz_matrix *ctm, fz_colorspace *colorspace)
+{
+	shade_mesh_key key;
+	shade_mesh *mesh;
+
+	key.refs = 1;
+	key.shade = shade;
+	mesh = fz_find_item(ctx, fz_free_shade_mesh_imp, &key, &fz_shade_mesh_store_type);
+	if (mesh && (memcmp(&mesh->ctm, ctm, sizeof(*ctm)) != 0 || mesh->colorspace != colorspace))
+	{
+		fz_drop_storable(ctx, &mesh->storable);
+		mesh = NULL;
+	}
+	return mesh;
+}
+
+/* any failure here just results in the mesh not being cached */
+static void
+fz_store_shade_mesh(fz_context *ctx, fz_shade *shade, shade_mesh *mesh)
+{
+	shade_mesh_key *key = NULL;
+	shade_mesh *existing;
+
+	fz_var(key);
+
+	fz_try(ctx)
+	{
+		key = fz_malloc_struct(ctx, shade_mesh_key);
+		key->refs = 1;
+		key->shade = fz_keep_shade(ctx, shade);
+		/* replace the mesh for a different matrix or colorspace */
+		fz_remove_item(ctx, fz_free_shade_mesh_imp, key, &fz_shade_mesh_store_type);
+		existing = fz_store_item(ctx, key, mesh, fz_shade_mesh_size(mesh), &fz_shade_mesh_store_type);
+		/* a racing thread might have stored a mesh in the meantime */
+		if (existing)
+			fz_drop_storable(ctx, &existing->storable);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_shade_mesh_key(ctx, key);
+	}
+	fz_catch(ctx)
+	{
+		/* Do nothing */
+	}
+}
+
+static void
+fz_paint_shade_mesh(fz_pixmap *dest, shade_mesh *mesh, const fz_irect *bbox)
+{
+	float *vertices[3];
+	float *v = mesh->v;
+	int i;
+
+	for (i = 0; i < mesh->len; i++)
+	{
+		vertices[0] = v;
+		vertices[1] = v + mesh->n;
+		vertices[2] = v + 2 * mesh->n;
+		fz_paint_triangle(dest, vertices, mesh->n, bbox);
+		v += 3 * mesh->n;
+	}
+}
+
+/* stops recording (and drops the triangles) if the mesh grows too large */
+static void
+fz_record_shade_mesh(fz_context *ctx, shade_mesh *mesh, float *vertices[3])
+{
+	float *v;
+	int i;
+
+	if (mesh->len < 0)
+		return;
+	if (mesh->len == mesh->cap)
+	{
+		int cap = mesh->cap ? mesh->cap * 2 : 64;
+		if ((unsigned int)cap * 3 * mesh->n * sizeof(float) > MAX_SHADE_MESH_SIZE)
+			v = NULL;
+		else
+			v = fz_resize_array_no_throw(ctx, mesh->v, cap * 3 * mesh->n, sizeof(float));
+		if (!v)
+		{
+			fz_free(ctx, mesh->v);
+			mesh->v = NULL;
+			mesh->len = mesh->cap = -1;
+			return;
+		}
+		mesh->v = v;
+		mesh->cap = cap;
+	}
+	v = mesh->v + mesh->len * 3 * mesh->n;
+	for (i = 0; i < 3; i++)
+	{
+		memcpy(v, vertices[i], mesh->n * sizeof(float));
+		v += mesh->n;
+	}
+	mesh->len++;
+}
+
 struct paint_tri_data
 {
 	fz_context *ctx;
@@ -162,6 +393,7 @@ struct paint_tri_data
 	fz_pixmap *dest;
 	const fz_irect *bbox;
 	fz_color_converter cc;
+	shade_mesh *mesh;
 };
 
 static void
@@ -196,6 +428,8 @@ do_paint_tri(void *arg, fz_vertex *av, fz_vertex *bv, fz_vertex *cv)
 
 	dest = ptd->dest;
 	fz_paint_triangle(dest, vertices, 2 + dest->colorspace->n, ptd->bbox);
+	if (ptd->mesh)
+		fz_record_shade_mesh(ptd->ctx, ptd->mesh, vertices);
 }
 
 void
@@ -208,9 +442,12 @@ fz_paint_shade(fz_context *ctx, fz_shade *shade, const fz_matrix *ctm, fz_pixmap
 	struct paint_tri_data ptd = { 0 };
 	int i, k;
 	fz_matrix local_ctm;
+	shade_mesh *mesh = NULL;
 
 	fz_var(temp);
 	fz_var(conv);
+	fz_var(mesh);
+	fz_var(ptd.mesh);
 
 	fz_try(ctx)
 	{
@@ -241,8 +478,17 @@ fz_paint_shade(fz_context *ctx, fz_shade *shade, const fz_matrix *ctm, fz_pixmap
 		ptd.shade = shade;
 		ptd.bbox = bbox;
 
-		fz_init_cached_color_converter(ctx, &ptd.cc, temp->colorspace, shade->colorspace);
-		fz_process_mesh(ctx, shade, &local_ctm, &prepare_vertex, &do_paint_tri, &ptd);
+		mesh = fz_find_shade_mesh(ctx, shade, &local_ctm, temp->colorspace);
+		if (mesh)
+			fz_paint_shade_mesh(temp, mesh, bbox);
+		else
+		{
+			ptd.mesh = fz_new_shade_mesh(ctx, &local_ctm, temp->colorspace);
+			fz_init_cached_color_converter(ctx, &ptd.cc, temp->colorspace, shade->colorspace);
+			fz_process_mesh(ctx, shade, &local_ctm, &prepare_vertex, &do_paint_tri, &ptd);
+			if (ptd.mesh->len > 0)
+				fz_store_shade_mesh(ctx, shade, ptd.mesh);
+		}
 
 		if (shade->use_function)
 		{
@@ -265,6 +511,10 @@ fz_paint_shade(fz_context *ctx, fz_shade *shade, const fz_matrix *ctm, fz_pixmap
 	fz_always(ctx)
 	{
 		fz_fin_cached_color_converter(&ptd.cc);
+		if (mesh)
+			fz_drop_storable(ctx, &mesh->storable);
+		if (ptd.mesh)
+			fz_drop_storable(ctx, &ptd.mesh->storable);
 	}
 	fz_catch(ctx)
 	{
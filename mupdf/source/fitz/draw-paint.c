@@ -73,6 +73,168 @@ and stick to using the premultiplied form.
 
 typedef unsigned char byte;
 
+#ifdef FZ_DRAW_SSE2
+
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+int
+fz_draw_has_sse2(void)
+{
+#if defined(_M_X64) || defined(__SSE2__)
+	return 1;
+#else
+	static int has_sse2 = -1;
+	if (has_sse2 < 0)
+	{
+		int info[4];
+		__cpuid(info, 1);
+		has_sse2 = (info[3] >> 26) & 1;
+	}
+	return has_sse2;
+#endif
+}
+
+/*
+The SSE2 painters below handle 4 RGBA pixels at a time (with each
+component expanded to 16 bits) and return the number of pixels they've
+painted, so that the scalar code can finish the span. They produce the
+exact same results as the scalar code.
+*/
+
+/* FZ_BLEND(c, d, ma) for ma in 0..256, i.e. (d * (256 - ma) + c * ma) >> 8 */
+static inline __m128i
+fz_blend_sse2(__m128i c, __m128i d, __m128i ma)
+{
+	__m128i dm = _mm_mullo_epi16(d, _mm_sub_epi16(_mm_set1_epi16(256), ma));
+	return _mm_srli_epi16(_mm_add_epi16(dm, _mm_mullo_epi16(c, ma)), 8);
+}
+
+/* expands the 16-bit amounts for 4 pixels (in the lower half of m) to all components of the low and high 2 pixels */
+static inline void
+fz_spread_alpha_sse2(__m128i m, __m128i *lo, __m128i *hi)
+{
+	m = _mm_unpacklo_epi16(m, m);
+	*lo = _mm_unpacklo_epi32(m, m);
+	*hi = _mm_unpackhi_epi32(m, m);
+}
+
+static int
+fz_paint_solid_color_4_sse2(byte * restrict dp, int w, unsigned int rgba, int sa)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i c = _mm_unpacklo_epi8(_mm_set1_epi32((int)rgba), zero);
+	__m128i ma = _mm_set1_epi16((short)sa);
+	int i;
+
+	for (i = 0; i + 4 <= w; i += 4, dp += 16)
+	{
+		__m128i d = _mm_loadu_si128((__m128i *)dp);
+		__m128i lo = fz_blend_sse2(c, _mm_unpacklo_epi8(d, zero), ma);
+		__m128i hi = fz_blend_sse2(c, _mm_unpackhi_epi8(d, zero), ma);
+		_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(lo, hi));
+	}
+	return i;
+}
+
+static int
+fz_paint_span_with_color_4_sse2(byte * restrict dp, byte * restrict mp, int w, unsigned int rgba, int sa)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i c = _mm_unpacklo_epi8(_mm_set1_epi32((int)rgba), zero);
+	__m128i sa16 = _mm_set1_epi16((short)sa);
+	int i;
+
+	for (i = 0; i + 4 <= w; i += 4, dp += 16, mp += 4)
+	{
+		__m128i m, mlo, mhi, d, lo, hi;
+		unsigned int m4 = *(unsigned int *)mp;
+		if (m4 == 0)
+			continue;
+		if (m4 == 0xFFFFFFFF && sa == 256)
+		{
+			_mm_storeu_si128((__m128i *)dp, _mm_set1_epi32((int)rgba));
+			continue;
+		}
+		m = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)m4), zero);
+		m = _mm_add_epi16(m, _mm_srli_epi16(m, 7));
+		if (sa != 256)
+			m = _mm_srli_epi16(_mm_mullo_epi16(m, sa16), 8);
+		fz_spread_alpha_sse2(m, &mlo, &mhi);
+		d = _mm_loadu_si128((__m128i *)dp);
+		lo = fz_blend_sse2(c, _mm_unpacklo_epi8(d, zero), mlo);
+		hi = fz_blend_sse2(c, _mm_unpackhi_epi8(d, zero), mhi);
+		_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(lo, hi));
+	}
+	return i;
+}
+
+static int
+fz_paint_span_4_sse2(byte * restrict dp, byte * restrict sp, int w)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i low_byte = _mm_set1_epi16(0xFF);
+	int i;
+
+	for (i = 0; i + 4 <= w; i += 4, dp += 16, sp += 16)
+	{
+		__m128i s = _mm_loadu_si128((__m128i *)sp);
+		__m128i sa = _mm_srli_epi32(s, 24);
+		__m128i transparent = _mm_cmpeq_epi32(sa, zero);
+		__m128i t, tlo, thi, d, lo, hi, res;
+		int opaque = _mm_movemask_epi8(_mm_cmpeq_epi32(sa, _mm_set1_epi32(0xFF)));
+		if (_mm_movemask_epi8(transparent) == 0xFFFF)
+			continue;
+		if (opaque == 0xFFFF)
+		{
+			_mm_storeu_si128((__m128i *)dp, s);
+			continue;
+		}
+		/* t = 256 - FZ_EXPAND(sa) */
+		t = _mm_packs_epi32(sa, zero);
+		t = _mm_sub_epi16(_mm_set1_epi16(256), _mm_add_epi16(t, _mm_srli_epi16(t, 7)));
+		fz_spread_alpha_sse2(t, &tlo, &thi);
+		d = _mm_loadu_si128((__m128i *)dp);
+		/* sp + FZ_COMBINE(dp, t), truncated to a byte */
+		lo = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), tlo), 8);
+		hi = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), thi), 8);
+		lo = _mm_and_si128(_mm_add_epi16(lo, _mm_unpacklo_epi8(s, zero)), low_byte);
+		hi = _mm_and_si128(_mm_add_epi16(hi, _mm_unpackhi_epi8(s, zero)), low_byte);
+		res = _mm_packus_epi16(lo, hi);
+		/* fully transparent source pixels leave the destination untouched */
+		res = _mm_or_si128(_mm_and_si128(transparent, d), _mm_andnot_si128(transparent, res));
+		_mm_storeu_si128((__m128i *)dp, res);
+	}
+	return i;
+}
+
+static int
+fz_paint_span_4_with_alpha_sse2(byte * restrict dp, byte * restrict sp, int w, int alpha)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i alpha16 = _mm_set1_epi16((short)alpha);
+	int i;
+
+	for (i = 0; i + 4 <= w; i += 4, dp += 16, sp += 16)
+	{
+		__m128i s = _mm_loadu_si128((__m128i *)sp);
+		__m128i d = _mm_loadu_si128((__m128i *)dp);
+		__m128i masa, mlo, mhi, lo, hi;
+		/* masa = FZ_COMBINE(sa, alpha) */
+		masa = _mm_packs_epi32(_mm_srli_epi32(s, 24), zero);
+		masa = _mm_srli_epi16(_mm_mullo_epi16(masa, alpha16), 8);
+		fz_spread_alpha_sse2(masa, &mlo, &mhi);
+		lo = fz_blend_sse2(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero), mlo);
+		hi = fz_blend_sse2(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero), mhi);
+		_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(lo, hi));
+	}
+	return i;
+}
+
+#endif
+
 /* These are used by the non-aa scan converter */
 
 void
@@ -142,6 +304,14 @@ fz_paint_solid_color_4(byte * restrict dp, int w, byte *color)
 		unsigned int mask = 0xFF00FF00;
 		unsigned int rb = rgba & (mask>>8);
 		unsigned int ga = (rgba & mask)>>8;
+#ifdef FZ_DRAW_SSE2
+		if (fz_draw_has_sse2())
+		{
+			int done = fz_paint_solid_color_4_sse2(dp, w, rgba, sa);
+			dp += done * 4;
+			w -= done;
+		}
+#endif
 		while (w--)
 		{
 			unsigned int RGBA = *(unsigned int *)dp;
@@ -262,6 +432,15 @@ fz_paint_span_with_color_4(byte * restrict dp, byte * restrict mp, int w, byte *
 	mask = 0xFF00FF00;
 	rb = rgba & (mask>>8);
 	ga = (rgba & mask)>>8;
+#ifdef FZ_DRAW_SSE2
+	if (fz_draw_has_sse2())
+	{
+		int done = fz_paint_span_with_color_4_sse2(dp, mp, w, rgba, sa);
+		dp += done * 4;
+		mp += done;
+		w -= done;
+	}
+#endif
 	if (sa == 256)
 	{
 		while (w--)
@@ -546,6 +725,15 @@ static inline void
 fz_paint_span_4_with_alpha(byte * restrict dp, byte * restrict sp, int w, int alpha)
 {
 	alpha = FZ_EXPAND(alpha);
+#ifdef FZ_DRAW_SSE2
+	if (fz_draw_has_sse2())
+	{
+		int done = fz_paint_span_4_with_alpha_sse2(dp, sp, w, alpha);
+		dp += done * 4;
+		sp += done * 4;
+		w -= done;
+	}
+#endif
 	while (w--)
 	{
 		int masa = FZ_COMBINE(sp[3], alpha);
@@ -621,6 +809,15 @@ fz_paint_span_2(byte * restrict dp, byte * restrict sp, int w)
 static inline void
 fz_paint_span_4(byte * restrict dp, byte * restrict sp, int w)
 {
+#ifdef FZ_DRAW_SSE2
+	if (fz_draw_has_sse2())
+	{
+		int done = fz_paint_span_4_sse2(dp, sp, w);
+		dp += done * 4;
+		sp += done * 4;
+		w -= done;
+	}
+#endif
 	while (w--)
 	{
 		int t = FZ_EXPAND(sp[3]);
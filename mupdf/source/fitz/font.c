@@ -193,6 +193,7 @@ struct fz_font_context_s {
 	int ctx_refs;
 	FT_Library ftlib;
 	int ftlib_refs;
+	int ftlib_kept; /* SumatraPDF: cf. fz_keep_freetype_library */
 	fz_load_system_font_func load_font;
 	fz_load_system_cjk_font_func load_cjk_font;
 };
@@ -214,6 +215,7 @@ void fz_new_font_context(fz_context *ctx)
 	ctx->font->ctx_refs = 1;
 	ctx->font->ftlib = NULL;
 	ctx->font->ftlib_refs = 0;
+	ctx->font->ftlib_kept = 0;
 	ctx->font->load_font = NULL;
 }
 
@@ -237,7 +239,12 @@ void fz_drop_font_context(fz_context *ctx)
 	drop = --ctx->font->ctx_refs;
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 	if (drop == 0)
+	{
+		/* SumatraPDF: cf. fz_keep_freetype_library */
+		if (ctx->font->ftlib_kept && --ctx->font->ftlib_refs == 0)
+			FT_Done_FreeType(ctx->font->ftlib);
 		fz_free(ctx, ctx->font);
+	}
 }
 
 void fz_install_load_system_font_funcs(fz_context *ctx, fz_load_system_font_func f, fz_load_system_cjk_font_func f_cjk)
@@ -354,6 +361,43 @@ fz_drop_freetype(fz_context *ctx)
 	fz_unlock(ctx, FZ_LOCK_FREETYPE);
 }
 
+/* SumatraPDF: keep FreeType loaded across documents */
+int
+fz_keep_freetype_library(fz_context *ctx)
+{
+	fz_font_context *fct = ctx->font;
+	int kept = 0;
+
+	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	if (fct->ftlib_kept)
+		kept = 1;
+	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+	if (kept)
+		return 1;
+
+	fz_try(ctx)
+	{
+		fz_keep_freetype(ctx);
+		kept = 1;
+	}
+	fz_catch(ctx)
+	{
+		fz_warn(ctx, "cannot keep freetype loaded");
+	}
+	if (!kept)
+		return 0;
+
+	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	if (fct->ftlib_kept)
+		kept = 2;
+	fct->ftlib_kept = 1;
+	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+	/* another thread might have been quicker */
+	if (kept == 2)
+		fz_drop_freetype(ctx);
+	return 1;
+}
+
 /* SumatraPDF: some Chinese fonts seem to wrongly use pre-devided units */
 static void
 fz_check_font_dimensions(FT_Face face)
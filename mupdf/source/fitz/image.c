@@ -377,6 +377,24 @@ fz_image_get_pixmap(fz_context *ctx, fz_image *image, int w, int h)
 	case FZ_IMAGE_JXR:
 		tile = fz_load_jxr(ctx, image->buffer->buffer->data, image->buffer->buffer->len);
 		break;
+	/* SumatraPDF: decode JPX images only at the resolution needed (cf. pdf_load_jpx) */
+	case FZ_IMAGE_JPX:
+		tile = NULL;
+		while (!tile)
+		{
+			fz_try(ctx)
+			{
+				tile = fz_load_jpx_reduced(ctx, image->buffer->buffer->data, image->buffer->buffer->len, image->colorspace, 0, l2factor);
+			}
+			fz_catch(ctx)
+			{
+				/* the image might have fewer resolution levels than requested */
+				if (l2factor == 0)
+					fz_rethrow(ctx);
+				l2factor--;
+			}
+		}
+		break;
 	case FZ_IMAGE_JPEG:
 		/* Scan JPEG stream and patch missing height values in header */
 		{
@@ -79,8 +79,23 @@ static inline unsigned int read_value(const unsigned char *data, int bytes)
 	return value;
 }
 
+/* SumatraPDF: allow decoding code-blocks on several threads */
+void
+fz_set_jpx_job_runner(fz_jpx_job_runner *runner)
+{
+	opj_set_job_runner((opj_run_jobs_fn)runner);
+}
+
 fz_pixmap *
 fz_load_jpx(fz_context *ctx, unsigned char *data, int size, fz_colorspace *defcs, int indexed)
+{
+	return fz_load_jpx_reduced(ctx, data, size, defcs, indexed, 0);
+}
+
+/* SumatraPDF: allow decoding at a lower resolution (throws if
+   l2factor is larger than the number of available resolutions) */
+fz_pixmap *
+fz_load_jpx_reduced(fz_context *ctx, unsigned char *data, int size, fz_colorspace *defcs, int indexed, int l2factor)
 {
 	fz_pixmap *img;
 	opj_dparameters_t params;
@@ -106,6 +121,7 @@ fz_load_jpx(fz_context *ctx, unsigned char *data, int size, fz_colorspace *defcs
 	opj_set_default_decoder_parameters(&params);
 	if (indexed)
 		params.flags |= OPJ_DPARAMETERS_IGNORE_PCLR_CMAP_CDEF_FLAG;
+	params.cp_reduce = l2factor;
 
 	codec = opj_create_decompress(format);
 	opj_set_info_handler(codec, fz_opj_info_callback, ctx);
@@ -29,6 +29,11 @@ struct fz_store_s
 	/* We keep track of the size of the store, and keep it below max. */
 	unsigned int max;
 	unsigned int size;
+
+	/* SumatraPDF: statistics for diagnostics */
+	unsigned int hits;
+	unsigned int misses;
+	unsigned int evictions;
 };
 
 void
@@ -50,6 +55,9 @@ fz_new_store_context(fz_context *ctx, unsigned int max)
 	store->tail = NULL;
 	store->size = 0;
 	store->max = max;
+	store->hits = 0;
+	store->misses = 0;
+	store->evictions = 0;
 	ctx->store = store;
 }
 
@@ -98,6 +106,7 @@ evict(fz_context *ctx, fz_item *item)
 	int drop;
 
 	store->size -= item->size;
+	store->evictions++;
 	/* Unlink from the linked list */
 	if (item->next)
 		item->next->prev = item->prev;
@@ -391,9 +400,11 @@ fz_find_item(fz_context *ctx, fz_store_free_fn *free, void *key, fz_store_type *
 		/* And bump the refcount before returning */
 		if (item->val->refs > 0)
 			item->val->refs++;
+		store->hits++;
 		fz_unlock(ctx, FZ_LOCK_ALLOC);
 		return (void *)item->val;
 	}
+	store->misses++;
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 
 	return NULL;
@@ -672,3 +683,43 @@ fz_shrink_store(fz_context *ctx, unsigned int percent)
 	return success;
 }
 
+
+/* SumatraPDF: allow adjusting the store's budget and reading its statistics */
+void
+fz_set_store_max(fz_context *ctx, unsigned int max)
+{
+	fz_store *store;
+
+	if (ctx == NULL)
+		return;
+	store = ctx->store;
+	if (store == NULL)
+		return;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	store->max = max;
+	if (max != FZ_STORE_UNLIMITED && store->size > max)
+		scavenge(ctx, store->size - max);
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+}
+
+void
+fz_get_store_stats(fz_context *ctx, fz_store_stats *stats)
+{
+	fz_store *store;
+
+	memset(stats, 0, sizeof(*stats));
+	if (ctx == NULL)
+		return;
+	store = ctx->store;
+	if (store == NULL)
+		return;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	stats->size = store->size;
+	stats->max = store->max;
+	stats->hits = store->hits;
+	stats->misses = store->misses;
+	stats->evictions = store->evictions;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+}
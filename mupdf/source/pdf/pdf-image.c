@@ -213,11 +213,15 @@ pdf_load_jpx(pdf_document *doc, pdf_obj *dict, int forcemask)
 	fz_context *ctx = doc->ctx;
 	int indexed = 0;
 	fz_image *mask = NULL;
+	/* SumatraPDF: decode JPX images on demand */
+	fz_compressed_buffer *cbuf = NULL;
+	int w, h;
 
 	fz_var(img);
 	fz_var(buf);
 	fz_var(colorspace);
 	fz_var(mask);
+	fz_var(cbuf);
 
 	buf = pdf_load_stream(doc, pdf_to_num(dict), pdf_to_gen(dict));
 
@@ -231,7 +235,21 @@ pdf_load_jpx(pdf_document *doc, pdf_obj *dict, int forcemask)
 			indexed = fz_colorspace_is_indexed(colorspace);
 		}
 
-		img = fz_load_jpx(ctx, buf->data, buf->len, colorspace, indexed);
+		/* SumatraPDF: delay decoding so that images can be decoded at a reduced
+		   resolution when drawn zoomed out (cf. fz_image_get_pixmap); images
+		   without a /ColorSpace would be drawn as image masks, though */
+		w = pdf_to_int(pdf_dict_getsa(dict, "Width", "W"));
+		h = pdf_to_int(pdf_dict_getsa(dict, "Height", "H"));
+		if (!forcemask && colorspace && !indexed && !pdf_dict_getsa(dict, "Decode", "D") && w > 0 && h > 0)
+		{
+			cbuf = fz_malloc_struct(ctx, fz_compressed_buffer);
+			cbuf->params.type = FZ_IMAGE_JPX;
+			cbuf->buffer = fz_keep_buffer(ctx, buf);
+			/* the image takes over this reference */
+			fz_keep_colorspace(ctx, colorspace);
+		}
+		else
+			img = fz_load_jpx(ctx, buf->data, buf->len, colorspace, indexed);
 
 		obj = pdf_dict_getsa(dict, "SMask", "Mask");
 		if (pdf_is_dict(obj))
@@ -243,7 +261,7 @@ pdf_load_jpx(pdf_document *doc, pdf_obj *dict, int forcemask)
 		}
 
 		obj = pdf_dict_getsa(dict, "Decode", "D");
-		if (obj && !indexed)
+		if (obj && !indexed && img)
 		{
 			float decode[FZ_MAX_COLORS * 2];
 			int i;
@@ -262,9 +280,16 @@ pdf_load_jpx(pdf_document *doc, pdf_obj *dict, int forcemask)
 	fz_catch(ctx)
 	{
 		fz_drop_pixmap(ctx, img);
+		if (cbuf)
+		{
+			fz_free_compressed_buffer(ctx, cbuf);
+			fz_drop_colorspace(ctx, colorspace);
+		}
 		fz_rethrow(ctx);
 	}
 
+	if (cbuf)
+		return fz_new_image(ctx, w, h, 8, colorspace, 96, 96, 0, 0, NULL, NULL, cbuf, mask);
 	return fz_new_image_from_pixmap(ctx, img, mask);
 }
 
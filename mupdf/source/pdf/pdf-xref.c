@@ -1487,9 +1487,10 @@ pdf_close_document(pdf_document *doc)
 	ctx = doc->ctx;
 
 	/* Type3 glyphs in the glyph cache can contain pdf_obj pointers
-	 * that we are about to destroy. Simplest solution is to bin the
-	 * glyph cache at this point. */
-	fz_purge_glyph_cache(ctx);
+	 * that we are about to destroy. */
+	/* SumatraPDF: the glyph cache is shared by all documents, so only
+	 * bin this document's Type3 glyphs instead of the entire cache */
+	fz_purge_type3_glyphs(ctx, doc);
 
 	if (doc->js)
 		doc->drop_js(doc->js);
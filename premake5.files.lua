@@ -400,6 +400,7 @@ function sumatra_files()
     "PagesLayoutDef.*",
     "ParseCommandLine.*",
     "PdfSync.*",
+    "PerfStats.*",
     "Print.*",
     "RenderCache.*",
     "Search.*",
@@ -452,6 +453,7 @@ function utils_files()
     "Dict.*",
     "DirIter.*",
     "Dpi.*",
+    "EtwTrace.*",
     "FileTransactions.*",
     "FileUtil.*",
     "FileWatcher.*",
@@ -792,6 +794,12 @@ function test_util_files()
   })
 end
 
+function bench_util_files()
+  files_in_dir("src", {
+    "tools/bench_util.cpp",
+  })
+end
+
 function engine_dump_files()
   files_in_dir("src", {
     "EngineDump.cpp",
@@ -182,6 +182,7 @@ workspace "SumatraPDF"
     kind "StaticLib"
     language "C"
     disablewarnings { "4204", "4244", "4057" }
+    defines { "WEBP_USE_THREAD" }
     includedirs { "ext/libwebp" }
     libwebp_files()
 
@@ -405,6 +406,16 @@ workspace "SumatraPDF"
     }
 
 
+  project "bench_util"
+    kind "ConsoleApp"
+    language "C++"
+    disablewarnings { "4838" }
+    includedirs { "src", "src/utils" }
+    bench_util_files()
+    links { "engines", "utils", "mupdf", "unarrlib", "libwebp", "libdjvu" }
+    links { "comctl32", "gdiplus", "shlwapi", "version", "windowscodecs" }
+
+
   project "unarr"
     kind "ConsoleApp"
     language "C"
@@ -590,5 +601,6 @@ workspace "SumatraPDF"
     dependson {
       "PdfPreview", "PdfFilter", "SumatraPDF", "SumatraPDF-no-MUPDF",
       "test_util", "cmapdump", "signfile", "plugin-test", "MakeLZSA",
-      "mutool", "mudraw", "Uninstaller", "enginedump", "efi", "unarr"
+      "mutool", "mudraw", "Uninstaller", "enginedump", "efi", "unarr",
+      "bench_util"
     }
@@ -126,8 +126,8 @@ def createFastSelector(fullList, nameList, funcName, type):
 List_HTML_Tags = "a abbr acronym area audio b base basefont blockquote body br center code col dd div dl dt em font frame h1 h2 h3 h4 h5 h6 head hr html i img input lh li link meta nav object ol p param pre s script section small span strike strong style sub sup table td th title tr tt u ul video"
 List_Other_Tags = "image mbp:pagebreak pagebreak subtitle svg svg:image"
 List_Align_Values = "center justify left right"
-# TODO: this incomplete list is currently unused
-List_HTML_Attrs = "align bgcolor border class clear colspan color controls face height href id lang link rowspan size style title valign value vlink width"
+# attributes which are looked up with HtmlToken::GetAttr (instead of by name)
+List_HTML_Attrs = "align alt bgcolor border class clear colspan color content controls dir face height hidden href http-equiv id lang link name rel rowspan size src style title type valign value vlink width"
 List_Other_Attrs = "filepos mediarecindex recindex xmlns"
 
 # these tags must all also appear in List_HTML_Tags or List_Other_Tags (else they're ignored)
@@ -183,10 +183,12 @@ Template_Lookup_Header = """\
 // This file is auto-generated by gen_htmlparserlookup.py
 
 %(enum_htmltag)s
+%(enum_htmlattr)s
 %(enum_alignattr)s
 HtmlTag         FindHtmlTag(const char *name, size_t len);
 bool            IsTagSelfClosing(HtmlTag item);
 bool            IsInlineTag(HtmlTag item);
+HtmlAttrId      FindHtmlAttr(const char *name, size_t len);
 AlignAttr       FindAlignAttr(const char *name, size_t len);
 uint32_t        FindHtmlEntityRune(const char *name, size_t len);
 
@@ -207,6 +209,7 @@ Template_Lookup_Code = """\
 %(code_htmltag)s
 %(code_selfclosing)s
 %(code_inlinetag)s
+%(code_htmlattr)s
 %(code_alignattr)s
 %(code_htmlentity)s
 %(code_cssprop)s
@@ -222,13 +225,13 @@ def main():
 	cssColors = [(name, "MKRGB(%s)" % value) for (name, value) in sorted(List_CSS_Colors)]
 
 	enum_htmltag = createTypeEnum(tags, "HtmlTag", "Tag_NotFound")
-	enum_htmlattr = createTypeEnum(attrs, "HtmlAttr", "Attr_NotFound")
+	enum_htmlattr = createTypeEnum(attrs, "HtmlAttrId", "Attr_NotFound")
 	enum_alignattr = createTypeEnum(aligns, "AlignAttr", "Align_NotFound")
 	enum_cssprop = createTypeEnum(cssProps, "CssProp", "Css_Unknown")
 
 	code_defines = Template_Defines
 	code_htmltag = createFastFinder(tags, "HtmlTag", "Tag_NotFound", True)
-	code_htmlattr = createFastFinder(attrs, "HtmlAttr", "Attr_NotFound", True)
+	code_htmlattr = createFastFinder(attrs, "HtmlAttrId", "Attr_NotFound", True)
 	code_selfclosing = createFastSelector(tags, List_Self_Closing_Tags.split(), "IsTagSelfClosing", "HtmlTag")
 	code_inlinetag = createFastSelector(tags, List_Inline_Tags.split(), "IsInlineTag", "HtmlTag")
 	code_alignattr = createFastFinder(aligns, "AlignAttr", "Align_NotFound", True)
@@ -135,6 +135,33 @@ FileTime = [
 
 PrinterDefaults = [
 	Field("PrintScale", Utf8String, "shrink", "default value for scaling (shrink, fit, none)"),
+	Field("PrintAsVectors", Bool, False,
+		"if true, PDF and XPS pages are sent to the printer as vector graphics instead " +
+		"of as images where possible (pages using e.g. transparency are still printed as images)",
+		version="3.2"),
+]
+
+Performance = [
+	Field("RenderThreads", Int, 0,
+		"number of threads used for rendering pages in the background (if this " +
+		"value isn't positive, one thread per processor core is used)"),
+	Field("RenderCacheSize", Int, 256,
+		"maximum amount of memory (in MB) used for caching rendered pages (visible " +
+		"pages are always kept cached; the limit is reduced when the system runs low on memory; " +
+		"decoded images of image documents and comic books count against this limit and may " +
+		"use up to half of it)"),
+	Field("DisplayListCacheSize", Int, 40,
+		"maximum amount of memory (in MB) used per PDF or XPS document for caching parsed page " +
+		"content (shared between viewing, printing and searching the same document)"),
+	Field("TextCacheSize", Int, 64,
+		"maximum amount of memory (in MB) used for caching the text of pages for searching and " +
+		"selecting text (shared between all documents)"),
+	Field("GlyphCacheSize", Int, 16,
+		"maximum amount of memory (in MB) the cache of rendered glyphs of a PDF or XPS document " +
+		"may grow to at high zoom levels and resolutions"),
+	Field("GpuScaling", Bool, True,
+		"if true, tiles rendered at a different zoom level are scaled with Direct2D (when " +
+		"available) while they're being replaced after zooming"),
 ]
 
 ForwardSearch = [
@@ -191,6 +218,16 @@ FixedPageUI = [
 	Field("InvertColors", Bool, False,
 		"if true, TextColor and BackgroundColor will be temporarily swapped",
 		internal=True),
+	Field("SmoothScroll", Bool, False,
+		"if true, scrolling with the mouse wheel is animated instead of moving " +
+		"the document line by line", version="3.2"),
+	Field("RenderQuality", Utf8String, "balanced",
+		"rendering profile for pages: \"fast\" trades anti-aliasing and image smoothing " +
+		"for speed, \"print\" renders at the same quality as printing", version="3.2"),
+	Field("FastScrollRendering", Bool, True,
+		"if true, pages are rendered with the \"fast\" profile while scrolling quickly " +
+		"and rendered again with RenderQuality once scrolling stops (mainly helps with " +
+		"complex documents such as large vector drawings)", version="3.2"),
 ]
 
 EbookUI = [
@@ -212,6 +249,12 @@ ComicBookUI = [
 		structName="SizeI"),
 	Field("CbxMangaMode", Bool, False,
 		"if true, default to displaying Comic Book files in manga mode (from right to left if showing 2 pages at a time)"),
+	Field("RenderQuality", Utf8String, "balanced",
+		"rendering profile for images: \"fast\" trades image smoothing for speed, " +
+		"\"print\" renders at the same quality as printing", version="3.2"),
+	Field("FastScrollRendering", Bool, True,
+		"if true, images are rendered with the \"fast\" profile while scrolling quickly " +
+		"and rendered again with RenderQuality once scrolling stops", version="3.2"),
 ]
 
 ChmUI = [
@@ -415,6 +458,10 @@ GlobalPrefs = [
 		"if true, a document will be reloaded automatically whenever it's changed " +
 		"(currently doesn't work for documents shown in the ebook UI)",
 		expert=True, version="2.5"),
+	Field("ReloadDelay", Int, 500,
+		"time in milliseconds a modified document has to stay unchanged before " +
+		"it's reloaded (avoids reloading partially written files)",
+		expert=True, version="3.2"),
 	Field("FullPathInTitle", Bool, False,
 		"if true, we show the full path to a file in the title bar",
 		expert=True, version="3.0"),
@@ -451,6 +498,9 @@ GlobalPrefs = [
 		"actual resolution of the main screen in DPI (if this value " +
 		" isn't positive, the system's UI setting is used)",
 		expert=True, version="2.5"),
+	Struct("Performance", Performance,
+		"options for tuning rendering and caching (the defaults should be fine in most cases)",
+		expert=True, version="3.2"),
 	EmptyLine(),
 
 	Field("RememberStatePerDocument", Bool, True,
@@ -3,9 +3,11 @@
 
 // utils
 #include "BaseUtil.h"
+#include "EtwTrace.h"
 #include "FileTransactions.h"
 #include "FileUtil.h"
 #include "FileWatcher.h"
+#include "ThreadUtil.h"
 #include "UITask.h"
 // rendering engines
 #include "BaseEngine.h"
@@ -20,14 +22,44 @@
 #include "WindowInfo.h"
 #include "AppPrefs.h"
 #include "AppTools.h"
+#include "CrashHandler.h"
 #include "Favorites.h"
 #include "Toolbar.h"
 #include "Translations.h"
 
 #define PREFS_FILE_NAME     L"SumatraPDF-settings.txt"
 
+#define SAVE_PREFS_DELAY_IN_MS  2000
+
 static WatchedFile * gWatchedSettingsFile = nullptr;
 
+// the data last read from or written to the settings file, so that saving
+// doesn't have to re-read the (potentially multi-MB) file each time
+static char * gPrefsData = nullptr;
+// a pending SaveDelayed (0 if none)
+static UINT_PTR gSaveTimerId = 0;
+
+// serializes writes from the UI thread and from background writers
+static CRITICAL_SECTION gWriteAccess;
+static bool gWriteAccessInited = false;
+// each serialization gets the next number, so that a background writer
+// never overwrites more recent data with an older snapshot
+static LONG gSaveCount = 0;
+static LONG gWrittenCount = 0;
+// modification time of the last background write (not yet propagated
+// to gGlobalPrefs->lastPrefUpdate)
+static FILETIME gWrittenTime = { 0 };
+static bool gWrittenTimeValid = false;
+
+static CRITICAL_SECTION *GetWriteAccess()
+{
+    if (!gWriteAccessInited) {
+        InitializeCriticalSection(&gWriteAccess);
+        gWriteAccessInited = true;
+    }
+    return &gWriteAccess;
+}
+
 // number of weeks past since 2011-01-01
 static int GetWeekCount()
 {
@@ -60,6 +92,7 @@ bool Load()
 
     ScopedMem<WCHAR> path(GetSettingsPath());
     ScopedMem<char> prefsData(file::ReadAll(path, nullptr));
+    str::ReplacePtr(&gPrefsData, prefsData);
     gGlobalPrefs = NewGlobalPrefs(prefsData);
     CrashAlwaysIf(!gGlobalPrefs);
 
@@ -118,14 +151,18 @@ bool Load()
     return true;
 }
 
-// called whenever global preferences change or a file is
-// added or removed from gFileHistory (in order to keep
-// the list of recently opened documents in sync)
-bool Save()
+static void SyncLastPrefUpdate()
+{
+    ScopedCritSec scope(GetWriteAccess());
+    if (gWrittenTimeValid)
+        gGlobalPrefs->lastPrefUpdate = gWrittenTime;
+    gWrittenTimeValid = false;
+}
+
+// serializes gGlobalPrefs (on the UI thread) and returns nullptr if
+// nothing has changed since the settings were last read or written
+static char *SerializeForSave(size_t *sizeOut)
 {
-    // don't save preferences without the proper permission
-    if (!HasPermission(Perm_SavePreferences))
-        return false;
 
     // update display states for all tabs
     for (WindowInfo *win : gWindows) {
@@ -140,31 +177,129 @@ bool Save()
     str::ReplacePtr(&gGlobalPrefs->defaultDisplayMode, conv::FromDisplayMode(gGlobalPrefs->defaultDisplayModeEnum));
     conv::FromZoom(&gGlobalPrefs->defaultZoom, gGlobalPrefs->defaultZoomFloat);
 
-    ScopedMem<WCHAR> path(GetSettingsPath());
-    CrashIfDebugOnly(!path);
-    if (!path)
-        return false;
-    size_t prevPrefsDataSize = 0;
-    ScopedMem<char> prevPrefsData(file::ReadAll(path, &prevPrefsDataSize));
     size_t prefsDataSize = 0;
-    ScopedMem<char> prefsData(SerializeGlobalPrefs(gGlobalPrefs, prevPrefsData, &prefsDataSize));
-
+    char *prefsData = SerializeGlobalPrefs(gGlobalPrefs, gPrefsData, &prefsDataSize);
     CrashIf(!prefsData || 0 == prefsDataSize);
     if (!prefsData || 0 == prefsDataSize)
-        return false;
+        return nullptr;
 
     // only save if anything's changed at all
-    if (prevPrefsDataSize == prefsDataSize && str::Eq(prefsData, prevPrefsData))
-        return true;
+    if (str::Eq(prefsData, gPrefsData)) {
+        free(prefsData);
+        return nullptr;
+    }
+    str::ReplacePtr(&gPrefsData, prefsData);
+    *sizeOut = prefsDataSize;
+    return prefsData;
+}
 
+// must be called with gWriteAccess held
+static bool WritePrefsData(const WCHAR *path, const char *data, size_t dataLen, LONG saveNo)
+{
+    // a more recent snapshot has already been written
+    if (saveNo < gWrittenCount)
+        return true;
+    etw::Span span("SavePrefs", etw::KeywordIO, -1, dataLen, path);
     FileTransaction trans;
-    bool ok = trans.WriteAll(path, prefsData, prefsDataSize) && trans.Commit();
+    bool ok = trans.WriteAll(path, data, dataLen) && trans.Commit();
     if (!ok)
         return false;
-    gGlobalPrefs->lastPrefUpdate = file::GetModificationTime(path);
+    gWrittenCount = saveNo;
+    gWrittenTime = file::GetModificationTime(path);
+    gWrittenTimeValid = true;
     return true;
 }
 
+static void KillDelayedSave()
+{
+    if (gSaveTimerId)
+        KillTimer(nullptr, gSaveTimerId);
+    gSaveTimerId = 0;
+}
+
+// called whenever global preferences change or a file is
+// added or removed from gFileHistory (in order to keep
+// the list of recently opened documents in sync)
+bool Save()
+{
+    // don't save preferences without the proper permission
+    if (!HasPermission(Perm_SavePreferences))
+        return false;
+    ScopedHangOperation hangOp("SavePrefs");
+
+    // this save supersedes any pending delayed one
+    KillDelayedSave();
+
+    ScopedMem<WCHAR> path(GetSettingsPath());
+    CrashIfDebugOnly(!path);
+    if (!path)
+        return false;
+    size_t prefsDataSize = 0;
+    ScopedMem<char> prefsData(SerializeForSave(&prefsDataSize));
+    bool ok = true;
+    if (prefsData) {
+        // also waits for a background write still in progress
+        ScopedCritSec scope(GetWriteAccess());
+        ok = WritePrefsData(path, prefsData, prefsDataSize, ++gSaveCount);
+    }
+    SyncLastPrefUpdate();
+    return ok;
+}
+
+static void CALLBACK DelayedSaveTimerProc(HWND hwnd, UINT msg, UINT_PTR timerId, DWORD time)
+{
+    UNUSED(hwnd); UNUSED(msg); UNUSED(timerId); UNUSED(time);
+    KillDelayedSave();
+    if (!HasPermission(Perm_SavePreferences))
+        return;
+
+    WCHAR *path = GetSettingsPath();
+    size_t prefsDataSize = 0;
+    char *prefsData = SerializeForSave(&prefsDataSize);
+    if (!path || !prefsData) {
+        free(path);
+        free(prefsData);
+        return;
+    }
+    // the serialization happens above since it accesses gGlobalPrefs,
+    // only the (slow) disk write is moved off the UI thread
+    LONG saveNo = ++gSaveCount;
+    RunAsync([path, prefsData, prefsDataSize, saveNo] {
+        {
+            ScopedCritSec scope(GetWriteAccess());
+            WritePrefsData(path, prefsData, prefsDataSize, saveNo);
+        }
+        free(path);
+        free(prefsData);
+        uitask::Post([] { SyncLastPrefUpdate(); });
+    });
+}
+
+// coalesces frequent saves (e.g. when opening and closing documents)
+// into a single background write after a short delay
+void SaveDelayed()
+{
+    if (!HasPermission(Perm_SavePreferences))
+        return;
+    // for thread timers, passing an existing id restarts that timer
+    gSaveTimerId = SetTimer(nullptr, gSaveTimerId, SAVE_PREFS_DELAY_IN_MS, DelayedSaveTimerProc);
+    if (!gSaveTimerId)
+        Save();
+}
+
+// makes sure that a pending delayed save has been written to disk
+void Flush()
+{
+    if (gSaveTimerId) {
+        Save();
+        return;
+    }
+    if (!gWriteAccessInited)
+        return;
+    // wait for a background write still in progress
+    ScopedCritSec scope(GetWriteAccess());
+}
+
 // refresh the preferences when a different SumatraPDF process saves them
 // or if they are edited by the user using a text editor
 bool Reload()
@@ -188,6 +323,8 @@ bool Reload()
 
     ScopedHandle hScope(h);
 
+    // don't reload settings we've just written ourselves
+    SyncLastPrefUpdate();
     FILETIME time = file::GetModificationTime(path);
     if (FileTimeEq(time, gGlobalPrefs->lastPrefUpdate))
         return true;
@@ -266,6 +403,7 @@ void CleanUp()
 {
     DeleteGlobalPrefs(gGlobalPrefs);
     gGlobalPrefs = nullptr;
+    str::ReplacePtr(&gPrefsData, nullptr);
 }
 
 class SettingsFileObserver : public FileChangeObserver {
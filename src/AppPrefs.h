@@ -15,6 +15,8 @@ WCHAR *GetSettingsPath();
 
 bool Load();
 bool Save();
+void SaveDelayed();
+void Flush();
 bool Reload();
 void CleanUp();
 
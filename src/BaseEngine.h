@@ -4,6 +4,9 @@
 /* certain OCGs will only be rendered for some of these (e.g. watermarks) */
 enum RenderTarget { Target_View, Target_Print, Target_Export };
 
+/* rendering profiles trading fidelity for speed (cf. BaseEngine::SetRenderQuality) */
+enum RenderQuality { Quality_FastScroll, Quality_Balanced, Quality_Print };
+
 enum PageLayoutType { Layout_Single = 0, Layout_Facing = 1, Layout_Book = 2,
                       Layout_R2L = 16, Layout_NonContinuous = 32 };
 
@@ -26,6 +29,7 @@ enum DocumentProperty {
     Prop_CreationDate, Prop_ModificationDate, Prop_CreatorApp,
     Prop_UnsupportedFeatures, Prop_FontList,
     Prop_PdfVersion, Prop_PdfProducer, Prop_PdfFileStructure,
+    Prop_CacheStatistics,
 };
 
 class RenderedBitmap {
@@ -147,13 +151,63 @@ public:
     // if this element is an image, this returns it
     // caller must delete the result
     virtual RenderedBitmap *GetImage() { return nullptr; }
+    // if this element is an image that's stored in a common file format (e.g. JPEG),
+    // this returns the image's original data so that it can be copied or saved
+    // without having to decode and re-encode it
+    // caller must free() the result
+    virtual unsigned char *GetImageData(size_t *cbCount) { UNUSED(cbCount); return nullptr; }
 };
 
 // an item in a document's Table of Content
+// ToCs can have tens of thousands of items, so engines should allocate them
+// from a PoolAllocator (new (allocator) MyTocItem(...)) instead of one by one
+// and then hand the allocator over to the tree's root with OwnAllocator().
+// Deleting items from an allocator only runs their destructors, the memory
+// is freed at once when the root is deleted.
 class DocTocItem {
     DocTocItem *last; // only updated by AddSibling
 
+    // precedes every item in memory
+    struct AllocHeader {
+        PoolAllocator *allocator; // nullptr if the item was malloc()ed
+        size_t ownsAllocator;
+    };
+
 public:
+    static void *operator new(size_t size) {
+        AllocHeader *hdr = (AllocHeader *)malloc(sizeof(AllocHeader) + size);
+        CrashAlwaysIf(!hdr);
+        hdr->allocator = nullptr;
+        hdr->ownsAllocator = 0;
+        return hdr + 1;
+    }
+    static void *operator new(size_t size, PoolAllocator *allocator) {
+        AllocHeader *hdr = (AllocHeader *)allocator->Alloc(sizeof(AllocHeader) + size);
+        CrashAlwaysIf(!hdr);
+        hdr->allocator = allocator;
+        hdr->ownsAllocator = 0;
+        return hdr + 1;
+    }
+    static void operator delete(void *p) {
+        if (!p)
+            return;
+        AllocHeader *hdr = (AllocHeader *)p - 1;
+        if (!hdr->allocator)
+            free(hdr);
+        else if (hdr->ownsAllocator)
+            delete hdr->allocator;
+        // else: freed together with the root
+    }
+    // matches operator new(size_t, PoolAllocator *)
+    static void operator delete(void *p, PoolAllocator *) { operator delete(p); }
+
+    // call on the root once all items have been allocated
+    void OwnAllocator() {
+        AllocHeader *hdr = (AllocHeader *)this - 1;
+        CrashIf(!hdr->allocator);
+        hdr->ownsAllocator = 1;
+    }
+
     // the item's visible label
     WCHAR *title;
     // whether any child elements are to be displayed
@@ -224,9 +278,18 @@ public:
     virtual const WCHAR *FileName() const = 0;
     // number of pages the loaded document contains
     virtual int PageCount() const = 0;
+    // false while pages are still being laid out in the background
+    // (in which case PageCount() is only an estimate)
+    virtual bool IsLayoutComplete() const { return true; }
 
     // the box containing the visible page content (usually RectD(0, 0, pageWidth, pageHeight))
     virtual RectD PageMediabox(int pageNo) = 0;
+    // same as PageMediabox, if the mediabox can be determined cheaply;
+    // otherwise an empty rectangle (for laying out large documents quickly)
+    virtual RectD QuickPageMediabox(int pageNo) { return PageMediabox(pageNo); }
+    // whether the document's data is still arriving (pages that can't be
+    // loaded yet should be requested again later on)
+    virtual bool IsLoadingProgressively() { return false; }
     // the box inside PageMediabox that actually contains any relevant content
     // (used for auto-cropping in Fit Content mode, can be PageMediabox)
     virtual RectD PageContentBox(int pageNo, RenderTarget target=Target_View) {
@@ -239,6 +302,27 @@ public:
     virtual RenderedBitmap *RenderBitmap(int pageNo, float zoom, int rotation,
                          RectD *pageRect=nullptr, /* if nullptr: defaults to the page's mediabox */
                          RenderTarget target=Target_View, AbortCookie **cookie_out=nullptr) = 0;
+    // renders a page as vector graphics directly into a device context (e.g. for printing),
+    // mapping pageRect to screenRect; returns false (usually without having rendered anything)
+    // if the page has content which can't be rendered that way (e.g. transparency)
+    // (*cookie_out must be deleted after the call returns)
+    virtual bool RenderPage(HDC hDC, RectI screenRect, int pageNo, float zoom, int rotation=0,
+                            RectD *pageRect=nullptr, RenderTarget target=Target_View, AbortCookie **cookie_out=nullptr) {
+        UNUSED(hDC); UNUSED(screenRect); UNUSED(pageNo); UNUSED(zoom); UNUSED(rotation);
+        UNUSED(pageRect); UNUSED(target); UNUSED(cookie_out);
+        return false;
+    }
+    // returns a ready-made image of a page (e.g. a PDF's /Thumb) scaled to fit
+    // into a size x size square, if the document contains one at least that large
+    // (that's usually much faster than rendering the page for a thumbnail)
+    virtual RenderedBitmap *GetEmbeddedThumbnail(int pageNo, int size) {
+        UNUSED(pageNo); UNUSED(size);
+        return nullptr;
+    }
+    // sets the profile used by RenderBitmap for Target_View (other targets always
+    // render at Quality_Print), e.g. lower anti-aliasing while scrolling fast
+    // (applies per engine instance, so render threads should use their own clones)
+    virtual void SetRenderQuality(RenderQuality quality) { UNUSED(quality); }
 
     // applies zoom and rotation to a point in user/page space converting
     // it into device/screen space - or in the inverse direction
@@ -264,6 +348,16 @@ public:
     // caller needs to free() the result and *coordsOut (if coordsOut is non-nullptr)
     virtual WCHAR * ExtractPageText(int pageNo, const WCHAR *lineSep, RectI **coordsOut=nullptr,
                                     RenderTarget target=Target_View) = 0;
+    // like ExtractPageText, but gives up once timeoutMs have passed (unless INFINITE)
+    // or once the AbortCookie returned in *cookie_out has been aborted, in which case
+    // the text extracted so far is returned and *partialOut is set to true
+    // (caller needs to delete *cookie_out, if it's non-nullptr)
+    virtual WCHAR * ExtractPageTextLimited(int pageNo, const WCHAR *lineSep, RectI **coordsOut,
+                                           DWORD timeoutMs, bool *partialOut, AbortCookie **cookie_out=nullptr) {
+        UNUSED(timeoutMs); UNUSED(cookie_out);
+        *partialOut = false;
+        return ExtractPageText(pageNo, lineSep, coordsOut);
+    }
     // pages where clipping doesn't help are rendered in larger tiles
     virtual bool HasClipOptimizations(int pageNo) = 0;
     // the layout type this document's author suggests (if the user doesn't care)
@@ -271,6 +365,9 @@ public:
     // whether the content should be displayed as images instead of as document pages
     // (e.g. with a black background and less padding in between and without search UI)
     virtual bool IsImageCollection() const { return false; }
+    // reduces the memory used for caching decoded images and fonts to a minimum
+    // while the document isn't visible (until called again with inBackground=false)
+    virtual void ReleaseCaches(bool inBackground) { UNUSED(inBackground); }
 
     // access to various document properties (such as Author, Title, etc.)
     virtual WCHAR *GetProperty(DocumentProperty prop) = 0;
@@ -330,6 +427,14 @@ public:
     // caller must free() the result
     virtual char *GetDecryptionKey() const { return nullptr; }
 
+    // returns a digest of everything that determines a page's appearance, so that
+    // pages which haven't changed can be recognized after a reload
+    // (returns false if that isn't supported for the page)
+    virtual bool GetPageFingerprint(int pageNo, unsigned char digest[16]) {
+        UNUSED(pageNo); UNUSED(digest);
+        return false;
+    }
+
     // loads the given page so that the time required can be measured
     // without also measuring rendering times
     virtual bool BenchLoadPage(int pageNo) = 0;
@@ -7,6 +7,7 @@
 #include "Dpi.h"
 #include "FileUtil.h"
 #include "FrameRateWnd.h"
+#include "FrameTimeoutCalculator.h"
 #include "Timer.h"
 #include "UITask.h"
 #include "WinUtil.h"
@@ -30,11 +31,13 @@
 #include "resource.h"
 #include "Canvas.h"
 #include "Caption.h"
+#include "CrashHandler.h"
 #include "Menu.h"
 #include "Notifications.h"
 #include "uia/Provider.h"
 #include "Search.h"
 #include "Selection.h"
+#include "StressTesting.h"
 #include "SumatraAbout.h"
 #include "Tabs.h"
 #include "Toolbar.h"
@@ -63,9 +66,82 @@ void UpdateDeltaPerLine()
 
 ///// methods needed for FixedPageUI canvases with document loaded /////
 
+static void StopScrollAnimation(WindowInfo& win)
+{
+    if (!win.scrollAnim.timing)
+        return;
+    KillTimer(win.hwndCanvas, SCROLL_ANIM_TIMER_ID);
+    delete win.scrollAnim.timing;
+    win.scrollAnim.timing = nullptr;
+    win.scrollAnim.ctrl = nullptr;
+}
+
+// moves the document towards the animation's target, easing out so that
+// repeated wheel ticks smoothly join into one movement
+static void AdvanceScrollAnimation(WindowInfo& win)
+{
+    DisplayModel *dm = win.AsFixed();
+    if (!win.scrollAnim.timing || !dm || win.ctrl != win.scrollAnim.ctrl) {
+        StopScrollAnimation(win);
+        return;
+    }
+
+    // wait for the next composition pass so that the frames are paced by vsync
+    // (this returns immediately if desktop composition is disabled)
+    if (dwm::IsCompositionEnabled())
+        dwm::Flush();
+
+    double t = win.scrollAnim.timing->ElapsedTotal() * 1000 / SCROLL_ANIM_DURATION_IN_MS;
+    double f = t >= 1.0 ? 1.0 : 1.0 - (1.0 - t) * (1.0 - t);
+    PointI start = win.scrollAnim.start, target = win.scrollAnim.target;
+    PointI pos((int)(start.x + (target.x - start.x) * f + 0.5), (int)(start.y + (target.y - start.y) * f + 0.5));
+    PointI curr = dm->GetViewPort().TL();
+    if (pos.x != curr.x)
+        dm->ScrollXBy(pos.x - curr.x);
+    if (pos.y != curr.y)
+        dm->ScrollYBy(pos.y - curr.y, false);
+
+    if (t >= 1.0 || (dm->GetViewPort().TL() == curr && pos != curr)) {
+        // reached the target (or the document can't move any further)
+        StopScrollAnimation(win);
+        return;
+    }
+    win.scrollAnim.timing->Step();
+    SetTimer(win.hwndCanvas, SCROLL_ANIM_TIMER_ID, win.scrollAnim.timing->GetTimeoutInMilliseconds(), nullptr);
+}
+
+// starts (or extends) an animation moving the document by (dx, dy)
+static void StartScrollAnimation(WindowInfo& win, int dx, int dy)
+{
+    DisplayModel *dm = win.AsFixed();
+    RectI viewPort = dm->GetViewPort();
+    SizeI canvas = dm->GetCanvasSize();
+    PointI target = win.scrollAnim.timing ? win.scrollAnim.target : viewPort.TL();
+    target.x = limitValue(target.x + dx, 0, std::max(canvas.dx - viewPort.dx, 0));
+    target.y = limitValue(target.y + dy, 0, std::max(canvas.dy - viewPort.dy, 0));
+
+    StopScrollAnimation(win);
+    if (target == viewPort.TL())
+        return;
+    win.scrollAnim.timing = new FrameTimeoutCalculator(SCROLL_ANIM_FPS);
+    win.scrollAnim.ctrl = win.ctrl;
+    win.scrollAnim.start = viewPort.TL();
+    win.scrollAnim.target = target;
+
+    // have the page at the animation's end rendered ahead of time
+    // (until then, RenderCache paints lower resolution tiles where available)
+    PointI center(target.x - viewPort.x + viewPort.dx / 2, target.y - viewPort.y + viewPort.dy / 2);
+    int pageNo = dm->GetPageNoByPoint(center);
+    if (dm->ValidPageNo(pageNo))
+        win.cbHandler->RequestRendering(pageNo);
+
+    AdvanceScrollAnimation(win);
+}
+
 static void OnVScroll(WindowInfo& win, WPARAM wParam)
 {
     AssertCrash(win.AsFixed());
+    StopScrollAnimation(win);
 
     SCROLLINFO si = { 0 };
     si.cbSize = sizeof (si);
@@ -105,6 +181,7 @@ static void OnVScroll(WindowInfo& win, WPARAM wParam)
 static void OnHScroll(WindowInfo& win, WPARAM wParam)
 {
     AssertCrash(win.AsFixed());
+    StopScrollAnimation(win);
 
     SCROLLINFO si = { 0 };
     si.cbSize = sizeof (si);
@@ -557,11 +634,15 @@ static void GetGradientColor(COLORREF a, COLORREF b, float perc, TRIVERTEX *tv)
     tv->Blue = (COLOR16)((GetBValueSafe(a) + perc * (GetBValueSafe(b) - GetBValueSafe(a))) * 256);
 }
 
-static void DrawDocument(WindowInfo& win, HDC hdc, RECT *rcArea)
+// returns false if the painted frame can't be reused after scrolling
+// (e.g. because it contains placeholders for pages still being rendered)
+static bool DrawDocument(WindowInfo& win, HDC hdc, RECT *rcArea)
 {
     AssertCrash(win.AsFixed());
-    if (!win.AsFixed()) return;
+    if (!win.AsFixed()) return false;
     DisplayModel* dm = win.AsFixed();
+    // the gradient is relative to the view port and has to be repainted as a whole
+    bool canScroll = gGlobalPrefs->fixedPageUI.gradientColors->Count() <= 1;
 
     bool paintOnBlackWithoutShadow = win.presentation ||
     // draw comic books and single images on a black background (without frame and shadow)
@@ -622,6 +703,7 @@ static void DrawDocument(WindowInfo& win, HDC hdc, RECT *rcArea)
 
     bool rendering = false;
     RectI screen(PointI(), dm->GetViewPort().Size());
+    RectI area = RectI::FromRECT(*rcArea);
 
     for (int pageNo = 1; pageNo <= dm->PageCount(); ++pageNo) {
         PageInfo *pageInfo = dm->GetPageInfo(pageNo);
@@ -632,6 +714,8 @@ static void DrawDocument(WindowInfo& win, HDC hdc, RECT *rcArea)
             continue;
 
         RectI bounds = pageInfo->pageOnScreen.Intersect(screen);
+        if (bounds.Intersect(area).IsEmpty())
+            continue;
         // don't paint the frame background for images
         if (!dm->GetEngine()->IsImageCollection())
             PaintPageFrameAndShadow(hdc, bounds, pageInfo->pageOnScreen, win.presentation);
@@ -640,6 +724,7 @@ static void DrawDocument(WindowInfo& win, HDC hdc, RECT *rcArea)
         UINT renderDelay = gRenderCache.Paint(hdc, bounds, dm, pageNo, pageInfo, &renderOutOfDateCue);
 
         if (renderDelay) {
+            canScroll = false;
             ScopedFont fontRightTxt(CreateSimpleFont(hdc, L"MS Shell Dlg", 14));
             HGDIOBJ hPrevFont = SelectObject(hdc, fontRightTxt);
             SetTextColor(hdc, gRenderCache.textColor);
@@ -659,6 +744,7 @@ static void DrawDocument(WindowInfo& win, HDC hdc, RECT *rcArea)
         if (!renderOutOfDateCue)
             continue;
 
+        canScroll = false;
         HDC bmpDC = CreateCompatibleDC(hdc);
         if (bmpDC) {
             SelectObject(bmpDC, gBitmapReloadingCue);
@@ -674,6 +760,11 @@ static void DrawDocument(WindowInfo& win, HDC hdc, RECT *rcArea)
         }
     }
 
+    // replace the tiles rendered while scrolling fast once scrolling stops
+    UINT idleDelay = gRenderCache.GetIdleRepaintDelay(dm);
+    if (idleDelay)
+        win.RepaintAsync(idleDelay);
+
     if (win.showSelection)
         PaintSelection(&win, hdc);
 
@@ -682,10 +773,64 @@ static void DrawDocument(WindowInfo& win, HDC hdc, RECT *rcArea)
 
     if (!rendering)
         DebugShowLinks(*dm, hdc);
+
+    return canScroll;
+}
+
+// only (re)paints the part of the buffer that needs updating
+// and remembers whether the result can be scrolled later on
+static void DrawDocumentBuffered(WindowInfo& win, HDC hdc, RECT *rcPaint)
+{
+    RectI area = RectI::FromRECT(*rcPaint);
+    HDC hdcBuffer = win.buffer->GetDC();
+    int savedDC = SaveDC(hdcBuffer);
+    IntersectClipRect(hdcBuffer, area.x, area.y, area.x + area.dx, area.y + area.dy);
+    bool canScroll = DrawDocument(win, hdcBuffer, rcPaint);
+    RestoreDC(hdcBuffer, savedDC);
+    win.buffer->Flush(hdc, area);
+
+    RectI viewPort = win.AsFixed() ? win.AsFixed()->GetViewPort() : RectI();
+    if (!canScroll)
+        win.bufferViewPort = RectI();
+    else if (area.Intersect(win.canvasRc) == win.canvasRc)
+        win.bufferViewPort = viewPort;
+    else if (win.bufferViewPort != viewPort)
+        win.bufferViewPort = RectI();
+}
+
+// shows what a slow document spends its time on (toggled with Ctrl+Shift+F12)
+static void UpdatePerfOverlay(WindowInfo& win, double paintMs)
+{
+    // hit rate since the previous update (i.e. for the most recent frame)
+    static int prevHits = 0, prevMisses = 0;
+
+    RenderCacheStats stats;
+    gRenderCache.GetStats(&stats);
+    int hits = stats.hits - prevHits, misses = stats.misses - prevMisses;
+    prevHits = stats.hits;
+    prevMisses = stats.misses;
+
+    str::Str<WCHAR> info;
+    info.AppendFmt(L"paint: %.1f ms\n", paintMs);
+    info.AppendFmt(L"tiles: %d%% cached, %d queued\n", hits + misses > 0 ? hits * 100 / (hits + misses) : 100, stats.queueDepth);
+    info.AppendFmt(L"render: %.1f ms last, %.1f ms avg (%d tiles)\n", stats.lastRenderMs, stats.avgRenderMs, stats.tilesRendered);
+    info.AppendFmt(L"bitmaps: %.1f MB (%d)", stats.bitmapBytes / (1024.0 * 1024), stats.bitmapCount);
+    if (win.currentTab)
+        info.AppendFmt(L"\nload: %.1f ms", win.currentTab->loadTimeMs);
+    DisplayModel *dm = win.AsFixed();
+    if (dm) {
+        info.AppendFmt(L"\ntext: %.1f MB (%d of %d pages)", dm->textCache->CacheBytes() / (1024.0 * 1024),
+                       dm->textCache->CachedPageCount(), dm->PageCount());
+        ScopedMem<WCHAR> cacheStats(dm->GetEngine()->GetProperty(Prop_CacheStatistics));
+        if (cacheStats)
+            info.AppendFmt(L"\nstore: %s", cacheStats);
+    }
+    ShowFrameRateInfo(win.frameRateWnd, info.Get());
 }
 
 static void OnPaintDocument(WindowInfo& win)
 {
+    ScopedHangOperation hangOp("PaintDocument");
     Timer t;
     PAINTSTRUCT ps;
     HDC hdc = BeginPaint(win.hwndCanvas, &ps);
@@ -698,14 +843,17 @@ static void OnPaintDocument(WindowInfo& win)
         FillRect(hdc, &ps.rcPaint, GetStockBrush(WHITE_BRUSH));
         break;
     default:
-        DrawDocument(win, win.buffer->GetDC(), &ps.rcPaint);
-        win.buffer->Flush(hdc);
+        DrawDocumentBuffered(win, hdc, &ps.rcPaint);
     }
 
     EndPaint(win.hwndCanvas, &ps);
     if (gShowFrameRate) {
         ShowFrameRateDur(win.frameRateWnd, t.GetTimeInMs());
     }
+    if (gShowPerfOverlay) {
+        UpdatePerfOverlay(win, t.GetTimeInMs());
+    }
+    OnStartupPaint(true);
 }
 
 static LRESULT OnSetCursor(WindowInfo& win, HWND hwnd)
@@ -736,6 +884,8 @@ static LRESULT OnSetCursor(WindowInfo& win, HWND hwnd)
             }
             DisplayModel *dm = win.AsFixed();
             PageElement *pageEl = dm->GetElementAtPos(pt);
+            PageDestination *dest = pageEl ? pageEl->AsLink() : nullptr;
+            PrefetchDestinationPage(&win, dest ? dest->GetDestPageNo() : 0);
             if (pageEl) {
                 ScopedMem<WCHAR> text(pageEl->GetValue());
                 RectI rc = dm->CvtToScreen(pageEl->GetPageNo(), pageEl->GetRect());
@@ -831,6 +981,16 @@ static LRESULT CanvasOnMouseWheel(WindowInfo& win, UINT message, WPARAM wParam,
 		return 0;
 	}
 
+    if (gGlobalPrefs->fixedPageUI.smoothScroll && win.AsFixed() && IsContinuous(win.ctrl->GetDisplayMode())) {
+        // move by the same distance as line scrolling would (cf. OnVScroll)
+        int dist = -MulDiv(DpiScaleY(win.hwndCanvas, 16), delta, gDeltaPerLine);
+        if (horizontal)
+            StartScrollAnimation(win, dist, 0);
+        else
+            StartScrollAnimation(win, 0, dist);
+        return 0;
+    }
+
     win.wheelAccumDelta += delta;
     int currentScrollPos = GetScrollPos(win.hwndCanvas, SB_VERT);
 
@@ -1103,6 +1263,8 @@ static LRESULT WndProcCanvasEbookUI(WindowInfo& win, HWND hwnd, UINT msg, WPARAM
 {
     bool wasHandled;
     LRESULT res = win.AsEbook()->HandleMessage(msg, wParam, lParam, wasHandled);
+    if (WM_PAINT == msg)
+        OnStartupPaint(true);
     if (wasHandled)
         return res;
 
@@ -1138,11 +1300,13 @@ static void OnPaintAbout(WindowInfo& win)
         DrawAboutPage(win, win.buffer->GetDC());
     }
     win.buffer->Flush(hdc);
+    win.bufferViewPort = RectI();
 
     EndPaint(win.hwndCanvas, &ps);
     if (gShowFrameRate) {
         ShowFrameRateDur(win.frameRateWnd, t.GetTimeInMs());
     }
+    OnStartupPaint(false);
 }
 
 static void OnMouseLeftButtonDownAbout(WindowInfo& win, int x, int y, WPARAM key)
@@ -1313,6 +1477,34 @@ void WindowInfo::RepaintAsync(UINT delay)
     });
 }
 
+// after scrolling, moves the previously painted frame by the scroll delta
+// and only paints the newly exposed parts (instead of repainting everything)
+void WindowInfo::RepaintScrolledAsync()
+{
+    uitask::Post([=]{
+        if (!WindowInfoStillValid(this))
+            return;
+        DisplayModel *dm = this->AsFixed();
+        RectI viewPort = dm ? dm->GetViewPort() : RectI();
+        int dx = this->bufferViewPort.x - viewPort.x;
+        int dy = this->bufferViewPort.y - viewPort.y;
+        // anything still waiting to be repainted (or child windows such as
+        // notifications) would be moved along, so repaint everything instead
+        if (!dm || this->presentation || this->bufferViewPort.IsEmpty() ||
+            this->bufferViewPort.Size() != viewPort.Size() ||
+            abs(dx) >= viewPort.dx || abs(dy) >= viewPort.dy ||
+            GetUpdateRect(this->hwndCanvas, nullptr, FALSE) ||
+            GetWindow(this->hwndCanvas, GW_CHILD) ||
+            !this->buffer->Scroll(dx, dy)) {
+            this->RedrawAll();
+            return;
+        }
+        ScrollWindowEx(this->hwndCanvas, dx, dy, nullptr, nullptr, nullptr, nullptr, SW_INVALIDATE);
+        this->bufferViewPort = viewPort;
+        UpdateWindow(this->hwndCanvas);
+    });
+}
+
 static void OnTimer(WindowInfo& win, HWND hwnd, WPARAM timerId)
 {
     PointI pt;
@@ -1324,6 +1516,11 @@ static void OnTimer(WindowInfo& win, HWND hwnd, WPARAM timerId)
         win.RedrawAll();
         break;
 
+    case SCROLL_ANIM_TIMER_ID:
+        KillTimer(hwnd, SCROLL_ANIM_TIMER_ID);
+        AdvanceScrollAnimation(win);
+        break;
+
     case SMOOTHSCROLL_TIMER_ID:
         if (MA_SCROLLING == win.mouseAction)
             win.MoveDocBy(win.xScrollSpeed, win.yScrollSpeed);
@@ -1372,6 +1569,25 @@ static void OnTimer(WindowInfo& win, HWND hwnd, WPARAM timerId)
                 tab->AsEbook()->TriggerLayout();
         }
         break;
+
+    case DPI_CHANGED_TIMER_ID:
+        KillTimer(hwnd, DPI_CHANGED_TIMER_ID);
+        UpdateScreenDpi(&win);
+        break;
+
+    case RELEASE_CACHES_TIMER_ID:
+        KillTimer(hwnd, RELEASE_CACHES_TIMER_ID);
+        for (TabInfo *tab : win.tabs) {
+            if (tab == win.currentTab || !tab->AsFixed())
+                continue;
+            // the document's state (scroll position, zoom, etc.) remains as is,
+            // everything else is recreated on demand once the tab is selected again
+            DisplayModel *dm = tab->AsFixed();
+            dm->GetEngine()->ReleaseCaches(true);
+            dm->textCache->EvictAll();
+            gRenderCache.FreeForBackground(dm);
+        }
+        break;
     }
 }
 
@@ -6,19 +6,76 @@
 #define PPC_BSTR
 #include <chm_lib.h>
 #include "ByteReader.h"
+#include "Dict.h"
 #include "FileUtil.h"
 #include "HtmlParserLookup.h"
+#include "HtmlPullParser.h"
 #include "TrivialHtmlParser.h"
 // rendering engines
 #include "BaseEngine.h"
 #include "EbookBase.h"
 #include "ChmDoc.h"
 
+// number of decompressed LZX blocks CHMLib keeps around (instead
+// of 5), so that the resources of a topic and the topics next to it
+// rarely require decompressing the same reset interval again
+#define CHM_BLOCKS_CACHED   64
+
+struct ChmUnitLocation {
+    LONGUINT64  start;
+    LONGUINT64  length;
+    int         space;
+};
+
+struct ChmPathIndex {
+    // paths are lowercased as CHMLib compares them case-insensitively
+    dict::MapStrToInt paths;
+    Vec<ChmUnitLocation> units;
+
+    ChmPathIndex() : paths(1024) { }
+};
+
+static int ChmIndexEntry(struct chmFile *chmHandle, struct chmUnitInfo *info, void *data)
+{
+    UNUSED(chmHandle);
+    ChmPathIndex *index = (ChmPathIndex *)data;
+    ChmUnitLocation loc = { info->start, info->length, info->space };
+    ScopedMem<char> path(str::Dup(info->path));
+    str::ToLowerInPlace(path);
+    if (index->paths.Insert(path, (int)index->units.Count()))
+        index->units.Append(loc);
+    return CHM_ENUMERATOR_CONTINUE;
+}
+
 ChmDoc::~ChmDoc()
 {
+    delete pathIndex;
     chm_close(chmHandle);
 }
 
+bool ChmDoc::ResolveObject(const char *fileName, struct chmUnitInfo *info)
+{
+    if (!pathIndex) {
+        pathIndex = new ChmPathIndex();
+        chm_enumerate(chmHandle, CHM_ENUMERATE_ALL, ChmIndexEntry, pathIndex);
+    }
+
+    ScopedMem<char> path(str::Dup(fileName));
+    str::ToLowerInPlace(path);
+    int idx;
+    if (!pathIndex->paths.Get(path, &idx)) {
+        // fall back to CHMLib for paths the enumeration might have missed
+        return chm_resolve_object(chmHandle, fileName, info) == CHM_RESOLVE_SUCCESS;
+    }
+    ChmUnitLocation& loc = pathIndex->units.At(idx);
+    info->start = loc.start;
+    info->length = loc.length;
+    info->space = loc.space;
+    info->flags = 0;
+    str::BufSet(info->path, dimof(info->path), fileName);
+    return true;
+}
+
 bool ChmDoc::HasData(const char *fileName)
 {
     if (!fileName)
@@ -33,7 +90,7 @@ bool ChmDoc::HasData(const char *fileName)
         fileName += 2;
 
     struct chmUnitInfo info;
-    return chm_resolve_object(chmHandle, fileName, &info) == CHM_RESOLVE_SUCCESS;
+    return ResolveObject(fileName, &info);
 }
 
 unsigned char *ChmDoc::GetData(const char *fileName, size_t *lenOut)
@@ -47,15 +104,15 @@ unsigned char *ChmDoc::GetData(const char *fileName, size_t *lenOut)
     }
 
     struct chmUnitInfo info;
-    int res = chm_resolve_object(chmHandle, fileName, &info);
-    if (CHM_RESOLVE_SUCCESS != res && str::FindChar(fileName, '\\')) {
+    bool found = ResolveObject(fileName, &info);
+    if (!found && str::FindChar(fileName, '\\')) {
         // Microsoft's HTML Help CHM viewer tolerates backslashes in URLs
         fileNameTmp.Set(str::Dup(fileName));
         str::TransChars(fileNameTmp, "\\", "/");
         fileName = fileNameTmp;
-        res = chm_resolve_object(chmHandle, fileName, &info);
+        found = ResolveObject(fileName, &info);
     }
-    if (CHM_RESOLVE_SUCCESS != res)
+    if (!found)
         return nullptr;
     size_t len = (size_t)info.length;
     if (len > 128 * 1024 * 1024) {
@@ -262,6 +319,7 @@ bool ChmDoc::Load(const WCHAR *fileName)
     chmHandle = chm_open((WCHAR *)fileName);
     if (!chmHandle)
         return false;
+    chm_set_param(chmHandle, CHM_PARAM_MAX_BLOCKS_CACHED, CHM_BLOCKS_CACHED);
 
     ParseWindowsData();
     if (!ParseSystemData())
@@ -334,6 +392,87 @@ Vec<char *> *ChmDoc::GetAllPaths()
     return paths;
 }
 
+// returns the paths of all images, stylesheets and scripts
+// an HTML topic refers to (for prefetching them)
+Vec<char *> *ChmDoc::GetTopicResources(const char *topicPath, const unsigned char *html, size_t len)
+{
+    Vec<char *> *paths = new Vec<char *>();
+    HtmlPullParser parser((const char *)html, len);
+    HtmlToken *tok;
+    while ((tok = parser.Next()) != nullptr && !tok->IsError()) {
+        if (!tok->IsStartTag() && !tok->IsEmptyElementEndTag())
+            continue;
+        AttrInfo *attr = nullptr;
+        if (Tag_Img == tok->tag || Tag_Script == tok->tag)
+            attr = tok->GetAttrByName("src");
+        else if (Tag_Link == tok->tag)
+            attr = tok->GetAttrByName("href");
+        if (!attr || 0 == attr->valLen)
+            continue;
+        ScopedMem<char> src(str::DupN(attr->val, attr->valLen));
+        // skip external and absolute URLs (e.g. "ms-its:other.chm::/file.htm")
+        if (str::FindChar(src, ':'))
+            continue;
+        char *path = NormalizeURL(src, topicPath);
+        paths->Append(path);
+    }
+    return paths;
+}
+
+static bool IsTopicLineBreak(HtmlTag tag)
+{
+    switch (tag) {
+    case Tag_Br: case Tag_P: case Tag_Div: case Tag_Li: case Tag_Tr:
+    case Tag_H1: case Tag_H2: case Tag_H3: case Tag_H4: case Tag_H5: case Tag_H6:
+    case Tag_Title: case Tag_Pre: case Tag_Dt: case Tag_Dd: case Tag_Hr:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// returns the plain text of an HTML topic (for searching it)
+// with whitespace collapsed and lines separated by lineSep
+WCHAR *ChmDoc::ExtractTopicText(const char *topicPath, const WCHAR *lineSep)
+{
+    size_t len;
+    ScopedMem<unsigned char> html(GetData(topicPath, &len));
+    if (!html)
+        return nullptr;
+
+    str::Str<WCHAR> text;
+    bool needsSpace = false, needsLineSep = false;
+    bool inScript = false;
+    HtmlPullParser parser((const char *)html.Get(), len);
+    HtmlToken *tok;
+    while ((tok = parser.Next()) != nullptr && !tok->IsError()) {
+        if (tok->IsTag()) {
+            if (Tag_Script == tok->tag || Tag_Style == tok->tag)
+                inScript = tok->IsStartTag();
+            else if (IsTopicLineBreak(tok->tag))
+                needsLineSep = text.Size() > 0;
+            continue;
+        }
+        if (inScript || !tok->IsText())
+            continue;
+        ScopedMem<char> s(str::DupN(tok->s, tok->sLen));
+        ScopedMem<WCHAR> ws(DecodeHtmlEntitites(s, codepage));
+        for (const WCHAR *c = ws; *c; c++) {
+            if (str::IsWs(*c)) {
+                needsSpace = text.Size() > 0;
+                continue;
+            }
+            if (needsLineSep)
+                text.Append(lineSep);
+            else if (needsSpace)
+                text.Append(' ');
+            needsSpace = needsLineSep = false;
+            text.Append(*c);
+        }
+    }
+    return text.StealData();
+}
+
 /* The html looks like:
 <li>
   <object type="text/sitemap">
@@ -1,8 +1,14 @@
 /* Copyright 2015 the SumatraPDF project authors (see AUTHORS file).
    License: GPLv3 */
 
+struct ChmPathIndex;
+
 class ChmDoc {
     struct chmFile *chmHandle;
+    // maps all paths to their location inside the CHM file
+    // (built on first use, so that lookups don't have to
+    // walk CHMLib's directory chunks every time)
+    ChmPathIndex *pathIndex;
 
     // Data parsed from /#WINDOWS, /#STRINGS, /#SYSTEM files inside CHM file
     ScopedMem<char> title;
@@ -16,11 +22,12 @@ class ChmDoc {
     bool ParseSystemData();
     bool ParseTocOrIndex(EbookTocVisitor *visitor, const char *path, bool isIndex);
     void FixPathCodepage(ScopedMem<char>& path, UINT& fileCP);
+    bool ResolveObject(const char *fileName, struct chmUnitInfo *info);
 
     bool Load(const WCHAR *fileName);
 
 public:
-    ChmDoc() : chmHandle(nullptr), codepage(0) { }
+    ChmDoc() : chmHandle(nullptr), pathIndex(nullptr), codepage(0) { }
     ~ChmDoc();
 
     bool HasData(const char *fileName);
@@ -33,6 +40,8 @@ public:
     WCHAR *GetProperty(DocumentProperty prop);
     const char *GetHomePath();
     Vec<char *> *GetAllPaths();
+    Vec<char *> *GetTopicResources(const char *topicPath, const unsigned char *html, size_t len);
+    WCHAR *ExtractTopicText(const char *topicPath, const WCHAR *lineSep);
 
     bool HasToc() const;
     bool ParseToc(EbookTocVisitor *visitor);
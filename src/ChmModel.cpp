@@ -4,7 +4,9 @@
 // utils
 #include "BaseUtil.h"
 #include "Dict.h"
+#include "FileUtil.h"
 #include "HtmlWindow.h"
+#include "ThreadUtil.h"
 #include "UITask.h"
 // rendering engines
 #include "BaseEngine.h"
@@ -15,6 +17,7 @@
 #include "Controller.h"
 #include "ChmModel.h"
 #include "GlobalPrefs.h"
+#include "TextSelection.h"
 
 static bool IsExternalUrl(const WCHAR *url)
 {
@@ -89,13 +92,22 @@ struct ChmTocTraceItem {
 
 ChmModel::ChmModel(ControllerCallback *cb) : Controller(cb),
     doc(nullptr), htmlWindow(nullptr), htmlWindowCb(nullptr), tocTrace(nullptr),
-    currentPageNo(1), initZoom(INVALID_ZOOM)
+    currentPageNo(1), initZoom(INVALID_ZOOM), prefetchThread(nullptr), prefetchRunning(false),
+    textEngine(nullptr), textCache(nullptr)
 {
     InitializeCriticalSection(&docAccess);
 }
 
 ChmModel::~ChmModel()
 {
+    if (prefetchThread) {
+        prefetchThread->RequestCancel();
+        prefetchThread->Join();
+        delete prefetchThread;
+    }
+    // stops the indexer before its engine goes away
+    delete textCache;
+    delete textEngine;
     EnterCriticalSection(&docAccess);
     // TODO: deleting htmlWindow seems to spin a modal loop which
     //       can lead to WM_PAINT being dispatched for the parent
@@ -323,6 +335,172 @@ bool ChmModel::Load(const WCHAR *fileName)
     return pages.Count() > 0;
 }
 
+// exposes the plain text of a CHM document's topics to PageTextCache and TextSearch
+// (which requires the topics to be numbered like pages): the pages are numbered
+// the same as the ChmModel's, followed by all topics which aren't part of the ToC
+class ChmTopicsEngine : public BaseEngine {
+    ScopedMem<WCHAR> fileName;
+    // the engine has its own ChmDoc, so that it can be used on any thread
+    ChmDoc *doc;
+    CRITICAL_SECTION docAccess;
+    WStrList pages;
+
+public:
+    ChmTopicsEngine() : doc(nullptr) { InitializeCriticalSection(&docAccess); }
+    virtual ~ChmTopicsEngine() {
+        delete doc;
+        DeleteCriticalSection(&docAccess);
+    }
+
+    BaseEngine *Clone() override { return nullptr; }
+    const WCHAR *FileName() const override { return fileName; }
+    int PageCount() const override { return (int)pages.Count(); }
+
+    // topics aren't rendered; for TextSelection, ExtractPageText places
+    // the characters of each line on a grid of one unit per character
+    RectD PageMediabox(int pageNo) override {
+        UNUSED(pageNo);
+        return RectD(0, 0, INT_MAX / 2, INT_MAX / 2);
+    }
+    RenderedBitmap *RenderBitmap(int pageNo, float zoom, int rotation, RectD *pageRect=nullptr,
+                                 RenderTarget target=Target_View, AbortCookie **cookie_out=nullptr) override {
+        UNUSED(pageNo); UNUSED(zoom); UNUSED(rotation); UNUSED(pageRect); UNUSED(target); UNUSED(cookie_out);
+        return nullptr;
+    }
+    PointD Transform(PointD pt, int pageNo, float zoom, int rotation, bool inverse=false) override {
+        UNUSED(pageNo); UNUSED(zoom); UNUSED(rotation); UNUSED(inverse);
+        return pt;
+    }
+    RectD Transform(RectD rect, int pageNo, float zoom, int rotation, bool inverse=false) override {
+        UNUSED(pageNo); UNUSED(zoom); UNUSED(rotation); UNUSED(inverse);
+        return rect;
+    }
+
+    unsigned char *GetFileData(size_t *cbCount) override {
+        return (unsigned char *)file::ReadAll(fileName, cbCount);
+    }
+    bool SaveFileAs(const WCHAR *copyFileName, bool includeUserAnnots=false) override {
+        UNUSED(copyFileName); UNUSED(includeUserAnnots);
+        return false;
+    }
+    WCHAR * ExtractPageText(int pageNo, const WCHAR *lineSep, RectI **coordsOut=nullptr,
+                            RenderTarget target=Target_View) override;
+    bool HasClipOptimizations(int pageNo) override { UNUSED(pageNo); return false; }
+
+    WCHAR *GetProperty(DocumentProperty prop) override {
+        ScopedCritSec scope(&docAccess);
+        return doc->GetProperty(prop);
+    }
+
+    bool SupportsAnnotation(bool forSaving=false) const override { UNUSED(forSaving); return false; }
+    void UpdateUserAnnotations(Vec<PageAnnotation> *list) override { UNUSED(list); }
+    const WCHAR *GetDefaultFileExt() const override { return L".chm"; }
+
+    Vec<PageElement *> *GetElements(int pageNo) override { UNUSED(pageNo); return nullptr; }
+    PageElement *GetElementAtPos(int pageNo, PointD pt) override { UNUSED(pageNo); UNUSED(pt); return nullptr; }
+
+    // the labels are the topics' paths (as expected by ChmModel::GoToTopic)
+    bool HasPageLabels() const override { return true; }
+    WCHAR *GetPageLabel(int pageNo) const override {
+        if (pageNo < 1 || pageNo > PageCount())
+            return BaseEngine::GetPageLabel(pageNo);
+        return str::Dup(pages.At(pageNo - 1));
+    }
+    int GetPageByLabel(const WCHAR *label) const override { return pages.Find(label) + 1; }
+
+    bool BenchLoadPage(int pageNo) override { UNUSED(pageNo); return false; }
+
+    bool Load(const WCHAR *fileName);
+};
+
+bool ChmTopicsEngine::Load(const WCHAR *fileName)
+{
+    this->fileName.Set(str::Dup(fileName));
+    doc = ChmDoc::CreateFromFile(fileName);
+    if (!doc)
+        return false;
+
+    // number the topics exactly as ChmModel::Load does
+    pages.Append(str::conv::FromAnsi(doc->GetHomePath()));
+    Vec<ChmTocTraceItem> tocTrace;
+    PoolAllocator allocator;
+    ChmTocBuilder tmpTocBuilder(doc, &pages, &tocTrace, &allocator);
+    doc->ParseToc(&tmpTocBuilder);
+
+    // followed by all the remaining HTML files
+    ScopedPtr<Vec<char *>> paths(doc->GetAllPaths());
+    for (size_t i = 0; i < paths->Count(); i++) {
+        char *path = paths->At(i);
+        if (!str::EndsWithI(path, ".htm") && !str::EndsWithI(path, ".html"))
+            continue;
+        if (*path == '/')
+            path++;
+        ScopedMem<WCHAR> url(str::conv::FromUtf8(path));
+        if (-1 == pages.FindI(url))
+            pages.Append(url.StealData());
+    }
+    paths->FreeMembers();
+    return pages.Count() > 0;
+}
+
+WCHAR *ChmTopicsEngine::ExtractPageText(int pageNo, const WCHAR *lineSep, RectI **coordsOut, RenderTarget target)
+{
+    UNUSED(target);
+    if (pageNo < 1 || pageNo > PageCount())
+        return nullptr;
+
+    ScopedMem<char> path(str::conv::ToUtf8(pages.At(pageNo - 1)));
+    WCHAR *text;
+    {
+        ScopedCritSec scope(&docAccess);
+        text = doc->ExtractTopicText(path, lineSep);
+    }
+    if (!text || !coordsOut)
+        return text;
+
+    size_t len = str::Len(text), sepLen = str::Len(lineSep);
+    RectI *coords = AllocArray<RectI>(len + 1);
+    if (!coords)
+        return text;
+    int line = 0, col = 0;
+    for (size_t i = 0; i < len; ) {
+        if (sepLen > 0 && str::StartsWith(text + i, lineSep)) {
+            // line breaks are marked by empty rectangles at x == 0
+            i += sepLen;
+            line++;
+            col = 0;
+            continue;
+        }
+        coords[i++] = RectI(++col, line, 1, 1);
+    }
+    *coordsOut = coords;
+    return text;
+}
+
+BaseEngine *ChmModel::CreateTextEngine(const WCHAR *fileName)
+{
+    ChmTopicsEngine *engine = new ChmTopicsEngine();
+    if (!engine->Load(fileName)) {
+        delete engine;
+        return nullptr;
+    }
+    return engine;
+}
+
+// extracts the text of all topics in the background and saves it to indexPath
+// (or loads it from there, if it's been saved before), so that the document
+// can be searched by SearchDocument without having to parse all topics again
+void ChmModel::StartIndexing(const WCHAR *indexPath)
+{
+    if (textCache || !indexPath)
+        return;
+    textEngine = CreateTextEngine(fileName);
+    if (!textEngine)
+        return;
+    textCache = new PageTextCache(textEngine);
+    textCache->StartPrefetching(1, indexPath);
+}
+
 class ChmCacheEntry {
 public:
     const WCHAR *url; // owned by ChmModel::poolAllocator
@@ -387,22 +565,91 @@ bool ChmModel::OnBeforeNavigate(const WCHAR *url, bool newWindow)
     return true;
 }
 
+class ChmPrefetchThread : public ThreadBase {
+    ChmModel *cm;
+
+public:
+    explicit ChmPrefetchThread(ChmModel *cm) : ThreadBase("ChmPrefetchThread"), cm(cm) { }
+
+    void Run() override {
+        while (!WasCancelRequested() && cm->PrefetchNextUrl()) {
+            // docAccess is released between resources so that
+            // the HtmlWindow never has to wait for more than one
+        }
+    }
+};
+
+// caller must hold docAccess
+ChmCacheEntry *ChmModel::LoadDataForUrl(const WCHAR *plainUrl, bool prefetchResources)
+{
+    ChmCacheEntry *e = FindDataForUrl(plainUrl);
+    if (e)
+        return e;
+
+    e = new ChmCacheEntry(Allocator::StrDup(&poolAlloc, plainUrl));
+    ScopedMem<char> urlUtf8(str::conv::ToUtf8(plainUrl));
+    e->data = doc->GetData(urlUtf8, &e->size);
+    if (!e->data) {
+        delete e;
+        return nullptr;
+    }
+    urlDataCache.Append(e);
+
+    if (prefetchResources && (str::EndsWithI(plainUrl, L".htm") || str::EndsWithI(plainUrl, L".html")))
+        PrefetchTopicResources(e);
+    return e;
+}
+
+// caller must hold docAccess
+void ChmModel::PrefetchTopicResources(ChmCacheEntry *topic)
+{
+    // resources of a previously displayed topic are no longer needed
+    prefetchUrls.Reset();
+
+    ScopedMem<char> topicUtf8(str::conv::ToUtf8(topic->url));
+    Vec<char *> *paths = doc->GetTopicResources(topicUtf8, topic->data, topic->size);
+    for (char *path : *paths) {
+        ScopedMem<WCHAR> pathW(str::conv::FromUtf8(path));
+        ScopedMem<WCHAR> plainUrl(url::GetFullPath(pathW));
+        if (!FindDataForUrl(plainUrl) && !prefetchUrls.Contains(plainUrl))
+            prefetchUrls.Append(plainUrl.StealData());
+    }
+    paths->FreeMembers();
+    delete paths;
+
+    if (0 == prefetchUrls.Count() || prefetchRunning)
+        return;
+    if (prefetchThread) {
+        // the previous thread no longer needs docAccess once it's cleared prefetchRunning
+        prefetchThread->Join();
+        delete prefetchThread;
+    }
+    prefetchRunning = true;
+    prefetchThread = new ChmPrefetchThread(this);
+    prefetchThread->Start();
+}
+
+// returns false once there's nothing left to prefetch
+bool ChmModel::PrefetchNextUrl()
+{
+    ScopedCritSec scope(&docAccess);
+    if (0 == prefetchUrls.Count()) {
+        prefetchRunning = false;
+        return false;
+    }
+    ScopedMem<WCHAR> plainUrl(prefetchUrls.PopAt(0));
+    LoadDataForUrl(plainUrl, false);
+    return true;
+}
+
 // Load and cache data for a given url inside CHM file.
 const unsigned char *ChmModel::GetDataForUrl(const WCHAR *url, size_t *len)
 {
     ScopedCritSec scope(&docAccess);
     ScopedMem<WCHAR> plainUrl(url::GetFullPath(url));
-    ChmCacheEntry *e = FindDataForUrl(plainUrl);
-    if (!e) {
-        e = new ChmCacheEntry(Allocator::StrDup(&poolAlloc, plainUrl));
-        ScopedMem<char> urlUtf8(str::conv::ToUtf8(plainUrl));
-        e->data = doc->GetData(urlUtf8, &e->size);
-        if (!e->data) {
-            delete e;
-            return nullptr;
-        }
-        urlDataCache.Append(e);
-    }
+    ChmCacheEntry *e = LoadDataForUrl(plainUrl);
+    if (!e)
+        return nullptr;
     if (len)
         *len = e->size;
     return e->data;
@@ -6,6 +6,8 @@ struct ChmTocTraceItem;
 class HtmlWindow;
 class HtmlWindowCallback;
 class ChmCacheEntry;
+class ChmPrefetchThread;
+class PageTextCache;
 
 class ChmModel : public Controller {
 public:
@@ -54,6 +56,9 @@ public:
 
     static bool IsSupportedFile(const WCHAR *fileName, bool sniff=false);
     static ChmModel *Create(const WCHAR *fileName, ControllerCallback *cb=nullptr);
+    // creates an engine which only extracts the text of a document's topics
+    // (for searching it; the page labels are the topics' paths)
+    static BaseEngine *CreateTextEngine(const WCHAR *fileName);
 
 public:
     // the following is specific to ChmModel
@@ -67,6 +72,10 @@ public:
     void CopySelection();
     LRESULT PassUIMsg(UINT msg, WPARAM wParam, LPARAM lParam);
 
+    // for showing a topic returned as page label by CreateTextEngine's engine
+    void GoToTopic(const WCHAR *url) { DisplayPage(url); }
+    void StartIndexing(const WCHAR *indexPath);
+
     // for HtmlWindowCallback (called through htmlWindowCb)
     bool OnBeforeNavigate(const WCHAR *url, bool newWindow);
     void OnDocumentComplete(const WCHAR *url);
@@ -91,10 +100,26 @@ protected:
     // is deleted (e.g. for titles and URLs for ChmTocItem and ChmCacheEntry)
     PoolAllocator poolAlloc;
 
+    // resources of the current topic which are loaded into urlDataCache
+    // in the background before the HtmlWindow asks for them
+    // (access is protected by docAccess)
+    WStrVec prefetchUrls;
+    ChmPrefetchThread *prefetchThread;
+    bool prefetchRunning;
+
+    // builds the text index for searching all topics (cf. StartIndexing)
+    BaseEngine *textEngine;
+    PageTextCache *textCache;
+
     bool Load(const WCHAR *fileName);
     void DisplayPage(const WCHAR *pageUrl);
 
     ChmCacheEntry *FindDataForUrl(const WCHAR *url);
+    ChmCacheEntry *LoadDataForUrl(const WCHAR *plainUrl, bool prefetchResources=true);
+    void PrefetchTopicResources(ChmCacheEntry *topic);
+    bool PrefetchNextUrl();
+
+    friend class ChmPrefetchThread;
 
     void ZoomTo(float zoomLevel);
 };
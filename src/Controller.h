@@ -18,10 +18,18 @@ public:
     virtual void GotoLink(PageDestination *dest) = 0;
     // DisplayModel //
     virtual void Repaint() = 0;
+    // like Repaint, for when only the view port has moved since the last repaint
+    virtual void RepaintScrolled() = 0;
     virtual void UpdateScrollbars(SizeI canvas) = 0;
     virtual void RequestRendering(int pageNo) = 0;
+    // render the pages next to pageNo ahead of time and keep them
+    // cached while pageNo is shown in presentation mode
+    virtual void RequestPresentationRendering(int pageNo) = 0;
     virtual void CleanUp(DisplayModel *dm) = 0;
     virtual void RenderThumbnail(DisplayModel *dm, SizeI size, const std::function<void(RenderedBitmap*)>&) = 0;
+    // tell the UI that more exact page sizes are available (cf. DisplayModel::UpdatePageMediaboxes)
+    // note: called from a background thread
+    virtual void HandleLoadedMediaboxes(DisplayModel *dm) = 0;
     // ChmModel //
     // tell the UI to move focus back to the main window
     // (if always == false, then focus is only moved if it's inside
@@ -742,3 +742,125 @@ void UninstallCrashHandler()
     free(gModulesInfo);
     delete gCrashHandlerAllocator;
 }
+
+// how often the watchdog pings the UI thread
+#define HANG_PING_INTERVAL_MS   1000
+#define HANG_DETECTOR_CLASS     L"SUMATRA_PDF_HANG_DETECTOR"
+
+static HWND     gHangDetectorHwnd = nullptr;
+static HANDLE   gHangDetectorThread = nullptr;
+static HANDLE   gHangDetectorStop = nullptr;
+static WCHAR *  gHangLogPath = nullptr;
+static DWORD    gHangTimeoutMs = 0;
+static DWORD    gUiThreadId = 0;
+// only set from the UI thread, read by the watchdog when reporting a hang
+static const char * volatile gHangOperation = nullptr;
+
+ScopedHangOperation::ScopedHangOperation(const char *name) : prevName(gHangOperation)
+{
+    gHangOperation = name;
+}
+
+ScopedHangOperation::~ScopedHangOperation()
+{
+    gHangOperation = prevName;
+}
+
+static void AppendToHangLog(str::Str<char>& s)
+{
+    HANDLE h = CreateFile(gHangLogPath, FILE_APPEND_DATA, FILE_SHARE_READ, nullptr,
+                          OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (INVALID_HANDLE_VALUE == h)
+        return;
+    DWORD written;
+    WriteFile(h, s.Get(), (DWORD)s.Size(), &written, nullptr);
+    CloseHandle(h);
+}
+
+static void ReportHang(const char *operation)
+{
+    SYSTEMTIME now;
+    GetLocalTime(&now);
+    str::Str<char> s;
+    s.AppendFmt("\r\n%04d-%02d-%02d %02d:%02d:%02d UI thread didn't respond within %d ms (%s)\r\n",
+                now.wYear, now.wMonth, now.wDay, now.wHour, now.wMinute, now.wSecond,
+                (int)gHangTimeoutMs, CURR_VERSION_STRA);
+    s.AppendFmt("Operation: %s\r\n", operation ? operation : "unknown");
+    if (gSymbolPathW && dbghelp::Initialize(gSymbolPathW, false))
+        dbghelp::GetThreadCallstack(s, gUiThreadId);
+    AppendToHangLog(s);
+}
+
+static DWORD WINAPI HangDetectorThread(LPVOID data)
+{
+    UNUSED(data);
+    DWORD hangStart = 0;
+    while (WaitForSingleObject(gHangDetectorStop, HANG_PING_INTERVAL_MS) == WAIT_TIMEOUT) {
+        // don't report time spent at breakpoints
+        if (IsDebuggerPresent())
+            continue;
+        // the operation which might be about to block the UI thread
+        const char *operation = gHangOperation;
+        DWORD_PTR res;
+        if (SendMessageTimeout(gHangDetectorHwnd, WM_NULL, 0, 0, SMTO_NORMAL, gHangTimeoutMs, &res)) {
+            if (hangStart) {
+                str::Str<char> s;
+                s.AppendFmt("UI thread responded again after about %d ms\r\n", (int)(GetTickCount() - hangStart));
+                AppendToHangLog(s);
+                hangStart = 0;
+            }
+            continue;
+        }
+        if (GetLastError() != ERROR_TIMEOUT)
+            break;
+        // only report the same hang once
+        if (hangStart)
+            continue;
+        hangStart = GetTickCount() - gHangTimeoutMs;
+        ReportHang(gHangOperation ? gHangOperation : operation);
+    }
+    return 0;
+}
+
+void StartHangDetector(const WCHAR *hangLogPath, DWORD timeoutMs)
+{
+    CrashIf(gHangDetectorThread);
+    if (!hangLogPath || gHangDetectorThread)
+        return;
+
+    WNDCLASSEX wcex = { 0 };
+    wcex.cbSize = sizeof(WNDCLASSEX);
+    wcex.lpfnWndProc = DefWindowProc;
+    wcex.hInstance = GetModuleHandle(nullptr);
+    wcex.lpszClassName = HANG_DETECTOR_CLASS;
+    RegisterClassEx(&wcex);
+    gHangDetectorHwnd = CreateWindow(HANG_DETECTOR_CLASS, L"", 0, 0, 0, 0, 0,
+                                     HWND_MESSAGE, nullptr, GetModuleHandle(nullptr), nullptr);
+    if (!gHangDetectorHwnd)
+        return;
+
+    gHangLogPath = str::Dup(hangLogPath);
+    gHangTimeoutMs = timeoutMs;
+    gUiThreadId = GetCurrentThreadId();
+    gHangDetectorStop = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    gHangDetectorThread = CreateThread(nullptr, 0, HangDetectorThread, nullptr, 0, 0);
+}
+
+void StopHangDetector()
+{
+    if (!gHangDetectorThread)
+        return;
+    SetEvent(gHangDetectorStop);
+    // the watchdog might be waiting for the UI thread (i.e. for us) to answer a ping
+    MSG msg;
+    while (WaitForSingleObject(gHangDetectorThread, 0) == WAIT_TIMEOUT) {
+        MsgWaitForMultipleObjects(1, &gHangDetectorThread, FALSE, INFINITE, QS_SENDMESSAGE);
+        PeekMessage(&msg, nullptr, 0, 0, PM_NOREMOVE);
+    }
+    CloseHandle(gHangDetectorThread);
+    CloseHandle(gHangDetectorStop);
+    gHangDetectorThread = gHangDetectorStop = nullptr;
+    DestroyWindow(gHangDetectorHwnd);
+    gHangDetectorHwnd = nullptr;
+    str::ReplacePtr(&gHangLogPath, nullptr);
+}
@@ -4,3 +4,18 @@
 void InstallCrashHandler(const WCHAR *crashDumpPath, const WCHAR *symDir);
 void SubmitCrashInfo();
 void UninstallCrashHandler();
+
+// pings the UI thread's message loop from a watchdog thread and appends the UI
+// thread's callstack to hangLogPath whenever it doesn't respond within timeoutMs
+// (must be called from the UI thread after InstallCrashHandler)
+void StartHangDetector(const WCHAR *hangLogPath, DWORD timeoutMs);
+void StopHangDetector();
+
+// names the operation the UI thread is busy with for hang reports
+// (name must be a static string)
+class ScopedHangOperation {
+    const char *prevName;
+public:
+    explicit ScopedHangOperation(const char *name);
+    ~ScopedHangOperation();
+};
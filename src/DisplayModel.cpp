@@ -45,6 +45,8 @@
 
 // utils
 #include "BaseUtil.h"
+#include "ThreadUtil.h"
+#include "Timer.h"
 #include "WinUtil.h"
 // rendering engines
 #include "BaseEngine.h"
@@ -57,10 +59,159 @@
 #include "PdfSync.h"
 #include "TextSelection.h"
 #include "TextSearch.h"
+// ui
+#include "PerfStats.h"
 
 // if true, we pre-render the pages right before and after the visible pages
+// (and the ones scrolling is about to reach)
 static bool gPredictiveRender = true;
 
+// for DisplayModel::documentId
+static int gNextDocumentId = 0;
+
+// how far ahead (in ms) the scroll velocity is used to predict the view port
+#define SCROLL_PREDICTION_MS        300
+// scroll velocity is reset if there's been no scrolling for this long (in ms)
+#define SCROLL_VELOCITY_TIMEOUT_MS  250
+// scrolling faster than this (in pixels per ms) counts as fast scrolling
+#define FAST_SCROLL_VELOCITY        2.0f
+// at most this many predicted pages are requested beyond the visible ones
+#define MAX_PREDICTED_PAGES         4
+
+// number of pages before and after the start page which are always laid out
+// with their exact mediabox (all others might start out with an estimate)
+#define EXACT_LAYOUT_PAGES      8
+// minimum interval (in ms) between layout updates from the MediaboxLoader
+#define MEDIABOX_UPDATE_DELAY   250
+// time (in ms) to wait for more data from progressively loaded documents
+#define PROGRESSIVE_RETRY_DELAY 500
+// maximum number of threads determining the page sizes of image collections
+// in parallel (which is mostly I/O bound, unlike for other documents)
+#define MAX_MEDIABOX_WORKERS    4
+
+struct ResolvedMediabox {
+    int pageNo;
+    RectD mediabox;
+};
+
+// determines the mediaboxes of all pages that were laid out
+// with an estimated size (cf. DisplayModel::BuildPagesInfo)
+// and keeps asking for updates while a document is loaded progressively
+class MediaboxLoader : public ThreadBase {
+    friend class MediaboxWorker;
+
+    BaseEngine *engine;
+    DisplayModel *dm;
+    ControllerCallback *cb;
+    int startPageNo;
+    ScopedMem<bool> estimated;
+    // index of the next page to visit (shared between all workers)
+    LONG nextVisit;
+
+    CRITICAL_SECTION access;
+    Vec<ResolvedMediabox> resolved;
+
+    bool ResolvePages(bool stillLoading);
+
+public:
+    // whether the document was still being loaded when layout started
+    bool progressive;
+
+    MediaboxLoader(BaseEngine *engine, DisplayModel *dm, ControllerCallback *cb, int startPageNo, bool *estimated) :
+        ThreadBase("MediaboxLoader"), engine(engine), dm(dm), cb(cb),
+        startPageNo(startPageNo), estimated(estimated), nextVisit(0),
+        progressive(engine->IsLoadingProgressively()) {
+        InitializeCriticalSection(&access);
+    }
+    virtual ~MediaboxLoader() { DeleteCriticalSection(&access); }
+
+    virtual void Run() override;
+
+    void TakeResolved(Vec<ResolvedMediabox>& result) {
+        ScopedCritSec scope(&access);
+        result.Append(resolved.LendData(), resolved.Count());
+        resolved.Reset();
+    }
+};
+
+// helps a MediaboxLoader with resolving the pages of an image collection
+class MediaboxWorker : public ThreadBase {
+    MediaboxLoader *loader;
+
+public:
+    explicit MediaboxWorker(MediaboxLoader *loader) : ThreadBase("MediaboxWorker"), loader(loader) { }
+    virtual void Run() override {
+        SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+        loader->ResolvePages(false);
+    }
+};
+
+// returns false if cancelled
+// (may be called by several workers at once, each resolving different pages)
+bool MediaboxLoader::ResolvePages(bool stillLoading)
+{
+    int pageCount = engine->PageCount();
+    DWORD lastUpdate = GetTickCount();
+    // visit startPageNo, startPageNo + 1, startPageNo - 1, startPageNo + 2, ...
+    for (int i; (i = InterlockedIncrement(&nextVisit) - 1) < 2 * pageCount && !WasCancelRequested(); ) {
+        int pageNo = startPageNo + (i % 2 ? (i + 1) / 2 : -(i / 2));
+        if (pageNo < 1 || pageNo > pageCount || !estimated[pageNo-1])
+            continue;
+        ResolvedMediabox item = { pageNo, engine->PageMediabox(pageNo) };
+        // the page's data might not have arrived yet
+        if (item.mediabox.IsEmpty() && stillLoading)
+            continue;
+        estimated[pageNo-1] = false;
+        ScopedCritSec scope(&access);
+        resolved.Append(item);
+        if (GetTickCount() - lastUpdate >= MEDIABOX_UPDATE_DELAY) {
+            cb->HandleLoadedMediaboxes(dm);
+            lastUpdate = GetTickCount();
+        }
+    }
+    if (WasCancelRequested())
+        return false;
+    cb->HandleLoadedMediaboxes(dm);
+    return true;
+}
+
+void MediaboxLoader::Run()
+{
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+
+    if (!progressive) {
+        // the sizes of images can be determined independently of each other
+        Vec<MediaboxWorker *> workers;
+        if (engine->IsImageCollection()) {
+            SYSTEM_INFO si;
+            GetSystemInfo(&si);
+            int count = limitValue((int)si.dwNumberOfProcessors, 1, MAX_MEDIABOX_WORKERS);
+            for (int i = 1; i < count; i++) {
+                MediaboxWorker *worker = new MediaboxWorker(this);
+                workers.Append(worker);
+                worker->Start();
+            }
+        }
+        ResolvePages(false);
+        for (MediaboxWorker *worker : workers) {
+            worker->Join();
+            delete worker;
+        }
+        return;
+    }
+    // retry pages until all data has arrived (the final pass
+    // also lets the UI refresh the pages that have failed to render)
+    for (;;) {
+        bool stillLoading = engine->IsLoadingProgressively();
+        nextVisit = 0;
+        if (!ResolvePages(stillLoading) || !stillLoading)
+            break;
+        for (int i = 0; i < PROGRESSIVE_RETRY_DELAY / 50 && !WasCancelRequested(); i++) {
+            Sleep(50);
+        }
+    }
+}
+
 static int ColumnsFromDisplayMode(DisplayMode displayMode)
 {
     if (!IsSingle(displayMode))
@@ -113,8 +264,12 @@ SizeD DisplayModel::PageSizeAfterRotation(int pageNo, bool fitToContent) const
             return PageSizeAfterRotation(pageNo);
     }
 
-    RectD box = fitToContent ? pageInfo->contentBox : pageInfo->page;
-    return engine->Transform(box, pageNo, 1.0, rotation).Size();
+    SizeD& size = fitToContent ? pageInfo->rotatedContentSize : pageInfo->rotatedSize;
+    if (size.IsEmpty()) {
+        RectD box = fitToContent ? pageInfo->contentBox : pageInfo->page;
+        size = engine->Transform(box, pageNo, 1.0, rotation).Size();
+    }
+    return size;
 }
 
 /* given 'columns' and an absolute 'pageNo', return the number of the first
@@ -144,26 +299,45 @@ static int LastPageInARowNo(int pageNo, int columns, bool showCover, int pageCou
     return std::min(lastPageNo, pageCount);
 }
 
+// parses the RenderQuality setting ("fast", "balanced" or "print")
+static RenderQuality ParseRenderQuality(const char *s)
+{
+    if (str::EqI(s, "fast"))
+        return Quality_FastScroll;
+    if (str::EqI(s, "print"))
+        return Quality_Print;
+    return Quality_Balanced;
+}
+
 // must call SetInitialViewSettings() after creation
 DisplayModel::DisplayModel(BaseEngine *engine, EngineType type, ControllerCallback *cb) :
     Controller(cb), engine(engine),
-    userAnnots(nullptr), userAnnotsModified(false), engineType(type), pdfSync(nullptr),
-    pagesInfo(nullptr), displayMode(DM_AUTOMATIC), startPage(1),
+    userAnnots(nullptr), userAnnotsModified(false), documentId(++gNextDocumentId),
+    engineType(type), pdfSync(nullptr),
+    pagesInfo(nullptr), visibleStart(0), visibleEnd(0),
+    scrollVelocity(0), lastScrollTime(0),
+    predictedFirst(INVALID_PAGE_NO), predictedLast(INVALID_PAGE_NO),
+    displayMode(DM_AUTOMATIC), startPage(1),
     zoomReal(INVALID_ZOOM), zoomVirtual(INVALID_ZOOM),
     rotation(0), dpiFactor(1.0f), displayR2L(false),
     presentationMode(false), presZoomVirtual(INVALID_ZOOM),
     presDisplayMode(DM_AUTOMATIC), navHistoryIx(0),
-    dontRenderFlag(false)
+    dontRenderFlag(false), renderQuality(Quality_Balanced), fastScrollRendering(false),
+    mediaboxLoader(nullptr)
 {
     CrashIf(!engine || engine->PageCount() <= 0);
 
     if (!engine->IsImageCollection()) {
         windowMargin = gGlobalPrefs->fixedPageUI.windowMargin;
         pageSpacing = gGlobalPrefs->fixedPageUI.pageSpacing;
+        renderQuality = ParseRenderQuality(gGlobalPrefs->fixedPageUI.renderQuality);
+        fastScrollRendering = gGlobalPrefs->fixedPageUI.fastScrollRendering;
     }
     else {
         windowMargin = gGlobalPrefs->comicBookUI.windowMargin;
         pageSpacing = gGlobalPrefs->comicBookUI.pageSpacing;
+        renderQuality = ParseRenderQuality(gGlobalPrefs->comicBookUI.renderQuality);
+        fastScrollRendering = gGlobalPrefs->comicBookUI.fastScrollRendering;
     }
 #ifdef DRAW_PAGE_SHADOWS
     windowMargin.top += 3; windowMargin.bottom += 5;
@@ -174,6 +348,9 @@ DisplayModel::DisplayModel(BaseEngine *engine, EngineType type, ControllerCallba
     textCache = new PageTextCache(engine);
     textSelection = new TextSelection(engine, textCache);
     textSearch = new TextSearch(engine, textCache);
+    // cf. CanRenderWithClone in RenderCache.cpp
+    if (Engine_PDF == engineType || Engine_XPS == engineType)
+        textSearch->EnableParallelSearch();
 }
 
 DisplayModel::~DisplayModel()
@@ -181,6 +358,12 @@ DisplayModel::~DisplayModel()
     dontRenderFlag = true;
     cb->CleanUp(this);
 
+    if (mediaboxLoader) {
+        mediaboxLoader->RequestCancel();
+        mediaboxLoader->Join();
+        delete mediaboxLoader;
+    }
+
     delete pdfSync;
     delete userAnnots;
     delete textSearch;
@@ -196,7 +379,13 @@ PageInfo *DisplayModel::GetPageInfo(int pageNo) const
         return nullptr;
     assert(pagesInfo);
     if (!pagesInfo) return nullptr;
-    return &(pagesInfo[pageNo-1]);
+    PageInfo *pageInfo = &(pagesInfo[pageNo-1]);
+    // RecalcVisibleParts() only updates pageOnScreen for visible pages
+    if (pageInfo->shown) {
+        pageInfo->pageOnScreen = pageInfo->pos;
+        pageInfo->pageOnScreen.Offset(-visibleOffset.x, -visibleOffset.y);
+    }
+    return pageInfo;
 }
 
 // Call this before the first Relayout
@@ -224,17 +413,44 @@ void DisplayModel::SetInitialViewSettings(DisplayMode newDisplayMode, int newSta
     BuildPagesInfo();
 }
 
+void DisplayModel::SetScreenDpi(int screenDPI)
+{
+    float newDpiFactor = 1.0f * screenDPI / engine->GetFileDPI();
+    if (newDpiFactor == dpiFactor)
+        return;
+    // the tiles rendered for the previous DPI remain in the cache and are
+    // painted scaled until they've been replaced (cf. RenderCache::PaintTile)
+    ScrollState ss = GetScrollState();
+    dpiFactor = newDpiFactor;
+    Relayout(zoomVirtual, rotation);
+    SetScrollState(ss);
+}
+
+// layout pages with an empty mediabox as A4 size (resp. letter size)
+static RectD GetDefaultPageRect(BaseEngine *engine)
+{
+    if (0 == GetMeasurementSystem())
+        return RectD(0, 0, 21.0 / 2.54 * engine->GetFileDPI(), 29.7 / 2.54 * engine->GetFileDPI());
+    return RectD(0, 0, 8.5 * engine->GetFileDPI(), 11 * engine->GetFileDPI());
+}
+
 void DisplayModel::BuildPagesInfo()
 {
-    AssertCrash(!pagesInfo);
+    AssertCrash(!pagesInfo && !mediaboxLoader);
     int pageCount = PageCount();
     pagesInfo = AllocArray<PageInfo>(pageCount);
 
-    RectD defaultRect;
-    if (0 == GetMeasurementSystem())
-        defaultRect = RectD(0, 0, 21.0 / 2.54 * engine->GetFileDPI(), 29.7 / 2.54 * engine->GetFileDPI());
-    else
-        defaultRect = RectD(0, 0, 8.5 * engine->GetFileDPI(), 11 * engine->GetFileDPI());
+    RectD defaultRect = GetDefaultPageRect(engine);
+    // pages whose mediabox can't be determined quickly are laid out
+    // with the start page's size until the MediaboxLoader has got to them
+    RectD estimate = engine->PageMediabox(startPage);
+    if (estimate.IsEmpty())
+        estimate = defaultRect;
+    ScopedMem<bool> estimated(AllocArray<bool>(pageCount));
+    bool hasEstimates = false;
+    // for progressively loaded documents, pages that haven't arrived yet
+    // (including the ones around the start page) are estimated as well
+    bool progressive = engine->IsLoadingProgressively();
 
     int columns = ColumnsFromDisplayMode(displayMode);
     int newStartPage = startPage;
@@ -242,8 +458,16 @@ void DisplayModel::BuildPagesInfo()
         newStartPage--;
     for (int pageNo = 1; pageNo <= pageCount; pageNo++) {
         PageInfo *pageInfo = GetPageInfo(pageNo);
-        pageInfo->page = engine->PageMediabox(pageNo);
-        // layout pages with an empty mediabox as A4 size (resp. letter size)
+        if (abs(pageNo - startPage) <= EXACT_LAYOUT_PAGES) {
+            pageInfo->page = engine->PageMediabox(pageNo);
+        }
+        else {
+            pageInfo->page = engine->QuickPageMediabox(pageNo);
+        }
+        if (pageInfo->page.IsEmpty() && (abs(pageNo - startPage) > EXACT_LAYOUT_PAGES || progressive)) {
+            pageInfo->page = estimate;
+            estimated[pageNo-1] = hasEstimates = true;
+        }
         if (pageInfo->page.IsEmpty())
             pageInfo->page = defaultRect;
         pageInfo->visibleRatio = 0.0;
@@ -253,6 +477,53 @@ void DisplayModel::BuildPagesInfo()
         else if (newStartPage <= pageNo && pageNo < newStartPage + columns)
             pageInfo->shown = true;
     }
+
+    if (hasEstimates || engine->IsLoadingProgressively()) {
+        mediaboxLoader = new MediaboxLoader(engine, this, cb, startPage, estimated.StealData());
+        mediaboxLoader->Start();
+    }
+}
+
+// replaces estimated page sizes with the mediaboxes determined
+// by the MediaboxLoader so far (must be called on the UI thread)
+void DisplayModel::UpdatePageMediaboxes()
+{
+    if (!mediaboxLoader)
+        return;
+
+    Vec<ResolvedMediabox> resolved;
+    mediaboxLoader->TakeResolved(resolved);
+    RectD defaultRect = GetDefaultPageRect(engine);
+    bool changed = false;
+    for (size_t i = 0; i < resolved.Count(); i++) {
+        PageInfo *pageInfo = GetPageInfo(resolved.At(i).pageNo);
+        RectD mediabox = resolved.At(i).mediabox;
+        if (mediabox.IsEmpty())
+            mediabox = defaultRect;
+        if (pageInfo->page != mediabox) {
+            pageInfo->page = mediabox;
+            pageInfo->contentBox = RectD();
+            pageInfo->rotatedSize = pageInfo->rotatedContentSize = SizeD();
+            changed = true;
+        }
+    }
+    // before the first Relayout, there's no position to preserve
+    if (INVALID_ZOOM == zoomVirtual)
+        return;
+    if (!changed) {
+        // pages which failed to render before their data arrived are rendered again
+        if (mediaboxLoader->progressive)
+            RepaintDisplay();
+        return;
+    }
+
+    ScrollState ss = GetScrollState();
+    Relayout(zoomVirtual, rotation);
+    // when fitting to content, let GoToPage do the necessary scrolling
+    if (zoomVirtual != ZOOM_FIT_CONTENT)
+        SetScrollState(ss);
+    else
+        GoToPage(ss.page, 0);
 }
 
 // TODO: a better name e.g. ShouldShow() to better distinguish between
@@ -284,7 +555,22 @@ bool DisplayModel::PageVisibleNearby(int pageNo) const
         if (ValidPageNo(i) && PageVisible(i))
             return true;
     }
-    return false;
+    // pages predicted to become visible soon shouldn't be discarded either
+    return predictedFirst <= pageNo && pageNo <= predictedLast;
+}
+
+int DisplayModel::GetSpreadPartner(int pageNo) const
+{
+    DisplayMode mode = GetDisplayMode();
+    int columns = ColumnsFromDisplayMode(mode);
+    if (columns < 2 || !ValidPageNo(pageNo))
+        return 0;
+
+    int first = FirstPageInARowNo(pageNo, columns, IsBookView(mode));
+    int last = LastPageInARowNo(pageNo, columns, IsBookView(mode), PageCount());
+    if (first == last)
+        return 0;
+    return pageNo == first ? last : first;
 }
 
 /* Return true if the first page is fully visible and alone on a line in
@@ -375,7 +661,9 @@ int DisplayModel::FirstVisiblePageNo() const
     assert(pagesInfo);
     if (!pagesInfo) return INVALID_PAGE_NO;
 
-    for (int pageNo = 1; pageNo <= PageCount(); ++pageNo) {
+    // shownPages is in layout order, i.e. sorted by page number
+    for (size_t i = visibleStart; i < visibleEnd; i++) {
+        int pageNo = shownPages.At(i);
         PageInfo *pageInfo = GetPageInfo(pageNo);
         if (pageInfo->visibleRatio > 0.0)
             return pageNo;
@@ -398,7 +686,8 @@ int DisplayModel::CurrentPageNo() const
     int mostVisiblePage = INVALID_PAGE_NO;
     float ratio = 0;
 
-    for (int pageNo = 1; pageNo <= PageCount(); pageNo++) {
+    for (size_t i = visibleStart; i < visibleEnd; i++) {
+        int pageNo = shownPages.At(i);
         PageInfo *pageInfo = GetPageInfo(pageNo);
         if (pageInfo->visibleRatio > ratio) {
             mostVisiblePage = pageNo;
@@ -475,7 +764,18 @@ void DisplayModel::Relayout(float newZoomVirtual, int newRotation)
     if (!pagesInfo)
         return;
 
-    rotation = NormalizeRotation(newRotation);
+    Timer layoutTimer;
+    newRotation = NormalizeRotation(newRotation);
+    if (newRotation != rotation) {
+        for (int pageNo = 1; pageNo <= PageCount(); pageNo++) {
+            PageInfo *pageInfo = GetPageInfo(pageNo);
+            pageInfo->rotatedSize = pageInfo->rotatedContentSize = SizeD();
+        }
+    }
+    rotation = newRotation;
+    // predictions for the previous layout no longer apply
+    scrollVelocity = 0;
+    predictedFirst = predictedLast = INVALID_PAGE_NO;
 
     bool needHScroll = false;
     bool needVScroll = false;
@@ -643,7 +943,25 @@ RestartLayout:
         }
     }
 
+    shownPages.Reset();
+    shownPagesBottom.Reset();
+    int maxBottom = INT_MIN;
+    for (int pageNo = 1; pageNo <= PageCount(); ++pageNo) {
+        PageInfo *pageInfo = GetPageInfo(pageNo);
+        if (!pageInfo->shown)
+            continue;
+        CrashIf(shownPages.Count() > 0 && pageInfo->pos.y < GetPageInfo(shownPages.Last())->pos.y);
+        maxBottom = std::max(maxBottom, pageInfo->pos.y + pageInfo->pos.dy);
+        shownPages.Append(pageNo);
+        shownPagesBottom.Append(maxBottom);
+    }
+    // visibility might have been changed for any page, so have
+    // RecalcVisibleParts() reset all of them once
+    visibleStart = 0;
+    visibleEnd = shownPages.Count();
+
     canvasSize = SizeI(std::max(canvasDx, viewPort.dx), std::max(canvasDy, viewPort.dy));
+    perfstats::Record(PerfStat_LayoutTime, engineType, layoutTimer.Stop());
 }
 
 void DisplayModel::ChangeStartPage(int newStartPage)
@@ -679,39 +997,55 @@ void DisplayModel::RecalcVisibleParts()
     if (!pagesInfo)
         return;
 
-    for (int pageNo = 1; pageNo <= PageCount(); ++pageNo) {
-        PageInfo *pageInfo = GetPageInfo(pageNo);
-        if (!pageInfo->shown) {
-            assert(0.0 == pageInfo->visibleRatio);
-            continue;
-        }
+    // pages outside of the previously visible range are already invisible
+    for (size_t i = visibleStart; i < visibleEnd; i++) {
+        pagesInfo[shownPages.At(i) - 1].visibleRatio = 0.0;
+    }
 
+    visibleOffset = viewPort.TL();
+    visibleStart = FirstShownPageReaching(viewPort.y);
+    for (visibleEnd = visibleStart; visibleEnd < shownPages.Count(); visibleEnd++) {
+        PageInfo *pageInfo = GetPageInfo(shownPages.At(visibleEnd));
         RectI pageRect = pageInfo->pos;
+        if (pageRect.y >= viewPort.y + viewPort.dy)
+            break;
         RectI visiblePart = pageRect.Intersect(viewPort);
 
-        pageInfo->visibleRatio = 0.0;
         if (!visiblePart.IsEmpty()) {
             assert(pageRect.dx > 0 && pageRect.dy > 0);
             // calculate with floating point precision to prevent an integer overflow
             pageInfo->visibleRatio = 1.0f * visiblePart.dx * visiblePart.dy / ((float)pageRect.dx * pageRect.dy);
         }
-        pageInfo->pageOnScreen = pageRect;
-        pageInfo->pageOnScreen.Offset(-viewPort.x, -viewPort.y);
     }
 }
 
+// returns the index into shownPages of the first page (in layout order)
+// which might extend down to y (or shownPages.Count(), if there's none)
+size_t DisplayModel::FirstShownPageReaching(int y) const
+{
+    size_t lo = 0, hi = shownPagesBottom.Count();
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (shownPagesBottom.At(mid) < y)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
 int DisplayModel::GetPageNoByPoint(PointI pt)
 {
     // no reasonable answer possible, if zoom hasn't been set yet
     if (zoomReal <= 0)
         return -1;
 
-    for (int pageNo = 1; pageNo <= PageCount(); ++pageNo) {
+    int y = pt.y + visibleOffset.y;
+    for (size_t i = FirstShownPageReaching(y); i < shownPages.Count(); i++) {
+        int pageNo = shownPages.At(i);
         PageInfo *pageInfo = GetPageInfo(pageNo);
-        AssertCrash(0.0 == pageInfo->visibleRatio || pageInfo->shown);
-        if (!pageInfo->shown)
-            continue;
-
+        if (pageInfo->pos.y > y)
+            break;
         if (pageInfo->pageOnScreen.Contains(pt))
             return pageNo;
     }
@@ -831,7 +1165,8 @@ void DisplayModel::RenderVisibleParts()
     int firstVisiblePage = 0;
     int lastVisiblePage = 0;
 
-    for (int pageNo = 1; pageNo <= PageCount(); ++pageNo) {
+    for (size_t i = visibleStart; i < visibleEnd; i++) {
+        int pageNo = shownPages.At(i);
         PageInfo *pageInfo = GetPageInfo(pageNo);
         if (pageInfo->visibleRatio > 0.0) {
             assert(pageInfo->shown);
@@ -845,14 +1180,58 @@ void DisplayModel::RenderVisibleParts()
     if (0 == firstVisiblePage)
         return;
 
-    // rendering happens LIFO except if the queue is currently
-    // empty, so request the visible pages first and last to
-    // make sure they're rendered before the predicted pages
+    // determine the pages between the view port and where it's expected to be
+    // in SCROLL_PREDICTION_MS, if the current scroll velocity is maintained
+    predictedFirst = predictedLast = INVALID_PAGE_NO;
+    if (gPredictiveRender && scrollVelocity != 0 && IsContinuous(GetDisplayMode())) {
+        int predictedY = viewPort.y + (int)(scrollVelocity * SCROLL_PREDICTION_MS);
+        predictedY = limitValue(predictedY, 0, std::max(canvasSize.dy - viewPort.dy, 0));
+        int top = scrollVelocity > 0 ? viewPort.y + viewPort.dy : predictedY;
+        int bottom = scrollVelocity > 0 ? predictedY + viewPort.dy : viewPort.y;
+        for (size_t i = FirstShownPageReaching(top); i < shownPages.Count(); i++) {
+            int pageNo = shownPages.At(i);
+            if (GetPageInfo(pageNo)->pos.y > bottom)
+                break;
+            if (pageNo >= firstVisiblePage && pageNo <= lastVisiblePage)
+                continue;
+            if (INVALID_PAGE_NO == predictedFirst)
+                predictedFirst = pageNo;
+            predictedLast = pageNo;
+        }
+        // only look as far ahead as the rendering queue allows
+        if (scrollVelocity > 0 && predictedLast - predictedFirst >= MAX_PREDICTED_PAGES)
+            predictedLast = predictedFirst + MAX_PREDICTED_PAGES - 1;
+        else if (scrollVelocity < 0 && predictedLast - predictedFirst >= MAX_PREDICTED_PAGES)
+            predictedFirst = predictedLast - MAX_PREDICTED_PAGES + 1;
+    }
+
+    // rendering prefers tiles closest to the center of the screen
+    // but the queue is limited, so request the visible pages first
+    // and last to make sure they're not pushed out by predicted pages
     for (int pageNo = firstVisiblePage; pageNo <= lastVisiblePage; pageNo++) {
         cb->RequestRendering(pageNo);
     }
 
-    if (gPredictiveRender) {
+    if (gPredictiveRender && predictedFirst != INVALID_PAGE_NO) {
+        // request the predicted pages farthest from the view port first,
+        // so that the closer ones are rendered first
+        if (scrollVelocity > 0) {
+            for (int pageNo = predictedLast; pageNo >= predictedFirst; pageNo--) {
+                cb->RequestRendering(pageNo);
+            }
+        } else {
+            for (int pageNo = predictedFirst; pageNo <= predictedLast; pageNo++) {
+                cb->RequestRendering(pageNo);
+            }
+        }
+    }
+
+    if (gPredictiveRender && presentationMode) {
+        // make sure that the next and previous slides are already
+        // rendered (and remain cached) when changing slides
+        cb->RequestPresentationRendering(firstVisiblePage);
+    }
+    else if (gPredictiveRender) {
         // prerender two more pages in facing and book view modes
         // if the rendering queue still has place for them
         if (!IsSingle(GetDisplayMode())) {
@@ -933,6 +1312,7 @@ void DisplayModel::GoToPage(int pageNo, int scrollY, bool addNavPt, int scrollX)
 
     if (addNavPt)
         AddNavPoint();
+    scrollDelta = PointI(0, pageNo - CurrentPageNo());
 
     /* in facing mode only start at odd pages (odd because page
        numbering starts with 1, so odd is really an even page) */
@@ -1031,6 +1411,11 @@ void DisplayModel::SetDisplayMode(DisplayMode newDisplayMode, bool keepContinuou
     GoToPage(currPageNo, 0);
 }
 
+void DisplayModel::UnshareDocument()
+{
+    documentId = ++gNextDocumentId;
+}
+
 void DisplayModel::SetPresentationMode(bool enable)
 {
     presentationMode = enable;
@@ -1146,13 +1531,14 @@ bool DisplayModel::GoToFirstPage()
 void DisplayModel::ScrollXTo(int xOff)
 {
     int currPageNo = CurrentPageNo();
+    scrollDelta = PointI(xOff - viewPort.x, 0);
     viewPort.x = xOff;
     RecalcVisibleParts();
     cb->UpdateScrollbars(canvasSize);
 
     if (CurrentPageNo() != currPageNo)
         cb->PageNoChanged(this, CurrentPageNo());
-    RepaintDisplay();
+    cb->RepaintScrolled();
 }
 
 void DisplayModel::ScrollXBy(int dx)
@@ -1162,9 +1548,54 @@ void DisplayModel::ScrollXBy(int dx)
         ScrollXTo(newOffX);
 }
 
+static double GetCurrentTimeInMs()
+{
+    LARGE_INTEGER now, freq;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return now.QuadPart * 1000.0 / freq.QuadPart;
+}
+
+// keeps track of how fast (and in which direction) the document is being scrolled
+void DisplayModel::UpdateScrollVelocity(int dy)
+{
+    double time = GetCurrentTimeInMs();
+    double elapsed = time - lastScrollTime;
+    lastScrollTime = time;
+
+    float velocity = dy / (float)std::max(elapsed, 1.0);
+    if (elapsed > SCROLL_VELOCITY_TIMEOUT_MS) {
+        // a new scrolling movement, the velocity can only be
+        // estimated once the next scroll step arrives
+        scrollVelocity = 0;
+    } else if (scrollVelocity == 0 || (velocity < 0) != (scrollVelocity < 0)) {
+        // when the direction changes, don't keep predicting the old one
+        // (RenderVisibleParts then replaces the predicted pages, so that
+        // the requests for the previous ones are aborted as obsolete)
+        scrollVelocity = velocity;
+    } else {
+        scrollVelocity = (scrollVelocity + velocity) / 2;
+    }
+}
+
+bool DisplayModel::IsScrollingFast() const
+{
+    return fabs(scrollVelocity) >= FAST_SCROLL_VELOCITY && GetScrollIdleDelay() > 0;
+}
+
+UINT DisplayModel::GetScrollIdleDelay() const
+{
+    double elapsed = GetCurrentTimeInMs() - lastScrollTime;
+    if (elapsed >= SCROLL_VELOCITY_TIMEOUT_MS)
+        return 0;
+    return (UINT)(SCROLL_VELOCITY_TIMEOUT_MS - elapsed) + 1;
+}
+
 void DisplayModel::ScrollYTo(int yOff)
 {
     int currPageNo = CurrentPageNo();
+    UpdateScrollVelocity(yOff - viewPort.y);
+    scrollDelta = PointI(0, yOff - viewPort.y);
     viewPort.y = yOff;
     RecalcVisibleParts();
     RenderVisibleParts();
@@ -1172,7 +1603,7 @@ void DisplayModel::ScrollYTo(int yOff)
     int newPageNo = CurrentPageNo();
     if (newPageNo != currPageNo)
         cb->PageNoChanged(this, newPageNo);
-    RepaintDisplay();
+    cb->RepaintScrolled();
 }
 
 /* Scroll the doc in y-axis by 'dy'. If 'changePage' is TRUE, automatically
@@ -1219,6 +1650,8 @@ void DisplayModel::ScrollYBy(int dy, bool changePage)
         return;
 
     currPageNo = CurrentPageNo();
+    UpdateScrollVelocity(newYOff - currYOff);
+    scrollDelta = PointI(0, newYOff - currYOff);
     viewPort.y = newYOff;
     RecalcVisibleParts();
     RenderVisibleParts();
@@ -1226,7 +1659,7 @@ void DisplayModel::ScrollYBy(int dy, bool changePage)
     newPageNo = CurrentPageNo();
     if (newPageNo != currPageNo)
         cb->PageNoChanged(this, newPageNo);
-    RepaintDisplay();
+    cb->RepaintScrolled();
 }
 
 void DisplayModel::SetZoomVirtual(float zoomLevel, PointI *fixPt)
@@ -1367,7 +1800,7 @@ void DisplayModel::RotateBy(int newRotation)
  * into a newly allocated buffer (which the caller needs to free()). */
 WCHAR *DisplayModel::GetTextInRegion(int pageNo, RectD region)
 {
-    RectI *coords;
+    const GlyphCoords *coords;
     const WCHAR *pageText = textCache->GetData(pageNo, nullptr, &coords);
     if (str::IsEmpty(pageText))
         return nullptr;
@@ -1376,7 +1809,7 @@ WCHAR *DisplayModel::GetTextInRegion(int pageNo, RectD region)
     RectI regionI = region.Round();
     for (const WCHAR *src = pageText; *src; src++) {
         if (*src != '\n') {
-            RectI rect = coords[src - pageText];
+            RectI rect = coords->At((int)(src - pageText));
             RectI isect = regionI.Intersect(rect);
             if (!isect.IsEmpty() && 1.0 * isect.dx * isect.dy / (rect.dx * rect.dy) >= 0.3)
                 result.Append(*src);
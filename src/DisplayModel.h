@@ -13,6 +13,11 @@ struct PageInfo {
 
     /* data that is calculated when needed. actual content size within a page (View target) */
     RectD           contentBox;
+    /* data that is calculated when needed and reset when the rotation changes.
+       page and content size after rotation in document units (so that
+       Relayout() doesn't have to query the engine for every page) */
+    SizeD           rotatedSize;
+    SizeD           rotatedContentSize;
 
     /* data that needs to be set before DisplayModel::Relayout().
        Determines whether a given page should be shown on the screen. */
@@ -26,7 +31,8 @@ struct PageInfo {
 
     /* data that changes due to scrolling. Calculated in DisplayModel::RecalcVisibleParts() */
     float           visibleRatio; /* (0.0 = invisible, 1.0 = fully visible) */
-    /* position of page relative to visible view port: pos.Offset(-viewPort.x, -viewPort.y) */
+    /* position of page relative to visible view port: pos.Offset(-viewPort.x, -viewPort.y)
+       (only refreshed for visible pages, DisplayModel::GetPageInfo() updates the others) */
     RectI           pageOnScreen;
 };
 
@@ -47,6 +53,7 @@ class TextSelection;
 class TextSearch;
 struct TextSel;
 class Synchronizer;
+class MediaboxLoader;
 
 // TODO: in hindsight, zoomVirtual is not a good name since it's either
 // virtual zoom level OR physical zoom level. Would be good to find
@@ -120,6 +127,12 @@ public:
     EngineType      engineType;
     Vec<PageAnnotation> *userAnnots;
     bool            userAnnotsModified;
+    // DisplayModels with the same id show the same unmodified document
+    // and can thus use each other's cached bitmaps (cf. RenderCache::Find)
+    int             documentId;
+    void            ShareDocumentWith(DisplayModel *other) { documentId = other->documentId; }
+    // called when the document is modified through this DisplayModel
+    void            UnshareDocument();
     Synchronizer *  pdfSync;
 
     PageTextCache * textCache;
@@ -137,6 +150,8 @@ public:
     void            Relayout(float zoomVirtual, int rotation);
 
     RectI           GetViewPort() const { return viewPort; }
+    // direction of the most recent scrolling (resp. page change)
+    PointI          GetScrollDelta() const { return scrollDelta; }
     bool            NeedHScroll() const { return viewPort.dy < totalViewPortSize.dy; }
     bool            NeedVScroll() const { return viewPort.dx < totalViewPortSize.dx; }
     SizeI           GetCanvasSize() const { return canvasSize; }
@@ -144,6 +159,8 @@ public:
     bool            PageShown(int pageNo) const;
     bool            PageVisible(int pageNo) const;
     bool            PageVisibleNearby(int pageNo) const;
+    // the page shown next to pageNo in facing and book view modes (0 if there's none)
+    int             GetSpreadPartner(int pageNo) const;
     int             FirstVisiblePageNo() const;
     bool            FirstBookPageVisible() const;
     bool            LastBookPageVisible() const;
@@ -175,6 +192,8 @@ public:
     void            CopyNavHistory(DisplayModel& orig);
 
     void            SetInitialViewSettings(DisplayMode displayMode, int newStartPage, SizeI viewPort, int screenDPI);
+    // relayouts for a different screen DPI at the same virtual zoom level
+    void            SetScreenDpi(int screenDPI);
     void            SetDisplayR2L(bool r2l) { displayR2L = r2l; }
     bool            GetDisplayR2L() const { return displayR2L; }
 
@@ -185,8 +204,18 @@ public:
     /* allow resizing a window without triggering a new rendering (needed for window destruction) */
     bool            dontRenderFlag;
 
+    /* rendering profile for tiles (cf. RenderCache) and whether to switch
+       to Quality_FastScroll while the document is scrolled quickly */
+    RenderQuality   renderQuality;
+    bool            fastScrollRendering;
+    bool            IsScrollingFast() const;
+    // returns in how many ms scrolling will be considered finished (0 if it is)
+    UINT            GetScrollIdleDelay() const;
+
     bool            GetPresentationMode() const { return presentationMode; }
 
+    void            UpdatePageMediaboxes();
+
 protected:
 
     void            BuildPagesInfo();
@@ -202,11 +231,22 @@ protected:
     void            GoToPage(int pageNo, int scrollY, bool addNavPt=false, int scrollX=-1);
     bool            GoToPrevPage(int scrollY);
     int             GetPageNextToPoint(PointI pt);
+    size_t          FirstShownPageReaching(int y) const;
+    void            UpdateScrollVelocity(int dy);
 
     BaseEngine *    engine;
 
     /* an array of PageInfo, len of array is pageCount */
     PageInfo *      pagesInfo;
+    /* numbers of all shown pages in layout order (i.e. sorted by pos.y) and
+       the running maximum of their bottom edges, so that the pages within a
+       range of rows can be found with a binary search (see Relayout()) */
+    Vec<int>        shownPages;
+    Vec<int>        shownPagesBottom;
+    /* range of shownPages which RecalcVisibleParts() last found (potentially) visible */
+    size_t          visibleStart, visibleEnd;
+    /* viewPort.TL() at the time of the last call to RecalcVisibleParts() */
+    PointI          visibleOffset;
 
     DisplayMode     displayMode;
     /* In non-continuous mode is the first page from a file that we're
@@ -220,6 +260,14 @@ protected:
        part of the canvase available for content (totalViewPortSize minus scroll bars)
        (canvasSize is always at least as big as viewPort.Size()) */
     RectI           viewPort;
+    /* offset by which viewPort was last moved (only the sign is reliable) */
+    PointI          scrollDelta;
+    /* smoothed vertical scroll velocity (in pixels per ms) and the time of
+       the last vertical scroll (in ms), for predicting which pages to prerender */
+    float           scrollVelocity;
+    double          lastScrollTime;
+    /* range of pages the view port is expected to reach soon (cf. RenderVisibleParts) */
+    int             predictedFirst, predictedLast;
     /* total size of view port (draw area), including scroll bars */
     SizeI           totalViewPortSize;
 
@@ -248,6 +296,9 @@ protected:
     /* index of the "current" history entry (to be updated on navigation),
        resp. number of Back history entries */
     size_t          navHistoryIx;
+
+    /* determines the exact size of pages laid out with an estimate */
+    MediaboxLoader *mediaboxLoader;
 };
 
 int     NormalizeRotation(int rotation);
@@ -21,6 +21,9 @@
 //       DataPool::OpenFiles::global_ptr, FCPools::global_ptr
 //       cf. http://sourceforge.net/projects/djvu/forums/forum/103286/topic/3553602
 
+// pages are rendered in strips of this many rows so that rendering can be aborted
+#define DJVU_RENDER_STRIP_ROWS 256
+
 class DjVuDestination : public PageDestination {
     // the link format can be any of
     //   #[ ]<pageNo>      e.g. #1 for FirstPage and # 13 for page 13
@@ -108,6 +111,23 @@ public:
     virtual PageDestination *GetLink() { return dest; }
 };
 
+// allows ExtractPageTextLimited to stop walking huge text layers
+// and RenderBitmap to stop between rendering strips
+class DjVuAbortCookie : public AbortCookie {
+    DWORD start, timeoutMs;
+    volatile bool abort;
+
+public:
+    explicit DjVuAbortCookie(DWORD timeoutMs) :
+        start(GetTickCount()), timeoutMs(timeoutMs), abort(false) { }
+    void Abort() override { abort = true; }
+    bool ShouldStop() {
+        if (!abort && INFINITE != timeoutMs && GetTickCount() - start >= timeoutMs)
+            abort = true;
+        return abort;
+    }
+};
+
 class DjVuContext {
     bool initialized;
     ddjvu_context_t *ctx;
@@ -173,6 +193,13 @@ public:
 
 static DjVuContext gDjVuContext;
 
+// page data read directly from the file (cf. DjVuEngineImpl::LoadMediaboxes)
+struct DjVuPageData {
+    int dpi;
+    // whether the page has TXTa/TXTz chunks (or includes shared ones)
+    bool hasText;
+};
+
 class DjVuEngineImpl : public BaseEngine {
 public:
     DjVuEngineImpl();
@@ -203,6 +230,8 @@ public:
     bool SaveFileAs(const WCHAR *copyFileName, bool includeUserAnnots=false) override;
     WCHAR * ExtractPageText(int pageNo, const WCHAR *lineSep, RectI **coordsOut=nullptr,
                                     RenderTarget target=Target_View) override;
+    WCHAR * ExtractPageTextLimited(int pageNo, const WCHAR *lineSep, RectI **coordsOut,
+                                   DWORD timeoutMs, bool *partialOut, AbortCookie **cookie_out=nullptr) override;
     bool HasClipOptimizations(int pageNo) override { UNUSED(pageNo);  return false; }
     PageLayoutType PreferredLayout() override { return Layout_Single; }
 
@@ -238,38 +267,51 @@ protected:
 
     int pageCount;
     RectD *mediaboxes;
+    // nullptr if LoadMediaboxes has had to fall back to libdjvu
+    DjVuPageData *pageData;
 
     ddjvu_document_t *doc;
     miniexp_t outline;
     miniexp_t *annos;
+    // userAnnots may be accessed without gDjVuContext.lock (cf. RenderBitmap)
+    CRITICAL_SECTION annotsAccess;
     Vec<PageAnnotation> userAnnots;
     bool hasPageLabels;
 
     Vec<ddjvu_fileinfo_t> fileInfo;
 
+    char *RenderPixels(int pageNo, int rotation, RectI full, RectI screen, int bg44Chunks, bool& isBitonal,
+                       DjVuAbortCookie *cookie=nullptr);
     RenderedBitmap *CreateRenderedBitmap(const char *bmpData, SizeI size, bool grayscale) const;
     void AddUserAnnots(RenderedBitmap *bmp, int pageNo, float zoom, int rotation, RectI screen);
     bool ExtractPageText(miniexp_t item, const WCHAR *lineSep,
-                         str::Str<WCHAR>& extracted, Vec<RectI>& coords);
+                         str::Str<WCHAR>& extracted, Vec<RectI>& coords, DjVuAbortCookie *cookie);
+    WCHAR *ExtractPageText(int pageNo, const WCHAR *lineSep, RectI **coordsOut, DjVuAbortCookie *cookie);
     char *ResolveNamedDest(const char *name);
-    DjVuTocItem *BuildTocTree(miniexp_t entry, int& idCounter);
+    DjVuTocItem *BuildTocTree(miniexp_t entry, int& idCounter, PoolAllocator *allocator);
     bool Load(const WCHAR *fileName);
     bool Load(IStream *stream);
     bool FinishLoading();
     bool LoadMediaboxes();
+    bool ScanPageData(HANDLE h);
+    bool LoadCachedPageData(const WCHAR *cachePath, int64 fileSize, FILETIME modified);
+    void SaveCachedPageData(const WCHAR *cachePath, int64 fileSize, FILETIME modified);
 };
 
 DjVuEngineImpl::DjVuEngineImpl() : fileName(nullptr), stream(nullptr),
-    pageCount(0), mediaboxes(nullptr), doc(nullptr),
+    pageCount(0), mediaboxes(nullptr), pageData(nullptr), doc(nullptr),
     outline(miniexp_nil), annos(nullptr), hasPageLabels(false)
 {
+    InitializeCriticalSection(&annotsAccess);
 }
 
 DjVuEngineImpl::~DjVuEngineImpl()
 {
     ScopedCritSec scope(&gDjVuContext.lock);
+    DeleteCriticalSection(&annotsAccess);
 
     free(mediaboxes);
+    free(pageData);
     free(fileName);
 
     if (annos) {
@@ -301,11 +343,67 @@ static bool ReadBytes(HANDLE h, DWORD offset, void *buffer, DWORD count)
     return ok && res == count;
 }
 
+#define DJVU_READ_BLOCK_SIZE (256 * 1024)
+
+// LoadMediaboxes needs a few bytes from the start of every page and chunk, which are
+// read in large sequential blocks instead of one by one (which is slow over network shares)
+class DjVuFileReader {
+    HANDLE h;
+    ScopedMem<char> block;
+    DWORD blockOffset;
+    DWORD blockLen;
+
+public:
+    explicit DjVuFileReader(HANDLE h) : h(h), block((char *)malloc(DJVU_READ_BLOCK_SIZE)), blockOffset(0), blockLen(0) { }
+
+    bool Read(DWORD offset, void *buffer, DWORD count) {
+        if (!block || count > DJVU_READ_BLOCK_SIZE)
+            return ReadBytes(h, offset, buffer, count);
+        if (offset < blockOffset || offset - blockOffset + count > blockLen) {
+            blockOffset = offset;
+            blockLen = 0;
+            DWORD res = SetFilePointer(h, offset, nullptr, FILE_BEGIN);
+            if (res != offset || !ReadFile(h, block, DJVU_READ_BLOCK_SIZE, &blockLen, nullptr))
+                return false;
+            if (count > blockLen)
+                return false;
+        }
+        memcpy(buffer, block + (offset - blockOffset), count);
+        return true;
+    }
+};
+
+// the page data of documents with many pages is cached (cf. DjVuEngine::SetPageDataCache)
+#define DJVU_CACHE_MIN_PAGES 50
+#define DJVU_CACHE_MAGIC "DjVP"
+#define DJVU_CACHE_VERSION 1
+
+static WCHAR *(* gGetPageDataCachePath)(const WCHAR *filePath) = nullptr;
+
+struct DjVuPageCacheHeader {
+    char magic[4];
+    uint32 version;
+    // the cache is only valid for a file of this size and modification time
+    int64 fileSize;
+    FILETIME modified;
+    int32 pageCount;
+    int32 fileDPI;
+};
+
+struct DjVuPageCacheEntry {
+    double dx, dy;
+    int32 dpi;
+    int32 hasText;
+};
+
 #define DJVU_MARK_MAGIC 0x41542654L /* AT&T */
 #define DJVU_MARK_FORM  0x464F524DL /* FORM */
 #define DJVU_MARK_DJVM  0x444A564DL /* DJVM */
 #define DJVU_MARK_DJVU  0x444A5655L /* DJVU */
 #define DJVU_MARK_INFO  0x494E464FL /* INFO */
+#define DJVU_MARK_TXTA  0x54585461L /* TXTa */
+#define DJVU_MARK_TXTZ  0x5458547AL /* TXTz */
+#define DJVU_MARK_INCL  0x494E434CL /* INCL */
 
 #include <pshpack1.h>
 
@@ -327,21 +425,46 @@ bool DjVuEngineImpl::LoadMediaboxes()
     ScopedHandle h(file::OpenReadOnly(fileName));
     if (h == INVALID_HANDLE_VALUE)
         return false;
+
+    LARGE_INTEGER fileSize = { 0 };
+    FILETIME modified = { 0 };
+    ScopedMem<WCHAR> cachePath;
+    if (pageCount >= DJVU_CACHE_MIN_PAGES && gGetPageDataCachePath &&
+        GetFileSizeEx(h, &fileSize) && GetFileTime(h, nullptr, nullptr, &modified)) {
+        cachePath.Set(gGetPageDataCachePath(fileName));
+    }
+    if (cachePath && LoadCachedPageData(cachePath, fileSize.QuadPart, modified))
+        return true;
+
+    if (!ScanPageData(h))
+        return false;
+    if (cachePath)
+        SaveCachedPageData(cachePath, fileSize.QuadPart, modified);
+    return true;
+}
+
+bool DjVuEngineImpl::ScanPageData(HANDLE h)
+{
+    DjVuFileReader reader(h);
     char buffer[16];
     ByteReader r(buffer, sizeof(buffer));
-    if (!ReadBytes(h, 0, buffer, 16) || r.DWordBE(0) != DJVU_MARK_MAGIC || r.DWordBE(4) != DJVU_MARK_FORM)
+    if (!reader.Read(0, buffer, 16) || r.DWordBE(0) != DJVU_MARK_MAGIC || r.DWordBE(4) != DJVU_MARK_FORM)
+        return false;
+
+    ScopedMem<DjVuPageData> data(AllocArray<DjVuPageData>(pageCount));
+    if (!data)
         return false;
 
     DWORD offset = r.DWordBE(12) == DJVU_MARK_DJVM ? 16 : 4;
     for (int pages = 0; pages < pageCount; ) {
-        if (!ReadBytes(h, offset, buffer, 16))
+        if (!reader.Read(offset, buffer, 16))
             return false;
         int partLen = r.DWordBE(4);
         if (partLen < 0)
             return false;
         if (r.DWordBE(0) == DJVU_MARK_FORM && r.DWordBE(8) == DJVU_MARK_DJVU &&
             r.DWordBE(12) == DJVU_MARK_INFO) {
-            if (!ReadBytes(h, offset + 16, buffer, 14))
+            if (!reader.Read(offset + 16, buffer, 14))
                 return false;
             DjVuInfoChunk info;
             bool ok = r.UnpackBE(&info, sizeof(info), "2w6b", 4);
@@ -354,14 +477,86 @@ bool DjVuEngineImpl::LoadMediaboxes()
             mediaboxes[pages].dy = GetFileDPI() * info.height / dpi;
             if ((info.flags & 4))
                 std::swap(mediaboxes[pages].dx, mediaboxes[pages].dy);
+            data[pages].dpi = dpi;
+            // skim the page's chunk headers for a text layer so that pages
+            // without one don't have to be loaded for text extraction at all
+            for (DWORD chunk = offset + 12; chunk + 8 <= offset + 8 + partLen; ) {
+                if (!reader.Read(chunk, buffer, 8))
+                    return false;
+                DWORD id = r.DWordBE(0);
+                if (DJVU_MARK_TXTA == id || DJVU_MARK_TXTZ == id || DJVU_MARK_INCL == id) {
+                    data[pages].hasText = true;
+                    break;
+                }
+                int chunkLen = r.DWordBE(4);
+                if (chunkLen < 0)
+                    return false;
+                chunk += 8 + chunkLen + (chunkLen & 1);
+            }
             pages++;
         }
         offset += 8 + partLen + (partLen & 1);
     }
 
+    pageData = data.StealData();
     return true;
 }
 
+bool DjVuEngineImpl::LoadCachedPageData(const WCHAR *cachePath, int64 fileSize, FILETIME modified)
+{
+    size_t len;
+    ScopedMem<char> cache(file::ReadAll(cachePath, &len));
+    if (!cache || len != sizeof(DjVuPageCacheHeader) + pageCount * sizeof(DjVuPageCacheEntry))
+        return false;
+    DjVuPageCacheHeader *hdr = (DjVuPageCacheHeader *)cache.Get();
+    if (!str::EqN(hdr->magic, DJVU_CACHE_MAGIC, 4) || hdr->version != DJVU_CACHE_VERSION ||
+        hdr->fileSize != fileSize || !FileTimeEq(hdr->modified, modified) ||
+        hdr->pageCount != pageCount || hdr->fileDPI != (int32)GetFileDPI()) {
+        return false;
+    }
+
+    ScopedMem<DjVuPageData> data(AllocArray<DjVuPageData>(pageCount));
+    if (!data)
+        return false;
+    DjVuPageCacheEntry *entries = (DjVuPageCacheEntry *)(cache.Get() + sizeof(DjVuPageCacheHeader));
+    for (int i = 0; i < pageCount; i++) {
+        if (entries[i].dpi < 25 || 6000 < entries[i].dpi)
+            return false;
+        mediaboxes[i] = RectD(0, 0, entries[i].dx, entries[i].dy);
+        data[i].dpi = entries[i].dpi;
+        data[i].hasText = entries[i].hasText != 0;
+    }
+
+    pageData = data.StealData();
+    return true;
+}
+
+void DjVuEngineImpl::SaveCachedPageData(const WCHAR *cachePath, int64 fileSize, FILETIME modified)
+{
+    size_t len = sizeof(DjVuPageCacheHeader) + pageCount * sizeof(DjVuPageCacheEntry);
+    ScopedMem<char> cache(AllocArray<char>(len));
+    if (!cache)
+        return;
+    DjVuPageCacheHeader *hdr = (DjVuPageCacheHeader *)cache.Get();
+    memcpy(hdr->magic, DJVU_CACHE_MAGIC, 4);
+    hdr->version = DJVU_CACHE_VERSION;
+    hdr->fileSize = fileSize;
+    hdr->modified = modified;
+    hdr->pageCount = pageCount;
+    hdr->fileDPI = (int32)GetFileDPI();
+    DjVuPageCacheEntry *entries = (DjVuPageCacheEntry *)(cache.Get() + sizeof(DjVuPageCacheHeader));
+    for (int i = 0; i < pageCount; i++) {
+        entries[i].dx = mediaboxes[i].dx;
+        entries[i].dy = mediaboxes[i].dy;
+        entries[i].dpi = pageData[i].dpi;
+        entries[i].hasText = pageData[i].hasText;
+    }
+
+    ScopedMem<WCHAR> cacheDir(path::GetDir(cachePath));
+    if (dir::Create(cacheDir))
+        file::WriteAll(cachePath, cache, len);
+}
+
 bool DjVuEngineImpl::Load(const WCHAR *fileName)
 {
     if (!gDjVuContext.Initialize())
@@ -459,6 +654,7 @@ void DjVuEngineImpl::AddUserAnnots(RenderedBitmap *bmp, int pageNo, float zoom,
 {
     using namespace Gdiplus;
 
+    ScopedCritSec scope(&annotsAccess);
     if (!bmp || userAnnots.Count() == 0)
         return;
 
@@ -553,33 +749,72 @@ RenderedBitmap *DjVuEngineImpl::CreateRenderedBitmap(const char *bmpData, SizeI
 
 RenderedBitmap *DjVuEngineImpl::RenderBitmap(int pageNo, float zoom, int rotation, RectD *pageRect, RenderTarget target, AbortCookie **cookieOut)
 {
-    UNUSED(cookieOut); UNUSED(target);
-
-    ScopedCritSec scope(&gDjVuContext.lock);
+    DjVuAbortCookie *cookie = nullptr;
+    if (cookieOut)
+        *cookieOut = cookie = new DjVuAbortCookie(INFINITE);
 
     RectD pageRc = pageRect ? *pageRect : PageMediabox(pageNo);
     RectI screen = Transform(pageRc, pageNo, zoom, rotation).Round();
     RectI full = Transform(PageMediabox(pageNo), pageNo, zoom, rotation).Round();
     screen = full.Intersect(screen);
 
+    // when the page is heavily subsampled for display, the refinement chunks of its
+    // IW44 background don't make a visible difference and don't have to be decoded
+    int bg44Chunks = 0;
+    if (Target_View == target && pageData) {
+        float subsample = pageData[pageNo - 1].dpi / (GetFileDPI() * zoom);
+        if (subsample >= 4.0f)
+            bg44Chunks = 1;
+        else if (subsample >= 2.0f)
+            bg44Chunks = 2;
+    }
+
+    bool isBitonal;
+    ScopedMem<char> bmpData(RenderPixels(pageNo, rotation, full, screen, bg44Chunks, isBitonal, cookie));
+    if (!bmpData)
+        return nullptr;
+
+    // libdjvu is no longer involved from here on, so that other threads
+    // may already start rendering while the bitmap is being finished
+    RenderedBitmap *bmp = CreateRenderedBitmap(bmpData, screen.Size(), isBitonal);
+    AddUserAnnots(bmp, pageNo, zoom, rotation, screen);
+    return bmp;
+}
+
+// returns the rendered pixels as top-down rows in either 8-bit grayscale
+// or 24-bit BGR format (as determined by isBitonal)
+// bg44Chunks limits the number of IW44 background chunks to decode (0 for all)
+// returns nullptr if rendering is aborted through cookie
+char *DjVuEngineImpl::RenderPixels(int pageNo, int rotation, RectI full, RectI screen, int bg44Chunks, bool& isBitonal,
+                                   DjVuAbortCookie *cookie)
+{
+    // libdjvu is built without thread support (THREADMODEL=0)
+    ScopedCritSec scope(&gDjVuContext.lock);
+
+    ddjvu_set_bg44_chunk_limit(bg44Chunks);
     ddjvu_page_t *page = ddjvu_page_create_by_pageno(doc, pageNo-1);
-    if (!page)
+    if (!page) {
+        ddjvu_set_bg44_chunk_limit(0);
         return nullptr;
+    }
     int rotation4 = (((-rotation / 90) % 4) + 4) % 4;
     ddjvu_page_set_rotation(page, (ddjvu_page_rotation_t)rotation4);
 
-    while (!ddjvu_page_decoding_done(page))
+    while (!ddjvu_page_decoding_done(page) && !(cookie && cookie->ShouldStop()))
         gDjVuContext.SpinMessageLoop();
-    if (ddjvu_page_decoding_error(page))
+    ddjvu_set_bg44_chunk_limit(0);
+    if (!ddjvu_page_decoding_done(page) || ddjvu_page_decoding_error(page)) {
+        ddjvu_page_release(page);
         return nullptr;
+    }
 
-    bool isBitonal = DDJVU_PAGETYPE_BITONAL == ddjvu_page_get_type(page);
+    isBitonal = DDJVU_PAGETYPE_BITONAL == ddjvu_page_get_type(page);
     ddjvu_format_t *fmt = ddjvu_format_create(isBitonal ? DDJVU_FORMAT_GREY8 : DDJVU_FORMAT_BGR24, 0, nullptr);
     ddjvu_format_set_row_order(fmt, /* top_to_bottom */ TRUE);
     ddjvu_rect_t prect = { full.x, full.y, full.dx, full.dy };
-    ddjvu_rect_t rrect = { screen.x, 2 * full.y - screen.y + full.dy - screen.dy, screen.dx, screen.dy };
+    // ddjvu_rect_t's y axis points upwards
+    int rrectY = 2 * full.y - screen.y + full.dy - screen.dy;
 
-    RenderedBitmap *bmp = nullptr;
     int stride = ((screen.dx * (isBitonal ? 1 : 3) + 3) / 4) * 4;
     ScopedMem<char> bmpData(AllocArray<char>(stride * (screen.dy + 5)));
     if (bmpData) {
@@ -590,19 +825,30 @@ RenderedBitmap *DjVuEngineImpl::RenderBitmap(int pageNo, float zoom, int rotatio
         //       in debug builds when passing in DDJVU_RENDER_COLOR
         ddjvu_render_mode_t mode = DDJVU_RENDER_MASKONLY;
 #endif
-        if (!ddjvu_page_render(page, mode, &prect, &rrect, fmt, stride, bmpData.Get())) {
-            // nothing was rendered, leave the page blank (same as WinDjView)
-            memset(bmpData, 0xFF, stride * screen.dy);
-            isBitonal = true;
+        // render from the top down in strips, checking for an abort in between
+        for (int y = 0; y < screen.dy; y += DJVU_RENDER_STRIP_ROWS) {
+            if (cookie && cookie->ShouldStop()) {
+                bmpData.Set(nullptr);
+                break;
+            }
+            int rows = std::min(DJVU_RENDER_STRIP_ROWS, screen.dy - y);
+            ddjvu_rect_t rrect = { screen.x, rrectY + screen.dy - y - rows, screen.dx, rows };
+            if (ddjvu_page_render(page, mode, &prect, &rrect, fmt, stride, bmpData.Get() + y * stride))
+                continue;
+            if (0 == y) {
+                // nothing was rendered, leave the page blank (same as WinDjView)
+                memset(bmpData, 0xFF, stride * screen.dy);
+                isBitonal = true;
+                break;
+            }
+            memset(bmpData.Get() + y * stride, 0xFF, stride * rows);
         }
-        bmp = CreateRenderedBitmap(bmpData, screen.Size(), isBitonal);
-        AddUserAnnots(bmp, pageNo, zoom, rotation, screen);
     }
 
     ddjvu_format_release(fmt);
     ddjvu_page_release(page);
 
-    return bmp;
+    return bmpData.StealData();
 }
 
 RectD DjVuEngineImpl::PageContentBox(int pageNo, RenderTarget target)
@@ -741,8 +987,12 @@ static void AppendNewline(str::Str<WCHAR>& extracted, Vec<RectI>& coords, const
     coords.AppendBlanks(str::Len(lineSep));
 }
 
-bool DjVuEngineImpl::ExtractPageText(miniexp_t item, const WCHAR *lineSep, str::Str<WCHAR>& extracted, Vec<RectI>& coords)
+bool DjVuEngineImpl::ExtractPageText(miniexp_t item, const WCHAR *lineSep, str::Str<WCHAR>& extracted, Vec<RectI>& coords, DjVuAbortCookie *cookie)
 {
+    // stop walking the text layer, keeping what's been extracted so far
+    if (cookie && cookie->ShouldStop())
+        return true;
+
     miniexp_t type = miniexp_car(item);
     if (!miniexp_symbolp(type))
         return false;
@@ -780,7 +1030,7 @@ bool DjVuEngineImpl::ExtractPageText(miniexp_t item, const WCHAR *lineSep, str::
         item = miniexp_cdr(item);
     }
     while (miniexp_consp(str)) {
-        ExtractPageText(str, lineSep, extracted, coords);
+        ExtractPageText(str, lineSep, extracted, coords, cookie);
         item = miniexp_cdr(item);
         str = miniexp_car(item);
     }
@@ -790,33 +1040,65 @@ bool DjVuEngineImpl::ExtractPageText(miniexp_t item, const WCHAR *lineSep, str::
 WCHAR *DjVuEngineImpl::ExtractPageText(int pageNo, const WCHAR *lineSep, RectI **coordsOut, RenderTarget target)
 {
     UNUSED(target);
-    ScopedCritSec scope(&gDjVuContext.lock);
+    return ExtractPageText(pageNo, lineSep, coordsOut, nullptr);
+}
 
-    miniexp_t pagetext;
-    while ((pagetext = ddjvu_document_get_pagetext(doc, pageNo-1, nullptr)) == miniexp_dummy)
-        gDjVuContext.SpinMessageLoop();
-    if (miniexp_nil == pagetext)
-        return nullptr;
+WCHAR *DjVuEngineImpl::ExtractPageTextLimited(int pageNo, const WCHAR *lineSep, RectI **coordsOut, DWORD timeoutMs, bool *partialOut, AbortCookie **cookie_out)
+{
+    DjVuAbortCookie *cookie = new DjVuAbortCookie(timeoutMs);
+    if (cookie_out)
+        *cookie_out = cookie;
+    WCHAR *text = ExtractPageText(pageNo, lineSep, coordsOut, cookie);
+    *partialOut = cookie->ShouldStop();
+    if (!cookie_out)
+        delete cookie;
+    return text;
+}
 
-    str::Str<WCHAR> extracted;
-    Vec<RectI> coords;
-    bool success = ExtractPageText(pagetext, lineSep, extracted, coords);
-    ddjvu_miniexp_release(doc, pagetext);
-    if (!success)
+WCHAR *DjVuEngineImpl::ExtractPageText(int pageNo, const WCHAR *lineSep, RectI **coordsOut, DjVuAbortCookie *cookie)
+{
+    if (pageData && !pageData[pageNo - 1].hasText)
         return nullptr;
+
+    // the text is collected in scratch memory and copied out once complete
+    ScopedScratch scratch;
+    str::Str<WCHAR> extracted(0, scratch.Get());
+    Vec<RectI> coords(0, scratch.Get());
+    float dpiFactor = 1.0;
+    {
+        ScopedCritSec scope(&gDjVuContext.lock);
+
+        miniexp_t pagetext;
+        while ((pagetext = ddjvu_document_get_pagetext(doc, pageNo-1, nullptr)) == miniexp_dummy) {
+            if (cookie && cookie->ShouldStop())
+                return nullptr;
+            gDjVuContext.SpinMessageLoop();
+        }
+        if (miniexp_nil == pagetext)
+            return nullptr;
+
+        bool success = ExtractPageText(pagetext, lineSep, extracted, coords, cookie);
+        ddjvu_miniexp_release(doc, pagetext);
+        if (!success)
+            return nullptr;
+
+        if (coordsOut && pageData) {
+            dpiFactor = GetFileDPI() / pageData[pageNo - 1].dpi;
+        }
+        else if (coordsOut) {
+            ddjvu_status_t status;
+            ddjvu_pageinfo_t info;
+            while ((status = ddjvu_document_get_pageinfo(doc, pageNo-1, &info)) < DDJVU_JOB_OK)
+                gDjVuContext.SpinMessageLoop();
+            if (DDJVU_JOB_OK == status)
+                dpiFactor = GetFileDPI() / info.dpi;
+        }
+    }
     if (extracted.Count() > 0 && !str::EndsWith(extracted.Get(), lineSep))
         AppendNewline(extracted, coords, lineSep);
 
     assert(str::Len(extracted.Get()) == coords.Count());
     if (coordsOut) {
-        ddjvu_status_t status;
-        ddjvu_pageinfo_t info;
-        while ((status = ddjvu_document_get_pageinfo(doc, pageNo-1, &info)) < DDJVU_JOB_OK)
-            gDjVuContext.SpinMessageLoop();
-        float dpiFactor = 1.0;
-        if (DDJVU_JOB_OK == status)
-            dpiFactor = GetFileDPI() / info.dpi;
-
         // TODO: the coordinates aren't completely correct yet
         RectI page = PageMediabox(pageNo).Round();
         for (size_t i = 0; i < coords.Count(); i++) {
@@ -831,15 +1113,15 @@ WCHAR *DjVuEngineImpl::ExtractPageText(int pageNo, const WCHAR *lineSep, RectI *
             }
         }
         CrashIf(coords.Count() != extracted.Count());
-        *coordsOut = coords.StealData();
+        *coordsOut = coords.DupData();
     }
 
-    return extracted.StealData();
+    return extracted.DupData();
 }
 
 void DjVuEngineImpl::UpdateUserAnnotations(Vec<PageAnnotation> *list)
 {
-    ScopedCritSec scope(&gDjVuContext.lock);
+    ScopedCritSec scope(&annotsAccess);
     if (list)
         userAnnots = *list;
     else
@@ -968,7 +1250,7 @@ PageDestination *DjVuEngineImpl::GetNamedDest(const WCHAR *name)
     return nullptr;
 }
 
-DjVuTocItem *DjVuEngineImpl::BuildTocTree(miniexp_t entry, int& idCounter)
+DjVuTocItem *DjVuEngineImpl::BuildTocTree(miniexp_t entry, int& idCounter, PoolAllocator *allocator)
 {
     DjVuTocItem *node = nullptr;
 
@@ -984,17 +1266,17 @@ DjVuTocItem *DjVuEngineImpl::BuildTocTree(miniexp_t entry, int& idCounter)
         DjVuTocItem *tocItem = nullptr;
         ScopedMem<char> linkNo(ResolveNamedDest(link));
         if (!linkNo)
-            tocItem = new DjVuTocItem(name, link);
+            tocItem = new (allocator) DjVuTocItem(name, link);
         else if (!str::IsEmpty(name) && !str::Eq(name, link + 1))
-            tocItem = new DjVuTocItem(name, linkNo);
+            tocItem = new (allocator) DjVuTocItem(name, linkNo);
         else {
             // ignore generic (name-less) entries
-            delete BuildTocTree(miniexp_cddr(item), idCounter);
+            delete BuildTocTree(miniexp_cddr(item), idCounter, allocator);
             continue;
         }
 
         tocItem->id = ++idCounter;
-        tocItem->child = BuildTocTree(miniexp_cddr(item), idCounter);
+        tocItem->child = BuildTocTree(miniexp_cddr(item), idCounter, allocator);
 
         if (!node)
             node = tocItem;
@@ -1012,9 +1294,14 @@ DocTocItem *DjVuEngineImpl::GetTocTree()
 
     ScopedCritSec scope(&gDjVuContext.lock);
     int idCounter = 0;
-    DjVuTocItem *root = BuildTocTree(outline, idCounter);
-    if (root)
-        root->OpenSingleNode();
+    PoolAllocator *allocator = new PoolAllocator();
+    DjVuTocItem *root = BuildTocTree(outline, idCounter, allocator);
+    if (!root) {
+        delete allocator;
+        return nullptr;
+    }
+    root->OwnAllocator();
+    root->OpenSingleNode();
     return root;
 }
 
@@ -1079,4 +1366,9 @@ BaseEngine *CreateFromStream(IStream *stream)
     return DjVuEngineImpl::CreateFromStream(stream);
 }
 
+void SetPageDataCache(WCHAR *(* getCachePath)(const WCHAR *filePath))
+{
+    gGetPageDataCachePath = getCachePath;
+}
+
 }
@@ -6,5 +6,8 @@ namespace DjVuEngine {
 bool IsSupportedFile(const WCHAR *fileName, bool sniff=false);
 BaseEngine *CreateFromFile(const WCHAR *fileName);
 BaseEngine *CreateFromStream(IStream *stream);
+// page sizes of documents with many pages are cached in the file returned by
+// getCachePath (caller must free the result; nullptr disables caching)
+void SetPageDataCache(WCHAR *(* getCachePath)(const WCHAR *filePath));
 
 }
@@ -9,6 +9,9 @@ struct ImageData {
     size_t      len;
 };
 
+// resolves url relative to the path base (implemented in EbookDoc.cpp)
+char *NormalizeURL(const char *url, const char *base);
+
 class EbookTocVisitor {
 public:
     virtual void Visit(const WCHAR *name, const WCHAR *url, int level) = 0;
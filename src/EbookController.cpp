@@ -4,6 +4,7 @@
 // utils
 #include "BaseUtil.h"
 #include "ArchUtil.h"
+#include "FileUtil.h"
 #include "GdiPlusUtil.h"
 #include "HtmlParserLookup.h"
 #include "HtmlPullParser.h"
@@ -13,6 +14,7 @@
 #include "TrivialHtmlParser.h"
 // rendering engines
 #include "BaseEngine.h"
+#include "EngineManager.h"
 #include "EbookBase.h"
 #include "EbookDoc.h"
 #include "MobiDoc.h"
@@ -25,6 +27,7 @@
 #include "GlobalPrefs.h"
 // ui
 #include "EbookControls.h"
+#include "PerfStats.h"
 #include "Translations.h"
 //#define NOLOG 0
 #include "DebugLog.h"
@@ -84,7 +87,51 @@ struct EbookFormattingData {
     }
 };
 
+// maximum number of threads laying out the chapters of an EPUB document
+// in parallel (including the formatting thread itself)
+#define MAX_CHAPTER_WORKERS 4
+
+// serializes access to the controller's text allocator so that
+// several formatters can resolve html entities at the same time
+class LockedAllocator : public Allocator {
+    Allocator *         allocator;
+    CRITICAL_SECTION    access;
+
+public:
+    explicit LockedAllocator(Allocator *allocator) : allocator(allocator) {
+        InitializeCriticalSection(&access);
+    }
+    virtual ~LockedAllocator() { DeleteCriticalSection(&access); }
+
+    virtual void *Alloc(size_t size) override {
+        ScopedCritSec scope(&access);
+        return Allocator::Alloc(allocator, size);
+    }
+    virtual void *Realloc(void *mem, size_t size) override {
+        ScopedCritSec scope(&access);
+        return Allocator::Realloc(allocator, mem, size);
+    }
+    virtual void Free(void *mem) override {
+        ScopedCritSec scope(&access);
+        Allocator::Free(allocator, mem);
+    }
+};
+
+// a spine item of an EPUB document, laid out independently of the others
+struct EbookChapter {
+    size_t          start;
+    size_t          len;
+    // 0: not yet claimed, 1: being laid out, 2: done
+    volatile LONG   state;
+    Vec<HtmlPage*>  pages;
+
+    EbookChapter(size_t start, size_t len) : start(start), len(len), state(0) { }
+    ~EbookChapter() { DeleteVecMembers(pages); }
+};
+
 class EbookFormattingThread : public ThreadBase {
+    friend class EbookChapterWorker;
+
     HtmlFormatterArgs * formatterArgs; // we own it
 
     Doc                 doc;
@@ -101,6 +148,18 @@ class EbookFormattingThread : public ThreadBase {
     int         reparseIdx;
     int         pagesAfterReparseIdx;
 
+    // state used when laying out EPUB chapters in parallel
+    Vec<EbookChapter *> chapters;
+    // index of the next chapter for the workers to visit
+    LONG        nextChapter;
+
+    void        AppendPage(HtmlPage *pd);
+    void        SendCancelled();
+    bool        SplitIntoChapters();
+    bool        FormatChapter(EbookChapter *ch, Allocator *allocator, bool sendPages);
+    void        FormatAheadChapters(Allocator *allocator);
+    bool        FormatChaptersInParallel();
+
 public:
     void        SendPagesIfNecessary(bool force, bool finished);
     bool        Format();
@@ -113,8 +172,23 @@ public:
     virtual void Run();
 };
 
+// helps an EbookFormattingThread with laying out the chapters
+// following the one that is currently being laid out
+class EbookChapterWorker : public ThreadBase {
+    EbookFormattingThread *owner;
+    Allocator *allocator;
+
+public:
+    EbookChapterWorker(EbookFormattingThread *owner, Allocator *allocator) :
+        ThreadBase("EbookChapterWorker"), owner(owner), allocator(allocator) { }
+    virtual void Run() override {
+        SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+        owner->FormatAheadChapters(allocator);
+    }
+};
+
 EbookFormattingThread::EbookFormattingThread(Doc doc, HtmlFormatterArgs *args, EbookController *ctrl, int reparseIdx, ControllerCallback *cb) :
-    doc(doc), formatterArgs(args), cb(cb), controller(ctrl), pageCount(0), reparseIdx(reparseIdx), pagesAfterReparseIdx(0)
+    doc(doc), formatterArgs(args), cb(cb), controller(ctrl), pageCount(0), reparseIdx(reparseIdx), pagesAfterReparseIdx(0), nextChapter(0)
 {
     CrashIf(reparseIdx < 0);
     AssertCrash(doc.IsDocLoaded() || (doc.IsNone() && (nullptr != args->htmlStr)));
@@ -123,6 +197,7 @@ EbookFormattingThread::EbookFormattingThread(Doc doc, HtmlFormatterArgs *args, E
 EbookFormattingThread::~EbookFormattingThread()
 {
     //lf("ThreadLayoutEbook::~ThreadLayoutEbook()");
+    DeleteVecMembers(chapters);
     delete formatterArgs;
 }
 
@@ -140,54 +215,241 @@ void EbookFormattingThread::SendPagesIfNecessary(bool force, bool finished)
     cb->HandleLayoutedPages(controller, msg);
 }
 
+void EbookFormattingThread::AppendPage(HtmlPage *pd)
+{
+    pages[pageCount++] = pd;
+    if (pd->reparseIdx >= reparseIdx) {
+        ++pagesAfterReparseIdx;
+    }
+    // force sending accumulated pages
+    bool force = false;
+    if (2 == pagesAfterReparseIdx) {
+        force = true;
+        //lf("EbookFormattingThread::Format: sending pages because pagesAfterReparseIdx == %d", pagesAfterReparseIdx);
+    }
+    SendPagesIfNecessary(force, false);
+    CrashIf(pageCount >= dimof(pages));
+}
+
+void EbookFormattingThread::SendCancelled()
+{
+    //lf("layout cancelled");
+    for (int i = 0; i < pageCount; i++) {
+        delete pages[i];
+    }
+    pageCount = 0;
+    // send a 'finished' message so that the thread object gets deleted
+    SendPagesIfNecessary(true, true /* finished */);
+}
+
+// EpubDoc precedes every spine item with a <pagebreak page_path="..." />
+// at which EpubFormatter starts a new page and resets its style rules,
+// so the spine items can be laid out independently of each other
+bool EbookFormattingThread::SplitIntoChapters()
+{
+    if (doc.Type() != Doc_Epub)
+        return false;
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    if (si.dwNumberOfProcessors < 2)
+        return false;
+
+    const char *html = formatterArgs->htmlStr;
+    size_t start = 0;
+    for (const char *s = str::Find(html, "<pagebreak page_path="); s; s = str::Find(s + 1, "<pagebreak page_path=")) {
+        size_t off = s - html;
+        if (off >= formatterArgs->htmlStrLen)
+            break;
+        if (off > start) {
+            chapters.Append(new EbookChapter(start, off - start));
+            start = off;
+        }
+    }
+    chapters.Append(new EbookChapter(start, formatterArgs->htmlStrLen - start));
+    if (chapters.Count() < 2) {
+        DeleteVecMembers(chapters);
+        return false;
+    }
+    return true;
+}
+
+// lays out a single chapter, either sending its pages right away
+// or collecting them for the formatting thread to send in order
+// returns false if layout was cancelled
+bool EbookFormattingThread::FormatChapter(EbookChapter *ch, Allocator *allocator, bool sendPages)
+{
+    HtmlFormatterArgs *args = CreateFormatterDefaultArgs(0, 0, allocator);
+    args->pageDx = formatterArgs->pageDx;
+    args->pageDy = formatterArgs->pageDy;
+    args->SetFontName(formatterArgs->GetFontName());
+    args->fontSize = formatterArgs->fontSize;
+    args->textRenderMethod = formatterArgs->textRenderMethod;
+    args->htmlStr = formatterArgs->htmlStr + ch->start;
+    args->htmlStrLen = ch->len;
+
+    bool ok = true;
+    HtmlFormatter *formatter = doc.CreateFormatter(args);
+    for (HtmlPage *pd = formatter->Next(); pd; pd = formatter->Next()) {
+        if (WasCancelRequested()) {
+            delete pd;
+            ok = false;
+            break;
+        }
+        // the formatter only saw the chapter, so make the
+        // reparse point relative to the whole document again
+        pd->reparseIdx += (int)ch->start;
+        if (sendPages)
+            AppendPage(pd);
+        else
+            ch->pages.Append(pd);
+    }
+    delete formatter;
+    delete args;
+    InterlockedExchange(&ch->state, 2);
+    return ok;
+}
+
+// (called by the workers, each laying out different chapters)
+void EbookFormattingThread::FormatAheadChapters(Allocator *allocator)
+{
+    for (int i; (i = InterlockedIncrement(&nextChapter) - 1) < (int)chapters.Count() && !WasCancelRequested(); ) {
+        EbookChapter *ch = chapters.At(i);
+        if (InterlockedCompareExchange(&ch->state, 1, 0) == 0)
+            FormatChapter(ch, allocator, false);
+    }
+}
+
+// the formatting thread lays out the chapters in order and sends their
+// pages immediately while the workers lay out the following chapters;
+// chapters finished by a worker are sent once their turn has come
+// returns true if layout has been cancelled
+bool EbookFormattingThread::FormatChaptersInParallel()
+{
+    LockedAllocator allocator(formatterArgs->textAllocator);
+    // the first chapter is always laid out by the formatting thread
+    nextChapter = 1;
+
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    int count = limitValue((int)si.dwNumberOfProcessors, 1, MAX_CHAPTER_WORKERS);
+    Vec<EbookChapterWorker *> workers;
+    for (int i = 1; i < count; i++) {
+        EbookChapterWorker *worker = new EbookChapterWorker(this, &allocator);
+        workers.Append(worker);
+        worker->Start();
+    }
+
+    for (EbookChapter *ch : chapters) {
+        if (WasCancelRequested())
+            break;
+        if (InterlockedCompareExchange(&ch->state, 1, 0) == 0) {
+            FormatChapter(ch, &allocator, true);
+            continue;
+        }
+        while (ch->state != 2 && !WasCancelRequested()) {
+            Sleep(1);
+        }
+        if (WasCancelRequested())
+            break;
+        for (HtmlPage *pd : ch->pages) {
+            AppendPage(pd);
+        }
+        ch->pages.Reset();
+    }
+
+    for (EbookChapterWorker *worker : workers) {
+        worker->Join();
+        delete worker;
+    }
+    if (WasCancelRequested()) {
+        SendCancelled();
+        return true;
+    }
+    SendPagesIfNecessary(true, true /* finished */);
+    return false;
+}
+
 // layout pages from a given reparse point (beginning if nullptr)
 // returns true if layout thread was cancelled
 bool EbookFormattingThread::Format()
 {
     //lf("Started laying out ebook, reparseIdx=%d", reparseIdx);
-    int totalPageCount = 0;
     formatterArgs->reparseIdx = 0;
     pagesAfterReparseIdx = 0;
+    if (SplitIntoChapters())
+        return FormatChaptersInParallel();
+
     HtmlFormatter *formatter = doc.CreateFormatter(formatterArgs);
     for (HtmlPage *pd = formatter->Next(); pd; pd = formatter->Next()) {
         if (WasCancelRequested()) {
-            //lf("layout cancelled");
-            for (int i = 0; i < pageCount; i++) {
-                delete pages[i];
-            }
-            pageCount = 0;
             delete pd;
-            // send a 'finished' message so that the thread object gets deleted
-            SendPagesIfNecessary(true, true /* finished */);
+            SendCancelled();
             delete formatter;
             return true;
         }
-        pages[pageCount++] = pd;
-        ++totalPageCount;
-        if (pd->reparseIdx >= reparseIdx) {
-            ++pagesAfterReparseIdx;
-        }
-        // force sending accumulated pages
-        bool force = false;
-        if (2 == pagesAfterReparseIdx) {
-            force = true;
-            //lf("EbookFormattingThread::Format: sending pages because pagesAfterReparseIdx == %d", pagesAfterReparseIdx);
-        }
-        SendPagesIfNecessary(force, false);
-        CrashIf(pageCount >= dimof(pages));
+        AppendPage(pd);
     }
     SendPagesIfNecessary(true, true /* finished */);
     delete formatter;
     return false;
 }
 
+// cf. EbookController::GetEngineType
+static EngineType EngineTypeForDoc(DocType type)
+{
+    switch (type) {
+    case Doc_Epub: return Engine_Epub;
+    case Doc_Fb2:  return Engine_Fb2;
+    case Doc_Mobi: return Engine_Mobi;
+    case Doc_Pdb:  return Engine_Pdb;
+    default:       return Engine_None;
+    }
+}
+
 void EbookFormattingThread::Run()
 {
     Timer t;
-    Format();
+    bool cancelled = Format();
     //lf("Formatting time: %.2f ms", t.Stop());
+    if (!cancelled)
+        perfstats::Record(PerfStat_LayoutTime, EngineTypeForDoc(doc.Type()), t.Stop());
 }
 
+// renders the pages the user will most likely turn to next into the
+// page bitmap cache, so that turning the page doesn't have to draw them
+class EbookPrerenderThread : public ThreadBase {
+    PageBitmapCache *   cache;
+    // copies of the pages to render, as the controller might delete
+    // the originals (e.g. when relayouting) while we're rendering them
+    Vec<HtmlPage *>     pages;
+    Vec<PageBitmapKey>  keys;
+
+public:
+    explicit EbookPrerenderThread(PageBitmapCache *cache) :
+        ThreadBase("EbookPrerenderThread"), cache(cache) { }
+    virtual ~EbookPrerenderThread() { DeleteVecMembers(pages); }
+
+    void AddPage(HtmlPage *page, const PageBitmapKey& key) {
+        HtmlPage *copy = new HtmlPage(page->reparseIdx);
+        copy->id = page->id;
+        copy->instructions = page->instructions;
+        pages.Append(copy);
+        keys.Append(key);
+    }
+    size_t PageCount() const { return pages.Count(); }
+
+    virtual void Run() override {
+        SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+        for (size_t i = 0; i < pages.Count() && !WasCancelRequested(); i++) {
+            if (cache->Has(keys.At(i)))
+                continue;
+            Bitmap *bmp = RenderPageBitmap(pages.At(i), keys.At(i));
+            if (bmp)
+                cache->Add(keys.At(i), bmp);
+        }
+    }
+};
+
 static void DeletePages(Vec<HtmlPage*>** toDeletePtr)
 {
     if (!*toDeletePtr)
@@ -199,8 +461,9 @@ static void DeletePages(Vec<HtmlPage*>** toDeletePtr)
 }
 
 EbookController::EbookController(Doc doc, EbookControls *ctrls, ControllerCallback *cb) :
-    doc(doc), Controller(cb), ctrls(ctrls), pages(nullptr), incomingPages(nullptr),
-    currPageNo(0), pageSize(0, 0), formattingThread(nullptr), formattingThreadNo(-1),
+    doc(doc), Controller(cb), ctrls(ctrls), pages(nullptr), provisionalPages(false), estimatedPages(false),
+    firstLaidOut(0), endLaidOut(0), forwardFormatter(nullptr), forwardArgs(nullptr), incomingPages(nullptr),
+    currPageNo(0), pageSize(0, 0), formattingThread(nullptr), formattingThreadNo(-1), prerenderThread(nullptr),
     currPageReparseIdx(0), handleMsgs(false), pageAnchorIds(nullptr), pageAnchorIdxs(nullptr),
     navHistoryIx(0)
 {
@@ -249,6 +512,11 @@ EbookController::~EbookController()
 
 // stop layout thread (if we're closing a document we'll delete
 // the ebook data, so we can't have the thread keep using it)
+EngineType EbookController::GetEngineType() const
+{
+    return EngineTypeForDoc(doc.Type());
+}
+
 void EbookController::StopFormattingThread()
 {
     if (!formattingThread)
@@ -262,11 +530,57 @@ void EbookController::StopFormattingThread()
     DeletePages(&incomingPages);
 }
 
+// the prerendered pages' text might come from an allocator we're about to free
+void EbookController::StopPrerenderThread()
+{
+    if (!prerenderThread)
+        return;
+    prerenderThread->RequestCancel();
+    bool ok = prerenderThread->Join();
+    CrashIf(!ok);
+    delete prerenderThread;
+    prerenderThread = nullptr;
+}
+
+// prerenders the pages following and preceding the ones currently shown
+void EbookController::StartPrerenderThread()
+{
+    StopPrerenderThread();
+    if (!pages)
+        return;
+
+    PageControl *controls[2] = { ctrls->pagesLayout->GetPage1(), ctrls->pagesLayout->GetPage2() };
+    int dist = IsDoublePage() ? 2 : 1;
+    // the next pages first, as readers mostly move forward
+    int firstPageNos[2] = { currPageNo + dist, currPageNo - dist };
+    EbookPrerenderThread *thread = new EbookPrerenderThread(ctrls->pageBitmaps);
+    for (int firstPageNo : firstPageNos) {
+        for (int i = 0; i < dist; i++) {
+            int pageNo = firstPageNo + i;
+            if (pageNo < 1 || pageNo > (int)pages->Count())
+                continue;
+            HtmlPage *p = pages->At(pageNo - 1);
+            PageBitmapKey key;
+            if (controls[i]->GetBitmapKey(p, &key) && !ctrls->pageBitmaps->Has(key))
+                thread->AddPage(p, key);
+        }
+    }
+    if (0 == thread->PageCount()) {
+        delete thread;
+        return;
+    }
+    prerenderThread = thread;
+    prerenderThread->Start();
+}
+
 void EbookController::CloseCurrentDocument()
 {
     ctrls->pagesLayout->GetPage1()->SetPage(nullptr);
     ctrls->pagesLayout->GetPage2()->SetPage(nullptr);
+    StopPrerenderThread();
+    ctrls->pageBitmaps->Clear();
     StopFormattingThread();
+    DeleteProvisionalState();
     DeletePages(&pages);
     doc.Delete();
     pageSize = SizeI(0, 0);
@@ -323,13 +637,15 @@ void EbookController::HandlePagesFromEbookLayout(EbookFormattingData *ft)
         for (size_t i = 0; i < ft->pageCount; i++) {
             incomingPages->Append(ft->pages[i]);
         }
-        int pageNo = PageForReparsePoint(incomingPages, currPageReparseIdx);
-        if (pageNo > 0) {
+        // provisional pages are only replaced once layout has completed
+        int pageNo = provisionalPages && !ft->finished ? -1 : PageForReparsePoint(incomingPages, currPageReparseIdx);
+        if (pageNo > 0 || provisionalPages && ft->finished && incomingPages->Count() > 0) {
             Vec<HtmlPage*> *toDelete = pages;
             pages = incomingPages;
             incomingPages = nullptr;
+            DeleteProvisionalState();
             DeletePages(&toDelete);
-            GoToPage(pageNo, false);
+            GoToPage(pageNo > 0 ? pageNo : (int)pages->Count(), false);
         }
     } else {
         CrashIf(!pages);
@@ -341,6 +657,7 @@ void EbookController::HandlePagesFromEbookLayout(EbookFormattingData *ft)
     if (ft->finished) {
         CrashIf(!pages);
         StopFormattingThread();
+        SaveLayoutCache();
     }
     UpdateStatus();
     // don't call DeleteEbookFormattingData since
@@ -348,6 +665,327 @@ void EbookController::HandlePagesFromEbookLayout(EbookFormattingData *ft)
     delete ft;
 }
 
+/* A layout cache file consists of a LayoutCacheHeader followed by the
+   reparseIdx of every page (as an int), so that a document reopened with
+   the same settings can be navigated before it's been completely laid out. */
+#define LAYOUT_CACHE_MAGIC      0x4C455053 /* 'SPEL' */
+#define LAYOUT_CACHE_VERSION    1
+
+struct LayoutCacheHeader {
+    uint32      magic;
+    uint32      version;
+    uint32      pageCount;
+    uint32      htmlLen;
+    // the document's size and modification time when the layout was cached
+    int64       fileSize;
+    FILETIME    fileTime;
+    // the settings the document has been laid out with
+    int         pageDx;
+    int         pageDy;
+    float       fontSize;
+    uint32      textRenderMethod;
+    WCHAR       fontName[LF_FACESIZE];
+};
+
+static void InitLayoutCacheHeader(LayoutCacheHeader& hdr, Doc doc, SizeI pageSize)
+{
+    const WCHAR *filePath = doc.GetFilePath();
+    ZeroMemory(&hdr, sizeof(hdr));
+    hdr.magic = LAYOUT_CACHE_MAGIC;
+    hdr.version = LAYOUT_CACHE_VERSION;
+    hdr.htmlLen = (uint32)doc.GetHtmlDataSize();
+    hdr.fileSize = file::GetSize(filePath);
+    hdr.fileTime = file::GetModificationTime(filePath);
+    hdr.pageDx = pageSize.dx;
+    hdr.pageDy = pageSize.dy;
+    hdr.fontSize = GetFontSize();
+    hdr.textRenderMethod = (uint32)GetTextRenderMethod();
+    str::BufSet(hdr.fontName, dimof(hdr.fontName), GetFontName());
+}
+
+// replaces pages with placeholders for all the pages of a cached layout
+// (if the document and the layout settings haven't changed since)
+bool EbookController::LoadLayoutCache()
+{
+    if (!layoutCachePath || !doc.GetFilePath())
+        return false;
+    size_t len;
+    ScopedMem<char> data(file::ReadAll(layoutCachePath, &len));
+    if (!data || len < sizeof(LayoutCacheHeader))
+        return false;
+
+    const LayoutCacheHeader *hdr = (const LayoutCacheHeader *)data.Get();
+    LayoutCacheHeader expected;
+    InitLayoutCacheHeader(expected, doc, pageSize);
+    expected.pageCount = hdr->pageCount;
+    if (memcmp(hdr, &expected, sizeof(expected)) != 0 || 0 == hdr->pageCount ||
+        (len - sizeof(LayoutCacheHeader)) / sizeof(int) != hdr->pageCount) {
+        return false;
+    }
+    // reparse points must be valid for the current html data
+    const int *reparseIdxs = (const int *)(hdr + 1);
+    for (uint32 i = 0; i < hdr->pageCount; i++) {
+        if (reparseIdxs[i] < 0 || (uint32)reparseIdxs[i] >= hdr->htmlLen ||
+            i > 0 && reparseIdxs[i] <= reparseIdxs[i - 1]) {
+            return false;
+        }
+    }
+
+    ctrls->pagesLayout->GetPage1()->SetPage(nullptr);
+    ctrls->pagesLayout->GetPage2()->SetPage(nullptr);
+    StopPrerenderThread();
+    DeleteProvisionalState();
+    DeletePages(&pages);
+    provisionalTextAllocator.FreeAll();
+    pages = new Vec<HtmlPage*>(hdr->pageCount);
+    for (uint32 i = 0; i < hdr->pageCount; i++) {
+        pages->Append(new HtmlPage(reparseIdxs[i]));
+    }
+    provisionalPages = true;
+    return true;
+}
+
+void EbookController::SaveLayoutCache()
+{
+    if (!layoutCachePath || !doc.GetFilePath() || !pages || pages->Count() == 0)
+        return;
+    LayoutCacheHeader hdr;
+    InitLayoutCacheHeader(hdr, doc, pageSize);
+    hdr.pageCount = (uint32)pages->Count();
+
+    Vec<char> data;
+    data.Append((const char *)&hdr, sizeof(hdr));
+    for (HtmlPage *p : *pages) {
+        data.Append((const char *)&p->reparseIdx, sizeof(int));
+    }
+    ScopedMem<WCHAR> cacheDir(path::GetDir(layoutCachePath));
+    if (dir::Create(cacheDir))
+        file::WriteAll(layoutCachePath, data.AtPtr(0), data.Size());
+}
+
+// lays out a placeholder page from the reparseIdx of this
+// and the next page (as known from the layout cache)
+void EbookController::LayoutCachedPage(int pageNo)
+{
+    if (!provisionalPages || pageNo < 1 || (size_t)pageNo > pages->Count())
+        return;
+    HtmlPage *p = pages->At(pageNo - 1);
+    if (p->instructions.Count() > 0)
+        return;
+
+    HtmlFormatterArgs *args = CreateFormatterArgsDoc(doc, pageSize.dx, pageSize.dy, &provisionalTextAllocator);
+    args->reparseIdx = p->reparseIdx;
+    if ((size_t)pageNo < pages->Count())
+        args->htmlStrLen = pages->At(pageNo)->reparseIdx;
+    HtmlFormatter *formatter = doc.CreateFormatter(args);
+    HtmlPage *pd = formatter->Next();
+    delete formatter;
+    delete args;
+    if (!pd)
+        return;
+    pd->reparseIdx = p->reparseIdx;
+    pages->At(pageNo - 1) = pd;
+    delete p;
+}
+
+// how many pages of the previous layout to go back for laying out
+// the pages preceding the first estimated page that's been laid out
+#define BACKWARD_RESTART_PAGES  8
+
+void EbookController::DeleteProvisionalState()
+{
+    delete forwardFormatter;
+    forwardFormatter = nullptr;
+    delete forwardArgs;
+    forwardArgs = nullptr;
+    restartIdxs.Reset();
+    firstLaidOut = endLaidOut = 0;
+    provisionalPages = false;
+    estimatedPages = false;
+}
+
+// after a resize, lays out the current page right away and estimates the number of
+// pages before and after it from the previous layout, so that the user can continue
+// reading while the background layout starts over (cf. LayoutEstimatedPage)
+bool EbookController::StartIncrementalLayout(SizeI prevSize)
+{
+    if (!pages || pages->Count() == 0 || prevSize.IsEmpty())
+        return false;
+    int prevPageNo = PageForReparsePoint(pages, currPageReparseIdx);
+    if (prevPageNo <= 0)
+        prevPageNo = (int)pages->Count();
+
+    HtmlFormatterArgs *args = CreateFormatterArgsDoc(doc, pageSize.dx, pageSize.dy, &provisionalTextAllocator);
+    args->reparseIdx = currPageReparseIdx;
+    HtmlFormatter *formatter = doc.CreateFormatter(args);
+    HtmlPage *pd = formatter->Next();
+    if (!pd) {
+        delete formatter;
+        delete args;
+        return false;
+    }
+
+    // the number of pages roughly scales with the inverse of the page area
+    double scale = (double)prevSize.dx * prevSize.dy / ((double)pageSize.dx * pageSize.dy);
+    int before = (int)((prevPageNo - 1) * scale + 0.5);
+    int after = (int)((pages->Count() - prevPageNo) * scale + 0.5);
+    Vec<int> prevRestartIdxs;
+    prevRestartIdxs.Append(0);
+    for (HtmlPage *p : *pages) {
+        // placeholders might not start at a valid reparse point
+        if (p->instructions.Count() > 0 && p->reparseIdx > prevRestartIdxs.Last() && p->reparseIdx < pd->reparseIdx)
+            prevRestartIdxs.Append(p->reparseIdx);
+    }
+
+    ctrls->pagesLayout->GetPage1()->SetPage(nullptr);
+    ctrls->pagesLayout->GetPage2()->SetPage(nullptr);
+    DeleteProvisionalState();
+    DeletePages(&pages);
+
+    // placeholders get evenly distributed reparseIdx estimates
+    int64 htmlLen = (int64)doc.GetHtmlDataSize();
+    pages = new Vec<HtmlPage*>(before + 1 + after);
+    for (int i = 0; i < before; i++) {
+        pages->Append(new HtmlPage((int)(pd->reparseIdx * (int64)i / before)));
+    }
+    pages->Append(pd);
+    for (int i = 1; i <= after; i++) {
+        pages->Append(new HtmlPage((int)(pd->reparseIdx + (htmlLen - pd->reparseIdx) * i / (after + 1))));
+    }
+    restartIdxs.Append(prevRestartIdxs.LendData(), prevRestartIdxs.Count());
+    firstLaidOut = before;
+    endLaidOut = before + 1;
+    forwardFormatter = formatter;
+    forwardArgs = args;
+    provisionalPages = true;
+    estimatedPages = true;
+    return true;
+}
+
+// lays out the estimated pages up to pageNo (forward or backward from the pages
+// that have already been laid out), adjusting pageNo if placeholders this side of
+// the document's start or end turn out to be superfluous
+void EbookController::LayoutEstimatedPage(int& pageNo)
+{
+    size_t idx = pageNo - 1;
+    if (idx >= pages->Count())
+        return;
+
+    while (idx >= endLaidOut && forwardFormatter) {
+        HtmlPage *pd = forwardFormatter->Next();
+        if (!pd) {
+            // there are fewer pages than estimated
+            for (size_t i = endLaidOut; i < pages->Count(); i++) {
+                delete pages->At(i);
+            }
+            pages->RemoveAt(endLaidOut, pages->Count() - endLaidOut);
+            delete forwardFormatter;
+            forwardFormatter = nullptr;
+            break;
+        }
+        if (endLaidOut < pages->Count()) {
+            delete pages->At(endLaidOut);
+            pages->At(endLaidOut) = pd;
+        } else {
+            // there are more pages than estimated
+            pages->Append(pd);
+        }
+        endLaidOut++;
+        // keep the estimates from getting ahead of the pages laid out
+        for (size_t i = endLaidOut; i < pages->Count() && pages->At(i)->reparseIdx <= pd->reparseIdx; i++) {
+            pages->At(i)->reparseIdx = pd->reparseIdx + 1;
+        }
+    }
+    if (idx >= pages->Count()) {
+        pageNo = (int)pages->Count();
+        return;
+    }
+
+    int stepBack = BACKWARD_RESTART_PAGES;
+    while (idx < firstLaidOut) {
+        int endIdx = pages->At(firstLaidOut)->reparseIdx;
+        int restartIdx = 0;
+        for (size_t i = restartIdxs.Count(); i > 0; i--) {
+            if (restartIdxs.At(i - 1) < endIdx) {
+                restartIdx = restartIdxs.At(i > (size_t)stepBack ? i - stepBack : 0);
+                break;
+            }
+        }
+
+        Vec<HtmlPage*> laidOut;
+        if (endIdx > 0) {
+            HtmlFormatterArgs *args = CreateFormatterArgsDoc(doc, pageSize.dx, pageSize.dy, &provisionalTextAllocator);
+            args->reparseIdx = restartIdx;
+            args->htmlStrLen = endIdx;
+            HtmlFormatter *formatter = doc.CreateFormatter(args);
+            for (HtmlPage *pd = formatter->Next(); pd; pd = formatter->Next()) {
+                laidOut.Append(pd);
+            }
+            delete formatter;
+            delete args;
+        }
+
+        // fill the placeholders preceding the pages laid out so far from the back
+        for (size_t i = laidOut.Count(); i > 0; i--) {
+            HtmlPage *pd = laidOut.At(i - 1);
+            if (firstLaidOut > 0) {
+                firstLaidOut--;
+                delete pages->At(firstLaidOut);
+                pages->At(firstLaidOut) = pd;
+                continue;
+            }
+            // there are more pages than estimated
+            pages->InsertAt(0, pd);
+            endLaidOut++;
+            idx++;
+        }
+        if (0 == restartIdx && firstLaidOut > 0) {
+            // there are fewer pages than estimated
+            for (size_t i = 0; i < firstLaidOut; i++) {
+                delete pages->At(i);
+            }
+            pages->RemoveAt(0, firstLaidOut);
+            endLaidOut -= firstLaidOut;
+            idx = idx >= firstLaidOut ? idx - firstLaidOut : 0;
+            firstLaidOut = 0;
+        }
+        if (0 == laidOut.Count())
+            stepBack *= 2;
+    }
+    // keep the estimates from getting ahead of the pages laid out
+    for (size_t i = firstLaidOut; i > 0 && pages->At(i - 1)->reparseIdx >= pages->At(i)->reparseIdx; i--) {
+        pages->At(i - 1)->reparseIdx = std::max(pages->At(i)->reparseIdx - 1, 0);
+    }
+    pageNo = (int)idx + 1;
+}
+
+// makes sure that the page(s) to be shown at pageNo have been laid out
+// returns pageNo adjusted for changes to the number of provisional pages
+int EbookController::LayoutProvisionalPages(int pageNo)
+{
+    if (!provisionalPages)
+        return pageNo;
+    if (!estimatedPages) {
+        LayoutCachedPage(pageNo);
+        if (IsDoublePage())
+            LayoutCachedPage(pageNo + 1);
+        return pageNo;
+    }
+
+    LayoutEstimatedPage(pageNo);
+    if (IsDoublePage() && pageNo < (int)pages->Count()) {
+        int nextPageNo = pageNo + 1;
+        LayoutEstimatedPage(nextPageNo);
+        pageNo = nextPageNo - 1;
+    }
+    int n = IsDoublePage() ? 1 : 0;
+    if (pageNo + n > (int)pages->Count())
+        pageNo = (int)pages->Count() - n;
+    if (pageNo < 1)
+        pageNo = 1;
+    return pageNo;
+}
+
 void EbookController::TriggerLayout()
 {
     Size s = ctrls->pagesLayout->GetPage1()->GetDrawableSize();
@@ -366,11 +1004,18 @@ void EbookController::TriggerLayout()
     }
 
     //lf("(%3d,%3d) EbookController::TriggerLayout",size.dx, size.dy);
+    SizeI prevSize = pageSize;
     pageSize = size; // set it early to prevent re-doing layout at the same size
 
     StopFormattingThread();
     CrashIf(incomingPages);
     incomingPages = new Vec<HtmlPage*>(1024);
+    if (LoadLayoutCache()) {
+        int pageNo = PageForReparsePoint(pages, currPageReparseIdx);
+        GoToPage(pageNo > 0 ? pageNo : (int)pages->Count(), false);
+    } else if (StartIncrementalLayout(prevSize)) {
+        GoToPage((int)firstLaidOut + 1, false);
+    }
 
     HtmlFormatterArgs *args = CreateFormatterArgsDoc(doc, size.dx, size.dy, &textAllocator);
     formattingThread = new EbookFormattingThread(doc, args, this, currPageReparseIdx, cb);
@@ -478,7 +1123,7 @@ void EbookController::ClickedPage2(Control *c, int x, int y)
 int EbookController::GetMaxPageCount() const
 {
     Vec<HtmlPage *> *pagesTmp = pages;
-    if (incomingPages) {
+    if (incomingPages && !provisionalPages) {
         CrashIf(!FormattingInProgress());
         pagesTmp = incomingPages;
     }
@@ -491,7 +1136,7 @@ int EbookController::GetMaxPageCount() const
 void EbookController::UpdateStatus()
 {
     int pageCount = GetMaxPageCount();
-    if (FormattingInProgress()) {
+    if (FormattingInProgress() && !provisionalPages) {
         ScopedMem<WCHAR> s(str::Format(_TR("Formatting the book... %d pages"), pageCount));
         ctrls->status->SetText(s);
         ctrls->progress->SetFilled(0.f);
@@ -513,7 +1158,8 @@ void EbookController::UpdateStatus()
 void EbookController::GoToPage(int pageNo, bool addNavPoint)
 {
     // we're still formatting, disable page movement
-    if (incomingPages) {
+    // (unless pages can be laid out on demand)
+    if (incomingPages && !provisionalPages) {
         //lf("EbookController::GoToPage(%d): skipping because incomingPages != nullptr", pageNo);
         return;
     }
@@ -535,6 +1181,7 @@ void EbookController::GoToPage(int pageNo, bool addNavPoint)
     if (pageNo < 1)
         pageNo = 1;
 
+    pageNo = LayoutProvisionalPages(pageNo);
     HtmlPage *p = pages->At(pageNo - 1);
     currPageNo = pageNo;
     currPageReparseIdx = p->reparseIdx;
@@ -545,6 +1192,7 @@ void EbookController::GoToPage(int pageNo, bool addNavPoint)
     } else {
         ctrls->pagesLayout->GetPage2()->SetPage(nullptr);
     }
+    StartPrerenderThread();
     UpdateStatus();
     // update the ToC selection
     cb->PageNoChanged(this, pageNo);
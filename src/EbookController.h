@@ -8,6 +8,7 @@ struct  FrameRateWnd;
 
 class   EbookController;
 class   EbookFormattingThread;
+class   EbookPrerenderThread;
 class   HtmlFormatter;
 class   HtmlFormatterArgs;
 class   HtmlPage;
@@ -56,6 +57,8 @@ public:
     // the following is specific to EbookController
 
     DocType GetDocType() const { return doc.Type(); }
+    // the engine type that would be used for the document in fixed page UI
+    EngineType GetEngineType() const;
     LRESULT HandleMessage(UINT msg, WPARAM wParam, LPARAM lParam, bool& wasHandled);
     void EnableMessageHandling(bool enable) { handleMsgs = enable; }
     void UpdateDocumentColors();
@@ -63,6 +66,9 @@ public:
     void HandlePagesFromEbookLayout(EbookFormattingData *ebookLayout);
     void TriggerLayout();
     void StartLayouting(int startReparseIdxArg=-1, DisplayMode displayMode=DM_AUTOMATIC);
+    // page boundaries are cached at layoutCachePath (if not nullptr), so that
+    // reopening the document with the same settings can lay out pages on demand
+    void SetLayoutCachePath(const WCHAR *path) { layoutCachePath.Set(str::Dup(path)); }
     int  ResolvePageAnchor(const WCHAR *id);
     void CopyNavHistory(EbookController& orig);
     int  CurrentTocPageNo() const;
@@ -83,6 +89,24 @@ protected:
     PoolAllocator   textAllocator;
 
     Vec<HtmlPage*> *    pages;
+    // whether pages are provisional until the background layout has completed,
+    // i.e. contain placeholders (without instructions) which are laid out on demand:
+    // either from the layout cache or estimated around the current page after a resize
+    bool                provisionalPages;
+    // whether the placeholders' reparseIdx are only estimates (after a resize)
+    bool                estimatedPages;
+    ScopedMem<WCHAR>    layoutCachePath;
+    // used for laying out placeholders (as textAllocator might be in use)
+    PoolAllocator       provisionalTextAllocator;
+
+    // state for laying out estimated pages: pages [firstLaidOut, endLaidOut)
+    // have been laid out, pages following them come from forwardFormatter,
+    // pages before them are laid out again from one of restartIdxs
+    size_t              firstLaidOut;
+    size_t              endLaidOut;
+    HtmlFormatter *     forwardFormatter;
+    HtmlFormatterArgs * forwardArgs;
+    Vec<int>            restartIdxs;
 
     // pages being sent from background formatting thread
     Vec<HtmlPage*> *    incomingPages;
@@ -98,6 +122,9 @@ protected:
     EbookFormattingThread * formattingThread;
     int                     formattingThreadNo;
 
+    // renders the pages around the current one in the background
+    EbookPrerenderThread *  prerenderThread;
+
     // whether HandleMessage passes messages on to ctrls->mainWnd
     bool            handleMsgs;
 
@@ -112,10 +139,19 @@ protected:
     void        UpdateStatus();
     bool        FormattingInProgress() const { return formattingThread != nullptr; }
     void        StopFormattingThread();
+    void        StartPrerenderThread();
+    void        StopPrerenderThread();
     void        CloseCurrentDocument();
     int         GetMaxPageCount() const;
     bool        IsDoublePage() const;
     void        ExtractPageAnchors();
+    bool        LoadLayoutCache();
+    void        SaveLayoutCache();
+    void        LayoutCachedPage(int pageNo);
+    bool        StartIncrementalLayout(SizeI prevSize);
+    void        LayoutEstimatedPage(int& pageNo);
+    int         LayoutProvisionalPages(int pageNo);
+    void        DeleteProvisionalState();
     void        AddNavPoint();
     void        OnClickedLink(int pageNo, DrawInstr *link);
 
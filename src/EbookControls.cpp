@@ -24,7 +24,109 @@
 #define NOLOG 1
 #include "DebugLog.h"
 
-PageControl::PageControl() : page(nullptr), cursorX(-1), cursorY(-1)
+bool PageBitmapKey::Equals(const PageBitmapKey& other) const
+{
+    return pageId == other.pageId && size.Equals(other.size) && drawable.Equals(other.drawable) &&
+           textColor == other.textColor && bgColor == other.bgColor && renderMethod == other.renderMethod;
+}
+
+// renders page the way PageControl::Paint would draw it onto a transparent control
+Bitmap *RenderPageBitmap(HtmlPage *page, const PageBitmapKey& key)
+{
+    // GDI doesn't preserve alpha, so we use an opaque bitmap
+    Bitmap *bmp = ::new Bitmap(key.size.Width, key.size.Height, PixelFormat24bppRGB);
+    if (!bmp || bmp->GetLastStatus() != Ok) {
+        ::delete bmp;
+        return nullptr;
+    }
+
+    Graphics g((Image *)bmp);
+    InitGraphicsMode(&g);
+    Color textColor, bgColor;
+    textColor.SetFromCOLORREF(key.textColor);
+    bgColor.SetFromCOLORREF(key.bgColor);
+    SolidBrush br(bgColor);
+    g.FillRectangle(&br, Rect(0, 0, key.size.Width, key.size.Height));
+
+    Rect r = key.drawable;
+    r.Inflate(1, 0);
+    g.SetClip(r, CombineModeReplace);
+
+    ITextRender *textRender = CreateTextRender(key.renderMethod, &g, key.size.Width, key.size.Height);
+    textRender->SetTextBgColor(bgColor);
+    DrawHtmlPage(&g, textRender, &page->instructions, (REAL)key.drawable.X, (REAL)key.drawable.Y, false, textColor);
+    delete textRender;
+    return bmp;
+}
+
+PageBitmapCache::PageBitmapCache() : useCount(0)
+{
+    InitializeCriticalSection(&access);
+}
+
+PageBitmapCache::~PageBitmapCache()
+{
+    Clear();
+    DeleteCriticalSection(&access);
+}
+
+bool PageBitmapCache::Has(const PageBitmapKey& key)
+{
+    ScopedCritSec scope(&access);
+    for (Entry& e : entries) {
+        if (e.key.Equals(key))
+            return true;
+    }
+    return false;
+}
+
+void PageBitmapCache::Add(const PageBitmapKey& key, Bitmap *bmp)
+{
+    ScopedCritSec scope(&access);
+    for (Entry& e : entries) {
+        if (e.key.Equals(key)) {
+            // another thread rendered the same page in the meantime
+            ::delete bmp;
+            return;
+        }
+    }
+    if (entries.Count() >= MAX_PAGE_BITMAPS) {
+        size_t oldest = 0;
+        for (size_t i = 1; i < entries.Count(); i++) {
+            if (entries.At(i).lastUse < entries.At(oldest).lastUse)
+                oldest = i;
+        }
+        ::delete entries.At(oldest).bmp;
+        entries.RemoveAt(oldest);
+    }
+    Entry e = { key, bmp, ++useCount };
+    entries.Append(e);
+}
+
+bool PageBitmapCache::Draw(Graphics *gfx, int x, int y, const PageBitmapKey& key)
+{
+    ScopedCritSec scope(&access);
+    for (Entry& e : entries) {
+        if (!e.key.Equals(key))
+            continue;
+        e.lastUse = ++useCount;
+        Rect r(x, y, key.size.Width, key.size.Height);
+        Status ok = gfx->DrawImage(e.bmp, r, 0, 0, key.size.Width, key.size.Height, UnitPixel);
+        return Ok == ok;
+    }
+    return false;
+}
+
+void PageBitmapCache::Clear()
+{
+    ScopedCritSec scope(&access);
+    for (Entry& e : entries) {
+        ::delete e.bmp;
+    }
+    entries.Reset();
+}
+
+PageControl::PageControl() : page(nullptr), cursorX(-1), cursorY(-1), bitmapCache(nullptr)
 {
     bit::Set(wantedInputBits, WantsMouseMoveBit, WantsMouseClickBit);
 }
@@ -94,6 +196,25 @@ Size PageControl::GetDrawableSize() const
     return s;
 }
 
+bool PageControl::GetBitmapKey(HtmlPage *forPage, PageBitmapKey *key) const
+{
+    // the bitmap is filled with the document's background color, which is
+    // what shows through transparent pages (cf. SetMainWndBgCol)
+    if (!forPage || forPage->instructions.Count() == 0 || !cachedStyle->bgColor->IsTransparent() || IsDebugPaint())
+        return false;
+    Size s = GetDrawableSize();
+    if (s.Width <= 0 || s.Height <= 0)
+        return false;
+
+    Padding pad = cachedStyle->padding;
+    key->pageId = forPage->id;
+    key->size = Size(pos.Width, pos.Height);
+    key->drawable = Rect(pad.left, pad.top, s.Width, s.Height);
+    GetEbookUiColors(key->textColor, key->bgColor);
+    key->renderMethod = GetTextRenderMethod();
+    return true;
+}
+
 void PageControl::Paint(Graphics *gfx, int offX, int offY)
 {
     CrashIf(!IsVisible());
@@ -112,6 +233,25 @@ void PageControl::Paint(Graphics *gfx, int offX, int offY)
     if (!page)
         return;
 
+    // turning to a recently shown or prerendered page only requires a blit
+    PageBitmapKey key;
+    if (bitmapCache && GetBitmapKey(page, &key)) {
+        Timer timerBlit;
+        bool ok = bitmapCache->Draw(gfx, offX, offY, key);
+        if (!ok) {
+            Bitmap *bmp = RenderPageBitmap(page, key);
+            if (bmp) {
+                bitmapCache->Add(key, bmp);
+                ok = bitmapCache->Draw(gfx, offX, offY, key);
+            }
+        }
+        if (ok) {
+            double durBlit = timerBlit.Stop();
+            lf("all: %.2f, fill: %.2f, blit: %.2f", timerAll.Stop(), durFill, durBlit);
+            return;
+        }
+    }
+
     // during resize the page we currently show might be bigger than
     // our area. To avoid drawing outside our area we clip
     Region origClipRegion;
@@ -224,6 +364,9 @@ EbookControls *CreateEbookControls(HWND hwnd, FrameRateWnd *frameRateWnd)
     CrashIf(!ctrls->topPart);
     ctrls->pagesLayout = static_cast<PagesLayout*>(FindLayoutNamed(*muiDef, "pagesLayout"));
     CrashIf(!ctrls->pagesLayout);
+    ctrls->pageBitmaps = new PageBitmapCache();
+    ctrls->pagesLayout->GetPage1()->SetBitmapCache(ctrls->pageBitmaps);
+    ctrls->pagesLayout->GetPage2()->SetBitmapCache(ctrls->pageBitmaps);
 
     ctrls->mainWnd = new HwndWrapper(hwnd);
     ctrls->mainWnd->frameRateWnd = frameRateWnd;
@@ -246,6 +389,7 @@ void DestroyEbookControls(EbookControls* ctrls)
     delete ctrls->topPart;
     delete ctrls->pagesLayout;
     delete ctrls->muiDef;
+    delete ctrls->pageBitmaps;
     delete ctrls;
 }
 
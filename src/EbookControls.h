@@ -5,6 +5,7 @@ struct FrameRateWnd;
 
 class HtmlFormatter;
 class HtmlFormatterArgs;
+class PageBitmapCache;
 class PageControl;
 class PagesLayout;
 using namespace mui;
@@ -18,6 +19,7 @@ struct EbookControls {
     Button *            status;
     ILayout *           topPart;
     PagesLayout *       pagesLayout;
+    PageBitmapCache *   pageBitmaps;
 };
 
 EbookControls * CreateEbookControls(HWND hwnd, FrameRateWnd *);
@@ -27,12 +29,58 @@ void            SetMainWndBgCol(EbookControls *ctrls);
 class HtmlPage;
 struct DrawInstr;
 
+// identifies a page rendered with given settings
+struct PageBitmapKey {
+    LONG                pageId;
+    // size of the bitmap and the area within it the page is drawn into
+    Size                size;
+    Rect                drawable;
+    COLORREF            textColor;
+    COLORREF            bgColor;
+    TextRenderMethod    renderMethod;
+
+    bool Equals(const PageBitmapKey& other) const;
+};
+
+Bitmap *RenderPageBitmap(HtmlPage *page, const PageBitmapKey& key);
+
+#define MAX_PAGE_BITMAPS 6
+
+// keeps the bitmaps of the most recently shown and prerendered pages, so that
+// turning to one of these pages is a blit instead of drawing all its text.
+// Bitmaps can be added from any thread
+class PageBitmapCache
+{
+    struct Entry {
+        PageBitmapKey   key;
+        Bitmap *        bmp;
+        int             lastUse;
+    };
+
+    CRITICAL_SECTION    access;
+    Vec<Entry>          entries;
+    int                 useCount;
+
+public:
+    PageBitmapCache();
+    ~PageBitmapCache();
+
+    bool Has(const PageBitmapKey& key);
+    // takes ownership of bmp
+    void Add(const PageBitmapKey& key, Bitmap *bmp);
+    // returns false if there's no bitmap for key
+    bool Draw(Graphics *gfx, int x, int y, const PageBitmapKey& key);
+    void Clear();
+};
+
 // control that shows a single ebook page
 // TODO: move to a separate file
 class PageControl : public Control
 {
     HtmlPage *  page;
     int         cursorX, cursorY;
+    // not owned by us
+    PageBitmapCache *bitmapCache;
 
 public:
     PageControl();
@@ -40,6 +88,9 @@ public:
 
     void      SetPage(HtmlPage *newPage);
     HtmlPage* GetPage() const { return page; }
+    void      SetBitmapCache(PageBitmapCache *cache) { bitmapCache = cache; }
+    // returns false if pages can't be drawn from a cached bitmap
+    bool      GetBitmapKey(HtmlPage *forPage, PageBitmapKey *key) const;
 
     Size GetDrawableSize() const;
     DrawInstr *GetLinkAt(int x, int y) const;
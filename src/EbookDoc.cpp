@@ -3,6 +3,7 @@
 
 // utils
 #include "BaseUtil.h"
+#include <emmintrin.h>
 #include "ArchUtil.h"
 #include "FileUtil.h"
 #include "HtmlParserLookup.h"
@@ -148,6 +149,40 @@ inline char decode64(char c)
     return -1;
 }
 
+// decodes 16 base64 characters into 12 bytes (using SSE2); returns false if
+// any of the characters is whitespace, padding or invalid (cf. decode64)
+static bool Base64DecodeBlock(const char *s, char *out)
+{
+    __m128i c = _mm_loadu_si128((const __m128i *)s);
+    // bytes >= 0x80 are negative and thus never in range
+    __m128i isUpper = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('Z' + 1)));
+    __m128i isLower = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('z' + 1)));
+    __m128i isDigit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+    __m128i isPlus = _mm_cmpeq_epi8(c, _mm_set1_epi8('+'));
+    __m128i isSlash = _mm_cmpeq_epi8(c, _mm_set1_epi8('/'));
+    __m128i isValid = _mm_or_si128(_mm_or_si128(isUpper, isLower), _mm_or_si128(isDigit, _mm_or_si128(isPlus, isSlash)));
+    if (_mm_movemask_epi8(isValid) != 0xFFFF)
+        return false;
+
+    // map all characters to their 6-bit values at once
+    __m128i delta = _mm_or_si128(
+        _mm_or_si128(_mm_and_si128(isUpper, _mm_set1_epi8(-'A')), _mm_and_si128(isLower, _mm_set1_epi8(26 - 'a'))),
+        _mm_or_si128(_mm_and_si128(isDigit, _mm_set1_epi8(52 - '0')),
+                     _mm_or_si128(_mm_and_si128(isPlus, _mm_set1_epi8(62 - '+')), _mm_and_si128(isSlash, _mm_set1_epi8(63 - '/')))));
+    __m128i values = _mm_add_epi8(c, delta);
+    // combine pairs of values into 12 bits and pairs of those into 24 bits
+    __m128i pairs = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(values, _mm_set1_epi16(0x3F)), 6), _mm_srli_epi16(values, 8));
+    __m128i quads = _mm_madd_epi16(pairs, _mm_set1_epi32((1 << 16) | (1 << 12)));
+    uint32_t q[4];
+    _mm_storeu_si128((__m128i *)q, quads);
+    for (int i = 0; i < 4; i++) {
+        *out++ = (char)(q[i] >> 16);
+        *out++ = (char)(q[i] >> 8);
+        *out++ = (char)q[i];
+    }
+    return true;
+}
+
 static char *Base64Decode(const char *s, size_t sLen, size_t *lenOut)
 {
     const char *end = s + sLen;
@@ -155,7 +190,14 @@ static char *Base64Decode(const char *s, size_t sLen, size_t *lenOut)
     char *curr = result;
     unsigned char c = 0;
     int step = 0;
+    bool hasSSE2 = HasSSE2();
     for (; s < end && *s != '='; s++) {
+        // decode the runs between line breaks 16 characters at a time
+        if (hasSSE2 && 0 == step % 4 && s + 16 <= end && Base64DecodeBlock(s, curr)) {
+            s += 15;
+            curr += 12;
+            continue;
+        }
         char n = decode64(*s);
         if (-1 == n) {
             if (str::IsWs(*s))
@@ -231,14 +273,14 @@ const char *EPUB_NCX_NS = "http://www.daisy.org/z3986/2005/ncx/";
 const char *EPUB_ENC_NS = "http://www.w3.org/2001/04/xmlenc#";
 
 EpubDoc::EpubDoc(const WCHAR *fileName) :
-    zip(fileName, true), fileName(str::Dup(fileName)),
-    isNcxToc(false), isRtlDoc(false) {
+    zip(fileName, true), fileName(str::Dup(fileName)), htmlDataLoaded(false),
+    coverImageIdx((size_t)-1), isNcxToc(false), isRtlDoc(false) {
     InitializeCriticalSection(&zipAccess);
 }
 
 EpubDoc::EpubDoc(IStream *stream) :
-    zip(stream, true), fileName(nullptr),
-    isNcxToc(false), isRtlDoc(false) {
+    zip(stream, true), fileName(nullptr), htmlDataLoaded(false),
+    coverImageIdx((size_t)-1), isNcxToc(false), isRtlDoc(false) {
     InitializeCriticalSection(&zipAccess);
 }
 
@@ -250,6 +292,10 @@ EpubDoc::~EpubDoc()
         free(images.At(i).base.data);
         free(images.At(i).id);
     }
+    for (size_t i = 0; i < chapters.Count(); i++) {
+        free(chapters.At(i).pagePath);
+        free(chapters.At(i).html);
+    }
 
     LeaveCriticalSection(&zipAccess);
     DeleteCriticalSection(&zipAccess);
@@ -306,6 +352,14 @@ bool EpubDoc::Load()
     else
         *contentPath = '\0';
 
+    // EPUB 2 cover image: <meta name="cover" content="{manifest id}"/>
+    ScopedMem<WCHAR> coverId;
+    for (HtmlElement *meta = parser.FindElementByNameNS("meta", EPUB_OPF_NS); meta && !coverId; meta = parser.FindElementByNameNS("meta", EPUB_OPF_NS, meta)) {
+        ScopedMem<WCHAR> name(meta->GetAttribute("name"));
+        if (str::Eq(name, L"cover"))
+            coverId.Set(meta->GetAttribute("content"));
+    }
+
     WStrList idList, pathList;
 
     for (node = node->down; node; node = node->next) {
@@ -320,6 +374,11 @@ bool EpubDoc::Load()
             imgPath.Set(str::Join(contentPath, imgPath));
             if (encList.Contains(imgPath))
                 continue;
+            // EPUB 3 marks the cover image with properties="cover-image"
+            ScopedMem<WCHAR> imgId(node->GetAttribute("id"));
+            ScopedMem<WCHAR> properties(node->GetAttribute("properties"));
+            if (coverImageIdx == (size_t)-1 && (coverId && str::Eq(imgId, coverId) || properties && str::Find(properties, L"cover-image")))
+                coverImageIdx = images.Count();
             // load the image lazily
             ImageData2 data = { 0 };
             data.id = str::conv::ToUtf8(imgPath);
@@ -370,22 +429,66 @@ bool EpubDoc::Load()
             continue;
 
         ScopedMem<WCHAR> fullPath(str::Join(contentPath, pathList.At(idList.Find(idref))));
-        ScopedMem<char> html(zip.GetFileDataByName(fullPath));
-        if (!html)
+        EpubChapter ch = { 0 };
+        ch.zipIdx = zip.GetFileIndex(fullPath);
+        if (ch.zipIdx == (size_t)-1)
             continue;
+        ch.pagePath = str::conv::ToUtf8(fullPath);
+        CrashIfDebugOnly(str::FindChar(ch.pagePath, '"'));
+        str::TransChars(ch.pagePath, "\"", "'");
+        chapters.Append(ch);
+    }
+
+    // only decompress until a readable chapter has been found,
+    // the remaining ones are decompressed when they're needed
+    for (size_t i = 0; i < chapters.Count(); i++) {
+        if (LoadChapter(i))
+            return true;
+    }
+    return false;
+}
+
+// caller must hold zipAccess
+bool EpubDoc::LoadChapter(size_t idx)
+{
+    EpubChapter *ch = &chapters.At(idx);
+    if (ch->html || ch->failed)
+        return ch->html != nullptr;
+
+    ScopedMem<char> html(zip.GetFileDataByIdx(ch->zipIdx));
+    if (html)
         html.Set(DecodeTextToUtf8(html, true));
-        if (!html)
-            continue;
-        // insert explicit page-breaks between sections including
-        // an anchor with the file name at the top (for internal links)
-        ScopedMem<char> utf8_path(str::conv::ToUtf8(fullPath));
-        CrashIfDebugOnly(str::FindChar(utf8_path, '"'));
-        str::TransChars(utf8_path, "\"", "'");
-        htmlData.AppendFmt("<pagebreak page_path=\"%s\" page_marker />", utf8_path.Get());
-        htmlData.Append(html);
+    if (!html) {
+        ch->failed = true;
+        return false;
     }
+    // insert explicit page-breaks between sections including
+    // an anchor with the file name at the top (for internal links)
+    str::Str<char> data;
+    data.AppendFmt("<pagebreak page_path=\"%s\" page_marker />", ch->pagePath);
+    data.Append(html);
+    ch->len = data.Size();
+    ch->html = data.StealData();
+    return true;
+}
+
+void EpubDoc::LoadHtmlData()
+{
+    ScopedCritSec scope(&zipAccess);
+    if (htmlDataLoaded)
+        return;
 
-    return htmlData.Count() > 0;
+    for (size_t i = 0; i < chapters.Count(); i++) {
+        EpubChapter *ch = &chapters.At(i);
+        ch->offset = htmlData.Size();
+        if (!LoadChapter(i))
+            continue;
+        htmlData.Append(ch->html, ch->len);
+        // GetChapterData points into htmlData from now on
+        free(ch->html);
+        ch->html = nullptr;
+    }
+    htmlDataLoaded = true;
 }
 
 void EpubDoc::ParseMetadata(const char *content)
@@ -430,17 +533,44 @@ void EpubDoc::ParseMetadata(const char *content)
     }
 }
 
-const char *EpubDoc::GetHtmlData(size_t *lenOut) const
+const char *EpubDoc::GetHtmlData(size_t *lenOut)
 {
+    LoadHtmlData();
     *lenOut = htmlData.Size();
     return htmlData.Get();
 }
 
-size_t EpubDoc::GetHtmlDataSize() const
+size_t EpubDoc::GetHtmlDataSize()
 {
+    LoadHtmlData();
     return htmlData.Size();
 }
 
+size_t EpubDoc::GetChapterCount() const
+{
+    return chapters.Count();
+}
+
+// returns the HTML of a single spine item without decompressing
+// any of the others (returns nullptr for unreadable items)
+const char *EpubDoc::GetChapterData(size_t idx, size_t *lenOut)
+{
+    ScopedCritSec scope(&zipAccess);
+
+    CrashIf(idx >= chapters.Count());
+    EpubChapter *ch = &chapters.At(idx);
+    if (htmlDataLoaded) {
+        *lenOut = ch->failed ? 0 : ch->len;
+        return ch->failed ? nullptr : htmlData.Get() + ch->offset;
+    }
+    if (!LoadChapter(idx)) {
+        *lenOut = 0;
+        return nullptr;
+    }
+    *lenOut = ch->len;
+    return ch->html;
+}
+
 ImageData *EpubDoc::GetImageData(const char *id, const char *pagePath)
 {
     ScopedCritSec scope(&zipAccess);
@@ -496,6 +626,18 @@ ImageData *EpubDoc::GetImageData(const char *id, const char *pagePath)
     return nullptr;
 }
 
+ImageData *EpubDoc::GetCoverImage()
+{
+    ScopedCritSec scope(&zipAccess);
+
+    if (coverImageIdx >= images.Count())
+        return nullptr;
+    ImageData2 *img = &images.At(coverImageIdx);
+    if (!img->base.data)
+        img->base.data = zip.GetFileDataByIdx(img->idx, &img->base.len);
+    return img->base.data ? &img->base : nullptr;
+}
+
 char *EpubDoc::GetFileData(const char *relPath, const char *pagePath, size_t *lenOut)
 {
     if (!pagePath) {
@@ -703,19 +845,23 @@ const char *FB2_MAIN_NS = "http://www.gribuser.ru/xml/fictionbook/2.0";
 const char *FB2_XLINK_NS = "http://www.w3.org/1999/xlink";
 
 Fb2Doc::Fb2Doc(const WCHAR *fileName) : fileName(str::Dup(fileName)),
-    stream(nullptr), isZipped(false), hasToc(false) { }
+    stream(nullptr), isZipped(false), hasToc(false) {
+    InitializeCriticalSection(&imagesAccess);
+}
 
 Fb2Doc::Fb2Doc(IStream *stream) : fileName(nullptr),
     stream(stream), isZipped(false), hasToc(false) {
+    InitializeCriticalSection(&imagesAccess);
     stream->AddRef();
 }
 
 Fb2Doc::~Fb2Doc()
 {
     for (size_t i = 0; i < images.Count(); i++) {
-        free(images.At(i).base.data);
-        free(images.At(i).id);
+        free(images.At(i).img.base.data);
+        free(images.At(i).img.id);
     }
+    DeleteCriticalSection(&imagesAccess);
     if (stream)
         stream->Release();
 }
@@ -848,6 +994,8 @@ bool Fb2Doc::Load()
             ExtractImage(&parser, tok);
     }
 
+    // the images are decoded from fileData when they're needed
+    fileData.Set(data.StealData());
     return xmlData.Size() > 0;
 }
 
@@ -864,12 +1012,11 @@ void Fb2Doc::ExtractImage(HtmlPullParser *parser, HtmlToken *tok)
     if (!tok || !tok->IsText())
         return;
 
-    ImageData2 data = { 0 };
-    data.base.data = Base64Decode(tok->s, tok->sLen, &data.base.len);
-    if (!data.base.data)
-        return;
-    data.id = str::Join("#", id);
-    data.idx = images.Count();
+    Fb2Image data = { 0 };
+    data.base64 = tok->s;
+    data.base64Len = tok->sLen;
+    data.img.id = str::Join("#", id);
+    data.img.idx = images.Count();
     images.Append(data);
 }
 
@@ -886,9 +1033,17 @@ size_t Fb2Doc::GetXmlDataSize() const
 
 ImageData *Fb2Doc::GetImageData(const char *id)
 {
+    ScopedCritSec scope(&imagesAccess);
     for (size_t i = 0; i < images.Count(); i++) {
-        if (str::Eq(images.At(i).id, id))
-            return &images.At(i).base;
+        Fb2Image *img = &images.At(i);
+        if (!str::Eq(img->img.id, id))
+            continue;
+        if (!img->img.base.data && img->base64) {
+            img->img.base.data = Base64Decode(img->base64, img->base64Len, &img->img.base.len);
+            // invalid data is only decoded once
+            img->base64 = nullptr;
+        }
+        return img->img.base.data ? &img->img.base : nullptr;
     }
     return nullptr;
 }
@@ -1298,7 +1453,15 @@ HtmlDoc *HtmlDoc::CreateFromFile(const WCHAR *fileName)
 
 /* ********** Plain Text (and RFCs and TCR) ********** */
 
-TxtDoc::TxtDoc(const WCHAR *fileName) : fileName(str::Dup(fileName)), isRFC(false) { }
+TxtDoc::TxtDoc(const WCHAR *fileName) : fileName(str::Dup(fileName)), isRFC(false),
+    textPos(0), streamedHtml(nullptr), streamedLen(0), streamedCommitted(0),
+    linkEnd(nullptr), rfcHeader(false), sectionCount(0) { }
+
+TxtDoc::~TxtDoc()
+{
+    if (streamedHtml)
+        VirtualFree(streamedHtml, 0, MEM_RELEASE);
+}
 
 // cf. http://www.cix.co.uk/~gidds/Software/TCR.html
 #define TCR_HEADER "!!8-Bit!!"
@@ -1425,10 +1588,16 @@ static const char *TextFindRfcEnd(str::Str<char>& htmlData, const char *curr)
     return end;
 }
 
+// documents are converted in chunks of (at least) this many bytes,
+// if they're larger than that
+#define TXT_CHUNK_SIZE      (1024 * 1024)
+// address space reserved for a streamed document's HTML (cf. Vec's limit)
+#define TXT_HTML_RESERVE    ((size_t)INT_MAX)
+
 bool TxtDoc::Load()
 {
     size_t dataLen;
-    ScopedMem<char> text(file::ReadAll(fileName, &dataLen));
+    text.Set(file::ReadAll(fileName, &dataLen));
     if (str::EndsWithI(fileName, L".tcr") && str::StartsWith(text.Get(), TCR_HEADER))
         text.Set(DecompressTcrText(text, dataLen));
     if (!text)
@@ -1440,12 +1609,27 @@ bool TxtDoc::Load()
     int rfc;
     isRFC = str::Parse(path::GetBaseName(fileName), L"rfc%d.txt%$", &rfc) != nullptr;
 
-    const char *linkEnd = nullptr;
-    bool rfcHeader = false;
-    int sectionCount = 0;
+    // RFCs are small and their ToC is parsed from the complete HTML
+    if (!isRFC && str::Len(text) > TXT_CHUNK_SIZE)
+        streamedHtml = (char *)VirtualAlloc(nullptr, TXT_HTML_RESERVE, MEM_RESERVE, PAGE_NOACCESS);
+    if (!streamedHtml) {
+        ConvertText(htmlData, SIZE_MAX);
+        text.Set(nullptr);
+        return true;
+    }
+    ConvertMoreHtml();
+    return streamedLen > 0;
+}
 
-    htmlData.Append("<pre>");
-    for (const char *curr = text; *curr; curr++) {
+// converts the text from textPos up to the first line break after minLen bytes
+// (or up to the end) and returns true once the end of the text has been reached
+bool TxtDoc::ConvertText(str::Str<char>& htmlData, size_t minLen)
+{
+    int rfc;
+    const char *chunkStart = text + textPos;
+    if (0 == textPos)
+        htmlData.Append("<pre>");
+    for (const char *curr = chunkStart; *curr; curr++) {
         // similar logic to LinkifyText in PdfEngine.cpp
         if (linkEnd == curr) {
             htmlData.Append("</a>");
@@ -1491,16 +1675,61 @@ bool TxtDoc::Load()
         }
 
         AppendChar(htmlData, *curr);
+
+        // chunks end at line breaks outside of links, so that
+        // the formatter never sees a partial tag or a partial word
+        if ('\n' == *curr && (size_t)(curr + 1 - chunkStart) >= minLen && !linkEnd && !rfcHeader) {
+            textPos = curr + 1 - text;
+            return false;
+        }
     }
     if (linkEnd)
         htmlData.Append("</a>");
     htmlData.Append("</pre>");
+    textPos = str::Len(text);
+
+    return true;
+}
 
+bool TxtDoc::AppendStreamedHtml(const char *s, size_t len)
+{
+    // keep the HTML zero-terminated
+    size_t needed = streamedLen + len + 1;
+    if (needed > TXT_HTML_RESERVE)
+        return false;
+    if (needed > streamedCommitted) {
+        size_t newCommitted = std::min(RoundUp(needed, TXT_CHUNK_SIZE), TXT_HTML_RESERVE);
+        if (!VirtualAlloc(streamedHtml + streamedCommitted, newCommitted - streamedCommitted, MEM_COMMIT, PAGE_READWRITE))
+            return false;
+        streamedCommitted = newCommitted;
+    }
+    memcpy(streamedHtml + streamedLen, s, len);
+    streamedLen += len;
+    streamedHtml[streamedLen] = '\0';
     return true;
 }
 
+size_t TxtDoc::ConvertMoreHtml()
+{
+    if (!streamedHtml)
+        return htmlData.Size();
+    if (!text)
+        return streamedLen;
+
+    str::Str<char> chunk(TXT_CHUNK_SIZE + TXT_CHUNK_SIZE / 4);
+    bool isComplete = ConvertText(chunk, TXT_CHUNK_SIZE);
+    // running out of memory ends the document early
+    if (!AppendStreamedHtml(chunk.Get(), chunk.Size()) || isComplete)
+        text.Set(nullptr);
+    return streamedLen;
+}
+
 const char *TxtDoc::GetHtmlData(size_t *lenOut) const
 {
+    if (streamedHtml) {
+        *lenOut = streamedLen;
+        return streamedHtml;
+    }
     *lenOut = htmlData.Size();
     return htmlData.Get();
 }
@@ -10,7 +10,15 @@ struct ImageData2 {
     size_t  idx; // document specific index at which to find this image
 };
 
-char *NormalizeURL(const char *url, const char *base);
+// a spine item of an EPUB document, decompressed on demand
+struct EpubChapter {
+    size_t  zipIdx;
+    char *  pagePath;
+    char *  html;   // including the leading <pagebreak page_path="..." />
+    size_t  len;
+    size_t  offset; // into htmlData, once that's been assembled
+    bool    failed;
+};
 
 class PropertyMap {
     ScopedMem<char> values[Prop_PdfVersion];
@@ -30,8 +38,13 @@ class EpubDoc {
     // access to them must be serialized for multi-threaded users (such as EbookController)
     CRITICAL_SECTION zipAccess;
 
+    // chapters are only decompressed (and htmlData assembled) when needed
+    Vec<EpubChapter> chapters;
     str::Str<char> htmlData;
+    bool htmlDataLoaded;
     Vec<ImageData2> images;
+    // index into images (or (size_t)-1 if there's no cover image)
+    size_t coverImageIdx;
     ScopedMem<WCHAR> tocPath;
     ScopedMem<WCHAR> fileName;
     PropertyMap props;
@@ -40,6 +53,8 @@ class EpubDoc {
 
     bool Load();
     void ParseMetadata(const char *content);
+    bool LoadChapter(size_t idx);
+    void LoadHtmlData();
     bool ParseNavToc(const char *data, size_t dataLen, const char *pagePath, EbookTocVisitor *visitor);
     bool ParseNcxToc(const char *data, size_t dataLen, const char *pagePath, EbookTocVisitor *visitor);
 
@@ -48,9 +63,13 @@ public:
     explicit EpubDoc(IStream *stream);
     ~EpubDoc();
 
-    const char *GetHtmlData(size_t *lenOut) const;
-    size_t GetHtmlDataSize() const;
+    const char *GetHtmlData(size_t *lenOut);
+    size_t GetHtmlDataSize();
+    // the result of GetChapterData is only valid until GetHtmlData is called
+    size_t GetChapterCount() const;
+    const char *GetChapterData(size_t idx, size_t *lenOut);
     ImageData *GetImageData(const char *id, const char *pagePath);
+    ImageData *GetCoverImage();
     char *GetFileData(const char *relPath, const char *pagePath, size_t *lenOut);
 
     WCHAR *GetProperty(DocumentProperty prop) const;
@@ -69,12 +88,23 @@ public:
 
 #define FB2_TOC_ENTRY_MARK "ToC!Entry!"
 
+// an image embedded in an FB2 document (only decoded once it's needed)
+struct Fb2Image {
+    ImageData2  img;
+    // base64 encoded data within Fb2Doc::fileData
+    const char *base64;
+    size_t      base64Len;
+};
+
 class Fb2Doc {
     ScopedMem<WCHAR> fileName;
     IStream *stream;
 
+    // the decoded document, which also contains the images' data
+    ScopedMem<char> fileData;
     str::Str<char> xmlData;
-    Vec<ImageData2> images;
+    Vec<Fb2Image> images;
+    CRITICAL_SECTION imagesAccess;
     ScopedMem<char> coverImage;
     PropertyMap props;
     bool isZipped;
@@ -167,12 +197,30 @@ class TxtDoc {
     str::Str<char> htmlData;
     bool isRFC;
 
+    // large documents are converted to HTML in chunks while they're laid out
+    // (cf. ConvertMoreHtml), into reserved memory so that the HTML never moves
+    ScopedMem<char> text;
+    size_t textPos;
+    char *streamedHtml;
+    size_t streamedLen;
+    size_t streamedCommitted;
+    // conversion state (kept between chunks)
+    const char *linkEnd;
+    bool rfcHeader;
+    int sectionCount;
+
     bool Load();
+    bool ConvertText(str::Str<char>& html, size_t minLen);
+    bool AppendStreamedHtml(const char *s, size_t len);
 
 public:
     explicit TxtDoc(const WCHAR *fileName);
+    ~TxtDoc();
 
     const char *GetHtmlData(size_t *lenOut) const;
+    // converts the next chunk of a streamed document and returns the length
+    // of the HTML so far (which doesn't change once the conversion is complete)
+    size_t ConvertMoreHtml();
 
     WCHAR *GetProperty(DocumentProperty prop) const;
     const WCHAR *GetFileName() const;
@@ -14,6 +14,7 @@
 #include "HtmlPullParser.h"
 #include "Mui.h"
 #include "PalmDbReader.h"
+#include "ThreadUtil.h"
 #include "TrivialHtmlParser.h"
 #include "WinUtil.h"
 #include "ZipUtil.h"
@@ -52,10 +53,10 @@ void SetDefaultEbookFont(const WCHAR *name, float size)
 /* common classes for EPUB, FictionBook2, Mobi, PalmDOC, CHM, HTML and TXT engines */
 
 struct PageAnchor {
-    DrawInstr *instr;
+    DrawInstr instr;
     int pageNo;
 
-    explicit PageAnchor(DrawInstr *instr=nullptr, int pageNo=-1) : instr(instr), pageNo(pageNo) { }
+    PageAnchor(DrawInstr& instr, int pageNo) : instr(instr), pageNo(pageNo) { }
 };
 
 class EbookAbortCookie : public AbortCookie {
@@ -65,13 +66,17 @@ public:
     void Abort() override { abort = true; }
 };
 
+class EbookLayoutThread;
+
 class EbookEngine : public BaseEngine {
 public:
     EbookEngine();
     virtual ~EbookEngine();
 
     const WCHAR *FileName() const override { return fileName; };
-    int PageCount() const override { return pages ? (int)pages->Count() : 0; }
+    // while pages are still being laid out, this is an estimate
+    int PageCount() const override { return pageCount; }
+    bool IsLayoutComplete() const override { return !formatter; }
 
     RectD PageMediabox(int pageNo) override { UNUSED(pageNo);  return pageRect; }
     RectD PageContentBox(int pageNo, RenderTarget target=Target_View) override {
@@ -84,6 +89,7 @@ public:
     RenderedBitmap *RenderBitmap(int pageNo, float zoom, int rotation,
                          RectD *pageRect=nullptr, /* if nullptr: defaults to the page's mediabox */
                          RenderTarget target=Target_View, AbortCookie **cookie_out=nullptr) override;
+    void SetRenderQuality(RenderQuality quality) override { renderQuality = quality; }
 
     PointD Transform(PointD pt, int pageNo, float zoom, int rotation, bool inverse=false) override;
     RectD Transform(RectD rect, int pageNo, float zoom, int rotation, bool inverse=false) override;
@@ -114,10 +120,25 @@ public:
 protected:
     WCHAR *fileName;
     Vec<HtmlPage *> *pages;
+    // the instructions of all pages (HtmlPage::instructions are
+    // released once they've been packed, cf. AddLaidOutPage)
+    PackedDrawInstrs *packedPages;
+    // if set, only the first page is laid out while loading and the
+    // remaining ones either on demand or on a background thread
+    // (set for engines created from streams for previewing and thumbnailing
+    // and for clones used for printing and searching)
+    bool layoutOnDemand;
+    // non-null while not all pages have been laid out yet
+    HtmlFormatter *formatter;
+    bool skipEmptyPages;
+    EbookLayoutThread *layoutThread;
+    // number of pages laid out so far or an estimate until layout is complete
+    int pageCount;
+    size_t htmlLen;
     Vec<PageAnchor> anchors;
-    // contains for each page the last anchor indicating
-    // a break between two merged documents
-    Vec<DrawInstr *> baseAnchors;
+    // contains for each page the index of the last anchor indicating
+    // a break between two merged documents (or -1)
+    Vec<int> baseAnchors;
     // needed so that memory allocated by ResolveHtmlEntities isn't leaked
     PoolAllocator allocator;
     // TODO: still needed?
@@ -127,20 +148,41 @@ protected:
     // page dimensions can vary between filetypes
     RectD pageRect;
     float pageBorder;
+    // profile for Target_View renderings (cf. SetRenderQuality)
+    RenderQuality renderQuality;
 
     void GetTransform(Matrix& m, float zoom, int rotation) {
         GetBaseTransform(m, pageRect.ToGdipRectF(), zoom, rotation);
     }
-    bool ExtractPageAnchors();
+    // takes ownership of formatter
+    bool LayoutPages(HtmlFormatter *formatter, HtmlFormatterArgs *args, bool skipEmptyPages=false);
+    void AddLaidOutPage(HtmlPage *page);
+    bool LayoutNextPage();
+    bool LayoutUntil(int pageNo);
+    void LayoutAllPages() { LayoutUntil(INT_MAX); }
+    // must be called by subclasses before releasing what formatter refers to
+    void StopLayout();
     WCHAR *ExtractFontList();
 
+    friend class EbookLayoutThread;
+
     virtual PageElement *CreatePageLink(DrawInstr *link, RectI rect, int pageNo);
 
-    Vec<DrawInstr> *GetHtmlPage(int pageNo) {
-        CrashIf(pageNo < 1 || PageCount() < pageNo);
-        if (pageNo < 1 || PageCount() < pageNo)
-            return nullptr;
-        return &pages->At(pageNo - 1)->instructions;
+    // replaces instructions with the ones of page pageNo
+    // (caller must hold pagesAccess)
+    bool GetHtmlPage(int pageNo, Vec<DrawInstr>& instructions) {
+        CrashIf(pageNo < 1);
+        instructions.Reset();
+        // PageCount() might have been overestimated
+        if (pageNo < 1 || !LayoutUntil(pageNo))
+            return false;
+        if (packedPages) {
+            packedPages->GetPage(pageNo - 1, instructions);
+        } else {
+            Vec<DrawInstr>& pageInstrs = pages->At(pageNo - 1)->instructions;
+            instructions.Append(pageInstrs.LendData(), pageInstrs.Count());
+        }
+        return true;
     }
 };
 
@@ -162,15 +204,15 @@ public:
 
 class EbookLink : public PageElement, public PageDestination {
     PageDestination *dest; // required for internal links, nullptr for external ones
-    DrawInstr *link; // owned by *EngineImpl::pages
+    DrawInstr link; // its string is owned by *EngineImpl
     RectI rect;
     int pageNo;
     bool showUrl;
 
 public:
-    EbookLink() : dest(nullptr), link(nullptr), pageNo(-1), showUrl(false) { }
+    EbookLink() : dest(nullptr), link(DrawInstr::LinkStart(nullptr, 0)), pageNo(-1), showUrl(false) { }
     EbookLink(DrawInstr *link, RectI rect, PageDestination *dest, int pageNo=-1, bool showUrl=false) :
-        link(link), rect(rect), dest(dest), pageNo(pageNo), showUrl(showUrl) { }
+        link(*link), rect(rect), dest(dest), pageNo(pageNo), showUrl(showUrl) { }
     virtual ~EbookLink() { delete dest; }
 
     PageElementType GetType() const override { return Element_Link; }
@@ -178,7 +220,7 @@ public:
     RectD GetRect() const override { return rect.Convert<double>(); }
     WCHAR *GetValue() const override {
         if (!dest || showUrl)
-            return str::conv::FromHtmlUtf8(link->str.s, link->str.len);
+            return str::conv::FromHtmlUtf8(link.str.s, link.str.len);
         return nullptr;
     }
     virtual PageDestination *AsLink() { return dest ? dest : this; }
@@ -191,12 +233,12 @@ public:
 
 class ImageDataElement : public PageElement {
     int pageNo;
-    ImageData *id; // owned by *EngineImpl::pages
+    ImageData id; // its data is owned by *EngineImpl
     RectI bbox;
 
 public:
     ImageDataElement(int pageNo, ImageData *id, RectI bbox) :
-        pageNo(pageNo), id(id), bbox(bbox) { }
+        pageNo(pageNo), id(*id), bbox(bbox) { }
 
     virtual PageElementType GetType() const { return Element_Image; }
     virtual int GetPageNo() const { return pageNo; }
@@ -205,7 +247,7 @@ public:
 
     virtual RenderedBitmap *GetImage() {
         HBITMAP hbmp;
-        Bitmap *bmp = BitmapFromData(id->data, id->len);
+        Bitmap *bmp = BitmapFromData(id.data, id.len);
         if (!bmp || bmp->GetHBITMAP((ARGB)Color::White, &hbmp) != Ok) {
             delete bmp;
             return nullptr;
@@ -214,6 +256,13 @@ public:
         delete bmp;
         return new RenderedBitmap(hbmp, size);
     }
+
+    virtual unsigned char *GetImageData(size_t *cbCount) {
+        if (!GfxFileExtFromData(id.data, id.len))
+            return nullptr;
+        *cbCount = id.len;
+        return (unsigned char *)memdup(id.data, id.len);
+    }
 };
 
 class EbookTocItem : public DocTocItem {
@@ -227,51 +276,145 @@ public:
     virtual PageDestination *GetLink() { return dest; }
 };
 
-EbookEngine::EbookEngine() : fileName(nullptr), pages(nullptr),
+EbookEngine::EbookEngine() : fileName(nullptr), pages(nullptr), packedPages(nullptr),
+    layoutOnDemand(false), formatter(nullptr), skipEmptyPages(false), layoutThread(nullptr),
+    pageCount(0), htmlLen(0),
     pageRect(0, 0, 5.12 * GetFileDPI(), 7.8 * GetFileDPI()), // "B Format" paperback
-    pageBorder(0.4f * GetFileDPI())
+    pageBorder(0.4f * GetFileDPI()), renderQuality(Quality_Balanced)
 {
     InitializeCriticalSection(&pagesAccess);
 }
 
 EbookEngine::~EbookEngine()
 {
+    StopLayout();
     EnterCriticalSection(&pagesAccess);
 
     if (pages)
         DeleteVecMembers(*pages);
     delete pages;
+    delete packedPages;
     free(fileName);
 
     LeaveCriticalSection(&pagesAccess);
     DeleteCriticalSection(&pagesAccess);
 }
 
-bool EbookEngine::ExtractPageAnchors()
+class EbookLayoutThread : public ThreadBase {
+    EbookEngine *engine;
+
+public:
+    explicit EbookLayoutThread(EbookEngine *engine) : ThreadBase("EbookLayoutThread"), engine(engine) { }
+
+    void Run() override {
+        while (!WasCancelRequested() && engine->LayoutNextPage()) {
+            // pagesAccess is released between pages so that
+            // rendering doesn't have to wait for the whole layout
+        }
+    }
+};
+
+bool EbookEngine::LayoutPages(HtmlFormatter *formatter, HtmlFormatterArgs *args, bool skipEmptyPages)
 {
     ScopedCritSec scope(&pagesAccess);
 
-    DrawInstr *baseAnchor = nullptr;
-    for (int pageNo = 1; pageNo <= PageCount(); pageNo++) {
-        Vec<DrawInstr> *pageInstrs = GetHtmlPage(pageNo);
-        if (!pageInstrs)
-            return false;
+    CrashIf(pages || this->formatter);
+    pages = new Vec<HtmlPage *>();
+    packedPages = new PackedDrawInstrs(args->htmlStr, args->htmlStrLen);
+    htmlLen = args->htmlStrLen;
+    this->formatter = formatter;
+    this->skipEmptyPages = skipEmptyPages;
 
-        for (size_t k = 0; k < pageInstrs->Count(); k++) {
-            DrawInstr *i = &pageInstrs->At(k);
-            if (InstrAnchor != i->type)
-                continue;
-            anchors.Append(PageAnchor(i, pageNo));
-            if (k < 2 && str::StartsWith(i->str.s + i->str.len, "\" page_marker />"))
-                baseAnchor = i;
-        }
-        baseAnchors.Append(baseAnchor);
+    if (!layoutOnDemand) {
+        LayoutAllPages();
+    } else if (LayoutNextPage()) {
+        layoutThread = new EbookLayoutThread(this);
+        layoutThread->Start();
     }
+    return pages->Count() > 0;
+}
+
+// laid out pages are kept in memory for as long as the document is
+// open, so store them in a more compact form than Vec<DrawInstr>
+void EbookEngine::AddLaidOutPage(HtmlPage *page)
+{
+    int pageNo = (int)pages->Count() + 1;
+    pages->Append(page);
 
+    int baseAnchor = baseAnchors.Count() > 0 ? baseAnchors.Last() : -1;
+    for (size_t k = 0; k < page->instructions.Count(); k++) {
+        DrawInstr *i = &page->instructions.At(k);
+        if (InstrAnchor != i->type)
+            continue;
+        anchors.Append(PageAnchor(*i, pageNo));
+        if (k < 2 && str::StartsWith(i->str.s + i->str.len, "\" page_marker />"))
+            baseAnchor = (int)anchors.Count() - 1;
+    }
+    baseAnchors.Append(baseAnchor);
     CrashIf(baseAnchors.Count() != pages->Count());
+
+    packedPages->AddPage(page->instructions);
+    page->instructions.Reset();
+}
+
+// returns false once all pages have been laid out
+bool EbookEngine::LayoutNextPage()
+{
+    ScopedCritSec scope(&pagesAccess);
+
+    if (!formatter)
+        return false;
+    HtmlPage *page = formatter->Next(skipEmptyPages);
+    if (!page) {
+        delete formatter;
+        formatter = nullptr;
+        pageCount = (int)pages->Count();
+        return false;
+    }
+    // the HTML of streamed documents grows while they're laid out
+    if (formatter->GetHtmlLen() > htmlLen) {
+        htmlLen = formatter->GetHtmlLen();
+        packedPages->SetHtmlLen(htmlLen);
+    }
+    AddLaidOutPage(page);
+
+    // extrapolate the total page count from how much of the document
+    // has been laid out so far (never report fewer pages than we have)
+    pageCount = (int)pages->Count();
+    ptrdiff_t progress = formatter->GetCurrReparseIdx();
+    if (progress > 0 && (size_t)progress < htmlLen) {
+        int64 estimate = (int64)pageCount * htmlLen / progress;
+        pageCount = (int)std::min(estimate, (int64)INT_MAX / 2);
+    }
     return true;
 }
 
+// returns true if page pageNo exists
+bool EbookEngine::LayoutUntil(int pageNo)
+{
+    ScopedCritSec scope(&pagesAccess);
+
+    while (formatter && (int)pages->Count() < pageNo) {
+        LayoutNextPage();
+    }
+    return pageNo <= (int)pages->Count();
+}
+
+void EbookEngine::StopLayout()
+{
+    if (layoutThread) {
+        layoutThread->RequestCancel();
+        layoutThread->Join();
+        delete layoutThread;
+        layoutThread = nullptr;
+    }
+    ScopedCritSec scope(&pagesAccess);
+    delete formatter;
+    formatter = nullptr;
+    if (pages)
+        pageCount = (int)pages->Count();
+}
+
 PointD EbookEngine::Transform(PointD pt, int pageNo, float zoom, int rotation, bool inverse)
 {
     RectD rect = Transform(RectD(pt, SizeD()), pageNo, zoom, rotation, inverse);
@@ -357,7 +500,6 @@ static void DrawAnnotations(Graphics& g, Vec<PageAnnotation>& userAnnots, int pa
 
 RenderedBitmap *EbookEngine::RenderBitmap(int pageNo, float zoom, int rotation, RectD *pageRect, RenderTarget target, AbortCookie **cookieOut)
 {
-    UNUSED(target);
     RectD pageRc = pageRect ? *pageRect : PageMediabox(pageNo);
     RectI screen = Transform(pageRc, pageNo, zoom, rotation).Round();
     PointI screenTL = screen.TL();
@@ -370,6 +512,16 @@ RenderedBitmap *EbookEngine::RenderBitmap(int pageNo, float zoom, int rotation,
 
     Graphics g(hDC);
     mui::InitGraphicsMode(&g);
+    // the text rendering hint must remain the same as for layout
+    RenderQuality quality = Target_View == target ? renderQuality : Quality_Print;
+    if (Quality_FastScroll == quality) {
+        g.SetCompositingQuality(CompositingQualityHighSpeed);
+        g.SetSmoothingMode(SmoothingModeNone);
+        g.SetInterpolationMode(InterpolationModeNearestNeighbor);
+    }
+    else if (Quality_Print == quality) {
+        g.SetInterpolationMode(InterpolationModeHighQualityBicubic);
+    }
 
     Color white(0xFF, 0xFF, 0xFF);
     SolidBrush tmpBrush(white);
@@ -388,8 +540,11 @@ RenderedBitmap *EbookEngine::RenderBitmap(int pageNo, float zoom, int rotation,
 
     ScopedCritSec scope(&pagesAccess);
 
+    ScopedScratch scratch;
+    Vec<DrawInstr> pageInstrs(0, scratch.Get());
+    GetHtmlPage(pageNo, pageInstrs);
     mui::ITextRender *textDraw = mui::TextRenderGdiplus::Create(&g);
-    DrawHtmlPage(&g, textDraw, GetHtmlPage(pageNo), pageBorder, pageBorder, false, Color((ARGB)Color::Black), cookie ? &cookie->abort : nullptr);
+    DrawHtmlPage(&g, textDraw, &pageInstrs, pageBorder, pageBorder, false, Color((ARGB)Color::Black), cookie ? &cookie->abort : nullptr);
     DrawAnnotations(g, userAnnots, pageNo);
     delete textDraw;
     DeleteDC(hDC);
@@ -415,12 +570,17 @@ WCHAR *EbookEngine::ExtractPageText(int pageNo, const WCHAR *lineSep, RectI **co
     UNUSED(target);
     ScopedCritSec scope(&pagesAccess);
 
-    str::Str<WCHAR> content;
-    Vec<RectI> coords;
+    // the text is collected in scratch memory and copied out once complete
+    ScopedScratch scratch;
+    str::Str<WCHAR> content(0, scratch.Get());
+    Vec<RectI> coords(0, scratch.Get());
     bool insertSpace = false;
+    // re-used for decoding all the strings on the page
+    str::Str<WCHAR> text;
 
-    Vec<DrawInstr> *pageInstrs = GetHtmlPage(pageNo);
-    for (DrawInstr& i : *pageInstrs) {
+    Vec<DrawInstr> pageInstrs(0, scratch.Get());
+    GetHtmlPage(pageNo, pageInstrs);
+    for (DrawInstr& i : pageInstrs) {
         RectI bbox = GetInstrBbox(i, pageBorder);
         switch (i.type) {
         case InstrString:
@@ -439,9 +599,9 @@ WCHAR *EbookEngine::ExtractPageText(int pageNo, const WCHAR *lineSep, RectI **co
             }
             insertSpace = false;
             {
-                ScopedMem<WCHAR> s(str::conv::FromHtmlUtf8(i.str.s, i.str.len));
-                content.Append(s);
-                size_t len = str::Len(s);
+                str::conv::FromHtmlUtf8(i.str.s, i.str.len, text);
+                content.Append(text.Get(), text.Count());
+                size_t len = text.Count();
                 double cwidth = 1.0 * bbox.dx / len;
                 for (size_t k = 0; k < len; k++)
                     coords.Append(RectI((int)(bbox.x + k * cwidth), bbox.y, (int)cwidth, bbox.dy));
@@ -463,9 +623,9 @@ WCHAR *EbookEngine::ExtractPageText(int pageNo, const WCHAR *lineSep, RectI **co
             }
             insertSpace = false;
             {
-                ScopedMem<WCHAR> s(str::conv::FromHtmlUtf8(i.str.s, i.str.len));
-                content.Append(s);
-                size_t len = str::Len(s);
+                str::conv::FromHtmlUtf8(i.str.s, i.str.len, text);
+                content.Append(text.Get(), text.Count());
+                size_t len = text.Count();
                 double cwidth = 1.0 * bbox.dx / len;
                 for (size_t k = 0; k < len; k++)
                     coords.Append(RectI((int)(bbox.x + (len - k - 1) * cwidth), bbox.y, (int)cwidth, bbox.dy));
@@ -484,9 +644,9 @@ WCHAR *EbookEngine::ExtractPageText(int pageNo, const WCHAR *lineSep, RectI **co
 
     if (coordsOut) {
         CrashIf(coords.Count() != content.Count());
-        *coordsOut = coords.StealData();
+        *coordsOut = coords.DupData();
     }
-    return content.StealData();
+    return content.DupData();
 }
 
 void EbookEngine::UpdateUserAnnotations(Vec<PageAnnotation> *list)
@@ -504,8 +664,9 @@ PageElement *EbookEngine::CreatePageLink(DrawInstr *link, RectI rect, int pageNo
     if (url::IsAbsolute(url))
         return new EbookLink(link, rect, nullptr, pageNo);
 
-    DrawInstr *baseAnchor = baseAnchors.At(pageNo-1);
-    if (baseAnchor) {
+    int baseAnchorIdx = baseAnchors.At(pageNo-1);
+    if (baseAnchorIdx != -1) {
+        DrawInstr *baseAnchor = &anchors.At(baseAnchorIdx).instr;
         ScopedMem<char> basePath(str::DupN(baseAnchor->str.s, baseAnchor->str.len));
         ScopedMem<char> relPath(ResolveHtmlEntities(link->str.s, link->str.len));
         ScopedMem<char> absPath(NormalizeURL(relPath, basePath));
@@ -522,8 +683,11 @@ Vec<PageElement *> *EbookEngine::GetElements(int pageNo)
 {
     Vec<PageElement *> *els = new Vec<PageElement *>();
 
-    Vec<DrawInstr> *pageInstrs = GetHtmlPage(pageNo);
-    for (DrawInstr& i : *pageInstrs) {
+    // CreatePageLink accesses anchors which might still be growing
+    ScopedCritSec scope(&pagesAccess);
+    Vec<DrawInstr> pageInstrs;
+    GetHtmlPage(pageNo, pageInstrs);
+    for (DrawInstr& i : pageInstrs) {
         if (InstrImage == i.type)
             els->Append(new ImageDataElement(pageNo, &i.img, GetInstrBbox(i, pageBorder)));
         else if (InstrLinkStart == i.type && !i.bbox.IsEmptyArea()) {
@@ -557,6 +721,9 @@ PageElement *EbookEngine::GetElementAtPos(int pageNo, PointD pt)
 
 PageDestination *EbookEngine::GetNamedDest(const WCHAR *name)
 {
+    // anchors are only complete once all pages have been laid out
+    LayoutAllPages();
+
     ScopedMem<char> name_utf8(str::conv::ToUtf8(name));
     const char *id = name_utf8;
     if (str::FindChar(id, '#'))
@@ -566,15 +733,18 @@ PageDestination *EbookEngine::GetNamedDest(const WCHAR *name)
     // try to first skip to the page with the desired
     // path before looking for the ID to allow
     // for the same ID to be reused on different pages
-    DrawInstr *baseAnchor = nullptr;
+    int baseAnchorIdx = -1;
     int basePageNo = 0;
     if (id > name_utf8 + 1) {
         size_t base_len = id - name_utf8 - 1;
         for (size_t i = 0; i < baseAnchors.Count(); i++) {
-            DrawInstr *anchor = baseAnchors.At(i);
-            if (anchor && base_len == anchor->str.len &&
+            int idx = baseAnchors.At(i);
+            if (idx == -1)
+                continue;
+            DrawInstr *anchor = &anchors.At(idx).instr;
+            if (base_len == anchor->str.len &&
                 str::EqNI(name_utf8, anchor->str.s, base_len)) {
-                baseAnchor = anchor;
+                baseAnchorIdx = idx;
                 basePageNo = (int)i + 1;
                 break;
             }
@@ -582,17 +752,13 @@ PageDestination *EbookEngine::GetNamedDest(const WCHAR *name)
     }
 
     size_t id_len = str::Len(id);
-    for (size_t i = 0; i < anchors.Count(); i++) {
+    // only consider anchors following the base anchor
+    for (size_t i = baseAnchorIdx + 1; i < anchors.Count(); i++) {
         PageAnchor *anchor = &anchors.At(i);
-        if (baseAnchor) {
-            if (anchor->instr == baseAnchor)
-                baseAnchor = nullptr;
-            continue;
-        }
         // note: at least CHM treats URLs as case-independent
-        if (id_len == anchor->instr->str.len &&
-            str::EqNI(id, anchor->instr->str.s, id_len)) {
-            RectD rect(0, anchor->instr->bbox.Y + pageBorder, pageRect.dx, 10);
+        if (id_len == anchor->instr.str.len &&
+            str::EqNI(id, anchor->instr.str.s, id_len)) {
+            RectD rect(0, anchor->instr.bbox.Y + pageBorder, pageRect.dx, 10);
             rect.Inflate(-pageBorder, 0);
             return new SimpleDest2(anchor->pageNo, rect);
         }
@@ -611,16 +777,17 @@ PageDestination *EbookEngine::GetNamedDest(const WCHAR *name)
 WCHAR *EbookEngine::ExtractFontList()
 {
     ScopedCritSec scope(&pagesAccess);
+    LayoutAllPages();
 
     Vec<mui::CachedFont *> seenFonts;
     WStrVec fonts;
 
+    Vec<DrawInstr> pageInstrs;
     for (int pageNo = 1; pageNo <= PageCount(); pageNo++) {
-        Vec<DrawInstr> *pageInstrs = GetHtmlPage(pageNo);
-        if (!pageInstrs)
+        if (!GetHtmlPage(pageNo, pageInstrs))
             continue;
 
-        for (DrawInstr& i : *pageInstrs) {
+        for (DrawInstr& i : pageInstrs) {
             if (InstrSetFont != i.type || seenFonts.Contains(i.font))
                 continue;
             seenFonts.Append(i.font);
@@ -673,10 +840,13 @@ class EbookTocBuilder : public EbookTocVisitor {
     EbookTocItem *root;
     int idCounter;
     bool isIndex;
+    // owned by root once GetRoot() has been called
+    PoolAllocator *allocator;
 
 public:
     explicit EbookTocBuilder(BaseEngine *engine) :
-        engine(engine), root(nullptr), idCounter(0), isIndex(false) { }
+        engine(engine), root(nullptr), idCounter(0), isIndex(false), allocator(new PoolAllocator()) { }
+    ~EbookTocBuilder() { delete allocator; }
 
     virtual void Visit(const WCHAR *name, const WCHAR *url, int level) {
         PageDestination *dest;
@@ -693,7 +863,7 @@ public:
             }
         }
 
-        EbookTocItem *item = new EbookTocItem(str::Dup(name), dest);
+        EbookTocItem *item = new (allocator) EbookTocItem(str::Dup(name), dest);
         item->id = ++idCounter;
         if (isIndex) {
             item->pageNo = 0;
@@ -702,7 +872,13 @@ public:
         AppendTocItem(root, item, level);
     }
 
-    EbookTocItem *GetRoot() { return root; }
+    EbookTocItem *GetRoot() {
+        if (root && allocator) {
+            root->OwnAllocator();
+            allocator = nullptr;
+        }
+        return root;
+    }
     void SetIsIndex(bool value) { isIndex = value; }
 };
 
@@ -715,7 +891,8 @@ public:
     BaseEngine *Clone() override {
         if (stream)
             return CreateFromStream(stream);
-        return fileName ? CreateFromFile(fileName) : nullptr;
+        // clones are used for rendering, printing and searching single pages
+        return fileName ? CreateFromFile(fileName, true) : nullptr;
     }
 
     unsigned char *GetFileData(size_t *cbCount) override;
@@ -731,7 +908,7 @@ public:
     bool HasTocTree() const override { return doc->HasToc(); }
     DocTocItem *GetTocTree() override;
 
-    static BaseEngine *CreateFromFile(const WCHAR *fileName);
+    static BaseEngine *CreateFromFile(const WCHAR *fileName, bool layoutOnDemand=false);
     static BaseEngine *CreateFromStream(IStream *stream);
 
 protected:
@@ -745,6 +922,7 @@ protected:
 
 EpubEngineImpl::~EpubEngineImpl()
 {
+    StopLayout();
     delete doc;
     if (stream)
         stream->Release();
@@ -786,11 +964,7 @@ bool EpubEngineImpl::FinishLoading()
     args.textAllocator = &allocator;
     args.textRenderMethod = mui::TextRenderMethodGdiplusQuick;
 
-    pages = EpubFormatter(&args, doc).FormatAllPages(false);
-    if (!ExtractPageAnchors())
-        return false;
-
-    return pages->Count() > 0;
+    return LayoutPages(new EpubFormatter(&args, doc), &args);
 }
 
 unsigned char *EpubEngineImpl::GetFileData(size_t *cbCount)
@@ -836,9 +1010,10 @@ DocTocItem *EpubEngineImpl::GetTocTree()
     return root;
 }
 
-BaseEngine *EpubEngineImpl::CreateFromFile(const WCHAR *fileName)
+BaseEngine *EpubEngineImpl::CreateFromFile(const WCHAR *fileName, bool layoutOnDemand)
 {
     EpubEngineImpl *engine = new EpubEngineImpl();
+    engine->layoutOnDemand = layoutOnDemand;
     if (!engine->Load(fileName)) {
         delete engine;
         return nullptr;
@@ -849,6 +1024,8 @@ BaseEngine *EpubEngineImpl::CreateFromFile(const WCHAR *fileName)
 BaseEngine *EpubEngineImpl::CreateFromStream(IStream *stream)
 {
     EpubEngineImpl *engine = new EpubEngineImpl();
+    // streams are only used for previewing and thumbnailing
+    engine->layoutOnDemand = true;
     if (!engine->Load(stream)) {
         delete engine;
         return nullptr;
@@ -884,9 +1061,12 @@ BaseEngine *CreateFromStream(IStream *stream)
 class Fb2EngineImpl : public EbookEngine {
 public:
     Fb2EngineImpl() : EbookEngine(), doc(nullptr) { }
-    virtual ~Fb2EngineImpl() { delete doc; }
+    virtual ~Fb2EngineImpl() {
+        StopLayout();
+        delete doc;
+    }
     BaseEngine *Clone() override {
-        return fileName ? CreateFromFile(fileName) : nullptr;
+        return fileName ? CreateFromFile(fileName, true) : nullptr;
     }
 
     WCHAR *GetProperty(DocumentProperty prop) override {
@@ -899,7 +1079,7 @@ public:
     bool HasTocTree() const override { return doc->HasToc(); }
     DocTocItem *GetTocTree() override;
 
-    static BaseEngine *CreateFromFile(const WCHAR *fileName);
+    static BaseEngine *CreateFromFile(const WCHAR *fileName, bool layoutOnDemand=false);
     static BaseEngine *CreateFromStream(IStream *stream);
 
 protected:
@@ -937,11 +1117,7 @@ bool Fb2EngineImpl::FinishLoading()
     args.textAllocator = &allocator;
     args.textRenderMethod = mui::TextRenderMethodGdiplusQuick;
 
-    pages = Fb2Formatter(&args, doc).FormatAllPages(false);
-    if (!ExtractPageAnchors())
-        return false;
-
-    return pages->Count() > 0;
+    return LayoutPages(new Fb2Formatter(&args, doc), &args);
 }
 
 DocTocItem *Fb2EngineImpl::GetTocTree()
@@ -954,9 +1130,10 @@ DocTocItem *Fb2EngineImpl::GetTocTree()
     return root;
 }
 
-BaseEngine *Fb2EngineImpl::CreateFromFile(const WCHAR *fileName)
+BaseEngine *Fb2EngineImpl::CreateFromFile(const WCHAR *fileName, bool layoutOnDemand)
 {
     Fb2EngineImpl *engine = new Fb2EngineImpl();
+    engine->layoutOnDemand = layoutOnDemand;
     if (!engine->Load(fileName)) {
         delete engine;
         return nullptr;
@@ -967,6 +1144,8 @@ BaseEngine *Fb2EngineImpl::CreateFromFile(const WCHAR *fileName)
 BaseEngine *Fb2EngineImpl::CreateFromStream(IStream *stream)
 {
     Fb2EngineImpl *engine = new Fb2EngineImpl();
+    // streams are only used for previewing and thumbnailing
+    engine->layoutOnDemand = true;
     if (!engine->Load(stream)) {
         delete engine;
         return nullptr;
@@ -1000,9 +1179,12 @@ BaseEngine *CreateFromStream(IStream *stream)
 class MobiEngineImpl : public EbookEngine {
 public:
     MobiEngineImpl() : EbookEngine(), doc(nullptr) { }
-    ~MobiEngineImpl() override { delete doc; }
+    ~MobiEngineImpl() override {
+        StopLayout();
+        delete doc;
+    }
     BaseEngine *Clone() override {
-        return fileName ? CreateFromFile(fileName) : nullptr;
+        return fileName ? CreateFromFile(fileName, true) : nullptr;
     }
 
     WCHAR *GetProperty(DocumentProperty prop) override {
@@ -1014,7 +1196,7 @@ public:
     bool HasTocTree() const override { return doc->HasToc(); }
     DocTocItem *GetTocTree() override;
 
-    static BaseEngine *CreateFromFile(const WCHAR *fileName);
+    static BaseEngine *CreateFromFile(const WCHAR *fileName, bool layoutOnDemand=false);
     static BaseEngine *CreateFromStream(IStream *stream);
 
 protected:
@@ -1052,11 +1234,7 @@ bool MobiEngineImpl::FinishLoading()
     args.textAllocator = &allocator;
     args.textRenderMethod = mui::TextRenderMethodGdiplusQuick;
 
-    pages = MobiFormatter(&args, doc).FormatAllPages();
-    if (!ExtractPageAnchors())
-        return false;
-
-    return pages->Count() > 0;
+    return LayoutPages(new MobiFormatter(&args, doc), &args, true);
 }
 
 PageDestination *MobiEngineImpl::GetNamedDest(const WCHAR *name)
@@ -1064,6 +1242,7 @@ PageDestination *MobiEngineImpl::GetNamedDest(const WCHAR *name)
     int filePos = _wtoi(name);
     if (filePos < 0 || 0 == filePos && *name != '0')
         return nullptr;
+    LayoutAllPages();
     int pageNo;
     for (pageNo = 1; pageNo < PageCount(); pageNo++) {
         if (pages->At(pageNo)->reparseIdx > filePos)
@@ -1077,11 +1256,12 @@ PageDestination *MobiEngineImpl::GetNamedDest(const WCHAR *name)
         return nullptr;
 
     ScopedCritSec scope(&pagesAccess);
-    Vec<DrawInstr> *pageInstrs = GetHtmlPage(pageNo);
+    Vec<DrawInstr> pageInstrs;
+    GetHtmlPage(pageNo, pageInstrs);
     // link to the bottom of the page, if filePos points
     // beyond the last visible DrawInstr of a page
     float currY = (float)pageRect.dy;
-    for (DrawInstr& i : *pageInstrs) {
+    for (DrawInstr& i : pageInstrs) {
         if ((InstrString == i.type || InstrRtlString == i.type) &&
             i.str.s >= start && i.str.s <= start + htmlLen &&
             i.str.s - start >= filePos) {
@@ -1104,9 +1284,10 @@ DocTocItem *MobiEngineImpl::GetTocTree()
     return root;
 }
 
-BaseEngine *MobiEngineImpl::CreateFromFile(const WCHAR *fileName)
+BaseEngine *MobiEngineImpl::CreateFromFile(const WCHAR *fileName, bool layoutOnDemand)
 {
     MobiEngineImpl *engine = new MobiEngineImpl();
+    engine->layoutOnDemand = layoutOnDemand;
     if (!engine->Load(fileName)) {
         delete engine;
         return nullptr;
@@ -1117,6 +1298,8 @@ BaseEngine *MobiEngineImpl::CreateFromFile(const WCHAR *fileName)
 BaseEngine *MobiEngineImpl::CreateFromStream(IStream *stream)
 {
     MobiEngineImpl *engine = new MobiEngineImpl();
+    // streams are only used for previewing and thumbnailing
+    engine->layoutOnDemand = true;
     if (!engine->Load(stream)) {
         delete engine;
         return nullptr;
@@ -1186,11 +1369,7 @@ bool PdbEngineImpl::Load(const WCHAR *fileName)
     args.textAllocator = &allocator;
     args.textRenderMethod = mui::TextRenderMethodGdiplusQuick;
 
-    pages = HtmlFormatter(&args).FormatAllPages();
-    if (!ExtractPageAnchors())
-        return false;
-
-    return pages->Count() > 0;
+    return LayoutPages(new HtmlFormatter(&args), &args, true);
 }
 
 DocTocItem *PdbEngineImpl::GetTocTree()
@@ -1310,7 +1489,7 @@ void ChmFormatter::HandleTagPagebreak(HtmlToken *t)
         currPage->instructions.Append(DrawInstr::Anchor(attr->val, attr->valLen, bbox));
         pagePath.Set(str::DupN(attr->val, attr->valLen));
         // reset CSS style rules for the new document
-        styleRules.Reset();
+        ResetStyleRules();
     }
 }
 
@@ -1491,11 +1670,7 @@ bool ChmEngineImpl::Load(const WCHAR *fileName)
     args.textAllocator = &allocator;
     args.textRenderMethod = mui::TextRenderMethodGdiplusQuick;
 
-    pages = ChmFormatter(&args, dataCache).FormatAllPages(false);
-    if (!ExtractPageAnchors())
-        return false;
-
-    return pages->Count() > 0;
+    return LayoutPages(new ChmFormatter(&args, dataCache), &args);
 }
 
 PageDestination *ChmEngineImpl::GetNamedDest(const WCHAR *name)
@@ -1553,7 +1728,10 @@ PageElement *ChmEngineImpl::CreatePageLink(DrawInstr *link, RectI rect, int page
     if (linkEl)
         return linkEl;
 
-    DrawInstr *baseAnchor = baseAnchors.At(pageNo-1);
+    int baseAnchorIdx = baseAnchors.At(pageNo-1);
+    if (-1 == baseAnchorIdx)
+        return nullptr;
+    DrawInstr *baseAnchor = &anchors.At(baseAnchorIdx).instr;
     ScopedMem<char> basePath(str::DupN(baseAnchor->str.s, baseAnchor->str.len));
     ScopedMem<char> url(str::DupN(link->str.s, link->str.len));
     url.Set(NormalizeURL(url, basePath));
@@ -1646,11 +1824,7 @@ bool HtmlEngineImpl::Load(const WCHAR *fileName)
     args.textAllocator = &allocator;
     args.textRenderMethod = mui::TextRenderMethodGdiplus;
 
-    pages = HtmlFileFormatter(&args, doc).FormatAllPages(false);
-    if (!ExtractPageAnchors())
-        return false;
-
-    return pages->Count() > 0;
+    return LayoutPages(new HtmlFileFormatter(&args, doc), &args);
 }
 
 class RemoteHtmlDest : public SimpleDest2 {
@@ -1716,9 +1890,13 @@ public:
         // ISO 216 A4 (210mm x 297mm)
         pageRect = RectD(0, 0, 8.27 * GetFileDPI(), 11.693 * GetFileDPI());
     }
-    virtual ~TxtEngineImpl() { delete doc; }
+    virtual ~TxtEngineImpl() {
+        // the formatter might still be converting doc
+        StopLayout();
+        delete doc;
+    }
     BaseEngine *Clone() override {
-        return fileName ? CreateFromFile(fileName) : nullptr;
+        return fileName ? CreateFromFile(fileName, true) : nullptr;
     }
 
     WCHAR *GetProperty(DocumentProperty prop) override {
@@ -1732,7 +1910,7 @@ public:
     bool HasTocTree() const override { return doc->HasToc(); }
     DocTocItem *GetTocTree() override;
 
-    static BaseEngine *CreateFromFile(const WCHAR *fileName);
+    static BaseEngine *CreateFromFile(const WCHAR *fileName, bool layoutOnDemand=false);
 
 protected:
     TxtDoc *doc;
@@ -1755,6 +1933,9 @@ bool TxtEngineImpl::Load(const WCHAR *fileName)
 
     HtmlFormatterArgs args;
     args.htmlStr = doc->GetHtmlData(&args.htmlStrLen);
+    // large documents are converted while they're being laid out
+    // (the formatter is deleted before doc, cf. ~TxtEngineImpl)
+    args.moreHtml = [this] { return doc->ConvertMoreHtml(); };
     args.pageDx = (float)pageRect.dx - 2 * pageBorder;
     args.pageDy = (float)pageRect.dy - 2 * pageBorder;
     args.SetFontName(GetDefaultFontName());
@@ -1762,11 +1943,7 @@ bool TxtEngineImpl::Load(const WCHAR *fileName)
     args.textAllocator = &allocator;
     args.textRenderMethod = mui::TextRenderMethodGdiplus;
 
-    pages = TxtFormatter(&args).FormatAllPages(false);
-    if (!ExtractPageAnchors())
-        return false;
-
-    return pages->Count() > 0;
+    return LayoutPages(new TxtFormatter(&args), &args);
 }
 
 DocTocItem *TxtEngineImpl::GetTocTree()
@@ -1776,9 +1953,10 @@ DocTocItem *TxtEngineImpl::GetTocTree()
     return builder.GetRoot();
 }
 
-BaseEngine *TxtEngineImpl::CreateFromFile(const WCHAR *fileName)
+BaseEngine *TxtEngineImpl::CreateFromFile(const WCHAR *fileName, bool layoutOnDemand)
 {
     TxtEngineImpl *engine = new TxtEngineImpl();
+    engine->layoutOnDemand = layoutOnDemand;
     if (!engine->Load(fileName)) {
         delete engine;
         return nullptr;
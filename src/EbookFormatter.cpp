@@ -65,7 +65,7 @@ void MobiFormatter::HandleSpacing_Mobi(HtmlToken *t)
     // best I can tell, in mobi <p width="1em" height="3pt> means that
     // the first line of the paragrap is indented by 1em and there's
     // 3pt top padding (the same seems to apply for <blockquote>)
-    AttrInfo *attr = t->GetAttrByName("width");
+    AttrInfo *attr = t->GetAttr(Attr_Width);
     if (attr) {
         float lineIndent = ParseSizeAsPixels(attr->val, attr->valLen, CurrFont()->GetSize());
         // there are files with negative width which produces partially invisible
@@ -75,7 +75,7 @@ void MobiFormatter::HandleSpacing_Mobi(HtmlToken *t)
             EmitParagraph(lineIndent);
         }
     }
-    attr = t->GetAttrByName("height");
+    attr = t->GetAttr(Attr_Height);
     if (attr) {
         // for use it in FlushCurrLine()
         currLineTopPadding = ParseSizeAsPixels(attr->val, attr->valLen, CurrFont()->GetSize());
@@ -93,7 +93,7 @@ void MobiFormatter::HandleTagImg(HtmlToken *t)
     if (!doc)
         return;
     bool needAlt = true;
-    AttrInfo *attr = t->GetAttrByName("recindex");
+    AttrInfo *attr = t->GetAttr(Attr_Recindex);
     if (attr) {
         int n;
         if (str::Parse(attr->val, attr->valLen, "%d", &n)) {
@@ -101,7 +101,7 @@ void MobiFormatter::HandleTagImg(HtmlToken *t)
             needAlt = !img || !EmitImage(img);
         }
     }
-    if (needAlt && (attr = t->GetAttrByName("alt")) != nullptr)
+    if (needAlt && (attr = t->GetAttr(Attr_Alt)) != nullptr)
         HandleText(attr->val, attr->valLen);
 }
 
@@ -137,14 +137,14 @@ void EpubFormatter::HandleTagImg(HtmlToken *t)
     if (t->IsEndTag())
         return;
     bool needAlt = true;
-    AttrInfo *attr = t->GetAttrByName("src");
+    AttrInfo *attr = t->GetAttr(Attr_Src);
     if (attr) {
         ScopedMem<char> src(str::DupN(attr->val, attr->valLen));
         url::DecodeInPlace(src);
         ImageData *img = epubDoc->GetImageData(src, pagePath);
         needAlt = !img || !EmitImage(img);
     }
-    if (needAlt && (attr = t->GetAttrByName("alt")) != nullptr)
+    if (needAlt && (attr = t->GetAttr(Attr_Alt)) != nullptr)
         HandleText(attr->val, attr->valLen);
 }
 
@@ -158,7 +158,7 @@ void EpubFormatter::HandleTagPagebreak(HtmlToken *t)
         currPage->instructions.Append(DrawInstr::Anchor(attr->val, attr->valLen, bbox));
         pagePath.Set(str::DupN(attr->val, attr->valLen));
         // reset CSS style rules for the new document
-        styleRules.Reset();
+        ResetStyleRules();
     }
 }
 
@@ -167,13 +167,13 @@ void EpubFormatter::HandleTagLink(HtmlToken *t)
     CrashIf(!epubDoc);
     if (t->IsEndTag())
         return;
-    AttrInfo *attr = t->GetAttrByName("rel");
+    AttrInfo *attr = t->GetAttr(Attr_Rel);
     if (!attr || !attr->ValIs("stylesheet"))
         return;
-    attr = t->GetAttrByName("type");
+    attr = t->GetAttr(Attr_Type);
     if (attr && !attr->ValIs("text/css"))
         return;
-    attr = t->GetAttrByName("href");
+    attr = t->GetAttr(Attr_Href);
     if (!attr)
         return;
 
@@ -211,7 +211,7 @@ void EpubFormatter::HandleHtmlTag(HtmlToken *t)
         UpdateTagNesting(t);
         return;
     }
-    if (0 == hiddenDepth && t->IsStartTag() && t->GetAttrByName("hidden"))
+    if (0 == hiddenDepth && t->IsStartTag() && t->GetAttr(Attr_Hidden))
         hiddenDepth = tagNesting.Count() + 1;
     if (hiddenDepth > 0)
         UpdateTagNesting(t);
@@ -330,14 +330,14 @@ void HtmlFileFormatter::HandleTagImg(HtmlToken *t)
     if (t->IsEndTag())
         return;
     bool needAlt = true;
-    AttrInfo *attr = t->GetAttrByName("src");
+    AttrInfo *attr = t->GetAttr(Attr_Src);
     if (attr) {
         ScopedMem<char> src(str::DupN(attr->val, attr->valLen));
         url::DecodeInPlace(src);
         ImageData *img = htmlDoc->GetImageData(src);
         needAlt = !img || !EmitImage(img);
     }
-    if (needAlt && (attr = t->GetAttrByName("alt")) != nullptr)
+    if (needAlt && (attr = t->GetAttr(Attr_Alt)) != nullptr)
         HandleText(attr->val, attr->valLen);
 }
 
@@ -346,13 +346,13 @@ void HtmlFileFormatter::HandleTagLink(HtmlToken *t)
     CrashIf(!htmlDoc);
     if (t->IsEndTag())
         return;
-    AttrInfo *attr = t->GetAttrByName("rel");
+    AttrInfo *attr = t->GetAttr(Attr_Rel);
     if (!attr || !attr->ValIs("stylesheet"))
         return;
-    attr = t->GetAttrByName("type");
+    attr = t->GetAttr(Attr_Type);
     if (attr && !attr->ValIs("text/css"))
         return;
-    attr = t->GetAttrByName("href");
+    attr = t->GetAttr(Attr_Href);
     if (!attr)
         return;
 
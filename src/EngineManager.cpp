@@ -3,6 +3,8 @@
 
 // utils
 #include "BaseUtil.h"
+#include "FileUtil.h"
+#include "GdiPlusUtil.h"
 // rendering engines
 #include "BaseEngine.h"
 #include "DjVuEngine.h"
@@ -34,12 +36,66 @@ bool IsSupportedFile(const WCHAR *filePath, bool sniff, bool enableEbookEngines)
            );
 }
 
+// reads the beginning of a file once and determines the engine to use from
+// the file's signature (returns Engine_None if there's no unambiguous signature,
+// e.g. for ZIP archives which could be XPS, EPUB or comic book files)
+static EngineType SniffEngineType(const WCHAR *filePath)
+{
+    if (dir::Exists(filePath))
+        return Engine_None;
+    char header[1024] = { 0 };
+    if (!file::ReadN(filePath, header, sizeof(header) - 1))
+        return Engine_None;
+
+    if (str::StartsWith(header, "%PDF-"))
+        return Engine_PDF;
+    if (str::StartsWith(header, "AT&T"))
+        return Engine_DjVu;
+    if (str::StartsWith(header, "ITSF"))
+        return Engine_Chm;
+    if (str::StartsWith(header, "%!PS"))
+        return PsEngine::IsAvailable() ? Engine_PS : Engine_None;
+    if (memeq(header, "Rar!\x1A\x07\x00", 7) || memeq(header, "Rar!\x1A\x07\x01\x00", 8) ||
+        memeq(header, "7z\xBC\xAF\x27\x1C", 6))
+        return Engine_ComicBook;
+    // TGA files don't have a reliable signature
+    const WCHAR *imgExt = GfxFileExtFromData(header, 32);
+    if (imgExt && !str::Eq(imgExt, L".tga"))
+        return Engine_Image;
+    return Engine_None;
+}
+
+static BaseEngine *CreateEngineForType(EngineType engineType, const WCHAR *filePath, PasswordUI *pwdUI)
+{
+    switch (engineType) {
+    case Engine_PDF:       return PdfEngine::CreateFromFile(filePath, pwdUI);
+    case Engine_DjVu:      return DjVuEngine::CreateFromFile(filePath);
+    case Engine_Chm:       return ChmEngine::CreateFromFile(filePath);
+    case Engine_PS:        return PsEngine::CreateFromFile(filePath);
+    case Engine_ComicBook: return CbxEngine::CreateFromFile(filePath);
+    case Engine_Image:     return ImageEngine::CreateFromFile(filePath);
+    default:               return nullptr;
+    }
+}
+
 BaseEngine *CreateEngine(const WCHAR *filePath, PasswordUI *pwdUI, EngineType *typeOut, bool enableChmEngine, bool enableEbookEngines)
 {
     CrashIf(!filePath);
 
-    BaseEngine *engine = nullptr;
-    EngineType engineType = Engine_None;
+    // hand files with a known signature directly to the matching engine,
+    // so that files with a wrong or missing extension don't have to be
+    // opened and read by several failing engines first
+    EngineType engineType = SniffEngineType(filePath);
+    if (Engine_Chm == engineType && !enableChmEngine)
+        engineType = Engine_None;
+    BaseEngine *engine = CreateEngineForType(engineType, filePath, pwdUI);
+    if (engine) {
+        CrashIf(!IsSupportedFile(filePath, true, enableEbookEngines));
+        if (typeOut)
+            *typeOut = engineType;
+        return engine;
+    }
+
     bool sniff = false;
 RetrySniffing:
     if (PdfEngine::IsSupportedFile(filePath, sniff) && engineType != Engine_PDF) {
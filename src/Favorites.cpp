@@ -7,6 +7,7 @@
 #include "FileUtil.h"
 #include "GdiPlusUtil.h"
 #include "LabelWithCloseWnd.h"
+#include "StrFormat.h"
 #include "UITask.h"
 #include "WinUtil.h"
 // rendering engines
@@ -187,8 +188,9 @@ static bool HasFavorites()
 // caller has to free() the result
 static WCHAR *FavReadableName(Favorite *fn)
 {
-    ScopedMem<WCHAR> plainLabel(str::Format(L"%d", fn->pageNo));
-    const WCHAR *label = fn->pageLabel ? fn->pageLabel : plainLabel;
+    fmt::Buf<WCHAR, 16> plainLabel;
+    plainLabel.i(fn->pageNo);
+    const WCHAR *label = fn->pageLabel ? fn->pageLabel : plainLabel.Get();
     if (fn->name) {
         ScopedMem<WCHAR> pageNo(str::Format(_TR("(page %s)"), label));
         return str::Join(fn->name, L" ", pageNo);
@@ -549,8 +551,9 @@ void AddFavorite(WindowInfo *win)
     if (!shouldAdd)
         return;
 
-    ScopedMem<WCHAR> plainLabel(str::Format(L"%d", pageNo));
-    bool needsLabel = !str::Eq(plainLabel, pageLabel);
+    fmt::Buf<WCHAR, 16> plainLabel;
+    plainLabel.i(pageNo);
+    bool needsLabel = !str::Eq(plainLabel.Get(), pageLabel);
 
     RememberFavTreeExpansionStateForAllWindows();
     gFavorites.AddOrReplace(tab->filePath, pageNo, name, needsLabel ? pageLabel.Get() : nullptr);
@@ -559,7 +562,7 @@ void AddFavorite(WindowInfo *win)
     if (fav && fav->favorites->Count() == 2)
         win->expandedFavorites.Append(fav);
     UpdateFavoritesTreeForAllWindows();
-    prefs::Save();
+    prefs::SaveDelayed();
 }
 
 void DelFavorite(WindowInfo *win)
@@ -568,7 +571,7 @@ void DelFavorite(WindowInfo *win)
     RememberFavTreeExpansionStateForAllWindows();
     gFavorites.Remove(win->currentTab->filePath, win->currPageNo);
     UpdateFavoritesTreeForAllWindows();
-    prefs::Save();
+    prefs::SaveDelayed();
 }
 
 void RememberFavTreeExpansionState(WindowInfo *win)
@@ -700,7 +703,7 @@ static void OnFavTreeContextMenu(WindowInfo *win, PointI pt)
             gFavorites.RemoveAllForFile(f->filePath);
         }
         UpdateFavoritesTreeForAllWindows();
-        prefs::Save();
+        prefs::SaveDelayed();
 
         // TODO: it would be nice to have a system for undo-ing things, like in Gmail,
         // so that we can do destructive operations without asking for permission via
@@ -36,6 +36,9 @@ quits.
 // (to keep the settings file within reasonable bounds)
 #define FILE_HISTORY_MAX_FILES 1000
 
+// initial number of slots in FileHistory::pathIndex (must be a power of 2)
+#define PATH_INDEX_MIN_SIZE 64
+
 // sorts the most often used files first
 static int cmpOpenCount(const void *a, const void *b) {
     DisplayState *dsA = *(DisplayState **) a;
@@ -44,15 +47,132 @@ static int cmpOpenCount(const void *a, const void *b) {
     if (dsA->isPinned != dsB->isPinned)
         return dsA->isPinned ? -1 : 1;
     // sort pinned documents alphabetically
-    if (dsA->isPinned)
-        return str::CmpNatural(path::GetBaseName(dsA->filePath), path::GetBaseName(dsB->filePath));
+    if (dsA->isPinned) {
+        int cmp = str::CmpNatural(path::GetBaseName(dsA->filePath), path::GetBaseName(dsB->filePath));
+        if (cmp != 0)
+            return cmp;
+    }
     // sort often opened documents first
-    if (dsA->openCount != dsB->openCount)
+    else if (dsA->openCount != dsB->openCount)
         return dsB->openCount - dsA->openCount;
     // use recency as the criterion in case of equal open counts
     return dsA->index < dsB->index ? -1 : 1;
 }
 
+// same order as cmpOpenCount for a state whose recency relative
+// to the other states is known (but whose index isn't up-to-date)
+static bool IsSortedBefore(DisplayState *ds, DisplayState *other, bool isMoreRecent) {
+    if (ds->isPinned != other->isPinned)
+        return ds->isPinned;
+    if (ds->isPinned) {
+        int cmp = str::CmpNatural(path::GetBaseName(ds->filePath), path::GetBaseName(other->filePath));
+        if (cmp != 0)
+            return cmp < 0;
+    }
+    else if (ds->openCount != other->openCount)
+        return ds->openCount > other->openCount;
+    return isMoreRecent;
+}
+
+// case-insensitive variation of FNV-1a which is consistent with str::EqI
+// for ASCII paths (all non-ASCII characters hash the same)
+static uint32_t GetPathHashI(const WCHAR *path) {
+    uint32_t hash = 2166136261U;
+    for (WCHAR c; (c = *path++) != 0; ) {
+        if (c & 0xFF80)
+            c = 0x80;
+        else if ('A' <= c && c <= 'Z')
+            c += 'a' - 'A';
+        hash = (hash ^ c) * 16777619U;
+    }
+    return hash;
+}
+
+// uses linear probing (index must have a free slot)
+static void InsertIntoIndex(Vec<DisplayState *>& index, DisplayState *state) {
+    size_t mask = index.Count() - 1;
+    size_t i = GetPathHashI(state->filePath) & mask;
+    while (index.At(i)) {
+        i = (i + 1) & mask;
+    }
+    index.At(i) = state;
+}
+
+void FileHistory::RebuildIndex() {
+    pathIndex.Reset();
+    pathIndexCount = 0;
+    hasDuplicatePaths = false;
+    frequencyOrderValid = false;
+    if (!states)
+        return;
+    for (DisplayState *ds : *states) {
+        AddToIndex(ds);
+    }
+}
+
+void FileHistory::AddToIndex(DisplayState *state) {
+    if (!state->filePath)
+        return;
+    DisplayState *existing = Find(state->filePath);
+    if (existing) {
+        if (existing != state)
+            hasDuplicatePaths = true;
+        return;
+    }
+    // keep the table at most half full
+    if (2 * (pathIndexCount + 1) > pathIndex.Count()) {
+        Vec<DisplayState *> prevIndex(pathIndex);
+        pathIndex.Reset();
+        pathIndex.AppendBlanks(std::max((size_t)PATH_INDEX_MIN_SIZE, 2 * prevIndex.Count()));
+        for (DisplayState *ds : prevIndex) {
+            if (ds)
+                InsertIntoIndex(pathIndex, ds);
+        }
+    }
+    InsertIntoIndex(pathIndex, state);
+    pathIndexCount++;
+}
+
+void FileHistory::RemoveFromIndex(DisplayState *state) {
+    if (!state->filePath || pathIndex.Count() == 0)
+        return;
+    size_t mask = pathIndex.Count() - 1;
+    size_t i = GetPathHashI(state->filePath) & mask;
+    for (; pathIndex.At(i) && pathIndex.At(i) != state; i = (i + 1) & mask);
+    if (!pathIndex.At(i))
+        return;
+    pathIndex.At(i) = nullptr;
+    pathIndexCount--;
+    // re-insert the remainder of the cluster so that lookups don't stop at the gap
+    for (i = (i + 1) & mask; pathIndex.At(i); i = (i + 1) & mask) {
+        DisplayState *ds = pathIndex.At(i);
+        pathIndex.At(i) = nullptr;
+        InsertIntoIndex(pathIndex, ds);
+    }
+    if (hasDuplicatePaths) {
+        for (DisplayState *ds : *states) {
+            if (ds != state && str::EqI(ds->filePath, state->filePath)) {
+                AddToIndex(ds);
+                break;
+            }
+        }
+    }
+}
+
+void FileHistory::InsertIntoFrequencyOrder(DisplayState *state, bool isMostRecent) {
+    CrashIf(!frequencyOrderValid);
+    // binary search for the first state to be sorted after the new one
+    size_t lo = 0, hi = frequencyOrder.Count();
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (IsSortedBefore(state, frequencyOrder.At(mid), isMostRecent))
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    frequencyOrder.InsertAt(lo, state);
+}
+
 void FileHistory::Clear(bool keepFavorites) {
     if (!states)
         return;
@@ -66,6 +186,20 @@ void FileHistory::Clear(bool keepFavorites) {
         }
     }
     *states = keep;
+    RebuildIndex();
+}
+
+void FileHistory::Append(DisplayState *state) {
+    states->Append(state);
+    AddToIndex(state);
+    if (frequencyOrderValid)
+        InsertIntoFrequencyOrder(state, false);
+}
+
+void FileHistory::Remove(DisplayState *state) {
+    states->Remove(state);
+    RemoveFromIndex(state);
+    frequencyOrder.Remove(state);
 }
 
 DisplayState *FileHistory::Get(size_t index) const {
@@ -75,11 +209,15 @@ DisplayState *FileHistory::Get(size_t index) const {
 }
 
 DisplayState *FileHistory::Find(const WCHAR *filePath, size_t *idxOut) const {
-    for (size_t i = 0; i < states->Count(); i++) {
-        if (str::EqI(states->At(i)->filePath, filePath)) {
+    if (!filePath || pathIndex.Count() == 0)
+        return nullptr;
+    size_t mask = pathIndex.Count() - 1;
+    for (size_t i = GetPathHashI(filePath) & mask; pathIndex.At(i); i = (i + 1) & mask) {
+        DisplayState *state = pathIndex.At(i);
+        if (str::EqI(state->filePath, filePath)) {
             if (idxOut)
-                *idxOut = i;
-            return states->At(i);
+                *idxOut = (size_t)states->Find(state);
+            return state;
         }
     }
     return nullptr;
@@ -94,12 +232,17 @@ DisplayState *FileHistory::MarkFileLoaded(const WCHAR *filePath) {
     if (!state) {
         state = NewDisplayState(filePath);
         state->useDefaultState = true;
+        AddToIndex(state);
     } else {
         states->Remove(state);
+        frequencyOrder.Remove(state);
         state->isMissing = false;
     }
     states->InsertAt(0, state);
     state->openCount++;
+    // the state is now the most recently used one
+    if (frequencyOrderValid)
+        InsertIntoFrequencyOrder(state, true);
     return state;
 }
 
@@ -128,22 +271,39 @@ bool FileHistory::MarkFileInexistent(const WCHAR *filePath, bool hide) {
     state->thumbnail = nullptr;
     state->openCount >>= 2;
     state->isMissing = hide;
+    frequencyOrderValid = false;
     return true;
 }
 
+void FileHistory::UpdateFilePath(DisplayState *state, const WCHAR *filePath) {
+    RemoveFromIndex(state);
+    str::ReplacePtr(&state->filePath, filePath);
+    AddToIndex(state);
+    // pinned documents are sorted by name
+    frequencyOrderValid = false;
+}
+
 // returns a shallow copy of the file history list, sorted
 // by open count (which has a pre-multiplied recency factor)
 // and with all missing states filtered out
 // caller needs to delete the result (but not the contained states)
 void FileHistory::GetFrequencyOrder(Vec<DisplayState *>& list) {
     CrashIf(list.Count() > 0);
-    size_t i = 0;
-    for (DisplayState *ds : *states) {
-        ds->index = i++;
+    // the sorted order is kept up-to-date by MarkFileLoaded, Append and Remove
+    // and only has to be recreated after less common changes
+    if (!frequencyOrderValid) {
+        frequencyOrder = *states;
+        size_t i = 0;
+        for (DisplayState *ds : frequencyOrder) {
+            ds->index = i++;
+        }
+        frequencyOrder.Sort(cmpOpenCount);
+        frequencyOrderValid = true;
+    }
+    for (DisplayState *ds : frequencyOrder) {
         if (!ds->isMissing || ds->isPinned)
             list.Append(ds);
     }
-    list.Sort(cmpOpenCount);
 }
 
 // removes file history entries which shouldn't be saved anymore
@@ -160,6 +320,7 @@ void FileHistory::Purge(bool alwaysUseDefaultState) {
             minOpenCount = frequencyList.At(FILE_HISTORY_MAX_FREQUENT)->openCount / 2;
     }
 
+    size_t count = states->Count();
     for (size_t j = states->Count(); j > 0; j--) {
         DisplayState *state = states->At(j - 1);
         // never forget pinned documents, documents we've remembered a password for and
@@ -179,4 +340,11 @@ void FileHistory::Purge(bool alwaysUseDefaultState) {
             continue;
         DeleteDisplayState(state);
     }
+    if (states->Count() != count)
+        RebuildIndex();
+}
+
+void FileHistory::UpdateStatesSource(Vec<DisplayState *> *states) {
+    this->states = states;
+    RebuildIndex();
 }
@@ -14,18 +14,36 @@ class FileHistory {
     // owned by gGlobalPrefs->fileStates
     Vec<DisplayState *> *states;
 
+    // open addressing hash table of states by (case-insensitive) file path
+    // (for duplicate paths, only the first state is indexed)
+    Vec<DisplayState *> pathIndex;
+    size_t pathIndexCount;
+    bool hasDuplicatePaths;
+    // all states sorted as returned by GetFrequencyOrder
+    // (only valid if frequencyOrderValid is set)
+    Vec<DisplayState *> frequencyOrder;
+    bool frequencyOrderValid;
+
+    void RebuildIndex();
+    void AddToIndex(DisplayState *state);
+    void RemoveFromIndex(DisplayState *state);
+    void InsertIntoFrequencyOrder(DisplayState *state, bool isMostRecent);
+
 public:
-    FileHistory() : states(nullptr) { }
+    FileHistory() : states(nullptr), pathIndexCount(0), hasDuplicatePaths(false), frequencyOrderValid(false) { }
     ~FileHistory() { }
 
     void Clear(bool keepFavorites);
-    void Append(DisplayState *state) { states->Append(state); }
-    void Remove(DisplayState *state) { states->Remove(state); }
+    void Append(DisplayState *state);
+    void Remove(DisplayState *state);
     DisplayState *Get(size_t index) const;
     DisplayState *Find(const WCHAR *filePath, size_t *idxOut = nullptr) const;
     DisplayState *MarkFileLoaded(const WCHAR *filePath);
     bool MarkFileInexistent(const WCHAR *filePath, bool hide = false);
+    void UpdateFilePath(DisplayState *state, const WCHAR *filePath);
+    // must be called after changing a state's isPinned or openCount directly
+    void InvalidateFrequencyOrder() { frequencyOrderValid = false; }
     void GetFrequencyOrder(Vec<DisplayState *>& list);
     void Purge(bool alwaysUseDefaultState = false);
-    void UpdateStatesSource(Vec<DisplayState *> *states) { this->states = states; }
+    void UpdateStatesSource(Vec<DisplayState *> *states);
 };
@@ -128,9 +128,10 @@ bool SaveFileModifictions(const WCHAR *filePath, Vec<PageAnnotation> *list)
         // in the case of an update, append changed annotations to the existing ones
         // (don't rewrite the existing ones in case they're by a newer version which
         // added annotation types and properties this version doesn't know anything about)
-        for (; offset < prevList->Count() && prevList->At(offset) == list->At(offset); offset++);
+        // and only append the new data to the file instead of rewriting it, so that
+        // repeatedly saving a growing number of annotations stays cheap
+        for (; offset < prevList->Count() && offset < list->Count() && prevList->At(offset) == list->At(offset); offset++);
         CrashIfDebugOnly(offset != prevList->Count());
-        data.AppendAndFree(prevData.StealData());
         delete prevList;
     }
     else {
@@ -170,6 +171,8 @@ bool SaveFileModifictions(const WCHAR *filePath, Vec<PageAnnotation> *list)
     data.RemoveAt(data.Size() - 2, 2);
 
     FileTransaction trans;
+    if (isUpdate)
+        return trans.AppendAll(modificationsPath, data.LendData(), data.Size()) && trans.Commit();
     return trans.WriteAll(modificationsPath, data.LendData(), data.Size()) && trans.Commit();
 }
 
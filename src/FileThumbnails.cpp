@@ -3,9 +3,11 @@
 
 // utils
 #include "BaseUtil.h"
+#include <zlib.h>
 #include "CryptoUtil.h"
 #include "FileUtil.h"
 #include "GdiPlusUtil.h"
+#include "StrFormat.h"
 #include "WinUtil.h"
 // layout controllers
 #include "BaseEngine.h"
@@ -16,43 +18,241 @@
 #include "FileThumbnails.h"
 
 #define THUMBNAILS_DIR_NAME L"sumatrapdfcache"
+#define THUMBNAIL_EXT L".png"
+#define TEXT_INDEX_EXT L".txtidx"
+#define EBOOK_LAYOUT_EXT L".layout"
+#define DJVU_PAGES_EXT L".djvupages"
+#define PDF_PAGES_EXT L".pdfpages"
+#define CBX_INDEX_EXT L".cbxidx"
+// all thumbnails are stored in a single file, so that the start page
+// doesn't have to open and decode dozens of PNG files
+#define THUMBNAIL_PACK_NAME L"thumbnails.dat"
+#define THUMBNAIL_PACK_MAGIC "SThP"
+#define THUMBNAIL_PACK_TMP_EXT L".tmp"
 
-// TODO: create in TEMP directory instead?
-static WCHAR *GetThumbnailPath(const WCHAR *filePath)
+// thumbnails are appended to the pack (so that saving doesn't have to rewrite it)
+// and the last entry for a digest wins; the pack is compacted in CleanUpThumbnailCache
+struct ThumbnailPackEntry {
+    unsigned char digest[16];
+    // when the thumbnail was created (cf. HasThumbnail)
+    FILETIME created;
+    // an empty size removes a previous thumbnail
+    int32 dx, dy;
+    // length of the zlib compressed 24-bit top-down pixel rows following the entry
+    uint32 dataLen;
+};
+
+// create a fingerprint of a (normalized) path
+static bool GetPathDigest(const WCHAR *filePath, unsigned char digest[16])
 {
-    // create a fingerprint of a (normalized) path for the file name
     // I'd have liked to also include the file's last modification time
     // in the fingerprint (much quicker than hashing the entire file's
     // content), but that's too expensive for files on slow drives
-    unsigned char digest[16];
     // TODO: why is this happening? Seen in crash reports e.g. 35043
     if (!filePath)
-        return nullptr;
+        return false;
     ScopedMem<char> pathU(str::conv::ToUtf8(filePath));
     if (!pathU)
-        return nullptr;
+        return false;
     if (path::HasVariableDriveLetter(filePath))
         pathU[0] = '?'; // ignore the drive letter, if it might change
     CalcMD5Digest((unsigned char *)pathU.Get(), str::Len(pathU), digest);
-    ScopedMem<char> fingerPrint(_MemToHex(&digest));
+    return true;
+}
 
+// TODO: create in TEMP directory instead?
+static WCHAR *GetCacheFilePath(const WCHAR *filePath, const WCHAR *ext)
+{
+    unsigned char digest[16];
+    if (!GetPathDigest(filePath, digest))
+        return nullptr;
     ScopedMem<WCHAR> thumbsPath(AppGenDataFilename(THUMBNAILS_DIR_NAME));
     if (!thumbsPath)
         return nullptr;
-    ScopedMem<WCHAR> fname(str::conv::FromAnsi(fingerPrint));
 
-    return str::Format(L"%s\\%s.png", thumbsPath.Get(), fname.Get());
+    // the file name is the hex encoded digest
+    fmt::Buf<WCHAR, MAX_PATH> path;
+    path.s(thumbsPath).c('\\');
+    for (size_t i = 0; i < dimof(digest); i++) {
+        path.hex(digest[i], 2);
+    }
+    path.s(ext);
+    if (path.IsTruncated())
+        return nullptr;
+    return str::Dup(path);
 }
 
-// removes thumbnails that don't belong to any frequently used item in file history
-void CleanUpThumbnailCache(FileHistory& fileHistory)
+// thumbnails used to be saved as individual PNG files, which are still read
+// (but no longer written) until they've been replaced or cleaned up
+static WCHAR *GetThumbnailPath(const WCHAR *filePath)
 {
-    ScopedMem<WCHAR> thumbsPath(AppGenDataFilename(THUMBNAILS_DIR_NAME));
-    if (!thumbsPath)
-        return;
-    ScopedMem<WCHAR> pattern(path::Join(thumbsPath, L"*.png"));
+    return GetCacheFilePath(filePath, THUMBNAIL_EXT);
+}
 
-    WStrVec files;
+// text indices are stored next to the thumbnails, so that they're cleaned up along with them
+WCHAR *GetTextIndexPath(const WCHAR *filePath)
+{
+    return GetCacheFilePath(filePath, TEXT_INDEX_EXT);
+}
+
+WCHAR *GetEbookLayoutPath(const WCHAR *filePath)
+{
+    return GetCacheFilePath(filePath, EBOOK_LAYOUT_EXT);
+}
+
+WCHAR *GetDjVuPageDataPath(const WCHAR *filePath)
+{
+    return GetCacheFilePath(filePath, DJVU_PAGES_EXT);
+}
+
+WCHAR *GetPdfPageDataPath(const WCHAR *filePath)
+{
+    return GetCacheFilePath(filePath, PDF_PAGES_EXT);
+}
+
+WCHAR *GetCbxIndexPath(const WCHAR *filePath)
+{
+    return GetCacheFilePath(filePath, CBX_INDEX_EXT);
+}
+
+static WCHAR *GetThumbnailPackPath()
+{
+    return AppGenDataFilename(THUMBNAILS_DIR_NAME L"\\" THUMBNAIL_PACK_NAME);
+}
+
+// read-only view of the thumbnail pack which is mapped once for any number of lookups
+class ThumbnailPack {
+    HANDLE hFile;
+    HANDLE hMap;
+    const char *data;
+    size_t size;
+
+public:
+    ThumbnailPack() : hFile(INVALID_HANDLE_VALUE), hMap(nullptr), data(nullptr), size(0) {
+        ScopedMem<WCHAR> packPath(GetThumbnailPackPath());
+        if (!packPath)
+            return;
+        // allow thumbnails to be appended and the pack to be replaced while it's mapped
+        hFile = CreateFile(packPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                           nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (INVALID_HANDLE_VALUE == hFile)
+            return;
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(hFile, &fileSize) || fileSize.QuadPart > INT_MAX || fileSize.QuadPart <= 4)
+            return;
+        hMap = CreateFileMapping(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (hMap)
+            data = (const char *)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+        if (data && !str::EqN(data, THUMBNAIL_PACK_MAGIC, 4)) {
+            UnmapViewOfFile(data);
+            data = nullptr;
+        }
+        if (data)
+            size = (size_t)fileSize.QuadPart;
+    }
+    ~ThumbnailPack() {
+        if (data)
+            UnmapViewOfFile(data);
+        if (hMap)
+            CloseHandle(hMap);
+        if (INVALID_HANDLE_VALUE != hFile)
+            CloseHandle(hFile);
+    }
+
+    // returns the most recent entry for digest (or nullptr, if there's none)
+    // the entry's pixel data immediately follows it
+    const ThumbnailPackEntry *Find(const unsigned char digest[16]) const {
+        const ThumbnailPackEntry *found = nullptr;
+        size_t offset = 4;
+        // entries are only ever appended, so a truncated one can only be the last one
+        while (offset + sizeof(ThumbnailPackEntry) <= size) {
+            const ThumbnailPackEntry *entry = (const ThumbnailPackEntry *)(data + offset);
+            offset += sizeof(ThumbnailPackEntry);
+            if (entry->dataLen > size - offset)
+                break;
+            offset += entry->dataLen;
+            if (memeq(entry->digest, digest, 16))
+                found = entry;
+        }
+        if (found && (found->dx <= 0 || found->dy <= 0))
+            return nullptr;
+        return found;
+    }
+};
+
+static int GetThumbnailStride(int dx)
+{
+    return (dx * 3 + 3) / 4 * 4;
+}
+
+static void InitThumbnailBitmapInfo(BITMAPINFO& bmi, SizeI size)
+{
+    ZeroMemory(&bmi, sizeof(bmi));
+    bmi.bmiHeader.biSize = sizeof(bmi.bmiHeader);
+    bmi.bmiHeader.biWidth = size.dx;
+    bmi.bmiHeader.biHeight = -size.dy;
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 24;
+    bmi.bmiHeader.biCompression = BI_RGB;
+}
+
+static RenderedBitmap *LoadPackedThumbnail(const ThumbnailPackEntry *entry)
+{
+    SizeI size(entry->dx, entry->dy);
+    // don't trust the size of a corrupted entry
+    if (size.dx > 4 * THUMBNAIL_DX || size.dy > 4 * THUMBNAIL_DY)
+        return nullptr;
+
+    BITMAPINFO bmi;
+    InitThumbnailBitmapInfo(bmi, size);
+    void *bits = nullptr;
+    HBITMAP hbmp = CreateDIBSection(nullptr, &bmi, DIB_RGB_COLORS, &bits, nullptr, 0);
+    if (!hbmp)
+        return nullptr;
+
+    z_stream stream = { 0 };
+    stream.next_in = (Bytef *)(entry + 1);
+    stream.avail_in = entry->dataLen;
+    stream.next_out = (Bytef *)bits;
+    stream.avail_out = GetThumbnailStride(size.dx) * size.dy;
+    bool ok = inflateInit(&stream) == Z_OK;
+    ok = ok && inflate(&stream, Z_FINISH) == Z_STREAM_END && 0 == stream.avail_out;
+    inflateEnd(&stream);
+    if (!ok) {
+        DeleteObject(hbmp);
+        return nullptr;
+    }
+    return new RenderedBitmap(hbmp, size);
+}
+
+static bool AppendToThumbnailPack(ThumbnailPackEntry& entry, const void *data)
+{
+    ScopedMem<WCHAR> packPath(GetThumbnailPackPath());
+    if (!packPath)
+        return false;
+    ScopedMem<WCHAR> thumbsPath(path::GetDir(packPath));
+    if (!dir::Create(thumbsPath))
+        return false;
+
+    HANDLE hFile = CreateFile(packPath, FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr,
+                              OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (INVALID_HANDLE_VALUE == hFile)
+        return false;
+    LARGE_INTEGER size;
+    bool ok = GetFileSizeEx(hFile, &size);
+    DWORD written;
+    if (ok && 0 == size.QuadPart)
+        ok = WriteFile(hFile, THUMBNAIL_PACK_MAGIC, 4, &written, nullptr) && 4 == written;
+    ok = ok && WriteFile(hFile, &entry, sizeof(entry), &written, nullptr) && sizeof(entry) == written;
+    if (ok && entry.dataLen > 0)
+        ok = WriteFile(hFile, data, entry.dataLen, &written, nullptr) && entry.dataLen == written;
+    CloseHandle(hFile);
+    return ok;
+}
+
+static void FindCacheFiles(const WCHAR *thumbsPath, const WCHAR *ext, WStrVec& files)
+{
+    ScopedMem<WCHAR> pattern(str::Format(L"%s\\*%s", thumbsPath, ext));
     WIN32_FIND_DATA fdata;
 
     HANDLE hfind = FindFirstFile(pattern, &fdata);
@@ -63,18 +263,84 @@ void CleanUpThumbnailCache(FileHistory& fileHistory)
             files.Append(str::Dup(fdata.cFileName));
     } while (FindNextFile(hfind, &fdata));
     FindClose(hfind);
+}
+
+static void KeepCacheFile(WStrVec& files, const WCHAR *cachePath)
+{
+    if (!cachePath)
+        return;
+    int idx = files.Find(path::GetBaseName(cachePath));
+    if (idx != -1) {
+        CrashIf(idx < 0 || files.Count() <= (size_t)idx);
+        free(files.PopAt(idx));
+    }
+}
+
+// rewrites the thumbnail pack with only the most recent thumbnails of the given files
+static void CompactThumbnailPack(Vec<DisplayState *>& keep)
+{
+    ScopedMem<WCHAR> packPath(GetThumbnailPackPath());
+    if (!packPath || !file::Exists(packPath))
+        return;
+
+    str::Str<char> packed;
+    packed.Append(THUMBNAIL_PACK_MAGIC, 4);
+    {
+        ThumbnailPack pack;
+        for (DisplayState *ds : keep) {
+            unsigned char digest[16];
+            const ThumbnailPackEntry *entry = nullptr;
+            if (GetPathDigest(ds->filePath, digest))
+                entry = pack.Find(digest);
+            if (entry)
+                packed.Append((const char *)entry, sizeof(ThumbnailPackEntry) + entry->dataLen);
+        }
+    }
+    if (packed.Size() == (size_t)file::GetSize(packPath))
+        return;
+
+    ScopedMem<WCHAR> tmpPath(str::Join(packPath, THUMBNAIL_PACK_TMP_EXT));
+    bool ok = file::WriteAll(tmpPath, packed.Get(), packed.Size());
+    // fails while the pack is being appended to (in which case it's compacted next time)
+    if (!ok || !MoveFileEx(tmpPath, packPath, MOVEFILE_REPLACE_EXISTING))
+        file::Delete(tmpPath);
+}
+
+// removes thumbnails, text indices, ebook layouts and DjVu page data that don't belong to any frequently used item in file history
+void CleanUpThumbnailCache(FileHistory& fileHistory)
+{
+    ScopedMem<WCHAR> thumbsPath(AppGenDataFilename(THUMBNAILS_DIR_NAME));
+    if (!thumbsPath)
+        return;
 
     Vec<DisplayState *> list;
     fileHistory.GetFrequencyOrder(list);
-    for (size_t i = 0; i < list.Count() && i < FILE_HISTORY_MAX_FREQUENT * 2; i++) {
+    if (list.Count() > FILE_HISTORY_MAX_FREQUENT * 2)
+        list.RemoveAt(FILE_HISTORY_MAX_FREQUENT * 2, list.Count() - FILE_HISTORY_MAX_FREQUENT * 2);
+    CompactThumbnailPack(list);
+
+    WStrVec files;
+    FindCacheFiles(thumbsPath, THUMBNAIL_EXT, files);
+    FindCacheFiles(thumbsPath, TEXT_INDEX_EXT, files);
+    FindCacheFiles(thumbsPath, EBOOK_LAYOUT_EXT, files);
+    FindCacheFiles(thumbsPath, DJVU_PAGES_EXT, files);
+    FindCacheFiles(thumbsPath, CBX_INDEX_EXT, files);
+    if (files.Count() == 0)
+        return;
+
+    for (size_t i = 0; i < list.Count(); i++) {
         ScopedMem<WCHAR> bmpPath(GetThumbnailPath(list.At(i)->filePath));
-        if (!bmpPath)
-            continue;
-        int idx = files.Find(path::GetBaseName(bmpPath));
-        if (idx != -1) {
-            CrashIf(idx < 0 || files.Count() <= (size_t)idx);
-            free(files.PopAt(idx));
-        }
+        KeepCacheFile(files, bmpPath);
+        ScopedMem<WCHAR> indexPath(GetTextIndexPath(list.At(i)->filePath));
+        KeepCacheFile(files, indexPath);
+        ScopedMem<WCHAR> layoutPath(GetEbookLayoutPath(list.At(i)->filePath));
+        KeepCacheFile(files, layoutPath);
+        ScopedMem<WCHAR> pagesPath(GetDjVuPageDataPath(list.At(i)->filePath));
+        KeepCacheFile(files, pagesPath);
+        pagesPath.Set(GetPdfPageDataPath(list.At(i)->filePath));
+        KeepCacheFile(files, pagesPath);
+        pagesPath.Set(GetCbxIndexPath(list.At(i)->filePath));
+        KeepCacheFile(files, pagesPath);
     }
 
     for (size_t i = 0; i < files.Count(); i++) {
@@ -102,34 +368,74 @@ static RenderedBitmap *LoadRenderedBitmap(const WCHAR *filePath)
     return rendered;
 }
 
-bool LoadThumbnail(DisplayState& ds)
+static const ThumbnailPackEntry *FindPackedThumbnail(ThumbnailPack& pack, const WCHAR *filePath)
 {
-    delete ds.thumbnail;
-    ds.thumbnail = nullptr;
-
-    ScopedMem<WCHAR> bmpPath(GetThumbnailPath(ds.filePath));
-    if (!bmpPath)
-        return false;
+    unsigned char digest[16];
+    if (!GetPathDigest(filePath, digest))
+        return nullptr;
+    return pack.Find(digest);
+}
 
-    RenderedBitmap *bmp = LoadRenderedBitmap(bmpPath);
-    if (!bmp || bmp->Size().IsEmpty()) {
+static RenderedBitmap *LoadThumbnailFromPack(ThumbnailPack& pack, const WCHAR *filePath)
+{
+    RenderedBitmap *bmp = nullptr;
+    const ThumbnailPackEntry *entry = FindPackedThumbnail(pack, filePath);
+    if (entry) {
+        bmp = LoadPackedThumbnail(entry);
+    }
+    else {
+        ScopedMem<WCHAR> bmpPath(GetThumbnailPath(filePath));
+        if (bmpPath)
+            bmp = LoadRenderedBitmap(bmpPath);
+    }
+    if (bmp && bmp->Size().IsEmpty()) {
         delete bmp;
-        return false;
+        bmp = nullptr;
     }
+    return bmp;
+}
 
-    ds.thumbnail = bmp;
-    return true;
+// doesn't access any global state, so that it can be called from any thread
+RenderedBitmap *LoadThumbnail(const WCHAR *filePath)
+{
+    ThumbnailPack pack;
+    return LoadThumbnailFromPack(pack, filePath);
+}
+
+void LoadThumbnails(Vec<WCHAR *>& filePaths, Vec<RenderedBitmap *>& bitmaps)
+{
+    ThumbnailPack pack;
+    for (const WCHAR *filePath : filePaths) {
+        bitmaps.Append(LoadThumbnailFromPack(pack, filePath));
+    }
+}
+
+bool LoadThumbnail(DisplayState& ds)
+{
+    delete ds.thumbnail;
+    ds.thumbnail = LoadThumbnail(ds.filePath);
+    return ds.thumbnail != nullptr;
 }
 
 bool HasThumbnail(DisplayState& ds)
 {
-    if (!ds.thumbnail && !LoadThumbnail(ds))
+    ThumbnailPack pack;
+    if (!ds.thumbnail)
+        ds.thumbnail = LoadThumbnailFromPack(pack, ds.filePath);
+    if (!ds.thumbnail)
         return false;
 
-    ScopedMem<WCHAR> bmpPath(GetThumbnailPath(ds.filePath));
-    if (!bmpPath)
-        return true;
-    FILETIME bmpTime = file::GetModificationTime(bmpPath);
+    FILETIME bmpTime;
+    const ThumbnailPackEntry *entry = FindPackedThumbnail(pack, ds.filePath);
+    if (entry) {
+        bmpTime = entry->created;
+    }
+    else {
+        ScopedMem<WCHAR> bmpPath(GetThumbnailPath(ds.filePath));
+        if (!bmpPath)
+            return true;
+        bmpTime = file::GetModificationTime(bmpPath);
+    }
     FILETIME fileTime = file::GetModificationTime(ds.filePath);
     // delete the thumbnail if the file is newer than the thumbnail
     if (FileTimeDiffInSecs(fileTime, bmpTime) > 0) {
@@ -157,15 +463,36 @@ void SaveThumbnail(DisplayState& ds)
     if (!ds.thumbnail)
         return;
 
-    ScopedMem<WCHAR> bmpPath(GetThumbnailPath(ds.filePath));
-    if (!bmpPath)
+    ThumbnailPackEntry entry = { 0 };
+    if (!GetPathDigest(ds.filePath, entry.digest))
+        return;
+    SizeI size = ds.thumbnail->Size();
+    size_t pixelsLen = GetThumbnailStride(size.dx) * size.dy;
+    ScopedMem<BYTE> pixels(AllocArray<BYTE>(pixelsLen));
+    if (!pixels)
+        return;
+    BITMAPINFO bmi;
+    InitThumbnailBitmapInfo(bmi, size);
+    HDC hdc = GetDC(nullptr);
+    int rows = GetDIBits(hdc, ds.thumbnail->GetBitmap(), 0, size.dy, pixels, &bmi, DIB_RGB_COLORS);
+    ReleaseDC(nullptr, hdc);
+    if (rows != size.dy)
         return;
-    ScopedMem<WCHAR> thumbsPath(path::GetDir(bmpPath));
-    if (dir::Create(thumbsPath)) {
-        CrashIf(!str::EndsWithI(bmpPath, L".png"));
-        Bitmap bmp(ds.thumbnail->GetBitmap(), nullptr);
-        CLSID tmpClsid = GetEncoderClsid(L"image/png");
-        bmp.Save(bmpPath.Get(), &tmpClsid, nullptr);
+
+    uLongf dataLen = compressBound((uLong)pixelsLen);
+    ScopedMem<Bytef> data(AllocArray<Bytef>(dataLen));
+    if (!data || compress(data, &dataLen, pixels, (uLong)pixelsLen) != Z_OK)
+        return;
+
+    GetSystemTimeAsFileTime(&entry.created);
+    entry.dx = size.dx;
+    entry.dy = size.dy;
+    entry.dataLen = (uint32)dataLen;
+    if (AppendToThumbnailPack(entry, data)) {
+        // the thumbnail no longer needs to be kept as a PNG file
+        ScopedMem<WCHAR> bmpPath(GetThumbnailPath(ds.filePath));
+        if (bmpPath)
+            file::Delete(bmpPath);
     }
 }
 
@@ -174,6 +501,11 @@ void RemoveThumbnail(DisplayState& ds)
     if (!HasThumbnail(ds))
         return;
 
+    ThumbnailPackEntry entry = { 0 };
+    if (GetPathDigest(ds.filePath, entry.digest)) {
+        GetSystemTimeAsFileTime(&entry.created);
+        AppendToThumbnailPack(entry, nullptr);
+    }
     ScopedMem<WCHAR> bmpPath(GetThumbnailPath(ds.filePath));
     if (bmpPath)
         file::Delete(bmpPath);
@@ -8,8 +8,23 @@
 void    CleanUpThumbnailCache(FileHistory& fileHistory);
 
 bool    LoadThumbnail(DisplayState& ds);
+// caller must delete the result
+RenderedBitmap *LoadThumbnail(const WCHAR *filePath);
+// same as LoadThumbnail for several files at once (bitmaps can contain nullptr)
+void    LoadThumbnails(Vec<WCHAR *>& filePaths, Vec<RenderedBitmap *>& bitmaps);
 bool    HasThumbnail(DisplayState& ds);
 // takes ownership of bmp
 void    SetThumbnail(DisplayState *ds, RenderedBitmap *bmp);
 void    SaveThumbnail(DisplayState& ds);
 void    RemoveThumbnail(DisplayState& ds);
+
+// path of the cached text index for filePath (cf. PageTextCache::StartPrefetching)
+WCHAR * GetTextIndexPath(const WCHAR *filePath);
+// path of the cached page boundaries of an ebook (cf. EbookController::SetLayoutCachePath)
+WCHAR * GetEbookLayoutPath(const WCHAR *filePath);
+// path of the cached page sizes of a DjVu document (cf. DjVuEngine::SetPageDataCache)
+WCHAR * GetDjVuPageDataPath(const WCHAR *filePath);
+// path of the cached page geometry and labels of a PDF document (cf. PdfEngine::SetPageDataCache)
+WCHAR * GetPdfPageDataPath(const WCHAR *filePath);
+// path of the cached entry list, page order and page sizes of a comic book (cf. CbxEngine::SetArchiveIndexCache)
+WCHAR * GetCbxIndexPath(const WCHAR *filePath);
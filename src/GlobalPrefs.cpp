@@ -101,6 +101,26 @@ TabState *NewTabState(DisplayState *ds)
     return state;
 }
 
+TabState *CopyTabState(TabState *src)
+{
+    TabState *state = (TabState *)DeserializeStruct(&gTabStateInfo, nullptr);
+    str::ReplacePtr(&state->filePath, src->filePath);
+    str::ReplacePtr(&state->displayMode, src->displayMode);
+    state->pageNo = src->pageNo;
+    str::ReplacePtr(&state->zoom, src->zoom);
+    state->rotation = src->rotation;
+    state->scrollPos = src->scrollPos;
+    state->showToc = src->showToc;
+    *state->tocState = *src->tocState;
+    return state;
+}
+
+void DeleteTabState(TabState *state)
+{
+    if (state)
+        FreeStruct(&gTabStateInfo, state);
+}
+
 void ResetSessionState(Vec<SessionData *> *sessionData)
 {
     CrashIf(!sessionData);
@@ -24,6 +24,8 @@ void DeleteGlobalPrefs(GlobalPrefs *gp);
 
 SessionData *NewSessionData();
 TabState *NewTabState(DisplayState *ds);
+TabState *CopyTabState(TabState *src);
+void DeleteTabState(TabState *state);
 void ResetSessionState(Vec<SessionData *> *sessionData);
 
 // TODO: those are actually defined in SettingsStructs.cpp
@@ -3,6 +3,7 @@
 
 // utils
 #include "BaseUtil.h"
+#include "EtwTrace.h"
 #include "GdiPlusUtil.h"
 #include "HtmlParserLookup.h"
 #include "CssParser.h"
@@ -118,6 +119,157 @@ DrawInstr DrawInstr::Anchor(const char *s, size_t len, RectF bbox)
     return di;
 }
 
+static LONG gNextHtmlPageId = 0;
+
+LONG HtmlPage::NextId()
+{
+    // pages are created by several formatting threads at once
+    return InterlockedIncrement(&gNextHtmlPageId);
+}
+
+// fractional bits of packed coordinates
+#define PACKED_COORD_SHIFT 4
+// the instruction's bbox is empty
+#define PACKED_NO_BBOX      0x10
+// the instruction's bbox doesn't fit 16-bit fixed-point numbers
+#define PACKED_FLOAT_BBOX   0x20
+// a string isn't part of the document's HTML data
+#define PACKED_STR_POINTER  0x40
+
+static void AppendVarint(str::Str<char>& data, size_t val)
+{
+    while (val >= 0x80) {
+        data.Append((char)(val | 0x80));
+        val >>= 7;
+    }
+    data.Append((char)val);
+}
+
+static size_t ReadVarint(const uint8_t *& s)
+{
+    size_t val = 0;
+    for (int shift = 0; ; shift += 7) {
+        uint8_t c = *s++;
+        val |= (size_t)(c & 0x7F) << shift;
+        if (!(c & 0x80))
+            return val;
+    }
+}
+
+static bool FitsPackedCoord(REAL v)
+{
+    return 0 <= v && v < (1 << (16 - PACKED_COORD_SHIFT));
+}
+
+static uint16_t ToPackedCoord(REAL v)
+{
+    return (uint16_t)floorf(v * (1 << PACKED_COORD_SHIFT) + 0.5f);
+}
+
+static REAL FromPackedCoord(uint16_t v)
+{
+    return (REAL)v / (1 << PACKED_COORD_SHIFT);
+}
+
+void PackedDrawInstrs::PackPointer(const void *p)
+{
+    data.Append((const char *)&p, sizeof(p));
+}
+
+void PackedDrawInstrs::AddPage(Vec<DrawInstr>& instructions)
+{
+    pageOffsets.Append(data.Size());
+    AppendVarint(data, instructions.Count());
+
+    for (DrawInstr& i : instructions) {
+        RectF& bbox = i.bbox;
+        uint8_t flags = (uint8_t)i.type;
+        CrashIf(flags & 0xF0);
+        if (0 == bbox.X && 0 == bbox.Y && 0 == bbox.Width && 0 == bbox.Height)
+            flags |= PACKED_NO_BBOX;
+        else if (!FitsPackedCoord(bbox.X) || !FitsPackedCoord(bbox.Y) ||
+                 !FitsPackedCoord(bbox.Width) || !FitsPackedCoord(bbox.Height))
+            flags |= PACKED_FLOAT_BBOX;
+        bool isStr = InstrString == i.type || InstrRtlString == i.type ||
+                     InstrLinkStart == i.type || InstrAnchor == i.type;
+        if (isStr && !(html <= i.str.s && i.str.s + i.str.len <= html + htmlLen))
+            flags |= PACKED_STR_POINTER;
+        data.Append((char)flags);
+
+        if (flags & PACKED_FLOAT_BBOX) {
+            data.Append((const char *)&bbox, sizeof(bbox));
+        } else if (!(flags & PACKED_NO_BBOX)) {
+            uint16_t coords[4] = {
+                ToPackedCoord(bbox.X), ToPackedCoord(bbox.Y),
+                ToPackedCoord(bbox.Width), ToPackedCoord(bbox.Height)
+            };
+            data.Append((const char *)coords, sizeof(coords));
+        }
+
+        if (isStr) {
+            AppendVarint(data, i.str.len);
+            if ((flags & PACKED_STR_POINTER))
+                PackPointer(i.str.s);
+            else
+                AppendVarint(data, i.str.s - html);
+        } else if (InstrSetFont == i.type) {
+            int idx = fonts.Find(i.font);
+            if (-1 == idx) {
+                idx = (int)fonts.Count();
+                fonts.Append(i.font);
+            }
+            AppendVarint(data, idx);
+        } else if (InstrImage == i.type) {
+            AppendVarint(data, i.img.len);
+            PackPointer(i.img.data);
+        }
+    }
+}
+
+void PackedDrawInstrs::GetPage(size_t idx, Vec<DrawInstr>& instructions) const
+{
+    CrashIf(idx >= pageOffsets.Count());
+    const uint8_t *s = (const uint8_t *)data.Get() + pageOffsets.At(idx);
+    size_t count = ReadVarint(s);
+    DrawInstr *instrs = instructions.AppendBlanks(count);
+
+    for (size_t n = 0; n < count; n++) {
+        DrawInstr& i = instrs[n];
+        uint8_t flags = *s++;
+        i.type = (DrawInstrType)(flags & 0x0F);
+
+        if (flags & PACKED_FLOAT_BBOX) {
+            memcpy(&i.bbox, s, sizeof(i.bbox));
+            s += sizeof(i.bbox);
+        } else if (!(flags & PACKED_NO_BBOX)) {
+            uint16_t coords[4];
+            memcpy(coords, s, sizeof(coords));
+            s += sizeof(coords);
+            i.bbox = RectF(FromPackedCoord(coords[0]), FromPackedCoord(coords[1]),
+                           FromPackedCoord(coords[2]), FromPackedCoord(coords[3]));
+        } else {
+            i.bbox = RectF();
+        }
+
+        if (InstrString == i.type || InstrRtlString == i.type ||
+            InstrLinkStart == i.type || InstrAnchor == i.type) {
+            i.str.len = ReadVarint(s);
+            if ((flags & PACKED_STR_POINTER)) {
+                memcpy(&i.str.s, s, sizeof(i.str.s));
+                s += sizeof(i.str.s);
+            } else {
+                i.str.s = html + ReadVarint(s);
+            }
+        } else if (InstrSetFont == i.type) {
+            i.font = fonts.At(ReadVarint(s));
+        } else if (InstrImage == i.type) {
+            i.img.len = ReadVarint(s);
+            memcpy(&i.img.data, s, sizeof(i.img.data));
+            s += sizeof(i.img.data);
+        }
+    }
+}
+
 StyleRule::StyleRule() : tag(Tag_NotFound), textIndentUnit(inherit), textAlign(Align_NotFound) { }
 
 // parses size in the form "1em", "3pt" or "15px"
@@ -182,14 +334,15 @@ HtmlFormatter::HtmlFormatter(HtmlFormatterArgs *args) :
     pageDx(args->pageDx), pageDy(args->pageDy),
     textAllocator(args->textAllocator), currLineReparseIdx(0),
     currX(0), currY(0), currLineTopPadding(0), currLinkIdx(0),
-    listDepth(0), preFormatted(false), dirRtl(false), currPage(nullptr),
-    finishedParsing(false), pageCount(0),
+    listDepth(0), preFormatted(false), dirRtl(false), currLineInstr(0, lineScratch.Get()),
+    currPage(nullptr), finishedParsing(false), pageCount(0),
     keepTagNesting(false)
 {
     currReparseIdx = args->reparseIdx;
     htmlParser = new HtmlPullParser(args->htmlStr, args->htmlStrLen);
     htmlParser->SetCurrPosOff(currReparseIdx);
     CrashIf(!ValidReparseIdx(currReparseIdx, htmlParser));
+    moreHtml = args->moreHtml;
 
     gfx = mui::AllocGraphicsForMeasureText();
     textMeasure = CreateTextRender(args->textRenderMethod, gfx, 10, 10);
@@ -791,9 +944,9 @@ void HtmlFormatter::HandleAnchorAttr(HtmlToken *t, bool idsOnly)
     if (t->IsEndTag())
         return;
 
-    AttrInfo *attr = t->GetAttrByName("id");
+    AttrInfo *attr = t->GetAttr(Attr_Id);
     if (!attr && !idsOnly && Tag_A == t->tag)
-        attr = t->GetAttrByName("name");
+        attr = t->GetAttr(Attr_Name);
     if (!attr)
         return;
 
@@ -808,7 +961,7 @@ void HtmlFormatter::HandleDirAttr(HtmlToken *t)
 {
     // only apply reading direction changes to block elements (for now)
     if (t->IsStartTag() && !IsInlineTag(t->tag)) {
-        AttrInfo *attr = t->GetAttrByName("dir");
+        AttrInfo *attr = t->GetAttr(Attr_Dir);
         if (attr)
             dirRtl = CurrStyle()->dirRtl = attr->ValIs("RTL");
     }
@@ -825,7 +978,7 @@ void HtmlFormatter::HandleTagBr()
 
 static AlignAttr GetAlignAttr(HtmlToken *t, AlignAttr defVal)
 {
-    AttrInfo *attr = t->GetAttrByName("align");
+    AttrInfo *attr = t->GetAttr(Attr_Align);
     if (!attr)
         return defVal;
     AlignAttr align = FindAlignAttr(attr->val, attr->valLen);
@@ -869,7 +1022,7 @@ void HtmlFormatter::HandleTagFont(HtmlToken *t)
         return;
     }
 
-    AttrInfo *attr = t->GetAttrByName("face");
+    AttrInfo *attr = t->GetAttr(Attr_Face);
     const WCHAR *faceName = CurrFont()->GetName();
     if (attr) {
         size_t strLen = str::Utf8ToWcharBuf(attr->val, attr->valLen, buf, dimof(buf));
@@ -881,7 +1034,7 @@ void HtmlFormatter::HandleTagFont(HtmlToken *t)
     }
 
     float fontSize = CurrFont()->GetSize();
-    attr = t->GetAttrByName("size");
+    attr = t->GetAttr(Attr_Size);
     if (attr) {
         // the sizes are in the range from 1 (tiny) to 7 (huge)
         int size = 3; // normal size
@@ -974,11 +1127,58 @@ void HtmlFormatter::HandleTagPre(HtmlToken *t)
     }
 }
 
+// maximum number of cached results of ComputeStyleRule per style sheet
+// (documents with lots of different inline styles shouldn't use much memory)
+#define MAX_COMPUTED_STYLE_RULES 4096
+
+static size_t StyleRuleHash(HtmlTag tag, uint32_t classHash, uint32_t styleHash=0)
+{
+    return (size_t)((tag * 0x9E3779B1u) ^ classHash ^ (styleHash * 0x85EBCA6Bu));
+}
+
+// hash indices are open addressing tables which contain the index of an item
+// plus 1 (0 for empty slots) and are kept at most half full
+static bool HashIndexNeedsGrowing(Vec<int>& slots, size_t itemCount)
+{
+    return itemCount * 2 > slots.Count();
+}
+
+static void AddToHashIndex(Vec<int>& slots, size_t hash, size_t idx)
+{
+    size_t mask = slots.Count() - 1;
+    size_t i = hash & mask;
+    while (slots.At(i) != 0) {
+        i = (i + 1) & mask;
+    }
+    slots.At(i) = (int)idx + 1;
+}
+
+static void ResetHashIndex(Vec<int>& slots, size_t itemCount)
+{
+    size_t count = 64;
+    while (itemCount * 2 > count) {
+        count *= 2;
+    }
+    slots.Reset();
+    slots.AppendBlanks(count);
+}
+
+void HtmlFormatter::ResetStyleRules()
+{
+    styleRules.Reset();
+    styleRulesIdx.Reset();
+    computedRules.Reset();
+    computedRulesIdx.Reset();
+}
+
 StyleRule *HtmlFormatter::FindStyleRule(HtmlTag tag, const char *clazz, size_t clazzLen)
 {
+    if (0 == styleRulesIdx.Count())
+        return nullptr;
     uint32_t classHash = clazz ? MurmurHash2(clazz, clazzLen) : 0;
-    for (size_t i = 0; i < styleRules.Count(); i++) {
-        StyleRule& rule = styleRules.At(i);
+    size_t mask = styleRulesIdx.Count() - 1;
+    for (size_t i = StyleRuleHash(tag, classHash) & mask; styleRulesIdx.At(i) != 0; i = (i + 1) & mask) {
+        StyleRule& rule = styleRules.At(styleRulesIdx.At(i) - 1);
         if (tag == rule.tag && classHash == rule.classHash)
             return &rule;
     }
@@ -987,6 +1187,21 @@ StyleRule *HtmlFormatter::FindStyleRule(HtmlTag tag, const char *clazz, size_t c
 
 StyleRule HtmlFormatter::ComputeStyleRule(HtmlToken *t)
 {
+    // TODO: support multiple class names
+    AttrInfo *classAttr = t->GetAttr(Attr_Class);
+    AttrInfo *styleAttr = t->GetAttr(Attr_Style);
+    uint32_t classHash = classAttr ? MurmurHash2(classAttr->val, classAttr->valLen) : 0;
+    uint32_t styleHash = styleAttr ? MurmurHash2(styleAttr->val, styleAttr->valLen) : 0;
+    size_t hash = StyleRuleHash(t->tag, classHash, styleHash);
+    if (computedRulesIdx.Count() > 0) {
+        size_t mask = computedRulesIdx.Count() - 1;
+        for (size_t i = hash & mask; computedRulesIdx.At(i) != 0; i = (i + 1) & mask) {
+            ComputedStyleRule& computed = computedRules.At(computedRulesIdx.At(i) - 1);
+            if (t->tag == computed.tag && classHash == computed.classHash && styleHash == computed.styleHash)
+                return computed.rule;
+        }
+    }
+
     StyleRule rule;
     // get style rules ordered by specificity
     StyleRule *prevRule = FindStyleRule(Tag_Body, nullptr, 0);
@@ -995,19 +1210,32 @@ StyleRule HtmlFormatter::ComputeStyleRule(HtmlToken *t)
     if (prevRule) rule.Merge(*prevRule);
     prevRule = FindStyleRule(t->tag, nullptr, 0);
     if (prevRule) rule.Merge(*prevRule);
-    // TODO: support multiple class names
-    AttrInfo *attr = t->GetAttrByName("class");
-    if (attr) {
-        prevRule = FindStyleRule(Tag_Any, attr->val, attr->valLen);
+    if (classAttr) {
+        prevRule = FindStyleRule(Tag_Any, classAttr->val, classAttr->valLen);
         if (prevRule) rule.Merge(*prevRule);
-        prevRule = FindStyleRule(t->tag, attr->val, attr->valLen);
+        prevRule = FindStyleRule(t->tag, classAttr->val, classAttr->valLen);
         if (prevRule) rule.Merge(*prevRule);
     }
-    attr = t->GetAttrByName("style");
-    if (attr) {
-        StyleRule newRule = StyleRule::Parse(attr->val, attr->valLen);
+    if (styleAttr) {
+        StyleRule newRule = StyleRule::Parse(styleAttr->val, styleAttr->valLen);
         rule.Merge(newRule);
     }
+
+    if (computedRules.Count() >= MAX_COMPUTED_STYLE_RULES) {
+        computedRules.Reset();
+        computedRulesIdx.Reset();
+    }
+    ComputedStyleRule computed = { t->tag, classHash, styleHash, rule };
+    computedRules.Append(computed);
+    if (HashIndexNeedsGrowing(computedRulesIdx, computedRules.Count())) {
+        ResetHashIndex(computedRulesIdx, computedRules.Count());
+        for (size_t i = 0; i < computedRules.Count(); i++) {
+            ComputedStyleRule& c = computedRules.At(i);
+            AddToHashIndex(computedRulesIdx, StyleRuleHash(c.tag, c.classHash, c.styleHash), i);
+        }
+    } else {
+        AddToHashIndex(computedRulesIdx, hash, computedRules.Count() - 1);
+    }
     return rule;
 }
 
@@ -1028,16 +1256,28 @@ void HtmlFormatter::ParseStyleSheet(const char *data, size_t len)
                 rule.tag = sel->tag;
                 rule.classHash = sel->clazz ? MurmurHash2(sel->clazz, sel->clazzLen) : 0;
                 styleRules.Append(rule);
+                if (HashIndexNeedsGrowing(styleRulesIdx, styleRules.Count())) {
+                    ResetHashIndex(styleRulesIdx, styleRules.Count());
+                    for (size_t i = 0; i < styleRules.Count(); i++) {
+                        StyleRule& r = styleRules.At(i);
+                        AddToHashIndex(styleRulesIdx, StyleRuleHash(r.tag, r.classHash), i);
+                    }
+                } else {
+                    AddToHashIndex(styleRulesIdx, StyleRuleHash(rule.tag, rule.classHash), styleRules.Count() - 1);
+                }
             }
         }
     }
+    // previously computed rules might no longer apply
+    computedRules.Reset();
+    computedRulesIdx.Reset();
 }
 
 void HtmlFormatter::HandleTagStyle(HtmlToken *t)
 {
     if (!t->IsStartTag())
         return;
-    AttrInfo *attr = t->GetAttrByName("type");
+    AttrInfo *attr = t->GetAttr(Attr_Type);
     if (attr && !attr->ValIs("text/css"))
         return;
 
@@ -1311,8 +1551,31 @@ static bool IsEmptyPage(HtmlPage *p)
 // xml element at a time. This might cause a creation of one
 // or more pages, which we remeber and send to the caller
 // if we detect accumulated pages.
+// the HTML of streamed documents is requested ahead of time, so that the parser
+// only ever reaches the end of the data at the end of the document
+#define HTML_LOOKAHEAD  (64 * 1024)
+
+void HtmlFormatter::RequestMoreHtml()
+{
+    while (moreHtml && (size_t)(htmlParser->Start() + htmlParser->Len() - htmlParser->CurrPos()) < HTML_LOOKAHEAD) {
+        size_t newLen = moreHtml();
+        if (newLen > htmlParser->Len())
+            htmlParser->SetLen(newLen);
+        else
+            moreHtml = nullptr;
+    }
+}
+
+size_t HtmlFormatter::GetHtmlLen() const
+{
+    return htmlParser->Len();
+}
+
 HtmlPage *HtmlFormatter::Next(bool skipEmptyPages)
 {
+    // the size is the offset into the html at which the page ends
+    etw::Span span("HtmlLayoutPage", etw::KeywordLayout, pageCount + 1);
+    ScopedMemTraceTag memTag(MemTag_EbookLayout);
     for (;;)
     {
         // send out all pages accumulated so far
@@ -1321,14 +1584,17 @@ HtmlPage *HtmlFormatter::Next(bool skipEmptyPages)
             pageCount++;
             if (skipEmptyPages && IsEmptyPage(ret))
                 delete ret;
-            else
+            else {
+                span.SetSize(currReparseIdx);
                 return ret;
+            }
         }
         // we can call ourselves recursively to send outstanding
         // pages after parsing has finished so this is to detect
         // that case and really end parsing
         if (finishedParsing)
             return nullptr;
+        RequestMoreHtml();
         HtmlToken *t = htmlParser->Next();
         if (!t || t->IsError())
             break;
@@ -1366,13 +1632,56 @@ Vec<HtmlPage*> *HtmlFormatter::FormatAllPages(bool skipEmptyPages)
 // mouse is over a link. There's a slight complication here: we only get explicit information about
 // strings, not about the whitespace and we should underline the whitespace as well. Also the text
 // should be underlined at a baseline
+#define MAX_TEXT_RUN_PARTS 64
+#define MAX_TEXT_RUN_PART_LEN 512
+
+// consecutive strings of a line in the same font, to be drawn together
+// with a single ITextRender::DrawRun call
+struct TextRun {
+    WCHAR buf[4 * MAX_TEXT_RUN_PART_LEN];
+    size_t len;
+    mui::TextRunPart parts[MAX_TEXT_RUN_PARTS];
+    size_t partsCount;
+
+    TextRun() : len(0), partsCount(0) { }
+
+    bool CanAppend(RectF& bbox) const {
+        if (0 == partsCount)
+            return true;
+        if (MAX_TEXT_RUN_PARTS == partsCount || len + MAX_TEXT_RUN_PART_LEN > dimof(buf))
+            return false;
+        return parts[0].bbox.Y == bbox.Y && parts[0].bbox.Height == bbox.Height;
+    }
+
+    void Append(DrawInstr& i, RectF& bbox) {
+        WCHAR *dst = buf + len;
+        size_t strLen = str::Utf8ToWcharBuf(i.str.s, i.str.len, dst, MAX_TEXT_RUN_PART_LEN);
+        // soft hyphens should not be displayed
+        strLen -= str::RemoveChars(dst, L"\xad");
+        if (0 == strLen)
+            return;
+        parts[partsCount].len = strLen;
+        parts[partsCount].bbox = bbox;
+        partsCount++;
+        len += strLen;
+    }
+
+    void Flush(mui::ITextRender *textDraw) {
+        if (partsCount > 0)
+            textDraw->DrawRun(buf, parts, partsCount);
+        len = partsCount = 0;
+    }
+};
+
 void DrawHtmlPage(Graphics *g, mui::ITextRender *textDraw, Vec<DrawInstr> *drawInstructions, REAL offX, REAL offY, bool showBbox, Color textColor, bool *abortCookie)
 {
     Pen debugPen(Color(255, 0, 0), 1);
     //Pen linePen(Color(0, 0, 0), 2.f);
     Pen linePen(Color(0x5F, 0x4B, 0x32), 2.f);
 
-    WCHAR buf[512];
+    WCHAR buf[MAX_TEXT_RUN_PART_LEN];
+    TextRun run;
+    mui::CachedFont *currFont = nullptr;
 
     // GDI text rendering suffers terribly if we call GetHDC()/ReleaseHDC() around every
     // draw, so first draw text and then paint everything else
@@ -1384,17 +1693,26 @@ void DrawHtmlPage(Graphics *g, mui::ITextRender *textDraw, Vec<DrawInstr> *drawI
         RectF bbox = i.bbox;
         bbox.X += offX;
         bbox.Y += offY;
-        if (InstrString == i.type || InstrRtlString == i.type) {
+        if (InstrString == i.type) {
+            if (!run.CanAppend(bbox))
+                run.Flush(textDraw);
+            run.Append(i, bbox);
+        } else if (InstrRtlString == i.type) {
+            run.Flush(textDraw);
             size_t strLen = str::Utf8ToWcharBuf(i.str.s, i.str.len, buf, dimof(buf));
             // soft hyphens should not be displayed
             strLen -= str::RemoveChars(buf, L"\xad");
-            textDraw->Draw(buf, strLen, bbox, InstrRtlString == i.type);
-        } else if (InstrSetFont == i.type) {
+            textDraw->Draw(buf, strLen, bbox, true);
+        } else if (InstrSetFont == i.type && i.font != currFont) {
+            run.Flush(textDraw);
             textDraw->SetFont(i.font);
+            currFont = i.font;
         }
         if (abortCookie && *abortCookie)
             break;
     }
+    if (!abortCookie || !*abortCookie)
+        run.Flush(textDraw);
     textDraw->Unlock();
     double dur = t.Stop();
     lf("DrawHtmlPage: textDraw %.2f ms", dur);
@@ -76,6 +76,14 @@ struct StyleRule {
     static StyleRule Parse(const char *s, size_t len);
 };
 
+// the StyleRule computed for an element's tag, class and inline style
+struct ComputedStyleRule {
+    HtmlTag     tag;
+    uint32_t    classHash;
+    uint32_t    styleHash;
+    StyleRule   rule;
+};
+
 struct DrawStyle {
     mui::CachedFont *font;
     AlignAttr align;
@@ -84,7 +92,10 @@ struct DrawStyle {
 
 class HtmlPage {
 public:
-    explicit HtmlPage(int reparseIdx=0) : reparseIdx(reparseIdx) { }
+    explicit HtmlPage(int reparseIdx=0) : reparseIdx(reparseIdx), id(NextId()) { }
+
+    // returns a new id (unique for the lifetime of the process)
+    static LONG NextId();
 
     Vec<DrawInstr>  instructions;
     // if we start parsing html again from reparseIdx, we should
@@ -93,6 +104,34 @@ public:
     // TODO: reparsing from reparseIdx can lead to different styling
     // due to internal state of HtmlFormatter not being properly set
     int             reparseIdx;
+    // identifies the page's content (e.g. for caching the rendered page)
+    LONG            id;
+};
+
+// compact encoding of the DrawInstr of all pages of a document (e.g. for
+// keeping a whole book laid out in memory): coordinates are stored as 16-bit
+// fixed-point numbers (if they fit), strings as varint encoded offsets into
+// the document's HTML data and fonts as indices into a table shared by all pages
+class PackedDrawInstrs {
+    const char *    html;
+    size_t          htmlLen;
+    Vec<mui::CachedFont *> fonts;
+    str::Str<char>  data;
+    // start of every page within data
+    Vec<size_t>     pageOffsets;
+
+    void PackPointer(const void *p);
+
+public:
+    PackedDrawInstrs(const char *html, size_t htmlLen) : html(html), htmlLen(htmlLen) { }
+
+    // for html which grows in place (cf. HtmlFormatterArgs::moreHtml)
+    void SetHtmlLen(size_t newLen) { htmlLen = newLen; }
+
+    void AddPage(Vec<DrawInstr>& instructions);
+    size_t PageCount() const { return pageOffsets.Count(); }
+    // appends the instructions of page idx (0-based) to instructions
+    void GetPage(size_t idx, Vec<DrawInstr>& instructions) const;
 };
 
 // just to pack args to HtmlFormatter
@@ -121,6 +160,10 @@ public:
 
     const char *    htmlStr;
     size_t          htmlStrLen;
+    // for documents which are converted to HTML while they're being laid out:
+    // returns the new length of htmlStr (which must grow in place) once
+    // the formatter gets close to htmlStrLen, or the same length at the end
+    std::function<size_t()> moreHtml;
 
     // we start parsing from htmlStr + reparseIdx
     int             reparseIdx;
@@ -186,12 +229,14 @@ protected:
     void  RevertStyleChange();
 
     void  ParseStyleSheet(const char *data, size_t len);
+    void  ResetStyleRules();
     StyleRule *FindStyleRule(HtmlTag tag, const char *clazz, size_t clazzLen);
     StyleRule ComputeStyleRule(HtmlToken *t);
 
     void  AppendInstr(DrawInstr di);
     bool  IsCurrLineEmpty();
     virtual bool IgnoreText();
+    void  RequestMoreHtml();
 
     void DumpLineDebugInfo();
 
@@ -226,8 +271,15 @@ protected:
     bool                keepTagNesting;
     // set from CSS and to be checked by the individual tag handlers
     Vec<StyleRule>      styleRules;
-
-    // isntructions for the current line
+    // hash index over styleRules by tag and class hash
+    Vec<int>            styleRulesIdx;
+    // cache for ComputeStyleRule (invalidated whenever styleRules change)
+    Vec<ComputedStyleRule> computedRules;
+    Vec<int>            computedRulesIdx;
+
+    // isntructions for the current line (they're allocated from the
+    // thread's ScratchArena since the line is reset after each flush)
+    ScopedScratch       lineScratch;
     Vec<DrawInstr>      currLineInstr;
     // reparse point of the first instructions in a current line
     ptrdiff_t           currLineReparseIdx;
@@ -240,6 +292,8 @@ protected:
     ptrdiff_t           currReparseIdx;
 
     HtmlPullParser *    htmlParser;
+    // cf. HtmlFormatterArgs::moreHtml
+    std::function<size_t()> moreHtml;
 
     // list of pages that we've created but haven't yet sent to client
     Vec<HtmlPage*>      pagesToSend;
@@ -257,6 +311,10 @@ public:
 
     HtmlPage *Next(bool skipEmptyPages=true);
     Vec<HtmlPage*> *FormatAllPages(bool skipEmptyPages=true);
+    // offset into the html data up to which layout has progressed
+    ptrdiff_t GetCurrReparseIdx() const { return currReparseIdx; }
+    // length of the html data available so far
+    size_t GetHtmlLen() const;
 };
 
 void DrawHtmlPage(Graphics *g, mui::ITextRender *textRender, Vec<DrawInstr> *drawInstructions, REAL offX, REAL offY, bool showBbox, Color textColor, bool *abortCookie=nullptr);
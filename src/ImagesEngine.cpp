@@ -9,14 +9,30 @@
 #include "HtmlParserLookup.h"
 #include "HtmlPullParser.h"
 #include "JsonParser.h"
+#include "ThreadUtil.h"
 #include "WinUtil.h"
 // rendering engines
 #include "BaseEngine.h"
 #include "ImagesEngine.h"
 #include "PdfCreator.h"
-
-// number of decoded bitmaps to cache for quicker rendering
-#define MAX_IMAGE_PAGE_CACHE    10
+#include "DebugLog.h"
+
+// default maximum estimated memory used for caching decoded bitmaps for quicker
+// rendering (cf. ImageEngine::SetMaxPageCacheMemory)
+#define MAX_IMAGE_PAGE_CACHE_MEMORY (256 * 1024 * 1024)
+// number of pages following and preceding the most recently rendered one
+// which are decoded in the background (cf. ImagesEngine::PrefetchPages)
+#define PREFETCH_PAGES_AFTER    3
+#define PREFETCH_PAGES_BEFORE   1
+// number of bytes read from the start of an image file for determining its size
+// (enough for the headers of most images, including JPEGs with large Exif data)
+#define IMAGE_HEADER_PROBE_SIZE (128 * 1024)
+// images with at least this many pixels are drawn from downscaled copies
+// at low zoom levels and only in parts (cf. ImagesEngine::DrawHugePage)
+#define MIPMAP_MIN_IMAGE_PIXELS (4096 * 4096)
+#define MAX_MIPMAP_LEVELS       6
+// images are drawn in strips of this many rows so that rendering can be aborted
+#define IMAGE_DRAW_STRIP_ROWS   512
 
 ///// ImagesEngine methods apply to all types of engines handling full-page images /////
 
@@ -25,15 +41,43 @@ struct ImagePage {
     Bitmap *bmp;
     bool ownBmp;
     int refs;
+    size_t size; // estimated memory requirement of the decoded bitmap
+    // the bitmap has been decoded at 1/2^l2factor of the image's size
+    int l2factor;
+    // for huge images: mips.At(i) is bmp downscaled to 1/2^(i+1)
+    // (allocated with ::new, cf. ImagesEngine::GetMipmap)
+    Vec<Bitmap *> mips;
 
     ImagePage(int pageNo, Bitmap *bmp) :
-        pageNo(pageNo), bmp(bmp), ownBmp(true), refs(1) { }
+        pageNo(pageNo), bmp(bmp), ownBmp(true), refs(1), size(0), l2factor(0) { }
+};
+
+class ImagesAbortCookie : public AbortCookie {
+public:
+    volatile bool abort;
+    ImagesAbortCookie() : abort(false) { }
+    void Abort() override { abort = true; }
 };
 
+// estimated memory used by the decoded bitmaps cached by all documents
+// (the most recently used page of a document is always kept, no matter its size)
+static LONG gImageCacheBytes = 0;
+static LONG gMaxImageCacheBytes = MAX_IMAGE_PAGE_CACHE_MEMORY;
+
+static size_t EstimateBitmapSize(Bitmap *bmp)
+{
+    if (!bmp)
+        return 0;
+    size_t size = (size_t)bmp->GetWidth() * bmp->GetHeight() * std::max(GetPixelFormatSize(bmp->GetPixelFormat()) / 8, 1U);
+    return std::min(size, (size_t)(INT_MAX / 4));
+}
+
 class ImageElement;
+class ImagePagePrefetcher;
 
 class ImagesEngine : public BaseEngine {
     friend ImageElement;
+    friend ImagePagePrefetcher;
 
 public:
     ImagesEngine();
@@ -47,6 +91,7 @@ public:
     RenderedBitmap *RenderBitmap(int pageNo, float zoom, int rotation,
                          RectD *pageRect=nullptr, /* if nullptr: defaults to the page's mediabox */
                          RenderTarget target=Target_View, AbortCookie **cookie_out=nullptr) override;
+    void SetRenderQuality(RenderQuality quality) override { renderQuality = quality; }
 
     PointD Transform(PointD pt, int pageNo, float zoom, int rotation, bool inverse=false) override;
     RectD Transform(RectD rect, int pageNo, float zoom, int rotation, bool inverse=false) override;
@@ -60,6 +105,7 @@ public:
         return nullptr;
     }
     bool HasClipOptimizations(int pageNo) override { UNUSED(pageNo);  return false; }
+    void ReleaseCaches(bool inBackground) override;
     PageLayoutType PreferredLayout() override { return Layout_NonContinuous; }
     bool IsImageCollection() const override { return true; }
 
@@ -83,23 +129,67 @@ protected:
     CRITICAL_SECTION cacheAccess;
     Vec<ImagePage *> pageCache;
     Vec<RectD> mediaboxes;
+    // the page most recently rendered for display (cached pages are
+    // evicted starting with the ones farthest away from it)
+    int currentPageNo;
+    // set by engines whose LoadBitmap may be called from several threads at once
+    // (such engines must call StopPrefetching in their destructor)
+    bool canPrefetch;
+    Vec<ImagePagePrefetcher *> prefetchers;
+    // profile for Target_View renderings (cf. SetRenderQuality)
+    RenderQuality renderQuality;
 
     void GetTransform(Matrix& m, int pageNo, float zoom, int rotation);
+    Bitmap *GetMipmap(ImagePage *page, int level);
+    Status DrawHugePage(Graphics& g, ImagePage *page, RectD region, int level, ImageAttributes *imgAttrs,
+                        ImagesAbortCookie *cookie=nullptr);
 
-    virtual Bitmap *LoadBitmap(int pageNo, bool& deleteAfterUse) = 0;
+    // l2factor is the reduction at which the image may be decoded (cf. ScaledBitmapFromData)
+    // and must be updated to the reduction which has actually been applied
+    virtual Bitmap *LoadBitmap(int pageNo, bool& deleteAfterUse, int& l2factor) = 0;
     virtual RectD LoadMediabox(int pageNo) = 0;
 
-    ImagePage *GetPage(int pageNo, bool tryOnly=false);
+    ImagePage *GetPage(int pageNo, bool tryOnly=false, int l2factor=0);
     void DropPage(ImagePage *page, bool forceRemove=false);
+    ImagePage *FindCachedPage(int pageNo, int l2factor=0);
+    void AddToCache(ImagePage *page, size_t index);
+    bool IsCacheFull() const { return gImageCacheBytes >= gMaxImageCacheBytes; }
+
+    void PrefetchPages(int pageNo, size_t pageSize, int l2factor);
+    void PrefetchPage(int pageNo, int l2factor);
+    void StopPrefetching();
 };
 
-ImagesEngine::ImagesEngine() : fileName(nullptr)
+// decodes a single page in the background (cf. ImagesEngine::PrefetchPages)
+class ImagePagePrefetcher : public ThreadBase {
+    ImagesEngine *engine;
+
+public:
+    int pageNo;
+    int l2factor;
+    volatile bool finished;
+
+    ImagePagePrefetcher(ImagesEngine *engine, int pageNo, int l2factor) :
+        ThreadBase("ImagePagePrefetcher"), engine(engine), pageNo(pageNo),
+        l2factor(l2factor), finished(false) { }
+    virtual void Run() override {
+        SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+        if (!WasCancelRequested())
+            engine->PrefetchPage(pageNo, l2factor);
+        finished = true;
+    }
+};
+
+ImagesEngine::ImagesEngine() : fileName(nullptr), currentPageNo(1), canPrefetch(false),
+    renderQuality(Quality_Balanced)
 {
     InitializeCriticalSection(&cacheAccess);
 }
 
 ImagesEngine::~ImagesEngine()
 {
+    StopPrefetching();
+
     EnterCriticalSection(&cacheAccess);
     while (pageCache.Count() > 0) {
         CrashIf(pageCache.Last()->refs != 1);
@@ -122,10 +212,30 @@ RectD ImagesEngine::PageMediabox(int pageNo)
 
 RenderedBitmap *ImagesEngine::RenderBitmap(int pageNo, float zoom, int rotation, RectD *pageRect, RenderTarget target, AbortCookie **cookieOut)
 {
-    UNUSED(target); UNUSED(cookieOut);
-    ImagePage *page = GetPage(pageNo);
+    ImagesAbortCookie *cookie = nullptr;
+    if (cookieOut)
+        *cookieOut = cookie = new ImagesAbortCookie();
+
+    // at low zoom levels, (JPEG) images don't have to be decoded at full size
+    // (printing and exporting always use the full resolution)
+    int l2factor = 0;
+    while (Target_View == target && l2factor < 3 && zoom * (2 << l2factor) <= 1.0f) {
+        l2factor++;
+    }
+    ImagePage *page = GetPage(pageNo, false, l2factor);
     if (!page)
         return nullptr;
+    // decoding can't be aborted, drawing can
+    if (cookie && cookie->abort) {
+        DropPage(page);
+        return nullptr;
+    }
+
+    // printing and exporting don't page back and forth
+    if (Target_View == target)
+        currentPageNo = pageNo;
+    if (canPrefetch && Target_View == target)
+        PrefetchPages(pageNo, page->size, l2factor);
 
     RectD pageRc = pageRect ? *pageRect : PageMediabox(pageNo);
     RectI screen = Transform(pageRc, pageNo, zoom, rotation).Round();
@@ -138,8 +248,18 @@ RenderedBitmap *ImagesEngine::RenderBitmap(int pageNo, float zoom, int rotation,
     DeleteObject(SelectObject(hDC, hbmp));
 
     Graphics g(hDC);
-    g.SetCompositingQuality(CompositingQualityHighQuality);
-    g.SetSmoothingMode(SmoothingModeAntiAlias);
+    RenderQuality quality = Target_View == target ? renderQuality : Quality_Print;
+    if (Quality_FastScroll == quality) {
+        g.SetCompositingQuality(CompositingQualityHighSpeed);
+        g.SetSmoothingMode(SmoothingModeNone);
+        g.SetInterpolationMode(InterpolationModeNearestNeighbor);
+    }
+    else {
+        g.SetCompositingQuality(CompositingQualityHighQuality);
+        g.SetSmoothingMode(SmoothingModeAntiAlias);
+        if (Quality_Print == quality)
+            g.SetInterpolationMode(InterpolationModeHighQualityBicubic);
+    }
     g.SetPageUnit(UnitPixel);
 
     Color white(0xFF, 0xFF, 0xFF);
@@ -156,7 +276,21 @@ RenderedBitmap *ImagesEngine::RenderBitmap(int pageNo, float zoom, int rotation,
     RectI pageRcI = PageMediabox(pageNo).Round();
     ImageAttributes imgAttrs;
     imgAttrs.SetWrapMode(WrapModeTileFlipXY);
-    Status ok = g.DrawImage(page->bmp, pageRcI.ToGdipRect(), 0, 0, pageRcI.dx, pageRcI.dy, UnitPixel, &imgAttrs);
+    Status ok;
+    if ((size_t)page->bmp->GetWidth() * page->bmp->GetHeight() < MIPMAP_MIN_IMAGE_PIXELS) {
+        // (the bitmap might be smaller than the page, if it's been decoded at a reduced size)
+        RectI src(0, 0, page->bmp->GetWidth(), page->bmp->GetHeight());
+        ok = DrawImageInStrips(g, page->bmp, pageRcI.ToGdipRectF(), src, &imgAttrs, cookie);
+    }
+    else {
+        // as with l2factor, only downscale further for display
+        int level = 0;
+        float bmpZoom = zoom * pageRcI.dx / page->bmp->GetWidth();
+        while (Target_View == target && level < MAX_MIPMAP_LEVELS && bmpZoom * (2 << level) <= 1.0f) {
+            level++;
+        }
+        ok = DrawHugePage(g, page, pageRc, level, &imgAttrs, cookie);
+    }
 
     DropPage(page);
     DeleteDC(hDC);
@@ -175,6 +309,89 @@ void ImagesEngine::GetTransform(Matrix& m, int pageNo, float zoom, int rotation)
     GetBaseTransform(m, PageMediabox(pageNo).ToGdipRectF(), zoom, rotation);
 }
 
+// returns the page's bitmap downscaled to 1/2^level, creating the missing
+// levels from the next larger one (or the smallest level that could be created)
+Bitmap *ImagesEngine::GetMipmap(ImagePage *page, int level)
+{
+    ScopedCritSec scope(&cacheAccess);
+    while ((int)page->mips.Count() < level) {
+        Bitmap *src = page->mips.Count() > 0 ? page->mips.Last() : page->bmp;
+        int w = src->GetWidth() / 2, h = src->GetHeight() / 2;
+        if (w < 1 || h < 1)
+            break;
+        Bitmap *mip = ::new Bitmap(w, h, PixelFormat32bppPARGB);
+        Status ok = mip->GetLastStatus();
+        if (Ok == ok) {
+            Graphics g(mip);
+            g.SetInterpolationMode(InterpolationModeHighQualityBilinear);
+            g.SetPixelOffsetMode(PixelOffsetModeHalf);
+            ImageAttributes imgAttrs;
+            imgAttrs.SetWrapMode(WrapModeTileFlipXY);
+            ok = g.DrawImage(src, Rect(0, 0, w, h), 0, 0, src->GetWidth(), src->GetHeight(), UnitPixel, &imgAttrs);
+        }
+        if (ok != Ok) {
+            ::delete mip;
+            break;
+        }
+        page->mips.Append(mip);
+        size_t size = EstimateBitmapSize(mip);
+        page->size += size;
+        if (pageCache.Contains(page))
+            InterlockedExchangeAdd(&gImageCacheBytes, (LONG)size);
+    }
+    if (0 == level || 0 == page->mips.Count())
+        return page->bmp;
+    return page->mips.At(std::min(level, (int)page->mips.Count()) - 1);
+}
+
+// draws the src part of bmp into dest in horizontal strips so that rendering
+// can be aborted in between through cookie (in which case Aborted is returned)
+static Status DrawImageInStrips(Graphics& g, Bitmap *bmp, RectF dest, RectI src, ImageAttributes *imgAttrs,
+                                ImagesAbortCookie *cookie)
+{
+    if (!cookie || src.dy <= IMAGE_DRAW_STRIP_ROWS)
+        return g.DrawImage(bmp, dest, (REAL)src.x, (REAL)src.y, (REAL)src.dx, (REAL)src.dy, UnitPixel, imgAttrs);
+
+    REAL sy = dest.Height / src.dy;
+    Status ok = Ok;
+    for (int y = 0; y < src.dy && Ok == ok; y += IMAGE_DRAW_STRIP_ROWS) {
+        if (cookie->abort) {
+            ok = Aborted;
+            break;
+        }
+        int rows = std::min(IMAGE_DRAW_STRIP_ROWS, src.dy - y);
+        g.SetClip(RectF(dest.X, dest.Y + y * sy, dest.Width, rows * sy));
+        // let the strips overlap a few rows so that they're filtered alike at their edges
+        int y0 = std::max(y - 2, 0), y1 = std::min(y + rows + 2, src.dy);
+        RectF stripDest(dest.X, dest.Y + y0 * sy, dest.Width, (y1 - y0) * sy);
+        ok = g.DrawImage(bmp, stripDest, (REAL)src.x, (REAL)(src.y + y0), (REAL)src.dx, (REAL)(y1 - y0), UnitPixel, imgAttrs);
+    }
+    g.ResetClip();
+    return ok;
+}
+
+// draws only the part of a huge page's bitmap (or of one of its downscaled
+// copies) which intersects region, so that rendering single tiles at high
+// zoom levels and whole pages at low zoom levels remains affordable
+Status ImagesEngine::DrawHugePage(Graphics& g, ImagePage *page, RectD region, int level, ImageAttributes *imgAttrs,
+                                  ImagesAbortCookie *cookie)
+{
+    Bitmap *bmp = GetMipmap(page, level);
+    RectD mediabox = PageMediabox(page->pageNo);
+    double sx = bmp->GetWidth() / mediabox.dx, sy = bmp->GetHeight() / mediabox.dy;
+
+    region = region.Intersect(mediabox);
+    RectI src = RectD(region.x * sx, region.y * sy, region.dx * sx, region.dy * sy).Round();
+    // include a few more pixels so that adjacent tiles are filtered alike
+    src.Inflate(2, 2);
+    src = src.Intersect(RectI(0, 0, bmp->GetWidth(), bmp->GetHeight()));
+    if (src.IsEmpty())
+        return Ok;
+
+    RectF dest((REAL)(src.x / sx), (REAL)(src.y / sy), (REAL)(src.dx / sx), (REAL)(src.dy / sy));
+    return DrawImageInStrips(g, bmp, dest, src, imgAttrs, cookie);
+}
+
 PointD ImagesEngine::Transform(PointD pt, int pageNo, float zoom, int rotation, bool inverse)
 {
     RectD rect = Transform(RectD(pt, SizeD()), pageNo, zoom, rotation, inverse);
@@ -269,30 +486,59 @@ bool ImagesEngine::SaveFileAs(const WCHAR *copyFileName, bool includeUserAnnots)
     return false;
 }
 
-ImagePage *ImagesEngine::GetPage(int pageNo, bool tryOnly)
+// returns the cached bitmap with the lowest resolution that
+// is still at least 1/2^l2factor of the image's size
+ImagePage *ImagesEngine::FindCachedPage(int pageNo, int l2factor)
 {
     ScopedCritSec scope(&cacheAccess);
-
     ImagePage *result = nullptr;
+    for (ImagePage *page : pageCache) {
+        if (page->pageNo == pageNo && page->l2factor <= l2factor && (!result || page->l2factor > result->l2factor))
+            result = page;
+    }
+    return result;
+}
 
-    for (size_t i = 0; i < pageCache.Count(); i++) {
-        if (pageCache.At(i)->pageNo == pageNo) {
-            result = pageCache.At(i);
-            break;
+// the caller must hold cacheAccess
+void ImagesEngine::AddToCache(ImagePage *page, size_t index)
+{
+    pageCache.InsertAt(std::min(index, pageCache.Count()), page);
+    InterlockedExchangeAdd(&gImageCacheBytes, (LONG)page->size);
+
+    // TODO: drop most memory intensive pages first
+    // (i.e. formats which aren't IsGdiPlusNativeFormat)?
+    while (gImageCacheBytes > gMaxImageCacheBytes) {
+        // evict the page farthest away from the current one (and the
+        // least recently used one of two equally distant pages) but
+        // never the current or the most recently used page
+        ImagePage *evict = nullptr;
+        for (size_t i = pageCache.Count() - 1; i > 0; i--) {
+            ImagePage *candidate = pageCache.At(i);
+            if (candidate->pageNo == currentPageNo)
+                continue;
+            if (!evict || abs(candidate->pageNo - currentPageNo) > abs(evict->pageNo - currentPageNo))
+                evict = candidate;
         }
+        if (!evict)
+            break;
+        DropPage(evict, true);
     }
+}
+
+ImagePage *ImagesEngine::GetPage(int pageNo, bool tryOnly, int l2factor)
+{
+    ScopedCritSec scope(&cacheAccess);
+
+    ImagePage *result = FindCachedPage(pageNo, l2factor);
     if (!result && tryOnly)
         return nullptr;
     if (!result) {
-        // TODO: drop most memory intensive pages first
-        // (i.e. formats which aren't IsGdiPlusNativeFormat)?
-        if (pageCache.Count() >= MAX_IMAGE_PAGE_CACHE) {
-            CrashIf(pageCache.Count() != MAX_IMAGE_PAGE_CACHE);
-            DropPage(pageCache.Last(), true);
-        }
+        ScopedMemTraceTag memTag(MemTag_ImageCache);
         result = new ImagePage(pageNo, nullptr);
-        result->bmp = LoadBitmap(pageNo, result->ownBmp);
-        pageCache.InsertAt(0, result);
+        result->l2factor = l2factor;
+        result->bmp = LoadBitmap(pageNo, result->ownBmp, result->l2factor);
+        result->size = EstimateBitmapSize(result->bmp);
+        AddToCache(result, 0);
     }
     else if (result != pageCache.At(0)) {
         // keep the list Most Recently Used first
@@ -313,16 +559,113 @@ void ImagesEngine::DropPage(ImagePage *page, bool forceRemove)
     ScopedCritSec scope(&cacheAccess);
     page->refs--;
 
-    if (0 == page->refs || forceRemove)
-        pageCache.Remove(page);
+    if ((0 == page->refs || forceRemove) && pageCache.Remove(page))
+        InterlockedExchangeAdd(&gImageCacheBytes, -(LONG)page->size);
 
     if (0 == page->refs) {
         if (page->ownBmp)
             delete page->bmp;
+        for (Bitmap *mip : page->mips) {
+            ::delete mip;
+        }
         delete page;
     }
 }
 
+// documents in background tabs only keep their current page cached
+void ImagesEngine::ReleaseCaches(bool inBackground)
+{
+    if (!inBackground)
+        return;
+
+    ScopedCritSec scope(&cacheAccess);
+    for (size_t i = pageCache.Count(); i > 0; i--) {
+        if (pageCache.At(i - 1)->pageNo != currentPageNo)
+            DropPage(pageCache.At(i - 1), true);
+    }
+}
+
+// starts decoding the pages around pageNo in the background, as far as
+// they'd fit into the cache (assuming they're about as large as pageNo)
+void ImagesEngine::PrefetchPages(int pageNo, size_t pageSize, int l2factor)
+{
+    ScopedCritSec scope(&cacheAccess);
+    if (!canPrefetch)
+        return;
+
+    for (size_t i = 0; i < prefetchers.Count(); i++) {
+        if (prefetchers.At(i)->finished) {
+            prefetchers.At(i)->Join();
+            delete prefetchers.At(i);
+            prefetchers.RemoveAt(i--);
+        }
+    }
+
+    size_t fittingPages = (size_t)gMaxImageCacheBytes / std::max(pageSize, (size_t)1);
+    int maxPages = fittingPages > 1 ? (int)std::min(fittingPages - 1, (size_t)(PREFETCH_PAGES_AFTER + PREFETCH_PAGES_BEFORE)) : 0;
+    for (int i = 1; i <= maxPages; i++) {
+        // visit pageNo + 1, ..., pageNo + PREFETCH_PAGES_AFTER, pageNo - 1, ...
+        int nextNo = i <= PREFETCH_PAGES_AFTER ? pageNo + i : pageNo + PREFETCH_PAGES_AFTER - i;
+        if (nextNo < 1 || nextNo > PageCount() || FindCachedPage(nextNo, l2factor))
+            continue;
+        bool pending = false;
+        for (ImagePagePrefetcher *prefetcher : prefetchers) {
+            pending = pending || prefetcher->pageNo == nextNo;
+        }
+        if (pending)
+            continue;
+        ImagePagePrefetcher *prefetcher = new ImagePagePrefetcher(this, nextNo, l2factor);
+        prefetchers.Append(prefetcher);
+        prefetcher->Start();
+    }
+}
+
+// called on an ImagePagePrefetcher's thread
+void ImagesEngine::PrefetchPage(int pageNo, int l2factor)
+{
+    bool ownBmp = true;
+    int requested = l2factor;
+    Bitmap *bmp = LoadBitmap(pageNo, ownBmp, l2factor);
+    if (!bmp)
+        return;
+    // GDI+ only decodes images when they're drawn for the first time
+    Rect rect(0, 0, bmp->GetWidth(), bmp->GetHeight());
+    BitmapData bmpData;
+    if (bmp->LockBits(&rect, ImageLockModeRead, bmp->GetPixelFormat(), &bmpData) == Ok)
+        bmp->UnlockBits(&bmpData);
+
+    ScopedCritSec scope(&cacheAccess);
+    if (FindCachedPage(pageNo, requested)) {
+        // the page has been loaded for rendering in the meantime
+        if (ownBmp)
+            delete bmp;
+        return;
+    }
+    ImagePage *page = new ImagePage(pageNo, bmp);
+    page->ownBmp = ownBmp;
+    page->size = EstimateBitmapSize(bmp);
+    page->l2factor = l2factor;
+    // keep the most recently rendered page in front
+    AddToCache(page, 1);
+}
+
+void ImagesEngine::StopPrefetching()
+{
+    EnterCriticalSection(&cacheAccess);
+    Vec<ImagePagePrefetcher *> pending;
+    pending.Append(prefetchers.LendData(), prefetchers.Count());
+    prefetchers.Reset();
+    canPrefetch = false;
+    LeaveCriticalSection(&cacheAccess);
+
+    // prefetchers need cacheAccess for finishing
+    for (ImagePagePrefetcher *prefetcher : pending) {
+        prefetcher->RequestCancel();
+        prefetcher->Join();
+        delete prefetcher;
+    }
+}
+
 ///// ImageEngine handles a single image file /////
 
 class ImageEngineImpl : public ImagesEngine {
@@ -350,7 +693,7 @@ protected:
     bool LoadFromStream(IStream *stream);
     bool FinishLoading();
 
-    virtual Bitmap *LoadBitmap(int pageNo, bool& deleteAfterUse);
+    virtual Bitmap *LoadBitmap(int pageNo, bool& deleteAfterUse, int& l2factor);
     virtual RectD LoadMediabox(int pageNo);
 };
 
@@ -475,8 +818,10 @@ WCHAR *ImageEngineImpl::GetProperty(DocumentProperty prop)
     }
 }
 
-Bitmap *ImageEngineImpl::LoadBitmap(int pageNo, bool& deleteAfterUse)
+Bitmap *ImageEngineImpl::LoadBitmap(int pageNo, bool& deleteAfterUse, int& l2factor)
 {
+    // the image has already been decoded while loading
+    l2factor = 0;
     if (1 == pageNo) {
         deleteAfterUse = false;
         return image;
@@ -505,7 +850,7 @@ RectD ImageEngineImpl::LoadMediabox(int pageNo)
         return RectD(0, 0, image->GetWidth(), image->GetHeight());
 
     // fill the cache to prevent the first few frames from being unpacked twice
-    ImagePage *page = GetPage(pageNo, MAX_IMAGE_PAGE_CACHE == pageCache.Count());
+    ImagePage *page = GetPage(pageNo, IsCacheFull());
     if (page) {
         RectD mbox(0, 0, page->bmp->GetWidth(), page->bmp->GetHeight());
         DropPage(page);
@@ -513,6 +858,8 @@ RectD ImageEngineImpl::LoadMediabox(int pageNo)
     }
 
     CrashIf(!str::Eq(fileExt, L".tif") && !str::Eq(fileExt, L".gif"));
+    // image is also used by LoadBitmap (and GDI+ objects aren't thread safe)
+    ScopedCritSec scope(&cacheAccess);
     RectD mbox = RectD(0, 0, image->GetWidth(), image->GetHeight());
     Bitmap *frame = image->Clone(0, 0, image->GetWidth(), image->GetHeight(), PixelFormat32bppARGB);
     if (!frame)
@@ -606,6 +953,16 @@ BaseEngine *CreateFromStream(IStream *stream)
     return ImageEngineImpl::CreateFromStream(stream);
 }
 
+void SetMaxPageCacheMemory(size_t maxBytes)
+{
+    gMaxImageCacheBytes = (LONG)std::min(maxBytes, (size_t)(INT_MAX / 2));
+}
+
+size_t GetPageCacheMemory()
+{
+    return (size_t)std::max(gImageCacheBytes, (LONG)0);
+}
+
 }
 
 ///// ImageDirEngine handles a directory full of image files /////
@@ -642,7 +999,7 @@ public:
 protected:
     bool LoadImageDir(const WCHAR *dirName);
 
-    virtual Bitmap *LoadBitmap(int pageNo, bool& deleteAfterUse);
+    virtual Bitmap *LoadBitmap(int pageNo, bool& deleteAfterUse, int& l2factor);
     virtual RectD LoadMediabox(int pageNo);
 
     WStrVec pageFileNames;
@@ -714,13 +1071,15 @@ public:
 
 DocTocItem *ImageDirEngineImpl::GetTocTree()
 {
-    DocTocItem *root = new ImageDirTocItem(GetPageLabel(1), 1);
+    PoolAllocator *allocator = new PoolAllocator();
+    DocTocItem *root = new (allocator) ImageDirTocItem(GetPageLabel(1), 1);
     root->id = 1;
     for (int i = 2; i <= PageCount(); i++) {
-        DocTocItem *item = new ImageDirTocItem(GetPageLabel(i), i);
+        DocTocItem *item = new (allocator) ImageDirTocItem(GetPageLabel(i), i);
         item->id = i;
         root->AddSibling(item);
     }
+    root->OwnAllocator();
     return root;
 }
 
@@ -739,19 +1098,31 @@ bool ImageDirEngineImpl::SaveFileAs(const WCHAR *copyFileName, bool includeUserA
     return ok;
 }
 
-Bitmap *ImageDirEngineImpl::LoadBitmap(int pageNo, bool& deleteAfterUse)
+Bitmap *ImageDirEngineImpl::LoadBitmap(int pageNo, bool& deleteAfterUse, int& l2factor)
 {
     size_t len;
     ScopedMem<char> bmpData(file::ReadAll(pageFileNames.At(pageNo - 1), &len));
     if (bmpData) {
         deleteAfterUse = true;
-        return BitmapFromData(bmpData, len);
+        return ScaledBitmapFromData(bmpData, len, l2factor);
     }
     return nullptr;
 }
 
+// note: this is called from several threads at once (cf. MediaboxLoader)
 RectD ImageDirEngineImpl::LoadMediabox(int pageNo)
 {
+    // try to get by with reading an image's header (so that images
+    // don't have to be read in their entirety before layout)
+    ScopedHandle h(file::OpenReadOnly(pageFileNames.At(pageNo - 1)));
+    ScopedMem<char> header(AllocArray<char>(IMAGE_HEADER_PROBE_SIZE));
+    DWORD headerLen = 0;
+    if (h != INVALID_HANDLE_VALUE && header && ReadFile(h, header, IMAGE_HEADER_PROBE_SIZE, &headerLen, nullptr)) {
+        Size size = BitmapSizeFromHeader(header, headerLen);
+        if (!size.Empty())
+            return RectD(0, 0, size.Width, size.Height);
+    }
+
     size_t len;
     ScopedMem<char> bmpData(file::ReadAll(pageFileNames.At(pageNo - 1), &len));
     if (bmpData) {
@@ -807,10 +1178,59 @@ BaseEngine *CreateFromFile(const WCHAR *fileName)
 
 enum CbxFormat { Arch_Zip, Arch_Rar, Arch_7z, Arch_Tar };
 
+// the entry lists, page order and page sizes of comic book archives with
+// many pages are cached (cf. CbxEngine::SetArchiveIndexCache)
+#define CBX_CACHE_MIN_PAGES 20
+#define CBX_CACHE_MAGIC "CbxI"
+#define CBX_CACHE_VERSION 1
+
+static WCHAR *(* gGetArchiveIndexCachePath)(const WCHAR *filePath) = nullptr;
+
+struct CbxIndexCacheHeader {
+    char magic[4];
+    uint32 version;
+    // the cache is only valid for a file of this size and modification time
+    int64 fileSize;
+    FILETIME modified;
+    int32 format;
+    int32 entryCount;
+    int32 pageCount;
+};
+
+// followed by entryCount offsets (int64), pageCount CbxIndexCachePage and
+// entryCount zero-terminated entry names
+struct CbxIndexCachePage {
+    int32 entryIdx;
+    // 0 if the page's size hadn't been determined yet
+    double dx, dy;
+};
+
+// everything needed for reopening an archive without scanning and sorting its entries
+struct CbxArchiveIndex {
+    CbxFormat format;
+    ArchEntries entries;
+    Vec<size_t> fileIdxs;
+    Vec<RectD> mediaboxes;
+
+    bool Load(const WCHAR *cachePath, int64 fileSize, FILETIME modified);
+    void Save(const WCHAR *cachePath, int64 fileSize, FILETIME modified);
+};
+
 class CbxEngineImpl : public ImagesEngine, public json::ValueVisitor {
 public:
-    CbxEngineImpl(ArchFile *arch, CbxFormat cbxFormat) : cbxFile(arch), cbxFormat(cbxFormat) { }
-    virtual ~CbxEngineImpl() { delete cbxFile; }
+    CbxEngineImpl(ArchFile *arch, CbxFormat cbxFormat) : cbxFile(arch), cbxFormat(cbxFormat),
+        indexFileSize(0), indexChanged(false) {
+        InitializeCriticalSection(&archiveAccess);
+        canPrefetch = true;
+        indexModified.dwLowDateTime = indexModified.dwHighDateTime = 0;
+    }
+    virtual ~CbxEngineImpl() {
+        StopPrefetching();
+        if (indexCachePath && indexChanged)
+            SaveArchiveIndex();
+        delete cbxFile;
+        DeleteCriticalSection(&archiveAccess);
+    }
 
     virtual BaseEngine *Clone()  override {
         if (fileStream) {
@@ -819,8 +1239,13 @@ public:
             if (SUCCEEDED(res))
                 return CreateFromStream(stm);
         }
-        if (fileName)
-            return CreateFromFile(fileName);
+        if (fileName) {
+            BaseEngine *clone = CreateFromFile(fileName);
+            // only the original engine updates the cached index
+            if (clone)
+                static_cast<CbxEngineImpl *>(clone)->indexCachePath.Set(nullptr);
+            return clone;
+        }
         return nullptr;
     }
 
@@ -834,6 +1259,8 @@ public:
     float GetFileDPI() const override { return 96.0f; }
     const WCHAR *GetDefaultFileExt() const override;
 
+    RenderedBitmap *GetEmbeddedThumbnail(int pageNo, int size) override;
+
     // json::ValueVisitor
     bool Visit(const char *path, const char *value, json::DataType type) override;
 
@@ -841,21 +1268,33 @@ public:
     static BaseEngine *CreateFromStream(IStream *stream);
 
 protected:
-    virtual Bitmap *LoadBitmap(int pageNo, bool& deleteAfterUse);
+    virtual Bitmap *LoadBitmap(int pageNo, bool& deleteAfterUse, int& l2factor);
     virtual RectD LoadMediabox(int pageNo);
 
     bool LoadFromFile(const WCHAR *fileName);
+    bool LoadFromIndex(const WCHAR *fileName, CbxArchiveIndex& index);
     bool LoadFromStream(IStream *stream);
     bool FinishLoading();
+    void LoadMetadata();
+    void SaveArchiveIndex();
 
     char *GetImageData(int pageNo, size_t& len);
+    Size GetImageSizeFromHeader(int pageNo);
     void ParseComicInfoXml(const char *xmlData);
 
-    // access to cbxFile must be protected after initialization (with cacheAccess)
+    // access to cbxFile must be protected after initialization (with archiveAccess)
+    CRITICAL_SECTION archiveAccess;
     ArchFile *cbxFile;
     CbxFormat cbxFormat;
     Vec<size_t> fileIdxs;
 
+    // cf. CbxEngine::SetArchiveIndexCache
+    ScopedMem<WCHAR> indexCachePath;
+    int64 indexFileSize;
+    FILETIME indexModified;
+    // whether the index has to be (re)written when the engine is destroyed
+    bool indexChanged;
+
     // extracted metadata
     ScopedMem<WCHAR> propTitle;
     WStrVec propAuthors;
@@ -873,7 +1312,29 @@ bool CbxEngineImpl::LoadFromFile(const WCHAR *file)
         return false;
     fileName = str::Dup(file);
 
-    return FinishLoading();
+    if (!FinishLoading())
+        return false;
+    if (PageCount() >= CBX_CACHE_MIN_PAGES && gGetArchiveIndexCachePath) {
+        indexCachePath.Set(gGetArchiveIndexCachePath(fileName));
+        indexFileSize = file::GetSize(fileName);
+        indexModified = file::GetModificationTime(fileName);
+        indexChanged = true;
+    }
+    return true;
+}
+
+// the entries have been restored from the index, so they neither have
+// to be filtered nor sorted (and the known page sizes are reused)
+bool CbxEngineImpl::LoadFromIndex(const WCHAR *file, CbxArchiveIndex& index)
+{
+    if (!file || cbxFile->GetFileCount() != index.entries.names.Count())
+        return false;
+    fileName = str::Dup(file);
+
+    LoadMetadata();
+    fileIdxs = index.fileIdxs;
+    mediaboxes = index.mediaboxes;
+    return true;
 }
 
 bool CbxEngineImpl::LoadFromStream(IStream *stream)
@@ -918,12 +1379,7 @@ bool CbxEngineImpl::FinishLoading()
     }
     AssertCrash(allFileNames.Count() == cbxFile->GetFileCount());
 
-    ScopedMem<char> metadata(cbxFile->GetFileDataByName(L"ComicInfo.xml"));
-    if (metadata)
-        ParseComicInfoXml(metadata);
-    metadata.Set(cbxFile->GetComment());
-    if (metadata)
-        json::Parse(metadata, this);
+    LoadMetadata();
 
     pageFileNames.Sort(cmpAscii);
     for (const WCHAR *fn : pageFileNames) {
@@ -938,10 +1394,103 @@ bool CbxEngineImpl::FinishLoading()
     return true;
 }
 
+void CbxEngineImpl::LoadMetadata()
+{
+    ScopedMem<char> metadata(cbxFile->GetFileDataByName(L"ComicInfo.xml"));
+    if (metadata)
+        ParseComicInfoXml(metadata);
+    metadata.Set(cbxFile->GetComment());
+    if (metadata)
+        json::Parse(metadata, this);
+}
+
+void CbxEngineImpl::SaveArchiveIndex()
+{
+    CbxArchiveIndex index;
+    index.format = cbxFormat;
+    cbxFile->GetEntries(index.entries);
+    index.fileIdxs = fileIdxs;
+    index.mediaboxes = mediaboxes;
+    index.Save(indexCachePath, indexFileSize, indexModified);
+}
+
+bool CbxArchiveIndex::Load(const WCHAR *cachePath, int64 fileSize, FILETIME modified)
+{
+    size_t len;
+    ScopedMem<char> cache(file::ReadAll(cachePath, &len));
+    if (!cache || len < sizeof(CbxIndexCacheHeader))
+        return false;
+    CbxIndexCacheHeader *hdr = (CbxIndexCacheHeader *)cache.Get();
+    if (!str::EqN(hdr->magic, CBX_CACHE_MAGIC, 4) || hdr->version != CBX_CACHE_VERSION ||
+        hdr->fileSize != fileSize || !FileTimeEq(hdr->modified, modified) ||
+        hdr->format < Arch_Zip || hdr->format > Arch_Tar ||
+        hdr->entryCount <= 0 || hdr->pageCount <= 0 || hdr->pageCount > hdr->entryCount) {
+        return false;
+    }
+    size_t namesOffset = sizeof(CbxIndexCacheHeader) + hdr->entryCount * sizeof(int64) +
+                         hdr->pageCount * sizeof(CbxIndexCachePage);
+    if (len < namesOffset)
+        return false;
+
+    format = (CbxFormat)hdr->format;
+    int64 *offsets = (int64 *)(cache.Get() + sizeof(CbxIndexCacheHeader));
+    const WCHAR *s = (const WCHAR *)(cache.Get() + namesOffset);
+    const WCHAR *end = (const WCHAR *)(cache.Get() + len);
+    for (int i = 0; i < hdr->entryCount; i++) {
+        const WCHAR *next = s;
+        for (; next < end && *next; next++);
+        if (next == end)
+            return false;
+        // entries without a name are stored as empty strings
+        entries.names.Append(next > s ? str::DupN(s, next - s) : nullptr);
+        entries.offsets.Append(offsets[i]);
+        s = next + 1;
+    }
+
+    CbxIndexCachePage *pages = (CbxIndexCachePage *)(offsets + hdr->entryCount);
+    for (int i = 0; i < hdr->pageCount; i++) {
+        if (pages[i].entryIdx < 0 || pages[i].entryIdx >= hdr->entryCount)
+            return false;
+        fileIdxs.Append((size_t)pages[i].entryIdx);
+        mediaboxes.Append(RectD(0, 0, pages[i].dx, pages[i].dy));
+    }
+    return true;
+}
+
+void CbxArchiveIndex::Save(const WCHAR *cachePath, int64 fileSize, FILETIME modified)
+{
+    str::Str<char> cache;
+    CbxIndexCacheHeader hdr;
+    memcpy(hdr.magic, CBX_CACHE_MAGIC, 4);
+    hdr.version = CBX_CACHE_VERSION;
+    hdr.fileSize = fileSize;
+    hdr.modified = modified;
+    hdr.format = format;
+    hdr.entryCount = (int32)entries.names.Count();
+    hdr.pageCount = (int32)fileIdxs.Count();
+    cache.Append((const char *)&hdr, sizeof(hdr));
+    cache.Append((const char *)entries.offsets.LendData(), entries.offsets.Count() * sizeof(int64));
+    for (size_t i = 0; i < fileIdxs.Count(); i++) {
+        CbxIndexCachePage page;
+        page.entryIdx = (int32)fileIdxs.At(i);
+        page.dx = mediaboxes.At(i).dx;
+        page.dy = mediaboxes.At(i).dy;
+        cache.Append((const char *)&page, sizeof(page));
+    }
+    for (size_t i = 0; i < entries.names.Count(); i++) {
+        const WCHAR *name = entries.names.At(i) ? entries.names.At(i) : L"";
+        cache.Append((const char *)name, (str::Len(name) + 1) * sizeof(WCHAR));
+    }
+
+    ScopedMem<WCHAR> cacheDir(path::GetDir(cachePath));
+    if (dir::Create(cacheDir))
+        file::WriteAll(cachePath, cache.Get(), cache.Size());
+}
+
 char *CbxEngineImpl::GetImageData(int pageNo, size_t& len)
 {
     AssertCrash(1 <= pageNo && pageNo <= PageCount());
-    ScopedCritSec scope(&cacheAccess);
+    ScopedCritSec scope(&archiveAccess);
     return cbxFile->GetFileDataByIdx(fileIdxs.At(pageNo - 1), &len);
 }
 
@@ -1084,43 +1633,121 @@ const WCHAR *CbxEngineImpl::GetDefaultFileExt() const
     }
 }
 
-Bitmap *CbxEngineImpl::LoadBitmap(int pageNo, bool& deleteAfterUse)
+Bitmap *CbxEngineImpl::LoadBitmap(int pageNo, bool& deleteAfterUse, int& l2factor)
 {
     size_t len;
     ScopedMem<char> bmpData(GetImageData(pageNo, len));
     if (bmpData) {
         deleteAfterUse = true;
-        return BitmapFromData(bmpData, len);
+        return ScaledBitmapFromData(bmpData, len, l2factor);
     }
     return nullptr;
 }
 
+// decoding a page's image right at the requested size is much cheaper than decoding it
+// at full size for PageMediabox and again at a reduced size for RenderBitmap
+RenderedBitmap *CbxEngineImpl::GetEmbeddedThumbnail(int pageNo, int size)
+{
+    size_t len;
+    ScopedMem<char> bmpData(GetImageData(pageNo, len));
+    if (!bmpData)
+        return nullptr;
+    Bitmap *thumb = ThumbnailFromData(bmpData, len, size);
+    if (!thumb)
+        return nullptr;
+    HBITMAP hbmp;
+    Status ok = thumb->GetHBITMAP((ARGB)Color::White, &hbmp);
+    SizeI thumbSize(thumb->GetWidth(), thumb->GetHeight());
+    delete thumb;
+    if (ok != Ok)
+        return nullptr;
+    return new RenderedBitmap(hbmp, thumbSize);
+}
+
 RectD CbxEngineImpl::LoadMediabox(int pageNo)
 {
+    // newly determined page sizes are cached along with the index
+    indexChanged = true;
+
     // fill the cache to prevent the first few images from being unpacked twice
-    ImagePage *page = GetPage(pageNo, MAX_IMAGE_PAGE_CACHE == pageCache.Count());
+    ImagePage *page = GetPage(pageNo, IsCacheFull());
     if (page) {
         RectD mbox(0, 0, page->bmp->GetWidth(), page->bmp->GetHeight());
         DropPage(page);
         return mbox;
     }
 
+    // most image formats store their size close to the start, so there's
+    // usually no need to uncompress an entire (possibly very large) image
+    Size size = GetImageSizeFromHeader(pageNo);
+    if (!size.Empty())
+        return RectD(0, 0, size.Width, size.Height);
+
     size_t len;
     ScopedMem<char> bmpData(GetImageData(pageNo, len));
     if (bmpData) {
-        Size size = BitmapSizeFromData(bmpData, len);
+        size = BitmapSizeFromData(bmpData, len);
         return RectD(0, 0, size.Width, size.Height);
     }
     return RectD();
 }
 
+// enough for image headers preceded by (reasonably sized) EXIF data
+#define MAX_IMAGE_HEADER_SIZE (64 * 1024)
+
+Size CbxEngineImpl::GetImageSizeFromHeader(int pageNo)
+{
+    AssertCrash(1 <= pageNo && pageNo <= PageCount());
+    ScopedCritSec scope(&archiveAccess);
+    ScopedComPtr<IStream> stm(cbxFile->GetFileStream(fileIdxs.At(pageNo - 1)));
+    ScopedMem<char> header((char *)malloc(MAX_IMAGE_HEADER_SIZE));
+    if (!stm || !header)
+        return Size();
+    ULONG len;
+    HRESULT res = stm->Read(header, MAX_IMAGE_HEADER_SIZE, &len);
+    if (FAILED(res))
+        return Size();
+    return BitmapSizeFromHeader(header, len);
+}
+
 #define RAR_SIGNATURE       "Rar!\x1A\x07\x00"
 #define RAR_SIGNATURE_LEN   7
 #define RAR5_SIGNATURE      "Rar!\x1A\x07\x01\x00"
 #define RAR5_SIGNATURE_LEN  8
 
+static ArchFile *OpenArchive(const WCHAR *fileName, CbxFormat format, const ArchEntries *entries)
+{
+    switch (format) {
+    case Arch_Zip: return new ZipFile(fileName, false, entries);
+    case Arch_Rar: return new RarFile(fileName, entries);
+    case Arch_7z:  return new _7zFile(fileName, entries);
+    case Arch_Tar: return new TarFile(fileName, entries);
+    default: CrashIf(true); return nullptr;
+    }
+}
+
 BaseEngine *CbxEngineImpl::CreateFromFile(const WCHAR *fileName)
 {
+    // reopening an archive with a cached index doesn't require scanning
+    // all of its entry headers (which are spread all over RAR and TAR
+    // archives) nor determining the sizes of pages that had been shown
+    ScopedMem<WCHAR> cachePath(gGetArchiveIndexCachePath ? gGetArchiveIndexCachePath(fileName) : nullptr);
+    if (cachePath) {
+        CbxArchiveIndex index;
+        int64 fileSize = file::GetSize(fileName);
+        FILETIME modified = file::GetModificationTime(fileName);
+        if (index.Load(cachePath, fileSize, modified)) {
+            CbxEngineImpl *engine = new CbxEngineImpl(OpenArchive(fileName, index.format, &index.entries), index.format);
+            if (engine->LoadFromIndex(fileName, index)) {
+                engine->indexCachePath.Set(cachePath.StealData());
+                engine->indexFileSize = fileSize;
+                engine->indexModified = modified;
+                return engine;
+            }
+            delete engine;
+        }
+    }
+
     if (str::EndsWithI(fileName, L".cbz") || str::EndsWithI(fileName, L".zip") ||
         file::StartsWithN(fileName, "PK\x03\x04", 4)) {
         CbxEngineImpl *engine = new CbxEngineImpl(new ZipFile(fileName), Arch_Zip);
@@ -1213,4 +1840,9 @@ BaseEngine *CreateFromStream(IStream *stream)
     return CbxEngineImpl::CreateFromStream(stream);
 }
 
+void SetArchiveIndexCache(WCHAR *(* getCachePath)(const WCHAR *filePath))
+{
+    gGetArchiveIndexCachePath = getCachePath;
+}
+
 }
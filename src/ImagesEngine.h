@@ -6,6 +6,11 @@ namespace ImageEngine {
 bool IsSupportedFile(const WCHAR *fileName, bool sniff=false);
 BaseEngine *CreateFromFile(const WCHAR *fileName);
 BaseEngine *CreateFromStream(IStream *stream);
+// limits the memory used for caching decoded images (shared by all
+// image, image directory and comic book documents)
+void SetMaxPageCacheMemory(size_t maxBytes);
+// the memory currently used for caching decoded images (by all documents)
+size_t GetPageCacheMemory();
 
 }
 
@@ -21,5 +26,9 @@ namespace CbxEngine {
 bool IsSupportedFile(const WCHAR *fileName, bool sniff=false);
 BaseEngine *CreateFromFile(const WCHAR *fileName);
 BaseEngine *CreateFromStream(IStream *stream);
+// the entry lists, page order and page sizes of archives with many pages are
+// cached in the file returned by getCachePath (caller must free the result;
+// nullptr disables caching)
+void SetArchiveIndexCache(WCHAR *(* getCachePath)(const WCHAR *filePath));
 
 }
@@ -6,6 +6,7 @@
 #include "CmdLineParser.h"
 #include "FileUtil.h"
 #include "HtmlParserLookup.h"
+#include "GdiPlusUtil.h"
 #include "Mui.h"
 #include "WinUtil.h"
 // rendering engines
@@ -127,6 +128,8 @@ static MenuDef menuDefGoTo[] = {
     { _TRN("F&orward\tAlt+Right Arrow"),    IDM_GOTO_NAV_FORWARD,       0 },
     { SEP_ITEM,                             0,                          MF_NOT_FOR_EBOOK_UI },
     { _TRN("Fin&d...\tCtrl+F"),             IDM_FIND_FIRST,             MF_NOT_FOR_EBOOK_UI },
+    { _TRN("Find in All &Tabs..."),         IDM_FIND_IN_TABS,           MF_NOT_FOR_EBOOK_UI },
+    { _TRN("Find in &Recent Files..."),     IDM_FIND_IN_HISTORY,        MF_NOT_FOR_EBOOK_UI },
 };
 //] ACCESSKEY_GROUP GoTo Menu
 
@@ -181,6 +184,7 @@ static MenuDef menuDefHelp[] = {
     { _TRN("Visit &Website"),               IDM_VISIT_WEBSITE,          MF_REQ_DISK_ACCESS },
     { _TRN("&Manual"),                      IDM_MANUAL,                 MF_REQ_DISK_ACCESS },
     { _TRN("Check for &Updates"),           IDM_CHECK_UPDATE,           MF_REQ_INET_ACCESS },
+    { _TRN("&Performance Statistics"),      IDM_SHOW_PERF_STATS,        MF_REQ_DISK_ACCESS },
     { SEP_ITEM,                             0,                          MF_REQ_DISK_ACCESS },
     { _TRN("&About"),                       IDM_ABOUT,                  0 },
 };
@@ -192,6 +196,7 @@ static MenuDef menuDefDebug[] = {
     { "Highlight links",                    IDM_DEBUG_SHOW_LINKS,       MF_NO_TRANSLATE },
     { "Toggle ebook UI",                    IDM_DEBUG_EBOOK_UI,         MF_NO_TRANSLATE },
     { "Mui debug paint",                    IDM_DEBUG_MUI,              MF_NO_TRANSLATE },
+    { "Performance overlay\tCtrl+Shift+F12", IDM_DEBUG_PERF_OVERLAY,   MF_NO_TRANSLATE },
     { "Annotation from Selection",          IDM_DEBUG_ANNOTATION,       MF_NO_TRANSLATE },
     { SEP_ITEM,                             0,                          0 },
     { "Crash me",                           IDM_DEBUG_CRASH_ME,         MF_NO_TRANSLATE },
@@ -206,6 +211,7 @@ static MenuDef menuDefContext[] = {
     { _TRN("Copy &Link Address"),           IDM_COPY_LINK_TARGET,       MF_REQ_ALLOW_COPY },
     { _TRN("Copy Co&mment"),                IDM_COPY_COMMENT,           MF_REQ_ALLOW_COPY },
     { _TRN("Copy &Image"),                  IDM_COPY_IMAGE,             MF_REQ_ALLOW_COPY },
+    { _TRN("Save Ima&ge As..."),            IDM_SAVE_IMAGE,             MF_REQ_DISK_ACCESS },
     { SEP_ITEM,                             0,                          MF_REQ_ALLOW_COPY },
     { _TRN("Select &All"),                  IDM_SELECT_ALL,             MF_REQ_ALLOW_COPY },
     { SEP_ITEM,                             0,                          MF_PLUGIN_MODE_ONLY | MF_REQ_ALLOW_COPY },
@@ -496,6 +502,7 @@ void MenuUpdateStateForWindow(WindowInfo* win)
     win::menu::SetChecked(win->menu, IDM_DEBUG_SHOW_LINKS, gDebugShowLinks);
     win::menu::SetChecked(win->menu, IDM_DEBUG_EBOOK_UI, gGlobalPrefs->ebookUI.useFixedPageUI);
     win::menu::SetChecked(win->menu, IDM_DEBUG_MUI, mui::IsDebugPaint());
+    win::menu::SetChecked(win->menu, IDM_DEBUG_PERF_OVERLAY, gShowPerfOverlay);
     win::menu::SetEnabled(win->menu, IDM_DEBUG_ANNOTATION, tab && tab->selectionOnPage && win->showSelection &&
                                                            tab->AsFixed() && tab->AsFixed()->GetEngine()->SupportsAnnotation());
 #endif
@@ -531,6 +538,7 @@ void OnAboutContextMenu(WindowInfo* win, int x, int y)
 
     case IDM_PIN_SELECTED_DOCUMENT:
         state->isPinned = !state->isPinned;
+        gFileHistory.InvalidateFrequencyOrder();
         win->DeleteInfotip();
         win->RedrawAll(true);
         break;
@@ -552,6 +560,57 @@ void OnAboutContextMenu(WindowInfo* win, int x, int y)
     DestroyMenu(popup);
 }
 
+// besides the bitmap, images stored as JPEG/PNG/GIF are also put on the
+// clipboard as they are, so that they can be pasted without a loss in quality
+static void CopyImage(PageElement *pageEl)
+{
+    RenderedBitmap *bmp = pageEl->GetImage();
+    if (!bmp || !OpenClipboard(nullptr)) {
+        delete bmp;
+        return;
+    }
+    EmptyClipboard();
+    CopyImageToClipboard(bmp->GetBitmap(), true);
+    delete bmp;
+
+    size_t len;
+    ScopedMem<unsigned char> data(pageEl->GetImageData(&len));
+    const WCHAR *ext = data ? GfxFileExtFromData((const char *)data.Get(), len) : nullptr;
+    const WCHAR *format = nullptr;
+    if (str::Eq(ext, L".jpg"))
+        format = L"JFIF";
+    else if (str::Eq(ext, L".png"))
+        format = L"PNG";
+    else if (str::Eq(ext, L".gif"))
+        format = L"GIF";
+    if (format)
+        CopyDataToClipboard(format, data, len, true);
+
+    CloseClipboard();
+}
+
+// saves an image's original data if available (and a .bmp file otherwise)
+static void SaveImageAs(WindowInfo *win, PageElement *pageEl)
+{
+    size_t len;
+    ScopedMem<unsigned char> data(pageEl->GetImageData(&len));
+    if (!data) {
+        RenderedBitmap *bmp = pageEl->GetImage();
+        if (bmp)
+            data.Set(SerializeBitmap(bmp->GetBitmap(), &len));
+        delete bmp;
+    }
+    if (!data)
+        return;
+
+    ScopedMem<WCHAR> baseName(str::Dup(path::GetBaseName(win->currentTab->filePath)));
+    *(WCHAR *)path::GetExt(baseName) = '\0';
+    const WCHAR *ext = GfxFileExtFromData((const char *)data.Get(), len);
+    ScopedMem<WCHAR> fileName(str::Format(L"%s-%d%s", baseName, pageEl->GetPageNo(), ext ? ext : L""));
+    LinkSaver saver(win->currentTab, win->hwndFrame, fileName);
+    saver.SaveEmbedded(data, len);
+}
+
 void OnContextMenu(WindowInfo* win, int x, int y)
 {
     CrashIf(!win->AsFixed());
@@ -568,8 +627,10 @@ void OnContextMenu(WindowInfo* win, int x, int y)
         win::menu::Remove(popup, IDM_COPY_LINK_TARGET);
     if (!pageEl || pageEl->GetType() != Element_Comment || !value)
         win::menu::Remove(popup, IDM_COPY_COMMENT);
-    if (!pageEl || pageEl->GetType() != Element_Image)
+    if (!pageEl || pageEl->GetType() != Element_Image) {
         win::menu::Remove(popup, IDM_COPY_IMAGE);
+        win::menu::Remove(popup, IDM_SAVE_IMAGE);
+    }
 
     if (!win->currentTab->selectionOnPage)
         win::menu::SetEnabled(popup, IDM_COPY_SELECTION, false);
@@ -597,12 +658,13 @@ void OnContextMenu(WindowInfo* win, int x, int y)
         break;
 
     case IDM_COPY_IMAGE:
-        if (pageEl) {
-            RenderedBitmap *bmp = pageEl->GetImage();
-            if (bmp)
-                CopyImageToClipboard(bmp->GetBitmap(), false);
-            delete bmp;
-        }
+        if (pageEl)
+            CopyImage(pageEl);
+        break;
+
+    case IDM_SAVE_IMAGE:
+        if (pageEl)
+            SaveImageAs(win, pageEl);
         break;
     }
 
@@ -10,6 +10,7 @@
 #include "HtmlParserLookup.h"
 #include "HtmlPullParser.h"
 #include "PalmDbReader.h"
+#include "ThreadUtil.h"
 #include "TrivialHtmlParser.h"
 // rendering engines
 #include "BaseEngine.h"
@@ -193,10 +194,19 @@ static_assert(kCdicHeaderLen == sizeof(CdicHeader), "wrong size of CdicHeader st
 
 #define kCdicsMax 32
 
+// codes of up to kLookupBits bits are decoded with a single table lookup
+#define kLookupBits 12
+// only memoize expanded entries for dictionaries of a reasonable size
+#define kMemoCodeLenMax 16
+#define kExpandedFlag 0x80000000
+
 class HuffDicDecompressor
 {
     uint32      cacheTable[kCacheItemCount];
     uint32      baseTable[kBaseTableItemCount];
+    // code and code length (0 if longer than kLookupBits) for every kLookupBits bit prefix
+    uint32      lookupCode[1 << kLookupBits];
+    uint8       lookupLen[1 << kLookupBits];
 
     size_t      dictsCount;
     // owned by the creator (in our case: by the PdbReader)
@@ -205,18 +215,56 @@ class HuffDicDecompressor
 
     uint32      codeLength;
 
+    // fully expanded recursive dictionary entries (allocated on demand),
+    // len has kExpandedFlag set once an entry has been expanded
+    struct ExpandedEntry {
+        uint32  offset;
+        uint32  len;
+    };
+    ExpandedEntry *expanded[kCdicsMax];
+    str::Str<char> expandedData;
+
     Vec<uint32> recursionGuard;
 
+    bool DecodeCode(uint32 bits, uint32& code, uint32& codeLen) const;
+    void BuildLookupTable();
+    bool DecodeOne(uint32 code, str::Str<char>& dst);
+
 public:
     HuffDicDecompressor();
+    // shares the (immutable) dictionaries, e.g. for decompressing on several threads
+    explicit HuffDicDecompressor(const HuffDicDecompressor& orig);
+    ~HuffDicDecompressor();
 
     bool SetHuffData(uint8 *huffData, size_t huffDataLen);
     bool AddCdicData(uint8 *cdicData, uint32 cdicDataLen);
     bool Decompress(uint8 *src, size_t octets, str::Str<char>& dst);
-    bool DecodeOne(uint32 code, str::Str<char>& dst);
 };
 
-HuffDicDecompressor::HuffDicDecompressor() : codeLength(0), dictsCount(0) { }
+HuffDicDecompressor::HuffDicDecompressor() : codeLength(0), dictsCount(0)
+{
+    ZeroMemory(lookupLen, sizeof(lookupLen));
+    ZeroMemory(expanded, sizeof(expanded));
+}
+
+HuffDicDecompressor::HuffDicDecompressor(const HuffDicDecompressor& orig) :
+    codeLength(orig.codeLength), dictsCount(orig.dictsCount)
+{
+    memcpy(cacheTable, orig.cacheTable, sizeof(cacheTable));
+    memcpy(baseTable, orig.baseTable, sizeof(baseTable));
+    memcpy(lookupCode, orig.lookupCode, sizeof(lookupCode));
+    memcpy(lookupLen, orig.lookupLen, sizeof(lookupLen));
+    memcpy(dicts, orig.dicts, sizeof(dicts));
+    memcpy(dictSize, orig.dictSize, sizeof(dictSize));
+    ZeroMemory(expanded, sizeof(expanded));
+}
+
+HuffDicDecompressor::~HuffDicDecompressor()
+{
+    for (size_t i = 0; i < dictsCount; i++) {
+        free(expanded[i]);
+    }
+}
 
 bool HuffDicDecompressor::DecodeOne(uint32 code, str::Str<char>& dst)
 {
@@ -226,6 +274,17 @@ bool HuffDicDecompressor::DecodeOne(uint32 code, str::Str<char>& dst)
         return false;
     }
     code &= ((1 << (codeLength)) - 1);
+    ExpandedEntry *memo = nullptr;
+    if (codeLength <= kMemoCodeLenMax) {
+        if (!expanded[dict])
+            expanded[dict] = AllocArray<ExpandedEntry>((size_t)1 << codeLength);
+        memo = expanded[dict] ? &expanded[dict][code] : nullptr;
+    }
+    if (memo && (memo->len & kExpandedFlag)) {
+        dst.Append(expandedData.Get() + memo->offset, memo->len & ~kExpandedFlag);
+        return true;
+    }
+
     uint16 offset = UInt16BE(dicts[dict] + code * 2);
 
     if ((uint32)offset + 2 > dictSize[dict]) {
@@ -245,9 +304,16 @@ bool HuffDicDecompressor::DecodeOne(uint32 code, str::Str<char>& dst)
             return false;
         }
         recursionGuard.Push(code);
+        size_t start = dst.Size();
         if (!Decompress(p, symLen, dst))
             return false;
         recursionGuard.Pop();
+        size_t len = dst.Size() - start;
+        if (memo && len < kExpandedFlag && expandedData.Size() <= (uint32)-1) {
+            memo->offset = (uint32)expandedData.Size();
+            memo->len = (uint32)len | kExpandedFlag;
+            expandedData.Append(dst.Get() + start, len);
+        }
     } else {
         symLen &= 0x7fff;
         if (symLen > 127) {
@@ -259,6 +325,51 @@ bool HuffDicDecompressor::DecodeOne(uint32 code, str::Str<char>& dst)
     return true;
 }
 
+// determines the code and code length for the (left aligned) bits
+bool HuffDicDecompressor::DecodeCode(uint32 bits, uint32& code, uint32& codeLen) const
+{
+    uint32 v = cacheTable[bits >> 24];
+    codeLen = v & 0x1f;
+    if (!codeLen) {
+        lf("corrupted table, zero code len");
+        return false;
+    }
+    bool isTerminal = (v & 0x80) != 0;
+
+    if (isTerminal) {
+        code = (v >> 8) - (bits >> (32 - codeLen));
+        return true;
+    }
+
+    uint32 baseVal;
+    codeLen -= 1;
+    do {
+        codeLen++;
+        if (codeLen > 32) {
+            lf("code len > 32 bits");
+            return false;
+        }
+        baseVal = baseTable[codeLen * 2 - 2];
+        code = (bits >> (32 - codeLen));
+    } while (baseVal > code);
+    code = baseTable[codeLen * 2 - 1] - (bits >> (32 - codeLen));
+    return true;
+}
+
+// a code only depends on its own bits, so all codes of up to
+// kLookupBits bits can be resolved ahead of time
+void HuffDicDecompressor::BuildLookupTable()
+{
+    for (uint32 prefix = 0; prefix < (1 << kLookupBits); prefix++) {
+        uint32 code, codeLen;
+        lookupLen[prefix] = 0;
+        if (!DecodeCode(prefix << (32 - kLookupBits), code, codeLen) || codeLen > kLookupBits)
+            continue;
+        lookupCode[prefix] = code;
+        lookupLen[prefix] = (uint8)codeLen;
+    }
+}
+
 bool HuffDicDecompressor::Decompress(uint8 *src, size_t srcSize, str::Str<char>& dst)
 {
     uint32    bitsConsumed = 0;
@@ -278,31 +389,13 @@ bool HuffDicDecompressor::Decompress(uint8 *src, size_t srcSize, str::Str<char>&
         bits = br.Peek(32);
         if (br.BitsLeft() < 8 && 0 == bits)
             break;
-        uint32 v = cacheTable[bits >> 24];
-        uint32 codeLen = v & 0x1f;
-        if (!codeLen) {
-            lf("corrupted table, zero code len");
-            return false;
-        }
-        bool isTerminal = (v & 0x80) != 0;
 
         uint32 code;
-        if (isTerminal) {
-            code = (v >> 8) - (bits >> (32 - codeLen));
-        } else {
-            uint32 baseVal;
-            codeLen -= 1;
-            do {
-                codeLen++;
-                if (codeLen > 32) {
-                    lf("code len > 32 bits");
-                    return false;
-                }
-                baseVal = baseTable[codeLen * 2 - 2];
-                code = (bits >> (32 - codeLen));
-            } while (baseVal > code);
-            code = baseTable[codeLen * 2 - 1] - (bits >> (32 - codeLen));
-        }
+        uint32 codeLen = lookupLen[bits >> (32 - kLookupBits)];
+        if (codeLen != 0)
+            code = lookupCode[bits >> (32 - kLookupBits)];
+        else if (!DecodeCode(bits, code, codeLen))
+            return false;
 
         if (!DecodeOne(code, dst))
             return false;
@@ -352,6 +445,7 @@ bool HuffDicDecompressor::SetHuffData(uint8 *huffData, size_t huffDataLen)
         baseTable[i] = d.UInt32();
     }
     CrashIf(d.Offset() != kHuffRecordMinLen);
+    BuildLookupTable();
     return true;
 }
 
@@ -782,7 +876,7 @@ static size_t GetRealRecordSize(uint8 *recData, size_t recLen, size_t trailersCo
 
 // Load a given record of a document into strOut, uncompressing if necessary.
 // Returns false if error.
-bool MobiDoc::LoadDocRecordIntoBuffer(size_t recNo, str::Str<char>& strOut)
+bool MobiDoc::LoadDocRecordIntoBuffer(size_t recNo, str::Str<char>& strOut, HuffDicDecompressor *decompressor)
 {
     size_t recSize;
     const char *recData = pdbReader->GetRecord(recNo, &recSize);
@@ -803,7 +897,9 @@ bool MobiDoc::LoadDocRecordIntoBuffer(size_t recNo, str::Str<char>& strOut)
         return ok;
     }
     if (COMPRESSION_HUFF == compressionType && huffDic) {
-        bool ok = huffDic->Decompress((uint8*)recData, recSize, strOut);
+        if (!decompressor)
+            decompressor = huffDic;
+        bool ok = decompressor->Decompress((uint8*)recData, recSize, strOut);
         if (!ok)
             lf("HuffDic decompression failed");
         return ok;
@@ -819,6 +915,78 @@ bool MobiDoc::LoadDocRecordIntoBuffer(size_t recNo, str::Str<char>& strOut)
     return false;
 }
 
+#define MAX_RECORD_WORKERS 8
+// don't bother spinning up threads for short documents
+#define MIN_RECORDS_PER_WORKER 16
+
+// text records are compressed independently of each other, so they can be
+// decompressed on several threads at once (for HuffDic compressed records,
+// every worker needs its own HuffDicDecompressor for the memoized entries)
+class MobiRecordWorker : public ThreadBase {
+    MobiDoc *doc;
+    ScopedPtr<HuffDicDecompressor> huffDic;
+    str::Str<char> *records;
+    // index of the next record to decompress (shared between all workers)
+    LONG *nextRec;
+    LONG *failed;
+
+public:
+    MobiRecordWorker(MobiDoc *doc, str::Str<char> *records, LONG *nextRec, LONG *failed) :
+        ThreadBase("MobiRecordWorker"), doc(doc),
+        huffDic(doc->huffDic ? new HuffDicDecompressor(*doc->huffDic) : nullptr),
+        records(records), nextRec(nextRec), failed(failed) { }
+
+    virtual void Run() override {
+        LONG i;
+        while (!*failed && (i = InterlockedIncrement(nextRec) - 1) < (LONG)doc->docRecCount) {
+            if (!doc->LoadDocRecordIntoBuffer(i + 1, records[i], huffDic))
+                InterlockedExchange(failed, 1);
+        }
+    }
+};
+
+// returns the number of threads worth using for decompressing all records
+int MobiDoc::GetRecordWorkerCount() const
+{
+    if (COMPRESSION_PALM != compressionType && (COMPRESSION_HUFF != compressionType || !huffDic))
+        return 1;
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    int count = std::min((int)si.dwNumberOfProcessors, (int)(docRecCount / MIN_RECORDS_PER_WORKER));
+    return limitValue(count, 1, MAX_RECORD_WORKERS);
+}
+
+bool MobiDoc::LoadDocRecordsInParallel(int workerCount)
+{
+    str::Str<char> *records = new str::Str<char>[docRecCount];
+    LONG nextRec = 0, failed = 0;
+    Vec<MobiRecordWorker *> workers;
+    for (int i = 0; i < workerCount; i++) {
+        MobiRecordWorker *worker = new MobiRecordWorker(this, records, &nextRec, &failed);
+        workers.Append(worker);
+        worker->Start();
+    }
+    for (MobiRecordWorker *worker : workers) {
+        worker->Join();
+        delete worker;
+    }
+
+    if (!failed) {
+        // copy all records into place with a single allocation
+        size_t totalSize = 0;
+        for (size_t i = 0; i < docRecCount; i++) {
+            totalSize += records[i].Size();
+        }
+        char *dst = doc->AppendBlanks(totalSize);
+        for (size_t i = 0; i < docRecCount; i++) {
+            memcpy(dst, records[i].Get(), records[i].Size());
+            dst += records[i].Size();
+        }
+    }
+    delete[] records;
+    return !failed;
+}
+
 bool MobiDoc::LoadDocument(PdbReader *pdbReader)
 {
     this->pdbReader = pdbReader;
@@ -827,9 +995,15 @@ bool MobiDoc::LoadDocument(PdbReader *pdbReader)
 
     assert(!doc);
     doc = new str::Str<char>(docUncompressedSize);
-    for (size_t i = 1; i <= docRecCount; i++) {
-        if (!LoadDocRecordIntoBuffer(i, *doc))
+    int workerCount = GetRecordWorkerCount();
+    if (workerCount > 1) {
+        if (!LoadDocRecordsInParallel(workerCount))
             return false;
+    } else {
+        for (size_t i = 1; i <= docRecCount; i++) {
+            if (!LoadDocRecordIntoBuffer(i, *doc))
+                return false;
+        }
     }
     // replace unexpected \0 with spaces
     // cf. https://code.google.com/p/sumatrapdf/issues/detail?id=2529
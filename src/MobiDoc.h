@@ -8,6 +8,8 @@ enum PdbDocType { Pdb_Unknown, Pdb_Mobipocket, Pdb_PalmDoc, Pdb_TealDoc };
 
 class MobiDoc
 {
+    friend class MobiRecordWorker;
+
     WCHAR *             fileName;
 
     PdbReader *         pdbReader;
@@ -37,7 +39,9 @@ class MobiDoc
     explicit MobiDoc(const WCHAR *filePath);
 
     bool    ParseHeader();
-    bool    LoadDocRecordIntoBuffer(size_t recNo, str::Str<char>& strOut);
+    bool    LoadDocRecordIntoBuffer(size_t recNo, str::Str<char>& strOut, HuffDicDecompressor *decompressor=nullptr);
+    int     GetRecordWorkerCount() const;
+    bool    LoadDocRecordsInParallel(int workerCount);
     void    LoadImages();
     bool    LoadImage(size_t imageNo);
     bool    LoadDocument(PdbReader *pdbReader);
@@ -113,6 +113,10 @@ bool IsValidPageRange(const WCHAR* ranges) {
     return ParsePageRanges(ranges, rangeList);
 }
 
+static bool IsRenderBatchFormat(const WCHAR* s) {
+    return str::EqI(s, L"png") || str::EqI(s, L"jpg") || str::EqI(s, L"bmp") || str::EqI(s, L"tga");
+}
+
 // <s> can be:
 // * "loadonly"
 // * description of page ranges e.g. "1", "1-5", "2-3,6,8-10"
@@ -203,6 +207,7 @@ static const char* argNames =
     "n\0"
     "render\0"
     "bench\0"
+    "bench-startup\0"
     "lang\0"
     "bgcolor\0"
     "bg-color\0"
@@ -213,7 +218,14 @@ static const char* argNames =
     "manga-mode\0"
     "autoupdate\0"
     "extract-text\0"
-    "silent\0";
+    "silent\0"
+    "render-batch\0"
+    "bench-format\0"
+    "bench-repeat\0"
+    "bench-warmup\0"
+    "bench-cpu\0"
+    "stress-threads\0"
+    "render-server\0";
 
 enum {
     RegisterForPdf,
@@ -250,6 +262,7 @@ enum {
     ArgN,
     Render,
     Bench,
+    BenchStartup,
     Lang,
     BgColor,
     BgColor2,
@@ -260,7 +273,14 @@ enum {
     MangaMode,
     AutoUpdate,
     ExtractText,
-    Silent
+    Silent,
+    RenderBatch,
+    BenchFormat,
+    BenchRepeat,
+    BenchWarmup,
+    BenchCpu,
+    StressThreads,
+    RenderServer
 };
 
 static int GetArgNo(const WCHAR* argName) {
@@ -385,8 +405,37 @@ void CommandLineInfo::ParseCommandLine(const WCHAR* cmdLine) {
                 stressTestCycles = num;
                 n++;
             }
+        } else if (is_arg_with_param(StressThreads)) {
+            // -stress-threads <count> : run -stress-test without UI on <count> threads,
+            // each using its own engines
+            handle_int_param(stressThreadCount);
         } else if (is_arg_with_param(ArgN)) {
             handle_int_param(stressParallelCount);
+            renderBatchWorkers = stressParallelCount;
+        } else if (is_arg_with_param(RenderBatch) && argCount > n + 2) {
+            // -render-batch <file, dir or @listfile> <output dir> [<page range(s)>] [<dpi>dpi]
+            // [png|jpg|bmp|tga]
+            // e.g. -render-batch dir out 1 72dpi jpg  render the first page of all files in dir
+            //      -render-batch @files.txt out       render all pages of all listed files as PNG
+            // (use -n <count> to set the number of worker threads)
+            handle_string_param(renderBatchPath);
+            handle_string_param(renderBatchOutDir);
+            int num;
+            if (has_additional_param() && IsValidPageRange(additional_param()))
+                handle_string_param(renderBatchRanges);
+            if (has_additional_param() && str::Parse(additional_param(), L"%ddpi%$", &num) &&
+                num > 0) {
+                renderBatchDpi = num;
+                n++;
+            }
+            if (has_additional_param() && IsRenderBatchFormat(additional_param()))
+                handle_string_param(renderBatchFormat);
+            exitImmediately = true;
+        } else if (is_arg_with_param(RenderServer)) {
+            // -render-server <name> : serve render and text requests over the
+            // named pipe \\.\pipe\<name> (see RunRenderServer)
+            handle_string_param(renderServerPipe);
+            exitImmediately = true;
         } else if (is_arg_with_param(Render)) {
             handle_int_param(pageNumber);
             testRenderPage = true;
@@ -405,6 +454,28 @@ void CommandLineInfo::ParseCommandLine(const WCHAR* cmdLine) {
             }
             pathsToBenchmark.Push(s);
             exitImmediately = true;
+        } else if (is_arg_with_param(BenchFormat)) {
+            // -bench-format json|csv : report -bench results in a machine-readable
+            // format on stdout (instead of as log messages on stderr)
+            if (str::EqI(param, L"json") || str::EqI(param, L"csv"))
+                benchFormat.Set(str::Dup(param));
+            ++n;
+        } else if (is_arg_with_param(BenchRepeat)) {
+            // -bench-repeat <count> : measure each -bench document <count> times
+            handle_int_param(benchRepeat);
+        } else if (is_arg_with_param(BenchWarmup)) {
+            // -bench-warmup <count> : load and render each -bench document <count>
+            // times before measuring (so that caches are warmed up)
+            handle_int_param(benchWarmup);
+        } else if (is_arg_with_param(BenchCpu)) {
+            // -bench-cpu <index> : run -bench on a single processor for more stable timings
+            handle_int_param(benchCpu);
+        } else if (is_arg_with_param(BenchStartup)) {
+            // -bench-startup <file> : open file, report the startup
+            // timeline once it's been painted and exit
+            benchStartup = true;
+            fileNames.Push(str::Dup(param));
+            ++n;
         } else if (CrashOnOpen == arg) {
             // to make testing of crash reporting system in pre-release/release
             // builds possible
@@ -17,6 +17,10 @@ class CommandLineInfo {
     //   to benchmark. It can also be a string "loadonly" which means we'll
     //   only benchmark loading of the catalog
     WStrVec pathsToBenchmark;
+    ScopedMem<WCHAR> benchFormat; // "json" or "csv" (nullptr means human-readable output)
+    int benchRepeat;
+    int benchWarmup;
+    int benchCpu; // -1 means not to restrict the benchmark to a processor
     bool makeDefault;
     bool exitWhenDone;
     bool printDialog;
@@ -34,6 +38,7 @@ class CommandLineInfo {
     float startZoom;
     PointI startScroll;
     bool showConsole;
+    bool benchStartup;
     HWND hwndPluginParent;
     ScopedMem<WCHAR> pluginURL;
     bool exitImmediately;
@@ -49,6 +54,16 @@ class CommandLineInfo {
     int stressTestCycles;
     int stressParallelCount;
     bool stressRandomizeFiles;
+    int stressThreadCount; // 0 means to stress test the UI instead of just the engines
+
+    // batch rendering related
+    ScopedMem<WCHAR> renderBatchPath;
+    ScopedMem<WCHAR> renderBatchOutDir;
+    ScopedMem<WCHAR> renderBatchRanges; // nullptr means all pages
+    ScopedMem<WCHAR> renderBatchFormat; // nullptr is equivalent to "png"
+    int renderBatchDpi; // 0 means at 100% zoom
+    int renderBatchWorkers; // 0 means one worker per processor
+    ScopedMem<WCHAR> renderServerPipe;
 
     // related to testing
     bool testRenderPage;
@@ -62,7 +77,11 @@ class CommandLineInfo {
     WStrVec globalPrefArgs;
 
     CommandLineInfo()
-        : makeDefault(false),
+        : benchFormat(nullptr),
+          benchRepeat(1),
+          benchWarmup(0),
+          benchCpu(-1),
+          makeDefault(false),
           exitWhenDone(false),
           printDialog(false),
           printerName(nullptr),
@@ -80,6 +99,7 @@ class CommandLineInfo {
           startZoom(INVALID_ZOOM),
           startScroll(PointI(-1, -1)),
           showConsole(false),
+          benchStartup(false),
           exitImmediately(false),
           silent(false),
           forwardSearchOrigin(nullptr),
@@ -90,6 +110,14 @@ class CommandLineInfo {
           stressTestCycles(1),
           stressParallelCount(1),
           stressRandomizeFiles(false),
+          stressThreadCount(0),
+          renderBatchPath(nullptr),
+          renderBatchOutDir(nullptr),
+          renderBatchRanges(nullptr),
+          renderBatchFormat(nullptr),
+          renderBatchDpi(0),
+          renderBatchWorkers(0),
+          renderServerPipe(nullptr),
           testRenderPage(false),
           testExtractPage(false),
           appdataDir(nullptr),
@@ -10,7 +10,10 @@ extern "C" {
 
 // utils
 #include "BaseUtil.h"
+#include "ByteReader.h"
 #include "GdiplusUtil.h"
+#include "ThreadUtil.h"
+#include "WinUtil.h"
 // rendering engines
 #include "BaseEngine.h"
 #include "PdfCreator.h"
@@ -23,34 +26,49 @@ void PdfCreator::SetProducerName(const WCHAR *name)
         gPdfProducer.Set(str::Dup(name));
 }
 
-static fz_image *render_to_pixmap(fz_context *ctx, HBITMAP hbmp, SizeI size)
+// converts a bitmap to RGB (or grayscale) pixel data and deflates it; this only
+// uses plain allocations (no fz_context) so that it can be called on several threads
+static unsigned char *compress_bitmap(HBITMAP hbmp, SizeI size, size_t *lenOut, bool *isGrayscale)
 {
     int w = size.dx, h = size.dy;
     int stride = ((w * 3 + 3) / 4) * 4;
 
-    unsigned char *data = (unsigned char *)fz_malloc(ctx, stride * h);
-
-    BITMAPINFO bmi = { 0 };
-    bmi.bmiHeader.biSize = sizeof(bmi.bmiHeader);
-    bmi.bmiHeader.biWidth = w;
-    bmi.bmiHeader.biHeight = -h;
-    bmi.bmiHeader.biPlanes = 1;
-    bmi.bmiHeader.biBitCount = 24;
-    bmi.bmiHeader.biCompression = BI_RGB;
-
-    HDC hDC = GetDC(nullptr);
-    int res = GetDIBits(hDC, hbmp, 0, h, data, &bmi, DIB_RGB_COLORS);
-    ReleaseDC(nullptr, hDC);
-    if (!res) {
-        fz_free(ctx, data);
-        fz_throw(ctx, FZ_ERROR_GENERIC, "GetDIBits failed");
+    unsigned char *data = AllocArray<unsigned char>(stride * h);
+    if (!data)
+        return nullptr;
+
+    // read the pixels of 32-bit DIB sections (e.g. RenderedBitmaps) directly
+    // instead of having GDI copy them into data first
+    int bpp = 0;
+    const unsigned char *pixels = GetDIBSectionPixels(hbmp, &stride, &bpp);
+    if (!pixels || bpp != 32 || GetBitmapSize(hbmp) != size) {
+        stride = ((w * 3 + 3) / 4) * 4;
+        pixels = data;
+        bpp = 24;
+
+        BITMAPINFO bmi = { 0 };
+        bmi.bmiHeader.biSize = sizeof(bmi.bmiHeader);
+        bmi.bmiHeader.biWidth = w;
+        bmi.bmiHeader.biHeight = -h;
+        bmi.bmiHeader.biPlanes = 1;
+        bmi.bmiHeader.biBitCount = 24;
+        bmi.bmiHeader.biCompression = BI_RGB;
+
+        HDC hDC = GetDC(nullptr);
+        int ok = GetDIBits(hDC, hbmp, 0, h, data, &bmi, DIB_RGB_COLORS);
+        ReleaseDC(nullptr, hDC);
+        if (!ok) {
+            free(data);
+            return nullptr;
+        }
     }
 
-    // convert BGR with padding to RGB without padding
+    // convert BGR(A) with padding to RGB without padding
+    // (this works in place for 24-bit data)
     unsigned char *out = data;
     bool is_grayscale = true;
     for (int y = 0; y < h; y++) {
-        const unsigned char *in = data + y * stride;
+        const unsigned char *in = pixels + y * stride;
         unsigned char green, blue;
         for (int x = 0; x < w; x++) {
             is_grayscale = is_grayscale && in[0] == in[1] && in[0] == in[2];
@@ -59,6 +77,7 @@ static fz_image *render_to_pixmap(fz_context *ctx, HBITMAP hbmp, SizeI size)
             *out++ = *in++;
             *out++ = green;
             *out++ = blue;
+            in += bpp / 8 - 3;
         }
     }
     // convert grayscale RGB to proper grayscale
@@ -70,45 +89,142 @@ static fz_image *render_to_pixmap(fz_context *ctx, HBITMAP hbmp, SizeI size)
         }
     }
 
+    uLong cap = compressBound((uLong)(out - data));
+    unsigned char *compressed = AllocArray<unsigned char>(cap);
+    if (!compressed) {
+        free(data);
+        return nullptr;
+    }
+
+    z_stream zstm = { 0 };
+    zstm.next_in = data;
+    zstm.avail_in = (uInt)(out - data);
+    zstm.next_out = compressed;
+    zstm.avail_out = (uInt)cap;
+
+    int res = deflateInit(&zstm, 9);
+    if (Z_OK == res) {
+        res = deflate(&zstm, Z_FINISH);
+        if (deflateEnd(&zstm) != Z_OK && Z_STREAM_END == res)
+            res = Z_STREAM_ERROR;
+    }
+    free(data);
+    if (res != Z_STREAM_END) {
+        free(compressed);
+        return nullptr;
+    }
+
+    *lenOut = zstm.total_out;
+    *isGrayscale = is_grayscale;
+    return compressed;
+}
+
+static fz_image *pack_flate(fz_context *ctx, const unsigned char *data, size_t len, SizeI size, bool is_grayscale)
+{
     fz_compressed_buffer *buf = nullptr;
     fz_var(buf);
 
     fz_try(ctx) {
         buf = fz_malloc_struct(ctx, fz_compressed_buffer);
-        buf->buffer = fz_new_buffer(ctx, w * h * 4 + 10);
+        buf->buffer = fz_new_buffer(ctx, (int)len);
+        memcpy(buf->buffer->data, data, (buf->buffer->len = (int)len));
         buf->params.type = FZ_IMAGE_FLATE;
         buf->params.u.flate.predictor = 1;
+    }
+    fz_catch(ctx) {
+        fz_free_compressed_buffer(ctx, buf);
+        fz_rethrow(ctx);
+    }
 
-        z_stream zstm = { 0 };
-        zstm.next_in = data;
-        zstm.avail_in = out - data;
-        zstm.next_out = buf->buffer->data;
-        zstm.avail_out = buf->buffer->cap;
+    fz_colorspace *cs = is_grayscale ? fz_device_gray(ctx) : fz_device_rgb(ctx);
+    return fz_new_image(ctx, size.dx, size.dy, 8, cs, 96, 96, 0, 0, nullptr, nullptr, buf, nullptr);
+}
 
-        res = deflateInit(&zstm, 9);
-        if (res != Z_OK)
-            fz_throw(ctx, FZ_ERROR_GENERIC, "deflate failure %d", res);
-        res = deflate(&zstm, Z_FINISH);
-        if (res != Z_STREAM_END)
-            fz_throw(ctx, FZ_ERROR_GENERIC, "deflate failure %d", res);
-        buf->buffer->len = zstm.total_out;
-        res = deflateEnd(&zstm);
-        if (res != Z_OK)
-            fz_throw(ctx, FZ_ERROR_GENERIC, "deflate failure %d", res);
+static fz_image *render_to_pixmap(fz_context *ctx, HBITMAP hbmp, SizeI size)
+{
+    size_t len = 0;
+    bool is_grayscale = false;
+    unsigned char *data = compress_bitmap(hbmp, size, &len, &is_grayscale);
+    if (!data)
+        fz_throw(ctx, FZ_ERROR_GENERIC, "failed to compress bitmap");
+
+    fz_image *image = nullptr;
+    fz_try(ctx) {
+        image = pack_flate(ctx, data, len, size, is_grayscale);
     }
     fz_always(ctx) {
-        fz_free(ctx, data);
+        free(data);
     }
     fz_catch(ctx) {
-        fz_free_compressed_buffer(ctx, buf);
         fz_rethrow(ctx);
     }
+    return image;
+}
 
-    fz_colorspace *cs = is_grayscale ? fz_device_gray(ctx) : fz_device_rgb(ctx);
-    return fz_new_image(ctx, w, h, 8, cs, 96, 96, 0, 0, nullptr, nullptr, buf, nullptr);
+// returns the number of color components (1 or 3) of a JPEG image which can be
+// embedded as is with DCTDecode, else 0 (e.g. for CMYK images, which might need
+// to be inverted, or for 12-bit, lossless or arithmetic coding)
+static int JpegPassthroughInfo(const char *data, size_t len, SizeI *size)
+{
+    ByteReader r(data, len);
+    for (size_t ix = 2; ix + 9 < len && r.Byte(ix) == 0xFF; ix += r.WordBE(ix + 2) + 2) {
+        uint8_t marker = r.Byte(ix + 1);
+        if (0xDA == marker) {
+            // start of scan without a frame header
+            break;
+        }
+        if (0xC4 == marker || 0xC8 == marker || 0xCC == marker || marker < 0xC0 || marker > 0xCF)
+            continue;
+        // start of frame: only baseline and progressive Huffman coding are passed through
+        if (marker > 0xC2 || r.Byte(ix + 4) != 8)
+            return 0;
+        *size = SizeI(r.WordBE(ix + 7), r.WordBE(ix + 5));
+        int components = r.Byte(ix + 9);
+        if (size->IsEmpty() || (components != 1 && components != 3))
+            return 0;
+        return components;
+    }
+    return 0;
 }
 
-static fz_image *pack_jpeg(fz_context *ctx, const char *data, size_t len, SizeI size)
+// returns the number of color components (1 or 3) of a JP2 image which can be
+// embedded as is with JPXDecode, else 0 (e.g. for images with palette or alpha)
+static int Jp2PassthroughInfo(const char *data, size_t len, SizeI *size)
+{
+    ByteReader r(data, len);
+    for (size_t ix = 0; ix + 8 <= len; ) {
+        uint32_t lbox = r.DWordBE(ix);
+        uint32_t tbox = r.DWordBE(ix + 4);
+        if (lbox < 8 || lbox > len - ix)
+            return 0;
+        if (0x6A703268 /* jp2h */ != tbox) {
+            ix += lbox;
+            continue;
+        }
+        int components = 0;
+        for (size_t sub = ix + 8; sub + 8 <= ix + lbox; ) {
+            uint32_t lsub = r.DWordBE(sub);
+            uint32_t tsub = r.DWordBE(sub + 4);
+            if (lsub < 8 || lsub > ix + lbox - sub)
+                return 0;
+            if (0x69686472 /* ihdr */ == tsub && lsub >= 22) {
+                *size = SizeI(r.DWordBE(sub + 12), r.DWordBE(sub + 8));
+                components = r.WordBE(sub + 16);
+            }
+            else if (0x70636C72 /* pclr */ == tsub || 0x63646566 /* cdef */ == tsub) {
+                // palette and channel definitions aren't expressible as PDF color spaces
+                return 0;
+            }
+            sub += lsub;
+        }
+        if (size->IsEmpty() || (components != 1 && components != 3))
+            return 0;
+        return components;
+    }
+    return 0;
+}
+
+static fz_image *pack_jpeg(fz_context *ctx, const char *data, size_t len, SizeI size, fz_colorspace *cs)
 {
     fz_compressed_buffer *buf = nullptr;
     fz_var(buf);
@@ -125,10 +241,10 @@ static fz_image *pack_jpeg(fz_context *ctx, const char *data, size_t len, SizeI
         fz_rethrow(ctx);
     }
 
-    return fz_new_image(ctx, size.dx, size.dy, 8, fz_device_rgb(ctx), 96, 96, 0, 0, nullptr, nullptr, buf, nullptr);
+    return fz_new_image(ctx, size.dx, size.dy, 8, cs, 96, 96, 0, 0, nullptr, nullptr, buf, nullptr);
 }
 
-static fz_image *pack_jp2(fz_context *ctx, const char *data, size_t len, SizeI size)
+static fz_image *pack_jp2(fz_context *ctx, const char *data, size_t len, SizeI size, fz_colorspace *cs)
 {
     fz_compressed_buffer *buf = nullptr;
     fz_var(buf);
@@ -144,7 +260,7 @@ static fz_image *pack_jp2(fz_context *ctx, const char *data, size_t len, SizeI s
         fz_rethrow(ctx);
     }
 
-    return fz_new_image(ctx, size.dx, size.dy, 8, fz_device_rgb(ctx), 96, 96, 0, 0, nullptr, nullptr, buf, nullptr);
+    return fz_new_image(ctx, size.dx, size.dy, 8, cs, 96, 96, 0, 0, nullptr, nullptr, buf, nullptr);
 }
 
 PdfCreator::PdfCreator()
@@ -231,12 +347,21 @@ bool PdfCreator::AddImagePage(const char *data, size_t len, float imgDpi)
     CrashIf(!ctx || !doc);
     if (!ctx || !doc) return false;
 
+    // embed JPEG and JP2 images byte-for-byte (without decoding them)
+    // whenever their color space can be expressed without conversion
     const WCHAR *ext = GfxFileExtFromData(data, len);
-    if (str::Eq(ext, L".jpg") || str::Eq(ext, L".jp2")) {
-        Size size = BitmapSizeFromData(data, len);
+    bool isJpeg = str::Eq(ext, L".jpg");
+    SizeI size;
+    int components = 0;
+    if (isJpeg)
+        components = JpegPassthroughInfo(data, len, &size);
+    else if (str::Eq(ext, L".jp2"))
+        components = Jp2PassthroughInfo(data, len, &size);
+    if (components > 0) {
+        fz_colorspace *cs = 1 == components ? fz_device_gray(ctx) : fz_device_rgb(ctx);
         fz_image *image = nullptr;
         fz_try(ctx) {
-            image = (str::Eq(ext, L".jpg") ? pack_jpeg : pack_jp2)(ctx, data, len, SizeI(size.Width, size.Height));
+            image = (isJpeg ? pack_jpeg : pack_jp2)(ctx, data, len, size, cs);
         }
         fz_catch(ctx) {
             return false;
@@ -345,20 +470,179 @@ bool PdfCreator::SaveToFile(const WCHAR *filePath)
     return true;
 }
 
+#define MAX_RENDER_TO_FILE_WORKERS  4
+// maximum number of compressed pages waiting to be added to the document
+#define MAX_RENDER_TO_FILE_AHEAD    16
+
+struct CompressedPage {
+    unsigned char *data;
+    size_t len;
+    SizeI size;
+    bool isGrayscale;
+    bool done;
+};
+
+class RenderToFilePipeline;
+
+class RenderToFileWorker : public ThreadBase {
+    RenderToFilePipeline *pipeline;
+    BaseEngine *clone;
+
+  public:
+    explicit RenderToFileWorker(RenderToFilePipeline *pipeline)
+        : ThreadBase("RenderToFileWorker"), pipeline(pipeline), clone(nullptr) {}
+    virtual ~RenderToFileWorker() { delete clone; }
+    virtual void Run() override;
+};
+
+// renders and compresses pages on worker threads (each using its own engine
+// clone) while the pages are added to the document in order; the number of
+// pages rendered ahead is bounded so that memory use doesn't grow with page count
+class RenderToFilePipeline {
+    CRITICAL_SECTION access;
+    RenderToFileWorker *workers[MAX_RENDER_TO_FILE_WORKERS];
+    int workerCount;
+    CompressedPage *pages;
+    int nextPage;
+    int consumed;
+
+  public:
+    BaseEngine *engine;
+    float zoom;
+
+    RenderToFilePipeline(BaseEngine *engine, float zoom);
+    ~RenderToFilePipeline();
+
+    bool ClaimPage(int *pageNo, bool *wait);
+    void FinishPage(int pageNo, unsigned char *data, size_t len, SizeI size, bool isGrayscale);
+    CompressedPage *TakePage(int pageNo);
+};
+
+RenderToFilePipeline::RenderToFilePipeline(BaseEngine *engine, float zoom)
+    : workerCount(0), nextPage(1), consumed(0), engine(engine), zoom(zoom) {
+    InitializeCriticalSection(&access);
+    pages = AllocArray<CompressedPage>(engine->PageCount() + 1);
+
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    int count = limitValue((int)si.dwNumberOfProcessors, 1, MAX_RENDER_TO_FILE_WORKERS);
+    count = std::min(count, engine->PageCount());
+    for (int i = 0; i < count; i++) {
+        workers[i] = new RenderToFileWorker(this);
+        workers[i]->Start();
+    }
+    workerCount = count;
+}
+
+RenderToFilePipeline::~RenderToFilePipeline() {
+    for (int i = 0; i < workerCount; i++) {
+        workers[i]->RequestCancel();
+    }
+    for (int i = 0; i < workerCount; i++) {
+        workers[i]->Join();
+        delete workers[i];
+    }
+    for (int i = 0; i <= engine->PageCount(); i++) {
+        free(pages[i].data);
+    }
+    free(pages);
+    DeleteCriticalSection(&access);
+}
+
+// returns false if there's no page to render (*wait is true if the
+// document has to catch up before the next page may be rendered)
+bool RenderToFilePipeline::ClaimPage(int *pageNo, bool *wait) {
+    ScopedCritSec scope(&access);
+    *wait = nextPage <= engine->PageCount() && nextPage > consumed + MAX_RENDER_TO_FILE_AHEAD;
+    if (nextPage > engine->PageCount() || *wait)
+        return false;
+    *pageNo = nextPage++;
+    return true;
+}
+
+void RenderToFilePipeline::FinishPage(int pageNo, unsigned char *data, size_t len, SizeI size, bool isGrayscale) {
+    ScopedCritSec scope(&access);
+    CompressedPage &page = pages[pageNo];
+    page.data = data;
+    page.len = len;
+    page.size = size;
+    page.isGrayscale = isGrayscale;
+    page.done = true;
+}
+
+// waits until the page has been rendered (page->data is nullptr if that failed)
+CompressedPage *RenderToFilePipeline::TakePage(int pageNo) {
+    for (;;) {
+        {
+            ScopedCritSec scope(&access);
+            if (pages[pageNo].done) {
+                consumed = pageNo;
+                return &pages[pageNo];
+            }
+        }
+        Sleep(1);
+    }
+}
+
+void RenderToFileWorker::Run() {
+    // cloning the engine on the worker allows for several clones to be created at once
+    // (fall back to the thread-safe original if cloning fails)
+    clone = pipeline->engine->Clone();
+    BaseEngine *engine = clone ? clone : pipeline->engine;
+
+    while (!WasCancelRequested()) {
+        int pageNo;
+        bool wait;
+        if (!pipeline->ClaimPage(&pageNo, &wait)) {
+            if (!wait)
+                break;
+            Sleep(1);
+            continue;
+        }
+        unsigned char *data = nullptr;
+        size_t len = 0;
+        bool isGrayscale = false;
+        SizeI size;
+        RenderedBitmap *bmp = engine->RenderBitmap(pageNo, pipeline->zoom, 0, nullptr, Target_Export);
+        if (bmp) {
+            size = bmp->Size();
+            data = compress_bitmap(bmp->GetBitmap(), size, &len, &isGrayscale);
+            delete bmp;
+        }
+        pipeline->FinishPage(pageNo, data, len, size, isGrayscale);
+    }
+}
+
 bool PdfCreator::RenderToFile(const WCHAR *pdfFileName, BaseEngine *engine, int dpi)
 {
     PdfCreator *c = new PdfCreator();
+    if (!c->ctx || !c->doc) {
+        delete c;
+        return false;
+    }
     bool ok = true;
     // render all pages to images
     float zoom = dpi / engine->GetFileDPI();
+    RenderToFilePipeline *pipeline = new RenderToFilePipeline(engine, zoom);
     for (int i = 1; ok && i <= engine->PageCount(); i++) {
-        RenderedBitmap *bmp = engine->RenderBitmap(i, zoom, 0, nullptr, Target_Export);
-        if (bmp)
-            ok = c->AddImagePage(bmp->GetBitmap(), bmp->Size(), dpi);
-        else
+        CompressedPage *page = pipeline->TakePage(i);
+        ok = page->data != nullptr;
+        fz_image *image = nullptr;
+        fz_var(image);
+        fz_try(c->ctx) {
+            if (ok)
+                image = pack_flate(c->ctx, page->data, page->len, page->size, page->isGrayscale);
+        }
+        fz_catch(c->ctx) {
             ok = false;
-        delete bmp;
+        }
+        free(page->data);
+        page->data = nullptr;
+        if (ok)
+            ok = c->AddImagePage(image, (float)dpi);
+        fz_drop_image(c->ctx, image);
     }
+    delete pipeline;
     if (!ok) {
         delete c;
         return false;
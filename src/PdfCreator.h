@@ -16,7 +16,7 @@ public:
     bool AddImagePage(fz_image *image, float imgDpi=0);
     bool AddImagePage(HBITMAP hbmp, SizeI size, float imgDpi=0);
     bool AddImagePage(Gdiplus::Bitmap *bmp, float imgDpi=0);
-    // recommended for JPEG and JP2 images (don't need to be recompressed)
+    // recommended for JPEG and JP2 images (grayscale and RGB images are embedded as is)
     bool AddImagePage(const char *data, size_t len, float imgDpi=0);
 
     bool SetProperty(DocumentProperty prop, const WCHAR *value);
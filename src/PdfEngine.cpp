@@ -10,28 +10,86 @@ extern "C" {
 // utils
 #include "BaseUtil.h"
 #include "ArchUtil.h"
+#include "CryptoUtil.h"
+#include "EtwTrace.h"
 #include "FileUtil.h"
 #include "HtmlParserLookup.h"
 #include "HtmlPullParser.h"
+#include "ThreadUtil.h"
 #include "TrivialHtmlParser.h"
 #include "WinUtil.h"
 #include "ZipUtil.h"
 // rendering engines
 #include "BaseEngine.h"
 #include "PdfEngine.h"
+#include "DebugLog.h"
 
 // maximum size of a file that's entirely loaded into memory before parsed
-// and displayed; larger files will be kept open while they're displayed
-// so that their content can be loaded on demand in order to preserve memory
+// and displayed; larger files will be memory mapped (or kept open) while
+// they're displayed so that their content can be loaded on demand in order
+// to preserve memory
 #define MAX_MEMORY_FILE_SIZE (10 * 1024 * 1024)
+// minimum number of pages for which a document's page objects are
+// looked up on demand instead of walking the entire page tree while loading
+#define LAZY_PAGE_TREE_MIN_PAGES 1000
+// number of bytes read at once by a progressive_file's reader thread
+#define PROGRESSIVE_CHUNK_SIZE (256 * 1024)
+// time (in ms) to wait for more data before retrying to open a progressive stream
+#define PROGRESSIVE_RETRY_DELAY 50
 
 // number of page content trees to cache for quicker rendering
 #define MAX_PAGE_RUN_CACHE  8
-// maximum estimated memory requirement allowed for the run cache of one document
+// default maximum estimated memory requirement allowed for the run cache
+// of one document (cf. PdfEngine::SetMaxPageRunMemory)
 #define MAX_PAGE_RUN_MEMORY (40 * 1024 * 1024)
 
+static size_t gMaxPageRunMemory = MAX_PAGE_RUN_MEMORY;
+
 // maximum amount of memory that MuPDF should use per fz_context store
 #define MAX_CONTEXT_MEMORY  (256 * 1024 * 1024)
+// amount of memory a store is reduced to while its document isn't visible
+#define MIN_CONTEXT_MEMORY  (16 * 1024 * 1024)
+
+// renderings of at least this many pixels are split into horizontal bands
+// which are rendered concurrently (cf. PdfEngineImpl::RenderPageRunBands)
+#define BANDED_RENDER_MIN_PIXELS (1024 * 1024)
+#define BANDED_RENDER_MIN_BAND_HEIGHT 256
+#define BANDED_RENDER_MAX_BANDS 8
+
+// default maximum amount of memory the glyph cache of one document may grow to
+// at high resolutions (cf. PdfEngine::SetMaxGlyphCacheMemory)
+#define MAX_GLYPH_CACHE_MEMORY (16 * 1024 * 1024)
+// glyphs up to this font size (in points) remain cacheable at most zoom levels
+#define MIN_CACHED_GLYPH_POINTS 72
+// but never cache glyphs larger than this (in pixels)
+#define MAX_CACHED_GLYPH_SIZE 1024
+
+static size_t gMaxGlyphCacheMemory = MAX_GLYPH_CACHE_MEMORY;
+
+// the page geometry and labels of documents with many pages are cached
+// (cf. PdfEngine::SetPageDataCache)
+#define PDF_CACHE_MIN_PAGES 50
+#define PDF_CACHE_MAGIC "PdfP"
+#define PDF_CACHE_VERSION 1
+
+static WCHAR *(* gGetPageDataCachePath)(const WCHAR *filePath) = nullptr;
+
+struct PdfPageCacheHeader {
+    char magic[4];
+    uint32 version;
+    // the cache is only valid for a file of this size and modification time
+    int64 fileSize;
+    FILETIME modified;
+    int32 pageCount;
+    // either 0 or pageCount zero-terminated labels follow the entries
+    int32 labelCount;
+};
+
+struct PdfPageCacheEntry {
+    // an empty mediabox or content box hadn't been determined yet
+    double mediaboxDx, mediaboxDy;
+    double contentX, contentY, contentDx, contentDy;
+};
 
 ///// extensions to Fitz that are usable for both PDF and XPS /////
 
@@ -120,18 +178,8 @@ ProducingPaletteDone:
     }
     if (!hasPalette) {
         free(bmpData);
-        /* BGRA is a GDI compatible format */
-        fz_try(ctx) {
-            fz_irect bbox;
-            fz_colorspace *colorspace = fz_device_bgr(ctx);
-            bgrPixmap = fz_new_pixmap_with_bbox(ctx, colorspace, fz_pixmap_bbox(ctx, pixmap, &bbox));
-            fz_convert_pixmap(ctx, bgrPixmap, pixmap);
-        }
-        fz_catch(ctx) {
-            return nullptr;
-        }
+        bmpData = nullptr;
     }
-    AssertCrash(hasPalette || bgrPixmap);
 
     BITMAPINFOHEADER *bmih = &bmi.Get()->bmiHeader;
     bmih->biSize = sizeof(*bmih);
@@ -146,13 +194,29 @@ ProducingPaletteDone:
     void *data = nullptr;
     HANDLE hMap = CreateFileMapping(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, bmih->biSizeImage, nullptr);
     HBITMAP hbmp = CreateDIBSection(nullptr, bmi, DIB_RGB_COLORS, &data, hMap, 0);
-    if (hbmp)
-        memcpy(data, hasPalette ? bmpData : bgrPixmap->samples, bmih->biSizeImage);
+    if (hbmp && hasPalette) {
+        memcpy(data, bmpData, bmih->biSizeImage);
+    }
+    else if (hbmp) {
+        /* BGRA is a GDI compatible format, so convert straight into the DIB section */
+        fz_var(bgrPixmap);
+        fz_try(ctx) {
+            fz_irect bbox;
+            fz_colorspace *colorspace = fz_device_bgr(ctx);
+            bgrPixmap = fz_new_pixmap_with_bbox_and_data(ctx, colorspace, fz_pixmap_bbox(ctx, pixmap, &bbox), (unsigned char *)data);
+            fz_convert_pixmap(ctx, bgrPixmap, pixmap);
+        }
+        fz_always(ctx) {
+            fz_drop_pixmap(ctx, bgrPixmap);
+        }
+        fz_catch(ctx) {
+            DeleteObject(hbmp);
+            CloseHandle(hMap);
+            return nullptr;
+        }
+    }
 
-    if (hasPalette)
-        free(bmpData);
-    else
-        fz_drop_pixmap(ctx, bgrPixmap);
+    free(bmpData);
 
     // return a RenderedBitmap even if hbmp is nullptr so that callers can
     // distinguish rendering errors from GDI resource exhaustion
@@ -160,10 +224,269 @@ ProducingPaletteDone:
     return new RenderedBitmap(hbmp, SizeI(w, h), hMap);
 }
 
-fz_stream *fz_open_file2(fz_context *ctx, const WCHAR *filePath)
+// a read-only view of an entire file, shared by all streams reopened from
+// the same stream (e.g. by engine clones)
+struct mapped_file {
+    LONG refs;
+    HANDLE hFile;
+    HANDLE hMap;
+    unsigned char *data;
+    int len;
+};
+
+static void drop_mapped_file(mapped_file *mf)
+{
+    if (InterlockedDecrement(&mf->refs) > 0)
+        return;
+    UnmapViewOfFile(mf->data);
+    CloseHandle(mf->hMap);
+    CloseHandle(mf->hFile);
+    free(mf);
+}
+
+static mapped_file *map_file(const WCHAR *filePath)
+{
+    HANDLE hFile = CreateFile(filePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                              nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (INVALID_HANDLE_VALUE == hFile)
+        return nullptr;
+    LARGE_INTEGER size;
+    HANDLE hMap = nullptr;
+    void *data = nullptr;
+    mapped_file *mf = nullptr;
+    if (GetFileSizeEx(hFile, &size) && 0 < size.QuadPart && size.QuadPart <= INT_MAX)
+        hMap = CreateFileMapping(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    // this fails e.g. for 32-bit builds without enough contiguous address space
+    if (hMap)
+        data = MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+    if (data)
+        mf = AllocStruct<mapped_file>();
+    if (!mf) {
+        if (data)
+            UnmapViewOfFile(data);
+        if (hMap)
+            CloseHandle(hMap);
+        CloseHandle(hFile);
+        return nullptr;
+    }
+    mf->refs = 1;
+    mf->hFile = hFile;
+    mf->hMap = hMap;
+    mf->data = (unsigned char *)data;
+    mf->len = (int)size.QuadPart;
+    return mf;
+}
+
+extern "C" static int next_mapped(fz_stream *stm, int max)
+{
+    UNUSED(stm); UNUSED(max);
+    // all data is available right away
+    return EOF;
+}
+
+// same as seek_buffer in fitz/stream-open.c
+extern "C" static void seek_mapped(fz_stream *stm, int offset, int whence)
+{
+    int pos = stm->pos - (int)(stm->wp - stm->rp);
+    if (1 == whence)
+        offset += pos;
+    else if (2 == whence)
+        offset += stm->pos;
+    offset = limitValue(offset, 0, stm->pos);
+    stm->rp += offset - pos;
+}
+
+extern "C" static void close_mapped(fz_context *ctx, void *state)
+{
+    UNUSED(ctx);
+    drop_mapped_file((mapped_file *)state);
+}
+
+static fz_stream *open_mapped_stream(fz_context *ctx, mapped_file *mf);
+
+extern "C" static fz_stream *reopen_mapped(fz_context *ctx, fz_stream *stm)
+{
+    mapped_file *mf = (mapped_file *)stm->state;
+    InterlockedIncrement(&mf->refs);
+    return open_mapped_stream(ctx, mf);
+}
+
+// takes over a reference to mf (which fz_new_stream drops on failure)
+static fz_stream *open_mapped_stream(fz_context *ctx, mapped_file *mf)
+{
+    fz_stream *stm = fz_new_stream(ctx, mf, next_mapped, close_mapped, nullptr);
+    stm->seek = seek_mapped;
+    stm->reopen = reopen_mapped;
+    stm->rp = mf->data;
+    stm->wp = mf->data + mf->len;
+    stm->pos = mf->len;
+    return stm;
+}
+
+// large linearized files on network drives are read in the background
+// so that the first pages can be displayed before the whole file has arrived
+// (MuPDF throws FZ_ERROR_TRYLATER for data that isn't available yet)
+struct progressive_file {
+    LONG refs;
+    HANDLE hFile;
+    HANDLE hThread;
+    unsigned char *data;
+    int len;
+    // number of bytes read so far
+    volatile LONG available;
+    volatile bool failed;
+    volatile bool canceled;
+};
+
+static DWORD WINAPI read_progressive_file(void *data)
+{
+    progressive_file *pf = (progressive_file *)data;
+    while (pf->available < pf->len && !pf->canceled) {
+        DWORD toRead = (DWORD)std::min(pf->len - (int)pf->available, PROGRESSIVE_CHUNK_SIZE);
+        DWORD read;
+        if (!ReadFile(pf->hFile, pf->data + pf->available, toRead, &read, nullptr) || 0 == read) {
+            pf->failed = true;
+            break;
+        }
+        InterlockedExchangeAdd(&pf->available, (LONG)read);
+    }
+    return 0;
+}
+
+static void drop_progressive_file(progressive_file *pf)
+{
+    if (InterlockedDecrement(&pf->refs) > 0)
+        return;
+    pf->canceled = true;
+    WaitForSingleObject(pf->hThread, INFINITE);
+    CloseHandle(pf->hThread);
+    CloseHandle(pf->hFile);
+    free(pf->data);
+    free(pf);
+}
+
+// the linearization dictionary must be the first object and
+// be contained within the first 1024 bytes of the file
+static bool starts_linearized(const WCHAR *filePath)
+{
+    char header[1024];
+    if (!file::ReadN(filePath, header, sizeof(header)))
+        return false;
+    const char *marker = "/Linearized";
+    size_t markerLen = str::Len(marker);
+    for (size_t i = 0; i + markerLen <= sizeof(header); i++) {
+        if (!memcmp(header + i, marker, markerLen))
+            return true;
+    }
+    return false;
+}
+
+static progressive_file *open_progressive_file(const WCHAR *filePath, int64 fileSize)
+{
+    if (fileSize > INT_MAX || !starts_linearized(filePath))
+        return nullptr;
+    progressive_file *pf = AllocStruct<progressive_file>();
+    if (!pf)
+        return nullptr;
+    pf->len = (int)fileSize;
+    pf->data = (unsigned char *)malloc(pf->len);
+    pf->hFile = CreateFile(filePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                           nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (pf->data && INVALID_HANDLE_VALUE != pf->hFile)
+        pf->hThread = CreateThread(nullptr, 0, read_progressive_file, pf, 0, 0);
+    if (!pf->hThread) {
+        if (INVALID_HANDLE_VALUE != pf->hFile)
+            CloseHandle(pf->hFile);
+        free(pf->data);
+        free(pf);
+        return nullptr;
+    }
+    pf->refs = 1;
+    return pf;
+}
+
+extern "C" static int next_progressive(fz_stream *stm, int max)
+{
+    UNUSED(max);
+    progressive_file *pf = (progressive_file *)stm->state;
+    int available = pf->available;
+    if (stm->pos >= pf->len)
+        return EOF;
+    if (stm->pos >= available) {
+        if (pf->failed)
+            fz_throw(stm->ctx, FZ_ERROR_GENERIC, "read error at offset %d", stm->pos);
+        fz_throw(stm->ctx, FZ_ERROR_TRYLATER, "data at offset %d not available yet", stm->pos);
+    }
+    stm->rp = pf->data + stm->pos;
+    stm->wp = pf->data + available;
+    stm->pos = available;
+    return *stm->rp++;
+}
+
+extern "C" static void seek_progressive(fz_stream *stm, int offset, int whence)
+{
+    progressive_file *pf = (progressive_file *)stm->state;
+    if (1 == whence)
+        offset += fz_tell(stm);
+    else if (2 == whence)
+        offset += pf->len;
+    // data is only requested (and possibly not available) on the next read
+    stm->pos = limitValue(offset, 0, pf->len);
+    stm->rp = stm->wp = pf->data + stm->pos;
+}
+
+extern "C" static void close_progressive(fz_context *ctx, void *state)
+{
+    UNUSED(ctx);
+    drop_progressive_file((progressive_file *)state);
+}
+
+extern "C" static int meta_progressive(fz_stream *stm, int key, int size, void *ptr)
+{
+    UNUSED(size); UNUSED(ptr);
+    progressive_file *pf = (progressive_file *)stm->state;
+    if (FZ_STREAM_META_PROGRESSIVE == key)
+        return 1;
+    if (FZ_STREAM_META_LENGTH == key)
+        return pf->len;
+    return -1;
+}
+
+static fz_stream *open_progressive_stream(fz_context *ctx, progressive_file *pf);
+
+extern "C" static fz_stream *reopen_progressive(fz_context *ctx, fz_stream *stm)
+{
+    progressive_file *pf = (progressive_file *)stm->state;
+    InterlockedIncrement(&pf->refs);
+    return open_progressive_stream(ctx, pf);
+}
+
+// takes over a reference to pf (which fz_new_stream drops on failure)
+static fz_stream *open_progressive_stream(fz_context *ctx, progressive_file *pf)
+{
+    fz_stream *stm = fz_new_stream(ctx, pf, next_progressive, close_progressive, nullptr);
+    stm->seek = seek_progressive;
+    stm->reopen = reopen_progressive;
+    stm->meta = meta_progressive;
+    stm->rp = stm->wp = pf->data;
+    return stm;
+}
+
+// whether stm is a progressive stream whose data hasn't arrived completely yet
+static bool is_stream_incomplete(fz_stream *stm)
+{
+    if (!stm || stm->meta != meta_progressive)
+        return false;
+    progressive_file *pf = (progressive_file *)stm->state;
+    return pf->available < pf->len && !pf->failed;
+}
+
+fz_stream *fz_open_file2(fz_context *ctx, const WCHAR *filePath, bool *inMemory=nullptr)
 {
     fz_stream *file = nullptr;
     int64 fileSize = file::GetSize(filePath);
+    if (inMemory)
+        *inMemory = false;
     // load small files entirely into memory so that they can be
     // overwritten even by programs that don't open files with FILE_SHARE_READ
     if (fileSize > 0 && fileSize < MAX_MEMORY_FILE_SIZE) {
@@ -179,6 +502,38 @@ fz_stream *fz_open_file2(fz_context *ctx, const WCHAR *filePath)
             file = nullptr;
         }
         fz_drop_buffer(ctx, data);
+        if (file) {
+            if (inMemory)
+                *inMemory = true;
+            return file;
+        }
+    }
+
+    // larger files are memory mapped, so that reading objects doesn't need any
+    // copying and so that all processes share the same pages of the file in memory
+    // (not for files on network or removable drives, as reading from a view of
+    // a file that's become unavailable can't fail gracefully)
+    mapped_file *mf = path::IsOnFixedDrive(filePath) ? map_file(filePath) : nullptr;
+    if (mf) {
+        fz_try(ctx) {
+            file = open_mapped_stream(ctx, mf);
+        }
+        fz_catch(ctx) {
+            file = nullptr;
+        }
+        if (file)
+            return file;
+    }
+
+    // large linearized files on slow drives are read progressively
+    progressive_file *pf = !path::IsOnFixedDrive(filePath) && fileSize > 0 ? open_progressive_file(filePath, fileSize) : nullptr;
+    if (pf) {
+        fz_try(ctx) {
+            file = open_progressive_stream(ctx, pf);
+        }
+        fz_catch(ctx) {
+            file = nullptr;
+        }
         if (file)
             return file;
     }
@@ -212,31 +567,31 @@ unsigned char *fz_extract_stream_data(fz_stream *stream, size_t *cbCount)
     return data;
 }
 
+#define FINGERPRINT_CHUNK_SIZE (256 * 1024)
+
+// the data is hashed in chunks so that large documents don't
+// have to be (temporarily) read into memory as a whole
 void fz_stream_fingerprint(fz_stream *file, unsigned char digest[16])
 {
-    int fileLen = -1;
-    fz_buffer *buffer = nullptr;
+    CryptoHash md5(CryptoHash::MD5);
+    ScopedMem<unsigned char> chunk(AllocArray<unsigned char>(FINGERPRINT_CHUNK_SIZE));
+    bool ok = md5.IsValid() && chunk;
 
+    fz_var(ok);
     fz_try(file->ctx) {
-        fz_seek(file, 0, 2);
-        fileLen = fz_tell(file);
         fz_seek(file, 0, 0);
-        buffer = fz_read_all(file, fileLen);
+        int read;
+        while (ok && (read = fz_read(file, chunk, FINGERPRINT_CHUNK_SIZE)) > 0) {
+            ok = md5.Update(chunk, read);
+        }
     }
     fz_catch(file->ctx) {
+        ok = false;
+    }
+    if (!ok || !md5.Final(digest, 16)) {
         fz_warn(file->ctx, "couldn't read stream data, using a nullptr fingerprint instead");
         ZeroMemory(digest, 16);
-        return;
     }
-    CrashIf(nullptr == buffer);
-    CrashIf(fileLen != buffer->len);
-
-    fz_md5 md5;
-    fz_md5_init(&md5);
-    fz_md5_update(&md5, buffer->data, buffer->len);
-    fz_md5_final(&md5, digest);
-
-    fz_drop_buffer(file->ctx, buffer);
 }
 
 static inline int wchars_per_rune(int rune)
@@ -322,10 +677,12 @@ static void AddLineSep(str::Str<WCHAR>& s, Vec<RectI>& rects, const WCHAR *lineS
 static WCHAR *fz_text_page_to_str(fz_text_page *text, const WCHAR *lineSep, RectI **coordsOut)
 {
     size_t lineSepLen = str::Len(lineSep);
-    str::Str<WCHAR> content;
+    // the text is collected in scratch memory and copied out once complete
+    ScopedScratch scratch;
+    str::Str<WCHAR> content(0, scratch.Get());
     // coordsOut is optional but we ask for it by default so we simplify the code
     // by always calculating it
-    Vec<RectI> rects;
+    Vec<RectI> rects(0, scratch.Get());
 
     for (fz_page_block *block = text->blocks; block < text->blocks + text->len; block++) {
         if (block->type != FZ_PAGE_BLOCK_TEXT)
@@ -344,10 +701,10 @@ static WCHAR *fz_text_page_to_str(fz_text_page *text, const WCHAR *lineSep, Rect
     CrashIf(content.Count() != rects.Count());
 
     if (coordsOut) {
-        *coordsOut = rects.StealData();
+        *coordsOut = rects.DupData();
     }
 
-    return content.StealData();
+    return content.DupData();
 }
 
 struct istream_filter {
@@ -756,157 +1113,627 @@ static fz_device *fz_new_inspection_device(fz_context *ctx, ListInspectionData *
     return dev;
 }
 
-class FitzAbortCookie : public AbortCookie {
-public:
-    fz_cookie cookie;
-    FitzAbortCookie() { memset(&cookie, 0, sizeof(cookie)); }
-    void Abort() override { cookie.abort = 1; }
+// renders content as vector graphics into a GDI device context (used for printing).
+// Since GDI can't render everything (e.g. transparency, shadings, image masks and
+// patterns), pages are run through this device with checkOnly set first, so that
+// they can rather be rendered as bitmaps if unsupported is set afterwards
+struct GdiDeviceData {
+    HDC hDC;
+    bool checkOnly;
+    bool unsupported;
+
+    explicit GdiDeviceData(HDC hDC) : hDC(hDC), checkOnly(true), unsupported(false) { }
 };
 
-extern "C" static void
-fz_lock_context_cs(void *user, int lock)
-{
-    UNUSED(lock);
-    // we use a single critical section for all locks,
-    // since that critical section (ctxAccess) should
-    // be guarding all fz_context access anyway and
-    // thus already be in place (in debug builds we
-    // crash if that assertion doesn't hold)
-    CRITICAL_SECTION *cs = (CRITICAL_SECTION *)user;
-    BOOL ok = TryEnterCriticalSection(cs);
-    if (!ok) {
-        CrashIf(true);
-        EnterCriticalSection(cs);
-    }
+static void fz_gdi_set_unsupported(fz_device *dev)
+{
+    ((GdiDeviceData *)dev->user)->unsupported = true;
 }
 
-extern "C" static void
-fz_unlock_context_cs(void *user, int lock)
+// returns false if content shouldn't be drawn (yet)
+static bool fz_gdi_can_draw(fz_device *dev)
 {
-    UNUSED(lock);
-    CRITICAL_SECTION *cs = (CRITICAL_SECTION *)user;
-    LeaveCriticalSection(cs);
+    GdiDeviceData *data = (GdiDeviceData *)dev->user;
+    return !data->checkOnly && !data->unsupported;
 }
 
-static Vec<PageAnnotation> fz_get_user_page_annots(Vec<PageAnnotation>& userAnnots, int pageNo)
+static COLORREF fz_gdi_color(fz_context *ctx, fz_colorspace *colorspace, float *color)
 {
-    Vec<PageAnnotation> result;
-    for (size_t i = 0; i < userAnnots.Count(); i++) {
-        PageAnnotation& annot = userAnnots.At(i);
-        if (annot.pageNo != pageNo)
-            continue;
-        // include all annotations for pageNo that can be rendered by fz_run_user_annots
-        switch (annot.type) {
-        case Annot_Highlight: case Annot_Underline: case Annot_StrikeOut: case Annot_Squiggly:
-            result.Append(annot);
-            break;
-        }
-    }
+    float rgb[3];
+    fz_convert_color(ctx, fz_device_rgb(ctx), rgb, colorspace, color);
+    return RGB((BYTE)(limitValue(rgb[0], 0.f, 1.f) * 255 + 0.5f),
+               (BYTE)(limitValue(rgb[1], 0.f, 1.f) * 255 + 0.5f),
+               (BYTE)(limitValue(rgb[2], 0.f, 1.f) * 255 + 0.5f));
+}
+
+static POINT fz_gdi_point(const float *coords, const fz_matrix *ctm)
+{
+    fz_point pt = { coords[0], coords[1] };
+    fz_transform_point(&pt, ctm);
+    POINT result = { (LONG)floorf(pt.x + 0.5f), (LONG)floorf(pt.y + 0.5f) };
     return result;
 }
 
-static void fz_run_user_page_annots(Vec<PageAnnotation>& pageAnnots, fz_device *dev, const fz_matrix *ctm, const fz_rect *cliprect, fz_cookie *cookie)
+// adds the path's figures to the current GDI path (between BeginPath and EndPath)
+static void fz_gdi_add_path(HDC hDC, fz_path *path, const fz_matrix *ctm)
 {
-    for (size_t i = 0; i < pageAnnots.Count() && (!cookie || !cookie->abort); i++) {
-        PageAnnotation& annot = pageAnnots.At(i);
-        // skip annotation if it isn't visible
-        fz_rect rect = fz_RectD_to_rect(annot.rect);
-        fz_transform_rect(&rect, ctm);
-        fz_rect isect = rect;
-        if (cliprect && fz_is_empty_rect(fz_intersect_rect(&isect, cliprect)))
-            continue;
-        // prepare text highlighting path (cf. pdf_create_highlight_annot
-        // and pdf_create_markup_annot in pdf_annot.c)
-        fz_path *path = fz_new_path(dev->ctx);
-        fz_stroke_state *stroke = nullptr;
-        switch (annot.type) {
-        case Annot_Highlight:
-            fz_moveto(dev->ctx, path, annot.rect.TL().x, annot.rect.TL().y);
-            fz_lineto(dev->ctx, path, annot.rect.BR().x, annot.rect.TL().y);
-            fz_lineto(dev->ctx, path, annot.rect.BR().x, annot.rect.BR().y);
-            fz_lineto(dev->ctx, path, annot.rect.TL().x, annot.rect.BR().y);
-            fz_closepath(dev->ctx, path);
-            break;
-        case Annot_Underline:
-            fz_moveto(dev->ctx, path, annot.rect.TL().x, annot.rect.BR().y - 0.25f);
-            fz_lineto(dev->ctx, path, annot.rect.BR().x, annot.rect.BR().y - 0.25f);
-            break;
-        case Annot_StrikeOut:
-            fz_moveto(dev->ctx, path, annot.rect.TL().x, annot.rect.TL().y + annot.rect.dy / 2);
-            fz_lineto(dev->ctx, path, annot.rect.BR().x, annot.rect.TL().y + annot.rect.dy / 2);
+    int k = 0;
+    for (int i = 0; i < path->cmd_len; i++) {
+        switch (path->cmds[i]) {
+        case FZ_MOVETO: {
+            POINT pt = fz_gdi_point(&path->coords[k], ctm);
+            MoveToEx(hDC, pt.x, pt.y, nullptr);
+            k += 2;
             break;
-        case Annot_Squiggly:
-            fz_moveto(dev->ctx, path, annot.rect.TL().x + 1, annot.rect.BR().y);
-            fz_lineto(dev->ctx, path, annot.rect.BR().x, annot.rect.BR().y);
-            fz_moveto(dev->ctx, path, annot.rect.TL().x, annot.rect.BR().y - 0.5f);
-            fz_lineto(dev->ctx, path, annot.rect.BR().x, annot.rect.BR().y - 0.5f);
-            stroke = fz_new_stroke_state_with_dash_len(dev->ctx, 2);
-            CrashIf(!stroke);
-            stroke->linewidth = 0.5f;
-            stroke->dash_list[stroke->dash_len++] = 1;
-            stroke->dash_list[stroke->dash_len++] = 1;
+        }
+        case FZ_LINETO: {
+            POINT pt = fz_gdi_point(&path->coords[k], ctm);
+            LineTo(hDC, pt.x, pt.y);
+            k += 2;
             break;
-        default:
-            CrashIf(true);
         }
-        fz_colorspace *cs = fz_device_rgb(dev->ctx);
-        float color[3] = { annot.color.r / 255.f, annot.color.g / 255.f, annot.color.b / 255.f };
-        if (Annot_Highlight == annot.type) {
-            // render path with transparency effect
-            fz_begin_group(dev, &rect, 0, 0, FZ_BLEND_MULTIPLY, 1.f);
-            fz_fill_path(dev, path, 0, ctm, cs, color, annot.color.a / 255.f);
-            fz_end_group(dev);
+        case FZ_CURVETO: {
+            POINT pts[3];
+            for (int j = 0; j < 3; j++) {
+                pts[j] = fz_gdi_point(&path->coords[k], ctm);
+                k += 2;
+            }
+            PolyBezierTo(hDC, pts, 3);
+            break;
         }
-        else {
-            if (!stroke)
-                stroke = fz_new_stroke_state(dev->ctx);
-            fz_stroke_path(dev, path, stroke, ctm, cs, color, 1.0f);
-            fz_drop_stroke_state(dev->ctx, stroke);
+        case FZ_CLOSE_PATH:
+            CloseFigure(hDC);
+            break;
         }
-        fz_free_path(dev->ctx, path);
     }
 }
 
-static void fz_run_page_transparency(Vec<PageAnnotation>& pageAnnots, fz_device *dev, const fz_rect *cliprect, bool endGroup, bool hasTransparency=false)
+static HPEN fz_gdi_create_pen(fz_stroke_state *stroke, const fz_matrix *ctm, COLORREF color)
 {
-    if (hasTransparency || pageAnnots.Count() == 0)
-        return;
-    bool needsTransparency = false;
-    for (size_t i = 0; i < pageAnnots.Count(); i++) {
-        if (Annot_Highlight == pageAnnots.At(i).type) {
-            needsTransparency = true;
-            break;
+    float expansion = fz_matrix_expansion(ctm);
+    DWORD style = PS_GEOMETRIC;
+    style |= FZ_LINECAP_ROUND == stroke->start_cap ? PS_ENDCAP_ROUND :
+             FZ_LINECAP_SQUARE == stroke->start_cap ? PS_ENDCAP_SQUARE : PS_ENDCAP_FLAT;
+    style |= FZ_LINEJOIN_ROUND == stroke->linejoin ? PS_JOIN_ROUND :
+             FZ_LINEJOIN_BEVEL == stroke->linejoin ? PS_JOIN_BEVEL : PS_JOIN_MITER;
+
+    DWORD dashes[16];
+    int dashCount = stroke->dash_len;
+    if (dashCount > 0) {
+        style |= PS_USERSTYLE;
+        for (int i = 0; i < dashCount; i++) {
+            dashes[i] = std::max((DWORD)(stroke->dash_list[i] * expansion + 0.5f), (DWORD)1);
         }
     }
-    if (!needsTransparency)
-        return;
-    if (!endGroup)
-        fz_begin_group(dev, cliprect ? cliprect : &fz_infinite_rect, 1, 0, 0, 1);
-    else
-        fz_end_group(dev);
-}
-
-///// PDF-specific extensions to Fitz/MuPDF /////
+    else {
+        style |= PS_SOLID;
+    }
 
-extern "C" {
-#include <mupdf/pdf.h>
+    LOGBRUSH lb = { BS_SOLID, color, 0 };
+    DWORD width = std::max((DWORD)(stroke->linewidth * expansion + 0.5f), (DWORD)1);
+    return ExtCreatePen(style, width, &lb, dashCount, dashCount > 0 ? dashes : nullptr);
 }
 
-namespace str {
-    namespace conv {
+static bool fz_gdi_is_supported_stroke(fz_stroke_state *stroke)
+{
+    return stroke->dash_len <= 16;
+}
 
-inline WCHAR *FromPdf(pdf_obj *obj)
+// only fonts with glyph outlines can be drawn as paths
+static bool fz_gdi_is_supported_text(fz_text *text)
 {
-    ScopedMem<WCHAR> str(AllocArray<WCHAR>(pdf_to_str_len(obj) + 1));
-    pdf_to_ucs2_buf((unsigned short *)str.Get(), obj);
-    return str.StealData();
+    return text->font->ft_face && !text->font->t3procs;
 }
 
+static void fz_gdi_add_text(fz_context *ctx, HDC hDC, fz_text *text, const fz_matrix *ctm)
+{
+    fz_matrix tm = text->trm;
+    for (int i = 0; i < text->len; i++) {
+        if (text->items[i].gid < 0)
+            continue;
+        tm.e = text->items[i].x;
+        tm.f = text->items[i].y;
+        fz_matrix trm;
+        fz_concat(&trm, &tm, ctm);
+        fz_path *path = fz_outline_glyph(ctx, text->font, text->items[i].gid, &trm);
+        if (!path)
+            continue;
+        fz_gdi_add_path(hDC, path, &fz_identity);
+        fz_free_path(ctx, path);
     }
 }
 
-// some PDF documents contain control characters in outline titles or /Info properties
-WCHAR *pdf_clean_string(WCHAR *string)
+static void fz_gdi_fill_current_path(HDC hDC, COLORREF color, int fillMode)
+{
+    HBRUSH brush = CreateSolidBrush(color);
+    HGDIOBJ prevBrush = SelectObject(hDC, brush);
+    SetPolyFillMode(hDC, fillMode);
+    FillPath(hDC);
+    SelectObject(hDC, prevBrush);
+    DeleteObject(brush);
+}
+
+static void fz_gdi_stroke_current_path(HDC hDC, fz_stroke_state *stroke, const fz_matrix *ctm, COLORREF color)
+{
+    HPEN pen = fz_gdi_create_pen(stroke, ctm, color);
+    HGDIOBJ prevPen = SelectObject(hDC, pen);
+    SetMiterLimit(hDC, stroke->miterlimit, nullptr);
+    StrokePath(hDC);
+    SelectObject(hDC, prevPen);
+    DeleteObject(pen);
+}
+
+extern "C" static void
+fz_gdi_fill_path(fz_device *dev, fz_path *path, int even_odd, const fz_matrix *ctm, fz_colorspace *colorspace, float *color, float alpha)
+{
+    if (alpha < 1.0f)
+        fz_gdi_set_unsupported(dev);
+    if (!fz_gdi_can_draw(dev))
+        return;
+    HDC hDC = ((GdiDeviceData *)dev->user)->hDC;
+    BeginPath(hDC);
+    fz_gdi_add_path(hDC, path, ctm);
+    EndPath(hDC);
+    fz_gdi_fill_current_path(hDC, fz_gdi_color(dev->ctx, colorspace, color), even_odd ? ALTERNATE : WINDING);
+}
+
+extern "C" static void
+fz_gdi_stroke_path(fz_device *dev, fz_path *path, fz_stroke_state *stroke, const fz_matrix *ctm, fz_colorspace *colorspace, float *color, float alpha)
+{
+    if (alpha < 1.0f || !fz_gdi_is_supported_stroke(stroke))
+        fz_gdi_set_unsupported(dev);
+    if (!fz_gdi_can_draw(dev))
+        return;
+    HDC hDC = ((GdiDeviceData *)dev->user)->hDC;
+    BeginPath(hDC);
+    fz_gdi_add_path(hDC, path, ctm);
+    EndPath(hDC);
+    fz_gdi_stroke_current_path(hDC, stroke, ctm, fz_gdi_color(dev->ctx, colorspace, color));
+}
+
+extern "C" static void
+fz_gdi_clip_path(fz_device *dev, fz_path *path, const fz_rect *rect, int even_odd, const fz_matrix *ctm)
+{
+    UNUSED(rect);
+    if (!fz_gdi_can_draw(dev))
+        return;
+    HDC hDC = ((GdiDeviceData *)dev->user)->hDC;
+    SaveDC(hDC);
+    BeginPath(hDC);
+    fz_gdi_add_path(hDC, path, ctm);
+    EndPath(hDC);
+    SetPolyFillMode(hDC, even_odd ? ALTERNATE : WINDING);
+    SelectClipPath(hDC, RGN_AND);
+}
+
+extern "C" static void
+fz_gdi_clip_stroke_path(fz_device *dev, fz_path *path, const fz_rect *rect, fz_stroke_state *stroke, const fz_matrix *ctm)
+{
+    UNUSED(rect);
+    if (!fz_gdi_is_supported_stroke(stroke))
+        fz_gdi_set_unsupported(dev);
+    if (!fz_gdi_can_draw(dev))
+        return;
+    HDC hDC = ((GdiDeviceData *)dev->user)->hDC;
+    SaveDC(hDC);
+    HPEN pen = fz_gdi_create_pen(stroke, ctm, RGB(0, 0, 0));
+    HGDIOBJ prevPen = SelectObject(hDC, pen);
+    SetMiterLimit(hDC, stroke->miterlimit, nullptr);
+    BeginPath(hDC);
+    fz_gdi_add_path(hDC, path, ctm);
+    EndPath(hDC);
+    WidenPath(hDC);
+    SetPolyFillMode(hDC, WINDING);
+    SelectClipPath(hDC, RGN_AND);
+    SelectObject(hDC, prevPen);
+    DeleteObject(pen);
+}
+
+extern "C" static void
+fz_gdi_fill_text(fz_device *dev, fz_text *text, const fz_matrix *ctm, fz_colorspace *colorspace, float *color, float alpha)
+{
+    if (alpha < 1.0f || !fz_gdi_is_supported_text(text))
+        fz_gdi_set_unsupported(dev);
+    if (!fz_gdi_can_draw(dev))
+        return;
+    HDC hDC = ((GdiDeviceData *)dev->user)->hDC;
+    BeginPath(hDC);
+    fz_gdi_add_text(dev->ctx, hDC, text, ctm);
+    EndPath(hDC);
+    fz_gdi_fill_current_path(hDC, fz_gdi_color(dev->ctx, colorspace, color), WINDING);
+}
+
+extern "C" static void
+fz_gdi_stroke_text(fz_device *dev, fz_text *text, fz_stroke_state *stroke, const fz_matrix *ctm, fz_colorspace *colorspace, float *color, float alpha)
+{
+    if (alpha < 1.0f || !fz_gdi_is_supported_text(text) || !fz_gdi_is_supported_stroke(stroke))
+        fz_gdi_set_unsupported(dev);
+    if (!fz_gdi_can_draw(dev))
+        return;
+    HDC hDC = ((GdiDeviceData *)dev->user)->hDC;
+    BeginPath(hDC);
+    fz_gdi_add_text(dev->ctx, hDC, text, ctm);
+    EndPath(hDC);
+    fz_gdi_stroke_current_path(hDC, stroke, ctm, fz_gdi_color(dev->ctx, colorspace, color));
+}
+
+extern "C" static void
+fz_gdi_clip_text(fz_device *dev, fz_text *text, const fz_matrix *ctm, int accumulate)
+{
+    UNUSED(text); UNUSED(ctm); UNUSED(accumulate);
+    fz_gdi_set_unsupported(dev);
+}
+
+extern "C" static void
+fz_gdi_clip_stroke_text(fz_device *dev, fz_text *text, fz_stroke_state *stroke, const fz_matrix *ctm)
+{
+    UNUSED(text); UNUSED(stroke); UNUSED(ctm);
+    fz_gdi_set_unsupported(dev);
+}
+
+extern "C" static void
+fz_gdi_fill_shade(fz_device *dev, fz_shade *shade, const fz_matrix *ctm, float alpha)
+{
+    UNUSED(shade); UNUSED(ctm); UNUSED(alpha);
+    fz_gdi_set_unsupported(dev);
+}
+
+extern "C" static void
+fz_gdi_fill_image(fz_device *dev, fz_image *image, const fz_matrix *ctm, float alpha)
+{
+    if (alpha < 1.0f || image->mask)
+        fz_gdi_set_unsupported(dev);
+    if (!fz_gdi_can_draw(dev))
+        return;
+
+    // images are drawn at their native resolution (unless that exceeds the device's)
+    float scaleX = sqrtf(ctm->a * ctm->a + ctm->b * ctm->b);
+    float scaleY = sqrtf(ctm->c * ctm->c + ctm->d * ctm->d);
+    int w = limitValue((int)(scaleX + 0.5f), 1, image->w);
+    int h = limitValue((int)(scaleY + 0.5f), 1, image->h);
+
+    fz_context *ctx = dev->ctx;
+    HDC hDC = ((GdiDeviceData *)dev->user)->hDC;
+    fz_pixmap *pixmap = fz_new_pixmap_from_image(ctx, image, w, h);
+    RenderedBitmap *bmp = nullptr;
+    fz_try(ctx) {
+        bmp = new_rendered_fz_pixmap(ctx, pixmap);
+    }
+    fz_always(ctx) {
+        fz_drop_pixmap(ctx, pixmap);
+    }
+    fz_catch(ctx) {
+        fz_rethrow(ctx);
+    }
+    if (!bmp)
+        fz_throw(ctx, FZ_ERROR_GENERIC, "can't convert image for GDI");
+
+    // the image is mapped onto the unit square (top row first)
+    SizeI size = bmp->Size();
+    XFORM xform = { ctm->a / size.dx, ctm->b / size.dx, ctm->c / size.dy, ctm->d / size.dy, ctm->e, ctm->f };
+    SaveDC(hDC);
+    SetGraphicsMode(hDC, GM_ADVANCED);
+    SetWorldTransform(hDC, &xform);
+    bmp->StretchDIBits(hDC, RectI(PointI(), size));
+    RestoreDC(hDC, -1);
+    delete bmp;
+}
+
+extern "C" static void
+fz_gdi_fill_image_mask(fz_device *dev, fz_image *image, const fz_matrix *ctm, fz_colorspace *colorspace, float *color, float alpha)
+{
+    UNUSED(image); UNUSED(ctm); UNUSED(colorspace); UNUSED(color); UNUSED(alpha);
+    fz_gdi_set_unsupported(dev);
+}
+
+extern "C" static void
+fz_gdi_clip_image_mask(fz_device *dev, fz_image *image, const fz_rect *rect, const fz_matrix *ctm)
+{
+    UNUSED(image); UNUSED(rect); UNUSED(ctm);
+    fz_gdi_set_unsupported(dev);
+}
+
+extern "C" static void
+fz_gdi_pop_clip(fz_device *dev)
+{
+    if (!fz_gdi_can_draw(dev))
+        return;
+    RestoreDC(((GdiDeviceData *)dev->user)->hDC, -1);
+}
+
+extern "C" static void
+fz_gdi_begin_mask(fz_device *dev, const fz_rect *rect, int luminosity, fz_colorspace *colorspace, float *bc)
+{
+    UNUSED(rect); UNUSED(luminosity); UNUSED(colorspace); UNUSED(bc);
+    fz_gdi_set_unsupported(dev);
+}
+
+extern "C" static void
+fz_gdi_begin_group(fz_device *dev, const fz_rect *rect, int isolated, int knockout, int blendmode, float alpha)
+{
+    UNUSED(rect); UNUSED(isolated); UNUSED(knockout);
+    // opaque groups without blending are the same as drawing their content directly
+    if (alpha < 1.0f || blendmode != FZ_BLEND_NORMAL)
+        fz_gdi_set_unsupported(dev);
+}
+
+extern "C" static int
+fz_gdi_begin_tile(fz_device *dev, const fz_rect *area, const fz_rect *view, float xstep, float ystep, const fz_matrix *ctm, int id)
+{
+    UNUSED(area); UNUSED(view); UNUSED(xstep); UNUSED(ystep); UNUSED(ctm); UNUSED(id);
+    fz_gdi_set_unsupported(dev);
+    return 0;
+}
+
+extern "C" static void
+fz_gdi_apply_transfer_function(fz_device *dev, fz_transfer_function *tr, int for_mask)
+{
+    UNUSED(tr); UNUSED(for_mask);
+    fz_gdi_set_unsupported(dev);
+}
+
+static fz_device *fz_new_gdi_device(fz_context *ctx, GdiDeviceData *data)
+{
+    fz_device *dev = fz_new_device(ctx, data);
+
+    dev->fill_path = fz_gdi_fill_path;
+    dev->stroke_path = fz_gdi_stroke_path;
+    dev->clip_path = fz_gdi_clip_path;
+    dev->clip_stroke_path = fz_gdi_clip_stroke_path;
+
+    dev->fill_text = fz_gdi_fill_text;
+    dev->stroke_text = fz_gdi_stroke_text;
+    dev->clip_text = fz_gdi_clip_text;
+    dev->clip_stroke_text = fz_gdi_clip_stroke_text;
+
+    dev->fill_shade = fz_gdi_fill_shade;
+    dev->fill_image = fz_gdi_fill_image;
+    dev->fill_image_mask = fz_gdi_fill_image_mask;
+    dev->clip_image_mask = fz_gdi_clip_image_mask;
+
+    dev->pop_clip = fz_gdi_pop_clip;
+
+    dev->begin_mask = fz_gdi_begin_mask;
+    dev->begin_group = fz_gdi_begin_group;
+    dev->begin_tile = fz_gdi_begin_tile;
+    dev->apply_transfer_function = fz_gdi_apply_transfer_function;
+
+    return dev;
+}
+
+// renders a page as vector graphics in two passes: the first one checks
+// whether all the content is supported, the second one renders it into hDC
+// (runPage is expected to free the device)
+static bool fz_run_page_gdi(fz_context *ctx, CRITICAL_SECTION *ctxAccess, HDC hDC, RectI screenRect,
+                            const std::function<bool(fz_device *)>& runPage)
+{
+    GdiDeviceData data(hDC);
+    for (int pass = 0; pass < 2; pass++) {
+        data.checkOnly = 0 == pass;
+        fz_device *dev = nullptr;
+        EnterCriticalSection(ctxAccess);
+        fz_try(ctx) {
+            dev = fz_new_gdi_device(ctx, &data);
+        }
+        fz_catch(ctx) {
+            dev = nullptr;
+        }
+        LeaveCriticalSection(ctxAccess);
+        if (!dev)
+            return false;
+
+        if (!data.checkOnly) {
+            SaveDC(hDC);
+            IntersectClipRect(hDC, screenRect.x, screenRect.y, screenRect.x + screenRect.dx, screenRect.y + screenRect.dy);
+        }
+        bool ok = runPage(dev);
+        if (!data.checkOnly)
+            RestoreDC(hDC, -1);
+        if (!ok || data.unsupported)
+            return false;
+    }
+    return true;
+}
+
+class FitzAbortCookie : public AbortCookie {
+public:
+    fz_cookie cookie;
+    FitzAbortCookie() { memset(&cookie, 0, sizeof(cookie)); }
+    void Abort() override { cookie.abort = 1; }
+};
+
+// aborts a FitzAbortCookie once timeoutMs have passed (cf. ExtractPageTextLimited)
+class FitzAbortTimer {
+    HANDLE timer;
+
+    static VOID CALLBACK OnTimeout(PVOID cookie, BOOLEAN timedOut) {
+        UNUSED(timedOut);
+        ((FitzAbortCookie *)cookie)->Abort();
+    }
+
+public:
+    FitzAbortTimer(FitzAbortCookie *cookie, DWORD timeoutMs) : timer(nullptr) {
+        if (INFINITE != timeoutMs && !CreateTimerQueueTimer(&timer, nullptr, OnTimeout, cookie, timeoutMs, 0, WT_EXECUTEONLYONCE))
+            timer = nullptr;
+    }
+    // waits for a concurrently running OnTimeout to complete
+    ~FitzAbortTimer() {
+        if (timer)
+            DeleteTimerQueueTimer(nullptr, timer, INVALID_HANDLE_VALUE);
+    }
+};
+
+// all contexts share a single set of locks (cf. fz_new_engine_context),
+// i.e. the locks aren't guarded by a single engine's ctxAccess; each lock
+// gets its own critical section so that e.g. allocations of one thread don't
+// have to wait for another thread's glyph cache or FreeType access
+extern "C" static void
+fz_lock_shared_cs(void *user, int lock)
+{
+    CRITICAL_SECTION *cs = (CRITICAL_SECTION *)user;
+    EnterCriticalSection(&cs[lock]);
+}
+
+extern "C" static void
+fz_unlock_shared_cs(void *user, int lock)
+{
+    CRITICAL_SECTION *cs = (CRITICAL_SECTION *)user;
+    LeaveCriticalSection(&cs[lock]);
+}
+
+static Vec<PageAnnotation> fz_get_user_page_annots(Vec<PageAnnotation>& userAnnots, int pageNo)
+{
+    Vec<PageAnnotation> result;
+    for (size_t i = 0; i < userAnnots.Count(); i++) {
+        PageAnnotation& annot = userAnnots.At(i);
+        if (annot.pageNo != pageNo)
+            continue;
+        // include all annotations for pageNo that can be rendered by fz_run_user_annots
+        switch (annot.type) {
+        case Annot_Highlight: case Annot_Underline: case Annot_StrikeOut: case Annot_Squiggly:
+            result.Append(annot);
+            break;
+        }
+    }
+    return result;
+}
+
+static void fz_run_user_page_annots(Vec<PageAnnotation>& pageAnnots, fz_device *dev, const fz_matrix *ctm, const fz_rect *cliprect, fz_cookie *cookie)
+{
+    for (size_t i = 0; i < pageAnnots.Count() && (!cookie || !cookie->abort); i++) {
+        PageAnnotation& annot = pageAnnots.At(i);
+        // skip annotation if it isn't visible
+        fz_rect rect = fz_RectD_to_rect(annot.rect);
+        fz_transform_rect(&rect, ctm);
+        fz_rect isect = rect;
+        if (cliprect && fz_is_empty_rect(fz_intersect_rect(&isect, cliprect)))
+            continue;
+        // prepare text highlighting path (cf. pdf_create_highlight_annot
+        // and pdf_create_markup_annot in pdf_annot.c)
+        fz_path *path = fz_new_path(dev->ctx);
+        fz_stroke_state *stroke = nullptr;
+        switch (annot.type) {
+        case Annot_Highlight:
+            fz_moveto(dev->ctx, path, annot.rect.TL().x, annot.rect.TL().y);
+            fz_lineto(dev->ctx, path, annot.rect.BR().x, annot.rect.TL().y);
+            fz_lineto(dev->ctx, path, annot.rect.BR().x, annot.rect.BR().y);
+            fz_lineto(dev->ctx, path, annot.rect.TL().x, annot.rect.BR().y);
+            fz_closepath(dev->ctx, path);
+            break;
+        case Annot_Underline:
+            fz_moveto(dev->ctx, path, annot.rect.TL().x, annot.rect.BR().y - 0.25f);
+            fz_lineto(dev->ctx, path, annot.rect.BR().x, annot.rect.BR().y - 0.25f);
+            break;
+        case Annot_StrikeOut:
+            fz_moveto(dev->ctx, path, annot.rect.TL().x, annot.rect.TL().y + annot.rect.dy / 2);
+            fz_lineto(dev->ctx, path, annot.rect.BR().x, annot.rect.TL().y + annot.rect.dy / 2);
+            break;
+        case Annot_Squiggly:
+            fz_moveto(dev->ctx, path, annot.rect.TL().x + 1, annot.rect.BR().y);
+            fz_lineto(dev->ctx, path, annot.rect.BR().x, annot.rect.BR().y);
+            fz_moveto(dev->ctx, path, annot.rect.TL().x, annot.rect.BR().y - 0.5f);
+            fz_lineto(dev->ctx, path, annot.rect.BR().x, annot.rect.BR().y - 0.5f);
+            stroke = fz_new_stroke_state_with_dash_len(dev->ctx, 2);
+            CrashIf(!stroke);
+            stroke->linewidth = 0.5f;
+            stroke->dash_list[stroke->dash_len++] = 1;
+            stroke->dash_list[stroke->dash_len++] = 1;
+            break;
+        default:
+            CrashIf(true);
+        }
+        fz_colorspace *cs = fz_device_rgb(dev->ctx);
+        float color[3] = { annot.color.r / 255.f, annot.color.g / 255.f, annot.color.b / 255.f };
+        if (Annot_Highlight == annot.type) {
+            // render path with transparency effect
+            fz_begin_group(dev, &rect, 0, 0, FZ_BLEND_MULTIPLY, 1.f);
+            fz_fill_path(dev, path, 0, ctm, cs, color, annot.color.a / 255.f);
+            fz_end_group(dev);
+        }
+        else {
+            if (!stroke)
+                stroke = fz_new_stroke_state(dev->ctx);
+            fz_stroke_path(dev, path, stroke, ctm, cs, color, 1.0f);
+            fz_drop_stroke_state(dev->ctx, stroke);
+        }
+        fz_free_path(dev->ctx, path);
+    }
+}
+
+static void fz_run_page_transparency(Vec<PageAnnotation>& pageAnnots, fz_device *dev, const fz_rect *cliprect, bool endGroup, bool hasTransparency=false)
+{
+    if (hasTransparency || pageAnnots.Count() == 0)
+        return;
+    bool needsTransparency = false;
+    for (size_t i = 0; i < pageAnnots.Count(); i++) {
+        if (Annot_Highlight == pageAnnots.At(i).type) {
+            needsTransparency = true;
+            break;
+        }
+    }
+    if (!needsTransparency)
+        return;
+    if (!endGroup)
+        fz_begin_group(dev, cliprect ? cliprect : &fz_infinite_rect, 1, 0, 0, 1);
+    else
+        fz_end_group(dev);
+}
+
+static WCHAR *fz_store_stats_to_str(fz_context *ctx, size_t runBytes, size_t runCount)
+{
+    fz_store_stats stats;
+    fz_get_store_stats(ctx, &stats);
+    fz_glyph_cache_stats glyphs;
+    fz_get_glyph_cache_stats(ctx, &glyphs);
+    unsigned int lookups = glyphs.hits + glyphs.misses;
+    return str::Format(L"%.1f of %.1f MB used, %u hits, %u misses, %u evictions; display lists: %.1f MB for %d pages; "
+                       L"glyphs: %.1f of %.1f MB used (up to %u px), %u%% hits, %u evictions",
+                       stats.size / (1024.0 * 1024), stats.max / (1024.0 * 1024),
+                       stats.hits, stats.misses, stats.evictions,
+                       runBytes / (1024.0 * 1024), (int)runCount,
+                       glyphs.size / (1024.0 * 1024), glyphs.max / (1024.0 * 1024), glyphs.max_glyph_size,
+                       lookups > 0 ? (unsigned int)(glyphs.hits * 100ULL / lookups) : 100, glyphs.evictions);
+}
+
+// MuPDF's default glyph cache only holds glyphs up to 256 pixels in a 1 MB budget
+// which at high DPI and zoom levels means that most text is rasterized from its
+// outlines for every tile. Grow the limits with the rendering resolution instead
+// (they're never reduced, so that thumbnails don't evict the glyphs of the view).
+static void fz_scale_glyph_cache(fz_context *ctx, float zoom)
+{
+    int maxGlyphSize = limitValue((int)(MIN_CACHED_GLYPH_POINTS * fabs(zoom)), 256, MAX_CACHED_GLYPH_SIZE);
+    // the memory needed for the same text grows with the area of its glyphs
+    double scale = maxGlyphSize / 256.0;
+    size_t maxSize = std::min((size_t)(1024 * 1024 * scale * scale), std::max(gMaxGlyphCacheMemory, (size_t)1024 * 1024));
+
+    fz_glyph_cache_stats stats;
+    fz_get_glyph_cache_stats(ctx, &stats);
+    if ((unsigned int)maxGlyphSize <= stats.max_glyph_size && maxSize <= stats.max)
+        return;
+    fz_set_glyph_cache_limits(ctx, (int)std::max(maxSize, (size_t)stats.max), std::max(maxGlyphSize, (int)stats.max_glyph_size));
+}
+
+///// PDF-specific extensions to Fitz/MuPDF /////
+
+extern "C" {
+#include <mupdf/pdf.h>
+}
+
+namespace str {
+    namespace conv {
+
+inline WCHAR *FromPdf(pdf_obj *obj)
+{
+    ScopedMem<WCHAR> str(AllocArray<WCHAR>(pdf_to_str_len(obj) + 1));
+    pdf_to_ucs2_buf((unsigned short *)str.Get(), obj);
+    return str.StealData();
+}
+
+    }
+}
+
+// some PDF documents contain control characters in outline titles or /Info properties
+WCHAR *pdf_clean_string(WCHAR *string)
 {
     for (WCHAR *c = string; *c; c++) {
         if (*c < 0x20 && *c != '\n' && *c != '\r' && *c != '\t')
@@ -1142,28 +1969,328 @@ pdf_load_page_objs(pdf_document *doc, pdf_obj **page_objs)
     doc->page_objs = page_objs;
 }
 
+// jobs handed out by MuPDF (cf. fz_set_jpx_job_runner) are claimed one by one
+// by the calling thread and by helper tasks on the thread pool, so that the
+// calling thread never waits for a job which hasn't been started yet (which
+// could deadlock if the calling thread is itself a pool worker)
+struct FitzJobs {
+    fz_jpx_job_fn *job;
+    void *data;
+    LONG count;
+    volatile LONG next;
+    volatile LONG done;
+    // the calling thread and all helper tasks hold a reference
+    volatile LONG refs;
+    HANDLE finished;
+};
+
+static void fz_run_pending_jobs(FitzJobs *jobs)
+{
+    for (LONG ix = InterlockedIncrement(&jobs->next) - 1; ix < jobs->count; ix = InterlockedIncrement(&jobs->next) - 1) {
+        jobs->job((unsigned int)ix, jobs->data);
+        if (InterlockedIncrement(&jobs->done) == jobs->count)
+            SetEvent(jobs->finished);
+    }
+}
+
+static void fz_release_jobs(FitzJobs *jobs)
+{
+    if (0 == InterlockedDecrement(&jobs->refs)) {
+        CloseHandle(jobs->finished);
+        delete jobs;
+    }
+}
+
+static void fz_run_jobs_on_thread_pool(fz_jpx_job_fn *job, unsigned int count, void *data)
+{
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    int helpers = std::min((int)count, (int)si.dwNumberOfProcessors) - 1;
+    HANDLE finished = helpers > 0 ? CreateEvent(nullptr, TRUE, FALSE, nullptr) : nullptr;
+    if (!finished) {
+        for (unsigned int ix = 0; ix < count; ix++) {
+            job(ix, data);
+        }
+        return;
+    }
+
+    FitzJobs *jobs = new FitzJobs();
+    jobs->job = job;
+    jobs->data = data;
+    jobs->count = (LONG)count;
+    jobs->next = jobs->done = 0;
+    jobs->refs = helpers + 1;
+    jobs->finished = finished;
+    for (int i = 0; i < helpers; i++) {
+        RunAsync([jobs] {
+            fz_run_pending_jobs(jobs);
+            fz_release_jobs(jobs);
+        }, TaskPriority::Interactive);
+    }
+    fz_run_pending_jobs(jobs);
+    WaitForSingleObject(jobs->finished, INFINITE);
+    fz_release_jobs(jobs);
+}
+
+// the fonts, glyph cache and locks shared by the contexts of all engines
+// (so that fonts are only loaded once and the glyph cache doesn't grow with
+// the number of open documents), while each engine gets its own resource store
+struct FitzSharedState {
+    // one critical section per FZ_LOCK_* id
+    CRITICAL_SECTION fzAccess[FZ_LOCK_MAX];
+    fz_locks_context fzLocks;
+    // only used for cloning, never for document access
+    fz_context *ctx;
+};
+
+// intentionally never freed, as engines might still be destroyed
+// during static destruction (e.g. when a DLL is unloaded)
+static FitzSharedState *gFitzShared = nullptr;
+
+static fz_context *fz_new_engine_context(unsigned int max_store)
+{
+    FitzSharedState *shared = (FitzSharedState *)InterlockedCompareExchangePointer((void **)&gFitzShared, nullptr, nullptr);
+    if (!shared) {
+        shared = new FitzSharedState();
+        for (int i = 0; i < FZ_LOCK_MAX; i++) {
+            InitializeCriticalSection(&shared->fzAccess[i]);
+        }
+        shared->fzLocks.user = shared->fzAccess;
+        shared->fzLocks.lock = fz_lock_shared_cs;
+        shared->fzLocks.unlock = fz_unlock_shared_cs;
+        shared->ctx = fz_new_context(nullptr, &shared->fzLocks, MAX_CONTEXT_MEMORY);
+        if (shared->ctx) {
+            pdf_install_load_system_font_funcs(shared->ctx);
+            // processes such as the IFilter host load one document after another,
+            // so FreeType would otherwise be initialized again for each of them
+            fz_keep_freetype_library(shared->ctx);
+        }
+        // another thread might have been quicker
+        FitzSharedState *other = (FitzSharedState *)InterlockedCompareExchangePointer((void **)&gFitzShared, shared, nullptr);
+        if (other) {
+            fz_free_context(shared->ctx);
+            for (int i = 0; i < FZ_LOCK_MAX; i++) {
+                DeleteCriticalSection(&shared->fzAccess[i]);
+            }
+            delete shared;
+            shared = other;
+        }
+    }
+    if (!shared->ctx)
+        return nullptr;
+    return fz_clone_context_with_store(shared->ctx, max_store);
+}
+
+// bits of anti-aliasing used for a rendering profile
+// (fewer bits make complex vector graphics render noticeably faster)
+static int fz_aa_level_for_quality(RenderQuality quality)
+{
+    return Quality_FastScroll == quality ? 2 : 8;
+}
+
 ///// Above are extensions to Fitz and MuPDF, now follows PdfEngine /////
 
 struct PdfPageRun {
-    pdf_page *page;
+    int pageNo;
     fz_display_list *list;
     size_t size_est;
+    // the page's image rectangles (terminated with a null-rectangle, or nullptr)
+    fz_rect *imageRects;
+    // the page's text as collected by ExtractPageText, so that linkification,
+    // text extraction and selection don't each have to run the page through
+    // a text device (set at most once, protected by PdfSharedState::runAccess)
+    fz_text_sheet *textSheet;
+    fz_text_page *textPage;
     int refs;
 
-    PdfPageRun(pdf_page *page, fz_display_list *list, ListInspectionData& data) :
-        page(page), list(list), size_est(data.mem_estimate), refs(1) { }
+    PdfPageRun(int pageNo, fz_display_list *list, ListInspectionData& data, fz_rect *imageRects) :
+        pageNo(pageNo), list(list), size_est(data.mem_estimate), imageRects(imageRects),
+        textSheet(nullptr), textPage(nullptr), refs(1) { }
+};
+
+// caller must hold the ctxAccess of the engine owning ctx
+static void FreePageRun(fz_context *ctx, PdfPageRun *run)
+{
+    fz_drop_display_list(ctx, run->list);
+    fz_free_text_page(ctx, run->textPage);
+    fz_free_text_sheet(ctx, run->textSheet);
+    free(run->imageRects);
+    delete run;
+}
+
+static size_t fz_text_page_mem_estimate(fz_text_page *text)
+{
+    size_t size = sizeof(fz_text_page) + text->cap * sizeof(fz_page_block);
+    for (fz_page_block *block = text->blocks; block < text->blocks + text->len; block++) {
+        if (block->type != FZ_PAGE_BLOCK_TEXT)
+            continue;
+        size += sizeof(fz_text_block) + block->u.text->cap * sizeof(fz_text_line);
+        for (fz_text_line *line = block->u.text->lines; line < block->u.text->lines + block->u.text->len; line++) {
+            for (fz_text_span *span = line->first_span; span; span = span->next) {
+                size += sizeof(fz_text_span) + span->cap * sizeof(fz_text_char);
+            }
+        }
+    }
+    return size;
+}
+
+// number of rows and columns of a PdfElementGrid
+#define ELEMENT_GRID_SIZE 16
+
+// the bounding boxes of a page's links and comments, bucketed into a coarse
+// grid so that hit testing (on every mouse move) only has to check nearby ones
+class PdfElementGrid {
+public:
+    struct Entry {
+        fz_rect rect;
+        // exactly one of link and annot is set
+        fz_link *link;
+        pdf_annot *annot;
+    };
+
+    PdfElementGrid(pdf_page *page, pdf_annot **annots);
+    // returns the first link or (if there's none) comment containing pt
+    const Entry *Find(fz_point pt) const;
+
+protected:
+    // links (in top-to-bottom order) followed by comments
+    Vec<Entry> entries;
+    fz_rect bounds;
+    // cell i contains the entries cellIndices[cellStart[i]] to cellIndices[cellStart[i+1]-1]
+    int cellStart[ELEMENT_GRID_SIZE * ELEMENT_GRID_SIZE + 1];
+    ScopedMem<int> cellIndices;
+
+    int CellX(float x) const;
+    int CellY(float y) const;
+};
+
+PdfElementGrid::PdfElementGrid(pdf_page *page, pdf_annot **annots) : bounds(fz_empty_rect)
+{
+    for (fz_link *link = page->links; link; link = link->next) {
+        if (link->dest.kind != FZ_LINK_NONE) {
+            Entry el = { link->rect, link, nullptr };
+            entries.Append(el);
+        }
+    }
+    for (size_t i = 0; annots && annots[i]; i++) {
+        Entry el = { annots[i]->rect, nullptr, annots[i] };
+        fz_transform_rect(&el.rect, &page->ctm);
+        entries.Append(el);
+    }
+
+    // note: fz_union_rect would ignore degenerate rectangles, which
+    // fz_is_pt_in_rect might still match
+    bool isFirst = true;
+    for (Entry& el : entries) {
+        if (el.rect.x1 < el.rect.x0 || el.rect.y1 < el.rect.y0)
+            continue;
+        if (isFirst)
+            bounds = el.rect;
+        bounds.x0 = std::min(bounds.x0, el.rect.x0);
+        bounds.y0 = std::min(bounds.y0, el.rect.y0);
+        bounds.x1 = std::max(bounds.x1, el.rect.x1);
+        bounds.y1 = std::max(bounds.y1, el.rect.y1);
+        isFirst = false;
+    }
+
+    // count the entries per cell and then fill the cells in entry order
+    ZeroMemory(cellStart, sizeof(cellStart));
+    for (Entry& el : entries) {
+        for (int y = CellY(el.rect.y0); y <= CellY(el.rect.y1); y++) {
+            for (int x = CellX(el.rect.x0); x <= CellX(el.rect.x1); x++) {
+                cellStart[y * ELEMENT_GRID_SIZE + x + 1]++;
+            }
+        }
+    }
+    for (int i = 0; i < ELEMENT_GRID_SIZE * ELEMENT_GRID_SIZE; i++) {
+        cellStart[i + 1] += cellStart[i];
+    }
+    cellIndices.Set(AllocArray<int>(cellStart[ELEMENT_GRID_SIZE * ELEMENT_GRID_SIZE] + 1));
+    int cellFill[ELEMENT_GRID_SIZE * ELEMENT_GRID_SIZE];
+    memcpy(cellFill, cellStart, sizeof(cellFill));
+    for (size_t i = 0; i < entries.Count(); i++) {
+        fz_rect rect = entries.At(i).rect;
+        for (int y = CellY(rect.y0); y <= CellY(rect.y1); y++) {
+            for (int x = CellX(rect.x0); x <= CellX(rect.x1); x++) {
+                cellIndices[cellFill[y * ELEMENT_GRID_SIZE + x]++] = (int)i;
+            }
+        }
+    }
+}
+
+int PdfElementGrid::CellX(float x) const
+{
+    float dx = bounds.x1 - bounds.x0;
+    int cell = dx > 0 ? (int)((x - bounds.x0) * ELEMENT_GRID_SIZE / dx) : 0;
+    return limitValue(cell, 0, ELEMENT_GRID_SIZE - 1);
+}
+
+int PdfElementGrid::CellY(float y) const
+{
+    float dy = bounds.y1 - bounds.y0;
+    int cell = dy > 0 ? (int)((y - bounds.y0) * ELEMENT_GRID_SIZE / dy) : 0;
+    return limitValue(cell, 0, ELEMENT_GRID_SIZE - 1);
+}
+
+const PdfElementGrid::Entry *PdfElementGrid::Find(fz_point pt) const
+{
+    if (entries.Count() == 0 || !fz_is_pt_in_rect(bounds, pt))
+        return nullptr;
+
+    int cell = CellY(pt.y) * ELEMENT_GRID_SIZE + CellX(pt.x);
+    for (int i = cellStart[cell]; i < cellStart[cell + 1]; i++) {
+        const Entry& el = entries.At(cellIndices[i]);
+        if (fz_is_pt_in_rect(el.rect, pt))
+            return &el;
+    }
+    return nullptr;
+}
+
+// state shared by a PdfEngineImpl and all of its clones: the clones' contexts
+// are created with fz_clone_context so that they use the same resource store,
+// which allows them to reuse each other's display lists
+struct PdfSharedState {
+    LONG refs;
+    // make sure to never ask for ctxAccess or pagesAccess in a
+    // runAccess protected critical section in order to avoid deadlocks
+    CRITICAL_SECTION runAccess;
+    Vec<PdfPageRun *> runCache; // ordered most recently used first
+    // the font list is expensive to extract (cf. ExtractFontList)
+    // and thus only computed once per document
+    ScopedMem<WCHAR> fontList;
+    bool fontListExtracted;
+
+    PdfSharedState() : refs(1), fontListExtracted(false) {
+        InitializeCriticalSection(&runAccess);
+    }
+    ~PdfSharedState() {
+        assert(0 == runCache.Count());
+        DeleteCriticalSection(&runAccess);
+    }
+};
+
+struct PdfPageDigest {
+    bool valid;
+    unsigned char digest[16];
+};
+
+struct PdfStreamDigest {
+    int num;
+    unsigned char digest[16];
 };
 
 class PdfTocItem;
 class PdfLink;
 class PdfImage;
+class PdfRenderBand;
 
 class PdfEngineImpl : public BaseEngine {
     friend PdfLink;
     friend PdfImage;
+    friend PdfRenderBand;
 
 public:
-    PdfEngineImpl();
+    explicit PdfEngineImpl(PdfEngineImpl *original=nullptr);
     virtual ~PdfEngineImpl();
     BaseEngine *Clone() override;
 
@@ -1175,24 +2302,34 @@ public:
     }
 
     RectD PageMediabox(int pageNo) override;
+    RectD QuickPageMediabox(int pageNo) override;
+    bool IsLoadingProgressively() override;
     RectD PageContentBox(int pageNo, RenderTarget target=Target_View) override;
 
     RenderedBitmap *RenderBitmap(int pageNo, float zoom, int rotation,
                          RectD *pageRect=nullptr, /* if nullptr: defaults to the page's mediabox */
                          RenderTarget target=Target_View, AbortCookie **cookie_out=nullptr) override;
+    bool RenderPage(HDC hDC, RectI screenRect, int pageNo, float zoom, int rotation=0,
+                    RectD *pageRect=nullptr, RenderTarget target=Target_View, AbortCookie **cookie_out=nullptr) override;
+    void SetRenderQuality(RenderQuality quality) override { renderQuality = quality; }
 
     PointD Transform(PointD pt, int pageNo, float zoom, int rotation, bool inverse=false) override;
     RectD Transform(RectD rect, int pageNo, float zoom, int rotation, bool inverse=false) override;
 
     unsigned char *GetFileData(size_t *cbCount) override;
     bool SaveFileAs(const WCHAR *copyFileName, bool includeUserAnnots=false) override;
+    bool GetPageFingerprint(int pageNo, unsigned char digest[16]) override;
+    RenderedBitmap *GetEmbeddedThumbnail(int pageNo, int size) override;
     virtual bool SaveFileAsPdf(const WCHAR *pdfFileName, bool includeUserAnnots=false) {
         return SaveFileAs(pdfFileName, includeUserAnnots);
     }
     WCHAR * ExtractPageText(int pageNo, const WCHAR *lineSep, RectI **coordsOut=nullptr,
                                     RenderTarget target=Target_View) override;
+    WCHAR * ExtractPageTextLimited(int pageNo, const WCHAR *lineSep, RectI **coordsOut,
+                                   DWORD timeoutMs, bool *partialOut, AbortCookie **cookie_out=nullptr) override;
     bool HasClipOptimizations(int pageNo) override;
     PageLayoutType PreferredLayout() override;
+    void ReleaseCaches(bool inBackground) override;
     WCHAR *GetProperty(DocumentProperty prop) override;
 
     bool SupportsAnnotation(bool forSaving=false) const override;
@@ -1226,19 +2363,24 @@ public:
     bool IsPasswordProtected() const override { return isProtected; }
     char *GetDecryptionKey() const override;
 
-    static BaseEngine *CreateFromFile(const WCHAR *fileName, PasswordUI *pwdUI);
-    static BaseEngine *CreateFromStream(IStream *stream, PasswordUI *pwdUI);
+    static BaseEngine *CreateFromFile(const WCHAR *fileName, PasswordUI *pwdUI, bool previewOnly=false);
+    static BaseEngine *CreateFromStream(IStream *stream, PasswordUI *pwdUI, bool previewOnly=false);
 
 protected:
     WCHAR *_fileName;
     char *_decryptionKey;
     bool isProtected;
+    // whether the whole file has been read into memory, so that
+    // it can't have changed underneath us (cf. GetPageFingerprint)
+    bool fileInMemory;
+    // profile for Target_View renderings (cf. SetRenderQuality)
+    RenderQuality renderQuality;
 
     // make sure to never ask for pagesAccess in an ctxAccess
     // protected critical section in order to avoid deadlocks
     CRITICAL_SECTION ctxAccess;
     fz_context *    ctx;
-    fz_locks_context fz_locks_ctx;
+    PdfSharedState *shared;
     pdf_document *  _doc;
 
     CRITICAL_SECTION pagesAccess;
@@ -1252,6 +2394,7 @@ protected:
     bool            FinishLoading();
 
     pdf_page      * GetPdfPage(int pageNo, bool failIfBusy=false);
+    pdf_obj       * GetPageObj(int pageNo);
     int             GetPageNo(pdf_page *page);
     fz_matrix       viewctm(int pageNo, float zoom, int rotation) {
         const fz_rect tmpRc = fz_RectD_to_rect(PageMediabox(pageNo));
@@ -1262,34 +2405,72 @@ protected:
         return fz_create_view_ctm(pdf_bound_page(_doc, page, &r), zoom, rotation);
     }
     WCHAR         * ExtractPageText(pdf_page *page, const WCHAR *lineSep, RectI **coordsOut=nullptr,
-                                    RenderTarget target=Target_View, bool cacheRun=false);
+                                    RenderTarget target=Target_View, bool cacheRun=false,
+                                    FitzAbortCookie *cookie=nullptr);
+    WCHAR         * ExtractPageText(int pageNo, const WCHAR *lineSep, RectI **coordsOut,
+                                    RenderTarget target, FitzAbortCookie *cookie);
 
-    Vec<PdfPageRun *> runCache; // ordered most recently used first
     PdfPageRun    * CreatePageRun(pdf_page *page, fz_display_list *list);
     PdfPageRun    * GetPageRun(pdf_page *page, bool tryOnly=false);
     bool            RunPage(pdf_page *page, fz_device *dev, const fz_matrix *ctm,
                             RenderTarget target=Target_View,
                             const fz_rect *cliprect=nullptr, bool cacheRun=true,
                             FitzAbortCookie *cookie=nullptr);
+    bool            RunPageRun(pdf_page *page, PdfPageRun *run, fz_device *dev, const fz_matrix *ctm,
+                               const fz_rect *cliprect, FitzAbortCookie *cookie);
     void            DropPageRun(PdfPageRun *run, bool forceRemove=false);
-
-    PdfTocItem    * BuildTocTree(fz_outline *entry, int& idCounter);
+    RenderedBitmap *RenderPageRun(pdf_page *page, PdfPageRun *run, const fz_matrix *ctm,
+                                  const fz_irect *bbox, RenderQuality quality, FitzAbortCookie *cookie);
+    bool            RenderPageRunBands(pdf_page *page, PdfPageRun *run, const fz_matrix *ctm, fz_pixmap *image,
+                                       int bandCount, RenderQuality quality, FitzAbortCookie *cookie);
+    bool            RenderPageRunBand(pdf_page *page, PdfPageRun *run, const fz_matrix *ctm, fz_pixmap *image,
+                                      const fz_irect *band, RenderQuality quality, FitzAbortCookie *cookie);
+
+    PdfTocItem    * BuildTocTree(fz_outline *entry, int& idCounter, PoolAllocator *allocator);
+    bool            ProcessPageElements(int pageNo, pdf_page *page, bool failIfBusy=false);
     void            LinkifyPageText(pdf_page *page);
     pdf_annot    ** ProcessPageAnnotations(pdf_page *page);
+    fz_image      * FindPageImage(int pageNo, RectD rect, size_t imageIx);
     RenderedBitmap *GetPageImage(int pageNo, RectD rect, size_t imageIx);
+    unsigned char * GetPageImageData(int pageNo, RectD rect, size_t imageIx, size_t *cbCount);
     WCHAR         * ExtractFontList();
     bool            IsLinearizedFile();
 
     bool            SaveEmbedded(LinkSaverUI& saveUI, int num, int gen);
     bool            SaveUserAnnots(const WCHAR *fileName);
+    bool            SaveUserAnnotsInPlace();
+
+    bool            UpdateFingerprint(fz_md5 *md5, pdf_obj *obj, int depth);
+    bool            GetStreamDigest(int num, int gen, unsigned char digest[16]);
+
+    bool            LoadCachedPageData();
+    void            SaveCachedPageData();
 
     RectD         * _mediaboxes;
+    // content boxes for Target_View (cf. PageContentBox)
+    RectD         * _contentBoxes;
     fz_outline    * outline;
     fz_outline    * attachments;
     pdf_obj       * _info;
     WStrVec       * _pagelabels;
     pdf_annot   *** pageAnnots;
     fz_rect      ** imageRects;
+    // set once links and annotations have been extracted for a page (cf. ProcessPageElements)
+    PdfElementGrid ** pageElements;
+    // digests of the pages' content (cf. GetPageFingerprint)
+    PdfPageDigest * pageDigests;
+    // digests of all streams hashed so far, sorted by object number
+    Vec<PdfStreamDigest> streamDigests;
+    // skip loading everything that's not needed for rendering pages and
+    // extracting text and properties (outline, attachments, page labels)
+    bool            previewOnly;
+    bool            isClone;
+    // where to cache the page geometry and labels (nullptr if they aren't)
+    WCHAR         * pageDataCachePath;
+    int64           pageDataFileSize;
+    FILETIME        pageDataModified;
+    // set when page data has been determined which isn't cached yet
+    bool            pageDataChanged;
 
     Vec<PageAnnotation> userAnnots;
 };
@@ -1369,24 +2550,36 @@ public:
     virtual RenderedBitmap *GetImage() {
         return engine->GetPageImage(pageNo, rect, imageIx);
     }
+    virtual unsigned char *GetImageData(size_t *cbCount) {
+        return engine->GetPageImageData(pageNo, rect, imageIx, cbCount);
+    }
 };
 
-PdfEngineImpl::PdfEngineImpl() : _fileName(nullptr), _doc(nullptr),
-    _pages(nullptr), _pageObjs(nullptr), _mediaboxes(nullptr), _info(nullptr),
+// the caller must hold original's ctxAccess
+PdfEngineImpl::PdfEngineImpl(PdfEngineImpl *original) : _fileName(nullptr), _doc(nullptr),
+    _pages(nullptr), _pageObjs(nullptr), _mediaboxes(nullptr), _contentBoxes(nullptr), _info(nullptr),
     outline(nullptr), attachments(nullptr), _pagelabels(nullptr),
-    _decryptionKey(nullptr), isProtected(false),
-    pageAnnots(nullptr), imageRects(nullptr)
+    _decryptionKey(nullptr), isProtected(false), fileInMemory(false),
+    pageAnnots(nullptr), imageRects(nullptr), pageElements(nullptr),
+    pageDigests(nullptr), previewOnly(false), isClone(original != nullptr),
+    pageDataCachePath(nullptr), pageDataFileSize(0), pageDataChanged(false),
+    renderQuality(Quality_Balanced)
 {
+    pageDataModified.dwLowDateTime = pageDataModified.dwHighDateTime = 0;
     InitializeCriticalSection(&pagesAccess);
     InitializeCriticalSection(&ctxAccess);
 
-    fz_locks_ctx.user = &ctxAccess;
-    fz_locks_ctx.lock = fz_lock_context_cs;
-    fz_locks_ctx.unlock = fz_unlock_context_cs;
-    ctx = fz_new_context(nullptr, &fz_locks_ctx, MAX_CONTEXT_MEMORY);
-
-    if (ctx)
-        pdf_install_load_system_font_funcs(ctx);
+    if (original) {
+        previewOnly = original->previewOnly;
+        // share resources and display lists with the original
+        shared = original->shared;
+        InterlockedIncrement(&shared->refs);
+        ctx = fz_clone_context(original->ctx);
+    }
+    else {
+        shared = new PdfSharedState();
+        ctx = fz_new_engine_context(MAX_CONTEXT_MEMORY);
+    }
 }
 
 PdfEngineImpl::~PdfEngineImpl()
@@ -1394,6 +2587,9 @@ PdfEngineImpl::~PdfEngineImpl()
     EnterCriticalSection(&pagesAccess);
     EnterCriticalSection(&ctxAccess);
 
+    if (pageDataCachePath && pageDataChanged)
+        SaveCachedPageData();
+
     if (_pages) {
         for (int i = 0; i < PageCount(); i++) {
             pdf_free_page(_doc, _pages[i]);
@@ -1423,19 +2619,36 @@ PdfEngineImpl::~PdfEngineImpl()
         }
         free(imageRects);
     }
+    if (pageElements) {
+        for (int i = 0; i < PageCount(); i++) {
+            delete pageElements[i];
+        }
+        free(pageElements);
+    }
 
-    while (runCache.Count() > 0) {
-        assert(runCache.Last()->refs == 1);
-        DropPageRun(runCache.Last(), true);
+    // the display lists are dropped along with the last engine sharing them
+    bool isLastRef = 0 == InterlockedDecrement(&shared->refs);
+    if (isLastRef) {
+        ScopedCritSec scope(&shared->runAccess);
+        for (PdfPageRun *run : shared->runCache) {
+            assert(run->refs == 1);
+            FreePageRun(ctx, run);
+        }
+        shared->runCache.Reset();
     }
 
     pdf_close_document(_doc);
     _doc = nullptr;
     fz_free_context(ctx);
     ctx = nullptr;
+    if (isLastRef)
+        delete shared;
 
     free(_mediaboxes);
+    free(_contentBoxes);
+    free(pageDigests);
     delete _pagelabels;
+    free(pageDataCachePath);
     free(_fileName);
     free(_decryptionKey);
 
@@ -1469,13 +2682,17 @@ BaseEngine *PdfEngineImpl::Clone()
     if (pdf_crypt_key(_doc))
         pwdUI = new PasswordCloner(pdf_crypt_key(_doc));
 
-    PdfEngineImpl *clone = new PdfEngineImpl();
-    if (!clone || !(_fileName ? clone->Load(_fileName, pwdUI) : clone->Load(_doc->file, pwdUI))) {
+    // progressively read files are shared instead of being read all over again
+    bool progressive = _doc->file->meta == meta_progressive;
+    PdfEngineImpl *clone = new PdfEngineImpl(this);
+    if (!clone || !(_fileName && !progressive ? clone->Load(_fileName, pwdUI) : clone->Load(_doc->file, pwdUI))) {
         delete clone;
         delete pwdUI;
         return nullptr;
     }
     delete pwdUI;
+    if (_fileName && progressive)
+        clone->_fileName = str::Dup(_fileName);
 
     if (!_decryptionKey && _doc->crypt) {
         delete clone->_decryptionKey;
@@ -1520,7 +2737,7 @@ bool PdfEngineImpl::Load(const WCHAR *fileName, PasswordUI *pwdUI)
     if (embedMarks)
         *embedMarks = '\0';
     fz_try(ctx) {
-        file = fz_open_file2(ctx, _fileName);
+        file = fz_open_file2(ctx, _fileName, &fileInMemory);
     }
     fz_catch(ctx) {
         file = nullptr;
@@ -1556,6 +2773,7 @@ OpenEmbeddedFile:
 
     pdf_close_document(_doc);
     _doc = nullptr;
+    fileInMemory = true;
 
     goto OpenEmbeddedFile;
 }
@@ -1600,15 +2818,23 @@ bool PdfEngineImpl::LoadFromStream(fz_stream *stm, PasswordUI *pwdUI)
     if (!stm)
         return false;
 
-    fz_try(ctx) {
-        _doc = pdf_open_document_with_stream(ctx, stm);
-    }
-    fz_always(ctx) {
-        fz_close(stm);
-    }
-    fz_catch(ctx) {
+    // progressively read documents can only be opened once
+    // the data for their first page has arrived
+    bool tryLater;
+    do {
+        tryLater = false;
+        fz_try(ctx) {
+            _doc = pdf_open_document_with_stream(ctx, stm);
+        }
+        fz_catch(ctx) {
+            tryLater = fz_caught(ctx) == FZ_ERROR_TRYLATER && is_stream_incomplete(stm);
+        }
+        if (tryLater)
+            Sleep(PROGRESSIVE_RETRY_DELAY);
+    } while (tryLater);
+    fz_close(stm);
+    if (!_doc)
         return false;
-    }
 
     isProtected = pdf_needs_password(_doc);
     if (!isProtected)
@@ -1677,22 +2903,43 @@ bool PdfEngineImpl::FinishLoading()
     _pages = AllocArray<pdf_page *>(PageCount());
     _pageObjs = AllocArray<pdf_obj *>(PageCount());
     _mediaboxes = AllocArray<RectD>(PageCount());
+    _contentBoxes = AllocArray<RectD>(PageCount());
     pageAnnots = AllocArray<pdf_annot **>(PageCount());
     imageRects = AllocArray<fz_rect *>(PageCount());
+    pageElements = AllocArray<PdfElementGrid *>(PageCount());
+    pageDigests = AllocArray<PdfPageDigest>(PageCount());
 
-    if (!_pages || !_pageObjs || !_mediaboxes || !pageAnnots || !imageRects)
+    if (!_pages || !_pageObjs || !_mediaboxes || !_contentBoxes || !pageAnnots || !imageRects || !pageElements || !pageDigests)
         return false;
 
+    // with cached mediaboxes, large documents can be laid out without walking
+    // the page tree at all (clones look the pages up as needed anyway)
+    if (PageCount() >= PDF_CACHE_MIN_PAGES && gGetPageDataCachePath && _fileName && !fileInMemory &&
+        !isClone && !previewOnly && !_doc->file_reading_linearly) {
+        pageDataCachePath = gGetPageDataCachePath(_fileName);
+        pageDataFileSize = file::GetSize(_fileName);
+        pageDataModified = file::GetModificationTime(_fileName);
+        if (pageDataCachePath && !LoadCachedPageData())
+            pageDataChanged = true;
+    }
+
     ScopedCritSec scope(&ctxAccess);
 
-    fz_try(ctx) {
-        pdf_load_page_objs(_doc, _pageObjs);
-    }
-    fz_catch(ctx) {
-        fz_warn(ctx, "Couldn't load all page objects");
+    // for large documents, walking the whole page tree noticeably delays
+    // the display of the first page (cf. GetPageObj)
+    // (for progressively read documents, only the pages that have
+    // already arrived can be looked up at all)
+    if (PageCount() < LAZY_PAGE_TREE_MIN_PAGES && !_doc->file_reading_linearly && !previewOnly) {
+        fz_try(ctx) {
+            pdf_load_page_objs(_doc, _pageObjs);
+        }
+        fz_catch(ctx) {
+            fz_warn(ctx, "Couldn't load all page objects");
+        }
     }
     fz_try(ctx) {
-        outline = pdf_load_outline(_doc);
+        if (!previewOnly)
+            outline = pdf_load_outline(_doc);
     }
     fz_catch(ctx) {
         // ignore errors from pdf_load_outline()
@@ -1702,7 +2949,8 @@ bool PdfEngineImpl::FinishLoading()
         fz_warn(ctx, "Couldn't load outline");
     }
     fz_try(ctx) {
-        attachments = pdf_loadattachments(_doc);
+        if (!previewOnly)
+            attachments = pdf_loadattachments(_doc);
     }
     fz_catch(ctx) {
         fz_warn(ctx, "Couldn't load attachments");
@@ -1744,8 +2992,10 @@ bool PdfEngineImpl::FinishLoading()
     }
     fz_try(ctx) {
         pdf_obj *pagelabels = pdf_dict_getp(pdf_trailer(_doc), "Root/PageLabels");
-        if (pagelabels)
+        if (pagelabels && !previewOnly && !_pagelabels) {
             _pagelabels = BuildPageLabelVec(pagelabels, PageCount());
+            pageDataChanged = true;
+        }
     }
     fz_catch(ctx) {
         fz_warn(ctx, "Couldn't load page labels");
@@ -1756,20 +3006,20 @@ bool PdfEngineImpl::FinishLoading()
     return true;
 }
 
-PdfTocItem *PdfEngineImpl::BuildTocTree(fz_outline *entry, int& idCounter)
+PdfTocItem *PdfEngineImpl::BuildTocTree(fz_outline *entry, int& idCounter, PoolAllocator *allocator)
 {
     PdfTocItem *node = nullptr;
 
     for (; entry; entry = entry->next) {
         WCHAR *name = entry->title ? pdf_clean_string(str::conv::FromUtf8(entry->title)) : str::Dup(L"");
-        PdfTocItem *item = new PdfTocItem(name, PdfLink(this, &entry->dest));
+        PdfTocItem *item = new (allocator) PdfTocItem(name, PdfLink(this, &entry->dest));
         item->open = entry->is_open;
         item->id = ++idCounter;
 
         if (entry->dest.kind == FZ_LINK_GOTO)
             item->pageNo = entry->dest.ld.gotor.page + 1;
         if (entry->down)
-            item->child = BuildTocTree(entry->down, idCounter);
+            item->child = BuildTocTree(entry->down, idCounter, allocator);
 
         if (!node)
             node = item;
@@ -1784,14 +3034,20 @@ DocTocItem *PdfEngineImpl::GetTocTree()
 {
     PdfTocItem *node = nullptr;
     int idCounter = 0;
+    PoolAllocator *allocator = new PoolAllocator();
 
     if (outline) {
-        node = BuildTocTree(outline, idCounter);
+        node = BuildTocTree(outline, idCounter, allocator);
         if (attachments)
-            node->AddSibling(BuildTocTree(attachments, idCounter));
+            node->AddSibling(BuildTocTree(attachments, idCounter, allocator));
     } else if (attachments)
-        node = BuildTocTree(attachments, idCounter);
+        node = BuildTocTree(attachments, idCounter, allocator);
 
+    if (!node) {
+        delete allocator;
+        return nullptr;
+    }
+    node->OwnAllocator();
     return node;
 }
 
@@ -1845,10 +3101,8 @@ pdf_page *PdfEngineImpl::GetPdfPage(int pageNo, bool failIfBusy)
         ScopedCritSec ctxScope(&ctxAccess);
         fz_var(page);
         fz_try(ctx) {
-            page = pdf_load_page_by_obj(_doc, pageNo - 1, _pageObjs[pageNo-1]);
+            page = pdf_load_page_by_obj(_doc, pageNo - 1, GetPageObj(pageNo));
             _pages[pageNo-1] = page;
-            LinkifyPageText(page);
-            pageAnnots[pageNo-1] = ProcessPageAnnotations(page);
         }
         fz_catch(ctx) { }
     }
@@ -1856,6 +3110,27 @@ pdf_page *PdfEngineImpl::GetPdfPage(int pageNo, bool failIfBusy)
     return page;
 }
 
+// returns the /Page object for pageNo, looking it up in the page tree
+// if it hasn't been loaded yet (cf. FinishLoading)
+pdf_obj *PdfEngineImpl::GetPageObj(int pageNo)
+{
+    ScopedCritSec scope(&ctxAccess);
+
+    if (!_pageObjs[pageNo-1]) {
+        fz_try(ctx) {
+            // pages that haven't arrived yet are looked up again on the next call
+            if (_doc->file_reading_linearly)
+                _pageObjs[pageNo-1] = pdf_keep_obj(pdf_progressive_advance(_doc, pageNo - 1));
+            else
+                _pageObjs[pageNo-1] = pdf_keep_obj(pdf_lookup_page_obj(_doc, pageNo - 1));
+        }
+        fz_catch(ctx) {
+            fz_warn(ctx, "Couldn't load page object for page %d", pageNo);
+        }
+    }
+    return _pageObjs[pageNo-1];
+}
+
 int PdfEngineImpl::GetPageNo(pdf_page *page)
 {
     for (int i = 0; i < PageCount(); i++)
@@ -1879,78 +3154,122 @@ PdfPageRun *PdfEngineImpl::CreatePageRun(pdf_page *page, fz_display_list *list)
     fz_free_device(dev);
 
     // save the image rectangles for this page
+    // (the list of page image rectangles is terminated with a null-rectangle)
     int pageNo = GetPageNo(page);
-    if (!imageRects[pageNo-1] && positions.Count() > 0) {
-        // the list of page image rectangles is terminated with a null-rectangle
-        fz_rect *rects = AllocArray<fz_rect>(positions.Count() + 1);
+    fz_rect *rects = nullptr;
+    if (positions.Count() > 0) {
+        rects = AllocArray<fz_rect>(positions.Count() + 1);
         if (rects) {
             for (size_t i = 0; i < positions.Count(); i++) {
                 rects[i] = positions.At(i).rect;
             }
-            imageRects[pageNo-1] = rects;
         }
     }
+    if (!imageRects[pageNo-1] && rects)
+        imageRects[pageNo-1] = (fz_rect *)memdup(rects, (positions.Count() + 1) * sizeof(fz_rect));
 
-    return new PdfPageRun(page, list, data);
+    return new PdfPageRun(pageNo, list, data, rects);
+}
+
+// returns a page run from the cache shared by all clones (if any)
+static PdfPageRun *FindSharedPageRun(PdfSharedState *shared, int pageNo)
+{
+    ScopedCritSec scope(&shared->runAccess);
+    for (size_t i = 0; i < shared->runCache.Count(); i++) {
+        PdfPageRun *run = shared->runCache.At(i);
+        if (run->pageNo == pageNo) {
+            // keep the list Most Recently Used first
+            if (i > 0) {
+                shared->runCache.RemoveAt(i);
+                shared->runCache.InsertAt(0, run);
+            }
+            run->refs++;
+            return run;
+        }
+    }
+    return nullptr;
 }
 
 PdfPageRun *PdfEngineImpl::GetPageRun(pdf_page *page, bool tryOnly)
 {
-    PdfPageRun *result = nullptr;
+    ScopedCritSec scope(&pagesAccess);
+
+    int pageNo = GetPageNo(page);
+    PdfPageRun *result = FindSharedPageRun(shared, pageNo);
+    if (result) {
+        // the list might have been created by a clone
+        if (!imageRects[pageNo-1] && result->imageRects) {
+            size_t count = 0;
+            while (!fz_is_empty_rect(&result->imageRects[count]))
+                count++;
+            imageRects[pageNo-1] = (fz_rect *)memdup(result->imageRects, (count + 1) * sizeof(fz_rect));
+        }
+        return result;
+    }
+    if (tryOnly)
+        return nullptr;
 
-    ScopedCritSec scope(&pagesAccess);
+    // the display list is created without blocking the other clones' access to the cache
+    EnterCriticalSection(&ctxAccess);
+    fz_display_list *list = nullptr;
+    fz_device *dev = nullptr;
+    fz_var(list);
+    fz_var(dev);
+    ScopedMemTraceTag memTag(MemTag_DisplayLists);
+    fz_try(ctx) {
+        list = fz_new_display_list(ctx);
+        dev = fz_new_list_device(ctx, list);
+        pdf_run_page(_doc, page, dev, &fz_identity, nullptr);
+    }
+    fz_catch(ctx) {
+        fz_drop_display_list(ctx, list);
+        list = nullptr;
+    }
+    fz_free_device(dev);
+    if (list)
+        result = CreatePageRun(page, list);
+    LeaveCriticalSection(&ctxAccess);
+    if (!result)
+        return nullptr;
 
-    for (size_t i = 0; i < runCache.Count(); i++) {
-        if (runCache.At(i)->page == page) {
-            result = runCache.At(i);
-            break;
-        }
+    Vec<PdfPageRun *> dropped;
+    EnterCriticalSection(&shared->runAccess);
+    // a clone might have created a display list for the same page in the meantime
+    PdfPageRun *other = FindSharedPageRun(shared, pageNo);
+    if (other) {
+        dropped.Append(result);
+        result = other;
     }
-    if (!result && !tryOnly) {
+    else {
         size_t mem = 0;
-        for (size_t i = 0; i < runCache.Count(); i++) {
+        for (size_t i = 0; i < shared->runCache.Count(); i++) {
             // drop page runs that take up too much memory due to huge images
             // (except for the very recently used ones)
-            if (i >= 2 && mem + runCache.At(i)->size_est >= MAX_PAGE_RUN_MEMORY)
-                DropPageRun(runCache.At(i--), true);
+            PdfPageRun *run = shared->runCache.At(i);
+            if (i >= 2 && mem + run->size_est >= gMaxPageRunMemory) {
+                shared->runCache.RemoveAt(i--);
+                if (0 == --run->refs)
+                    dropped.Append(run);
+            }
             else
-                mem += runCache.At(i)->size_est;
-        }
-        if (runCache.Count() >= MAX_PAGE_RUN_CACHE) {
-            assert(runCache.Count() == MAX_PAGE_RUN_CACHE);
-            DropPageRun(runCache.Last(), true);
-        }
-
-        ScopedCritSec scope2(&ctxAccess);
-
-        fz_display_list *list = nullptr;
-        fz_device *dev = nullptr;
-        fz_var(list);
-        fz_var(dev);
-        fz_try(ctx) {
-            list = fz_new_display_list(ctx);
-            dev = fz_new_list_device(ctx, list);
-            pdf_run_page(_doc, page, dev, &fz_identity, nullptr);
-        }
-        fz_catch(ctx) {
-            fz_drop_display_list(ctx, list);
-            list = nullptr;
+                mem += run->size_est;
         }
-        fz_free_device(dev);
-
-        if (list) {
-            result = CreatePageRun(page, list);
-            runCache.InsertAt(0, result);
+        if (shared->runCache.Count() >= MAX_PAGE_RUN_CACHE) {
+            PdfPageRun *run = shared->runCache.Pop();
+            if (0 == --run->refs)
+                dropped.Append(run);
         }
+        // one reference for the cache and one for the caller
+        shared->runCache.InsertAt(0, result);
+        result->refs++;
     }
-    else if (result && result != runCache.At(0)) {
-        // keep the list Most Recently Used first
-        runCache.Remove(result);
-        runCache.InsertAt(0, result);
+    LeaveCriticalSection(&shared->runAccess);
+
+    for (PdfPageRun *run : dropped) {
+        ScopedCritSec ctxScope(&ctxAccess);
+        FreePageRun(ctx, run);
     }
 
-    if (result)
-        result->refs++;
     return result;
 }
 
@@ -1960,21 +3279,7 @@ bool PdfEngineImpl::RunPage(pdf_page *page, fz_device *dev, const fz_matrix *ctm
 
     PdfPageRun *run;
     if (Target_View == target && (run = GetPageRun(page, !cacheRun)) != nullptr) {
-        EnterCriticalSection(&ctxAccess);
-        Vec<PageAnnotation> pageAnnots = fz_get_user_page_annots(userAnnots, GetPageNo(page));
-        fz_try(ctx) {
-            fz_rect pagerect;
-            fz_begin_page(dev, pdf_bound_page(_doc, page, &pagerect), ctm);
-            fz_run_page_transparency(pageAnnots, dev, cliprect, false, page->transparency);
-            fz_run_display_list(run->list, dev, ctm, cliprect, cookie ? &cookie->cookie : nullptr);
-            fz_run_page_transparency(pageAnnots, dev, cliprect, true, page->transparency);
-            fz_run_user_page_annots(pageAnnots, dev, ctm, cliprect, cookie ? &cookie->cookie : nullptr);
-            fz_end_page(dev);
-        }
-        fz_catch(ctx) {
-            ok = false;
-        }
-        LeaveCriticalSection(&ctxAccess);
+        ok = RunPageRun(page, run, dev, ctm, cliprect, cookie);
         DropPageRun(run);
     }
     else {
@@ -2003,18 +3308,48 @@ bool PdfEngineImpl::RunPage(pdf_page *page, fz_device *dev, const fz_matrix *ctm
     return ok && !(cookie && cookie->cookie.abort);
 }
 
+// runs a cached display list (and the user annotations) on dev. For devices
+// created with a context other than ctx, ctxAccess is only held briefly, since
+// display lists don't access the document (and thus can be run in parallel)
+bool PdfEngineImpl::RunPageRun(pdf_page *page, PdfPageRun *run, fz_device *dev, const fz_matrix *ctm, const fz_rect *cliprect, FitzAbortCookie *cookie)
+{
+    bool ok = true;
+    fz_context *runCtx = dev->ctx;
+
+    EnterCriticalSection(&ctxAccess);
+    Vec<PageAnnotation> pageAnnots = fz_get_user_page_annots(userAnnots, GetPageNo(page));
+    if (runCtx != ctx)
+        LeaveCriticalSection(&ctxAccess);
+    fz_try(runCtx) {
+        fz_rect pagerect;
+        fz_begin_page(dev, pdf_bound_page(_doc, page, &pagerect), ctm);
+        fz_run_page_transparency(pageAnnots, dev, cliprect, false, page->transparency);
+        fz_run_display_list(run->list, dev, ctm, cliprect, cookie ? &cookie->cookie : nullptr);
+        fz_run_page_transparency(pageAnnots, dev, cliprect, true, page->transparency);
+        fz_run_user_page_annots(pageAnnots, dev, ctm, cliprect, cookie ? &cookie->cookie : nullptr);
+        fz_end_page(dev);
+    }
+    fz_catch(runCtx) {
+        ok = false;
+    }
+    if (runCtx == ctx)
+        LeaveCriticalSection(&ctxAccess);
+
+    return ok;
+}
+
 void PdfEngineImpl::DropPageRun(PdfPageRun *run, bool forceRemove)
 {
-    ScopedCritSec scope(&pagesAccess);
+    EnterCriticalSection(&shared->runAccess);
     run->refs--;
-
     if (0 == run->refs || forceRemove)
-        runCache.Remove(run);
+        shared->runCache.Remove(run);
+    bool isUnused = 0 == run->refs;
+    LeaveCriticalSection(&shared->runAccess);
 
-    if (0 == run->refs) {
+    if (isUnused) {
         ScopedCritSec ctxScope(&ctxAccess);
-        fz_drop_display_list(ctx, run->list);
-        delete run;
+        FreePageRun(ctx, run);
     }
 }
 
@@ -2024,12 +3359,12 @@ RectD PdfEngineImpl::PageMediabox(int pageNo)
     if (!_mediaboxes[pageNo-1].IsEmpty())
         return _mediaboxes[pageNo-1];
 
-    pdf_obj *page = _pageObjs[pageNo - 1];
+    ScopedCritSec scope(&ctxAccess);
+
+    pdf_obj *page = GetPageObj(pageNo);
     if (!page)
         return RectD();
 
-    ScopedCritSec scope(&ctxAccess);
-
     // cf. pdf-page.c's pdf_load_page
     fz_rect mbox = fz_empty_rect, cbox = fz_empty_rect;
     int rotate = 0;
@@ -2042,7 +3377,11 @@ RectD PdfEngineImpl::PageMediabox(int pageNo)
         if (pdf_is_real(obj))
             userunit = pdf_to_real(obj);
     }
-    fz_catch(ctx) { }
+    fz_catch(ctx) {
+        // don't cache a fallback size for data that's still arriving
+        if (fz_caught(ctx) == FZ_ERROR_TRYLATER)
+            return RectD();
+    }
     if (fz_is_empty_rect(&mbox)) {
         fz_warn(ctx, "cannot find page size for page %d", pageNo);
         mbox.x0 = 0; mbox.y0 = 0;
@@ -2061,12 +3400,33 @@ RectD PdfEngineImpl::PageMediabox(int pageNo)
     fz_transform_rect(&mbox, fz_rotate(&ctm, (float)rotate));
 
     _mediaboxes[pageNo-1] = RectD(0, 0, (mbox.x1 - mbox.x0) * userunit, (mbox.y1 - mbox.y0) * userunit);
+    pageDataChanged = true;
     return _mediaboxes[pageNo-1];
 }
 
+bool PdfEngineImpl::IsLoadingProgressively()
+{
+    return _doc && is_stream_incomplete(_doc->file);
+}
+
+RectD PdfEngineImpl::QuickPageMediabox(int pageNo)
+{
+    assert(1 <= pageNo && pageNo <= PageCount());
+    if (!_mediaboxes[pageNo-1].IsEmpty())
+        return _mediaboxes[pageNo-1];
+    // determining the mediabox of a page whose object hasn't been
+    // looked up yet might require walking a large page tree
+    if (!_pageObjs[pageNo-1])
+        return RectD();
+    return PageMediabox(pageNo);
+}
+
 RectD PdfEngineImpl::PageContentBox(int pageNo, RenderTarget target)
 {
     assert(1 <= pageNo && pageNo <= PageCount());
+    if (Target_View == target && !_contentBoxes[pageNo-1].IsEmpty())
+        return _contentBoxes[pageNo-1];
+
     pdf_page *page = GetPdfPage(pageNo);
     if (!page)
         return RectD();
@@ -2091,8 +3451,82 @@ RectD PdfEngineImpl::PageContentBox(int pageNo, RenderTarget target)
     if (fz_is_infinite_rect(&rect))
         return PageMediabox(pageNo);
 
-    RectD rect2 = fz_rect_to_RectD(rect);
-    return rect2.Intersect(PageMediabox(pageNo));
+    RectD rect2 = fz_rect_to_RectD(rect).Intersect(PageMediabox(pageNo));
+    if (Target_View == target) {
+        ScopedCritSec scope(&ctxAccess);
+        _contentBoxes[pageNo-1] = rect2;
+        pageDataChanged = true;
+    }
+    return rect2;
+}
+
+bool PdfEngineImpl::LoadCachedPageData()
+{
+    size_t len;
+    ScopedMem<char> cache(file::ReadAll(pageDataCachePath, &len));
+    size_t entriesLen = sizeof(PdfPageCacheHeader) + PageCount() * sizeof(PdfPageCacheEntry);
+    if (!cache || len < entriesLen)
+        return false;
+    PdfPageCacheHeader *hdr = (PdfPageCacheHeader *)cache.Get();
+    if (!str::EqN(hdr->magic, PDF_CACHE_MAGIC, 4) || hdr->version != PDF_CACHE_VERSION ||
+        hdr->fileSize != pageDataFileSize || !FileTimeEq(hdr->modified, pageDataModified) ||
+        hdr->pageCount != PageCount() || (hdr->labelCount != 0 && hdr->labelCount != PageCount())) {
+        return false;
+    }
+
+    ScopedPtr<WStrVec> labels;
+    if (hdr->labelCount > 0) {
+        labels = new WStrVec();
+        const WCHAR *s = (const WCHAR *)(cache.Get() + entriesLen);
+        const WCHAR *end = (const WCHAR *)(cache.Get() + len);
+        for (int i = 0; i < hdr->labelCount; i++) {
+            const WCHAR *next = s;
+            for (; next < end && *next; next++);
+            if (next == end)
+                return false;
+            labels->Append(str::DupN(s, next - s));
+            s = next + 1;
+        }
+    }
+
+    PdfPageCacheEntry *entries = (PdfPageCacheEntry *)(cache.Get() + sizeof(PdfPageCacheHeader));
+    for (int i = 0; i < PageCount(); i++) {
+        _mediaboxes[i] = RectD(0, 0, entries[i].mediaboxDx, entries[i].mediaboxDy);
+        _contentBoxes[i] = RectD(entries[i].contentX, entries[i].contentY, entries[i].contentDx, entries[i].contentDy);
+    }
+    _pagelabels = labels.Detach();
+    return true;
+}
+
+void PdfEngineImpl::SaveCachedPageData()
+{
+    str::Str<char> cache;
+    PdfPageCacheHeader hdr;
+    memcpy(hdr.magic, PDF_CACHE_MAGIC, 4);
+    hdr.version = PDF_CACHE_VERSION;
+    hdr.fileSize = pageDataFileSize;
+    hdr.modified = pageDataModified;
+    hdr.pageCount = PageCount();
+    hdr.labelCount = _pagelabels && _pagelabels->Count() == (size_t)PageCount() ? PageCount() : 0;
+    cache.Append((const char *)&hdr, sizeof(hdr));
+    for (int i = 0; i < PageCount(); i++) {
+        PdfPageCacheEntry entry;
+        entry.mediaboxDx = _mediaboxes[i].dx;
+        entry.mediaboxDy = _mediaboxes[i].dy;
+        entry.contentX = _contentBoxes[i].x;
+        entry.contentY = _contentBoxes[i].y;
+        entry.contentDx = _contentBoxes[i].dx;
+        entry.contentDy = _contentBoxes[i].dy;
+        cache.Append((const char *)&entry, sizeof(entry));
+    }
+    for (int i = 0; i < hdr.labelCount; i++) {
+        const WCHAR *label = _pagelabels->At(i);
+        cache.Append((const char *)label, (str::Len(label) + 1) * sizeof(WCHAR));
+    }
+
+    ScopedMem<WCHAR> cacheDir(path::GetDir(pageDataCachePath));
+    if (dir::Create(cacheDir))
+        file::WriteAll(pageDataCachePath, cache.Get(), cache.Size());
 }
 
 PointD PdfEngineImpl::Transform(PointD pt, int pageNo, float zoom, int rotation, bool inverse)
@@ -2117,6 +3551,7 @@ RectD PdfEngineImpl::Transform(RectD rect, int pageNo, float zoom, int rotation,
 
 RenderedBitmap *PdfEngineImpl::RenderBitmap(int pageNo, float zoom, int rotation, RectD *pageRect, RenderTarget target, AbortCookie **cookie_out)
 {
+    etw::Span span("PdfRenderBitmap", etw::KeywordRender, pageNo);
     pdf_page* page = GetPdfPage(pageNo);
     if (!page || !pdf_is_dict(page->me))
         return nullptr;
@@ -2130,9 +3565,24 @@ RenderedBitmap *PdfEngineImpl::RenderBitmap(int pageNo, float zoom, int rotation
     fz_rect r = pRect;
     fz_irect bbox;
     fz_round_rect(&bbox, fz_transform_rect(&r, &ctm));
+    span.SetSize((int64)(bbox.x1 - bbox.x0) * (bbox.y1 - bbox.y0));
+    RenderQuality quality = Target_View == target ? renderQuality : Quality_Print;
+    fz_scale_glyph_cache(ctx, zoom);
+
+    // pages with a cached display list can be rendered without blocking other threads
+    PdfPageRun *run = Target_View == target ? GetPageRun(page) : nullptr;
+    if (run) {
+        FitzAbortCookie *cookie = nullptr;
+        if (cookie_out)
+            *cookie_out = cookie = new FitzAbortCookie();
+        RenderedBitmap *bitmap = RenderPageRun(page, run, &ctm, &bbox, quality, cookie);
+        DropPageRun(run);
+        return bitmap;
+    }
 
     fz_pixmap *image = nullptr;
     EnterCriticalSection(&ctxAccess);
+    fz_set_aa_level(ctx, fz_aa_level_for_quality(quality));
     fz_try(ctx) {
         fz_colorspace *colorspace = fz_device_rgb(ctx);
         image = fz_new_pixmap_with_bbox(ctx, colorspace, &bbox);
@@ -2169,33 +3619,245 @@ RenderedBitmap *PdfEngineImpl::RenderBitmap(int pageNo, float zoom, int rotation
     return bitmap;
 }
 
+bool PdfEngineImpl::RenderPage(HDC hDC, RectI screenRect, int pageNo, float zoom, int rotation, RectD *pageRect, RenderTarget target, AbortCookie **cookie_out)
+{
+    pdf_page* page = GetPdfPage(pageNo);
+    if (!page || !pdf_is_dict(page->me))
+        return false;
+    // GDI can't render transparency
+    if (page->transparency)
+        return false;
+
+    fz_rect pRect;
+    if (pageRect)
+        pRect = fz_RectD_to_rect(*pageRect);
+    else
+        pdf_bound_page(_doc, page, &pRect);
+    fz_matrix ctm = viewctm(page, zoom, rotation);
+    fz_rect r = pRect;
+    fz_irect bbox;
+    fz_round_rect(&bbox, fz_transform_rect(&r, &ctm));
+    // move the rendered page rectangle to screenRect
+    fz_matrix offset;
+    fz_concat(&ctm, &ctm, fz_translate(&offset, (float)(screenRect.x - bbox.x0), (float)(screenRect.y - bbox.y0)));
+    fz_rect cliprect = fz_RectD_to_rect(screenRect.Convert<double>());
+
+    FitzAbortCookie *cookie = nullptr;
+    if (cookie_out)
+        *cookie_out = cookie = new FitzAbortCookie();
+    return fz_run_page_gdi(ctx, &ctxAccess, hDC, screenRect, [&](fz_device *dev) {
+        return RunPage(page, dev, &ctm, target, &cliprect, false, cookie);
+    });
+}
+
+RenderedBitmap *PdfEngineImpl::GetEmbeddedThumbnail(int pageNo, int size)
+{
+    pdf_obj *page = GetPageObj(pageNo);
+    if (!page || size <= 0)
+        return nullptr;
+
+    ScopedCritSec scope(&ctxAccess);
+
+    fz_image *image = nullptr;
+    fz_pixmap *pixmap = nullptr, *scaled = nullptr;
+    RenderedBitmap *bmp = nullptr;
+    fz_var(image);
+    fz_var(pixmap);
+    fz_var(scaled);
+    fz_var(bmp);
+    fz_try(ctx) {
+        pdf_obj *thumb = pdf_dict_gets(page, "Thumb");
+        if (pdf_is_stream(_doc, pdf_to_num(thumb), pdf_to_gen(thumb)))
+            image = pdf_load_image(_doc, thumb);
+        // thumbnails smaller than requested would look blurry when scaled up
+        if (image && std::max(image->w, image->h) >= size) {
+            float zoom = std::min(size / (float)image->w, size / (float)image->h);
+            int w = std::max((int)(image->w * zoom + 0.5f), 1);
+            int h = std::max((int)(image->h * zoom + 0.5f), 1);
+            pixmap = fz_new_pixmap_from_image(ctx, image, w, h);
+            // the image might have been decoded at a larger size
+            if (pixmap->w != w || pixmap->h != h)
+                scaled = fz_scale_pixmap(ctx, pixmap, 0, 0, (float)w, (float)h, nullptr);
+            bmp = new_rendered_fz_pixmap(ctx, scaled ? scaled : pixmap);
+        }
+    }
+    fz_always(ctx) {
+        fz_drop_pixmap(ctx, scaled);
+        fz_drop_pixmap(ctx, pixmap);
+        fz_drop_image(ctx, image);
+    }
+    fz_catch(ctx) {
+        delete bmp;
+        return nullptr;
+    }
+    return bmp;
+}
+
+// renders a display list using a context cloned for this call, so that
+// several threads can render pages of the same document at once
+// returns the number of bands to split a rendering into (1 for small renderings or single processor machines)
+static int GetRenderBandCount(const fz_irect *bbox)
+{
+    int dy = bbox->y1 - bbox->y0;
+    if ((int64)(bbox->x1 - bbox->x0) * dy < BANDED_RENDER_MIN_PIXELS)
+        return 1;
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    int count = std::min((int)si.dwNumberOfProcessors, BANDED_RENDER_MAX_BANDS);
+    return limitValue(count, 1, std::max(dy / BANDED_RENDER_MIN_BAND_HEIGHT, 1));
+}
+
+RenderedBitmap *PdfEngineImpl::RenderPageRun(pdf_page *page, PdfPageRun *run, const fz_matrix *ctm, const fz_irect *bbox, RenderQuality quality, FitzAbortCookie *cookie)
+{
+    EnterCriticalSection(&ctxAccess);
+    fz_context *renderCtx = fz_clone_context(ctx);
+    LeaveCriticalSection(&ctxAccess);
+    if (!renderCtx)
+        return nullptr;
+    fz_set_aa_level(renderCtx, fz_aa_level_for_quality(quality));
+    int bandCount = GetRenderBandCount(bbox);
+
+    fz_pixmap *image = nullptr;
+    fz_device *dev = nullptr;
+    fz_var(image);
+    fz_var(dev);
+    fz_try(renderCtx) {
+        fz_colorspace *colorspace = fz_device_rgb(renderCtx);
+        image = fz_new_pixmap_with_bbox(renderCtx, colorspace, bbox);
+        fz_clear_pixmap_with_value(renderCtx, image, 0xFF); // initialize white background
+        if (bandCount <= 1)
+            dev = fz_new_draw_device(renderCtx, image);
+    }
+    fz_catch(renderCtx) {
+        fz_drop_pixmap(renderCtx, image);
+        fz_free_context(renderCtx);
+        return nullptr;
+    }
+
+    bool ok;
+    if (bandCount > 1) {
+        ok = RenderPageRunBands(page, run, ctm, image, bandCount, quality, cookie);
+    }
+    else {
+        fz_rect cliprect;
+        ok = RunPageRun(page, run, dev, ctm, fz_rect_from_irect(&cliprect, bbox), cookie);
+        fz_free_device(dev);
+    }
+
+    RenderedBitmap *bitmap = nullptr;
+    if (ok && !(cookie && cookie->cookie.abort))
+        bitmap = new_rendered_fz_pixmap(renderCtx, image);
+    fz_drop_pixmap(renderCtx, image);
+    fz_free_context(renderCtx);
+    return bitmap;
+}
+
+class PdfRenderBand : public ThreadBase {
+    PdfEngineImpl *engine;
+    pdf_page *page;
+    PdfPageRun *run;
+    fz_matrix ctm;
+    fz_pixmap *image;
+    fz_irect band;
+    RenderQuality quality;
+    FitzAbortCookie *cookie;
+
+public:
+    bool ok;
+
+    PdfRenderBand(PdfEngineImpl *engine, pdf_page *page, PdfPageRun *run, const fz_matrix *ctm, fz_pixmap *image,
+                  fz_irect band, RenderQuality quality, FitzAbortCookie *cookie) :
+        ThreadBase("PdfRenderBand"), engine(engine), page(page), run(run), ctm(*ctm), image(image),
+        band(band), quality(quality), cookie(cookie), ok(false) { }
+    virtual ~PdfRenderBand() { }
+    virtual void Run() override {
+        ok = engine->RenderPageRunBand(page, run, &ctm, image, &band, quality, cookie);
+    }
+};
+
+// renders a page's display list in horizontal bands on several threads, so that
+// expensive pages at high zoom levels don't take as long to appear. All bands
+// draw directly into image (and share the abort cookie which is only read by MuPDF).
+bool PdfEngineImpl::RenderPageRunBands(pdf_page *page, PdfPageRun *run, const fz_matrix *ctm, fz_pixmap *image, int bandCount, RenderQuality quality, FitzAbortCookie *cookie)
+{
+    CrashIf(bandCount < 2 || bandCount > BANDED_RENDER_MAX_BANDS);
+    PdfRenderBand *bands[BANDED_RENDER_MAX_BANDS];
+    for (int i = 0; i < bandCount; i++) {
+        fz_irect band;
+        band.x0 = image->x;
+        band.x1 = image->x + image->w;
+        band.y0 = image->y + image->h * i / bandCount;
+        band.y1 = image->y + image->h * (i + 1) / bandCount;
+        bands[i] = new PdfRenderBand(this, page, run, ctm, image, band, quality, cookie);
+        // the last band is rendered on the calling thread
+        if (i < bandCount - 1)
+            bands[i]->Start();
+    }
+    bands[bandCount - 1]->Run();
+
+    bool ok = true;
+    for (int i = 0; i < bandCount; i++) {
+        if (i < bandCount - 1)
+            bands[i]->Join();
+        ok = ok && bands[i]->ok;
+        delete bands[i];
+    }
+    return ok;
+}
+
+bool PdfEngineImpl::RenderPageRunBand(pdf_page *page, PdfPageRun *run, const fz_matrix *ctm, fz_pixmap *image, const fz_irect *band, RenderQuality quality, FitzAbortCookie *cookie)
+{
+    EnterCriticalSection(&ctxAccess);
+    fz_context *bandCtx = fz_clone_context(ctx);
+    LeaveCriticalSection(&ctxAccess);
+    if (!bandCtx)
+        return false;
+    fz_set_aa_level(bandCtx, fz_aa_level_for_quality(quality));
+
+    fz_pixmap *pixmap = nullptr;
+    fz_device *dev = nullptr;
+    fz_var(pixmap);
+    fz_var(dev);
+    fz_try(bandCtx) {
+        // the band's pixmap uses the rows of image it covers as its samples
+        unsigned char *samples = image->samples + (size_t)(band->y0 - image->y) * image->w * image->n;
+        pixmap = fz_new_pixmap_with_bbox_and_data(bandCtx, image->colorspace, band, samples);
+        dev = fz_new_draw_device(bandCtx, pixmap);
+    }
+    fz_catch(bandCtx) {
+        fz_drop_pixmap(bandCtx, pixmap);
+        fz_free_context(bandCtx);
+        return false;
+    }
+
+    fz_rect cliprect;
+    bool ok = RunPageRun(page, run, dev, ctm, fz_rect_from_irect(&cliprect, band), cookie);
+    fz_free_device(dev);
+    fz_drop_pixmap(bandCtx, pixmap);
+    fz_free_context(bandCtx);
+    return ok;
+}
+
 PageElement *PdfEngineImpl::GetElementAtPos(int pageNo, PointD pt)
 {
     pdf_page *page = GetPdfPage(pageNo, true);
-    if (!page)
+    // don't block hover checks while the page is busy (the next one will succeed)
+    if (!page || !ProcessPageElements(pageNo, page, true))
         return nullptr;
 
     fz_point p = { (float)pt.x, (float)pt.y };
-    for (fz_link *link = page->links; link; link = link->next) {
-        if (link->dest.kind != FZ_LINK_NONE && fz_is_pt_in_rect(link->rect, p))
-            return new PdfLink(this, &link->dest, link->rect, pageNo, &p);
-    }
+    const PdfElementGrid::Entry *el = pageElements[pageNo-1]->Find(p);
+    if (el && el->link)
+        return new PdfLink(this, &el->link->dest, el->link->rect, pageNo, &p);
+    if (el) {
+        ScopedCritSec scope(&ctxAccess);
 
-    if (pageAnnots[pageNo-1]) {
-        for (size_t i = 0; pageAnnots[pageNo-1][i]; i++) {
-            pdf_annot *annot = pageAnnots[pageNo-1][i];
-            fz_rect rect = annot->rect;
-            fz_transform_rect(&rect, &page->ctm);
-            if (fz_is_pt_in_rect(rect, p)) {
-                ScopedCritSec scope(&ctxAccess);
-
-                ScopedMem<WCHAR> contents(str::conv::FromPdf(pdf_dict_gets(annot->obj, "Contents")));
-                // TODO: use separate classes for comments and tooltips?
-                if (str::IsEmpty(contents.Get()) && FZ_ANNOT_WIDGET == annot->annot_type)
-                    contents.Set(str::conv::FromPdf(pdf_dict_gets(annot->obj, "TU")));
-                return new PdfComment(contents, fz_rect_to_RectD(rect), pageNo);
-            }
-        }
+        pdf_annot *annot = el->annot;
+        ScopedMem<WCHAR> contents(str::conv::FromPdf(pdf_dict_gets(annot->obj, "Contents")));
+        // TODO: use separate classes for comments and tooltips?
+        if (str::IsEmpty(contents.Get()) && FZ_ANNOT_WIDGET == annot->annot_type)
+            contents.Set(str::conv::FromPdf(pdf_dict_gets(annot->obj, "TU")));
+        return new PdfComment(contents, fz_rect_to_RectD(el->rect), pageNo);
     }
 
     if (imageRects[pageNo-1]) {
@@ -2212,6 +3874,7 @@ Vec<PageElement *> *PdfEngineImpl::GetElements(int pageNo)
     pdf_page *page = GetPdfPage(pageNo, true);
     if (!page)
         return nullptr;
+    ProcessPageElements(pageNo, page);
 
     // since all elements lists are in last-to-first order, append
     // item types in inverse order and reverse the whole list at the end
@@ -2244,8 +3907,42 @@ Vec<PageElement *> *PdfEngineImpl::GetElements(int pageNo)
         }
     }
 
-    els->Reverse();
-    return els;
+    els->Reverse();
+    return els;
+}
+
+// links in the page's text and annotations are only processed once a page's
+// elements are requested, so that rendering, printing and thumbnails
+// don't have to extract the page's text
+bool PdfEngineImpl::ProcessPageElements(int pageNo, pdf_page *page, bool failIfBusy)
+{
+    if (pageElements[pageNo-1])
+        return true;
+    // extracting text requires pagesAccess (for GetPageRun) before ctxAccess
+    if (!failIfBusy) {
+        EnterCriticalSection(&pagesAccess);
+        EnterCriticalSection(&ctxAccess);
+    }
+    else if (!TryEnterCriticalSection(&pagesAccess)) {
+        return false;
+    }
+    else if (!TryEnterCriticalSection(&ctxAccess)) {
+        LeaveCriticalSection(&pagesAccess);
+        return false;
+    }
+
+    if (!pageElements[pageNo-1]) {
+        fz_try(ctx) {
+            LinkifyPageText(page);
+            pageAnnots[pageNo-1] = ProcessPageAnnotations(page);
+        }
+        fz_catch(ctx) { }
+        pageElements[pageNo-1] = new PdfElementGrid(page, pageAnnots[pageNo-1]);
+    }
+
+    LeaveCriticalSection(&ctxAccess);
+    LeaveCriticalSection(&pagesAccess);
+    return true;
 }
 
 void PdfEngineImpl::LinkifyPageText(pdf_page *page)
@@ -2328,7 +4025,9 @@ pdf_annot **PdfEngineImpl::ProcessPageAnnotations(pdf_page *page)
     return annots.StealData();
 }
 
-RenderedBitmap *PdfEngineImpl::GetPageImage(int pageNo, RectD rect, size_t imageIx)
+// returns the imageIx-th image drawn on the page, if it's still at rect
+// (the image is owned by the page's resources)
+fz_image *PdfEngineImpl::FindPageImage(int pageNo, RectD rect, size_t imageIx)
 {
     pdf_page *page = GetPdfPage(pageNo);
     if (!page)
@@ -2355,11 +4054,19 @@ RenderedBitmap *PdfEngineImpl::GetPageImage(int pageNo, RectD rect, size_t image
         return nullptr;
     }
 
+    return positions.At(imageIx).image;
+}
+
+RenderedBitmap *PdfEngineImpl::GetPageImage(int pageNo, RectD rect, size_t imageIx)
+{
+    fz_image *image = FindPageImage(pageNo, rect, imageIx);
+    if (!image)
+        return nullptr;
+
     ScopedCritSec scope(&ctxAccess);
 
     fz_pixmap *pixmap = nullptr;
     fz_try(ctx) {
-        fz_image *image = positions.At(imageIx).image;
         pixmap = fz_new_pixmap_from_image(ctx, image, image->w, image->h);
     }
     fz_catch(ctx) {
@@ -2371,11 +4078,67 @@ RenderedBitmap *PdfEngineImpl::GetPageImage(int pageNo, RectD rect, size_t image
     return bmp;
 }
 
-WCHAR *PdfEngineImpl::ExtractPageText(pdf_page *page, const WCHAR *lineSep, RectI **coordsOut, RenderTarget target, bool cacheRun)
+// JPEG and JPEG 2000 images can be handed out as they are stored if
+// decoding them doesn't involve anything but the stream itself
+// (and the stream is a complete .jpg or .jp2 file)
+static bool IsImageDataSelfContained(fz_context *ctx, fz_image *image)
+{
+    if (!image->buffer || !image->buffer->buffer || image->mask || image->imagemask || image->usecolorkey)
+        return false;
+    if (image->colorspace != fz_device_rgb(ctx) && image->colorspace != fz_device_gray(ctx))
+        return false;
+    // Decode arrays and explicit /ColorTransform values aren't part of the stream data
+    for (int i = 0; i < image->n * 2; i++) {
+        if (image->decode[i] != (i & 1 ? 1.0f : 0.0f))
+            return false;
+    }
+    fz_buffer *buffer = image->buffer->buffer;
+    switch (image->buffer->params.type) {
+    case FZ_IMAGE_JPEG:
+        return 8 == image->bpc && -1 == image->buffer->params.u.jpeg.color_transform &&
+               buffer->len > 2 && memeq(buffer->data, "\xFF\xD8", 2);
+    case FZ_IMAGE_JPX:
+        // raw JPEG 2000 codestreams lack the JP2 signature box
+        return buffer->len > 12 && memeq(buffer->data, "\0\0\0\x0CjP  \x0D\x0A\x87\x0A", 12);
+    default:
+        return false;
+    }
+}
+
+unsigned char *PdfEngineImpl::GetPageImageData(int pageNo, RectD rect, size_t imageIx, size_t *cbCount)
+{
+    fz_image *image = FindPageImage(pageNo, rect, imageIx);
+    if (!image)
+        return nullptr;
+
+    ScopedCritSec scope(&ctxAccess);
+    if (!IsImageDataSelfContained(ctx, image))
+        return nullptr;
+
+    fz_buffer *buffer = image->buffer->buffer;
+    *cbCount = buffer->len;
+    return (unsigned char *)memdup(buffer->data, buffer->len);
+}
+
+WCHAR *PdfEngineImpl::ExtractPageText(pdf_page *page, const WCHAR *lineSep, RectI **coordsOut, RenderTarget target, bool cacheRun, FitzAbortCookie *cookie)
 {
     if (!page)
         return nullptr;
 
+    // a page with a cached run only goes through a text device once
+    PdfPageRun *run = Target_View == target ? GetPageRun(page, !cacheRun) : nullptr;
+    if (run) {
+        EnterCriticalSection(&shared->runAccess);
+        fz_text_page *cached = run->textPage;
+        LeaveCriticalSection(&shared->runAccess);
+        if (cached) {
+            // the text page is never changed once it's been set
+            WCHAR *content = fz_text_page_to_str(cached, lineSep, coordsOut);
+            DropPageRun(run);
+            return content;
+        }
+    }
+
     fz_text_sheet *sheet = nullptr;
     fz_text_page *text = nullptr;
     fz_device *dev = nullptr;
@@ -2392,6 +4155,8 @@ WCHAR *PdfEngineImpl::ExtractPageText(pdf_page *page, const WCHAR *lineSep, Rect
         fz_free_text_page(ctx, text);
         fz_free_text_sheet(ctx, sheet);
         LeaveCriticalSection(&ctxAccess);
+        if (run)
+            DropPageRun(run);
         return nullptr;
     }
     LeaveCriticalSection(&ctxAccess);
@@ -2402,28 +4167,78 @@ WCHAR *PdfEngineImpl::ExtractPageText(pdf_page *page, const WCHAR *lineSep, Rect
     // use an infinite rectangle as bounds (instead of pdf_bound_page) to ensure that
     // the extracted text is consistent between cached runs using a list device and
     // fresh runs (otherwise the list device omits text outside the mediabox bounds)
-    bool ok = RunPage(page, dev, &fz_identity, target, nullptr, cacheRun);
+    bool ok;
+    if (run) {
+        ok = RunPageRun(page, run, dev, &fz_identity, nullptr, cookie) && !(cookie && cookie->cookie.abort);
+        EnterCriticalSection(&ctxAccess);
+        fz_free_device(dev);
+        LeaveCriticalSection(&ctxAccess);
+    }
+    else {
+        ok = RunPage(page, dev, &fz_identity, target, nullptr, cacheRun, cookie);
+    }
 
     ScopedCritSec scope(&ctxAccess);
 
     WCHAR *content = nullptr;
-    if (ok)
+    // an aborted run still leaves the text collected so far
+    if (ok || cookie && cookie->cookie.abort)
         content = fz_text_page_to_str(text, lineSep, coordsOut);
+
+    // keep the complete text along with the run for the next extraction
+    if (ok && run) {
+        size_t size = fz_text_page_mem_estimate(text);
+        ScopedCritSec runScope(&shared->runAccess);
+        if (!run->textPage) {
+            run->textPage = text;
+            run->textSheet = sheet;
+            run->size_est += size;
+            text = nullptr;
+            sheet = nullptr;
+        }
+    }
     fz_free_text_page(ctx, text);
     fz_free_text_sheet(ctx, sheet);
+    if (run)
+        DropPageRun(run);
 
     return content;
 }
 
 WCHAR *PdfEngineImpl::ExtractPageText(int pageNo, const WCHAR *lineSep, RectI **coordsOut, RenderTarget target)
 {
+    return ExtractPageText(pageNo, lineSep, coordsOut, target, nullptr);
+}
+
+WCHAR *PdfEngineImpl::ExtractPageTextLimited(int pageNo, const WCHAR *lineSep, RectI **coordsOut, DWORD timeoutMs, bool *partialOut, AbortCookie **cookie_out)
+{
+    FitzAbortCookie *cookie = new FitzAbortCookie();
+    if (cookie_out)
+        *cookie_out = cookie;
+    WCHAR *text;
+    {
+        FitzAbortTimer timer(cookie, timeoutMs);
+        text = ExtractPageText(pageNo, lineSep, coordsOut, Target_View, cookie);
+    }
+    *partialOut = cookie->cookie.abort != 0;
+    if (!cookie_out)
+        delete cookie;
+    return text;
+}
+
+WCHAR *PdfEngineImpl::ExtractPageText(int pageNo, const WCHAR *lineSep, RectI **coordsOut, RenderTarget target, FitzAbortCookie *cookie)
+{
+    etw::Span span("PdfExtractPageText", etw::KeywordSearch, pageNo);
     pdf_page *page = GetPdfPage(pageNo, true);
-    if (page)
-        return ExtractPageText(page, lineSep, coordsOut, target);
+    if (page) {
+        WCHAR *text = ExtractPageText(page, lineSep, coordsOut, target, false, cookie);
+        span.SetSize(str::Len(text));
+        return text;
+    }
 
     EnterCriticalSection(&ctxAccess);
     fz_try(ctx) {
-        page = pdf_load_page_by_obj(_doc, pageNo - 1, _pageObjs[pageNo-1]);
+        page = pdf_load_page_by_obj(_doc, pageNo - 1, GetPageObj(pageNo));
     }
     fz_catch(ctx) {
         LeaveCriticalSection(&ctxAccess);
@@ -2431,7 +4246,8 @@ WCHAR *PdfEngineImpl::ExtractPageText(int pageNo, const WCHAR *lineSep, RectI **
     }
     LeaveCriticalSection(&ctxAccess);
 
-    WCHAR *result = ExtractPageText(page, lineSep, coordsOut, target);
+    WCHAR *result = ExtractPageText(page, lineSep, coordsOut, target, false, cookie);
+    span.SetSize(str::Len(result));
 
     EnterCriticalSection(&ctxAccess);
     pdf_free_page(_doc, page);
@@ -2468,7 +4284,7 @@ bool PdfEngineImpl::IsLinearizedFile()
     if (pdf_to_int(pdf_dict_gets(obj, "L")) != _doc->file_size)
         return false;
     // /O must be the object number of the first page
-    if (pdf_to_int(pdf_dict_gets(obj, "O")) != pdf_to_num(_pageObjs[0]))
+    if (pdf_to_int(pdf_dict_gets(obj, "O")) != pdf_to_num(GetPageObj(1)))
         return false;
     // /N must be the total number of pages
     if (pdf_to_int(pdf_dict_gets(obj, "N")) != PageCount())
@@ -2505,26 +4321,37 @@ WCHAR *PdfEngineImpl::ExtractFontList()
     Vec<pdf_obj *> fontList;
     Vec<pdf_obj *> resList;
 
-    // collect all fonts from all page objects
+    // start ctxAccess scope here so that we don't also have to
+    // ask for pagesAccess (as is required for GetPdfPage)
+    ScopedCritSec scope(&ctxAccess);
+
+    // collect all fonts from all page objects and their annotations' appearance
+    // streams without loading the pages (which for large documents would take
+    // a long while and keep all the pages in memory afterwards)
     for (int i = 1; i <= PageCount(); i++) {
-        pdf_page *page = GetPdfPage(i);
-        if (page) {
-            ScopedCritSec scope(&ctxAccess);
-            fz_try(ctx) {
-                pdf_extract_fonts(page->resources, fontList, resList);
-                for (pdf_annot *annot = page->annots; annot; annot = annot->next) {
-                    if (annot->ap)
-                        pdf_extract_fonts(annot->ap->resources, fontList, resList);
+        pdf_obj *pageObj = GetPageObj(i);
+        if (!pageObj)
+            continue;
+        fz_try(ctx) {
+            pdf_obj *res = pdf_lookup_inherited_page_item(_doc, pageObj, "Resources");
+            pdf_extract_fonts(res, fontList, resList);
+            pdf_obj *annots = pdf_dict_gets(pageObj, "Annots");
+            for (int j = 0; j < pdf_array_len(annots); j++) {
+                pdf_obj *ap = pdf_dict_getp(pdf_array_get(annots, j), "AP/N");
+                if (pdf_is_indirect(ap) && pdf_is_stream(_doc, pdf_to_num(ap), pdf_to_gen(ap))) {
+                    pdf_extract_fonts(pdf_dict_gets(ap, "Resources"), fontList, resList);
+                    continue;
+                }
+                // appearance streams for different states (e.g. of checkboxes)
+                for (int k = 0; k < pdf_dict_len(ap); k++) {
+                    pdf_obj *apState = pdf_dict_get_val(ap, k);
+                    pdf_extract_fonts(pdf_dict_gets(apState, "Resources"), fontList, resList);
                 }
             }
-            fz_catch(ctx) { }
         }
+        fz_catch(ctx) { }
     }
 
-    // start ctxAccess scope here so that we don't also have to
-    // ask for pagesAccess (as is required for GetPdfPage)
-    ScopedCritSec scope(&ctxAccess);
-
     for (pdf_obj *res : resList) {
         pdf_unmark_obj(res);
     }
@@ -2647,8 +4474,31 @@ WCHAR *PdfEngineImpl::GetProperty(DocumentProperty prop)
         return nullptr;
     }
 
-    if (Prop_FontList == prop)
-        return ExtractFontList();
+    if (Prop_FontList == prop) {
+        {
+            ScopedCritSec scope(&shared->runAccess);
+            if (shared->fontListExtracted)
+                return str::Dup(shared->fontList);
+        }
+        WCHAR *fontList = ExtractFontList();
+        ScopedCritSec scope(&shared->runAccess);
+        if (!shared->fontListExtracted) {
+            shared->fontList.Set(str::Dup(fontList));
+            shared->fontListExtracted = true;
+        }
+        return fontList;
+    }
+
+    if (Prop_CacheStatistics == prop) {
+        size_t runBytes = 0, runCount = 0;
+        {
+            ScopedCritSec scope(&shared->runAccess);
+            for (size_t i = 0; i < shared->runCache.Count(); i++)
+                runBytes += shared->runCache.At(i)->size_est;
+            runCount = shared->runCache.Count();
+        }
+        return fz_store_stats_to_str(ctx, runBytes, runCount);
+    }
 
     static struct {
         DocumentProperty prop;
@@ -2674,8 +4524,9 @@ bool PdfEngineImpl::SupportsAnnotation(bool forSaving) const
 {
     if (forSaving) {
         // TODO: support updating of documents where pages aren't all numbered objects?
+        PdfEngineImpl *self = const_cast<PdfEngineImpl *>(this);
         for (int i = 0; i < PageCount(); i++) {
-            if (pdf_to_num(_pageObjs[i]) == 0)
+            if (pdf_to_num(self->GetPageObj(i + 1)) == 0)
                 return false;
         }
     }
@@ -2692,6 +4543,186 @@ void PdfEngineImpl::UpdateUserAnnotations(Vec<PageAnnotation> *list)
         userAnnots.Reset();
 }
 
+// keys which don't affect a page's appearance and which would
+// make a page's fingerprint depend on other pages
+static const char *gFingerprintIgnoredKeys[] = {
+    "Parent", "P", "Popup", "A", "AA", "Dest", "StructParent", "StructParents", "B", "Thumb",
+};
+
+#define MAX_FINGERPRINT_DEPTH 64
+
+// digests of streams are cached, as resources (e.g. fonts) are usually shared between pages
+bool PdfEngineImpl::GetStreamDigest(int num, int gen, unsigned char digest[16])
+{
+    size_t lo = 0, hi = streamDigests.Count();
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (streamDigests.At(mid).num < num)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < streamDigests.Count() && streamDigests.At(lo).num == num) {
+        memcpy(digest, streamDigests.At(lo).digest, 16);
+        return true;
+    }
+
+    fz_buffer *buffer = nullptr;
+    fz_var(buffer);
+    fz_try(ctx) {
+        buffer = pdf_load_raw_stream(_doc, num, gen);
+    }
+    fz_catch(ctx) {
+        return false;
+    }
+    // streams can be several MB large (e.g. embedded fonts), so they're only
+    // hashed with MurmurHash64 (combined with their length) instead of MD5
+    // (the page fingerprints built from these digests are never persisted)
+    PdfStreamDigest sd;
+    sd.num = num;
+    uint64_t hash = MurmurHash64(buffer->data, buffer->len);
+    uint64_t len = (uint64_t)buffer->len;
+    static_assert(sizeof(sd.digest) == sizeof(hash) + sizeof(len), "digest size mismatch");
+    memcpy(sd.digest, &hash, sizeof(hash));
+    memcpy(sd.digest + sizeof(hash), &len, sizeof(len));
+    fz_drop_buffer(ctx, buffer);
+
+    streamDigests.InsertAt(lo, sd);
+    memcpy(digest, sd.digest, 16);
+    return true;
+}
+
+// hashes an object by content (and not by object numbers, which
+// usually change when a document is regenerated)
+bool PdfEngineImpl::UpdateFingerprint(fz_md5 *md5, pdf_obj *obj, int depth)
+{
+    if (depth > MAX_FINGERPRINT_DEPTH)
+        return false;
+
+    if (pdf_is_indirect(obj)) {
+        int num = pdf_to_num(obj), gen = pdf_to_gen(obj);
+        if (pdf_is_stream(_doc, num, gen)) {
+            unsigned char digest[16];
+            if (!GetStreamDigest(num, gen, digest))
+                return false;
+            fz_md5_update(md5, (const unsigned char *)"S", 1);
+            fz_md5_update(md5, digest, 16);
+        }
+        if (pdf_mark_obj(obj)) {
+            // cyclic reference
+            fz_md5_update(md5, (const unsigned char *)"R", 1);
+            return true;
+        }
+        bool ok = UpdateFingerprint(md5, pdf_resolve_indirect(obj), depth + 1);
+        pdf_unmark_obj(obj);
+        return ok;
+    }
+
+    if (pdf_is_dict(obj)) {
+        fz_md5_update(md5, (const unsigned char *)"<<", 2);
+        for (int i = 0; i < pdf_dict_len(obj); i++) {
+            const char *key = pdf_to_name(pdf_dict_get_key(obj, i));
+            bool ignore = false;
+            for (size_t j = 0; j < dimof(gFingerprintIgnoredKeys) && !ignore; j++) {
+                ignore = str::Eq(key, gFingerprintIgnoredKeys[j]);
+            }
+            if (ignore)
+                continue;
+            fz_md5_update(md5, (const unsigned char *)key, (unsigned)str::Len(key) + 1);
+            if (!UpdateFingerprint(md5, pdf_dict_get_val(obj, i), depth + 1))
+                return false;
+        }
+        fz_md5_update(md5, (const unsigned char *)">>", 2);
+    }
+    else if (pdf_is_array(obj)) {
+        fz_md5_update(md5, (const unsigned char *)"[", 1);
+        for (int i = 0; i < pdf_array_len(obj); i++) {
+            if (!UpdateFingerprint(md5, pdf_array_get(obj, i), depth + 1))
+                return false;
+        }
+        fz_md5_update(md5, (const unsigned char *)"]", 1);
+    }
+    else if (pdf_is_name(obj)) {
+        const char *name = pdf_to_name(obj);
+        fz_md5_update(md5, (const unsigned char *)"/", 1);
+        fz_md5_update(md5, (const unsigned char *)name, (unsigned)str::Len(name) + 1);
+    }
+    else if (pdf_is_string(obj)) {
+        int len = pdf_to_str_len(obj);
+        fz_md5_update(md5, (const unsigned char *)"(", 1);
+        fz_md5_update(md5, (const unsigned char *)&len, sizeof(len));
+        fz_md5_update(md5, (const unsigned char *)pdf_to_str_buf(obj), len);
+    }
+    else if (pdf_is_int(obj)) {
+        int value = pdf_to_int(obj);
+        fz_md5_update(md5, (const unsigned char *)"i", 1);
+        fz_md5_update(md5, (const unsigned char *)&value, sizeof(value));
+    }
+    else if (pdf_is_real(obj)) {
+        float value = pdf_to_real(obj);
+        fz_md5_update(md5, (const unsigned char *)"f", 1);
+        fz_md5_update(md5, (const unsigned char *)&value, sizeof(value));
+    }
+    else if (pdf_is_bool(obj)) {
+        fz_md5_update(md5, (const unsigned char *)(pdf_to_bool(obj) ? "t" : "b"), 1);
+    }
+    else {
+        fz_md5_update(md5, (const unsigned char *)"n", 1);
+    }
+    return true;
+}
+
+bool PdfEngineImpl::GetPageFingerprint(int pageNo, unsigned char digest[16])
+{
+    // the data of memory mapped or progressively read files
+    // might no longer be what the document was loaded from
+    if (!fileInMemory)
+        return false;
+
+    ScopedCritSec scope(&ctxAccess);
+
+    PdfPageDigest& pd = pageDigests[pageNo - 1];
+    if (!pd.valid) {
+        pdf_obj *page = GetPageObj(pageNo);
+        if (!page)
+            return false;
+        fz_md5 md5;
+        fz_md5_init(&md5);
+        if (!UpdateFingerprint(&md5, page, 0))
+            return false;
+        // inherited attributes aren't part of the page's dictionary
+        static const char *inheritedKeys[] = { "MediaBox", "CropBox", "Rotate", "Resources" };
+        for (size_t i = 0; i < dimof(inheritedKeys); i++) {
+            pdf_obj *item = nullptr;
+            fz_try(ctx) {
+                item = pdf_lookup_inherited_page_item(_doc, page, inheritedKeys[i]);
+            }
+            fz_catch(ctx) {
+                return false;
+            }
+            if (!UpdateFingerprint(&md5, item, 0))
+                return false;
+        }
+        fz_md5_final(&md5, pd.digest);
+        pd.valid = true;
+    }
+
+    // user annotations are rendered along with the page's content
+    fz_md5 md5;
+    fz_md5_init(&md5);
+    fz_md5_update(&md5, pd.digest, 16);
+    for (size_t i = 0; i < userAnnots.Count(); i++) {
+        PageAnnotation& annot = userAnnots.At(i);
+        if (annot.pageNo != pageNo)
+            continue;
+        fz_md5_update(&md5, (const unsigned char *)&annot.type, sizeof(annot.type));
+        fz_md5_update(&md5, (const unsigned char *)&annot.rect, sizeof(annot.rect));
+        fz_md5_update(&md5, (const unsigned char *)&annot.color, sizeof(annot.color));
+    }
+    fz_md5_final(&md5, digest);
+    return true;
+}
+
 char *PdfEngineImpl::GetDecryptionKey() const
 {
     if (!_decryptionKey)
@@ -2699,6 +4730,30 @@ char *PdfEngineImpl::GetDecryptionKey() const
     return str::Dup(_decryptionKey);
 }
 
+void PdfEngineImpl::ReleaseCaches(bool inBackground)
+{
+    // drop all display lists that aren't currently in use
+    // (which also allows the store to release the images they reference)
+    Vec<PdfPageRun *> dropped;
+    if (inBackground) {
+        ScopedCritSec scope(&shared->runAccess);
+        for (size_t i = 0; i < shared->runCache.Count(); i++) {
+            PdfPageRun *run = shared->runCache.At(i);
+            if (1 == run->refs) {
+                shared->runCache.RemoveAt(i--);
+                run->refs--;
+                dropped.Append(run);
+            }
+        }
+    }
+
+    ScopedCritSec scope(&ctxAccess);
+    for (PdfPageRun *run : dropped) {
+        FreePageRun(ctx, run);
+    }
+    fz_set_store_max(ctx, inBackground ? MIN_CONTEXT_MEMORY : MAX_CONTEXT_MEMORY);
+}
+
 PageLayoutType PdfEngineImpl::PreferredLayout()
 {
     PageLayoutType layout = Layout_Single;
@@ -2747,6 +4802,11 @@ unsigned char *PdfEngineImpl::GetFileData(size_t *cbCount)
 
 bool PdfEngineImpl::SaveFileAs(const WCHAR *copyFileName, bool includeUserAnnots)
 {
+    // SaveUserAnnots appends an incremental update, so there's no need
+    // to rewrite the entire document when saving it in place
+    if (includeUserAnnots && _fileName && path::IsSame(_fileName, copyFileName))
+        return SaveUserAnnotsInPlace();
+
     size_t dataLen;
     ScopedMem<unsigned char> data(GetFileData(&dataLen));
     if (data) {
@@ -2897,8 +4957,9 @@ bool PdfEngineImpl::SaveUserAnnots(const WCHAR *fileName)
     fz_try(ctx) {
         for (int pageNo = 1; pageNo <= PageCount(); pageNo++) {
             pdf_page *page = GetPdfPage(pageNo);
+            pdf_obj *pageObj = GetPageObj(pageNo);
             // TODO: this will skip annotations for broken documents
-            if (!page || !pdf_to_num(_pageObjs[pageNo - 1])) {
+            if (!page || !pdf_to_num(pageObj)) {
                 ok = false;
                 break;
             }
@@ -2906,18 +4967,18 @@ bool PdfEngineImpl::SaveUserAnnots(const WCHAR *fileName)
             if (pageAnnots.Count() == 0)
                 continue;
             // get the page's /Annots array for appending
-            pdf_obj *annots = pdf_dict_gets(_pageObjs[pageNo - 1], "Annots");
+            pdf_obj *annots = pdf_dict_gets(pageObj, "Annots");
             if (!pdf_is_array(annots)) {
-                pdf_dict_puts_drop(_pageObjs[pageNo - 1], "Annots", pdf_new_array(_doc, (int)pageAnnots.Count()));
-                annots = pdf_dict_gets(_pageObjs[pageNo - 1], "Annots");
+                pdf_dict_puts_drop(pageObj, "Annots", pdf_new_array(_doc, (int)pageAnnots.Count()));
+                annots = pdf_dict_gets(pageObj, "Annots");
             }
             if (!pdf_is_indirect(annots)) {
                 // make /Annots indirect for the current /Page
-                pdf_dict_puts_drop(_pageObjs[pageNo - 1], "Annots", pdf_new_ref(_doc, annots));
+                pdf_dict_puts_drop(pageObj, "Annots", pdf_new_ref(_doc, annots));
             }
             // append all annotations for the current page
             for (size_t i = 0; i < pageAnnots.Count(); i++) {
-                ok &= pdf_file_update_add_annotation(_doc, page, _pageObjs[pageNo - 1], pageAnnots.At(i), annots);
+                ok &= pdf_file_update_add_annotation(_doc, page, pageObj, pageAnnots.At(i), annots);
             }
         }
         if (ok) {
@@ -2932,6 +4993,28 @@ bool PdfEngineImpl::SaveUserAnnots(const WCHAR *fileName)
     return ok;
 }
 
+bool PdfEngineImpl::SaveUserAnnotsInPlace()
+{
+    if (!userAnnots.Count())
+        return true;
+
+    int64 origSize = file::GetSize(_fileName);
+    if (origSize < 0)
+        return false;
+    if (SaveUserAnnots(_fileName))
+        return true;
+
+    // don't leave a partially written update behind
+    ScopedHandle h(CreateFile(_fileName, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr));
+    if (h.IsValid()) {
+        LARGE_INTEGER size;
+        size.QuadPart = origSize;
+        if (SetFilePointerEx(h, size, nullptr, FILE_BEGIN))
+            SetEndOfFile(h);
+    }
+    return false;
+}
+
 bool PdfEngineImpl::SaveEmbedded(LinkSaverUI& saveUI, int num, int gen)
 {
     ScopedCritSec scope(&ctxAccess);
@@ -3163,9 +5246,11 @@ bool PdfLink::SaveEmbedded(LinkSaverUI& saveUI)
     return engine->SaveEmbedded(saveUI, link->ld.launch.embedded_num, link->ld.launch.embedded_gen);
 }
 
-BaseEngine *PdfEngineImpl::CreateFromFile(const WCHAR *fileName, PasswordUI *pwdUI)
+BaseEngine *PdfEngineImpl::CreateFromFile(const WCHAR *fileName, PasswordUI *pwdUI, bool previewOnly)
 {
     PdfEngineImpl *engine = new PdfEngineImpl();
+    if (engine)
+        engine->previewOnly = previewOnly;
     if (!engine || !fileName || !engine->Load(fileName, pwdUI)) {
         delete engine;
         return nullptr;
@@ -3173,9 +5258,10 @@ BaseEngine *PdfEngineImpl::CreateFromFile(const WCHAR *fileName, PasswordUI *pwd
     return engine;
 }
 
-BaseEngine *PdfEngineImpl::CreateFromStream(IStream *stream, PasswordUI *pwdUI)
+BaseEngine *PdfEngineImpl::CreateFromStream(IStream *stream, PasswordUI *pwdUI, bool previewOnly)
 {
     PdfEngineImpl *engine = new PdfEngineImpl();
+    engine->previewOnly = previewOnly;
     if (!engine->Load(stream, pwdUI)) {
         delete engine;
         return nullptr;
@@ -3201,14 +5287,34 @@ bool IsSupportedFile(const WCHAR *fileName, bool sniff)
     return str::EndsWithI(fileName, L".pdf") || findEmbedMarks(fileName);
 }
 
-BaseEngine *CreateFromFile(const WCHAR *fileName, PasswordUI *pwdUI)
+BaseEngine *CreateFromFile(const WCHAR *fileName, PasswordUI *pwdUI, bool previewOnly)
+{
+    return PdfEngineImpl::CreateFromFile(fileName, pwdUI, previewOnly);
+}
+
+BaseEngine *CreateFromStream(IStream *stream, PasswordUI *pwdUI, bool previewOnly)
+{
+    return PdfEngineImpl::CreateFromStream(stream, pwdUI, previewOnly);
+}
+
+void SetMaxPageRunMemory(size_t maxBytes)
+{
+    gMaxPageRunMemory = maxBytes;
+}
+
+void SetMaxGlyphCacheMemory(size_t maxBytes)
 {
-    return PdfEngineImpl::CreateFromFile(fileName, pwdUI);
+    gMaxGlyphCacheMemory = maxBytes;
 }
 
-BaseEngine *CreateFromStream(IStream *stream, PasswordUI *pwdUI)
+void EnableThreadPoolDecoding()
 {
-    return PdfEngineImpl::CreateFromStream(stream, pwdUI);
+    fz_set_jpx_job_runner(fz_run_jobs_on_thread_pool);
+}
+
+void SetPageDataCache(WCHAR *(* getCachePath)(const WCHAR *filePath))
+{
+    gGetPageDataCachePath = getCachePath;
 }
 
 }
@@ -3378,11 +5484,17 @@ struct XpsPageRun {
         page(page), list(list), size_est(data.mem_estimate), refs(1) { }
 };
 
+// number of pages following the most recently rendered one which are
+// loaded (i.e. parsed and cached as display lists) in the background
+#define XPS_PREFETCH_PAGE_COUNT 3
+
 class XpsTocItem;
 class XpsImage;
+class XpsPagePrefetcher;
 
 class XpsEngineImpl : public BaseEngine {
     friend XpsImage;
+    friend XpsPagePrefetcher;
 
 public:
     XpsEngineImpl();
@@ -3400,6 +5512,9 @@ public:
     RenderedBitmap *RenderBitmap(int pageNo, float zoom, int rotation,
                          RectD *pageRect=nullptr, /* if nullptr: defaults to the page's mediabox */
                          RenderTarget target=Target_View, AbortCookie **cookie_out=nullptr) override;
+    bool RenderPage(HDC hDC, RectI screenRect, int pageNo, float zoom, int rotation=0,
+                    RectD *pageRect=nullptr, RenderTarget target=Target_View, AbortCookie **cookie_out=nullptr) override;
+    void SetRenderQuality(RenderQuality quality) override { renderQuality = quality; }
 
     PointD Transform(PointD pt, int pageNo, float zoom, int rotation, bool inverse=false) override;
     RectD Transform(RectD rect, int pageNo, float zoom, int rotation, bool inverse=false) override;
@@ -3409,9 +5524,15 @@ public:
     WCHAR * ExtractPageText(int pageNo, const WCHAR *lineSep, RectI **coordsOut=nullptr,
                                     RenderTarget target=Target_View) override {
         UNUSED(target);
-        return ExtractPageText(GetXpsPage(pageNo), lineSep, coordsOut);
+        etw::Span span("XpsExtractPageText", etw::KeywordSearch, pageNo);
+        WCHAR *text = ExtractPageText(GetXpsPage(pageNo), lineSep, coordsOut);
+        span.SetSize(str::Len(text));
+        return text;
     }
+    WCHAR * ExtractPageTextLimited(int pageNo, const WCHAR *lineSep, RectI **coordsOut,
+                                   DWORD timeoutMs, bool *partialOut, AbortCookie **cookie_out=nullptr) override;
     bool HasClipOptimizations(int pageNo) override;
+    void ReleaseCaches(bool inBackground) override;
     WCHAR *GetProperty(DocumentProperty prop) override;
 
     bool SupportsAnnotation(bool forSaving=false) const override;
@@ -3431,17 +5552,20 @@ public:
 
     fz_rect FindDestRect(const char *target);
 
-    static BaseEngine *CreateFromFile(const WCHAR *fileName);
-    static BaseEngine *CreateFromStream(IStream *stream);
+    static BaseEngine *CreateFromFile(const WCHAR *fileName, bool previewOnly=false);
+    static BaseEngine *CreateFromStream(IStream *stream, bool previewOnly=false);
 
 protected:
     WCHAR *_fileName;
+    // skip loading the outline (cf. PdfEngineImpl::previewOnly)
+    bool previewOnly;
+    // profile for Target_View renderings (cf. SetRenderQuality)
+    RenderQuality renderQuality;
 
     // make sure to never ask for _pagesAccess in an ctxAccess
     // protected critical section in order to avoid deadlocks
     CRITICAL_SECTION ctxAccess;
     fz_context *    ctx;
-    fz_locks_context fz_locks_ctx;
     xps_document *  _doc;
     fz_stream *     _docStream;
 
@@ -3464,7 +5588,8 @@ protected:
         return fz_create_view_ctm(xps_bound_page(_doc, page, &r), zoom, rotation);
     }
     WCHAR         * ExtractPageText(xps_page *page, const WCHAR *lineSep,
-                                    RectI **coordsOut=nullptr, bool cacheRun=false);
+                                    RectI **coordsOut=nullptr, bool cacheRun=false,
+                                    FitzAbortCookie *cookie=nullptr);
 
     Vec<XpsPageRun *> runCache; // ordered most recently used first
     XpsPageRun    * CreatePageRun(xps_page *page, fz_display_list *list);
@@ -3474,7 +5599,7 @@ protected:
                             FitzAbortCookie *cookie=nullptr);
     void            DropPageRun(XpsPageRun *run, bool forceRemove=false);
 
-    XpsTocItem    * BuildTocTree(fz_outline *entry, int& idCounter);
+    XpsTocItem    * BuildTocTree(fz_outline *entry, int& idCounter, PoolAllocator *allocator);
     void            LinkifyPageText(xps_page *page, int pageNo);
     RenderedBitmap *GetPageImage(int pageNo, RectD rect, size_t imageIx);
     WCHAR         * ExtractFontList();
@@ -3485,8 +5610,48 @@ protected:
     fz_rect      ** imageRects;
 
     Vec<PageAnnotation> userAnnots;
+
+    XpsPagePrefetcher * prefetcher;
+    // the page after which pages should be prefetched
+    volatile LONG   prefetchAfterPageNo;
+    // number of pages currently being rendered
+    LONG            renderRequests;
+    void            PrefetchPagesAfter(int pageNo);
+    int             NextPageToPrefetch();
+};
+
+// loads the pages following the most recently rendered one at a lower
+// priority so that scrolling through a document doesn't have to wait
+// for every single page to be parsed
+class XpsPagePrefetcher : public ThreadBase {
+    XpsEngineImpl *engine;
+
+public:
+    volatile bool finished;
+
+    explicit XpsPagePrefetcher(XpsEngineImpl *engine) :
+        ThreadBase("XpsPagePrefetcher"), engine(engine), finished(false) { }
+    virtual void Run() override;
 };
 
+void XpsPagePrefetcher::Run()
+{
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+
+    while (!WasCancelRequested()) {
+        // yield to pages which are to be rendered right away
+        if (engine->renderRequests > 0) {
+            Sleep(10);
+            continue;
+        }
+        int pageNo = engine->NextPageToPrefetch();
+        // stop at the first page that fails to load instead of retrying it
+        if (!pageNo || !engine->GetXpsPage(pageNo))
+            break;
+    }
+    finished = true;
+}
+
 class XpsLink : public PageElement, public PageDestination {
     XpsEngineImpl *engine;
     fz_link_dest *link; // owned by a fz_link or fz_outline
@@ -3559,20 +5724,24 @@ public:
     }
 };
 
-XpsEngineImpl::XpsEngineImpl() : _fileName(nullptr), _doc(nullptr), _docStream(nullptr), _pages(nullptr),
-    _mediaboxes(nullptr), _outline(nullptr), _info(nullptr), imageRects(nullptr)
+XpsEngineImpl::XpsEngineImpl() : _fileName(nullptr), previewOnly(false), renderQuality(Quality_Balanced), _doc(nullptr), _docStream(nullptr), _pages(nullptr),
+    _mediaboxes(nullptr), _outline(nullptr), _info(nullptr), imageRects(nullptr),
+    prefetcher(nullptr), prefetchAfterPageNo(0), renderRequests(0)
 {
     InitializeCriticalSection(&_pagesAccess);
     InitializeCriticalSection(&ctxAccess);
 
-    fz_locks_ctx.user = &ctxAccess;
-    fz_locks_ctx.lock = fz_lock_context_cs;
-    fz_locks_ctx.unlock = fz_unlock_context_cs;
-    ctx = fz_new_context(nullptr, &fz_locks_ctx, MAX_CONTEXT_MEMORY);
+    ctx = fz_new_engine_context(MAX_CONTEXT_MEMORY);
 }
 
 XpsEngineImpl::~XpsEngineImpl()
 {
+    if (prefetcher) {
+        prefetcher->RequestCancel();
+        prefetcher->Join();
+        delete prefetcher;
+    }
+
     EnterCriticalSection(&_pagesAccess);
     EnterCriticalSection(&ctxAccess);
 
@@ -3709,7 +5878,8 @@ bool XpsEngineImpl::LoadFromStream(fz_stream *stm)
         return false;
 
     fz_try(ctx) {
-        _outline = xps_load_outline(_doc);
+        if (!previewOnly)
+            _outline = xps_load_outline(_doc);
     }
     fz_catch(ctx) {
         fz_warn(ctx, "Couldn't load outline");
@@ -3806,7 +5976,7 @@ XpsPageRun *XpsEngineImpl::GetPageRun(xps_page *page, bool tryOnly)
         for (size_t i = 0; i < runCache.Count(); i++) {
             // drop page runs that take up too much memory due to huge images
             // (except for the very recently used ones)
-            if (i >= 2 && mem + runCache.At(i)->size_est >= MAX_PAGE_RUN_MEMORY)
+            if (i >= 2 && mem + runCache.At(i)->size_est >= gMaxPageRunMemory)
                 DropPageRun(runCache.At(i--), true);
             else
                 mem += runCache.At(i)->size_est;
@@ -3822,6 +5992,7 @@ XpsPageRun *XpsEngineImpl::GetPageRun(xps_page *page, bool tryOnly)
         fz_device *dev = nullptr;
         fz_var(list);
         fz_var(dev);
+        ScopedMemTraceTag memTag(MemTag_DisplayLists);
         fz_try(ctx) {
             list = fz_new_display_list(ctx);
             dev = fz_new_list_device(ctx, list);
@@ -3995,8 +6166,10 @@ RectD XpsEngineImpl::Transform(RectD rect, int pageNo, float zoom, int rotation,
 
 RenderedBitmap *XpsEngineImpl::RenderBitmap(int pageNo, float zoom, int rotation, RectD *pageRect, RenderTarget target, AbortCookie **cookie_out)
 {
-    UNUSED(target);
+    etw::Span span("XpsRenderBitmap", etw::KeywordRender, pageNo);
+    InterlockedIncrement(&renderRequests);
     xps_page* page = GetXpsPage(pageNo);
+    InterlockedDecrement(&renderRequests);
     if (!page)
         return nullptr;
 
@@ -4009,9 +6182,12 @@ RenderedBitmap *XpsEngineImpl::RenderBitmap(int pageNo, float zoom, int rotation
     fz_rect r = pRect;
     fz_irect bbox;
     fz_round_rect(&bbox, fz_transform_rect(&r, &ctm));
+    span.SetSize((int64)(bbox.x1 - bbox.x0) * (bbox.y1 - bbox.y0));
+    fz_scale_glyph_cache(ctx, zoom);
 
     fz_pixmap *image = nullptr;
     EnterCriticalSection(&ctxAccess);
+    fz_set_aa_level(ctx, fz_aa_level_for_quality(Target_View == target ? renderQuality : Quality_Print));
     fz_try(ctx) {
         fz_colorspace *colorspace = fz_device_rgb(ctx);
         image = fz_new_pixmap_with_bbox(ctx, colorspace, &bbox);
@@ -4037,7 +6213,13 @@ RenderedBitmap *XpsEngineImpl::RenderBitmap(int pageNo, float zoom, int rotation
     if (cookie_out)
         *cookie_out = cookie = new FitzAbortCookie();
     fz_rect cliprect;
+    InterlockedIncrement(&renderRequests);
     bool ok = RunPage(page, dev, &ctm, fz_rect_from_irect(&cliprect, &bbox), true, cookie);
+    InterlockedDecrement(&renderRequests);
+
+    // printing and exporting don't move on to the following pages on their own
+    if (ok && Target_View == target)
+        PrefetchPagesAfter(pageNo);
 
     ScopedCritSec scope(&ctxAccess);
 
@@ -4048,7 +6230,71 @@ RenderedBitmap *XpsEngineImpl::RenderBitmap(int pageNo, float zoom, int rotation
     return bitmap;
 }
 
-WCHAR *XpsEngineImpl::ExtractPageText(xps_page *page, const WCHAR *lineSep, RectI **coordsOut, bool cacheRun)
+bool XpsEngineImpl::RenderPage(HDC hDC, RectI screenRect, int pageNo, float zoom, int rotation, RectD *pageRect, RenderTarget target, AbortCookie **cookie_out)
+{
+    UNUSED(target);
+    InterlockedIncrement(&renderRequests);
+    xps_page* page = GetXpsPage(pageNo);
+    InterlockedDecrement(&renderRequests);
+    if (!page)
+        return false;
+
+    fz_rect pRect;
+    if (pageRect)
+        pRect = fz_RectD_to_rect(*pageRect);
+    else
+        xps_bound_page(_doc, page, &pRect);
+    fz_matrix ctm = viewctm(page, zoom, rotation);
+    fz_rect r = pRect;
+    fz_irect bbox;
+    fz_round_rect(&bbox, fz_transform_rect(&r, &ctm));
+    // move the rendered page rectangle to screenRect
+    fz_matrix offset;
+    fz_concat(&ctm, &ctm, fz_translate(&offset, (float)(screenRect.x - bbox.x0), (float)(screenRect.y - bbox.y0)));
+    fz_rect cliprect = fz_RectD_to_rect(screenRect.Convert<double>());
+
+    FitzAbortCookie *cookie = nullptr;
+    if (cookie_out)
+        *cookie_out = cookie = new FitzAbortCookie();
+    return fz_run_page_gdi(ctx, &ctxAccess, hDC, screenRect, [&](fz_device *dev) {
+        return RunPage(page, dev, &ctm, &cliprect, true, cookie);
+    });
+}
+
+void XpsEngineImpl::PrefetchPagesAfter(int pageNo)
+{
+    InterlockedExchange(&prefetchAfterPageNo, pageNo);
+    // a running prefetcher picks up the new page number on its own
+    if (prefetcher && !prefetcher->finished)
+        return;
+    if (!NextPageToPrefetch())
+        return;
+
+    if (prefetcher) {
+        prefetcher->Join();
+        delete prefetcher;
+    }
+    prefetcher = new XpsPagePrefetcher(this);
+    prefetcher->Start();
+}
+
+// returns the first not yet loaded page after prefetchAfterPageNo (or 0)
+int XpsEngineImpl::NextPageToPrefetch()
+{
+    ScopedCritSec scope(&_pagesAccess);
+
+    if (!_pages)
+        return 0;
+    int afterPageNo = prefetchAfterPageNo;
+    int lastPageNo = std::min(afterPageNo + XPS_PREFETCH_PAGE_COUNT, PageCount());
+    for (int pageNo = afterPageNo + 1; pageNo <= lastPageNo; pageNo++) {
+        if (!_pages[pageNo - 1])
+            return pageNo;
+    }
+    return 0;
+}
+
+WCHAR *XpsEngineImpl::ExtractPageText(xps_page *page, const WCHAR *lineSep, RectI **coordsOut, bool cacheRun, FitzAbortCookie *cookie)
 {
     if (!page)
         return nullptr;
@@ -4079,7 +6325,7 @@ WCHAR *XpsEngineImpl::ExtractPageText(xps_page *page, const WCHAR *lineSep, Rect
     // use an infinite rectangle as bounds (instead of a mediabox) to ensure that
     // the extracted text is consistent between cached runs using a list device and
     // fresh runs (otherwise the list device omits text outside the mediabox bounds)
-    RunPage(page, dev, &fz_identity, nullptr, cacheRun);
+    RunPage(page, dev, &fz_identity, nullptr, cacheRun, cookie);
 
     ScopedCritSec scope(&ctxAccess);
 
@@ -4090,6 +6336,24 @@ WCHAR *XpsEngineImpl::ExtractPageText(xps_page *page, const WCHAR *lineSep, Rect
     return content;
 }
 
+WCHAR *XpsEngineImpl::ExtractPageTextLimited(int pageNo, const WCHAR *lineSep, RectI **coordsOut, DWORD timeoutMs, bool *partialOut, AbortCookie **cookie_out)
+{
+    etw::Span span("XpsExtractPageText", etw::KeywordSearch, pageNo);
+    FitzAbortCookie *cookie = new FitzAbortCookie();
+    if (cookie_out)
+        *cookie_out = cookie;
+    WCHAR *text;
+    {
+        FitzAbortTimer timer(cookie, timeoutMs);
+        text = ExtractPageText(GetXpsPage(pageNo), lineSep, coordsOut, false, cookie);
+    }
+    span.SetSize(str::Len(text));
+    *partialOut = cookie->cookie.abort != 0;
+    if (!cookie_out)
+        delete cookie;
+    return text;
+}
+
 unsigned char *XpsEngineImpl::GetFileData(size_t *cbCount)
 {
     unsigned char *data = nullptr;
@@ -4140,10 +6404,37 @@ WCHAR *XpsEngineImpl::ExtractFontList()
     return fonts.Join(L"\n");
 }
 
+void XpsEngineImpl::ReleaseCaches(bool inBackground)
+{
+    // drop all display lists that aren't currently in use
+    // (DropPageRun acquires _pagesAccess before ctxAccess)
+    if (inBackground) {
+        ScopedCritSec scope(&_pagesAccess);
+        for (size_t i = runCache.Count(); i > 0; i--) {
+            XpsPageRun *run = runCache.At(i - 1);
+            if (1 == run->refs)
+                DropPageRun(run, true);
+        }
+    }
+
+    ScopedCritSec scope(&ctxAccess);
+    fz_set_store_max(ctx, inBackground ? MIN_CONTEXT_MEMORY : MAX_CONTEXT_MEMORY);
+}
+
 WCHAR *XpsEngineImpl::GetProperty(DocumentProperty prop)
 {
     if (Prop_FontList == prop)
         return ExtractFontList();
+    if (Prop_CacheStatistics == prop) {
+        size_t runBytes = 0, runCount = 0;
+        {
+            ScopedCritSec scope(&_pagesAccess);
+            for (size_t i = 0; i < runCache.Count(); i++)
+                runBytes += runCache.At(i)->size_est;
+            runCount = runCache.Count();
+        }
+        return fz_store_stats_to_str(ctx, runBytes, runCount);
+    }
     if (!_info)
         return nullptr;
 
@@ -4330,20 +6621,20 @@ PageDestination *XpsEngineImpl::GetNamedDest(const WCHAR *name)
     return nullptr;
 }
 
-XpsTocItem *XpsEngineImpl::BuildTocTree(fz_outline *entry, int& idCounter)
+XpsTocItem *XpsEngineImpl::BuildTocTree(fz_outline *entry, int& idCounter, PoolAllocator *allocator)
 {
     XpsTocItem *node = nullptr;
 
     for (; entry; entry = entry->next) {
         WCHAR *name = entry->title ? str::conv::FromUtf8(entry->title) : str::Dup(L"");
-        XpsTocItem *item = new XpsTocItem(name, XpsLink(this, &entry->dest));
+        XpsTocItem *item = new (allocator) XpsTocItem(name, XpsLink(this, &entry->dest));
         item->id = ++idCounter;
         item->open = entry->is_open;
 
         if (FZ_LINK_GOTO == entry->dest.kind)
             item->pageNo = entry->dest.ld.gotor.page + 1;
         if (entry->down)
-            item->child = BuildTocTree(entry->down, idCounter);
+            item->child = BuildTocTree(entry->down, idCounter, allocator);
 
         if (!node)
             node = item;
@@ -4360,7 +6651,14 @@ DocTocItem *XpsEngineImpl::GetTocTree()
         return nullptr;
 
     int idCounter = 0;
-    return BuildTocTree(_outline, idCounter);
+    PoolAllocator *allocator = new PoolAllocator();
+    XpsTocItem *root = BuildTocTree(_outline, idCounter, allocator);
+    if (!root) {
+        delete allocator;
+        return nullptr;
+    }
+    root->OwnAllocator();
+    return root;
 }
 
 bool XpsEngineImpl::HasClipOptimizations(int pageNo)
@@ -4378,9 +6676,11 @@ bool XpsEngineImpl::HasClipOptimizations(int pageNo)
     return true;
 }
 
-BaseEngine *XpsEngineImpl::CreateFromFile(const WCHAR *fileName)
+BaseEngine *XpsEngineImpl::CreateFromFile(const WCHAR *fileName, bool previewOnly)
 {
     XpsEngineImpl *engine = new XpsEngineImpl();
+    if (engine)
+        engine->previewOnly = previewOnly;
     if (!engine || !fileName || !engine->Load(fileName)) {
         delete engine;
         return nullptr;
@@ -4388,9 +6688,10 @@ BaseEngine *XpsEngineImpl::CreateFromFile(const WCHAR *fileName)
     return engine;
 }
 
-BaseEngine *XpsEngineImpl::CreateFromStream(IStream *stream)
+BaseEngine *XpsEngineImpl::CreateFromStream(IStream *stream, bool previewOnly)
 {
     XpsEngineImpl *engine = new XpsEngineImpl();
+    engine->previewOnly = previewOnly;
     if (!engine->Load(stream)) {
         delete engine;
         return nullptr;
@@ -4417,14 +6718,14 @@ bool IsSupportedFile(const WCHAR *fileName, bool sniff)
     return str::EndsWithI(fileName, L".xps") || str::EndsWithI(fileName, L".oxps");
 }
 
-BaseEngine *CreateFromFile(const WCHAR *fileName)
+BaseEngine *CreateFromFile(const WCHAR *fileName, bool previewOnly)
 {
-    return XpsEngineImpl::CreateFromFile(fileName);
+    return XpsEngineImpl::CreateFromFile(fileName, previewOnly);
 }
 
-BaseEngine *CreateFromStream(IStream *stream)
+BaseEngine *CreateFromStream(IStream *stream, bool previewOnly)
 {
-    return XpsEngineImpl::CreateFromStream(stream);
+    return XpsEngineImpl::CreateFromStream(stream, previewOnly);
 }
 
 }
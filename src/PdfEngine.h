@@ -4,15 +4,29 @@
 namespace PdfEngine {
 
 bool IsSupportedFile(const WCHAR *fileName, bool sniff=false);
-BaseEngine *CreateFromFile(const WCHAR *fileName, PasswordUI *pwdUI=nullptr);
-BaseEngine *CreateFromStream(IStream *stream, PasswordUI *pwdUI=nullptr);
+// previewOnly skips loading what's only needed for interactive viewing
+// (outline, attachments, page labels) for quicker thumbnails and indexing
+BaseEngine *CreateFromFile(const WCHAR *fileName, PasswordUI *pwdUI=nullptr, bool previewOnly=false);
+BaseEngine *CreateFromStream(IStream *stream, PasswordUI *pwdUI=nullptr, bool previewOnly=false);
+// limits the memory used for caching display lists per document
+// (shared by all clones of a document; also used for XPS documents)
+void SetMaxPageRunMemory(size_t maxBytes);
+// limits the memory the glyph cache of a document may grow to at high resolutions
+// (also used for XPS documents)
+void SetMaxGlyphCacheMemory(size_t maxBytes);
+// decodes JPEG 2000 images on the shared thread pool
+// (only for processes which keep the thread pool around, i.e. not for DLLs)
+void EnableThreadPoolDecoding();
+// getCachePath returns where the page sizes, content boxes and labels of a large
+// document are cached (or nullptr if they shouldn't be); the caller frees the result
+void SetPageDataCache(WCHAR *(* getCachePath)(const WCHAR *filePath));
 
 }
 
 namespace XpsEngine {
 
 bool IsSupportedFile(const WCHAR *fileName, bool sniff=false);
-BaseEngine *CreateFromFile(const WCHAR *fileName);
-BaseEngine *CreateFromStream(IStream *stream);
+BaseEngine *CreateFromFile(const WCHAR *fileName, bool previewOnly=false);
+BaseEngine *CreateFromStream(IStream *stream, bool previewOnly=false);
 
 }
@@ -38,6 +38,19 @@ struct PdfsyncPoint {
     UINT page, x, y;
 };
 
+// for looking up lines by file and line number (instead of scanning all of a file's lines)
+struct PdfsyncSortedLine {
+    size_t file;
+    UINT line;
+    size_t ix; // index into lines
+};
+
+// for looking up points by record (instead of scanning all points)
+struct PdfsyncRecordPoint {
+    UINT record;
+    size_t ix; // index into points
+};
+
 // Synchronizer based on .pdfsync file generated with the pdfsync tex package
 class Pdfsync : public Synchronizer
 {
@@ -53,6 +66,7 @@ public:
 
 private:
     int RebuildIndex();
+    void BuildLookupTables();
     UINT SourceToRecord(const WCHAR* srcfilename, UINT line, UINT col, Vec<size_t>& records);
 
     BaseEngine *engine;         // needed for converting between coordinate systems
@@ -61,6 +75,8 @@ private:
     Vec<PdfsyncPoint> points;   // record-to-point mapping
     Vec<PdfsyncFileIndex> fileIndex; // start and end of entries for a file in <lines>
     Vec<size_t> sheetIndex;     // start of entries for a sheet in <points>
+    Vec<PdfsyncSortedLine> sortedLines;   // <lines> sorted by file, line and declaration
+    Vec<PdfsyncRecordPoint> recordPoints; // <points> sorted by record and declaration
 };
 
 // Synchronizer based on .synctex file generated with SyncTex
@@ -68,23 +84,39 @@ class SyncTex : public Synchronizer
 {
 public:
     SyncTex(const WCHAR* syncfilename, BaseEngine *engine) :
-        Synchronizer(syncfilename), engine(engine), scanner(nullptr)
+        Synchronizer(syncfilename), engine(engine), scanner(nullptr),
+        rebuildThread(nullptr), nextScanner(nullptr)
     {
         assert(str::EndsWithI(syncfilename, SYNCTEX_EXTENSION));
     }
     virtual ~SyncTex()
     {
+        if (rebuildThread) {
+            WaitForSingleObject(rebuildThread, INFINITE);
+            CloseHandle(rebuildThread);
+        }
+        synctex_scanner_free(nextScanner);
         synctex_scanner_free(scanner);
     }
 
     virtual int DocToSource(UINT pageNo, PointI pt, ScopedMem<WCHAR>& filename, UINT *line, UINT *col);
     virtual int SourceToDoc(const WCHAR* srcfilename, UINT line, UINT col, UINT *page, Vec<RectI> &rects);
 
+    void StartRebuildIndex();
+
 private:
     int RebuildIndex();
+    synctex_scanner_t LoadScanner();
+    static DWORD WINAPI RebuildIndexThread(LPVOID data);
 
     BaseEngine *engine; // needed for converting between coordinate systems
     synctex_scanner_t scanner;
+
+    // the index is rebuilt in the background as soon as a document has been
+    // (re)loaded, and swapped in at the next request (waiting for it if needed)
+    HANDLE rebuildThread;
+    synctex_scanner_t nextScanner;
+    struct _stat nextScannerStamp;
 };
 
 Synchronizer::Synchronizer(const WCHAR* syncfilepath) :
@@ -111,11 +143,14 @@ bool Synchronizer::IsIndexDiscarded() const
     return false;
 }
 
-int Synchronizer::RebuildIndex()
+int Synchronizer::RebuildIndex(const struct _stat *stamp)
 {
     indexDiscarded = false;
     // save sync file timestamp
-    _wstat(syncfilepath, &syncfileTimestamp);
+    if (stamp)
+        syncfileTimestamp = *stamp;
+    else
+        _wstat(syncfilepath, &syncfileTimestamp);
     return PDFSYNCERR_SUCCESS;
 }
 
@@ -153,7 +188,11 @@ int Synchronizer::Create(const WCHAR *pdffilename, BaseEngine *engine, Synchroni
     if (file::Exists(texGzFile) || file::Exists(texFile)) {
         // due to a bug with synctex_parser.c, this must always be
         // the path to the .synctex file (even if a .synctex.gz file is used instead)
-        *sync = new SyncTex(texFile, engine);
+        SyncTex *synctex = new SyncTex(texFile, engine);
+        // parsing large .synctex.gz files takes a while
+        if (synctex)
+            synctex->StartRebuildIndex();
+        *sync = synctex;
         return *sync ? PDFSYNCERR_SUCCESS : PDFSYNCERR_OUTOFMEMORY;
     }
 
@@ -318,12 +357,57 @@ int Pdfsync::RebuildIndex()
     fileIndex.At(0).end = lines.Count();
     assert(filestack.Count() == 1);
 
+    BuildLookupTables();
+
     return Synchronizer::RebuildIndex();
 }
 
+static int cmpSortedLines(const void *a, const void *b)
+{
+    const PdfsyncSortedLine *la = (const PdfsyncSortedLine *)a, *lb = (const PdfsyncSortedLine *)b;
+    if (la->file != lb->file)
+        return la->file < lb->file ? -1 : 1;
+    if (la->line != lb->line)
+        return la->line < lb->line ? -1 : 1;
+    return la->ix < lb->ix ? -1 : la->ix > lb->ix ? 1 : 0;
+}
+
+static int cmpRecordPoints(const void *a, const void *b)
+{
+    const PdfsyncRecordPoint *pa = (const PdfsyncRecordPoint *)a, *pb = (const PdfsyncRecordPoint *)b;
+    if (pa->record != pb->record)
+        return pa->record < pb->record ? -1 : 1;
+    return pa->ix < pb->ix ? -1 : pa->ix > pb->ix ? 1 : 0;
+}
+
+// large documents have hundreds of thousands of records, so that
+// forward search needs sorted tables for binary searching them
+void Pdfsync::BuildLookupTables()
+{
+    sortedLines.Reset();
+    for (size_t i = 0; i < lines.Count(); i++) {
+        PdfsyncSortedLine sl = { lines.At(i).file, lines.At(i).line, i };
+        sortedLines.Append(sl);
+    }
+    sortedLines.Sort(cmpSortedLines);
+
+    recordPoints.Reset();
+    for (size_t i = 0; i < points.Count(); i++) {
+        PdfsyncRecordPoint rp = { points.At(i).record, i };
+        recordPoints.Append(rp);
+    }
+    recordPoints.Sort(cmpRecordPoints);
+}
+
 // convert a coordinate from the sync file into a PDF coordinate
 #define SYNC_TO_PDF_COORDINATE(c)  (c/65781.76)
 
+static int cmpSizeT(const void *a, const void *b)
+{
+    size_t sa = *(const size_t *)a, sb = *(const size_t *)b;
+    return sa < sb ? -1 : sa > sb ? 1 : 0;
+}
+
 static int cmpLineRecords(const void *a, const void *b)
 {
     return ((PdfsyncLine *)a)->record - ((PdfsyncLine *)b)->record;
@@ -426,22 +510,37 @@ UINT Pdfsync::SourceToRecord(const WCHAR* srcfilename, UINT line, UINT col, Vec<
     if (fileIndex.At(isrc).start == fileIndex.At(isrc).end)
         return PDFSYNCERR_NORECORD_IN_SOURCEFILE; // there is not any record declaration for that particular source file
 
-    // look for sections belonging to the specified file
-    // starting with the first section that is declared within the scope of the file.
+    // find the first of this file's lines at or after the requested one
+    size_t lo = 0, hi = sortedLines.Count();
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const PdfsyncSortedLine& sl = sortedLines.At(mid);
+        if (sl.file < isrc || (sl.file == isrc && sl.line < line))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    // pick the closest line (within EPSILON_LINE) and prefer
+    // the record declared first if two lines are equally close
     UINT min_distance = EPSILON_LINE; // distance to the closest record
     size_t lineIx = (size_t)-1; // closest record-line index
-
-    for (size_t isec = fileIndex.At(isrc).start; isec < fileIndex.At(isrc).end; isec++) {
-        // does this section belong to the desired file?
-        if (lines.At(isec).file != isrc)
-            continue;
-
-        UINT d = abs((int)lines.At(isec).line - (int)line);
+    if (lo < sortedLines.Count() && sortedLines.At(lo).file == isrc) {
+        UINT d = sortedLines.At(lo).line - line;
         if (d < min_distance) {
             min_distance = d;
-            lineIx = isec;
-            if (0 == d)
-                break; // We have found a record for the requested line!
+            lineIx = sortedLines.At(lo).ix;
+        }
+    }
+    if (lo > 0 && sortedLines.At(lo - 1).file == isrc && min_distance > 0) {
+        // the first declared record for the preceding line
+        size_t below = lo - 1;
+        while (below > 0 && sortedLines.At(below - 1).file == isrc && sortedLines.At(below - 1).line == sortedLines.At(lo - 1).line)
+            below--;
+        UINT d = line - sortedLines.At(below).line;
+        if (d < min_distance || (d == min_distance && lineIx != (size_t)-1 && sortedLines.At(below).ix < lineIx)) {
+            min_distance = d;
+            lineIx = sortedLines.At(below).ix;
         }
     }
     if (lineIx == (size_t)-1)
@@ -468,16 +567,34 @@ int Pdfsync::SourceToDoc(const WCHAR* srcfilename, UINT line, UINT col, UINT *pa
     rects.Reset();
 
     // records have been found for the desired source position:
-    // we now find the page and positions in the PDF corresponding to these found records
+    // we now find the positions in the PDF corresponding to these found records
+    Vec<size_t> found_points;
+    for (size_t i = 0; i < found_records.Count(); i++) {
+        UINT record = (UINT)found_records.At(i);
+        size_t lo = 0, hi = recordPoints.Count();
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (recordPoints.At(mid).record < record)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        for (; lo < recordPoints.Count() && recordPoints.At(lo).record == record; lo++) {
+            if (!found_points.Contains(recordPoints.At(lo).ix))
+                found_points.Append(recordPoints.At(lo).ix);
+        }
+    }
+    // all points have to be on the page of the first declared one
+    found_points.Sort(cmpSizeT);
+
     UINT firstPage = UINT_MAX;
-    for (size_t i = 0; i < points.Count(); i++) {
-        if (!found_records.Contains(points.At(i).record))
+    for (size_t i = 0; i < found_points.Count(); i++) {
+        const PdfsyncPoint& pt = points.At(found_points.At(i));
+        if (firstPage != UINT_MAX && firstPage != pt.page)
             continue;
-        if (firstPage != UINT_MAX && firstPage != points.At(i).page)
-            continue;
-        firstPage = *page = points.At(i).page;
-        RectD rc(SYNC_TO_PDF_COORDINATE(points.At(i).x),
-                 SYNC_TO_PDF_COORDINATE(points.At(i).y),
+        firstPage = *page = pt.page;
+        RectD rc(SYNC_TO_PDF_COORDINATE(pt.x),
+                 SYNC_TO_PDF_COORDINATE(pt.y),
                  MARK_SIZE, MARK_SIZE);
         // PdfSync coordinates are y-inversed
         RectD mbox = engine->PageMediabox(firstPage);
@@ -493,15 +610,47 @@ int Pdfsync::SourceToDoc(const WCHAR* srcfilename, UINT line, UINT col, UINT *pa
 
 // SYNCTEX synchronizer
 
+synctex_scanner_t SyncTex::LoadScanner()
+{
+    ScopedMem<char> syncfname(str::conv::ToAnsi(syncfilepath));
+    if (!syncfname)
+        return nullptr;
+    return synctex_scanner_new_with_output_file(syncfname, nullptr, 1);
+}
+
+DWORD WINAPI SyncTex::RebuildIndexThread(LPVOID data)
+{
+    SyncTex *sync = (SyncTex *)data;
+    // changes made while parsing must still be detected afterwards
+    _wstat(sync->syncfilepath, &sync->nextScannerStamp);
+    sync->nextScanner = sync->LoadScanner();
+    return 0;
+}
+
+void SyncTex::StartRebuildIndex()
+{
+    if (!rebuildThread)
+        rebuildThread = CreateThread(nullptr, 0, RebuildIndexThread, this, 0, nullptr);
+}
+
 int SyncTex::RebuildIndex() {
     synctex_scanner_free(scanner);
     scanner = nullptr;
 
-    ScopedMem<char> syncfname(str::conv::ToAnsi(syncfilepath));
-    if (!syncfname)
-        return PDFSYNCERR_OUTOFMEMORY;
+    if (rebuildThread) {
+        WaitForSingleObject(rebuildThread, INFINITE);
+        CloseHandle(rebuildThread);
+        rebuildThread = nullptr;
+        // the sync file might not have been completely written yet when
+        // parsing started, so failing to parse it is retried below
+        if (nextScanner) {
+            scanner = nextScanner;
+            nextScanner = nullptr;
+            return Synchronizer::RebuildIndex(&nextScannerStamp);
+        }
+    }
 
-    scanner = synctex_scanner_new_with_output_file(syncfname, nullptr, 1);
+    scanner = LoadScanner();
     if (!scanner)
         return PDFSYNCERR_SYNCFILE_NOTFOUND; // cannot rebuild the index
 
@@ -47,7 +47,9 @@ private:
 
 protected:
     bool IsIndexDiscarded() const;
-    int RebuildIndex();
+    // stamp is the sync file's time stamp from before it was parsed
+    // (if the index was rebuilt in the background)
+    int RebuildIndex(const struct _stat *stamp=nullptr);
     WCHAR * PrependDir(const WCHAR* filename) const;
 
     ScopedMem<WCHAR> syncfilepath;  // path to the synchronization file
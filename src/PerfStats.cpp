@@ -0,0 +1,215 @@
+/* Copyright 2015 the SumatraPDF project authors (see AUTHORS file).
+   License: GPLv3 */
+
+// utils
+#include "BaseUtil.h"
+#include "FileUtil.h"
+#include "SquareTreeParser.h"
+#include "WinUtil.h"
+// rendering engines
+#include "BaseEngine.h"
+#include "EngineManager.h"
+// ui
+#include "SumatraPDF.h"
+#include "AppTools.h"
+#include "PerfStats.h"
+#include "Version.h"
+
+#define PERF_STATS_FILE_NAME    L"SumatraPDF-perfstats.txt"
+#define PERF_REPORT_FILE_NAME   L"SumatraPDF-perfreport.txt"
+
+// bucket 0 counts samples below 1 ms, bucket i samples from 2^(i-1) up to 2^i ms
+// and the last bucket all samples above 2^(PERF_STAT_BUCKETS-2) ms (about 4 minutes)
+#define PERF_STAT_BUCKETS       20
+// the highest engine type (cf. EngineManager.h)
+#define ENGINE_TYPE_COUNT       (Engine_Txt + 1)
+
+struct PerfHistogram {
+    uint32  counts[PERF_STAT_BUCKETS];
+    double  maxMs;
+};
+
+static PerfHistogram gHistograms[ENGINE_TYPE_COUNT][PerfStat_Count];
+static CRITICAL_SECTION gStatsAccess;
+static bool gStatsAccessInited = false;
+
+static const char *gEngineTypeNames[ENGINE_TYPE_COUNT] = {
+    nullptr, "PDF", "XPS", "DjVu", "Image", "ImageDir", "ComicBook", "PS",
+    "Epub", "Fb2", "Mobi", "Pdb", "Chm", "Html", "Txt",
+};
+
+static const char *gStatNames[PerfStat_Count] = {
+    "RenderLatency", "LoadTime", "LayoutTime",
+};
+
+static CRITICAL_SECTION *GetStatsAccess()
+{
+    if (!gStatsAccessInited) {
+        InitializeCriticalSection(&gStatsAccess);
+        gStatsAccessInited = true;
+    }
+    return &gStatsAccess;
+}
+
+static int BucketForTime(double ms)
+{
+    int bucket = 0;
+    for (double limit = 1.0; ms >= limit && bucket < PERF_STAT_BUCKETS - 1; limit *= 2)
+        bucket++;
+    return bucket;
+}
+
+// upper bound (in ms) of the times counted in a bucket
+static int BucketLimit(int bucket)
+{
+    return 1 << bucket;
+}
+
+static uint32 GetTotalCount(PerfHistogram *h)
+{
+    uint32 total = 0;
+    for (int i = 0; i < PERF_STAT_BUCKETS; i++) {
+        total += h->counts[i];
+    }
+    return total;
+}
+
+namespace perfstats {
+
+void Record(PerfStatType stat, EngineType engineType, double ms)
+{
+    CrashIf(stat < 0 || stat >= PerfStat_Count);
+    if (engineType <= Engine_None || engineType >= ENGINE_TYPE_COUNT)
+        return;
+    ScopedCritSec scope(GetStatsAccess());
+    PerfHistogram *h = &gHistograms[engineType][stat];
+    h->counts[BucketForTime(ms)]++;
+    h->maxMs = std::max(h->maxMs, ms);
+}
+
+/* the statistics are stored in SquareTree format, e.g.
+
+PDF [
+    RenderLatency = 12 40 83 20 3 0 ...
+    RenderLatencyMax = 97.2
+]
+*/
+
+bool Load()
+{
+    ScopedMem<WCHAR> path(AppGenDataFilename(PERF_STATS_FILE_NAME));
+    ScopedMem<char> data(file::ReadAll(path, nullptr));
+    if (!data)
+        return false;
+    SquareTree sqt(data);
+    if (!sqt.root)
+        return false;
+
+    ScopedCritSec scope(GetStatsAccess());
+    for (int type = Engine_None + 1; type < ENGINE_TYPE_COUNT; type++) {
+        SquareTreeNode *node = sqt.root->GetChild(gEngineTypeNames[type]);
+        if (!node)
+            continue;
+        for (int stat = 0; stat < PerfStat_Count; stat++) {
+            PerfHistogram *h = &gHistograms[type][stat];
+            const char *counts = node->GetValue(gStatNames[stat]);
+            for (int i = 0; counts && i < PERF_STAT_BUCKETS; i++) {
+                counts = str::Parse(counts, "%_%u", &h->counts[i]);
+            }
+            ScopedMem<char> maxKey(str::Format("%sMax", gStatNames[stat]));
+            const char *maxMs = node->GetValue(maxKey);
+            if (maxMs)
+                h->maxMs = atof(maxMs);
+        }
+    }
+    return true;
+}
+
+bool Save()
+{
+    if (!HasPermission(Perm_SavePreferences))
+        return false;
+
+    str::Str<char> data;
+    {
+        ScopedCritSec scope(GetStatsAccess());
+        for (int type = Engine_None + 1; type < ENGINE_TYPE_COUNT; type++) {
+            bool hasData = false;
+            for (int stat = 0; stat < PerfStat_Count && !hasData; stat++) {
+                hasData = GetTotalCount(&gHistograms[type][stat]) > 0;
+            }
+            if (!hasData)
+                continue;
+            data.AppendFmt("%s [\r\n", gEngineTypeNames[type]);
+            for (int stat = 0; stat < PerfStat_Count; stat++) {
+                PerfHistogram *h = &gHistograms[type][stat];
+                data.AppendFmt("\t%s =", gStatNames[stat]);
+                for (int i = 0; i < PERF_STAT_BUCKETS; i++) {
+                    data.AppendFmt(" %u", h->counts[i]);
+                }
+                data.AppendFmt("\r\n\t%sMax = %.1f\r\n", gStatNames[stat], h->maxMs);
+            }
+            data.Append("]\r\n");
+        }
+    }
+    if (data.Size() == 0)
+        return true;
+
+    ScopedMem<WCHAR> path(AppGenDataFilename(PERF_STATS_FILE_NAME));
+    return file::WriteAll(path, data.Get(), data.Size());
+}
+
+// returns the upper bound of the bucket containing the given percentile
+static int GetPercentile(PerfHistogram *h, uint32 total, int percent)
+{
+    uint64 needed = ((uint64)total * percent + 99) / 100;
+    uint64 seen = 0;
+    for (int i = 0; i < PERF_STAT_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= needed)
+            return BucketLimit(i);
+    }
+    return BucketLimit(PERF_STAT_BUCKETS - 1);
+}
+
+char *FormatReport()
+{
+    str::Str<char> report;
+    report.AppendFmt("SumatraPDF %s performance statistics\r\n", CURR_VERSION_STRA);
+    report.Append("(times in ms; percentiles give the upper bound of the histogram bucket)\r\n");
+
+    ScopedCritSec scope(GetStatsAccess());
+    for (int type = Engine_None + 1; type < ENGINE_TYPE_COUNT; type++) {
+        bool hasHeader = false;
+        for (int stat = 0; stat < PerfStat_Count; stat++) {
+            PerfHistogram *h = &gHistograms[type][stat];
+            uint32 total = GetTotalCount(h);
+            if (0 == total)
+                continue;
+            if (!hasHeader) {
+                report.AppendFmt("\r\n%s\r\n", gEngineTypeNames[type]);
+                hasHeader = true;
+            }
+            report.AppendFmt("  %s: %u samples, median < %d, 90%% < %d, 99%% < %d, max %.1f\r\n   ",
+                             gStatNames[stat], total, GetPercentile(h, total, 50),
+                             GetPercentile(h, total, 90), GetPercentile(h, total, 99), h->maxMs);
+            for (int i = 0; i < PERF_STAT_BUCKETS; i++) {
+                if (h->counts[i] > 0)
+                    report.AppendFmt(" <%d: %u", BucketLimit(i), h->counts[i]);
+            }
+            report.Append("\r\n");
+        }
+    }
+    return report.StealData();
+}
+
+bool ShowReport()
+{
+    ScopedMem<char> report(FormatReport());
+    ScopedMem<WCHAR> path(AppGenDataFilename(PERF_REPORT_FILE_NAME));
+    if (!path || !file::WriteAll(path, report.Get(), str::Len(report)))
+        return false;
+    return LaunchFile(path);
+}
+
+}
@@ -0,0 +1,30 @@
+/* Copyright 2015 the SumatraPDF project authors (see AUTHORS file).
+   License: GPLv3 */
+
+// locally persisted statistics about how long documents take to load,
+// lay out and render (nothing of this ever leaves the user's computer)
+
+enum PerfStatType {
+    // time from requesting a tile until it's first painted
+    PerfStat_RenderLatency,
+    // time for creating the engine or controller for a document
+    PerfStat_LoadTime,
+    // time for laying out the pages of a document
+    PerfStat_LayoutTime,
+    PerfStat_Count
+};
+
+namespace perfstats {
+
+// thread-safe, records a single sample into a log2 bucketed histogram
+void Record(PerfStatType stat, EngineType engineType, double ms);
+
+bool Load();
+bool Save();
+// returns a human readable summary of all histograms
+// (e.g. for attaching to a bug report)
+char *FormatReport();
+// writes the summary to a text file in the app data directory and opens it
+bool ShowReport();
+
+}
@@ -4,6 +4,7 @@
 // utils
 #include "BaseUtil.h"
 #include "FileUtil.h"
+#include "ThreadUtil.h"
 #include "UITask.h"
 #include "WinUtil.h"
 // rendering engines
@@ -22,6 +23,7 @@
 #include "WindowInfo.h"
 #include "TabInfo.h"
 #include "AppUtil.h"
+#include "CrashHandler.h"
 #include "Notifications.h"
 #include "Print.h"
 #include "Selection.h"
@@ -37,11 +39,13 @@ struct PrintData {
     Vec<SelectionOnPage> sel;   // empty when printing a page range
     Print_Advanced_Data advData;
     int rotation;
+    bool asVectors;
 
     PrintData(BaseEngine *engine, PRINTER_INFO_2 *printerInfo, DEVMODE *devMode,
               Vec<PRINTPAGERANGE> &ranges, Print_Advanced_Data &advData, int rotation = 0,
               Vec<SelectionOnPage> *sel = nullptr)
-        : engine(nullptr), advData(advData), rotation(rotation) {
+        : engine(nullptr), advData(advData), rotation(rotation),
+          asVectors(gGlobalPrefs->printerDefaults.printAsVectors) {
         if (engine)
             this->engine = engine->Clone();
 
@@ -106,6 +110,322 @@ static RectD BoundSelectionOnPage(const Vec<SelectionOnPage> &sel, int pageNo) {
     return bounds;
 }
 
+// at most this many bitmaps are rendered ahead of the one being spooled
+#define MAX_PRINT_RENDER_AHEAD          4
+// and they shouldn't need more memory than this
+#define MAX_PRINT_RENDER_AHEAD_BYTES    (256 * 1024 * 1024)
+// pages needing larger bitmaps are rendered in horizontal bands
+#define MAX_PRINT_BITMAP_BYTES          (64 * 1024 * 1024)
+#define MAX_PRINT_BAND_BYTES            (16 * 1024 * 1024)
+
+// a bitmap to be rendered and sent to the printer
+struct PrintJob {
+    int pageNo;
+    float zoom;
+    int rotation;
+    RectD *clip; // nullptr for the whole page
+    PointI offset;
+    // a page consists of one or more jobs (one per selection rectangle)
+    bool startsPage;
+    // set for jobs too large for rendering into a single bitmap
+    bool banded;
+};
+
+// returns the job's bitmap rectangle in device coordinates
+static RectI GetPrintJobRect(BaseEngine &engine, const PrintJob &job) {
+    RectD area = job.clip ? *job.clip : engine.PageMediabox(job.pageNo);
+    return engine.Transform(area, job.pageNo, job.zoom, job.rotation).Round();
+}
+
+static size_t GetPrintJobBitmapSize(BaseEngine &engine, const PrintJob &job) {
+    RectI rect = GetPrintJobRect(engine, job);
+    return (size_t)std::max(rect.dx, 0) * (size_t)std::max(rect.dy, 0) * 4;
+}
+
+class PrintRenderAhead;
+
+class PrintRenderWorker : public ThreadBase {
+    PrintRenderAhead *ahead;
+    BaseEngine *clone;
+
+  public:
+    AbortCookieManager cookie;
+
+    explicit PrintRenderWorker(PrintRenderAhead *ahead)
+        : ThreadBase("PrintRenderWorker"), ahead(ahead), clone(nullptr) {}
+    virtual ~PrintRenderWorker() { delete clone; }
+    virtual void Run() override;
+};
+
+// renders upcoming print jobs on worker threads (each using its own engine clone)
+// while the print thread spools the current bitmap, so that printing isn't blocked
+// on rendering one page after the other
+class PrintRenderAhead {
+    CRITICAL_SECTION access;
+    // signaled whenever a worker has finished a job (auto-reset, for the print thread)
+    HANDLE jobFinished;
+    // signaled whenever the print thread has taken a bitmap (manual-reset, for all workers)
+    HANDLE bitmapTaken;
+    // signaled when the workers are to stop
+    HANDLE cancel;
+    PrintRenderWorker *workers[MAX_PRINT_RENDER_AHEAD];
+    int workerCount;
+    RenderedBitmap **bitmaps;
+    bool *rendered;
+    size_t nextJob;
+    size_t consumed;
+    size_t maxAhead;
+
+  public:
+    BaseEngine *engine;
+    Vec<PrintJob> &jobs;
+
+    PrintRenderAhead(BaseEngine *engine, Vec<PrintJob> &jobs, bool renderAhead);
+    ~PrintRenderAhead();
+
+    bool ClaimJob(size_t *idx, bool *wait);
+    bool WaitForBitmapTaken();
+    void FinishJob(size_t idx, RenderedBitmap *bmp);
+    bool TakeBitmap(size_t idx, RenderedBitmap **bmp, ProgressUpdateUI *progressUI);
+};
+
+PrintRenderAhead::PrintRenderAhead(BaseEngine *engine, Vec<PrintJob> &jobs, bool renderAhead)
+    : workerCount(0), nextJob(0), consumed(0), maxAhead(0), engine(engine), jobs(jobs) {
+    InitializeCriticalSection(&access);
+    jobFinished = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    bitmapTaken = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    cancel = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    bitmaps = AllocArray<RenderedBitmap *>(jobs.Count());
+    rendered = AllocArray<bool>(jobs.Count());
+    if (!renderAhead || jobs.Count() < 2)
+        return;
+
+    // limit the number of bitmaps kept in memory (based on the first job's size)
+    size_t bmpSize = std::max(GetPrintJobBitmapSize(*engine, jobs.At(0)), (size_t)1);
+    maxAhead = limitValue(MAX_PRINT_RENDER_AHEAD_BYTES / bmpSize, (size_t)1, (size_t)MAX_PRINT_RENDER_AHEAD);
+
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    int count = limitValue((int)si.dwNumberOfProcessors, 1, (int)maxAhead);
+    for (int i = 0; i < count; i++) {
+        workers[i] = new PrintRenderWorker(this);
+        workers[i]->Start();
+    }
+    workerCount = count;
+}
+
+PrintRenderAhead::~PrintRenderAhead() {
+    for (int i = 0; i < workerCount; i++) {
+        workers[i]->RequestCancel();
+        workers[i]->cookie.Abort();
+    }
+    SetEvent(cancel);
+    for (int i = 0; i < workerCount; i++) {
+        workers[i]->Join();
+        delete workers[i];
+    }
+    for (size_t i = 0; i < jobs.Count(); i++) {
+        delete bitmaps[i];
+    }
+    free(bitmaps);
+    free(rendered);
+    CloseHandle(jobFinished);
+    CloseHandle(bitmapTaken);
+    CloseHandle(cancel);
+    DeleteCriticalSection(&access);
+}
+
+// returns false if there's no job to render (*wait is true if the
+// print thread has to catch up before the next job may be rendered)
+bool PrintRenderAhead::ClaimJob(size_t *idx, bool *wait) {
+    ScopedCritSec scope(&access);
+    *wait = nextJob < jobs.Count() && nextJob >= consumed + maxAhead;
+    // reset while still holding the lock, so that TakeBitmap can't advance
+    // consumed unnoticed before the worker starts waiting
+    if (*wait)
+        ResetEvent(bitmapTaken);
+    if (nextJob >= jobs.Count() || *wait)
+        return false;
+    *idx = nextJob++;
+    return true;
+}
+
+// blocks until the print thread has caught up (returns false if canceled)
+bool PrintRenderAhead::WaitForBitmapTaken() {
+    HANDLE handles[2] = { bitmapTaken, cancel };
+    return WaitForMultipleObjects(dimof(handles), handles, FALSE, INFINITE) == WAIT_OBJECT_0;
+}
+
+void PrintRenderAhead::FinishJob(size_t idx, RenderedBitmap *bmp) {
+    ScopedCritSec scope(&access);
+    bitmaps[idx] = bmp;
+    rendered[idx] = true;
+    SetEvent(jobFinished);
+}
+
+// returns false if the job hasn't been rendered ahead (i.e. must be rendered
+// by the caller), else *bmp is the rendered bitmap (or nullptr if rendering failed)
+bool PrintRenderAhead::TakeBitmap(size_t idx, RenderedBitmap **bmp, ProgressUpdateUI *progressUI) {
+    *bmp = nullptr;
+    for (;;) {
+        {
+            ScopedCritSec scope(&access);
+            if (consumed != idx + 1) {
+                consumed = idx + 1;
+                SetEvent(bitmapTaken);
+            }
+            if (rendered[idx]) {
+                *bmp = bitmaps[idx];
+                bitmaps[idx] = nullptr;
+                return true;
+            }
+            if (0 == workerCount || nextJob <= idx) {
+                // the workers haven't got this far, so skip this job
+                nextJob = std::max(nextJob, idx + 1);
+                return false;
+            }
+        }
+        if (progressUI && progressUI->WasCanceled())
+            return false;
+        // canceling isn't signaled, so check for it every now and then
+        WaitForSingleObject(jobFinished, 100);
+    }
+}
+
+void PrintRenderWorker::Run() {
+    // cloning the engine on the worker allows for several clones to be created at once
+    // (fall back to the thread-safe original if cloning fails)
+    clone = ahead->engine->Clone();
+    BaseEngine *engine = clone ? clone : ahead->engine;
+
+    while (!WasCancelRequested()) {
+        size_t idx;
+        bool wait;
+        if (!ahead->ClaimJob(&idx, &wait)) {
+            if (!wait || !ahead->WaitForBitmapTaken())
+                break;
+            continue;
+        }
+        PrintJob &job = ahead->jobs.At(idx);
+        if (job.banded) {
+            // the print thread renders the bands itself
+            ahead->FinishJob(idx, nullptr);
+            continue;
+        }
+        RenderedBitmap *bmp = engine->RenderBitmap(job.pageNo, job.zoom, job.rotation, job.clip,
+                                                   Target_Print, &cookie.cookie);
+        cookie.Clear();
+        ahead->FinishJob(idx, bmp);
+    }
+}
+
+// renders and prints a job in horizontal bands of bounded size, so that
+// large pages can be printed at full resolution with limited memory
+static bool PrintJobBanded(HDC hdc, BaseEngine &engine, PrintJob &job, ProgressUpdateUI *progressUI,
+                           AbortCookieManager *abortCookie) {
+    RectD area = job.clip ? *job.clip : engine.PageMediabox(job.pageNo);
+    RectI full = GetPrintJobRect(engine, job);
+    if (full.IsEmpty())
+        return false;
+    int bandDy = (int)std::min(std::max(MAX_PRINT_BAND_BYTES / ((size_t)full.dx * 4), (size_t)1), (size_t)full.dy);
+
+    for (int y = 0; y < full.dy; y += bandDy) {
+        if (progressUI && progressUI->WasCanceled())
+            return false;
+        RectD band(full.x, full.y + y, full.dx, std::min(bandDy, full.dy - y));
+        RectD pageRect = engine.Transform(band, job.pageNo, job.zoom, job.rotation, true).Intersect(area);
+        RenderedBitmap *bmp = engine.RenderBitmap(job.pageNo, job.zoom, job.rotation, &pageRect, Target_Print,
+                                                  abortCookie ? &abortCookie->cookie : nullptr);
+        if (abortCookie)
+            abortCookie->Clear();
+        bool ok = bmp && bmp->GetBitmap();
+        if (ok) {
+            RectI rc(job.offset.x, job.offset.y + y, bmp->Size().dx, bmp->Size().dy);
+            ok = bmp->StretchDIBits(hdc, rc);
+        }
+        delete bmp;
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+// renders and prints all jobs (as vector graphics where possible, if asVectors is set)
+static bool PrintJobs(HDC hdc, BaseEngine &engine, Vec<PrintJob> &jobs, int total, bool asVectors,
+                      ProgressUpdateUI *progressUI, AbortCookieManager *abortCookie) {
+    for (PrintJob &job : jobs) {
+        job.banded = GetPrintJobBitmapSize(engine, job) > MAX_PRINT_BITMAP_BYTES;
+    }
+    // when printing vector graphics, bitmaps are only needed for the exceptions
+    PrintRenderAhead ahead(&engine, jobs, !asVectors);
+
+    int current = 1;
+    for (size_t i = 0; i < jobs.Count(); i++) {
+        PrintJob &job = jobs.At(i);
+        if (job.startsPage) {
+            if (progressUI)
+                progressUI->UpdateProgress(current, total);
+            StartPage(hdc);
+        }
+
+        bool ok = false;
+        if (asVectors && !(progressUI && progressUI->WasCanceled())) {
+            RectI screenRect(job.offset, GetPrintJobRect(engine, job).Size());
+            ok = engine.RenderPage(hdc, screenRect, job.pageNo, job.zoom, job.rotation, job.clip, Target_Print,
+                                   abortCookie ? &abortCookie->cookie : nullptr);
+            if (abortCookie)
+                abortCookie->Clear();
+        }
+
+        RenderedBitmap *bmp;
+        bool renderedAhead = ahead.TakeBitmap(i, &bmp, progressUI);
+        if (!ok && !renderedAhead && !job.banded && !(progressUI && progressUI->WasCanceled())) {
+            bmp = engine.RenderBitmap(job.pageNo, job.zoom, job.rotation, job.clip, Target_Print,
+                                      abortCookie ? &abortCookie->cookie : nullptr);
+            if (abortCookie)
+                abortCookie->Clear();
+        }
+        if (!ok && bmp && bmp->GetBitmap()) {
+            RectI rc(job.offset.x, job.offset.y, bmp->Size().dx, bmp->Size().dy);
+            ok = bmp->StretchDIBits(hdc, rc);
+        }
+        delete bmp;
+
+        // fall back to rendering in bands at full resolution
+        // (e.g. if there wasn't enough memory for the whole bitmap)
+        if (!ok && !(progressUI && progressUI->WasCanceled()))
+            ok = PrintJobBanded(hdc, engine, job, progressUI, abortCookie);
+
+        // and only as a last resort at lower resolutions
+        short shrink = 2;
+        while (!ok && shrink < 32 && !(progressUI && progressUI->WasCanceled())) {
+            bmp = engine.RenderBitmap(job.pageNo, job.zoom / shrink, job.rotation, job.clip, Target_Print,
+                                      abortCookie ? &abortCookie->cookie : nullptr);
+            if (abortCookie)
+                abortCookie->Clear();
+            if (bmp && bmp->GetBitmap()) {
+                RectI rc(job.offset.x, job.offset.y, bmp->Size().dx * shrink, bmp->Size().dy * shrink);
+                ok = bmp->StretchDIBits(hdc, rc);
+            }
+            delete bmp;
+            shrink *= 2;
+        }
+        // TODO: abort if !ok?
+
+        bool endsPage = i + 1 == jobs.Count() || jobs.At(i + 1).startsPage;
+        if (!endsPage)
+            continue;
+        if (EndPage(hdc) <= 0 || progressUI && progressUI->WasCanceled()) {
+            AbortDoc(hdc);
+            return false;
+        }
+        current++;
+    }
+
+    EndDoc(hdc);
+    return true;
+}
+
 static bool PrintToDevice(const PrintData &pd, ProgressUpdateUI *progressUI = nullptr,
                           AbortCookieManager *abortCookie = nullptr) {
     AssertCrash(pd.engine);
@@ -127,7 +447,7 @@ static bool PrintToDevice(const PrintData &pd, ProgressUpdateUI *progressUI = nu
     } else
         di.lpszDocName = engine.FileName();
 
-    int current = 1, total = 0;
+    int total = 0;
     if (pd.sel.Count() == 0) {
         for (size_t i = 0; i < pd.ranges.Count(); i++) {
             if (pd.ranges.At(i).nToPage < pd.ranges.At(i).nFromPage)
@@ -145,7 +465,7 @@ static bool PrintToDevice(const PrintData &pd, ProgressUpdateUI *progressUI = nu
     if (0 == total)
         return false;
     if (progressUI)
-        progressUI->UpdateProgress(current, total);
+        progressUI->UpdateProgress(1, total);
 
     // cf. http://blogs.msdn.com/b/oldnewthing/archive/2012/11/09/10367057.aspx
     ScopeHDC hdc(CreateDC(nullptr, pd.printerName, nullptr, pd.devMode));
@@ -168,17 +488,13 @@ static bool PrintToDevice(const PrintData &pd, ProgressUpdateUI *progressUI = nu
     if (pd.devMode && (pd.devMode.Get()->dmFields & DM_ORIENTATION))
         bPrintPortrait = DMORIENT_PORTRAIT == pd.devMode.Get()->dmOrientation;
 
+    Vec<PrintJob> jobs;
     if (pd.sel.Count() > 0) {
         for (int pageNo = 1; pageNo <= engine.PageCount(); pageNo++) {
             RectD bounds = BoundSelectionOnPage(pd.sel, pageNo);
             if (bounds.IsEmpty())
                 continue;
 
-            if (progressUI)
-                progressUI->UpdateProgress(current, total);
-
-            StartPage(hdc);
-
             geomutil::SizeT<float> bSize = bounds.Size().Convert<float>();
             float zoom = std::min((float)printable.dx / bSize.dx, (float)printable.dy / bSize.dy);
             // use the correct zoom values, if the page fits otherwise
@@ -188,6 +504,7 @@ static bool PrintToDevice(const PrintData &pd, ProgressUpdateUI *progressUI = nu
             else if (PrintScaleNone == pd.advData.scale)
                 zoom = dpiFactor;
 
+            bool startsPage = true;
             for (size_t i = 0; i < pd.sel.Count(); i++) {
                 if (pd.sel.At(i).pageNo != pageNo)
                     continue;
@@ -201,34 +518,13 @@ static bool PrintToDevice(const PrintData &pd, ProgressUpdateUI *progressUI = nu
                     offset.y += (int)(printable.dy - bSize.dy * zoom) / 2;
                 }
 
-                bool ok = false;
-                short shrink = 1;
-                do {
-                    RenderedBitmap *bmp = engine.RenderBitmap(
-                        pd.sel.At(i).pageNo, zoom / shrink, pd.rotation, clipRegion, Target_Print,
-                        abortCookie ? &abortCookie->cookie : nullptr);
-                    if (abortCookie)
-                        abortCookie->Clear();
-                    if (bmp && bmp->GetBitmap()) {
-                        RectI rc(offset.x, offset.y, bmp->Size().dx * shrink,
-                                 bmp->Size().dy * shrink);
-                        ok = bmp->StretchDIBits(hdc, rc);
-                    }
-                    delete bmp;
-                    shrink *= 2;
-                } while (!ok && shrink < 32 && !(progressUI && progressUI->WasCanceled()));
-            }
-            // TODO: abort if !ok?
-
-            if (EndPage(hdc) <= 0 || progressUI && progressUI->WasCanceled()) {
-                AbortDoc(hdc);
-                return false;
+                PrintJob job = { pageNo, zoom, pd.rotation, clipRegion, offset, startsPage, false };
+                jobs.Append(job);
+                startsPage = false;
             }
-            current++;
         }
 
-        EndDoc(hdc);
-        return false;
+        return PrintJobs(hdc, engine, jobs, total, pd.asVectors, progressUI, abortCookie);
     }
 
     // print all the pages the user requested
@@ -239,10 +535,6 @@ static bool PrintToDevice(const PrintData &pd, ProgressUpdateUI *progressUI = nu
             if ((PrintRangeEven == pd.advData.range && pageNo % 2 != 0) ||
                 (PrintRangeOdd == pd.advData.range && pageNo % 2 == 0))
                 continue;
-            if (progressUI)
-                progressUI->UpdateProgress(current, total);
-
-            StartPage(hdc);
 
             geomutil::SizeT<float> pSize = engine.PageMediabox(pageNo).Size().Convert<float>();
             int rotation = 0;
@@ -301,33 +593,12 @@ static bool PrintToDevice(const PrintData &pd, ProgressUpdateUI *progressUI = nu
                     offset.y -= (int)(onPaper.BR().y - printable.BR().y);
             }
 
-            bool ok = false;
-            short shrink = 1;
-            do {
-                RenderedBitmap *bmp =
-                    engine.RenderBitmap(pageNo, zoom / shrink, rotation, nullptr, Target_Print,
-                                        abortCookie ? &abortCookie->cookie : nullptr);
-                if (abortCookie)
-                    abortCookie->Clear();
-                if (bmp && bmp->GetBitmap()) {
-                    RectI rc(offset.x, offset.y, bmp->Size().dx * shrink, bmp->Size().dy * shrink);
-                    ok = bmp->StretchDIBits(hdc, rc);
-                }
-                delete bmp;
-                shrink *= 2;
-            } while (!ok && shrink < 32 && !(progressUI && progressUI->WasCanceled()));
-            // TODO: abort if !ok?
-
-            if (EndPage(hdc) <= 0 || progressUI && progressUI->WasCanceled()) {
-                AbortDoc(hdc);
-                return false;
-            }
-            current++;
+            PrintJob job = { (int)pageNo, zoom, rotation, nullptr, offset, true, false };
+            jobs.Append(job);
         }
     }
 
-    EndDoc(hdc);
-    return true;
+    return PrintJobs(hdc, engine, jobs, total, pd.asVectors, progressUI, abortCookie);
 }
 
 class PrintThreadData : public ProgressUpdateUI, public NotificationWndCallback {
@@ -375,8 +646,7 @@ class PrintThreadData : public ProgressUpdateUI, public NotificationWndCallback
             win->notifications->RemoveNotification(wnd);
     }
 
-    static DWORD WINAPI PrintThread(LPVOID data) {
-        PrintThreadData *threadData = (PrintThreadData *)data;
+    static void PrintThread(PrintThreadData *threadData) {
         WindowInfo *win = threadData->win;
         // wait for PrintToDeviceOnThread to return so that we
         // close the correct handle to the current printing thread
@@ -392,7 +662,6 @@ class PrintThreadData : public ProgressUpdateUI, public NotificationWndCallback
             }
             delete threadData;
         });
-        return 0;
     }
 };
 
@@ -400,8 +669,7 @@ static void PrintToDeviceOnThread(WindowInfo *win, PrintData *data) {
     assert(!win->printThread);
     PrintThreadData *threadData = new PrintThreadData(win, data);
     win->printThread = nullptr;
-    win->printThread =
-        CreateThread(nullptr, 0, PrintThreadData::PrintThread, threadData, 0, nullptr);
+    win->printThread = RunAsyncWaitable([=] { PrintThreadData::PrintThread(threadData); });
 }
 
 void AbortPrinting(WindowInfo *win) {
@@ -447,6 +715,7 @@ So far have tested printing from XP to
 */
 enum { MAXPAGERANGES = 10 };
 void OnMenuPrint(WindowInfo *win, bool waitForCompletion) {
+    ScopedHangOperation hangOp("Print");
     // we remember some printer settings per process
     static ScopedMem<DEVMODE> defaultDevMode;
     static PrintScaleAdv defaultScaleAdv = PrintScaleShrink;
@@ -527,6 +796,8 @@ void OnMenuPrint(WindowInfo *win, bool waitForCompletion) {
     pd.nStartPage = START_PAGE_GENERAL;
 
     Print_Advanced_Data advanced(PrintRangeAll, defaultScaleAdv);
+    advanced.previewDm = dm;
+    advanced.previewPageNo = dm->CurrentPageNo();
     ScopedMem<DLGTEMPLATE> dlgTemplate; // needed for RTL languages
     HPROPSHEETPAGE hPsp = CreatePrintAdvancedPropSheet(&advanced, dlgTemplate);
     pd.lphPropertyPages = &hPsp;
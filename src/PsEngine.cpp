@@ -6,6 +6,7 @@
 #include <zlib.h>
 #include "ByteReader.h"
 #include "FileUtil.h"
+#include "ThreadUtil.h"
 #include "WinUtil.h"
 // rendering engines
 #include "BaseEngine.h"
@@ -118,7 +119,38 @@ static RectI ExtractDSCPageSize(const WCHAR *fileName)
     return RectI();
 }
 
-static BaseEngine *ps2pdf(const WCHAR *fileName)
+// returns the number of pages indicated by the DSC Pages comment (or 0)
+static int ExtractDSCPageCount(const WCHAR *fileName)
+{
+    // (gzread also reads uncompressed files)
+    char header[1024] = { 0 };
+    gzFile inFile = gzopen_w(fileName, "rb");
+    if (!inFile)
+        return 0;
+    gzread(inFile, header, sizeof(header) - 1);
+    gzclose(inFile);
+    if (!str::StartsWith(header, "%!PS-Adobe-"))
+        return 0;
+
+    char *nl = header;
+    int pageCount;
+    while ((nl = strchr(nl + 1, '\n')) != nullptr && '%' == nl[1]) {
+        if (str::StartsWith(nl + 1, "%%Pages:") &&
+            str::Parse(nl + 1, "%%%%Pages: %d% ", &pageCount) && pageCount > 0) {
+            return pageCount;
+        }
+    }
+    return 0;
+}
+
+#define GHOSTSCRIPT_TIMEOUT 10000
+// converting a whole document in the background may take longer
+#define GHOSTSCRIPT_BACKGROUND_TIMEOUT 120000
+
+// returns the data of the PDF document produced by Ghostscript
+// (limited to the first lastPage pages, if lastPage > 0). If a cancel event is given,
+// the conversion runs in the background and signaling the event terminates it.
+static char *ps2pdf(const WCHAR *fileName, size_t *lenOut, int lastPage, HANDLE cancel)
 {
     // TODO: read from gswin32c's stdout instead of using a TEMP file
     ScopedMem<WCHAR> shortPath(path::ShortPath(fileName));
@@ -133,10 +165,14 @@ static BaseEngine *ps2pdf(const WCHAR *fileName)
     RectI page = ExtractDSCPageSize(fileName);
     if (!page.IsEmpty())
         psSetup.Set(str::Format(L" << /PageSize [%i %i] >> setpagedevice", page.dx, page.dy));
+    ScopedMem<WCHAR> pageRange;
+    if (lastPage > 0)
+        pageRange.Set(str::Format(L" -dFirstPage=1 -dLastPage=%d", lastPage));
 
     ScopedMem<WCHAR> cmdLine(str::Format(
-        L"\"%s\" -q -dSAFER -dNOPAUSE -dBATCH -dEPSCrop -sOutputFile=\"%s\" -sDEVICE=pdfwrite -c \".setpdfwrite%s\" -f \"%s\"",
-        gswin32c.Get(), tmpFile.Get(), psSetup ? psSetup.Get() : L"", shortPath.Get()));
+        L"\"%s\" -q -dSAFER -dNOPAUSE -dBATCH -dEPSCrop%s -sOutputFile=\"%s\" -sDEVICE=pdfwrite -c \".setpdfwrite%s\" -f \"%s\"",
+        gswin32c.Get(), pageRange ? pageRange.Get() : L"", tmpFile.Get(), psSetup ? psSetup.Get() : L"",
+        shortPath.Get()));
     fprintf(stderr, "- %s:%d: using '%ls' for creating '%%TEMP%%\\%ls'\n", path::GetBaseName(__FILE__), __LINE__, gswin32c.Get(), path::GetBaseName(tmpFile));
 
     // TODO: the PS-to-PDF conversion can hang the UI for several seconds
@@ -144,33 +180,25 @@ static BaseEngine *ps2pdf(const WCHAR *fileName)
     if (!process)
         return nullptr;
 
-    DWORD timeout = 10000;
+    DWORD timeout = cancel ? GHOSTSCRIPT_BACKGROUND_TIMEOUT : GHOSTSCRIPT_TIMEOUT;
 #ifdef DEBUG
     // allow to disable the timeout for debugging purposes
     if (GetEnvironmentVariable(L"SUMATRAPDF_NO_GHOSTSCRIPT_TIMEOUT", nullptr, 0))
         timeout = INFINITE;
 #endif
     DWORD exitCode = EXIT_FAILURE;
-    WaitForSingleObject(process, timeout);
+    HANDLE handles[2] = { process, cancel };
+    WaitForMultipleObjects(cancel ? 2 : 1, handles, FALSE, timeout);
     GetExitCodeProcess(process, &exitCode);
     TerminateProcess(process, 1);
     CloseHandle(process);
     if (exitCode != EXIT_SUCCESS)
         return nullptr;
 
-    size_t len;
-    ScopedMem<char> pdfData(file::ReadAll(tmpFile, &len));
-    if (!pdfData)
-        return nullptr;
-
-    ScopedComPtr<IStream> stream(CreateStreamFromData(pdfData, len));
-    if (!stream)
-        return nullptr;
-
-    return PdfEngine::CreateFromStream(stream);
+    return file::ReadAll(tmpFile, lenOut);
 }
 
-static BaseEngine *psgz2pdf(const WCHAR *fileName)
+static char *psgz2pdf(const WCHAR *fileName, size_t *lenOut, int lastPage, HANDLE cancel)
 {
     ScopedMem<WCHAR> tmpFile(path::GetTempPath(L"PsE"));
     ScopedFile tmpFileScope(tmpFile);
@@ -197,19 +225,181 @@ static BaseEngine *psgz2pdf(const WCHAR *fileName)
     fclose(outFile);
     gzclose(inFile);
 
-    return ps2pdf(tmpFile);
+    return ps2pdf(tmpFile, lenOut, lastPage, cancel);
+}
+
+static char *ConvertPsFile(const WCHAR *fileName, size_t *lenOut, int lastPage=0, HANDLE cancel=nullptr)
+{
+    if (file::StartsWith(fileName, "\x1F\x8B"))
+        return psgz2pdf(fileName, lenOut, lastPage, cancel);
+    return ps2pdf(fileName, lenOut, lastPage, cancel);
+}
+
+/* Conversion cache: converting PostScript with Ghostscript is slow, so the resulting
+PDF documents are kept in %LOCALAPPDATA%\SumatraPDF\PsCache (which is shared between
+SumatraPDF, the previewer and the IFilter). Cached files are named after a digest of
+the original file's content and its modification time, their own modification time
+is updated when they're used and the least recently used ones are deleted when the
+cache grows beyond PS_CACHE_MAX_SIZE. */
+
+#define PS_CACHE_MAX_SIZE (256 * 1024 * 1024)
+
+static WCHAR *GetConversionCacheDir()
+{
+    ScopedMem<WCHAR> appData(GetSpecialFolder(CSIDL_LOCAL_APPDATA, true));
+    if (!appData)
+        return nullptr;
+    ScopedMem<WCHAR> dir(path::Join(appData, L"SumatraPDF\\PsCache"));
+    if (!dir::CreateAll(dir))
+        return nullptr;
+    return dir.StealData();
+}
+
+// returns nullptr if the file can't be read or there's nowhere to cache
+static WCHAR *GetConversionCachePath(const WCHAR *fileName)
+{
+    size_t len;
+    ScopedMem<char> data(file::ReadAll(fileName, &len));
+    if (!data)
+        return nullptr;
+    ScopedMem<WCHAR> dir(GetConversionCacheDir());
+    if (!dir)
+        return nullptr;
+    uint64_t digest = MurmurHash64(data, len);
+    FILETIME modified = file::GetModificationTime(fileName);
+    return str::Format(L"%s\\%016I64x-%08x%08x.pdf", dir.Get(), digest, modified.dwHighDateTime,
+                       modified.dwLowDateTime);
+}
+
+struct ConversionCacheFile {
+    WCHAR *path;
+    int64 size;
+    FILETIME lastUsed;
+};
+
+static int cmpCacheFileLastUsed(const void *a, const void *b)
+{
+    const ConversionCacheFile *fa = (const ConversionCacheFile *)a;
+    const ConversionCacheFile *fb = (const ConversionCacheFile *)b;
+    return CompareFileTime(&fa->lastUsed, &fb->lastUsed);
+}
+
+// deletes the least recently used files until the cache fits into PS_CACHE_MAX_SIZE
+static void TrimConversionCache(const WCHAR *dir)
+{
+    ScopedMem<WCHAR> pattern(path::Join(dir, L"*.pdf"));
+    WIN32_FIND_DATA fdata;
+    HANDLE hfind = FindFirstFile(pattern, &fdata);
+    if (INVALID_HANDLE_VALUE == hfind)
+        return;
+    Vec<ConversionCacheFile> files;
+    int64 totalSize = 0;
+    do {
+        if ((fdata.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+            continue;
+        ConversionCacheFile f;
+        f.path = path::Join(dir, fdata.cFileName);
+        f.size = ((int64)fdata.nFileSizeHigh << 32) + fdata.nFileSizeLow;
+        f.lastUsed = fdata.ftLastWriteTime;
+        files.Append(f);
+        totalSize += f.size;
+    } while (FindNextFile(hfind, &fdata));
+    FindClose(hfind);
+
+    files.Sort(cmpCacheFileLastUsed);
+    for (size_t i = 0; i < files.Count(); i++) {
+        if (totalSize > PS_CACHE_MAX_SIZE && file::Delete(files.At(i).path))
+            totalSize -= files.At(i).size;
+        free(files.At(i).path);
+    }
+}
+
+static void SaveToConversionCache(const WCHAR *cachePath, const char *pdfData, size_t len)
+{
+    if (len > PS_CACHE_MAX_SIZE / 4)
+        return;
+    // write to a temporary file first, so that other processes never see a partial file
+    ScopedMem<WCHAR> tmpPath(str::Join(cachePath, L".tmp"));
+    if (!file::WriteAll(tmpPath, pdfData, len) || !MoveFileEx(tmpPath, cachePath, MOVEFILE_REPLACE_EXISTING)) {
+        file::Delete(tmpPath);
+        return;
+    }
+    ScopedMem<WCHAR> dir(path::GetDir(cachePath));
+    TrimConversionCache(dir);
+}
+
+static BaseEngine *CreatePdfEngineFromData(const char *pdfData, size_t len)
+{
+    ScopedComPtr<IStream> stream(CreateStreamFromData(pdfData, len));
+    if (!stream)
+        return nullptr;
+    return PdfEngine::CreateFromStream(stream);
 }
 
+/* Streaming conversion: for documents with more than PS_FIRST_CHUNK_PAGES pages
+(according to their DSC comments), only the first pages are converted before
+the document is shown, while the whole document is converted in the background.
+Until that's done, the remaining pages are laid out using the DSC page size and
+rendering them waits for the background conversion. */
+
+#define PS_FIRST_CHUNK_PAGES 10
+
+class PsConversionThread : public ThreadBase {
+  public:
+    ScopedMem<WCHAR> fileName;
+    ScopedMem<WCHAR> cachePath;
+    // signaled once engine has been set (or the conversion failed)
+    HANDLE done;
+    HANDLE cancel;
+    BaseEngine *engine;
+
+    PsConversionThread(const WCHAR *fileName, const WCHAR *cachePath)
+        : ThreadBase("PsConversionThread"), fileName(str::Dup(fileName)), cachePath(str::Dup(cachePath)),
+          engine(nullptr) {
+        done = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+        cancel = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    }
+    virtual ~PsConversionThread() {
+        delete engine;
+        CloseHandle(done);
+        CloseHandle(cancel);
+    }
+
+    void Cancel() {
+        RequestCancel();
+        SetEvent(cancel);
+    }
+
+    virtual void Run() override {
+        size_t len;
+        ScopedMem<char> pdfData(ConvertPsFile(fileName, &len, 0, cancel));
+        if (pdfData && !WasCancelRequested())
+            engine = CreatePdfEngineFromData(pdfData, len);
+        if (engine && cachePath)
+            SaveToConversionCache(cachePath, pdfData, len);
+        SetEvent(done);
+    }
+};
+
 // PsEngineImpl is mostly a proxy for a PdfEngine that's fed whatever
 // the ps2pdf conversion from Ghostscript returns
 class PsEngineImpl : public BaseEngine {
 public:
-    PsEngineImpl() : fileName(nullptr), pdfEngine(nullptr) { }
+    PsEngineImpl() : fileName(nullptr), pdfEngine(nullptr), conversion(nullptr), pageCount(0),
+        renderQuality(Quality_Balanced), hasRenderQuality(false), hasUserAnnots(false), docSetUp(false) {
+        InitializeCriticalSection(&access);
+    }
     virtual ~PsEngineImpl() {
+        if (conversion) {
+            conversion->Cancel();
+            conversion->Join();
+            delete conversion;
+        }
         delete pdfEngine;
+        DeleteCriticalSection(&access);
     }
     BaseEngine *Clone() override {
-        BaseEngine *newEngine = pdfEngine->Clone();
+        BaseEngine *newEngine = Doc(true)->Clone();
         if (!newEngine)
             return nullptr;
         PsEngineImpl *clone = new PsEngineImpl();
@@ -221,27 +411,47 @@ public:
 
     const WCHAR *FileName() const override { return fileName; };
     int PageCount() const override {
-        return pdfEngine->PageCount();
+        return pageCount > 0 ? pageCount : pdfEngine->PageCount();
     }
 
     RectD PageMediabox(int pageNo) override {
-        return pdfEngine->PageMediabox(pageNo);
+        BaseEngine *engine = Doc();
+        if (pageNo > engine->PageCount())
+            return dscPageBox;
+        return engine->PageMediabox(pageNo);
     }
     RectD PageContentBox(int pageNo, RenderTarget target=Target_View) override {
-        return pdfEngine->PageContentBox(pageNo, target);
+        BaseEngine *engine = Doc();
+        if (pageNo > engine->PageCount())
+            return dscPageBox;
+        return engine->PageContentBox(pageNo, target);
     }
 
     RenderedBitmap *RenderBitmap(int pageNo, float zoom, int rotation,
                          RectD *pageRect=nullptr, /* if nullptr: defaults to the page's mediabox */
                          RenderTarget target=Target_View, AbortCookie **cookie_out=nullptr) override {
-        return pdfEngine->RenderBitmap(pageNo, zoom, rotation, pageRect, target, cookie_out);
+        BaseEngine *engine = EngineForPage(pageNo);
+        if (!engine)
+            return nullptr;
+        return engine->RenderBitmap(pageNo, zoom, rotation, pageRect, target, cookie_out);
+    }
+    void SetRenderQuality(RenderQuality quality) override {
+        ScopedCritSec scope(&access);
+        renderQuality = quality;
+        hasRenderQuality = true;
+        pdfEngine->SetRenderQuality(quality);
+        if (docSetUp)
+            conversion->engine->SetRenderQuality(quality);
     }
 
     PointD Transform(PointD pt, int pageNo, float zoom, int rotation, bool inverse=false) override {
-        return pdfEngine->Transform(pt, pageNo, zoom, rotation, inverse);
+        // pages which haven't been converted yet have the same size as the first one
+        BaseEngine *engine = Doc();
+        return engine->Transform(pt, pageNo <= engine->PageCount() ? pageNo : 1, zoom, rotation, inverse);
     }
     RectD Transform(RectD rect, int pageNo, float zoom, int rotation, bool inverse=false) override {
-        return pdfEngine->Transform(rect, pageNo, zoom, rotation, inverse);
+        BaseEngine *engine = Doc();
+        return engine->Transform(rect, pageNo <= engine->PageCount() ? pageNo : 1, zoom, rotation, inverse);
     }
 
     unsigned char *GetFileData(size_t *cbCount) override {
@@ -252,32 +462,60 @@ public:
         return fileName ? CopyFile(fileName, copyFileName, FALSE) : false;
     }
     bool SaveFileAsPDF(const WCHAR *pdfFileName, bool includeUserAnnots=false) override {
-        return pdfEngine->SaveFileAs(pdfFileName, includeUserAnnots);
+        return Doc(true)->SaveFileAs(pdfFileName, includeUserAnnots);
     }
     WCHAR * ExtractPageText(int pageNo, const WCHAR *lineSep, RectI **coordsOut=nullptr,
                                     RenderTarget target=Target_View) override {
-        return pdfEngine->ExtractPageText(pageNo, lineSep, coordsOut, target);
+        BaseEngine *engine = EngineForPage(pageNo);
+        if (!engine)
+            return nullptr;
+        return engine->ExtractPageText(pageNo, lineSep, coordsOut, target);
+    }
+    WCHAR * ExtractPageTextLimited(int pageNo, const WCHAR *lineSep, RectI **coordsOut,
+                                   DWORD timeoutMs, bool *partialOut, AbortCookie **cookie_out=nullptr) override {
+        // don't wait for the background conversion
+        BaseEngine *engine = Doc();
+        if (pageNo > engine->PageCount()) {
+            if (partialOut)
+                *partialOut = true;
+            return nullptr;
+        }
+        return engine->ExtractPageTextLimited(pageNo, lineSep, coordsOut, timeoutMs, partialOut, cookie_out);
     }
     bool HasClipOptimizations(int pageNo) override {
-        return pdfEngine->HasClipOptimizations(pageNo);
+        BaseEngine *engine = Doc();
+        return pageNo > engine->PageCount() || engine->HasClipOptimizations(pageNo);
     }
     PageLayoutType PreferredLayout() override {
         return pdfEngine->PreferredLayout();
     }
+    void ReleaseCaches(bool inBackground) override {
+        pdfEngine->ReleaseCaches(inBackground);
+        BaseEngine *engine = Doc();
+        if (engine != pdfEngine)
+            engine->ReleaseCaches(inBackground);
+    }
     WCHAR *GetProperty(DocumentProperty prop) override {
         // omit properties created by Ghostscript
         if (!pdfEngine || Prop_CreationDate == prop || Prop_ModificationDate == prop ||
             Prop_PdfVersion == prop || Prop_PdfProducer == prop || Prop_PdfFileStructure == prop) {
             return nullptr;
         }
-        return pdfEngine->GetProperty(prop);
+        return Doc()->GetProperty(prop);
     }
 
     bool SupportsAnnotation(bool forSaving=false) const override {
         return !forSaving && pdfEngine->SupportsAnnotation();
     }
     void UpdateUserAnnotations(Vec<PageAnnotation> *list) override {
+        ScopedCritSec scope(&access);
+        userAnnots.Reset();
+        if (list)
+            userAnnots.Append(list->LendData(), list->Count());
+        hasUserAnnots = true;
         pdfEngine->UpdateUserAnnotations(list);
+        if (docSetUp)
+            conversion->engine->UpdateUserAnnotations(list);
     }
 
     bool AllowsPrinting() const override {
@@ -295,18 +533,21 @@ public:
     }
 
     bool BenchLoadPage(int pageNo) override {
-        return pdfEngine->BenchLoadPage(pageNo);
+        BaseEngine *engine = EngineForPage(pageNo);
+        return engine && engine->BenchLoadPage(pageNo);
     }
 
     Vec<PageElement *> *GetElements(int pageNo) override {
-        return pdfEngine->GetElements(pageNo);
+        BaseEngine *engine = Doc();
+        return pageNo <= engine->PageCount() ? engine->GetElements(pageNo) : nullptr;
     }
     PageElement *GetElementAtPos(int pageNo, PointD pt) override {
-        return pdfEngine->GetElementAtPos(pageNo, pt);
+        BaseEngine *engine = Doc();
+        return pageNo <= engine->PageCount() ? engine->GetElementAtPos(pageNo, pt) : nullptr;
     }
 
     PageDestination *GetNamedDest(const WCHAR *name) override {
-        return pdfEngine->GetNamedDest(name);
+        return Doc()->GetNamedDest(name);
     }
     bool HasTocTree() const override {
         return pdfEngine->HasTocTree();
@@ -323,19 +564,110 @@ public:
 
 protected:
     ScopedMem<WCHAR> fileName;
+    // the converted document (or only its first pages while conversion is still running)
     BaseEngine *pdfEngine;
 
+    // only set for streaming conversions
+    PsConversionThread *conversion;
+    int pageCount;
+    RectD dscPageBox;
+    // settings to apply to the completely converted document
+    CRITICAL_SECTION access;
+    RenderQuality renderQuality;
+    bool hasRenderQuality;
+    Vec<PageAnnotation> userAnnots;
+    bool hasUserAnnots;
+    bool docSetUp;
+
+    // returns the engine for the whole document, if it's already available (or if wait is true,
+    // once the background conversion has finished); pdfEngine otherwise
+    BaseEngine *Doc(bool wait=false) {
+        if (!conversion)
+            return pdfEngine;
+        if (WaitForSingleObject(conversion->done, wait ? INFINITE : 0) != WAIT_OBJECT_0 || !conversion->engine)
+            return pdfEngine;
+        ScopedCritSec scope(&access);
+        if (!docSetUp) {
+            if (hasRenderQuality)
+                conversion->engine->SetRenderQuality(renderQuality);
+            if (hasUserAnnots)
+                conversion->engine->UpdateUserAnnotations(&userAnnots);
+            docSetUp = true;
+        }
+        return conversion->engine;
+    }
+
+    // returns nullptr if the page doesn't exist in the converted document
+    BaseEngine *EngineForPage(int pageNo) {
+        BaseEngine *engine = Doc(pageNo > pdfEngine->PageCount());
+        return pageNo <= engine->PageCount() ? engine : nullptr;
+    }
+
     bool Load(const WCHAR *fileName) {
         AssertCrash(!this->fileName && !pdfEngine);
         if (!fileName)
             return false;
         this->fileName.Set(str::Dup(fileName));
-        if (file::StartsWith(fileName, "\x1F\x8B"))
-            pdfEngine = psgz2pdf(fileName);
-        else
-            pdfEngine = ps2pdf(fileName);
+
+        size_t len;
+        ScopedMem<WCHAR> cachePath(GetConversionCachePath(fileName));
+        ScopedMem<char> pdfData(cachePath ? file::ReadAll(cachePath, &len) : nullptr);
+        if (pdfData) {
+            pdfEngine = CreatePdfEngineFromData(pdfData, len);
+            if (pdfEngine) {
+                FILETIME now;
+                GetSystemTimeAsFileTime(&now);
+                file::SetModificationTime(cachePath, now);
+                return true;
+            }
+            file::Delete(cachePath);
+        }
+
+        int dscPageCount = ExtractDSCPageCount(fileName);
+        RectI dscPage = ExtractDSCPageSize(fileName);
+        if (dscPageCount > PS_FIRST_CHUNK_PAGES && !dscPage.IsEmpty())
+            return LoadStreaming(fileName, cachePath, dscPageCount, dscPage.Convert<double>());
+
+        pdfData.Set(ConvertPsFile(fileName, &len));
+        if (!pdfData)
+            return false;
+        pdfEngine = CreatePdfEngineFromData(pdfData, len);
+        if (pdfEngine && cachePath)
+            SaveToConversionCache(cachePath, pdfData, len);
         return pdfEngine != nullptr;
     }
+
+    bool LoadStreaming(const WCHAR *fileName, const WCHAR *cachePath, int dscPageCount, RectD dscPage) {
+        conversion = new PsConversionThread(fileName, cachePath);
+        conversion->Start();
+
+        size_t len;
+        ScopedMem<char> pdfData(ConvertPsFile(fileName, &len, PS_FIRST_CHUNK_PAGES));
+        pdfEngine = pdfData ? CreatePdfEngineFromData(pdfData, len) : nullptr;
+        if (pdfEngine && pdfEngine->PageCount() >= dscPageCount) {
+            // Ghostscript ignored the page range (or the DSC comments are wrong)
+            DropConversion();
+            return true;
+        }
+        if (!pdfEngine) {
+            // fall back to the result of the complete conversion
+            conversion->Join();
+            pdfEngine = conversion->engine;
+            conversion->engine = nullptr;
+            DropConversion();
+            return pdfEngine != nullptr;
+        }
+        pageCount = dscPageCount;
+        dscPageBox = dscPage;
+        return true;
+    }
+
+    void DropConversion() {
+        conversion->Cancel();
+        conversion->Join();
+        delete conversion;
+        conversion = nullptr;
+    }
 };
 
 BaseEngine *PsEngineImpl::CreateFromFile(const WCHAR *fileName)
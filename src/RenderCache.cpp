@@ -3,10 +3,14 @@
 
 // utils
 #include "BaseUtil.h"
+#include "EtwTrace.h"
+#include "Timer.h"
+#include "WinDynCalls.h"
 #include "WinUtil.h"
 // rendering engines
 #include "BaseEngine.h"
 #include "EngineManager.h"
+#include "ImagesEngine.h"
 // layout controllers
 #include "SettingsStructs.h"
 #include "Controller.h"
@@ -14,6 +18,9 @@
 #include "GlobalPrefs.h"
 #include "RenderCache.h"
 #include "TextSelection.h"
+// ui
+#include "PerfStats.h"
+#include "DebugLog.h"
 
 #pragma warning(disable: 28159) // silence /analyze: Consider using 'GetTickCount64' instead of 'GetTickCount'
 
@@ -26,10 +33,30 @@
 // define to view the tile boundaries
 #undef SHOW_TILE_LAYOUT
 
+// previews are rendered at this fraction of the requested zoom level
+#define PREVIEW_ZOOM_FACTOR 0.25f
+
+// pages expected to take longer than this to render per tile are split into
+// more tiles so that they can be rendered in parallel by several threads
+#define EXPENSIVE_TILE_RENDER_MS 150.0f
+// pages expected to render faster than this are split into fewer tiles
+// so that less time is spent on setting up each tile's rendering
+#define CHEAP_PAGE_RENDER_MS 40.0f
+// tiles requested for a lower zoom level are scaled down from cached tiles
+// of at most this much larger zoom levels instead of being rendered anew
+// (e.g. after zooming out), which is about as sharp and much faster
+#define MAX_DOWNSAMPLE_FACTOR 2.0f
+
 RenderCache::RenderCache()
-    : cacheCount(0), requestCount(0),
+    : cacheCount(0), cacheSize(0), maxCacheSize(256 * 1024 * 1024),
+      requestCount(0), workerCount(0),
       maxTileSize(GetSystemMetrics(SM_CXSCREEN), GetSystemMetrics(SM_CYSCREEN)),
-      isRemoteSession(GetSystemMetrics(SM_REMOTESESSION))
+      isRemoteSession(GetSystemMetrics(SM_REMOTESESSION)), renderCostCount(0),
+      statHits(0), statMisses(0), paintedLowQuality(false), gpuScaling(true),
+      d2dFactory(nullptr), d2dTarget(nullptr), d2dTargetId(1),
+      presentationDm(nullptr), presentationPageNo(INVALID_PAGE_NO),
+      prefetchDm(nullptr), prefetchPageNo(INVALID_PAGE_NO), statTilesRendered(0),
+      statLastRenderMs(0), statTotalRenderMs(0)
 {
     textColor = WIN_COL_BLACK;
     backgroundColor = WIN_COL_WHITE;
@@ -38,8 +65,8 @@ RenderCache::RenderCache()
     InitializeCriticalSection(&requestAccess);
 
     startRendering = CreateEvent(nullptr, FALSE, FALSE, nullptr);
-    renderThread = CreateThread(nullptr, 0, RenderCacheThread, this, 0, 0);
-    assert(nullptr != renderThread);
+    lowMemory = CreateMemoryResourceNotification(LowMemoryResourceNotification);
+    StartRenderThreads(1);
 }
 
 RenderCache::~RenderCache()
@@ -47,9 +74,18 @@ RenderCache::~RenderCache()
     EnterCriticalSection(&requestAccess);
     EnterCriticalSection(&cacheAccess);
 
-    CloseHandle(renderThread);
+    for (int i = 0; i < workerCount; i++) {
+        assert(!workers[i].curReq);
+        CloseHandle(workers[i].thread);
+    }
     CloseHandle(startRendering);
-    assert(!curReq && 0 == requestCount && 0 == cacheCount);
+    if (lowMemory)
+        CloseHandle(lowMemory);
+    assert(0 == requestCount && 0 == cacheCount);
+    if (d2dTarget)
+        d2dTarget->Release();
+    if (d2dFactory)
+        d2dFactory->Release();
 
     LeaveCriticalSection(&cacheAccess);
     DeleteCriticalSection(&cacheAccess);
@@ -57,6 +93,196 @@ RenderCache::~RenderCache()
     DeleteCriticalSection(&requestAccess);
 }
 
+// the last reference to an entry can be dropped on any thread, which is
+// why the Direct2D factory is created as multi-threaded (cf. InitD2DTarget)
+BitmapCacheEntry::~BitmapCacheEntry()
+{
+    delete bitmap;
+    if (gpuBitmap)
+        gpuBitmap->Release();
+}
+
+TileBitmap::~TileBitmap()
+{
+    if (view)
+        UnmapViewOfFile(view);
+    else
+        free(pixels);
+    free(bmi);
+}
+
+TileBitmap *TileBitmap::Create(RenderedBitmap *bmp)
+{
+    TileBitmap *tile = new TileBitmap(bmp->Size());
+    HBITMAP hbmp = bmp->GetBitmap();
+    if (!hbmp)
+        return tile;
+
+    DIBSECTION info = { 0 };
+    if (GetObject(hbmp, sizeof(info), &info) == sizeof(info) && info.dsBm.bmBits) {
+        int colors = 0;
+        if (info.dsBmih.biBitCount <= 8)
+            colors = info.dsBmih.biClrUsed ? info.dsBmih.biClrUsed : 1 << info.dsBmih.biBitCount;
+        tile->bmi = (BITMAPINFO *)calloc(1, sizeof(BITMAPINFOHEADER) + std::max(colors, 1) * sizeof(RGBQUAD));
+        if (!tile->bmi)
+            return tile;
+        tile->bmi->bmiHeader = info.dsBmih;
+        size_t nBytes = (size_t)info.dsBm.bmWidthBytes * info.dsBm.bmHeight;
+        tile->bmi->bmiHeader.biSizeImage = (DWORD)nBytes;
+        if (colors > 0) {
+            HDC hdc = CreateCompatibleDC(nullptr);
+            HGDIOBJ prevBmp = SelectObject(hdc, hbmp);
+            tile->bmi->bmiHeader.biClrUsed = GetDIBColorTable(hdc, 0, colors, tile->bmi->bmiColors);
+            SelectObject(hdc, prevBmp);
+            DeleteDC(hdc);
+        }
+        // keep the section alive through a view of our own (views hold a
+        // reference to their section which outlives the HBITMAP and its handle)
+        if (info.dshSection)
+            tile->view = MapViewOfFile(info.dshSection, FILE_MAP_READ, 0, 0, 0);
+        if (tile->view) {
+            tile->pixels = (BYTE *)tile->view + info.dsOffset;
+        }
+        else {
+            tile->pixels = (BYTE *)memdup(info.dsBm.bmBits, nBytes);
+        }
+        return tile;
+    }
+
+    // for device dependent bitmaps: copy the pixels as a top-down 32-bit DIB
+    SizeI size = tile->size;
+    tile->bmi = AllocStruct<BITMAPINFO>();
+    if (!tile->bmi)
+        return tile;
+    BITMAPINFOHEADER *bmih = &tile->bmi->bmiHeader;
+    bmih->biSize = sizeof(*bmih);
+    bmih->biWidth = size.dx;
+    bmih->biHeight = -size.dy;
+    bmih->biPlanes = 1;
+    bmih->biBitCount = 32;
+    bmih->biCompression = BI_RGB;
+    bmih->biSizeImage = size.dx * size.dy * 4;
+    BYTE *copy = AllocArray<BYTE>(bmih->biSizeImage);
+    HDC hdc = GetDC(nullptr);
+    if (copy && GetDIBits(hdc, hbmp, 0, size.dy, copy, tile->bmi, DIB_RGB_COLORS) == size.dy)
+        tile->pixels = copy;
+    else
+        free(copy);
+    ReleaseDC(nullptr, hdc);
+    return tile;
+}
+
+TileBitmap *TileBitmap::Create(SizeI size, BYTE **pixelsOut)
+{
+    TileBitmap *tile = new TileBitmap(size);
+    tile->bmi = AllocStruct<BITMAPINFO>();
+    size_t nBytes = (size_t)size.dx * size.dy * 4;
+    tile->pixels = tile->bmi ? AllocArray<BYTE>(nBytes) : nullptr;
+    if (!tile->pixels) {
+        delete tile;
+        return nullptr;
+    }
+    BITMAPINFOHEADER *bmih = &tile->bmi->bmiHeader;
+    bmih->biSize = sizeof(*bmih);
+    bmih->biWidth = size.dx;
+    bmih->biHeight = -size.dy;
+    bmih->biPlanes = 1;
+    bmih->biBitCount = 32;
+    bmih->biCompression = BI_RGB;
+    bmih->biSizeImage = (DWORD)nBytes;
+    *pixelsOut = tile->pixels;
+    return tile;
+}
+
+const BYTE *TileBitmap::GetPixels(int *stride, int *bitsPerPixel) const
+{
+    if (!pixels)
+        return nullptr;
+    const BITMAPINFOHEADER *bmih = &bmi->bmiHeader;
+    int rowBytes = ((bmih->biWidth * bmih->biBitCount + 31) / 32) * 4;
+    *bitsPerPixel = bmih->biBitCount;
+    if (bmih->biHeight > 0) {
+        *stride = -rowBytes;
+        return pixels + (size.dy - 1) * rowBytes;
+    }
+    *stride = rowBytes;
+    return pixels;
+}
+
+bool TileBitmap::Paint(HDC hdc, RectI dst, RectI src) const
+{
+    if (!pixels)
+        return false;
+    src = src.Intersect(RectI(PointI(), size));
+    if (src.IsEmpty())
+        return false;
+
+    // describe only the rows of src as a bitmap of its own, so that the
+    // source rectangle always starts at the bitmap's first row (else the
+    // meaning of StretchDIBits' ySrc would depend on the bitmap's orientation)
+    struct {
+        BITMAPINFOHEADER bmiHeader;
+        RGBQUAD bmiColors[256];
+    } part;
+    size_t infoSize = sizeof(BITMAPINFOHEADER) + std::min(bmi->bmiHeader.biClrUsed, (DWORD)256) * sizeof(RGBQUAD);
+    memcpy(&part, bmi, infoSize);
+    int stride, bpp;
+    const BYTE *row = GetPixels(&stride, &bpp) + stride * src.y;
+    if (stride > 0) {
+        part.bmiHeader.biHeight = -src.dy;
+    }
+    else {
+        // bottom-up rows: start at the lowest row of src
+        row += stride * (src.dy - 1);
+        part.bmiHeader.biHeight = src.dy;
+    }
+    part.bmiHeader.biSizeImage = abs(stride) * src.dy;
+
+    int lines = StretchDIBits(hdc, dst.x, dst.y, dst.dx, dst.dy, src.x, 0, src.dx, src.dy,
+                              row, (BITMAPINFO *)&part, DIB_RGB_COLORS, SRCCOPY);
+    return lines != 0 && lines != GDI_ERROR;
+}
+
+void RenderCache::StartRenderThreads(int count)
+{
+    if (count <= 0) {
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        count = (int)si.dwNumberOfProcessors;
+    }
+    count = limitValue(count, 1, MAX_RENDER_THREADS);
+
+    ScopedCritSec scope(&requestAccess);
+    for (; workerCount < count; workerCount++) {
+        RenderWorker *worker = &workers[workerCount];
+        worker->cache = this;
+        worker->curReq = nullptr;
+        worker->usesClone = false;
+        worker->thread = CreateThread(nullptr, 0, RenderCacheThread, worker, 0, 0);
+        assert(nullptr != worker->thread);
+    }
+}
+
+void RenderCache::SetMaxCacheSize(size_t maxBytes)
+{
+    ScopedCritSec scope(&cacheAccess);
+    maxCacheSize = maxBytes;
+}
+
+// the budget is shared with the decoded images of image documents and comic
+// books (cf. ImageEngine::SetMaxPageCacheMemory), so the memory they use
+// is subtracted; the cache is only allowed to use a quarter of what's left
+// while the system signals that it's running low on physical memory
+size_t RenderCache::GetMaxCacheSize()
+{
+    size_t imageBytes = ImageEngine::GetPageCacheMemory();
+    size_t maxSize = maxCacheSize > imageBytes ? maxCacheSize - imageBytes : 0;
+    BOOL isLow = FALSE;
+    if (lowMemory && QueryMemoryResourceNotification(lowMemory, &isLow) && isLow)
+        return maxSize / 4;
+    return maxSize;
+}
+
 /* Find a bitmap for a page defined by <dm> and <pageNo> and optionally also
    <rotation> and <zoom> in the cache - call DropCacheEntry when you
    no longer need a found entry. */
@@ -66,9 +292,11 @@ BitmapCacheEntry *RenderCache::Find(DisplayModel *dm, int pageNo, int rotation,
     rotation = NormalizeRotation(rotation);
     for (int i = 0; i < cacheCount; i++) {
         BitmapCacheEntry *entry = cache[i];
-        if ((dm == entry->dm) && (pageNo == entry->pageNo) && (rotation == entry->rotation) &&
+        // bitmaps rendered for another view of the same document are just as good
+        if ((dm->documentId == entry->dm->documentId) && (pageNo == entry->pageNo) && (rotation == entry->rotation) &&
             (INVALID_ZOOM == zoom || zoom == entry->zoom) && (!tile || entry->tile == *tile)) {
             entry->refs++;
+            entry->lastUsed = GetTickCount();
             return entry;
         }
     }
@@ -93,7 +321,7 @@ void RenderCache::DropCacheEntry(BitmapCacheEntry *entry)
     }
 }
 
-void RenderCache::Add(PageRenderRequest &req, RenderedBitmap *bitmap)
+void RenderCache::Add(PageRenderRequest &req, TileBitmap *bitmap)
 {
     ScopedCritSec scope(&cacheAccess);
     assert(req.dm);
@@ -101,34 +329,41 @@ void RenderCache::Add(PageRenderRequest &req, RenderedBitmap *bitmap)
     req.rotation = NormalizeRotation(req.rotation);
     assert(cacheCount <= MAX_BITMAPS_CACHED);
 
+    // a preview is only of use as long as there's nothing better to display
+    // (the preview might finish after the actual tile when using several threads)
+    if (req.preview && Exists(req.dm, req.pageNo, req.rotation, INVALID_ZOOM, &req.tile)) {
+        delete bitmap;
+        return;
+    }
+
     /* It's possible there still is a cached bitmap with different zoom/rotation */
     FreePage(req.dm, req.pageNo, &req.tile);
 
-    if (cacheCount >= MAX_BITMAPS_CACHED) {
-        // free an invisible page of the same DisplayModel ...
-        for (int i = 0; i < cacheCount; i++) {
-            if (cache[i]->dm == req.dm && !req.dm->PageVisibleNearby(cache[i]->pageNo)) {
-                DropCacheEntry(cache[i]);
-                cacheCount--;
-                memmove(&cache[i], &cache[i + 1], (cacheCount - i) * sizeof(cache[0]));
-                break;
-            }
-        }
-        // ... or just the oldest cached page
-        if (cacheCount >= MAX_BITMAPS_CACHED) {
-            DropCacheEntry(cache[0]);
-            cacheCount--;
-            memmove(&cache[0], &cache[1], cacheCount * sizeof(cache[0]));
-        }
-    }
-
     // Copy the PageRenderRequest as it will be reused
-    cache[cacheCount] = new BitmapCacheEntry(req.dm, req.pageNo, req.rotation, req.zoom, req.tile, bitmap);
-    CrashIf(!cache[cacheCount]);
-    if (!cache[cacheCount])
+    // (previews are cached as if rendered at some other zoom level so that
+    // they're painted scaled until they're replaced with the actual tile)
+    float zoom = req.preview ? INVALID_ZOOM : req.zoom;
+    BitmapCacheEntry *entry = new BitmapCacheEntry(req.dm, req.pageNo, req.rotation, zoom, req.tile, bitmap);
+    CrashIf(!entry);
+    if (!entry) {
         delete bitmap;
-    else
-        cacheCount++;
+        return;
+    }
+    entry->lowQuality = Quality_FastScroll == req.quality && !req.preview;
+    if (!req.preview)
+        entry->requestTime = req.timestamp;
+
+    // make room for the new bitmap (bitmaps of visible pages are
+    // only evicted if there's no more space left at all)
+    size_t maxSize = GetMaxCacheSize();
+    while (cacheSize + entry->bytes > maxSize && EvictOne(false)) {
+        // evicted a bitmap not currently visible
+    }
+    if (cacheCount >= MAX_BITMAPS_CACHED)
+        EvictOne(true);
+
+    cache[cacheCount++] = entry;
+    cacheSize += entry->bytes;
 }
 
 static RectD GetTileRect(RectD pagerect, TilePosition tile)
@@ -180,6 +415,65 @@ static bool IsTileVisible(DisplayModel *dm, int pageNo, TilePosition tile, float
     return !tileOnScreen.Intersect(screen).IsEmpty();
 }
 
+void RenderCache::RemoveAt(int idx)
+{
+    ScopedCritSec scope(&cacheAccess);
+    CrashIf(idx < 0 || idx >= cacheCount);
+    BitmapCacheEntry *entry = cache[idx];
+    cacheSize -= entry->bytes;
+    cacheCount--;
+    memmove(&cache[idx], &cache[idx + 1], (cacheCount - idx) * sizeof(cache[0]));
+    DropCacheEntry(entry);
+}
+
+// 0 for visible bitmaps (and the ones kept for presentations), 1 for bitmaps
+// of visible pages resp. of pages next to them and 2 for all others
+int RenderCache::GetVisibilityWeight(BitmapCacheEntry *entry)
+{
+    ScopedCritSec scope(&cacheAccess);
+    if (entry->dm == presentationDm && presentationDm->GetPresentationMode() &&
+        abs(entry->pageNo - presentationPageNo) <= 1) {
+        return 0;
+    }
+    if (IsPrefetchPage(entry->dm, entry->pageNo))
+        return 1;
+    if (!entry->dm->PageVisibleNearby(entry->pageNo))
+        return 2;
+    if (!entry->dm->PageVisible(entry->pageNo))
+        return 1;
+    if (entry->tile.res > 1 && !IsTileVisible(entry->dm, entry->pageNo, entry->tile))
+        return 1;
+    return 0;
+}
+
+// frees the least recently used of the least visible bitmaps
+bool RenderCache::EvictOne(bool evictVisible)
+{
+    ScopedCritSec scope(&cacheAccess);
+    int victim = -1, victimWeight = -1;
+    DWORD now = GetTickCount(), victimAge = 0;
+    for (int i = 0; i < cacheCount; i++) {
+        int weight = GetVisibilityWeight(cache[i]);
+        DWORD age = now - cache[i]->lastUsed;
+        if (weight > victimWeight || weight == victimWeight && age > victimAge) {
+            victim = i;
+            victimWeight = weight;
+            victimAge = age;
+        }
+    }
+    if (-1 == victim || 0 == victimWeight && !evictVisible)
+        return false;
+    RemoveAt(victim);
+    return true;
+}
+
+static void AbortRequest(PageRenderRequest *req)
+{
+    if (req->abortCookie)
+        req->abortCookie->Abort();
+    req->abort = true;
+}
+
 /* Free all bitmaps in the cache that are of a specific page (or all pages
    of the given DisplayModel, or even all invisible pages). */
 void RenderCache::FreePage(DisplayModel *dm, int pageNo, TilePosition *tile)
@@ -187,6 +481,18 @@ void RenderCache::FreePage(DisplayModel *dm, int pageNo, TilePosition *tile)
     ScopedCritSec scope(&cacheAccess);
     int cacheCountTmp = cacheCount;
     int curPos = 0;
+    // bitmaps shared with another view of the same document are handed over to it
+    DisplayModel *heir = nullptr;
+    if (dm && INVALID_PAGE_NO == pageNo) {
+        if (presentationDm == dm)
+            presentationDm = nullptr;
+        if (prefetchDm == dm)
+            prefetchDm = nullptr;
+        for (int i = 0; i < cacheCount && !heir; i++) {
+            if (cache[i]->dm != dm && cache[i]->dm->documentId == dm->documentId)
+                heir = cache[i]->dm;
+        }
+    }
 
     for (int i = 0; i < cacheCountTmp; i++) {
         BitmapCacheEntry* entry = cache[i];
@@ -204,6 +510,10 @@ void RenderCache::FreePage(DisplayModel *dm, int pageNo, TilePosition *tile)
         } else if (dm) {
             // all pages of this DisplayModel
             shouldFree = (cache[i]->dm == dm);
+            if (shouldFree && heir) {
+                entry->dm = heir;
+                shouldFree = false;
+            }
         } else {
             // all invisible pages resp. page tiles
             shouldFree = !entry->dm->PageVisibleNearby(entry->pageNo);
@@ -212,6 +522,31 @@ void RenderCache::FreePage(DisplayModel *dm, int pageNo, TilePosition *tile)
         }
 
         if (shouldFree) {
+            cacheSize -= entry->bytes;
+            DropCacheEntry(entry);
+            cache[i] = nullptr;
+            cacheCount--;
+        }
+
+        if (curPos != i)
+            cache[curPos] = cache[i];
+        if (!shouldFree)
+            curPos++;
+    }
+}
+
+// what remains is just enough to show the document right away when the tab is selected again
+void RenderCache::FreeForBackground(DisplayModel *dm)
+{
+    ScopedCritSec scope(&cacheAccess);
+    int cacheCountTmp = cacheCount;
+    int curPos = 0;
+
+    for (int i = 0; i < cacheCountTmp; i++) {
+        BitmapCacheEntry* entry = cache[i];
+        bool shouldFree = entry->dm == dm && (entry->tile.res > 0 || !dm->PageVisible(entry->pageNo));
+        if (shouldFree) {
+            cacheSize -= entry->bytes;
             DropCacheEntry(entry);
             cache[i] = nullptr;
             cacheCount--;
@@ -226,17 +561,38 @@ void RenderCache::FreePage(DisplayModel *dm, int pageNo, TilePosition *tile)
 
 // keep the cached bitmaps for visible pages to avoid flickering during a reload.
 // mark invisible pages as out-of-date to prevent inconsistencies
-void RenderCache::KeepForDisplayModel(DisplayModel *oldDm, DisplayModel *newDm)
+// prevPageNos (if given) contains for each of newDm's pages the number of
+// the identical page in oldDm (or 0), whose bitmaps remain valid
+void RenderCache::KeepForDisplayModel(DisplayModel *oldDm, DisplayModel *newDm, const int *prevPageNos)
 {
     ScopedCritSec scope(&cacheAccess);
+    // newDm's pages are kept once it's rendered (cf. KeepPresentationPages)
+    if (presentationDm == oldDm)
+        presentationDm = nullptr;
+    if (prefetchDm == oldDm)
+        prefetchDm = nullptr;
+    int newPageCount = newDm->PageCount();
     for (int i = 0; i < cacheCount; i++) {
-        if (cache[i]->dm == oldDm) {
-            if (oldDm->PageVisible(cache[i]->pageNo))
-                cache[i]->dm = newDm;
-            // make sure that the page is rerendered eventually
-            cache[i]->zoom = INVALID_ZOOM;
-            cache[i]->outOfDate = true;
+        if (cache[i]->dm != oldDm)
+            continue;
+        int pageNo = cache[i]->pageNo;
+        int newPageNo = 0;
+        for (int n = 1; prevPageNos && n <= newPageCount && !newPageNo; n++) {
+            if (prevPageNos[n - 1] == pageNo)
+                newPageNo = n;
         }
+        if (newPageNo) {
+            cache[i]->dm = newDm;
+            cache[i]->pageNo = newPageNo;
+            continue;
+        }
+        // don't keep stale bitmaps for pages that are replaced with an unchanged one
+        bool isReplaced = prevPageNos && pageNo <= newPageCount && prevPageNos[pageNo - 1] != 0;
+        if (oldDm->PageVisible(pageNo) && !isReplaced)
+            cache[i]->dm = newDm;
+        // make sure that the page is rerendered eventually
+        cache[i]->zoom = INVALID_ZOOM;
+        cache[i]->outOfDate = true;
     }
 }
 
@@ -246,8 +602,14 @@ void RenderCache::Invalidate(DisplayModel *dm, int pageNo, RectD rect)
     ScopedCritSec scopeReq(&requestAccess);
 
     ClearQueueForDisplayModel(dm, pageNo);
-    if (curReq && curReq->dm == dm && curReq->pageNo == pageNo)
-        AbortCurrentRequest();
+    AbortCurrentRequests(dm, pageNo);
+    // make sure that engine clones pick up the modification as well
+    for (int i = 0; i < workerCount; i++) {
+        for (EngineClone& ec : workers[i].clones) {
+            if (ec.dm == dm)
+                ec.outOfDate = true;
+        }
+    }
 
     ScopedCritSec scopeCache(&cacheAccess);
 
@@ -259,6 +621,8 @@ void RenderCache::Invalidate(DisplayModel *dm, int pageNo, RectD rect)
             cache[i]->outOfDate = true;
         }
     }
+    // other views of the document don't see the modification
+    dm->UnshareDocument();
 }
 
 // determine the count of tiles required for a page at a given zoom level
@@ -286,10 +650,84 @@ USHORT RenderCache::GetTileRes(DisplayModel *dm, int pageNo)
     USHORT res = 0;
     if (factorAvg > 1.5)
         res = (USHORT)ceilf(log(factorAvg) / log(2.0f));
+
+    // adapt the tile size to how expensive the page has proven to render
+    float msPerMPixel = GetRenderCost(dm, pageNo);
+    if (msPerMPixel > 0) {
+        float pageMs = msPerMPixel * (float)(pixelbox.dx * pixelbox.dy) / 1000000.0f;
+        float tileMs = pageMs / (1 << (2 * std::min(res, (USHORT)14)));
+        if (tileMs > EXPENSIVE_TILE_RENDER_MS && workerCount > 1) {
+            res++;
+        }
+        else if (pageMs < CHEAP_PAGE_RENDER_MS && res > 0 &&
+                 pixelbox.dx / (1 << (res - 1)) <= 2 * maxTileSize.dx &&
+                 pixelbox.dy / (1 << (res - 1)) <= 2 * maxTileSize.dy) {
+            res--;
+        }
+    }
+
     // limit res to 30, so that (1 << res) doesn't overflow for 32-bit signed int
     return std::min(res, (USHORT)30);
 }
 
+// updates the rendering cost for a page after a tile of <size> pixels has been rendered
+void RenderCache::RecordRenderCost(DisplayModel *dm, int pageNo, SizeI size, double renderMs)
+{
+    if (size.IsEmpty())
+        return;
+    float msPerMPixel = (float)(renderMs * 1000000.0 / ((double)size.dx * size.dy));
+
+    ScopedCritSec scope(&cacheAccess);
+    PageRenderCost *cost = nullptr;
+    for (int i = 0; i < renderCostCount && !cost; i++) {
+        if (renderCosts[i].dm == dm && renderCosts[i].pageNo == pageNo)
+            cost = &renderCosts[i];
+    }
+    if (cost) {
+        // weigh the latest measurement heavily since the first rendering
+        // of a page usually includes one-time costs (e.g. loading fonts)
+        cost->msPerMPixel = (cost->msPerMPixel + msPerMPixel * 3) / 4;
+    }
+    else {
+        if (renderCostCount < MAX_PAGE_RENDER_COSTS) {
+            cost = &renderCosts[renderCostCount++];
+        }
+        else {
+            // replace the least recently updated entry
+            cost = &renderCosts[0];
+            for (int i = 1; i < renderCostCount; i++) {
+                if (renderCosts[i].lastUpdated < cost->lastUpdated)
+                    cost = &renderCosts[i];
+            }
+        }
+        cost->dm = dm;
+        cost->pageNo = pageNo;
+        cost->msPerMPixel = msPerMPixel;
+    }
+    cost->lastUpdated = GetTickCount();
+}
+
+// returns the moving average of the rendering time per megapixel
+// for the given page or 0 if the page hasn't been rendered yet
+float RenderCache::GetRenderCost(DisplayModel *dm, int pageNo)
+{
+    ScopedCritSec scope(&cacheAccess);
+    for (int i = 0; i < renderCostCount; i++) {
+        if (renderCosts[i].dm == dm && renderCosts[i].pageNo == pageNo)
+            return renderCosts[i].msPerMPixel;
+    }
+    return 0;
+}
+
+void RenderCache::DropRenderCosts(DisplayModel *dm)
+{
+    ScopedCritSec scope(&cacheAccess);
+    for (int i = renderCostCount - 1; i >= 0; i--) {
+        if (renderCosts[i].dm == dm)
+            renderCosts[i] = renderCosts[--renderCostCount];
+    }
+}
+
 // get the maximum resolution available for the given page
 USHORT RenderCache::GetMaxTileRes(DisplayModel *dm, int pageNo, int rotation)
 {
@@ -324,13 +762,16 @@ bool RenderCache::ReduceTileSize()
         FreeForDisplayModel(cache[0]->dm);
     while (requestCount > 0)
         ClearQueueForDisplayModel(requests[0].dm);
-    AbortCurrentRequest();
+    AbortCurrentRequests();
 
     return true;
 }
 
 void RenderCache::RequestRendering(DisplayModel *dm, int pageNo)
 {
+    // make room for the new request (e.g. after scrolling)
+    AbortObsoleteRequests(dm);
+
     TilePosition tile(GetTileRes(dm, pageNo), 0, 0);
     // only honor the request if there's a good chance that the
     // rendered tile will actually be used
@@ -346,6 +787,89 @@ void RenderCache::RequestRendering(DisplayModel *dm, int pageNo)
     }
 }
 
+void RenderCache::KeepPresentationPages(DisplayModel *dm, int pageNo)
+{
+    {
+        ScopedCritSec scope(&cacheAccess);
+        presentationDm = dm;
+        presentationPageNo = pageNo;
+    }
+    AbortObsoleteRequests(dm);
+
+    int pageNos[] = { pageNo + 1, pageNo - 1 };
+    for (int neighborNo : pageNos) {
+        if (dm->ValidPageNo(neighborNo) && dm->ShouldCacheRendering(neighborNo))
+            RequestAllTiles(dm, neighborNo);
+    }
+}
+
+void RenderCache::PrefetchPage(DisplayModel *dm, int pageNo)
+{
+    if (!dm->ValidPageNo(pageNo) || !dm->ShouldCacheRendering(pageNo)) {
+        CancelPrefetch(dm);
+        return;
+    }
+    DisplayModel *prevDm;
+    {
+        ScopedCritSec scope(&cacheAccess);
+        if (prefetchDm == dm && prefetchPageNo == pageNo)
+            return;
+        prevDm = prefetchDm;
+        prefetchDm = dm;
+        prefetchPageNo = pageNo;
+    }
+    // drop the requests for the previously hovered link's destination
+    if (prevDm)
+        AbortObsoleteRequests(prevDm);
+    // nearby pages are rendered (and kept) anyway
+    if (dm->PageVisibleNearby(pageNo))
+        return;
+    // following the link shows the destination's entire spread
+    int partnerNo = dm->GetSpreadPartner(pageNo);
+    if (partnerNo && dm->ShouldCacheRendering(partnerNo))
+        RequestAllTiles(dm, partnerNo);
+    RequestAllTiles(dm, pageNo);
+}
+
+void RenderCache::CancelPrefetch(DisplayModel *dm)
+{
+    DisplayModel *prevDm;
+    {
+        ScopedCritSec scope(&cacheAccess);
+        if (!prefetchDm || dm && prefetchDm != dm)
+            return;
+        prevDm = prefetchDm;
+        prefetchDm = nullptr;
+    }
+    AbortObsoleteRequests(prevDm);
+}
+
+// whether pageNo is the destination page passed to PrefetchPage
+// or the other page of that destination's spread
+bool RenderCache::IsPrefetchPage(DisplayModel *dm, int pageNo)
+{
+    ScopedCritSec scope(&cacheAccess);
+    if (!prefetchDm || dm != prefetchDm)
+        return false;
+    return pageNo == prefetchPageNo || pageNo == dm->GetSpreadPartner(prefetchPageNo);
+}
+
+// unlike RequestRendering, this renders all tiles of a page (if there aren't
+// too many), since whole slides resp. link destinations are about to be shown
+void RenderCache::RequestAllTiles(DisplayModel *dm, int pageNo)
+{
+    TilePosition tile(GetTileRes(dm, pageNo), 0, 0);
+    if (tile.res > 1)
+        return;
+    bool clearQueueForPage = true;
+    for (tile.row = 0; tile.row < (1 << tile.res); tile.row++) {
+        for (tile.col = 0; tile.col < (1 << tile.res); tile.col++) {
+            RequestRendering(dm, pageNo, tile, clearQueueForPage);
+            clearQueueForPage = false;
+        }
+    }
+}
+
 /* Render a bitmap for page <pageNo> in <dm>. */
 void RenderCache::RequestRendering(DisplayModel *dm, int pageNo, TilePosition tile, bool clearQueueForPage)
 {
@@ -357,14 +881,15 @@ void RenderCache::RequestRendering(DisplayModel *dm, int pageNo, TilePosition ti
     int rotation = NormalizeRotation(dm->GetRotation());
     float zoom = dm->GetZoomReal(pageNo);
 
-    if (curReq && (curReq->pageNo == pageNo) && (curReq->dm == dm) && (curReq->tile == tile)) {
+    PageRenderRequest *curReq = GetCurrentRequest(dm, pageNo, tile);
+    if (curReq) {
         if ((curReq->zoom == zoom) && (curReq->rotation == rotation)) {
             /* we're already rendering exactly the same page */
             return;
         }
         /* Currently rendered page is for the same page but with different zoom
         or rotation, so abort it */
-        AbortCurrentRequest();
+        AbortRequest(curReq);
     }
 
     // clear requests for tiles of different resolution and invisible tiles
@@ -373,7 +898,7 @@ void RenderCache::RequestRendering(DisplayModel *dm, int pageNo, TilePosition ti
 
     for (int i = 0; i < requestCount; i++) {
         PageRenderRequest* req = &(requests[i]);
-        if ((req->pageNo == pageNo) && (req->dm == dm) && (req->tile == tile)) {
+        if ((req->pageNo == pageNo) && (req->dm == dm) && (req->tile == tile) && !req->preview) {
             if ((req->zoom == zoom) && (req->rotation == rotation)) {
                 /* Request with exactly the same parameters already queued for
                    rendering. Move it to the top of the queue so that it'll
@@ -398,7 +923,33 @@ void RenderCache::RequestRendering(DisplayModel *dm, int pageNo, TilePosition ti
         return;
     }
 
-    Render(dm, pageNo, rotation, zoom, &tile);
+    // show something as quickly as possible if there's nothing at all
+    // that could be displayed for this visible page at the moment
+    bool needsPreview = dm->PageVisible(pageNo) && !Exists(dm, pageNo, rotation);
+    if (Render(dm, pageNo, rotation, zoom, &tile) && needsPreview)
+        RequestPreview(dm, pageNo, rotation, zoom, tile);
+}
+
+// requests a low resolution rendering of a tile which is rendered before
+// (and then replaced with) the actual tile
+void RenderCache::RequestPreview(DisplayModel *dm, int pageNo, int rotation, float zoom, TilePosition tile)
+{
+    ScopedCritSec scope(&requestAccess);
+    // don't push the actual request out of the queue
+    if (IsRenderQueueFull())
+        return;
+    for (int i = 0; i < requestCount; i++) {
+        if (requests[i].preview && requests[i].dm == dm && requests[i].pageNo == pageNo && requests[i].tile == tile)
+            return;
+    }
+    if (!Render(dm, pageNo, rotation, zoom, &tile))
+        return;
+    // the pageRect of the tile remains the same, only fewer pixels are rendered
+    PageRenderRequest *req = &requests[requestCount - 1];
+    req->zoom = zoom * PREVIEW_ZOOM_FACTOR;
+    req->preview = true;
+    if (dm->fastScrollRendering)
+        req->quality = Quality_FastScroll;
 }
 
 void RenderCache::Render(DisplayModel *dm, int pageNo, int rotation, float zoom, RectD pageRect, RenderingCallback& callback)
@@ -450,9 +1001,16 @@ bool RenderCache::Render(DisplayModel *dm, int pageNo, int rotation, float zoom,
     }
     else
         assert(0);
+    newRequest->preview = false;
+    // tiles rendered while scrolling fast are replaced once scrolling stops (cf. PaintTile)
+    if (tile && dm->fastScrollRendering && dm->IsScrollingFast())
+        newRequest->quality = Quality_FastScroll;
+    else
+        newRequest->quality = dm->renderQuality;
     newRequest->abort = false;
     newRequest->abortCookie = nullptr;
     newRequest->timestamp = GetTickCount();
+    newRequest->repaintSpread = false;
     newRequest->renderCb = renderCb;
 
     SetEvent(startRendering);
@@ -464,7 +1022,8 @@ UINT RenderCache::GetRenderDelay(DisplayModel *dm, int pageNo, TilePosition tile
 {
     ScopedCritSec scope(&requestAccess);
 
-    if (curReq && curReq->pageNo == pageNo && curReq->dm == dm && curReq->tile == tile)
+    PageRenderRequest *curReq = GetCurrentRequest(dm, pageNo, tile);
+    if (curReq)
         return GetTickCount() - curReq->timestamp;
 
     for (int i = 0; i < requestCount; i++)
@@ -474,33 +1033,175 @@ UINT RenderCache::GetRenderDelay(DisplayModel *dm, int pageNo, TilePosition tile
     return RENDER_DELAY_UNDEFINED;
 }
 
-bool RenderCache::GetNextRequest(PageRenderRequest *req)
+// only engines which are cheap to clone and which don't serialize
+// rendering across instances can be rendered by several threads at once
+static bool CanRenderWithClone(DisplayModel *dm)
+{
+    return Engine_PDF == dm->engineType || Engine_XPS == dm->engineType;
+}
+
+// whether a request for dm is being rendered with dm's own engine
+bool RenderCache::IsEngineBusy(DisplayModel *dm)
 {
     ScopedCritSec scope(&requestAccess);
+    for (int i = 0; i < workerCount; i++) {
+        if (workers[i].curReq && workers[i].curReq->dm == dm && !workers[i].usesClone)
+            return true;
+    }
+    return false;
+}
 
-    if (requestCount == 0)
-        return false;
+PageRenderRequest *RenderCache::GetCurrentRequest(DisplayModel *dm, int pageNo, TilePosition tile)
+{
+    ScopedCritSec scope(&requestAccess);
+    for (int i = 0; i < workerCount; i++) {
+        PageRenderRequest *req = workers[i].curReq;
+        if (req && req->pageNo == pageNo && req->dm == dm && req->tile == tile && !req->preview)
+            return req;
+    }
+    return nullptr;
+}
+
+// offset of the tile edge closest to the center of the screen
+// along one axis (0 if the tile spans the center)
+static int GetCenterOffset(int start, int end, int center)
+{
+    if (start > center)
+        return start - center;
+    if (end < center)
+        return end - center;
+    return 0;
+}
+
+// returns a lower value for requests which should be rendered sooner:
+// previews come before all other tiles, tiles closer to the center of the
+// screen come first, tiles ahead of the most recent scrolling direction
+// come before those left behind and at equal distance, tiles of lower
+// resolution (i.e. larger area) come first
+static int GetRenderPriority(PageRenderRequest *req)
+{
+    // always prefer requests someone is waiting for
+    if (req->renderCb)
+        return INT_MIN;
+
+    DisplayModel *dm = req->dm;
+    PageInfo *pageInfo = dm->GetPageInfo(req->pageNo);
+    if (!pageInfo || !pageInfo->shown)
+        return INT_MAX;
+
+    RectI tileOnScreen = GetTileOnScreen(dm->GetEngine(), req->pageNo, req->rotation, req->zoom, req->tile, pageInfo->pageOnScreen);
+    RectI screen(PointI(), dm->GetViewPort().Size());
+    PointI scroll = dm->GetScrollDelta();
+    // prevent overflows for extreme zoom levels
+    int offX = limitValue(GetCenterOffset(tileOnScreen.x, tileOnScreen.BR().x, screen.dx / 2), -(1 << 24), 1 << 24);
+    int offY = limitValue(GetCenterOffset(tileOnScreen.y, tileOnScreen.BR().y, screen.dy / 2), -(1 << 24), 1 << 24);
+    if ((offX < 0 && scroll.x > 0) || (offX > 0 && scroll.x < 0))
+        offX *= 2;
+    if ((offY < 0 && scroll.y > 0) || (offY > 0 && scroll.y < 0))
+        offY *= 2;
+
+    int distance = abs(offX) + abs(offY);
+    if (tileOnScreen.Intersect(screen).IsEmpty())
+        distance += screen.dx + screen.dy;
+    int priority = distance * 4 + std::min((int)req->tile.res, 3);
+    return req->preview ? priority - (1 << 30) : priority;
+}
 
-    assert(requestCount > 0);
+bool RenderCache::GetNextRequest(RenderWorker *worker)
+{
+    ScopedCritSec scope(&requestAccess);
+    assert(!worker->curReq);
     assert(requestCount <= MAX_PAGE_REQUESTS);
+
+    // take the most urgent request that can be rendered right away, i.e.
+    // either its engine isn't in use or a clone of it can be used instead
+    // (among requests of equal priority, the most recent one wins)
+    int next = -1, nextPriority = INT_MAX;
+    bool nextIsBusy = false;
+    for (int i = requestCount - 1; i >= 0; i--) {
+        bool isBusy = IsEngineBusy(requests[i].dm);
+        if (isBusy && !CanRenderWithClone(requests[i].dm))
+            continue;
+        int priority = GetRenderPriority(&requests[i]);
+        if (-1 == next || priority < nextPriority) {
+            next = i;
+            nextPriority = priority;
+            nextIsBusy = isBusy;
+        }
+    }
+    if (-1 == next)
+        return false;
+
+    worker->req = requests[next];
     requestCount--;
-    *req = requests[requestCount];
-    curReq = req;
+    memmove(&requests[next], &requests[next + 1], (requestCount - next) * sizeof(PageRenderRequest));
+    worker->curReq = &worker->req;
+    worker->usesClone = nextIsBusy;
     assert(requestCount >= 0);
-    assert(!req->abort);
+    assert(!worker->req.abort);
 
+    // wake up another rendering thread for the remaining requests
+    if (requestCount > 0)
+        SetEvent(startRendering);
     return true;
 }
 
-bool RenderCache::ClearCurrentRequest()
+void RenderCache::ClearCurrentRequest(RenderWorker *worker)
 {
     ScopedCritSec scope(&requestAccess);
-    if (curReq)
-        delete curReq->abortCookie;
-    curReq = nullptr;
+    // the other page of the spread has been waiting for this request, which
+    // was skipped or aborted (repainting is asynchronous, so this is done before
+    // CancelRendering can consider curReq->dm to be no longer in use)
+    if (worker->curReq && worker->curReq->repaintSpread)
+        worker->curReq->dm->RepaintDisplay();
+    if (worker->curReq)
+        delete worker->curReq->abortCookie;
+    worker->curReq = nullptr;
+    worker->usesClone = false;
+}
+
+// returns nullptr if dm's engine can't be cloned
+BaseEngine *RenderCache::GetEngineClone(RenderWorker *worker, DisplayModel *dm)
+{
+    BaseEngine *outdated = nullptr;
+    EnterCriticalSection(&requestAccess);
+    for (size_t i = 0; i < worker->clones.Count(); i++) {
+        EngineClone& ec = worker->clones.At(i);
+        if (ec.dm != dm)
+            continue;
+        if (!ec.outOfDate) {
+            LeaveCriticalSection(&requestAccess);
+            return ec.engine;
+        }
+        outdated = ec.engine;
+        worker->clones.RemoveAt(i);
+        break;
+    }
+    LeaveCriticalSection(&requestAccess);
+
+    // cloning can take a while, so don't block the queue meanwhile
+    // (CancelRendering waits for our curReq, so dm remains valid)
+    delete outdated;
+    EngineClone ec = { dm, dm->GetEngine()->Clone(), false };
 
-    bool isQueueEmpty = requestCount == 0;
-    return isQueueEmpty;
+    ScopedCritSec scope(&requestAccess);
+    worker->clones.Append(ec);
+    return ec.engine;
+}
+
+// must only be called while no request for dm is being rendered
+void RenderCache::DeleteEngineClones(DisplayModel *dm)
+{
+    ScopedCritSec scope(&requestAccess);
+    for (int i = 0; i < workerCount; i++) {
+        Vec<EngineClone>& clones = workers[i].clones;
+        for (size_t j = clones.Count(); j > 0; j--) {
+            if (clones.At(j - 1).dm == dm) {
+                delete clones.At(j - 1).engine;
+                clones.RemoveAt(j - 1);
+            }
+        }
+    }
 }
 
 /* Wait until rendering of a page beloging to <dm> has finished. */
@@ -512,14 +1213,20 @@ void RenderCache::CancelRendering(DisplayModel *dm)
 
     for (;;) {
         EnterCriticalSection(&requestAccess);
-        if (!curReq || (curReq->dm != dm)) {
+        bool isRendering = false;
+        for (int i = 0; i < workerCount && !isRendering; i++) {
+            isRendering = workers[i].curReq && workers[i].curReq->dm == dm;
+        }
+        if (!isRendering) {
             // to be on the safe side
             ClearQueueForDisplayModel(dm);
+            DeleteEngineClones(dm);
             LeaveCriticalSection(&requestAccess);
+            DropRenderCosts(dm);
             return;
         }
 
-        AbortCurrentRequest();
+        AbortCurrentRequests(dm);
         LeaveCriticalSection(&requestAccess);
 
         /* TODO: busy loop is not good, but I don't have a better idea */
@@ -547,33 +1254,294 @@ void RenderCache::ClearQueueForDisplayModel(DisplayModel *dm, int pageNo, TilePo
     }
 }
 
-void RenderCache::AbortCurrentRequest()
+// whether a tile request is no longer worth rendering because the tile
+// has been scrolled far enough off screen that it'd be freed right away
+// (uses the same criteria as FreeNotVisible)
+static bool IsRequestObsolete(PageRenderRequest *req)
+{
+    if (req->renderCb || req->abort)
+        return false;
+    if (!req->dm->PageVisibleNearby(req->pageNo))
+        return true;
+    return req->tile.res > 1 && !IsTileVisible(req->dm, req->pageNo, req->tile, 2.0);
+}
+
+// drops queued requests and aborts requests currently being rendered
+// for tiles of dm which are no longer visible
+void RenderCache::AbortObsoleteRequests(DisplayModel *dm)
+{
+    ScopedCritSec scope(&requestAccess);
+    // the destination of a hovered link remains requested (cf. PrefetchPage)
+    for (int i = 0; i < workerCount; i++) {
+        PageRenderRequest *req = workers[i].curReq;
+        if (req && req->dm == dm && IsRequestObsolete(req) && !IsPrefetchPage(dm, req->pageNo))
+            AbortRequest(req);
+    }
+
+    int curPos = 0;
+    for (int i = 0; i < requestCount; i++) {
+        if (requests[i].dm == dm && IsRequestObsolete(&requests[i]) && !IsPrefetchPage(dm, requests[i].pageNo))
+            continue;
+        if (i != curPos)
+            requests[curPos] = requests[i];
+        curPos++;
+    }
+    requestCount = curPos;
+}
+
+// aborts all requests currently being rendered (for dm and pageNo, if given)
+void RenderCache::AbortCurrentRequests(DisplayModel *dm, int pageNo)
 {
     ScopedCritSec scope(&requestAccess);
-    if (!curReq)
+    for (int i = 0; i < workerCount; i++) {
+        PageRenderRequest *req = workers[i].curReq;
+        if (!req || (dm && req->dm != dm) || (pageNo != INVALID_PAGE_NO && req->pageNo != pageNo))
+            continue;
+        AbortRequest(req);
+    }
+}
+
+// how the pixels of a downsampled tile's row or column are composed of the source
+// pixels: the (area) weights of up to three pixels of one of the source tiles
+struct DownsampleSpan {
+    int part, first, count;
+    int weights[3];
+};
+
+// maps count pixels from device coordinate start at the target zoom level to the
+// source pixels at the source zoom level (scale times larger), where the source
+// tiles begin at partStart (device coordinates sorted ascending) and are partSize large
+static bool GetDownsampleSpans(DownsampleSpan *spans, int start, int count, double originT, double originS,
+                               double scale, const int *partStart, const int *partSize, int parts)
+{
+    for (int i = 0; i < count; i++) {
+        double from = originS + (start + i - originT) * scale;
+        double to = from + scale;
+        DownsampleSpan& span = spans[i];
+        span.part = 0;
+        while (span.part + 1 < parts && (from + to) / 2 >= partStart[span.part + 1])
+            span.part++;
+        from = limitValue(from - partStart[span.part], 0.0, (double)partSize[span.part]);
+        to = limitValue(to - partStart[span.part], 0.0, (double)partSize[span.part]);
+        if (to <= from)
+            return false;
+        span.first = (int)floor(from);
+        span.count = 0;
+        int total = 0;
+        for (int px = span.first; px < to && span.count < 3; px++) {
+            double overlap = std::min(to, px + 1.0) - std::max(from, (double)px);
+            span.weights[span.count] = (int)(overlap / (to - from) * 256 + 0.5);
+            total += span.weights[span.count++];
+        }
+        span.weights[span.count - 1] += 256 - total;
+    }
+    return true;
+}
+
+static inline void AddWeightedPixel(const BYTE *row, int x, int bpp, const RGBQUAD *palette, int weight, int sums[3])
+{
+    if (8 == bpp) {
+        const RGBQUAD& color = palette[row[x]];
+        sums[0] += color.rgbBlue * weight;
+        sums[1] += color.rgbGreen * weight;
+        sums[2] += color.rgbRed * weight;
         return;
-    if (curReq->abortCookie)
-        curReq->abortCookie->Abort();
-    curReq->abort = true;
+    }
+    const BYTE *px = row + x * (bpp / 8);
+    sums[0] += px[0] * weight;
+    sums[1] += px[1] * weight;
+    sums[2] += px[2] * weight;
+}
+
+// scales the cached tiles covering req's tile at the smallest zoom level
+// larger than req's (within MAX_DOWNSAMPLE_FACTOR) down with a box filter
+// returns nullptr if the tile has to be rendered
+TileBitmap *RenderCache::DownsampleTile(PageRenderRequest& req)
+{
+    if (req.preview || req.renderCb)
+        return nullptr;
+
+    DisplayModel *dm = req.dm;
+    int rotation = NormalizeRotation(req.rotation);
+    BitmapCacheEntry *sources[4];
+    int sourceCount = 0;
+    float srcZoom = 0;
+    EnterCriticalSection(&cacheAccess);
+    // source tiles are either at the same or at the next higher resolution
+    // (in which case four of them cover the requested one)
+    Vec<BitmapCacheEntry *> candidates;
+    for (int i = 0; i < cacheCount; i++) {
+        BitmapCacheEntry *e = cache[i];
+        int d = e->tile.res - req.tile.res;
+        if (e->dm->documentId == dm->documentId && e->pageNo == req.pageNo && e->rotation == rotation &&
+            e->zoom != INVALID_ZOOM && e->zoom > req.zoom && e->zoom <= req.zoom * MAX_DOWNSAMPLE_FACTOR &&
+            !e->outOfDate && !e->lowQuality && e->bitmap && e->bitmap->HasPixels() &&
+            (0 == d || 1 == d) && (e->tile.row >> d) == req.tile.row && (e->tile.col >> d) == req.tile.col) {
+            candidates.Append(e);
+        }
+    }
+    USHORT srcRes = 0;
+    for (BitmapCacheEntry *e : candidates) {
+        if (srcZoom != 0 && e->zoom >= srcZoom)
+            continue;
+        int count = 0;
+        for (BitmapCacheEntry *other : candidates) {
+            if (other->zoom == e->zoom && other->tile.res == e->tile.res)
+                count++;
+        }
+        if (count == 1 << (2 * (e->tile.res - req.tile.res))) {
+            srcZoom = e->zoom;
+            srcRes = e->tile.res;
+        }
+    }
+    for (BitmapCacheEntry *e : candidates) {
+        if (e->zoom == srcZoom && e->tile.res == srcRes && sourceCount < (int)dimof(sources)) {
+            e->refs++;
+            sources[sourceCount++] = e;
+        }
+    }
+    LeaveCriticalSection(&cacheAccess);
+    if (0 == sourceCount)
+        return nullptr;
+
+    // the source tiles' columns and rows in device coordinates
+    BaseEngine *engine = dm->GetEngine();
+    RectI target = GetTileRectDevice(engine, req.pageNo, rotation, req.zoom, req.tile);
+    RectI srcRects[4];
+    int colStart[2], colSize[2], rowStart[2], rowSize[2], cols = 0, rows = 0;
+    bool ok = !target.IsEmpty();
+    for (int i = 0; i < sourceCount && ok; i++) {
+        srcRects[i] = GetTileRectDevice(engine, req.pageNo, rotation, srcZoom, sources[i]->tile);
+        ok = srcRects[i].Size() == sources[i]->bitmap->Size();
+        if (0 == cols || (srcRects[i].x != colStart[0] && (1 == cols || srcRects[i].x != colStart[1]))) {
+            if (cols < 2) {
+                colStart[cols] = srcRects[i].x;
+                colSize[cols++] = srcRects[i].dx;
+            }
+        }
+        if (0 == rows || (srcRects[i].y != rowStart[0] && (1 == rows || srcRects[i].y != rowStart[1]))) {
+            if (rows < 2) {
+                rowStart[rows] = srcRects[i].y;
+                rowSize[rows++] = srcRects[i].dy;
+            }
+        }
+    }
+    if (cols == 2 && colStart[1] < colStart[0]) {
+        std::swap(colStart[0], colStart[1]);
+        std::swap(colSize[0], colSize[1]);
+    }
+    if (rows == 2 && rowStart[1] < rowStart[0]) {
+        std::swap(rowStart[0], rowStart[1]);
+        std::swap(rowSize[0], rowSize[1]);
+    }
+    ok = ok && cols * rows == sourceCount;
+
+    // sources[grid[row][col]] holds the pixels of that part of the tile
+    int grid[2][2] = { { -1, -1 }, { -1, -1 } };
+    for (int i = 0; i < sourceCount && ok; i++) {
+        int col = srcRects[i].x == colStart[0] ? 0 : 1;
+        int row = srcRects[i].y == rowStart[0] ? 0 : 1;
+        grid[row][col] = i;
+    }
+
+    TileBitmap *result = nullptr;
+    ScopedMem<DownsampleSpan> colSpans(ok ? AllocArray<DownsampleSpan>(target.dx) : nullptr);
+    ScopedMem<DownsampleSpan> rowSpans(ok ? AllocArray<DownsampleSpan>(target.dy) : nullptr);
+    if (colSpans && rowSpans) {
+        RectD mediabox = engine->PageMediabox(req.pageNo);
+        RectD pageT = engine->Transform(mediabox, req.pageNo, req.zoom, rotation);
+        RectD pageS = engine->Transform(mediabox, req.pageNo, srcZoom, rotation);
+        ok = GetDownsampleSpans(colSpans, target.x, target.dx, pageT.x, pageS.x, pageS.dx / pageT.dx, colStart, colSize, cols) &&
+             GetDownsampleSpans(rowSpans, target.y, target.dy, pageT.y, pageS.y, pageS.dy / pageT.dy, rowStart, rowSize, rows);
+        for (int i = 0; i < sourceCount && ok; i++) {
+            int stride, bpp;
+            ok = sources[i]->bitmap->GetPixels(&stride, &bpp) && (32 == bpp || 24 == bpp || (8 == bpp && sources[i]->bitmap->GetPalette()));
+        }
+        BYTE *dst = nullptr;
+        if (ok)
+            result = TileBitmap::Create(target.Size(), &dst);
+        for (int y = 0; result && y < target.dy; y++) {
+            const DownsampleSpan& ys = rowSpans[y];
+            for (int x = 0; x < target.dx; x++) {
+                const DownsampleSpan& xs = colSpans[x];
+                BitmapCacheEntry *src = sources[grid[ys.part][xs.part]];
+                int stride, bpp;
+                const BYTE *pixels = src->bitmap->GetPixels(&stride, &bpp);
+                const RGBQUAD *palette = src->bitmap->GetPalette();
+                int sums[3] = { 0 };
+                for (int j = 0; j < ys.count; j++) {
+                    const BYTE *row = pixels + (ys.first + j) * stride;
+                    int rowSums[3] = { 0 };
+                    for (int i = 0; i < xs.count; i++) {
+                        AddWeightedPixel(row, xs.first + i, bpp, palette, xs.weights[i], rowSums);
+                    }
+                    for (int c = 0; c < 3; c++) {
+                        sums[c] += rowSums[c] * ys.weights[j];
+                    }
+                }
+                dst[0] = (BYTE)(sums[0] >> 16);
+                dst[1] = (BYTE)(sums[1] >> 16);
+                dst[2] = (BYTE)(sums[2] >> 16);
+                dst[3] = 0xFF;
+                dst += 4;
+            }
+        }
+    }
+
+    for (int i = 0; i < sourceCount; i++) {
+        DropCacheEntry(sources[i]);
+    }
+    return result;
+}
+
+// in facing and book view modes, a tile finished while the other page of
+// its spread is still being rendered (at the same zoom level) isn't shown
+// until that page's tile has been finished as well, so that both halves
+// of a spread replace their previews at once
+bool RenderCache::DeferSpreadRepaint(RenderWorker *worker)
+{
+    ScopedCritSec scope(&requestAccess);
+    PageRenderRequest *req = worker->curReq;
+    if (!req || req->preview)
+        return false;
+    if (req->repaintSpread) {
+        // the other page is already waiting for this one, so repaint right away
+        req->repaintSpread = false;
+        return false;
+    }
+    int partnerNo = req->dm->GetSpreadPartner(req->pageNo);
+    if (!partnerNo)
+        return false;
+    for (int i = 0; i < workerCount; i++) {
+        PageRenderRequest *other = workers[i].curReq;
+        if (other && other != req && other->dm == req->dm && other->pageNo == partnerNo &&
+            other->zoom == req->zoom && other->rotation == req->rotation &&
+            !other->preview && !other->abort && !other->renderCb) {
+            other->repaintSpread = true;
+            return true;
+        }
+    }
+    return false;
 }
 
 DWORD WINAPI RenderCache::RenderCacheThread(LPVOID data)
 {
-    RenderCache *cache = (RenderCache *)data;
-    PageRenderRequest   req;
+    RenderWorker *worker = (RenderWorker *)data;
+    RenderCache *cache = worker->cache;
+    PageRenderRequest&  req = worker->req;
     RenderedBitmap *    bmp;
 
     for (;;) {
-        if (cache->ClearCurrentRequest()) {
-            DWORD waitResult = WaitForSingleObject(cache->startRendering, INFINITE);
-            // Is it not a page render request?
-            if (WAIT_OBJECT_0 != waitResult)
-                continue;
+        cache->ClearCurrentRequest(worker);
+        if (!cache->GetNextRequest(worker)) {
+            WaitForSingleObject(cache->startRendering, INFINITE);
+            continue;
         }
 
-        if (!cache->GetNextRequest(&req))
-            continue;
-        if (!req.dm->PageVisibleNearby(req.pageNo) && !req.renderCb)
+        // temporary data needed for rendering and text extraction
+        // is allocated from the thread's ScratchArena
+        ScopedScratch scratch;
+        if (!req.dm->PageVisibleNearby(req.pageNo) && !req.renderCb && !cache->IsPrefetchPage(req.dm, req.pageNo))
             continue;
         if (req.dm->dontRenderFlag) {
             if (req.renderCb)
@@ -581,14 +1549,49 @@ DWORD WINAPI RenderCache::RenderCacheThread(LPVOID data)
             continue;
         }
 
-        // make sure that we have extracted page text for
-        // all rendered pages to allow text selection and
-        // searching without any further delays
-        if (!req.dm->textCache->HasData(req.pageNo))
+        // after zooming out, the cached tiles of the previous zoom level
+        // are usually good enough for producing the new ones
+        TileBitmap *scaled = cache->DownsampleTile(req);
+        if (scaled) {
+            cache->Add(req, scaled);
+            if (!cache->DeferSpreadRepaint(worker))
+                req.dm->RepaintDisplay();
+            continue;
+        }
+
+        BaseEngine *engine = req.dm->GetEngine();
+        if (worker->usesClone) {
+            // fall back to the (thread-safe) original if cloning failed
+            BaseEngine *clone = cache->GetEngineClone(worker, req.dm);
+            if (clone)
+                engine = clone;
+        }
+        else if (!req.dm->textCache->HasData(req.pageNo)) {
+            // make sure that we have extracted page text for
+            // all rendered pages to allow text selection and
+            // searching without any further delays
+            // (not done for clones so that they don't have to wait
+            // for the original engine)
             req.dm->textCache->GetData(req.pageNo);
+        }
 
         CrashIf(req.abortCookie != nullptr);
-        bmp = req.dm->GetEngine()->RenderBitmap(req.pageNo, req.zoom, req.rotation, &req.pageRect, Target_View, &req.abortCookie);
+        Timer t;
+        etw::Span span("RenderCacheRequest", etw::KeywordRender, req.pageNo);
+        ScopedMemTraceTag memTag(MemTag_RenderCache);
+        engine->SetRenderQuality(req.quality);
+        bmp = engine->RenderBitmap(req.pageNo, req.zoom, req.rotation, &req.pageRect, Target_View, &req.abortCookie);
+        double renderMs = t.Stop();
+        if (bmp) {
+            span.SetSize((int64)bmp->Size().dx * bmp->Size().dy);
+            ScopedCritSec scope(&cache->cacheAccess);
+            cache->statLastRenderMs = renderMs;
+            cache->statTotalRenderMs += cache->statLastRenderMs;
+            cache->statTilesRendered++;
+        }
+        // previews and fast scroll renderings aren't representative
+        if (bmp && !req.abort && !req.preview && req.quality != Quality_FastScroll)
+            cache->RecordRenderCost(req.dm, req.pageNo, bmp->Size(), renderMs);
         if (req.abort) {
             delete bmp;
             if (req.renderCb)
@@ -603,10 +1606,14 @@ DWORD WINAPI RenderCache::RenderCacheThread(LPVOID data)
         }
         else {
             // don't replace colors for individual images
-            if (bmp && !req.dm->GetEngine()->IsImageCollection())
+            if (bmp && !engine->IsImageCollection())
                 UpdateBitmapColors(bmp->GetBitmap(), cache->textColor, cache->backgroundColor);
-            cache->Add(req, bmp);
-            req.dm->RepaintDisplay();
+            // only the pixels are cached (cf. TileBitmap)
+            TileBitmap *tileBmp = bmp ? TileBitmap::Create(bmp) : nullptr;
+            delete bmp;
+            cache->Add(req, tileBmp);
+            if (!cache->DeferSpreadRepaint(worker))
+                req.dm->RepaintDisplay();
         }
     }
 }
@@ -618,7 +1625,12 @@ UINT RenderCache::PaintTile(HDC hdc, RectI bounds, DisplayModel *dm, int pageNo,
                             bool *renderOutOfDateCue, bool *renderedReplacement)
 {
     BitmapCacheEntry *entry = Find(dm, pageNo, dm->GetRotation(), dm->GetZoomReal(), &tile);
+    bool isReplacement = !entry;
     UINT renderDelay = 0;
+    if (entry)
+        statHits++;
+    else
+        statMisses++;
 
     if (!entry) {
         if (!isRemoteSession) {
@@ -630,11 +1642,10 @@ UINT RenderCache::PaintTile(HDC hdc, RectI bounds, DisplayModel *dm, int pageNo,
         if (renderMissing && RENDER_DELAY_UNDEFINED == renderDelay && !IsRenderQueueFull())
             RequestRendering(dm, pageNo, tile);
     }
-    RenderedBitmap *renderedBmp = entry ? entry->bitmap : nullptr;
-    HBITMAP hbmp = renderedBmp ? renderedBmp->GetBitmap() : nullptr;
+    TileBitmap *tileBmp = entry ? entry->bitmap : nullptr;
 
-    if (!hbmp) {
-        if (entry && !(renderedBmp && ReduceTileSize()))
+    if (!tileBmp || !tileBmp->HasPixels()) {
+        if (entry && !(tileBmp && ReduceTileSize()))
             renderDelay = RENDER_DELAY_FAILED;
         else if (0 == renderDelay)
             renderDelay = 1;
@@ -643,32 +1654,28 @@ UINT RenderCache::PaintTile(HDC hdc, RectI bounds, DisplayModel *dm, int pageNo,
         return renderDelay;
     }
 
-    HDC bmpDC = CreateCompatibleDC(hdc);
-    if (bmpDC) {
-        SizeI bmpSize = renderedBmp->Size();
-        int xSrc = -std::min(tileOnScreen.x, 0);
-        int ySrc = -std::min(tileOnScreen.y, 0);
-        float factor = std::min(1.0f * bmpSize.dx / tileOnScreen.dx, 1.0f * bmpSize.dy / tileOnScreen.dy);
-
-        HGDIOBJ prevBmp = SelectObject(bmpDC, hbmp);
-        if (factor != 1.0f)
-            StretchBlt(hdc, bounds.x, bounds.y, bounds.dx, bounds.dy,
-                bmpDC, (int)(xSrc * factor), (int)(ySrc * factor),
-                (int)(bounds.dx * factor), (int)(bounds.dy * factor), SRCCOPY);
-        else
-            BitBlt(hdc, bounds.x, bounds.y, bounds.dx, bounds.dy,
-                bmpDC, xSrc, ySrc, SRCCOPY);
+    SizeI bmpSize = tileBmp->Size();
+    int xSrc = -std::min(tileOnScreen.x, 0);
+    int ySrc = -std::min(tileOnScreen.y, 0);
+    float factor = std::min(1.0f * bmpSize.dx / tileOnScreen.dx, 1.0f * bmpSize.dy / tileOnScreen.dy);
+    RectD srcRect(xSrc * factor, ySrc * factor, bounds.dx * factor, bounds.dy * factor);
 
-        SelectObject(bmpDC, prevBmp);
-        DeleteDC(bmpDC);
+    if (factor != 1.0f && PaintScaledTile(hdc, bounds, entry, srcRect)) {
+        // scaled with bilinear filtering by Direct2D
+    }
+    else if (factor != 1.0f) {
+        tileBmp->Paint(hdc, bounds, RectI((int)srcRect.x, (int)srcRect.y, (int)srcRect.dx, (int)srcRect.dy));
+    }
+    else {
+        tileBmp->Paint(hdc, bounds, RectI(xSrc, ySrc, bounds.dx, bounds.dy));
+    }
 
 #ifdef SHOW_TILE_LAYOUT
-        HPEN pen = CreatePen(PS_SOLID, 1, RGB(0xff, 0xff, 0x00));
-        HGDIOBJ oldPen = SelectObject(hdc, pen);
-        PaintRect(hdc, bounds);
-        DeletePen(SelectObject(hdc, oldPen));
+    HPEN pen = CreatePen(PS_SOLID, 1, RGB(0xff, 0xff, 0x00));
+    HGDIOBJ oldPen = SelectObject(hdc, pen);
+    PaintRect(hdc, bounds);
+    DeletePen(SelectObject(hdc, oldPen));
 #endif
-    }
 
     if (entry->outOfDate) {
         if (renderOutOfDateCue)
@@ -676,10 +1683,194 @@ UINT RenderCache::PaintTile(HDC hdc, RectI bounds, DisplayModel *dm, int pageNo,
         CrashIf(renderedReplacement && !*renderedReplacement);
     }
 
+    if (entry->requestTime && !isReplacement) {
+        perfstats::Record(PerfStat_RenderLatency, dm->engineType, GetTickCount() - entry->requestTime);
+        entry->requestTime = 0;
+    }
+
+    if (entry->lowQuality && renderMissing) {
+        if (dm->GetScrollIdleDelay() > 0 || IsRenderQueueFull()) {
+            // try again once scrolling has stopped (cf. GetIdleRepaintDelay)
+            paintedLowQuality = true;
+        }
+        else {
+            // keep painting the tile until it's been replaced with one at
+            // the document's render quality (as if rendered at a different zoom level)
+            {
+                ScopedCritSec scope(&cacheAccess);
+                entry->zoom = INVALID_ZOOM;
+                entry->lowQuality = false;
+            }
+            RequestRendering(dm, pageNo, tile, false);
+        }
+    }
+
     DropCacheEntry(entry);
     return 0;
 }
 
+// tiles are scaled (while replacements at the current zoom level are being
+// rendered) by a Direct2D render target drawing into the canvas' DoubleBuffer,
+// so that everything else can still be painted with GDI; the tiles' pixels
+// are uploaded only once and are then scaled with bilinear filtering on the GPU
+bool RenderCache::InitD2DTarget()
+{
+    if (d2dTarget)
+        return true;
+    if (!gpuScaling || !d2d::IsAvailable())
+        return false;
+
+    HRESULT hr = S_OK;
+    if (!d2dFactory)
+        hr = d2d::CreateFactory(D2D1_FACTORY_TYPE_MULTI_THREADED, &d2dFactory);
+    if (SUCCEEDED(hr)) {
+        // use pixels instead of DIPs as units
+        D2D1_RENDER_TARGET_PROPERTIES props = D2D1::RenderTargetProperties(D2D1_RENDER_TARGET_TYPE_DEFAULT,
+            D2D1::PixelFormat(DXGI_FORMAT_B8G8R8A8_UNORM, D2D1_ALPHA_MODE_IGNORE), 96.0f, 96.0f);
+        hr = d2dFactory->CreateDCRenderTarget(&props, &d2dTarget);
+    }
+    if (FAILED(hr)) {
+        // don't retry for every tile
+        gpuScaling = false;
+        return false;
+    }
+    return true;
+}
+
+static ID2D1Bitmap *CreateD2DBitmap(ID2D1RenderTarget *target, TileBitmap *bmp)
+{
+    SizeI size = bmp->Size();
+    int stride, bpp;
+    const BYTE *pixels = bmp->GetPixels(&stride, &bpp);
+    if (!pixels || (bpp != 32 && bpp != 8))
+        return nullptr;
+    ScopedMem<BYTE> copy;
+    if (bpp != 32 || stride < 0) {
+        // Direct2D needs top-down 32-bit pixels
+        copy.Set(AllocArray<BYTE>((size_t)size.dx * size.dy * 4));
+        if (!copy)
+            return nullptr;
+        const RGBQUAD *palette = bmp->GetPalette();
+        for (int y = 0; y < size.dy; y++) {
+            const BYTE *src = pixels + y * stride;
+            BYTE *dst = copy + (size_t)y * size.dx * 4;
+            if (32 == bpp) {
+                memcpy(dst, src, size.dx * 4);
+                continue;
+            }
+            for (int x = 0; x < size.dx; x++) {
+                memcpy(dst + x * 4, &palette[src[x]], 4);
+            }
+        }
+        pixels = copy;
+        stride = size.dx * 4;
+    }
+
+    D2D1_BITMAP_PROPERTIES props = D2D1::BitmapProperties(
+        D2D1::PixelFormat(DXGI_FORMAT_B8G8R8A8_UNORM, D2D1_ALPHA_MODE_IGNORE));
+    ID2D1Bitmap *d2dBmp = nullptr;
+    HRESULT hr = target->CreateBitmap(D2D1::SizeU(size.dx, size.dy), pixels, stride, props, &d2dBmp);
+    return SUCCEEDED(hr) ? d2dBmp : nullptr;
+}
+
+// paints the part srcRect of entry's bitmap scaled into bounds; returns false
+// if the tile couldn't be painted with Direct2D (so that GDI is used instead)
+bool RenderCache::PaintScaledTile(HDC hdc, RectI bounds, BitmapCacheEntry *entry, RectD srcRect)
+{
+    if (!InitD2DTarget())
+        return false;
+
+    // entry->gpuBitmap is only accessed on the UI thread while holding a reference
+    if (entry->gpuBitmap && entry->gpuBitmapTarget != d2dTargetId) {
+        entry->gpuBitmap->Release();
+        entry->gpuBitmap = nullptr;
+    }
+    if (!entry->gpuBitmap) {
+        entry->gpuBitmap = CreateD2DBitmap(d2dTarget, entry->bitmap);
+        entry->gpuBitmapTarget = d2dTargetId;
+        if (!entry->gpuBitmap)
+            return false;
+    }
+
+    RECT rc = bounds.ToRECT();
+    if (FAILED(d2dTarget->BindDC(hdc, &rc)))
+        return false;
+    d2dTarget->BeginDraw();
+    D2D1_RECT_F dst = D2D1::RectF(0, 0, (FLOAT)bounds.dx, (FLOAT)bounds.dy);
+    D2D1_RECT_F src = D2D1::RectF((FLOAT)srcRect.x, (FLOAT)srcRect.y,
+                                  (FLOAT)(srcRect.x + srcRect.dx), (FLOAT)(srcRect.y + srcRect.dy));
+    d2dTarget->DrawBitmap(entry->gpuBitmap, dst, 1.0f, D2D1_BITMAP_INTERPOLATION_MODE_LINEAR, src);
+    HRESULT hr = d2dTarget->EndDraw();
+    if (D2DERR_RECREATE_TARGET == hr) {
+        // e.g. after the display driver has been updated
+        d2dTarget->Release();
+        d2dTarget = nullptr;
+        d2dTargetId++;
+    }
+    return SUCCEEDED(hr);
+}
+
+bool RenderCache::PaintPreview(HDC hdc, RectI bounds, DisplayModel *dm, int pageNo)
+{
+    BitmapCacheEntry *entry = nullptr;
+    int rotation = NormalizeRotation(dm->GetRotation());
+    {
+        ScopedCritSec scope(&cacheAccess);
+        for (int i = 0; i < cacheCount; i++) {
+            BitmapCacheEntry *e = cache[i];
+            if (dm == e->dm && pageNo == e->pageNo && rotation == e->rotation &&
+                0 == e->tile.res && e->bitmap && e->bitmap->HasPixels() &&
+                (!entry || e->zoom > entry->zoom)) {
+                entry = e;
+            }
+        }
+        if (!entry)
+            return false;
+        entry->refs++;
+        entry->lastUsed = GetTickCount();
+    }
+
+    bool ok = false;
+    SizeI bmpSize = entry->bitmap->Size();
+    if (!bmpSize.IsEmpty()) {
+        // keep the page's aspect ratio and center it in bounds
+        float scale = std::min(1.0f * bounds.dx / bmpSize.dx, 1.0f * bounds.dy / bmpSize.dy);
+        RectI dst(bounds.x, bounds.y, (int)(bmpSize.dx * scale), (int)(bmpSize.dy * scale));
+        dst.Offset((bounds.dx - dst.dx) / 2, (bounds.dy - dst.dy) / 2);
+
+        int prevMode = SetStretchBltMode(hdc, HALFTONE);
+        ok = entry->bitmap->Paint(hdc, dst, RectI(PointI(), bmpSize));
+        SetStretchBltMode(hdc, prevMode);
+    }
+
+    DropCacheEntry(entry);
+    return ok;
+}
+
+void RenderCache::GetStats(RenderCacheStats *stats)
+{
+    {
+        ScopedCritSec scope(&cacheAccess);
+        stats->bitmapCount = cacheCount;
+        stats->bitmapBytes = cacheSize;
+        stats->tilesRendered = statTilesRendered;
+        stats->lastRenderMs = statLastRenderMs;
+        stats->avgRenderMs = statTilesRendered > 0 ? statTotalRenderMs / statTilesRendered : 0;
+    }
+    ScopedCritSec scope(&requestAccess);
+    stats->queueDepth = requestCount;
+    stats->hits = statHits;
+    stats->misses = statMisses;
+}
+
+UINT RenderCache::GetIdleRepaintDelay(DisplayModel *dm)
+{
+    if (!paintedLowQuality)
+        return 0;
+    paintedLowQuality = false;
+    return std::max(dm->GetScrollIdleDelay(), 1U);
+}
+
 static int cmpTilePosition(const void *a, const void *b)
 {
     const TilePosition *ta = (const TilePosition *)a, *tb = (const TilePosition *)b;
@@ -6,9 +6,18 @@
 #define INVALID_TILE_RES       ((USHORT)-1)
 
 #define MAX_PAGE_REQUESTS 8
-// keep this value reasonably low, else we'll run out of
-// GDI resources/memory when caching many larger bitmaps
-#define MAX_BITMAPS_CACHED 64
+// the cache is limited by the memory used by its bitmaps (cf. SetMaxCacheSize);
+// cached tiles don't use any GDI resources (cf. TileBitmap), so this only
+// bounds the cost of the linear searches through the cache
+#define MAX_BITMAPS_CACHED 1024
+// upper limit for Performance.RenderThreads
+#define MAX_RENDER_THREADS 8
+// number of pages for which the rendering cost is remembered
+#define MAX_PAGE_RENDER_COSTS 64
+
+struct ID2D1Bitmap;
+struct ID2D1Factory;
+struct ID2D1DCRenderTarget;
 
 class RenderingCallback {
 public:
@@ -28,6 +37,41 @@ struct TilePosition {
     }
 };
 
+/* Cached tiles only keep the pixels of a RenderedBitmap and not its HBITMAP,
+   so that the number of cached tiles isn't limited by the process' GDI object
+   quota. The pixels remain in the (page file backed) section the engine has
+   rendered into, if there is one, else they're copied into process memory. */
+class TileBitmap {
+    SizeI           size;
+    // header and palette of the pixels (top-down or bottom-up as rendered)
+    BITMAPINFO *    bmi;
+    BYTE *          pixels;
+    // either nullptr or the view pixels point into
+    void *          view;
+
+    explicit TileBitmap(SizeI size) : size(size), bmi(nullptr), pixels(nullptr), view(nullptr) { }
+
+public:
+    ~TileBitmap();
+
+    // the result has no pixels if bmp didn't have any either (e.g. due to GDI
+    // resource exhaustion) or if they couldn't be copied (bmp can be deleted afterwards)
+    static TileBitmap *Create(RenderedBitmap *bmp);
+    // creates a top-down 32-bit bitmap whose pixels the caller fills in
+    // (returns nullptr if they couldn't be allocated)
+    static TileBitmap *Create(SizeI size, BYTE **pixelsOut);
+
+    SizeI Size() const { return size; }
+    bool HasPixels() const { return pixels != nullptr; }
+    // cf. GetDIBSectionPixels
+    const BYTE *GetPixels(int *stride, int *bitsPerPixel) const;
+    // the color table for bitmaps with 8 or less bits per pixel
+    const RGBQUAD *GetPalette() const { return bmi ? bmi->bmiColors : nullptr; }
+    // paints the part src of the bitmap into dst (stretching
+    // according to the DC's stretch mode, if needed)
+    bool Paint(HDC hdc, RectI dst, RectI src) const;
+};
+
 /* We keep a cache of rendered bitmaps. BitmapCacheEntry keeps data
    that uniquely identifies rendered page (dm, pageNo, rotation, zoom)
    and the corresponding rendered bitmap. */
@@ -39,13 +83,29 @@ struct BitmapCacheEntry {
     TilePosition     tile;
 
     // owned by the BitmapCacheEntry
-    RenderedBitmap * bitmap;
+    TileBitmap *     bitmap;
+    // approximate amount of memory used by bitmap
+    size_t           bytes;
+    // time of the most recent Find (for LRU eviction)
+    DWORD            lastUsed;
     bool             outOfDate;
+    // rendered with Quality_FastScroll and to be replaced once scrolling stops
+    bool             lowQuality;
+    // time of the rendering request until the bitmap is first painted
+    // (for the render latency statistics, cf. PerfStats.h)
+    DWORD            requestTime;
+    // bitmap uploaded for scaling with Direct2D (cf. RenderCache::PaintScaledTile)
+    // and the RenderCache::d2dTargetId it's been created for
+    ID2D1Bitmap *    gpuBitmap;
+    int              gpuBitmapTarget;
     int              refs;
 
-    BitmapCacheEntry(DisplayModel *dm, int pageNo, int rotation, float zoom, TilePosition tile, RenderedBitmap *bitmap) :
-        dm(dm), pageNo(pageNo), rotation(rotation), zoom(zoom), tile(tile), bitmap(bitmap), outOfDate(false), refs(1) { }
-    ~BitmapCacheEntry() { delete bitmap; }
+    BitmapCacheEntry(DisplayModel *dm, int pageNo, int rotation, float zoom, TilePosition tile, TileBitmap *bitmap) :
+        dm(dm), pageNo(pageNo), rotation(rotation), zoom(zoom), tile(tile), bitmap(bitmap),
+        bytes(bitmap ? (size_t)bitmap->Size().dx * bitmap->Size().dy * 4 : 0),
+        lastUsed(GetTickCount()), outOfDate(false), lowQuality(false), requestTime(0),
+        gpuBitmap(nullptr), gpuBitmapTarget(0), refs(1) { }
+    ~BitmapCacheEntry();
 };
 
 /* Even though this looks a lot like a BitmapCacheEntry, we keep it
@@ -59,32 +119,119 @@ struct PageRenderRequest {
     TilePosition        tile;
 
     RectD               pageRect; // calculated from TilePosition
+    // a quick low resolution render to show until the tile has been rendered
+    bool                preview;
+    RenderQuality       quality;
     bool                abort;
     AbortCookie *       abortCookie;
     DWORD               timestamp;
+    // set when the other page of the same spread has finished first and
+    // left repainting to this request (cf. RenderCache::DeferSpreadRepaint)
+    bool                repaintSpread;
     // owned by the PageRenderRequest (use it before reusing the request)
     // on rendering success, the callback gets handed the RenderedBitmap
     RenderingCallback * renderCb;
 };
 
+/* Measured rendering cost of a page, used for adapting the tile size
+   to how complex a page is to render (cf. RenderCache::GetTileRes) */
+struct PageRenderCost {
+    DisplayModel *      dm;
+    int                 pageNo;
+    // moving average of the rendering time per megapixel, which
+    // doesn't depend on the zoom level as much as the total time
+    float               msPerMPixel;
+    DWORD               lastUpdated;
+};
+
+class RenderCache;
+
+/* Engines are thread-safe but only render a single page at a time, so
+   in order to render several tiles of the same document in parallel,
+   additional render threads use private clones of a DisplayModel's engine */
+struct EngineClone {
+    DisplayModel *      dm;
+    // nullptr if the engine couldn't be cloned
+    BaseEngine *        engine;
+    // set when the DisplayModel's engine has been modified (e.g. annotations)
+    bool                outOfDate;
+};
+
+struct RenderWorker {
+    RenderCache *       cache;
+    HANDLE              thread;
+    PageRenderRequest   req;
+    // either nullptr or &req while a request is being rendered
+    PageRenderRequest * curReq;
+    // whether curReq is being rendered with a clone of curReq->dm's engine
+    bool                usesClone;
+    // only accessed in requestAccess protected critical sections
+    // (or from the worker's thread while it's got a curReq)
+    Vec<EngineClone>    clones;
+};
+
+// counters shown by the performance overlay (cf. RenderCache::GetStats)
+struct RenderCacheStats {
+    int     bitmapCount;
+    size_t  bitmapBytes;
+    int     queueDepth;
+    // tiles painted from a bitmap at the current zoom level vs. ones
+    // which had to be scaled from a different zoom level or were missing
+    int     hits, misses;
+    int     tilesRendered;
+    // render time of the most recently rendered tile and average over all tiles
+    double  lastRenderMs, avgRenderMs;
+};
+
 class RenderCache
 {
 private:
     BitmapCacheEntry *  cache[MAX_BITMAPS_CACHED];
     int                 cacheCount;
+    // sum of the bytes of all cached bitmaps
+    size_t              cacheSize;
+    size_t              maxCacheSize;
+    // signaled by the system when physical memory runs low
+    HANDLE              lowMemory;
     // make sure to never ask for requestAccess in a cacheAccess
     // protected critical section in order to avoid deadlocks
     CRITICAL_SECTION    cacheAccess;
 
     PageRenderRequest   requests[MAX_PAGE_REQUESTS];
     int                 requestCount;
-    PageRenderRequest * curReq;
     CRITICAL_SECTION    requestAccess;
-    HANDLE              renderThread;
+    RenderWorker        workers[MAX_RENDER_THREADS];
+    int                 workerCount;
 
     SizeI               maxTileSize;
     bool                isRemoteSession;
 
+    // only accessed in cacheAccess protected critical sections
+    PageRenderCost      renderCosts[MAX_PAGE_RENDER_COSTS];
+    int                 renderCostCount;
+
+    // only updated from PaintTile (i.e. on the UI thread)
+    int                 statHits, statMisses;
+    bool                paintedLowQuality;
+    // for scaling tiles with Direct2D (only used on the UI thread)
+    bool                gpuScaling;
+    ID2D1Factory *      d2dFactory;
+    ID2D1DCRenderTarget *d2dTarget;
+    // changes whenever d2dTarget has to be recreated (which invalidates all
+    // bitmaps created for the previous one)
+    int                 d2dTargetId;
+    // the document and page whose neighbors are kept cached during a
+    // presentation (only accessed in cacheAccess protected critical sections)
+    DisplayModel *      presentationDm;
+    int                 presentationPageNo;
+    // the document and page whose rendering has been requested ahead of
+    // time because a link to it is hovered (cf. PrefetchPage)
+    DisplayModel *      prefetchDm;
+    int                 prefetchPageNo;
+    // only accessed in cacheAccess protected critical sections
+    int                 statTilesRendered;
+    double              statLastRenderMs, statTotalRenderMs;
+
 public:
     COLORREF            textColor;
     COLORREF            backgroundColor;
@@ -92,53 +239,100 @@ public:
     RenderCache();
     ~RenderCache();
 
+    // starts additional rendering threads (up to MAX_RENDER_THREADS)
+    // a count <= 0 uses one thread per processor core
+    void    StartRenderThreads(int count);
+    // limits the memory used by cached bitmaps (in bytes)
+    void    SetMaxCacheSize(size_t maxBytes);
+    // scale tiles with Direct2D instead of GDI while replacements are rendered
+    // (falls back to GDI if Direct2D isn't available)
+    void    EnableGpuScaling(bool enable) { gpuScaling = enable; }
     void    RequestRendering(DisplayModel *dm, int pageNo);
+    // renders the pages before and after pageNo ahead of time and keeps them
+    // cached along with pageNo for as long as pageNo is shown in presentation mode
+    void    KeepPresentationPages(DisplayModel *dm, int pageNo);
+    // renders the destination page of a hovered link ahead of time (with the
+    // lowest priority) so that following the link doesn't show a blank page
+    // (along with the other page of its spread in facing and book view modes)
+    void    PrefetchPage(DisplayModel *dm, int pageNo);
+    // drops the prefetch requests for dm's page (or for any document)
+    void    CancelPrefetch(DisplayModel *dm=nullptr);
     void    Render(DisplayModel *dm, int pageNo, int rotation, float zoom,
                    RectD pageRect, RenderingCallback& callback);
     void    CancelRendering(DisplayModel *dm);
     bool    Exists(DisplayModel *dm, int pageNo, int rotation,
                    float zoom=INVALID_ZOOM, TilePosition *tile=nullptr);
     void    FreeForDisplayModel(DisplayModel *dm) { FreePage(dm); }
-    void    KeepForDisplayModel(DisplayModel *oldDm, DisplayModel *newDm);
+    // frees all bitmaps of a document in a background tab except for
+    // the low resolution ones of its visible pages
+    void    FreeForBackground(DisplayModel *dm);
+    void    KeepForDisplayModel(DisplayModel *oldDm, DisplayModel *newDm, const int *prevPageNos=nullptr);
     void    Invalidate(DisplayModel *dm, int pageNo, RectD rect);
     // returns how much time in ms has past since the most recent rendering
     // request for the visible part of the page if nothing at all could be
     // painted, 0 if something has been painted and RENDER_DELAY_FAILED on failure
     UINT    Paint(HDC hdc, RectI bounds, DisplayModel *dm, int pageNo,
                   PageInfo *pageInfo, bool *renderOutOfDateCue);
+    // scales the largest cached bitmap of an entire page into <bounds>
+    // (e.g. for print previews) without requesting any rendering
+    bool    PaintPreview(HDC hdc, RectI bounds, DisplayModel *dm, int pageNo);
+    // returns after how many ms the document should be repainted so that
+    // tiles rendered while scrolling fast are replaced (0 if there were none)
+    UINT    GetIdleRepaintDelay(DisplayModel *dm);
+    void    GetStats(RenderCacheStats *stats);
 
 protected:
     /* Interface for page rendering thread */
     HANDLE  startRendering;
 
-    bool    ClearCurrentRequest();
-    bool    GetNextRequest(PageRenderRequest *req);
-    void    Add(PageRenderRequest &req, RenderedBitmap *bitmap);
+    void    ClearCurrentRequest(RenderWorker *worker);
+    bool    GetNextRequest(RenderWorker *worker);
+    void    Add(PageRenderRequest &req, TileBitmap *bitmap);
+    BaseEngine *GetEngineClone(RenderWorker *worker, DisplayModel *dm);
 
 private:
     USHORT  GetTileRes(DisplayModel *dm, int pageNo);
     USHORT  GetMaxTileRes(DisplayModel *dm, int pageNo, int rotation);
     bool    ReduceTileSize();
 
+    void    RecordRenderCost(DisplayModel *dm, int pageNo, SizeI size, double renderMs);
+    float   GetRenderCost(DisplayModel *dm, int pageNo);
+    void    DropRenderCosts(DisplayModel *dm);
+
     bool    IsRenderQueueFull() const { return requestCount == MAX_PAGE_REQUESTS; }
     UINT    GetRenderDelay(DisplayModel *dm, int pageNo, TilePosition tile);
     void    RequestRendering(DisplayModel *dm, int pageNo, TilePosition tile, bool clearQueueForPage=true);
+    void    RequestAllTiles(DisplayModel *dm, int pageNo);
     bool    Render(DisplayModel *dm, int pageNo, int rotation, float zoom,
                    TilePosition *tile=nullptr, RectD *pageRect=nullptr,
                    RenderingCallback *callback=nullptr);
+    void    RequestPreview(DisplayModel *dm, int pageNo, int rotation, float zoom, TilePosition tile);
     void    ClearQueueForDisplayModel(DisplayModel *dm, int pageNo=INVALID_PAGE_NO,
                                       TilePosition *tile=nullptr);
-    void    AbortCurrentRequest();
+    void    AbortCurrentRequests(DisplayModel *dm=nullptr, int pageNo=INVALID_PAGE_NO);
+    void    AbortObsoleteRequests(DisplayModel *dm);
+    PageRenderRequest *GetCurrentRequest(DisplayModel *dm, int pageNo, TilePosition tile);
+    bool    IsEngineBusy(DisplayModel *dm);
+    void    DeleteEngineClones(DisplayModel *dm);
+    bool    IsPrefetchPage(DisplayModel *dm, int pageNo);
+    bool    DeferSpreadRepaint(RenderWorker *worker);
+    TileBitmap *DownsampleTile(PageRenderRequest& req);
 
     static DWORD WINAPI RenderCacheThread(LPVOID data);
 
     BitmapCacheEntry *  Find(DisplayModel *dm, int pageNo, int rotation,
                              float zoom=INVALID_ZOOM, TilePosition *tile=nullptr);
     void    DropCacheEntry(BitmapCacheEntry *entry);
+    void    RemoveAt(int idx);
+    int     GetVisibilityWeight(BitmapCacheEntry *entry);
+    bool    EvictOne(bool evictVisible);
+    size_t  GetMaxCacheSize();
     void    FreePage(DisplayModel *dm=nullptr, int pageNo=-1, TilePosition *tile=nullptr);
     void    FreeNotVisible() { FreePage(); }
 
     UINT    PaintTile(HDC hdc, RectI bounds, DisplayModel *dm, int pageNo,
                       TilePosition tile, RectI tileOnScreen, bool renderMissing,
                       bool *renderOutOfDateCue, bool *renderedReplacement);
+    bool    InitD2DTarget();
+    bool    PaintScaledTile(HDC hdc, RectI bounds, BitmapCacheEntry *entry, RectD srcRect);
 };
@@ -8,7 +8,9 @@
 
 // utils
 #include "BaseUtil.h"
+#include "Dpi.h"
 #include "FileUtil.h"
+#include "ThreadUtil.h"
 #include "UITask.h"
 #include "WinUtil.h"
 // rendering engines
@@ -19,6 +21,8 @@
 #include "Controller.h"
 #include "ChmModel.h"
 #include "DisplayModel.h"
+#include "FileHistory.h"
+#include "FileThumbnails.h"
 #include "GlobalPrefs.h"
 #include "PdfSync.h"
 #include "TextSelection.h"
@@ -282,9 +286,8 @@ static void FindEndTask(WindowInfo *win, FindThreadData *ftd, TextSel *textSel,
     delete ftd;
 }
 
-static DWORD WINAPI FindThread(LPVOID data)
+static void FindThread(FindThreadData *ftd)
 {
-    FindThreadData *ftd = (FindThreadData *)data;
     AssertCrash(ftd && ftd->win && ftd->win->ctrl && ftd->win->ctrl->AsFixed());
     WindowInfo *win = ftd->win;
     DisplayModel *dm = win->AsFixed();
@@ -323,8 +326,6 @@ static DWORD WINAPI FindThread(LPVOID data)
             FindEndTask(win, ftd, nullptr, win->findCanceled, false);
         });
     }
-
-    return 0;
 }
 
 void AbortFinding(WindowInfo *win, bool hideMessage)
@@ -353,10 +354,428 @@ void FindTextOnThread(WindowInfo* win, TextSearchDirection direction, bool showP
 
     ftd->ShowUI(showProgress);
     win->findThread = nullptr;
-    win->findThread = CreateThread(nullptr, 0, FindThread, ftd, 0, 0);
+    win->findThread = RunAsyncWaitable([=] { FindThread(ftd); }, TaskPriority::Interactive);
     ftd->thread = win->findThread; // safe because only accesssed on ui thread
 }
 
+/* Searching all documents open in tabs (and optionally the ones in the file history) */
+
+#define MAX_DOC_SEARCH_THREADS  4
+// number of characters shown before and after a match
+#define DOC_SEARCH_CONTEXT_LEN  40
+
+struct DocSearchJob {
+    ScopedMem<WCHAR> filePath;
+    // set if the document is loaded in a tab (else the worker loads
+    // the document itself, without a DisplayModel)
+    DisplayModel *dm;
+    // a text index saved for the document (used if the worker loads the document)
+    ScopedMem<WCHAR> indexPath;
+    bool canceled;
+    bool running;
+
+    DocSearchJob(const WCHAR *filePath, DisplayModel *dm) :
+        filePath(str::Dup(filePath)), dm(dm), canceled(false), running(false) {
+        if (!dm && HasPermission(Perm_SavePreferences | Perm_DiskAccess) && gGlobalPrefs->rememberOpenedFiles)
+            indexPath.Set(GetTextIndexPath(filePath));
+    }
+};
+
+struct DocSearchHit {
+    ScopedMem<WCHAR> filePath;
+    int pageNo;
+    ScopedMem<WCHAR> pageLabel;
+    ScopedMem<WCHAR> context;
+};
+
+/* There's at most a single DocSearch at a time, owned by its results window.
+   Workers claim jobs in order and stream their hits to the UI thread. */
+class DocSearch {
+public:
+    // identifies the search in tasks posted by the workers
+    int id;
+    WindowInfo *win;
+    ScopedMem<WCHAR> text;
+    bool matchCase;
+    HWND hwnd, hwndList;
+    // only accessed in access protected critical sections
+    Vec<DocSearchJob *> jobs;
+    size_t nextJob;
+    int jobsDone;
+    CRITICAL_SECTION access;
+    HANDLE threads[MAX_DOC_SEARCH_THREADS];
+    int threadCount;
+    CancelToken *cancel;
+    // only accessed on the UI thread
+    Vec<DocSearchHit *> hits;
+
+    DocSearch(int id, WindowInfo *win, const WCHAR *text, bool matchCase) :
+        id(id), win(win), text(str::Dup(text)), matchCase(matchCase), hwnd(nullptr),
+        hwndList(nullptr), nextJob(0), jobsDone(0), threadCount(0), cancel(new CancelToken()) {
+        InitializeCriticalSection(&access);
+    }
+    ~DocSearch() {
+        cancel->Cancel();
+        WaitForMultipleObjects(threadCount, threads, TRUE, INFINITE);
+        for (int i = 0; i < threadCount; i++) {
+            CloseHandle(threads[i]);
+        }
+        cancel->Release();
+        DeleteVecMembers(jobs);
+        DeleteVecMembers(hits);
+        DeleteCriticalSection(&access);
+    }
+
+    void AddJob(const WCHAR *filePath, DisplayModel *dm) {
+        for (DocSearchJob *job : jobs) {
+            if (path::IsSame(job->filePath, filePath))
+                return;
+        }
+        jobs.Append(new DocSearchJob(filePath, dm));
+    }
+
+    DocSearchJob *ClaimJob() {
+        ScopedCritSec scope(&access);
+        while (!cancel->IsCanceled() && nextJob < jobs.Count()) {
+            DocSearchJob *job = jobs.At(nextJob++);
+            if (!job->canceled) {
+                job->running = true;
+                return job;
+            }
+            jobsDone++;
+        }
+        return nullptr;
+    }
+
+    void FinishJob(DocSearchJob *job) {
+        ScopedCritSec scope(&access);
+        job->running = false;
+        jobsDone++;
+    }
+
+    // cancels all jobs using dm and waits for the ones currently running
+    void CancelJobs(DisplayModel *dm) {
+        for (;;) {
+            bool isRunning = false;
+            EnterCriticalSection(&access);
+            for (DocSearchJob *job : jobs) {
+                if (job->dm == dm) {
+                    job->canceled = true;
+                    isRunning = isRunning || job->running;
+                }
+            }
+            LeaveCriticalSection(&access);
+            if (!isRunning)
+                break;
+            Sleep(1);
+        }
+    }
+};
+
+static DocSearch *gDocSearch = nullptr;
+static int gDocSearchId = 0;
+
+static void InsertDocSearchHit(DocSearch *ds, int idx)
+{
+    DocSearchHit *hit = ds->hits.At(idx);
+    LVITEM item = { 0 };
+    item.mask = LVIF_TEXT | LVIF_PARAM;
+    item.iItem = idx;
+    item.pszText = (WCHAR *)path::GetBaseName(hit->filePath);
+    item.lParam = idx;
+    ListView_InsertItem(ds->hwndList, &item);
+    ListView_SetItemText(ds->hwndList, idx, 1, hit->pageLabel);
+    ListView_SetItemText(ds->hwndList, idx, 2, hit->context);
+}
+
+static void UpdateDocSearchTitle(DocSearch *ds)
+{
+    EnterCriticalSection(&ds->access);
+    int done = ds->jobsDone, total = (int)ds->jobs.Count();
+    LeaveCriticalSection(&ds->access);
+
+    ScopedMem<WCHAR> title;
+    if (done < total)
+        title.Set(str::Format(_TR("Searching %d of %d documents..."), done + 1, total));
+    else
+        title.Set(str::Format(_TR("Found %d matches"), (int)ds->hits.Count()));
+    win::SetText(ds->hwnd, title);
+}
+
+static void AddDocSearchHitsTask(int id, Vec<DocSearchHit *> *newHits)
+{
+    if (!gDocSearch || gDocSearch->id != id) {
+        DeleteVecMembers(*newHits);
+        delete newHits;
+        return;
+    }
+    for (DocSearchHit *hit : *newHits) {
+        gDocSearch->hits.Append(hit);
+        InsertDocSearchHit(gDocSearch, (int)gDocSearch->hits.Count() - 1);
+    }
+    delete newHits;
+    UpdateDocSearchTitle(gDocSearch);
+}
+
+static void DocSearchJobDoneTask(int id)
+{
+    if (gDocSearch && gDocSearch->id == id)
+        UpdateDocSearchTitle(gDocSearch);
+}
+
+// passes the hits on to the UI thread after every searched page
+class DocSearchTracker : public ProgressUpdateUI {
+    DocSearch *ds;
+    DocSearchJob *job;
+    BaseEngine *engine;
+    PageTextCache *textCache;
+    size_t reported;
+
+public:
+    TextSearchResults results;
+
+    DocSearchTracker(DocSearch *ds, DocSearchJob *job, BaseEngine *engine, PageTextCache *textCache) :
+        ds(ds), job(job), engine(engine), textCache(textCache), reported(0) { }
+
+    // reports all hits on the pages before pageNo
+    void ReportHits(int pageNo) {
+        Vec<DocSearchHit *> *newHits = new Vec<DocSearchHit *>();
+        TextSearchHit hit;
+        for (; results.GetHit(reported, &hit) && hit.pageNo < pageNo; reported++) {
+            int len;
+            const WCHAR *pageText = textCache->GetData(hit.pageNo, &len);
+            int start = std::max(hit.glyph - DOC_SEARCH_CONTEXT_LEN, 0);
+            int end = std::min(hit.glyph + hit.len + DOC_SEARCH_CONTEXT_LEN, len);
+            DocSearchHit *dsh = new DocSearchHit();
+            dsh->filePath.Set(str::Dup(job->filePath));
+            dsh->pageNo = hit.pageNo;
+            dsh->pageLabel.Set(engine->GetPageLabel(hit.pageNo));
+            dsh->context.Set(pageText ? str::DupN(pageText + start, end - start) : str::Dup(L""));
+            str::NormalizeWS(dsh->context);
+            newHits->Append(dsh);
+        }
+        if (0 == newHits->Count()) {
+            delete newHits;
+            return;
+        }
+        int id = ds->id;
+        uitask::Post([=] {
+            AddDocSearchHitsTask(id, newHits);
+        });
+    }
+
+    virtual void UpdateProgress(int current, int total) {
+        UNUSED(total);
+        ReportHits(current);
+    }
+
+    virtual bool WasCanceled() {
+        return ds->cancel->IsCanceled() || job->canceled;
+    }
+};
+
+static void SearchDocument(DocSearch *ds, DocSearchJob *job)
+{
+    // reuse the text cache of documents loaded in a tab
+    BaseEngine *engine = job->dm ? job->dm->GetEngine() : nullptr;
+    PageTextCache *textCache = job->dm ? job->dm->textCache : nullptr;
+    ScopedPtr<BaseEngine> ownEngine;
+    ScopedPtr<PageTextCache> ownTextCache;
+    if (!engine) {
+        // ebooks can't be loaded on a background thread and CHM documents are
+        // only searched through their topics' text (cf. ChmModel::CreateTextEngine)
+        if (ChmModel::IsSupportedFile(job->filePath))
+            ownEngine.Set(ChmModel::CreateTextEngine(job->filePath));
+        else
+            ownEngine.Set(EngineManager::CreateEngine(job->filePath, nullptr, nullptr, false, false));
+        if (!ownEngine || ownEngine->IsImageCollection())
+            return;
+        engine = ownEngine;
+        ownTextCache.Set(new PageTextCache(engine));
+        textCache = ownTextCache;
+        // text indices are saved for documents that have been open for a while
+        if (job->indexPath)
+            textCache->MapIndex(job->indexPath);
+    }
+
+    TextSearch search(engine, textCache);
+    search.SetSensitive(ds->matchCase);
+    DocSearchTracker tracker(ds, job, engine, textCache);
+    ScopedTextCachePin pin(textCache);
+    search.FindAll(ds->text, &tracker.results, &tracker);
+    if (!tracker.WasCanceled())
+        tracker.ReportHits(INT_MAX);
+}
+
+static void DocSearchThread(DocSearch *ds)
+{
+    while (DocSearchJob *job = ds->ClaimJob()) {
+        SearchDocument(ds, job);
+        ds->FinishJob(job);
+        int id = ds->id;
+        uitask::Post([=] {
+            DocSearchJobDoneTask(id);
+        });
+    }
+}
+
+static void OpenDocSearchHit(DocSearch *ds, DocSearchHit *hit)
+{
+    WindowInfo *win = FindWindowInfoByFile(hit->filePath, true);
+    if (!win) {
+        LoadArgs args(hit->filePath, WindowInfoStillValid(ds->win) ? ds->win : nullptr);
+        win = LoadDocument(args);
+    }
+    if (win && win->AsChm()) {
+        // the page labels of CHM documents are their topics' paths
+        win->AsChm()->GoToTopic(hit->pageLabel);
+        SetForegroundWindow(win->hwndFrame);
+        return;
+    }
+    if (!win || !win->AsFixed() || !win->ctrl->ValidPageNo(hit->pageNo))
+        return;
+
+    win->ctrl->GoToPage(hit->pageNo, true);
+    // highlight the match by continuing the search from the hit's page
+    win::SetText(win->hwndFindBox, ds->text);
+    Edit_SetModify(win->hwndFindBox, TRUE);
+    WORD state = (WORD)SendMessage(win->hwndToolbar, TB_GETSTATE, IDM_FIND_MATCH, 0);
+    if (ds->matchCase)
+        state |= TBSTATE_CHECKED;
+    else
+        state &= ~TBSTATE_CHECKED;
+    SendMessage(win->hwndToolbar, TB_SETSTATE, IDM_FIND_MATCH, state);
+    win->AsFixed()->textSearch->SetSensitive(ds->matchCase);
+    FindTextOnThread(win, FIND_FORWARD, true);
+    SetForegroundWindow(win->hwndFrame);
+}
+
+static bool CreateDocSearchWindow(DocSearch *ds)
+{
+    HWND hwnd = CreateWindow(
+           SEARCH_RESULTS_CLASS_NAME, _TR("Search Results"),
+           WS_OVERLAPPEDWINDOW,
+           CW_USEDEFAULT, CW_USEDEFAULT,
+           CW_USEDEFAULT, CW_USEDEFAULT,
+           nullptr, nullptr,
+           GetModuleHandle(nullptr), nullptr);
+    if (!hwnd)
+        return false;
+    ds->hwnd = hwnd;
+    ToggleWindowStyle(hwnd, WS_EX_LAYOUTRTL | WS_EX_NOINHERITLAYOUT, IsUIRightToLeft(), GWL_EXSTYLE);
+
+    ds->hwndList = CreateWindow(WC_LISTVIEW, nullptr,
+        WS_CHILD | WS_VISIBLE | LVS_REPORT | LVS_SINGLESEL | LVS_SHOWSELALWAYS,
+        0, 0, 0, 0, hwnd, nullptr, GetModuleHandle(nullptr), nullptr);
+    ListView_SetExtendedListViewStyle(ds->hwndList, LVS_EX_FULLROWSELECT);
+    SetWindowFont(ds->hwndList, GetDefaultGuiFont(), FALSE);
+
+    const WCHAR *titles[] = { _TR("Document"), _TR("Page"), _TR("Text") };
+    int widths[] = { 160, 50, 400 };
+    for (int i = 0; i < dimof(titles); i++) {
+        LVCOLUMN col = { 0 };
+        col.mask = LVCF_TEXT | LVCF_WIDTH;
+        col.pszText = (WCHAR *)titles[i];
+        col.cx = DpiScaleX(hwnd, widths[i]);
+        ListView_InsertColumn(ds->hwndList, i, &col);
+    }
+
+    HWND hwndParent = WindowInfoStillValid(ds->win) ? ds->win->hwndFrame : nullptr;
+    MoveWindow(hwnd, 0, 0, DpiScaleX(hwnd, 640), DpiScaleY(hwnd, 400), FALSE);
+    CenterDialog(hwnd, hwndParent);
+    UpdateDocSearchTitle(ds);
+    ShowWindow(hwnd, SW_SHOW);
+    return true;
+}
+
+LRESULT CALLBACK WndProcSearchResults(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
+{
+    DocSearch *ds = gDocSearch && gDocSearch->hwnd == hwnd ? gDocSearch : nullptr;
+
+    switch (msg)
+    {
+        case WM_SIZE:
+            if (ds && ds->hwndList)
+                MoveWindow(ds->hwndList, 0, 0, LOWORD(lParam), HIWORD(lParam), TRUE);
+            break;
+
+        case WM_NOTIFY:
+            if (ds && ((LPNMHDR)lParam)->hwndFrom == ds->hwndList && LVN_ITEMACTIVATE == ((LPNMHDR)lParam)->code) {
+                int idx = ((LPNMITEMACTIVATE)lParam)->iItem;
+                if (0 <= idx && idx < (int)ds->hits.Count())
+                    OpenDocSearchHit(ds, ds->hits.At(idx));
+            }
+            break;
+
+        case WM_DESTROY:
+            if (ds) {
+                gDocSearch = nullptr;
+                delete ds;
+            }
+            break;
+
+        default:
+            return DefWindowProc(hwnd, msg, wParam, lParam);
+    }
+    return 0;
+}
+
+void OnMenuFindInDocuments(WindowInfo *win, bool includeHistory)
+{
+    ScopedMem<WCHAR> previousFind(win::GetText(win->hwndFindBox));
+    WORD state = (WORD)SendMessage(win->hwndToolbar, TB_GETSTATE, IDM_FIND_MATCH, 0);
+    bool matchCase = (state & TBSTATE_CHECKED) != 0;
+
+    ScopedMem<WCHAR> findString(Dialog_Find(win->hwndFrame, previousFind, &matchCase));
+    if (str::IsEmpty(findString.Get()))
+        return;
+
+    if (gDocSearch)
+        DestroyWindow(gDocSearch->hwnd);
+    CrashIf(gDocSearch);
+
+    DocSearch *ds = new DocSearch(++gDocSearchId, win, findString, matchCase);
+    for (WindowInfo *w : gWindows) {
+        for (TabInfo *tab : w->tabs) {
+            if (tab->AsFixed() && !tab->AsFixed()->GetEngine()->IsImageCollection())
+                ds->AddJob(tab->filePath, tab->AsFixed());
+            else if (tab->AsChm() || !tab->ctrl && tab->filePath)
+                ds->AddJob(tab->filePath, nullptr);
+        }
+    }
+    // documents which aren't loaded can only be searched with disk access
+    if (!HasPermission(Perm_DiskAccess))
+        includeHistory = false;
+    for (size_t i = 0; includeHistory && gFileHistory.Get(i); i++) {
+        DisplayState *state = gFileHistory.Get(i);
+        if (!state->isMissing)
+            ds->AddJob(state->filePath, nullptr);
+    }
+
+    if (!CreateDocSearchWindow(ds)) {
+        delete ds;
+        return;
+    }
+    gDocSearch = ds;
+
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    int count = limitValue((int)si.dwNumberOfProcessors, 1, MAX_DOC_SEARCH_THREADS);
+    count = std::min(count, (int)ds->jobs.Count());
+    for (int i = 0; i < count; i++) {
+        ds->threads[ds->threadCount] = RunAsyncWaitable([=] { DocSearchThread(ds); }, TaskPriority::Background, ds->cancel);
+        if (ds->threads[ds->threadCount])
+            ds->threadCount++;
+    }
+}
+
+// called before a DisplayModel is destroyed (cf. ControllerCallbackHandler::CleanUp)
+void CancelDocumentSearch(DisplayModel *dm)
+{
+    if (gDocSearch)
+        gDocSearch->CancelJobs(dm);
+}
+
 void PaintForwardSearchMark(WindowInfo *win, HDC hdc)
 {
     CrashIf(!win->AsFixed());
@@ -4,6 +4,8 @@
 #define PDFSYNC_DDE_SERVICE   L"SUMATRA"
 #define PDFSYNC_DDE_TOPIC     L"control"
 
+#define SEARCH_RESULTS_CLASS_NAME   L"SUMATRA_PDF_SEARCH_RESULTS"
+
 // forward-search command
 //  format: [ForwardSearch(["<pdffilepath>",]"<sourcefilepath>",<line>,<column>[,<newwindow>, <setfocus>])]
 //    if pdffilepath is provided, the file will be opened if no open window can be found for it
@@ -57,3 +59,6 @@ void OnMenuFindMatchCase(WindowInfo *win);
 void OnMenuFindSel(WindowInfo *win, TextSearchDirection direction);
 void AbortFinding(WindowInfo *win, bool hideMessage);
 void FindTextOnThread(WindowInfo* win, TextSearchDirection direction, bool showProgress);
+void OnMenuFindInDocuments(WindowInfo *win, bool includeHistory);
+void CancelDocumentSearch(DisplayModel *dm);
+LRESULT CALLBACK WndProcSearchResults(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam);
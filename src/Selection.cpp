@@ -6,6 +6,8 @@
 #include <UIAutomationCore.h>
 #include <UIAutomationCoreApi.h>
 #include "Dpi.h"
+#include "ThreadUtil.h"
+#include "UITask.h"
 #include "WinUtil.h"
 // rendering engines
 #include "BaseEngine.h"
@@ -21,6 +23,7 @@
 #include "SumatraPDF.h"
 #include "WindowInfo.h"
 #include "TabInfo.h"
+#include "Notifications.h"
 #include "Selection.h"
 #include "Toolbar.h"
 #include "Translations.h"
@@ -63,15 +66,28 @@ Vec<SelectionOnPage> *SelectionOnPage::FromRectangle(DisplayModel *dm, RectI rec
     return sel;
 }
 
+// whether next continues the line of rect (i.e. touches it on the same line)
+static bool ContinuesLine(const RectI& rect, const RectI& next)
+{
+    return next.y == rect.y && next.dy == rect.dy &&
+           next.x >= rect.x && next.x <= rect.x + rect.dx + 1;
+}
+
 Vec<SelectionOnPage> *SelectionOnPage::FromTextSelect(TextSel *textSel)
 {
     Vec<SelectionOnPage> *sel = new Vec<SelectionOnPage>(textSel->len);
 
-    for (int i = textSel->len - 1; i >= 0; i--) {
-        RectD rect = textSel->rects[i].Convert<double>();
-        sel->Append(SelectionOnPage(textSel->pages[i], &rect));
+    // merge the rectangles of a line into a single span, so that
+    // each repaint has to convert and fill as few of them as possible
+    for (int i = 0; i < textSel->len; i++) {
+        RectI rect = textSel->rects[i];
+        for (; i + 1 < textSel->len && textSel->pages[i + 1] == textSel->pages[i] &&
+               ContinuesLine(rect, textSel->rects[i + 1]); i++) {
+            rect = rect.Union(textSel->rects[i + 1]);
+        }
+        RectD rectD = rect.Convert<double>();
+        sel->Append(SelectionOnPage(textSel->pages[i], &rectD));
     }
-    sel->Reverse();
 
     if (sel->Count() == 0) {
         delete sel;
@@ -154,8 +170,12 @@ void PaintSelection(WindowInfo *win, HDC hdc)
         if (!win->currentTab->selectionOnPage)
             return;
 
+        // only the spans on visible pages are painted (GetRect returns an
+        // empty rectangle otherwise) and clipped to the canvas
         for (SelectionOnPage& sel : *win->currentTab->selectionOnPage) {
-            rects.Append(sel.GetRect(win->AsFixed()));
+            RectI rect = sel.GetRect(win->AsFixed());
+            if (!rect.Intersect(win->canvasRc).IsEmpty())
+                rects.Append(rect);
         }
     }
 
@@ -229,6 +249,180 @@ void ZoomToSelection(WindowInfo *win, float factor, bool scrollToFit, bool relat
     UpdateToolbarState(win);
 }
 
+// text selections spanning more pages are extracted on a separate thread
+#define COPY_ON_THREAD_MIN_PAGES 20
+
+// accumulates text in movable global memory, so that
+// it can be handed to the clipboard without another copy
+class GlobalTextBuffer {
+    HGLOBAL handle;
+    // in WCHARs, excluding the terminating zero
+    size_t len, cap;
+
+public:
+    GlobalTextBuffer() : handle(nullptr), len(0), cap(0) { }
+    ~GlobalTextBuffer() { if (handle) GlobalFree(handle); }
+
+    bool Append(const WCHAR *s, size_t count) {
+        if (len + count + 1 > cap) {
+            size_t newCap = std::max(std::max(cap * 2, len + count + 1), (size_t)64 * 1024);
+            HGLOBAL newHandle = handle ? GlobalReAlloc(handle, newCap * sizeof(WCHAR), GMEM_MOVEABLE) :
+                                         GlobalAlloc(GMEM_MOVEABLE, newCap * sizeof(WCHAR));
+            if (!newHandle)
+                return false;
+            handle = newHandle;
+            cap = newCap;
+        }
+        WCHAR *data = (WCHAR *)GlobalLock(handle);
+        if (!data)
+            return false;
+        memcpy(data + len, s, count * sizeof(WCHAR));
+        len += count;
+        data[len] = '\0';
+        GlobalUnlock(handle);
+        return true;
+    }
+
+    size_t Len() const { return len; }
+    // the caller owns the returned zero-terminated text
+    HGLOBAL Detach() {
+        HGLOBAL result = handle;
+        handle = nullptr;
+        len = cap = 0;
+        return result;
+    }
+};
+
+struct CopyTextJob {
+    WindowInfo *win;
+    DisplayModel *dm;
+    // a copy of dm->textSelection (which the user might change in the meantime)
+    TextSelection *sel;
+    GlobalTextBuffer text;
+    // owned by win->notifications
+    NotificationWnd *wnd;
+    HANDLE thread;
+    bool canceled;
+
+    CopyTextJob(WindowInfo *win, DisplayModel *dm) : win(win), dm(dm),
+        sel(new TextSelection(dm->GetEngine(), dm->textCache)), wnd(nullptr), thread(nullptr), canceled(false) {
+        sel->CopySelection(dm->textSelection);
+    }
+    ~CopyTextJob() {
+        CloseHandle(thread);
+        delete sel;
+    }
+
+    void UpdateProgress(int current, int total);
+};
+
+// only a single large selection is copied at a time
+static CopyTextJob *gCopyTextJob = nullptr;
+
+static void UpdateCopyProgressTask(CopyTextJob *job, int current, int total)
+{
+    if (job->canceled || !WindowInfoStillValid(job->win))
+        return;
+    if (job->win->notifications->Contains(job->wnd))
+        job->wnd->UpdateProgress(current, total);
+    else // canceled by closing the notification
+        job->canceled = true;
+}
+
+void CopyTextJob::UpdateProgress(int current, int total)
+{
+    uitask::Post([=] {
+        UpdateCopyProgressTask(this, current, total);
+    });
+}
+
+static void CopyTextEndTask(CopyTextJob *job, HGLOBAL text)
+{
+    if (gCopyTextJob == job)
+        gCopyTextJob = nullptr;
+    bool copied = false;
+    if (text && !job->canceled && WindowInfoStillValid(job->win) && OpenClipboard(nullptr)) {
+        EmptyClipboard();
+        copied = SetClipboardData(CF_UNICODETEXT, text) != nullptr;
+        CloseClipboard();
+    }
+    if (text && !copied)
+        GlobalFree(text);
+    if (WindowInfoStillValid(job->win) && job->win->notifications->Contains(job->wnd))
+        job->win->notifications->RemoveNotification(job->wnd);
+    delete job;
+}
+
+static void CopyTextThread(CopyTextJob *job)
+{
+    int fromPage, fromGlyph, toPage, toGlyph;
+    job->sel->GetGlyphRange(&fromPage, &fromGlyph, &toPage, &toGlyph);
+
+    bool ok = true;
+    {
+        // extracting a page's lines needs all of its glyphs
+        ScopedTextCachePin pin(job->dm->textCache);
+        for (int page = fromPage; page <= toPage && ok && !job->canceled; page++) {
+            WStrVec lines;
+            job->sel->ExtractPageLines(page, &lines);
+            for (size_t i = 0; i < lines.Count() && ok; i++) {
+                if (job->text.Len() > 0)
+                    ok = job->text.Append(L"\r\n", 2);
+                ok = ok && job->text.Append(lines.At(i), str::Len(lines.At(i)));
+            }
+            job->UpdateProgress(page - fromPage + 1, toPage - fromPage + 1);
+        }
+        // the DisplayModel might be deleted as soon as this thread is done
+        delete job->sel;
+        job->sel = nullptr;
+    }
+
+    HGLOBAL text = ok && job->text.Len() > 0 ? job->text.Detach() : nullptr;
+    uitask::Post([=] {
+        CopyTextEndTask(job, text);
+    });
+}
+
+// called before a DisplayModel is destroyed (cf. ControllerCallbackHandler::CleanUp)
+void CancelCopyingText(DisplayModel *dm)
+{
+    if (!gCopyTextJob || (dm && gCopyTextJob->dm != dm))
+        return;
+    // CopyTextEndTask deletes the job
+    gCopyTextJob->canceled = true;
+    WaitForSingleObject(gCopyTextJob->thread, INFINITE);
+    gCopyTextJob = nullptr;
+}
+
+// streams large text selections into the clipboard without blocking the UI
+// (returns false if the selection is to be copied right away)
+static bool CopyTextSelectionOnThread(WindowInfo *win, DisplayModel *dm)
+{
+    int fromPage, fromGlyph, toPage, toGlyph;
+    dm->textSelection->GetGlyphRange(&fromPage, &fromGlyph, &toPage, &toGlyph);
+    if (toPage - fromPage + 1 < COPY_ON_THREAD_MIN_PAGES)
+        return false;
+#ifndef DISABLE_DOCUMENT_RESTRICTIONS
+    if (!dm->GetEngine()->AllowsCopyingText())
+        return false;
+#endif
+    if (dm->GetEngine()->IsImageCollection())
+        return false;
+
+    CancelCopyingText(nullptr);
+    CopyTextJob *job = new CopyTextJob(win, dm);
+    job->wnd = new NotificationWnd(win->hwndCanvas, L"", _TR("Copying page %d of %d..."), win->notifications);
+    win->notifications->Add(job->wnd, NG_COPY_PROGRESS);
+    job->thread = RunAsyncWaitable([=] { CopyTextThread(job); }, TaskPriority::Interactive);
+    if (!job->thread) {
+        win->notifications->RemoveNotification(job->wnd);
+        delete job;
+        return false;
+    }
+    gCopyTextJob = job;
+    return true;
+}
+
 void CopySelectionToClipboard(WindowInfo *win)
 {
     if (!win->currentTab || !win->currentTab->selectionOnPage) return;
@@ -237,10 +431,13 @@ void CopySelectionToClipboard(WindowInfo *win)
     CrashIf(!win->AsFixed());
     if (!win->AsFixed()) return;
 
+    DisplayModel *dm = win->AsFixed();
+    if (dm->textSelection->result.len > 0 && CopyTextSelectionOnThread(win, dm))
+        return;
+
     if (!OpenClipboard(nullptr)) return;
     EmptyClipboard();
 
-    DisplayModel *dm = win->AsFixed();
 #ifndef DISABLE_DOCUMENT_RESTRICTIONS
     if (!dm->GetEngine()->AllowsCopyingText())
         win->ShowNotification(_TR("Copying text was denied (copying as image only)"));
@@ -56,6 +56,16 @@ struct FixedPageUI {
     Vec<COLORREF> * gradientColors;
     // if true, TextColor and BackgroundColor will be temporarily swapped
     bool invertColors;
+    // if true, scrolling with the mouse wheel is animated instead of
+    // moving the document line by line
+    bool smoothScroll;
+    // rendering profile for pages: "fast" trades anti-aliasing and image
+    // smoothing for speed, "print" renders at the same quality as printing
+    char * renderQuality;
+    // if true, pages are rendered with the "fast" profile while scrolling
+    // quickly and rendered again with RenderQuality once scrolling stops
+    // (mainly helps with complex documents such as large vector drawings)
+    bool fastScrollRendering;
 };
 
 // customization options for eBooks (EPUB, Mobi, FictionBook) UI. If
@@ -85,6 +95,12 @@ struct ComicBookUI {
     // if true, default to displaying Comic Book files in manga mode (from
     // right to left if showing 2 pages at a time)
     bool cbxMangaMode;
+    // rendering profile for images: "fast" trades image smoothing for
+    // speed, "print" renders at the same quality as printing
+    char * renderQuality;
+    // if true, images are rendered with the "fast" profile while scrolling
+    // quickly and rendered again with RenderQuality once scrolling stops
+    bool fastScrollRendering;
 };
 
 // customization options for CHM UI. If UseFixedPageUI is true,
@@ -121,6 +137,10 @@ struct PrereleaseSettings {
 struct PrinterDefaults {
     // default value for scaling (shrink, fit, none)
     char * printScale;
+    // if true, PDF and XPS pages are sent to the printer as vector
+    // graphics instead of as images where possible (pages using e.g.
+    // transparency are still printed as images)
+    bool printAsVectors;
 };
 
 // customization options for how we show forward search results (used
@@ -151,6 +171,32 @@ struct AnnotationDefaults {
     bool saveIntoDocument;
 };
 
+// options for tuning rendering and caching (the defaults should be fine
+// in most cases)
+struct Performance {
+    // number of threads used for rendering pages in the background (if
+    // this value isn't positive, one thread per processor core is used)
+    int renderThreads;
+    // maximum amount of memory (in MB) used for caching rendered pages
+    // (visible pages are always kept cached; the limit is reduced when the
+    // system runs low on memory; decoded images of image documents and
+    // comic books count against this limit and may use up to half of it)
+    int renderCacheSize;
+    // maximum amount of memory (in MB) used per PDF or XPS document for
+    // caching parsed page content (shared between viewing, printing and
+    // searching the same document)
+    int displayListCacheSize;
+    // maximum amount of memory (in MB) used for caching the text of pages
+    // for searching and selecting text (shared between all documents)
+    int textCacheSize;
+    // maximum amount of memory (in MB) the cache of rendered glyphs of a
+    // PDF or XPS document may grow to at high zoom levels and resolutions
+    int glyphCacheSize;
+    // if true, tiles rendered at a different zoom level are scaled with
+    // Direct2D (when available) while they're being replaced after zooming
+    bool gpuScaling;
+};
+
 // Values which are persisted for bookmarks/favorites
 struct Favorite {
     // name of this favorite as shown in the menu
@@ -305,6 +351,9 @@ struct GlobalPrefs {
     // if true, a document will be reloaded automatically whenever it's
     // changed (currently doesn't work for documents shown in the ebook UI)
     bool reloadModifiedDocuments;
+    // time in milliseconds a modified document has to stay unchanged
+    // before it's reloaded (avoids reloading partially written files)
+    int reloadDelay;
     // if true, we show the full path to a file in the title bar
     bool fullPathInTitle;
     // zoom levels which zooming steps through in addition to Fit Page, Fit
@@ -326,6 +375,9 @@ struct GlobalPrefs {
     // actual resolution of the main screen in DPI (if this value isn't
     // positive, the system's UI setting is used)
     int customScreenDPI;
+    // options for tuning rendering and caching (the defaults should be
+    // fine in most cases)
+    Performance performance;
     // if true, we store display settings for each document separately
     // (i.e. everything after UseDefaultState in FileStates)
     bool rememberStatePerDocument;
@@ -416,14 +468,17 @@ static const FieldInfo gSizeIFields[] = {
 static const StructInfo gSizeIInfo = { sizeof(SizeI), 2, gSizeIFields, "Dx\0Dy" };
 
 static const FieldInfo gFixedPageUIFields[] = {
-    { offsetof(FixedPageUI, textColor),       Type_Color,      0x000000                     },
-    { offsetof(FixedPageUI, backgroundColor), Type_Color,      0xffffff                     },
-    { offsetof(FixedPageUI, selectionColor),  Type_Color,      0x0cfcf5                     },
-    { offsetof(FixedPageUI, windowMargin),    Type_Compact,    (intptr_t)&gWindowMarginInfo },
-    { offsetof(FixedPageUI, pageSpacing),     Type_Compact,    (intptr_t)&gSizeIInfo        },
-    { offsetof(FixedPageUI, gradientColors),  Type_ColorArray, 0                            },
-};
-static const StructInfo gFixedPageUIInfo = { sizeof(FixedPageUI), 6, gFixedPageUIFields, "TextColor\0BackgroundColor\0SelectionColor\0WindowMargin\0PageSpacing\0GradientColors" };
+    { offsetof(FixedPageUI, textColor),           Type_Color,      0x000000                     },
+    { offsetof(FixedPageUI, backgroundColor),     Type_Color,      0xffffff                     },
+    { offsetof(FixedPageUI, selectionColor),      Type_Color,      0x0cfcf5                     },
+    { offsetof(FixedPageUI, windowMargin),        Type_Compact,    (intptr_t)&gWindowMarginInfo },
+    { offsetof(FixedPageUI, pageSpacing),         Type_Compact,    (intptr_t)&gSizeIInfo        },
+    { offsetof(FixedPageUI, gradientColors),      Type_ColorArray, 0                            },
+    { offsetof(FixedPageUI, smoothScroll),        Type_Bool,       false                        },
+    { offsetof(FixedPageUI, renderQuality),       Type_Utf8String, (intptr_t)"balanced"         },
+    { offsetof(FixedPageUI, fastScrollRendering), Type_Bool,       true                         },
+};
+static const StructInfo gFixedPageUIInfo = { sizeof(FixedPageUI), 9, gFixedPageUIFields, "TextColor\0BackgroundColor\0SelectionColor\0WindowMargin\0PageSpacing\0GradientColors\0SmoothScroll\0RenderQuality\0FastScrollRendering" };
 
 static const FieldInfo gEbookUIFields[] = {
     { offsetof(EbookUI, fontName),        Type_String, (intptr_t)L"Georgia" },
@@ -449,11 +504,13 @@ static const FieldInfo gSizeI_1_Fields[] = {
 static const StructInfo gSizeI_1_Info = { sizeof(SizeI), 2, gSizeI_1_Fields, "Dx\0Dy" };
 
 static const FieldInfo gComicBookUIFields[] = {
-    { offsetof(ComicBookUI, windowMargin), Type_Compact, (intptr_t)&gWindowMargin_1_Info },
-    { offsetof(ComicBookUI, pageSpacing),  Type_Compact, (intptr_t)&gSizeI_1_Info        },
-    { offsetof(ComicBookUI, cbxMangaMode), Type_Bool,    false                           },
+    { offsetof(ComicBookUI, windowMargin),        Type_Compact,    (intptr_t)&gWindowMargin_1_Info },
+    { offsetof(ComicBookUI, pageSpacing),         Type_Compact,    (intptr_t)&gSizeI_1_Info        },
+    { offsetof(ComicBookUI, cbxMangaMode),        Type_Bool,       false                           },
+    { offsetof(ComicBookUI, renderQuality),       Type_Utf8String, (intptr_t)"balanced"            },
+    { offsetof(ComicBookUI, fastScrollRendering), Type_Bool,       true                            },
 };
-static const StructInfo gComicBookUIInfo = { sizeof(ComicBookUI), 3, gComicBookUIFields, "WindowMargin\0PageSpacing\0CbxMangaMode" };
+static const StructInfo gComicBookUIInfo = { sizeof(ComicBookUI), 5, gComicBookUIFields, "WindowMargin\0PageSpacing\0CbxMangaMode\0RenderQuality\0FastScrollRendering" };
 
 static const FieldInfo gChmUIFields[] = {
     { offsetof(ChmUI, useFixedPageUI), Type_Bool, false },
@@ -473,9 +530,10 @@ static const FieldInfo gPrereleaseSettingsFields[] = {
 static const StructInfo gPrereleaseSettingsInfo = { sizeof(PrereleaseSettings), 1, gPrereleaseSettingsFields, "TabWidth" };
 
 static const FieldInfo gPrinterDefaultsFields[] = {
-    { offsetof(PrinterDefaults, printScale), Type_Utf8String, (intptr_t)"shrink" },
+    { offsetof(PrinterDefaults, printScale),     Type_Utf8String, (intptr_t)"shrink" },
+    { offsetof(PrinterDefaults, printAsVectors), Type_Bool,       false              },
 };
-static const StructInfo gPrinterDefaultsInfo = { sizeof(PrinterDefaults), 1, gPrinterDefaultsFields, "PrintScale" };
+static const StructInfo gPrinterDefaultsInfo = { sizeof(PrinterDefaults), 2, gPrinterDefaultsFields, "PrintScale\0PrintAsVectors" };
 
 static const FieldInfo gForwardSearchFields[] = {
     { offsetof(ForwardSearch, highlightOffset),    Type_Int,   0        },
@@ -491,6 +549,16 @@ static const FieldInfo gAnnotationDefaultsFields[] = {
 };
 static const StructInfo gAnnotationDefaultsInfo = { sizeof(AnnotationDefaults), 2, gAnnotationDefaultsFields, "HighlightColor\0SaveIntoDocument" };
 
+static const FieldInfo gPerformanceFields[] = {
+    { offsetof(Performance, renderThreads),        Type_Int,  0    },
+    { offsetof(Performance, renderCacheSize),      Type_Int,  256  },
+    { offsetof(Performance, displayListCacheSize), Type_Int,  40   },
+    { offsetof(Performance, textCacheSize),        Type_Int,  64   },
+    { offsetof(Performance, glyphCacheSize),       Type_Int,  16   },
+    { offsetof(Performance, gpuScaling),           Type_Bool, true },
+};
+static const StructInfo gPerformanceInfo = { sizeof(Performance), 6, gPerformanceFields, "RenderThreads\0RenderCacheSize\0DisplayListCacheSize\0TextCacheSize\0GlyphCacheSize\0GpuScaling" };
+
 static const FieldInfo gRectIFields[] = {
     { offsetof(RectI, x),  Type_Int, 0 },
     { offsetof(RectI, y),  Type_Int, 0 },
@@ -601,6 +669,7 @@ static const FieldInfo gGlobalPrefsFields[] = {
     { offsetof(GlobalPrefs, prereleaseSettings),       Type_Prerelease,  (intptr_t)&gPrereleaseSettingsInfo                                                                                    },
     { offsetof(GlobalPrefs, showMenubar),              Type_Bool,        true                                                                                                                  },
     { offsetof(GlobalPrefs, reloadModifiedDocuments),  Type_Bool,        true                                                                                                                  },
+    { offsetof(GlobalPrefs, reloadDelay),              Type_Int,         500                                                                                                                   },
     { offsetof(GlobalPrefs, fullPathInTitle),          Type_Bool,        false                                                                                                                 },
     { offsetof(GlobalPrefs, zoomLevels),               Type_FloatArray,  (intptr_t)"8.33 12.5 18 25 33.33 50 66.67 75 100 125 150 200 300 400 600 800 1000 1200 1600 2000 2400 3200 4800 6400" },
     { offsetof(GlobalPrefs, zoomIncrement),            Type_Float,       (intptr_t)"0"                                                                                                         },
@@ -610,6 +679,7 @@ static const FieldInfo gGlobalPrefsFields[] = {
     { offsetof(GlobalPrefs, annotationDefaults),       Type_Prerelease,  (intptr_t)&gAnnotationDefaultsInfo                                                                                    },
     { offsetof(GlobalPrefs, defaultPasswords),         Type_StringArray, 0                                                                                                                     },
     { offsetof(GlobalPrefs, customScreenDPI),          Type_Int,         0                                                                                                                     },
+    { offsetof(GlobalPrefs, performance),              Type_Struct,      (intptr_t)&gPerformanceInfo                                                                                           },
     { (size_t)-1,                                      Type_Comment,     0                                                                                                                     },
     { offsetof(GlobalPrefs, rememberStatePerDocument), Type_Bool,        true                                                                                                                  },
     { offsetof(GlobalPrefs, uiLanguage),               Type_Utf8String,  0                                                                                                                     },
@@ -640,6 +710,6 @@ static const FieldInfo gGlobalPrefsFields[] = {
     { (size_t)-1,                                      Type_Comment,     0                                                                                                                     },
     { (size_t)-1,                                      Type_Comment,     (intptr_t)"Settings after this line have not been recognized by the current version"                                  },
 };
-static const StructInfo gGlobalPrefsInfo = { sizeof(GlobalPrefs), 54, gGlobalPrefsFields, "\0\0MainWindowBackground\0EscToExit\0ReuseInstance\0UseSysColors\0RestoreSession\0\0FixedPageUI\0EbookUI\0ComicBookUI\0ChmUI\0ExternalViewers\0PrereleaseSettings\0ShowMenubar\0ReloadModifiedDocuments\0FullPathInTitle\0ZoomLevels\0ZoomIncrement\0\0PrinterDefaults\0ForwardSearch\0AnnotationDefaults\0DefaultPasswords\0CustomScreenDPI\0\0RememberStatePerDocument\0UiLanguage\0ShowToolbar\0ShowFavorites\0AssociatedExtensions\0AssociateSilently\0CheckForUpdates\0VersionToSkip\0RememberOpenedFiles\0InverseSearchCmdLine\0EnableTeXEnhancements\0DefaultDisplayMode\0DefaultZoom\0WindowState\0WindowPos\0ShowToc\0SidebarDx\0TocDy\0ShowStartPage\0UseTabs\0\0FileStates\0SessionData\0ReopenOnce\0TimeOfLastUpdateCheck\0OpenCountWeek\0\0" };
+static const StructInfo gGlobalPrefsInfo = { sizeof(GlobalPrefs), 56, gGlobalPrefsFields, "\0\0MainWindowBackground\0EscToExit\0ReuseInstance\0UseSysColors\0RestoreSession\0\0FixedPageUI\0EbookUI\0ComicBookUI\0ChmUI\0ExternalViewers\0PrereleaseSettings\0ShowMenubar\0ReloadModifiedDocuments\0ReloadDelay\0FullPathInTitle\0ZoomLevels\0ZoomIncrement\0\0PrinterDefaults\0ForwardSearch\0AnnotationDefaults\0DefaultPasswords\0CustomScreenDPI\0Performance\0\0RememberStatePerDocument\0UiLanguage\0ShowToolbar\0ShowFavorites\0AssociatedExtensions\0AssociateSilently\0CheckForUpdates\0VersionToSkip\0RememberOpenedFiles\0InverseSearchCmdLine\0EnableTeXEnhancements\0DefaultDisplayMode\0DefaultZoom\0WindowState\0WindowPos\0ShowToc\0SidebarDx\0TocDy\0ShowStartPage\0UseTabs\0\0FileStates\0SessionData\0ReopenOnce\0TimeOfLastUpdateCheck\0OpenCountWeek\0\0" };
 
 #endif
@@ -3,13 +3,18 @@
 
 // utils
 #include "BaseUtil.h"
+#include "DebugLog.h"
 #include "DirIter.h"
 #include "FileUtil.h"
+#include "GdiplusUtil.h"
 #include "HtmlParserLookup.h"
 #include "HtmlWindow.h"
 #include "Mui.h"
 #include "SimpleLog.h"
+#include "TgaReader.h"
+#include "ThreadUtil.h"
 #include "Timer.h"
+#include "WinDynCalls.h"
 #include "WinUtil.h"
 // rendering engines
 #include "BaseEngine.h"
@@ -59,30 +64,61 @@ static bool IsInRange(Vec<PageRange>& ranges, int pageNo)
     return false;
 }
 
-static void BenchLoadRender(BaseEngine *engine, int pagenum)
+struct BenchDocResult {
+    const WCHAR *filePath;
+    EngineType engineType;
+    int pageCount;
+    bool ok;
+    // one entry per measured run
+    Vec<double> loadMs;
+    // one entry per page and measured run
+    Vec<BenchPageTimes> pages;
+    size_t peakMemory;
+};
+
+// options for -bench (cf. -bench-format, -bench-repeat, -bench-warmup)
+static const WCHAR *gBenchFormat = nullptr;
+static int gBenchRepeat = 1;
+static int gBenchWarmup = 0;
+static bool gBenchIsWarmingUp = false;
+
+#define logbenchrun(msg, ...) do { if (gLog && !gBenchIsWarmingUp) logbench(msg, __VA_ARGS__); } while (0)
+
+bool BenchLoadRender(BaseEngine *engine, int pagenum, float zoom, BenchPageTimes *times)
 {
+    times->pageNo = pagenum;
     Timer t;
     bool ok = engine->BenchLoadPage(pagenum);
     t.Stop();
 
     if (!ok) {
-        logbench(L"Error: failed to load page %d", pagenum);
-        return;
+        logbenchrun(L"Error: failed to load page %d", pagenum);
+        return false;
     }
     double timeMs = t.GetTimeInMs();
-    logbench(L"pageload   %3d: %.2f ms", pagenum, timeMs);
+    times->loadMs = timeMs;
+    logbenchrun(L"pageload   %3d: %.2f ms", pagenum, timeMs);
 
     t.Start();
-    RenderedBitmap *rendered = engine->RenderBitmap(pagenum, 1.0, 0);
+    RenderedBitmap *rendered = engine->RenderBitmap(pagenum, zoom, 0);
     t.Stop();
 
     if (!rendered) {
-        logbench(L"Error: failed to render page %d", pagenum);
-        return;
+        logbenchrun(L"Error: failed to render page %d", pagenum);
+        return false;
     }
     delete rendered;
     timeMs = t.GetTimeInMs();
-    logbench(L"pagerender %3d: %.2f ms", pagenum, timeMs);
+    times->renderMs = timeMs;
+    logbenchrun(L"pagerender %3d: %.2f ms", pagenum, timeMs);
+
+    t.Start();
+    free(engine->ExtractPageText(pagenum, L"\n", nullptr, Target_Export));
+    timeMs = t.Stop();
+    times->textMs = timeMs;
+    logbenchrun(L"pagetext   %3d: %.2f ms", pagenum, timeMs);
+
+    return true;
 }
 
 static int FormatWholeDoc(Doc& doc) {
@@ -103,6 +139,21 @@ static int FormatWholeDoc(Doc& doc) {
     return nPages;
 }
 
+// returns the time it takes to lay out the whole ebook (or a negative value if it fails to load)
+double BenchEbookLayoutTime(const WCHAR *filePath)
+{
+    Doc doc = Doc::CreateFromFile(filePath);
+    if (doc.LoadingFailed()) {
+        doc.Delete();
+        return -1;
+    }
+    Timer t;
+    FormatWholeDoc(doc);
+    double timeMs = t.Stop();
+    doc.Delete();
+    return timeMs;
+}
+
 static int TimeOneMethod(Doc&doc, TextRenderMethod method, const WCHAR *methodName) {
     SetTextRenderMethod(method);
     Timer t;
@@ -179,44 +230,164 @@ static void BenchChmLoadOnly(const WCHAR *filePath)
     logbench(L"Finished (in %.2f ms): %s", total.GetTimeInMs(), filePath);
 }
 
-static void BenchFile(const WCHAR *filePath, const WCHAR *pagesSpec)
+static const char *EngineTypeName(EngineType type)
 {
-    if (!file::Exists(filePath)) {
-        return;
+    switch (type) {
+    case Engine_PDF:       return "PDF";
+    case Engine_XPS:       return "XPS";
+    case Engine_DjVu:      return "DjVu";
+    case Engine_Image:     return "Image";
+    case Engine_ImageDir:  return "ImageDir";
+    case Engine_ComicBook: return "ComicBook";
+    case Engine_PS:        return "PS";
+    case Engine_Epub:      return "Epub";
+    case Engine_Fb2:       return "Fb2";
+    case Engine_Mobi:      return "Mobi";
+    case Engine_Pdb:       return "Pdb";
+    case Engine_Chm:       return "Chm";
+    case Engine_Html:      return "Html";
+    case Engine_Txt:       return "Txt";
+    default:               return "None";
     }
+}
 
-    // ad-hoc: if enabled times layout instead of rendering and does layout
-    // using all text rendering methods, so that we can compare and find
-    // docs that take a long time to load
+static size_t GetPeakMemoryUsage()
+{
+    PROCESS_MEMORY_COUNTERS pmc = { 0 };
+    if (!DynK32GetProcessMemoryInfo || !DynK32GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+        return 0;
+    return pmc.PeakWorkingSetSize;
+}
 
-    if (Doc::IsSupportedFile(filePath) && !gGlobalPrefs->ebookUI.useFixedPageUI) {
-        BenchEbookLayout(filePath);
-        return;
+static int cmpDouble(const void *a, const void *b)
+{
+    double diff = *(const double *)a - *(const double *)b;
+    return diff < 0 ? -1 : diff > 0 ? 1 : 0;
+}
+
+struct BenchStats {
+    double p50, p95, max;
+};
+
+// uses the nearest-rank method for percentiles
+static BenchStats GetBenchStats(Vec<double>& values)
+{
+    BenchStats stats = { 0, 0, 0 };
+    size_t n = values.Count();
+    if (0 == n)
+        return stats;
+    values.Sort(cmpDouble);
+    stats.p50 = values.At((n * 50 + 99) / 100 - 1);
+    stats.p95 = values.At((n * 95 + 99) / 100 - 1);
+    stats.max = values.Last();
+    return stats;
+}
+
+static void AppendJsonString(str::Str<char>& s, const WCHAR *value)
+{
+    ScopedMem<char> utf8(str::conv::ToUtf8(value));
+    s.Append('"');
+    for (const char *c = utf8; *c; c++) {
+        if ('"' == *c || '\\' == *c) {
+            s.Append('\\');
+            s.Append(*c);
+        }
+        else if ((unsigned char)*c < 0x20)
+            s.AppendFmt("\\u%04x", *c);
+        else
+            s.Append(*c);
     }
+    s.Append('"');
+}
 
-    if (ChmModel::IsSupportedFile(filePath) && !gGlobalPrefs->chmUI.useFixedPageUI) {
-        BenchChmLoadOnly(filePath);
-        return;
+static void AppendJsonStats(str::Str<char>& s, const char *name, BenchStats stats)
+{
+    s.AppendFmt(", \"%s\": {\"p50\": %.2f, \"p95\": %.2f, \"max\": %.2f}", name, stats.p50, stats.p95, stats.max);
+}
+
+// writes one line per document to stdout (a JSON object or a CSV row)
+static void OutputBenchResult(BenchDocResult& res)
+{
+    Vec<double> pageLoadMs, renderMs, textMs;
+    for (size_t i = 0; i < res.pages.Count(); i++) {
+        pageLoadMs.Append(res.pages.At(i).loadMs);
+        renderMs.Append(res.pages.At(i).renderMs);
+        textMs.Append(res.pages.At(i).textMs);
     }
+    BenchStats load = GetBenchStats(res.loadMs);
+    BenchStats pageLoad = GetBenchStats(pageLoadMs);
+    BenchStats render = GetBenchStats(renderMs);
+    BenchStats text = GetBenchStats(textMs);
+
+    str::Str<char> s;
+    if (str::EqI(gBenchFormat, L"csv")) {
+        // quote the path (doubling quotes) since it might contain commas
+        ScopedMem<char> path(str::conv::ToUtf8(res.filePath));
+        s.Append('"');
+        for (const char *c = path; *c; c++) {
+            if ('"' == *c)
+                s.Append('"');
+            s.Append(*c);
+        }
+        s.AppendFmt("\",%s,%s,%d,%d", EngineTypeName(res.engineType), res.ok ? "ok" : "error", res.pageCount,
+                    (int)res.loadMs.Count());
+        BenchStats all[] = { load, pageLoad, render, text };
+        for (size_t i = 0; i < dimof(all); i++) {
+            s.AppendFmt(",%.2f,%.2f,%.2f", all[i].p50, all[i].p95, all[i].max);
+        }
+        s.AppendFmt(",%Iu\n", res.peakMemory);
+    }
+    else {
+        s.Append("{\"file\": ");
+        AppendJsonString(s, res.filePath);
+        s.AppendFmt(", \"engine\": \"%s\", \"ok\": %s, \"pageCount\": %d, \"runs\": %d",
+                    EngineTypeName(res.engineType), res.ok ? "true" : "false", res.pageCount, (int)res.loadMs.Count());
+        AppendJsonStats(s, "load", load);
+        AppendJsonStats(s, "pageLoad", pageLoad);
+        AppendJsonStats(s, "render", render);
+        AppendJsonStats(s, "text", text);
+        s.AppendFmt(", \"peakMemory\": %Iu, \"pages\": [", res.peakMemory);
+        for (size_t i = 0; i < res.pages.Count(); i++) {
+            BenchPageTimes& page = res.pages.At(i);
+            s.AppendFmt("%s{\"page\": %d, \"load\": %.2f, \"render\": %.2f, \"text\": %.2f}", i > 0 ? ", " : "",
+                        page.pageNo, page.loadMs, page.renderMs, page.textMs);
+        }
+        s.Append("]}\n");
+    }
+    fputs(s.Get(), stdout);
+    fflush(stdout);
+}
 
+// loads the document once and renders the requested pages
+// (results are only recorded if this isn't a warm-up run)
+static bool BenchFileRun(const WCHAR *filePath, const WCHAR *pagesSpec, BenchDocResult& res)
+{
     Timer total;
-    logbench(L"Starting: %s", filePath);
+    logbenchrun(L"Starting: %s", filePath);
 
     Timer t;
-    BaseEngine *engine = EngineManager::CreateEngine(filePath);
+    BaseEngine *engine = EngineManager::CreateEngine(filePath, nullptr, &res.engineType);
     if (!engine) {
-        logbench(L"Error: failed to load %s", filePath);
-        return;
+        logbenchrun(L"Error: failed to load %s", filePath);
+        return false;
     }
 
     double timeMs = t.Stop();
-    logbench(L"load: %.2f ms", timeMs);
+    logbenchrun(L"load: %.2f ms", timeMs);
     int pages = engine->PageCount();
-    logbench(L"page count: %d", pages);
+    logbenchrun(L"page count: %d", pages);
+    if (!gBenchIsWarmingUp) {
+        res.loadMs.Append(timeMs);
+        res.pageCount = pages;
+    }
 
+    BenchPageTimes times = { 0 };
+    bool ok = true;
     if (nullptr == pagesSpec) {
         for (int i = 1; i <= pages; i++) {
-            BenchLoadRender(engine, i);
+            ok = BenchLoadRender(engine, i, 1.0f, &times) && ok;
+            if (!gBenchIsWarmingUp)
+                res.pages.Append(times);
         }
     }
 
@@ -225,8 +396,11 @@ static void BenchFile(const WCHAR *filePath, const WCHAR *pagesSpec)
     if (ParsePageRanges(pagesSpec, ranges)) {
         for (size_t i = 0; i < ranges.Count(); i++) {
             for (int j = ranges.At(i).start; j <= ranges.At(i).end; j++) {
-                if (1 <= j && j <= pages)
-                    BenchLoadRender(engine, j);
+                if (1 <= j && j <= pages) {
+                    ok = BenchLoadRender(engine, j, 1.0f, &times) && ok;
+                    if (!gBenchIsWarmingUp)
+                        res.pages.Append(times);
+                }
             }
         }
     }
@@ -234,7 +408,49 @@ static void BenchFile(const WCHAR *filePath, const WCHAR *pagesSpec)
     delete engine;
     total.Stop();
 
-    logbench(L"Finished (in %.2f ms): %s", total.GetTimeInMs(), filePath);
+    logbenchrun(L"Finished (in %.2f ms): %s", total.GetTimeInMs(), filePath);
+    return ok;
+}
+
+static void BenchFile(const WCHAR *filePath, const WCHAR *pagesSpec)
+{
+    if (!file::Exists(filePath)) {
+        return;
+    }
+
+    // ad-hoc: if enabled times layout instead of rendering and does layout
+    // using all text rendering methods, so that we can compare and find
+    // docs that take a long time to load
+    // (machine-readable output always uses the engines)
+
+    if (!gBenchFormat && Doc::IsSupportedFile(filePath) && !gGlobalPrefs->ebookUI.useFixedPageUI) {
+        BenchEbookLayout(filePath);
+        return;
+    }
+
+    if (!gBenchFormat && ChmModel::IsSupportedFile(filePath) && !gGlobalPrefs->chmUI.useFixedPageUI) {
+        BenchChmLoadOnly(filePath);
+        return;
+    }
+
+    BenchDocResult res;
+    res.filePath = filePath;
+    res.engineType = Engine_None;
+    res.pageCount = 0;
+    res.ok = true;
+    for (int run = 0; run < gBenchWarmup + gBenchRepeat; run++) {
+        gBenchIsWarmingUp = run < gBenchWarmup;
+        if (!BenchFileRun(filePath, pagesSpec, res))
+            res.ok = false;
+        // don't retry documents which fail to load
+        if (0 == res.pageCount && !gBenchIsWarmingUp)
+            break;
+    }
+    gBenchIsWarmingUp = false;
+    res.peakMemory = GetPeakMemoryUsage();
+
+    if (gBenchFormat)
+        OutputBenchResult(res);
 }
 
 static bool IsFileToBench(const WCHAR *fileName)
@@ -265,10 +481,24 @@ static void BenchDir(WCHAR *dir)
     }
 }
 
-void BenchFileOrDir(WStrVec& pathsToBench)
+void BenchFileOrDir(CommandLineInfo& info)
 {
     gLog = new slog::StderrLogger();
 
+    gBenchFormat = info.benchFormat;
+    gBenchRepeat = std::max(info.benchRepeat, 1);
+    gBenchWarmup = std::max(info.benchWarmup, 0);
+    if (info.benchCpu >= 0 && info.benchCpu < (int)(sizeof(DWORD_PTR) * 8)) {
+        // pinning the benchmark to a single processor avoids noise from thread migration
+        if (!SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << info.benchCpu))
+            logbench(L"Error: failed to run on processor %d", info.benchCpu);
+    }
+    if (str::EqI(gBenchFormat, L"csv")) {
+        fputs("file,engine,status,pages,runs,load_p50,load_p95,load_max,pageload_p50,pageload_p95,pageload_max,"
+              "render_p50,render_p95,render_max,text_p50,text_p95,text_max,peak_memory\n", stdout);
+    }
+
+    WStrVec& pathsToBench = info.pathsToBenchmark;
     size_t n = pathsToBench.Count() / 2;
     for (size_t i = 0; i < n; i++) {
         WCHAR *path = pathsToBench.At(2 * i);
@@ -283,6 +513,528 @@ void BenchFileOrDir(WStrVec& pathsToBench)
     delete gLog;
 }
 
+/* Batch rendering: -render-batch renders the pages of many documents to image
+files without any UI. Files are distributed over a pool of worker threads, each
+of which loads its own engine per document. One line is written to stdout per
+file ("ok" or "error", time, page count, path), so that the output can be
+processed by scripts. */
+
+#define MAX_RENDER_BATCH_WORKERS 64
+
+struct RenderBatchJob {
+    WStrVec files;
+    // output files mirror the layout below baseDir (if rendering a directory)
+    ScopedMem<WCHAR> baseDir;
+    const WCHAR *outDir;
+    Vec<PageRange> ranges;
+    int dpi;
+    const WCHAR *format;
+
+    CRITICAL_SECTION access;
+    size_t nextFile;
+    int failedCount;
+
+    RenderBatchJob() : outDir(nullptr), dpi(0), format(nullptr), nextFile(0), failedCount(0) {
+        InitializeCriticalSection(&access);
+    }
+    ~RenderBatchJob() { DeleteCriticalSection(&access); }
+};
+
+static bool SaveRenderBatchPage(RenderedBitmap *bmp, const WCHAR *filePath, const WCHAR *format)
+{
+    if (str::EqI(format, L"png") || str::EqI(format, L"jpg")) {
+        Bitmap gbmp(bmp->GetBitmap(), nullptr);
+        CLSID encId = GetEncoderClsid(str::EqI(format, L"png") ? L"image/png" : L"image/jpeg");
+        return gbmp.Save(filePath, &encId) == Ok;
+    }
+    size_t len;
+    ScopedMem<unsigned char> data;
+    if (str::EqI(format, L"bmp"))
+        data.Set(SerializeBitmap(bmp->GetBitmap(), &len));
+    else
+        data.Set(tga::SerializeBitmap(bmp->GetBitmap(), &len));
+    return data && file::WriteAll(filePath, data, len);
+}
+
+// returns false if the document couldn't be loaded or any page failed to render
+static bool RenderBatchFile(RenderBatchJob *job, const WCHAR *filePath, int *pagesRendered)
+{
+    *pagesRendered = 0;
+    BaseEngine *engine = EngineManager::CreateEngine(filePath, nullptr, nullptr, false);
+    if (!engine)
+        return false;
+
+    const WCHAR *relPath = path::GetBaseName(filePath);
+    if (job->baseDir && str::StartsWithI(filePath, job->baseDir)) {
+        relPath = filePath + str::Len(job->baseDir);
+        while (path::IsSep(*relPath))
+            relPath++;
+    }
+    ScopedMem<WCHAR> outBase(path::Join(job->outDir, relPath));
+    ScopedMem<WCHAR> outDir(path::GetDir(outBase));
+    dir::CreateAll(outDir);
+
+    float zoom = job->dpi > 0 ? job->dpi / engine->GetFileDPI() : 1.0f;
+    bool ok = true;
+    for (int pageNo = 1; pageNo <= engine->PageCount(); pageNo++) {
+        if (job->ranges.Count() > 0 && !IsInRange(job->ranges, pageNo))
+            continue;
+        RenderedBitmap *bmp = engine->RenderBitmap(pageNo, zoom, 0, nullptr, Target_Export);
+        ScopedMem<WCHAR> outPath(str::Format(L"%s-%d.%s", outBase, pageNo, job->format));
+        if (bmp && SaveRenderBatchPage(bmp, outPath, job->format))
+            (*pagesRendered)++;
+        else
+            ok = false;
+        delete bmp;
+    }
+    delete engine;
+    return ok;
+}
+
+class RenderBatchWorker : public ThreadBase {
+    RenderBatchJob *job;
+
+  public:
+    explicit RenderBatchWorker(RenderBatchJob *job) : ThreadBase("RenderBatchWorker"), job(job) {}
+    virtual ~RenderBatchWorker() {}
+    virtual void Run() override;
+};
+
+void RenderBatchWorker::Run()
+{
+    while (!WasCancelRequested()) {
+        const WCHAR *filePath;
+        {
+            ScopedCritSec scope(&job->access);
+            if (job->nextFile >= job->files.Count())
+                break;
+            filePath = job->files.At(job->nextFile++);
+        }
+
+        Timer t;
+        int pages;
+        bool ok = RenderBatchFile(job, filePath, &pages);
+        double timeMs = t.Stop();
+
+        ScopedCritSec scope(&job->access);
+        if (!ok)
+            job->failedCount++;
+        fwprintf(stdout, L"%s\t%.2f ms\t%d pages\t%s\n", ok ? L"ok" : L"error", timeMs, pages, filePath);
+        fflush(stdout);
+    }
+}
+
+static void CollectFilesToRender(const WCHAR *path, RenderBatchJob& job)
+{
+    if ('@' == *path) {
+        // a list of files (one path per line)
+        ScopedMem<char> data(file::ReadAll(path + 1, nullptr));
+        ScopedMem<WCHAR> list(data ? str::conv::FromUtf8(data) : nullptr);
+        WStrVec lines;
+        if (list)
+            lines.Split(0xFEFF == list[0] ? list + 1 : list, L"\n", true);
+        for (size_t i = 0; i < lines.Count(); i++) {
+            WCHAR *line = lines.At(i);
+            str::TrimWS(line);
+            if (*line && file::Exists(line))
+                job.files.Append(str::Dup(line));
+        }
+    }
+    else if (dir::Exists(path)) {
+        job.baseDir.Set(path::Normalize(path));
+        DirIter di(job.baseDir, true /* recursive */);
+        for (const WCHAR *filePath = di.First(); filePath; filePath = di.Next()) {
+            if (EngineManager::IsSupportedFile(filePath))
+                job.files.Append(str::Dup(filePath));
+        }
+        job.files.SortNatural();
+    }
+    else if (file::Exists(path)) {
+        job.files.Append(str::Dup(path));
+    }
+}
+
+// returns the number of files which failed to render (or 1 if there were no files to render)
+int RenderBatch(CommandLineInfo& i)
+{
+    RenderBatchJob job;
+    CollectFilesToRender(i.renderBatchPath, job);
+    if (0 == job.files.Count()) {
+        fwprintf(stderr, L"Error: no files to render in %s\n", i.renderBatchPath.Get());
+        return 1;
+    }
+    job.outDir = i.renderBatchOutDir;
+    ParsePageRanges(i.renderBatchRanges, job.ranges);
+    job.dpi = i.renderBatchDpi;
+    job.format = i.renderBatchFormat ? i.renderBatchFormat.Get() : L"png";
+
+    int count = i.renderBatchWorkers;
+    if (count <= 0) {
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        count = (int)si.dwNumberOfProcessors;
+    }
+    count = limitValue(count, 1, std::min((int)job.files.Count(), MAX_RENDER_BATCH_WORKERS));
+
+    Timer total;
+    RenderBatchWorker *workers[MAX_RENDER_BATCH_WORKERS];
+    for (int n = 0; n < count; n++) {
+        workers[n] = new RenderBatchWorker(&job);
+        workers[n]->Start();
+    }
+    for (int n = 0; n < count; n++) {
+        workers[n]->Join(INFINITE);
+        delete workers[n];
+    }
+
+    fwprintf(stderr, L"Rendered %d files (%d failed) in %.2f ms\n", (int)job.files.Count(), job.failedCount,
+             total.Stop());
+    return job.failedCount;
+}
+
+/* Render server: -render-server <name> serves page renders and page text to other
+processes over the named pipe \\.\pipe\<name>, without any UI. Each client gets its
+own thread. Requests and replies are UTF-8 lines terminated by '\n':
+
+  render "<file>" <page> <dpi> "<image file>"
+      renders a page to a .png, .jpg, .bmp or .tga file and replies "ok <dx> <dy>"
+  text "<file>" <page>
+      replies "ok <byte count>" followed by that many bytes of the page's UTF-8 text
+  quit
+      replies "ok" and stops the server
+
+Failures are replied to with "error <reason>". Recently used documents stay loaded,
+so that consecutive requests for the same file don't have to reload it. */
+
+#define RENDER_SERVER_MAX_ENGINES 8
+#define RENDER_SERVER_MAX_LINE 4096
+
+#ifndef PIPE_REJECT_REMOTE_CLIENTS
+#define PIPE_REJECT_REMOTE_CLIENTS 0x00000008
+#endif
+
+struct ServedEngine {
+    ScopedMem<WCHAR> filePath;
+    FILETIME modified;
+    BaseEngine *engine;
+    int refs;
+    // set when the engine has been removed from the cache while still in use
+    bool evicted;
+
+    ServedEngine(const WCHAR *filePath, FILETIME modified, BaseEngine *engine)
+        : filePath(str::Dup(filePath)), modified(modified), engine(engine), refs(1), evicted(false) {}
+    ~ServedEngine() { delete engine; }
+};
+
+struct RenderServerState {
+    ScopedMem<WCHAR> pipeName;
+    volatile LONG quit;
+
+    CRITICAL_SECTION access;
+    // most recently used first
+    Vec<ServedEngine *> engines;
+
+    RenderServerState() : quit(0) { InitializeCriticalSection(&access); }
+    ~RenderServerState() {
+        DeleteVecMembers(engines);
+        DeleteCriticalSection(&access);
+    }
+};
+
+static ServedEngine *AcquireServedEngine(RenderServerState *server, const WCHAR *path)
+{
+    ScopedMem<WCHAR> filePath(path::Normalize(path));
+    FILETIME modified = file::GetModificationTime(filePath);
+    {
+        ScopedCritSec scope(&server->access);
+        for (size_t i = 0; i < server->engines.Count(); i++) {
+            ServedEngine *se = server->engines.At(i);
+            if (str::EqI(se->filePath, filePath) && file::FileTimeEq(se->modified, modified)) {
+                se->refs++;
+                server->engines.InsertAt(0, server->engines.PopAt(i));
+                return se;
+            }
+        }
+    }
+
+    // loading may take a while, so don't block other clients in the meantime
+    BaseEngine *engine = EngineManager::CreateEngine(filePath, nullptr, nullptr, false);
+    if (!engine)
+        return nullptr;
+    ServedEngine *se = new ServedEngine(filePath, modified, engine);
+
+    Vec<ServedEngine *> unused;
+    {
+        ScopedCritSec scope(&server->access);
+        server->engines.InsertAt(0, se);
+        while (server->engines.Count() > RENDER_SERVER_MAX_ENGINES) {
+            ServedEngine *old = server->engines.Pop();
+            old->evicted = true;
+            if (0 == old->refs)
+                unused.Append(old);
+        }
+    }
+    DeleteVecMembers(unused);
+    return se;
+}
+
+static void ReleaseServedEngine(RenderServerState *server, ServedEngine *se)
+{
+    bool unused;
+    {
+        ScopedCritSec scope(&server->access);
+        unused = 0 == --se->refs && se->evicted;
+    }
+    if (unused)
+        delete se;
+}
+
+static HANDLE CreateRenderServerPipe(const WCHAR *pipeName)
+{
+    DWORD mode = PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT;
+    HANDLE hPipe = CreateNamedPipe(pipeName, PIPE_ACCESS_DUPLEX, mode | PIPE_REJECT_REMOTE_CLIENTS,
+                                   PIPE_UNLIMITED_INSTANCES, 64 * 1024, RENDER_SERVER_MAX_LINE, 0, nullptr);
+    // PIPE_REJECT_REMOTE_CLIENTS isn't supported before Windows Vista
+    if (INVALID_HANDLE_VALUE == hPipe && ERROR_INVALID_PARAMETER == GetLastError())
+        hPipe = CreateNamedPipe(pipeName, PIPE_ACCESS_DUPLEX, mode, PIPE_UNLIMITED_INSTANCES, 64 * 1024,
+                                RENDER_SERVER_MAX_LINE, 0, nullptr);
+    return hPipe;
+}
+
+class RenderServerClient : public ThreadBase {
+    RenderServerState *server;
+    HANDLE hPipe;
+
+    bool Reply(const char *data, size_t len);
+    bool HandleRequest(const char *line);
+
+  public:
+    RenderServerClient(RenderServerState *server, HANDLE hPipe)
+        : ThreadBase("RenderServerClient"), server(server), hPipe(hPipe) {}
+    virtual ~RenderServerClient() { CloseHandle(hPipe); }
+    virtual void Run() override;
+};
+
+bool RenderServerClient::Reply(const char *data, size_t len)
+{
+    DWORD written;
+    return WriteFile(hPipe, data, (DWORD)len, &written, nullptr) && written == len;
+}
+
+static const WCHAR *GetRenderServerFormat(const WCHAR *imagePath)
+{
+    const WCHAR *ext = path::GetExt(imagePath);
+    if (str::EqI(ext, L".png") || str::EqI(ext, L".jpg") || str::EqI(ext, L".bmp") || str::EqI(ext, L".tga"))
+        return ext + 1;
+    if (str::EqI(ext, L".jpeg"))
+        return L"jpg";
+    return nullptr;
+}
+
+// returns false if the connection should be closed
+bool RenderServerClient::HandleRequest(const char *line)
+{
+    ScopedMem<WCHAR> request(str::conv::FromUtf8(line));
+    ScopedMem<WCHAR> filePath, imagePath;
+    int pageNo, dpi;
+    ScopedMem<char> reply, text;
+
+    if (str::Parse(request, L"render \"%S\" %d %d \"%S\"%$", &filePath, &pageNo, &dpi, &imagePath)) {
+        const WCHAR *format = GetRenderServerFormat(imagePath);
+        ServedEngine *se = format ? AcquireServedEngine(server, filePath) : nullptr;
+        if (!format)
+            reply.Set(str::Dup("error unsupported image format"));
+        else if (!se)
+            reply.Set(str::Dup("error cannot load document"));
+        else if (pageNo < 1 || pageNo > se->engine->PageCount())
+            reply.Set(str::Dup("error invalid page number"));
+        else {
+            float zoom = dpi > 0 ? dpi / se->engine->GetFileDPI() : 1.0f;
+            RenderedBitmap *bmp = se->engine->RenderBitmap(pageNo, zoom, 0, nullptr, Target_Export);
+            if (!bmp)
+                reply.Set(str::Dup("error rendering failed"));
+            else if (!SaveRenderBatchPage(bmp, imagePath, format))
+                reply.Set(str::Dup("error cannot save image"));
+            else
+                reply.Set(str::Format("ok %d %d", bmp->Size().dx, bmp->Size().dy));
+            delete bmp;
+        }
+        if (se)
+            ReleaseServedEngine(server, se);
+    }
+    else if (str::Parse(request, L"text \"%S\" %d%$", &filePath, &pageNo)) {
+        ServedEngine *se = AcquireServedEngine(server, filePath);
+        if (!se)
+            reply.Set(str::Dup("error cannot load document"));
+        else if (pageNo < 1 || pageNo > se->engine->PageCount())
+            reply.Set(str::Dup("error invalid page number"));
+        else {
+            ScopedMem<WCHAR> pageText(se->engine->ExtractPageText(pageNo, L"\n", nullptr));
+            text.Set(str::conv::ToUtf8(pageText ? pageText.Get() : L""));
+            reply.Set(str::Format("ok %d", (int)str::Len(text)));
+        }
+        if (se)
+            ReleaseServedEngine(server, se);
+    }
+    else if (str::Eq(request, L"quit")) {
+        InterlockedExchange(&server->quit, 1);
+        Reply("ok\n", 3);
+        // wake up the server which is waiting for the next client
+        HANDLE hWake = CreateFile(server->pipeName, GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0,
+                                  nullptr);
+        if (hWake != INVALID_HANDLE_VALUE)
+            CloseHandle(hWake);
+        return false;
+    }
+    else {
+        reply.Set(str::Dup("error unknown request"));
+    }
+
+    str::Str<char> out;
+    out.Append(reply);
+    out.Append('\n');
+    if (text)
+        out.Append(text);
+    return Reply(out.Get(), out.Size());
+}
+
+void RenderServerClient::Run()
+{
+    str::Str<char> line;
+    bool tooLong = false;
+    char buf[1024];
+    DWORD read;
+    while (!server->quit && ReadFile(hPipe, buf, sizeof(buf), &read, nullptr) && read > 0) {
+        for (DWORD i = 0; i < read; i++) {
+            if (buf[i] != '\n') {
+                if (line.Size() < RENDER_SERVER_MAX_LINE)
+                    line.Append(buf[i]);
+                else
+                    tooLong = true;
+                continue;
+            }
+            if (line.Size() > 0 && '\r' == line.Last())
+                line.Pop();
+            bool ok;
+            if (tooLong)
+                ok = Reply("error request too long\n", 23);
+            else
+                ok = HandleRequest(line.Get());
+            line.Reset();
+            tooLong = false;
+            if (!ok) {
+                DisconnectNamedPipe(hPipe);
+                return;
+            }
+        }
+    }
+    DisconnectNamedPipe(hPipe);
+}
+
+// returns 0 after a quit request or 1 if serving wasn't possible
+int RunRenderServer(CommandLineInfo& i)
+{
+    // not deleted on exit, as clients might still be connected
+    RenderServerState *server = new RenderServerState();
+    server->pipeName.Set(str::Join(L"\\\\.\\pipe\\", i.renderServerPipe));
+    fwprintf(stderr, L"Serving requests on %s\n", server->pipeName.Get());
+
+    Vec<RenderServerClient *> clients;
+    int retCode = 0;
+    while (!server->quit) {
+        HANDLE hPipe = CreateRenderServerPipe(server->pipeName);
+        if (INVALID_HANDLE_VALUE == hPipe) {
+            fwprintf(stderr, L"Error: cannot create %s\n", server->pipeName.Get());
+            retCode = 1;
+            break;
+        }
+        bool connected = ConnectNamedPipe(hPipe, nullptr) || ERROR_PIPE_CONNECTED == GetLastError();
+
+        for (size_t n = clients.Count(); n > 0; n--) {
+            if (clients.At(n - 1)->Join(0))
+                delete clients.PopAt(n - 1);
+        }
+        if (!connected || server->quit) {
+            CloseHandle(hPipe);
+            continue;
+        }
+        RenderServerClient *client = new RenderServerClient(server, hPipe);
+        clients.Append(client);
+        client->Start();
+    }
+    return retCode;
+}
+
+/* Startup timeline: named phases are recorded (relative to process start)
+until the first document or start page has been painted. With -bench-startup,
+the process exits after the first paint of the given document and prints
+the breakdown to stderr. */
+
+#define MAX_STARTUP_PHASES 32
+
+struct StartupPhase {
+    const char *name;
+    double timeMs;
+};
+
+// started during static initialization, i.e. shortly after process start
+static Timer gStartupTimer;
+// ring buffer, so that an unexpectedly high number of phases
+// keeps the most recent ones
+static StartupPhase gStartupPhases[MAX_STARTUP_PHASES];
+static int gStartupPhaseCount = 0;
+static bool gStartupDone = false;
+static bool gIsBenchingStartup = false;
+
+// name must be a static string
+void RecordStartupPhase(const char *name)
+{
+    if (gStartupDone)
+        return;
+    StartupPhase& phase = gStartupPhases[gStartupPhaseCount % MAX_STARTUP_PHASES];
+    phase.name = name;
+    phase.timeMs = gStartupTimer.GetTimeInMs();
+    gStartupPhaseCount++;
+}
+
+static void LogStartupPhases(bool toStderr)
+{
+    int first = std::max(gStartupPhaseCount - MAX_STARTUP_PHASES, 0);
+    double prevMs = 0;
+    for (int n = first; n < gStartupPhaseCount; n++) {
+        StartupPhase& phase = gStartupPhases[n % MAX_STARTUP_PHASES];
+        plogf("startup: %-20s %8.2f ms (+%.2f ms)", phase.name, phase.timeMs, phase.timeMs - prevMs);
+        if (toStderr)
+            fprintf(stderr, "%-20s %8.2f ms (+%.2f ms)\n", phase.name, phase.timeMs, phase.timeMs - prevMs);
+        prevMs = phase.timeMs;
+    }
+}
+
+void StartBenchStartup()
+{
+    gIsBenchingStartup = true;
+}
+
+bool IsBenchingStartup()
+{
+    return gIsBenchingStartup;
+}
+
+// call after every successful paint (cheap once startup has finished)
+void OnStartupPaint(bool isDocument)
+{
+    if (gStartupDone)
+        return;
+    // when benchmarking, only the document's paint counts
+    if (gIsBenchingStartup && !isDocument)
+        return;
+    RecordStartupPhase("first paint");
+    gStartupDone = true;
+    LogStartupPhases(gIsBenchingStartup);
+    if (gIsBenchingStartup)
+        PostQuitMessage(0);
+}
+
 inline bool IsSpecialDir(const WCHAR *s)
 {
     return str::Eq(s, L".") || str::Eq(s, L"..");
@@ -867,6 +1619,232 @@ static void RandomizeFiles(WStrVec& files, int maxPerType)
     }
 }
 
+/* Concurrent stress testing: -stress-test <path> -stress-threads <count> runs
+<count> threads without any UI, each of which loads its own engines for the files
+and calls RenderBitmap, ExtractPageText, GetElements and Clone for random pages.
+This validates the thread-safety and the scalability of the engines; throughput
+and latency histograms (per call type) are printed once all files are done. */
+
+#define MAX_STRESS_THREADS          64
+// latencies are counted in buckets of < 1 ms, < 2 ms, < 4 ms, ..., >= 2^14 ms
+#define STRESS_HISTOGRAM_BUCKETS    16
+
+enum StressOp {
+    StressOp_Render, StressOp_Text, StressOp_Elements, StressOp_Clone, StressOp_Count
+};
+
+static const WCHAR *gStressOpNames[StressOp_Count] = { L"render", L"text", L"elements", L"clone" };
+
+struct StressOpStats {
+    int count;
+    int failed;
+    double totalMs;
+    double maxMs;
+    int histogram[STRESS_HISTOGRAM_BUCKETS];
+};
+
+struct ConcurrentStressJob {
+    WStrVec files;
+    Vec<PageRange> ranges;
+    int cycles;
+
+    CRITICAL_SECTION access;
+    // index into files * cycles
+    size_t nextFile;
+
+    ConcurrentStressJob() : cycles(1), nextFile(0) { InitializeCriticalSection(&access); }
+    ~ConcurrentStressJob() { DeleteCriticalSection(&access); }
+};
+
+class ConcurrentStressWorker : public ThreadBase {
+    ConcurrentStressJob *job;
+    uint32_t seed;
+
+    uint32_t Random() {
+        // xorshift, since rand() isn't seeded per thread
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+    int RandomPage(int pageCount);
+    void Record(StressOp op, Timer& t, bool ok);
+    void StressEngine(BaseEngine *engine);
+
+  public:
+    StressOpStats stats[StressOp_Count];
+    int loadFailed;
+
+    ConcurrentStressWorker(ConcurrentStressJob *job, int threadNo)
+        : ThreadBase("ConcurrentStressWorker"), job(job), loadFailed(0) {
+        seed = (uint32_t)GetTickCount() ^ (uint32_t)(threadNo + 1) * 2654435761u;
+        if (!seed)
+            seed = 1;
+        ZeroMemory(stats, sizeof(stats));
+    }
+    virtual ~ConcurrentStressWorker() {}
+    virtual void Run() override;
+};
+
+// picks a random page from the -stress-test page ranges (if any)
+int ConcurrentStressWorker::RandomPage(int pageCount)
+{
+    for (int tries = 0; tries < 16; tries++) {
+        int pageNo = 1 + (int)(Random() % pageCount);
+        if (0 == job->ranges.Count() || IsInRange(job->ranges, pageNo))
+            return pageNo;
+    }
+    return 1;
+}
+
+void ConcurrentStressWorker::Record(StressOp op, Timer& t, bool ok)
+{
+    double timeMs = t.Stop();
+    StressOpStats& s = stats[op];
+    s.count++;
+    if (!ok)
+        s.failed++;
+    s.totalMs += timeMs;
+    s.maxMs = std::max(s.maxMs, timeMs);
+    int bucket = 0;
+    for (double limit = 1; timeMs >= limit && bucket < STRESS_HISTOGRAM_BUCKETS - 1; limit *= 2) {
+        bucket++;
+    }
+    s.histogram[bucket]++;
+}
+
+void ConcurrentStressWorker::StressEngine(BaseEngine *engine)
+{
+    int pageCount = engine->PageCount();
+    if (pageCount <= 0)
+        return;
+    int opCount = limitValue(pageCount * 2, 8, 200);
+    for (int n = 0; n < opCount && !WasCancelRequested(); n++) {
+        int pageNo = RandomPage(pageCount);
+        StressOp op = (StressOp)(Random() % StressOp_Count);
+        Timer t;
+        if (StressOp_Render == op) {
+            // zoom levels between 25% and 200%
+            float zoom = (25 + Random() % 176) / 100.f;
+            int rotation = (Random() % 4) * 90;
+            RenderedBitmap *bmp = engine->RenderBitmap(pageNo, zoom, rotation);
+            Record(op, t, bmp != nullptr);
+            delete bmp;
+        }
+        else if (StressOp_Text == op) {
+            RectI *coords = nullptr;
+            WCHAR *text = engine->ExtractPageText(pageNo, L"\n", &coords);
+            Record(op, t, text != nullptr);
+            free(text);
+            free(coords);
+        }
+        else if (StressOp_Elements == op) {
+            Vec<PageElement *> *els = engine->GetElements(pageNo);
+            Record(op, t, true);
+            if (els)
+                DeleteVecMembers(*els);
+            delete els;
+        }
+        else {
+            // render a page with the clone, so that it's used concurrently with the original
+            BaseEngine *clone = engine->Clone();
+            RenderedBitmap *bmp = clone ? clone->RenderBitmap(pageNo, 1.0f, 0) : nullptr;
+            Record(op, t, bmp != nullptr);
+            delete bmp;
+            delete clone;
+        }
+    }
+}
+
+void ConcurrentStressWorker::Run()
+{
+    while (!WasCancelRequested()) {
+        const WCHAR *filePath;
+        {
+            ScopedCritSec scope(&job->access);
+            if (job->nextFile >= job->files.Count() * job->cycles)
+                break;
+            filePath = job->files.At(job->nextFile++ % job->files.Count());
+        }
+        BaseEngine *engine = EngineManager::CreateEngine(filePath, nullptr, nullptr, false);
+        if (!engine) {
+            loadFailed++;
+            continue;
+        }
+        StressEngine(engine);
+        delete engine;
+    }
+}
+
+// returns 0 if all calls succeeded
+int RunConcurrentStressTest(CommandLineInfo& i)
+{
+    ConcurrentStressJob job;
+    if (file::Exists(i.stressTestPath))
+        job.files.Append(str::Dup(i.stressTestPath));
+    else if (dir::Exists(i.stressTestPath))
+        GetAllMatchingFiles(i.stressTestPath, i.stressTestFilter, job.files, false);
+    if (0 == job.files.Count()) {
+        wprintf(L"Didn't find any files to test in %s\n", i.stressTestPath.Get());
+        return 1;
+    }
+    if (i.stressRandomizeFiles)
+        RandomizeFiles(job.files, 100);
+    ParsePageRanges(i.stressTestRanges, job.ranges);
+    job.cycles = std::max(i.stressTestCycles, 1);
+
+    int threadCount = limitValue(i.stressThreadCount, 1, MAX_STRESS_THREADS);
+    wprintf(L"Stress testing %d files on %d threads\n", (int)job.files.Count(), threadCount);
+    fflush(stdout);
+
+    Timer total;
+    ConcurrentStressWorker *workers[MAX_STRESS_THREADS];
+    for (int n = 0; n < threadCount; n++) {
+        workers[n] = new ConcurrentStressWorker(&job, n);
+        workers[n]->Start();
+    }
+    StressOpStats stats[StressOp_Count];
+    ZeroMemory(stats, sizeof(stats));
+    int loadFailed = 0;
+    for (int n = 0; n < threadCount; n++) {
+        workers[n]->Join(INFINITE);
+        loadFailed += workers[n]->loadFailed;
+        for (int op = 0; op < StressOp_Count; op++) {
+            StressOpStats& src = workers[n]->stats[op];
+            stats[op].count += src.count;
+            stats[op].failed += src.failed;
+            stats[op].totalMs += src.totalMs;
+            stats[op].maxMs = std::max(stats[op].maxMs, src.maxMs);
+            for (int b = 0; b < STRESS_HISTOGRAM_BUCKETS; b++) {
+                stats[op].histogram[b] += src.histogram[b];
+            }
+        }
+        delete workers[n];
+    }
+    double totalMs = total.Stop();
+
+    int failed = loadFailed;
+    wprintf(L"Finished in %.2f ms (%d files failed to load)\n", totalMs, loadFailed);
+    for (int op = 0; op < StressOp_Count; op++) {
+        StressOpStats& s = stats[op];
+        failed += s.failed;
+        if (0 == s.count)
+            continue;
+        wprintf(L"%-8s %6d calls (%d failed), %.1f calls/s, avg %.2f ms, max %.2f ms\n", gStressOpNames[op],
+                s.count, s.failed, s.count * 1000 / totalMs, s.totalMs / s.count, s.maxMs);
+        for (int b = 0; b < STRESS_HISTOGRAM_BUCKETS; b++) {
+            if (0 == s.histogram[b])
+                continue;
+            if (b < STRESS_HISTOGRAM_BUCKETS - 1)
+                wprintf(L"    < %5d ms: %d\n", 1 << b, s.histogram[b]);
+            else
+                wprintf(L"   >= %5d ms: %d\n", 1 << (b - 1), s.histogram[b]);
+        }
+    }
+    fflush(stdout);
+    return failed > 0 ? 1 : 0;
+}
+
 void StartStressTest(CommandLineInfo *i, WindowInfo *win)
 {
     gIsStressTesting = true;
@@ -1,16 +1,37 @@
 /* Copyright 2015 the SumatraPDF project authors (see AUTHORS file).
    License: GPLv3 */
 
+class BaseEngine;
+class CommandLineInfo;
+class WindowInfo;
+
+// timings for a single page as measured by -bench
+// (and the performance regression tests)
+struct BenchPageTimes {
+    int pageNo;
+    double loadMs;
+    double renderMs;
+    double textMs;
+};
+
 bool IsValidPageRange(const WCHAR *ranges);
 bool IsBenchPagesInfo(const WCHAR *s);
-void BenchFileOrDir(WStrVec& pathsToBench);
+void BenchFileOrDir(CommandLineInfo& info);
 bool IsStressTesting();
 void BenchEbookLayout(WCHAR *filePath);
+bool BenchLoadRender(BaseEngine *engine, int pageNo, float zoom, BenchPageTimes *times);
+double BenchEbookLayoutTime(const WCHAR *filePath);
 
-class CommandLineInfo;
-class WindowInfo;
+void RecordStartupPhase(const char *name);
+void OnStartupPaint(bool isDocument);
+void StartBenchStartup();
+bool IsBenchingStartup();
+
+int RenderBatch(CommandLineInfo& i);
+int RunRenderServer(CommandLineInfo& i);
 
 void StartStressTest(CommandLineInfo *i, WindowInfo *win);
+int RunConcurrentStressTest(CommandLineInfo& i);
 
 void OnStressTestTimer(WindowInfo *win, int timerId);
 void FinishStressTest(WindowInfo *win);
@@ -5,9 +5,12 @@
 #include "BaseUtil.h"
 #include "Dpi.h"
 #include "FileUtil.h"
+#include "ThreadUtil.h"
+#include "UITask.h"
 #include "WinUtil.h"
 // layout controllers
 #include "BaseEngine.h"
+#include "EngineManager.h"
 #include "SettingsStructs.h"
 #include "FileHistory.h"
 #include "GlobalPrefs.h"
@@ -612,6 +615,95 @@ void DrawAboutPage(WindowInfo& win, HDC hdc)
 #define DOCLIST_MAX_THUMBNAILS_X    5
 #define DOCLIST_BOTTOM_BOX_DY       DpiScaleY(win.hwndFrame, 50)
 
+// paths of documents for which a thumbnail has already been requested
+static WStrVec gThumbnailRequests;
+
+// renders the first page of a document which is opened without any UI
+// (so that documents which require a password are skipped)
+static RenderedBitmap *RenderThumbnailForFile(const WCHAR *filePath)
+{
+    // don't wake up network or removable drives for a thumbnail
+    if (!path::IsOnFixedDrive(filePath) || !file::Exists(filePath))
+        return nullptr;
+    BaseEngine *engine = EngineManager::CreateEngine(filePath, nullptr, nullptr, false, false);
+    if (!engine)
+        return nullptr;
+
+    RenderedBitmap *bmp = nullptr;
+    RectD pageRect = engine->Transform(engine->PageMediabox(1), 1, 1.0f, 0);
+    if (!pageRect.IsEmpty()) {
+        float zoom = THUMBNAIL_DX / (float)pageRect.dx;
+        if (pageRect.dy > THUMBNAIL_DY / zoom)
+            pageRect.dy = THUMBNAIL_DY / zoom;
+        pageRect = engine->Transform(pageRect, 1, 1.0f, 0, true);
+        bmp = engine->RenderBitmap(1, zoom, 0, &pageRect);
+    }
+    delete engine;
+    return bmp;
+}
+
+static void SetLoadedThumbnail(WCHAR *filePath, RenderedBitmap *bmp, bool created)
+{
+    DisplayState *ds = gFileHistory.Find(filePath);
+    // the document might have been opened (or removed from history) in the meantime
+    if (!ds || ds->thumbnail || !bmp || bmp->Size().IsEmpty()) {
+        delete bmp;
+    } else if (created) {
+        SetThumbnail(ds, bmp);
+    } else {
+        ds->thumbnail = bmp;
+    }
+    if (ds && ds->thumbnail) {
+        for (WindowInfo *win : gWindows) {
+            if (win->IsAboutWindow())
+                win->RedrawAll(true);
+        }
+    }
+    free(filePath);
+}
+
+// loads cached thumbnails (or creates missing ones) on a background thread,
+// so that painting the start page never has to wait for the disk or rendering
+static void LoadThumbnailsAsync(Vec<DisplayState *>& states)
+{
+    Vec<WCHAR *> *paths = new Vec<WCHAR *>();
+    for (DisplayState *state : states) {
+        if (gThumbnailRequests.Contains(state->filePath))
+            continue;
+        gThumbnailRequests.Append(str::Dup(state->filePath));
+        paths->Append(str::Dup(state->filePath));
+    }
+    if (paths->Count() == 0) {
+        delete paths;
+        return;
+    }
+
+    bool mayCreate = HasPermission(Perm_SavePreferences | Perm_DiskAccess);
+    RunAsync([=] {
+        SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+        // first load all cached thumbnails, then render the missing ones
+        Vec<RenderedBitmap *> bitmaps;
+        LoadThumbnails(*paths, bitmaps);
+        Vec<WCHAR *> missing;
+        for (size_t i = 0; i < paths->Count(); i++) {
+            WCHAR *filePath = paths->At(i);
+            RenderedBitmap *bmp = bitmaps.At(i);
+            if (bmp)
+                uitask::Post([=] { SetLoadedThumbnail(filePath, bmp, false); });
+            else if (mayCreate)
+                missing.Append(filePath);
+            else
+                free(filePath);
+        }
+        for (size_t i = 0; i < missing.Count(); i++) {
+            WCHAR *filePath = missing.At(i);
+            RenderedBitmap *bmp = RenderThumbnailForFile(filePath);
+            uitask::Post([=] { SetLoadedThumbnail(filePath, bmp, true); });
+        }
+        delete paths;
+    });
+}
+
 void DrawStartPage(WindowInfo& win, HDC hdc, FileHistory& fileHistory, COLORREF textColor, COLORREF backgroundColor)
 {
     ScopedPen penBorder(CreatePen(PS_SOLID, DOCLIST_SEPARATOR_DY, WIN_COL_BLACK));
@@ -676,6 +768,7 @@ void DrawStartPage(WindowInfo& win, HDC hdc, FileHistory& fileHistory, COLORREF
     SelectObject(hdc, GetStockBrush(NULL_BRUSH));
 
     win.staticLinks.Reset();
+    Vec<DisplayState *> pendingThumbnails;
     for (int h = 0; h < height; h++) {
         for (int w = 0; w < width; w++) {
             if (h * width + w >= (int)list.Count()) {
@@ -690,10 +783,10 @@ void DrawStartPage(WindowInfo& win, HDC hdc, FileHistory& fileHistory, COLORREF
                        THUMBNAIL_DX, THUMBNAIL_DY);
             if (isRtl)
                 page.x = rc.dx - page.x - page.dx;
-            bool loadOk = true;
+            // until the thumbnail is available, only its frame is drawn
             if (!state->thumbnail)
-                loadOk = LoadThumbnail(*state);
-            if (loadOk && state->thumbnail) {
+                pendingThumbnails.Append(state);
+            if (state->thumbnail) {
                 SizeI thumbSize = state->thumbnail->Size();
                 if (thumbSize.dx != THUMBNAIL_DX || thumbSize.dy != THUMBNAIL_DY) {
                     page.dy = thumbSize.dy * THUMBNAIL_DX / thumbSize.dx;
@@ -731,6 +824,7 @@ void DrawStartPage(WindowInfo& win, HDC hdc, FileHistory& fileHistory, COLORREF
             win.staticLinks.Append(StaticLinkInfo(rect.Union(page), state->filePath, state->filePath));
         }
     }
+    LoadThumbnailsAsync(pendingThumbnails);
 
     /* render bottom links */
     rc.y += DOCLIST_MARGIN_TOP + height * THUMBNAIL_DY + (height - 1) * DOCLIST_MARGIN_BETWEEN_Y + DOCLIST_MARGIN_BOTTOM;
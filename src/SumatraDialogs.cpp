@@ -5,9 +5,14 @@
 #include "BaseUtil.h"
 #include "DialogSizer.h"
 #include "WinUtil.h"
+// rendering engines
+#include "BaseEngine.h"
 // layout controllers
 #include "SettingsStructs.h"
+#include "Controller.h"
+#include "DisplayModel.h"
 #include "GlobalPrefs.h"
+#include "RenderCache.h"
 // ui
 #include "SumatraPDF.h"
 #include "resource.h"
@@ -893,6 +898,22 @@ static INT_PTR CALLBACK Sheet_Print_Advanced_Proc(HWND hDlg, UINT msg, WPARAM wP
         }
         break;
 
+    case WM_DRAWITEM:
+        if (IDC_PRINT_PREVIEW == wParam) {
+            DRAWITEMSTRUCT *dis = (DRAWITEMSTRUCT *)lParam;
+            data = (Print_Advanced_Data *)GetWindowLongPtr(hDlg, GWLP_USERDATA);
+            RectI rc = RectI::FromRECT(dis->rcItem);
+            FillRect(dis->hDC, &dis->rcItem, GetSysColorBrush(COLOR_BTNFACE));
+            // only show what has already been rendered for the view
+            // instead of rendering anything at print resolution
+            if (!data || !data->previewDm ||
+                !gRenderCache.PaintPreview(dis->hDC, rc, data->previewDm, data->previewPageNo)) {
+                DrawEdge(dis->hDC, &dis->rcItem, EDGE_SUNKEN, BF_RECT);
+            }
+            return TRUE;
+        }
+        break;
+
     case WM_COMMAND:
         switch (LOWORD(wParam)) {
         case IDC_PRINT_RANGE_ALL: case IDC_PRINT_RANGE_EVEN:
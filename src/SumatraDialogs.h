@@ -2,6 +2,7 @@
    License: GPLv3 */
 
 struct GlobalPrefs;
+class DisplayModel;
 
 WCHAR *   Dialog_GoToPage(HWND hwnd, const WCHAR *currentPageLabel, int pageCount, bool onlyNumeric=true);
 WCHAR *   Dialog_Find(HWND hwnd, const WCHAR *previousSearch, bool *matchCase);
@@ -19,10 +20,13 @@ enum PrintScaleAdv { PrintScaleNone = 0, PrintScaleShrink, PrintScaleFit };
 struct Print_Advanced_Data {
     PrintRangeAdv range;
     PrintScaleAdv scale;
+    // the page shown as preview (painted from cached bitmaps only)
+    DisplayModel *previewDm;
+    int previewPageNo;
 
     explicit Print_Advanced_Data(PrintRangeAdv range=PrintRangeAll,
                         PrintScaleAdv scale=PrintScaleShrink) :
-        range(range), scale(scale) { }
+        range(range), scale(scale), previewDm(nullptr), previewPageNo(0) { }
 };
 
 HPROPSHEETPAGE CreatePrintAdvancedPropSheet(Print_Advanced_Data *data, ScopedMem<DLGTEMPLATE>& dlgTemplate);
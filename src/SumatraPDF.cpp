@@ -8,6 +8,7 @@
 #include "CryptoUtil.h"
 #include "DirIter.h"
 #include "Dpi.h"
+#include "EtwTrace.h"
 #include "FileUtil.h"
 #include "FileWatcher.h"
 #include "FrameRateWnd.h"
@@ -19,6 +20,7 @@
 #include "SplitterWnd.h"
 #include "SquareTreeParser.h"
 #include "ThreadUtil.h"
+#include "Timer.h"
 #include "UITask.h"
 #include "WinUtil.h"
 // rendering engines
@@ -57,6 +59,7 @@
 #include "FileThumbnails.h"
 #include "Menu.h"
 #include "Notifications.h"
+#include "PerfStats.h"
 #include "Print.h"
 #include "Search.h"
 #include "Selection.h"
@@ -90,6 +93,8 @@ bool             gShowFrameRate = true;
 #else
 bool             gShowFrameRate = false;
 #endif
+// shows render, cache and text statistics below the frame rate
+bool             gShowPerfOverlay = false;
 
 // in plugin mode, the window's frame isn't drawn and closing and
 // fullscreen are disabled, so that SumatraPDF can be displayed
@@ -501,7 +506,6 @@ static void UpdateSidebarDisplayState(WindowInfo *win, TabInfo *tab, DisplayStat
 
     ds->showToc = tab->showToc;
     if (win->tocLoaded && tab == win->currentTab) {
-        tab->tocState.Reset();
         HTREEITEM hRoot = TreeView_GetRoot(win->hwndTocTree);
         if (hRoot)
             UpdateTocExpansionState(tab, win->hwndTocTree, hRoot);
@@ -649,11 +653,14 @@ public:
     virtual ~ControllerCallbackHandler() { }
 
     virtual void Repaint() { win->RepaintAsync(); }
+    virtual void RepaintScrolled() { win->RepaintScrolledAsync(); }
     virtual void PageNoChanged(Controller *ctrl, int pageNo);
     virtual void UpdateScrollbars(SizeI canvas);
     virtual void RequestRendering(int pageNo);
+    virtual void RequestPresentationRendering(int pageNo);
     virtual void CleanUp(DisplayModel *dm);
     virtual void RenderThumbnail(DisplayModel *dm, SizeI size, const std::function<void(RenderedBitmap*)>&);
+    virtual void HandleLoadedMediaboxes(DisplayModel *dm);
     virtual void GotoLink(PageDestination *dest) { win->linkHandler->GotoLink(dest); }
     virtual void FocusFrame(bool always);
     virtual void SaveDownload(const WCHAR *url, const unsigned char *data, size_t len);
@@ -680,6 +687,16 @@ void ControllerCallbackHandler::RenderThumbnail(DisplayModel *dm, SizeI size, co
     gRenderCache.Render(dm, 1, 0, zoom, pageRect, *callback);
 }
 
+void ControllerCallbackHandler::HandleLoadedMediaboxes(DisplayModel *dm)
+{
+    uitask::Post([=]{
+        // background tabs are updated in LoadModelIntoTab
+        WindowInfo *win = FindWindowInfoByController(dm);
+        if (win && win->ctrl == dm)
+            dm->UpdatePageMediaboxes();
+    });
+}
+
 static void CreateThumbnailForFile(WindowInfo& win, DisplayState& ds)
 {
     if (!ShouldSaveThumbnail(ds))
@@ -720,8 +737,45 @@ void ControllerCallbackHandler::RequestRendering(int pageNo)
         gRenderCache.RequestRendering(dm, pageNo);
 }
 
+void ControllerCallbackHandler::RequestPresentationRendering(int pageNo)
+{
+    CrashIf(!win->AsFixed());
+    if (!win->AsFixed()) return;
+
+    gRenderCache.KeepPresentationPages(win->AsFixed(), pageNo);
+}
+
+void PrefetchDestinationPage(WindowInfo *win, int pageNo)
+{
+    DisplayModel *dm = win->AsFixed();
+    if (!dm)
+        return;
+    if (pageNo > 0 && !win->presentation)
+        gRenderCache.PrefetchPage(dm, pageNo);
+    else
+        gRenderCache.CancelPrefetch(dm);
+}
+
+static int GetScreenDpi(WindowInfo *win)
+{
+    if (gGlobalPrefs->customScreenDPI > 0)
+        return gGlobalPrefs->customScreenDPI;
+    return DpiGetPreciseX(win->hwndFrame);
+}
+
+// called once the DPI has settled after the window has been moved to a monitor
+// with a different DPI (background tabs are updated when they're selected)
+void UpdateScreenDpi(WindowInfo *win)
+{
+    DpiUpdate(win->hwndFrame);
+    if (win->AsFixed())
+        win->AsFixed()->SetScreenDpi(GetScreenDpi(win));
+}
+
 void ControllerCallbackHandler::CleanUp(DisplayModel *dm)
 {
+    CancelDocumentSearch(dm);
+    CancelCopyingText(dm);
     gRenderCache.CancelRendering(dm);
     gRenderCache.FreeForDisplayModel(dm);
 }
@@ -837,22 +891,62 @@ void ControllerCallbackHandler::PageNoChanged(Controller *ctrl, int pageNo)
     }
 }
 
-static Controller *CreateControllerForFile(const WCHAR *filePath, PasswordUI *pwdUI, WindowInfo *win)
+// documents larger than this are likely to take a noticeable time to load
+#define SLOW_TO_LOAD_FILE_SIZE  (32 * 1024 * 1024)
+
+static bool IsSlowToLoad(const WCHAR *filePath)
+{
+    if (!file::Exists(filePath))
+        return false;
+    return !path::IsOnFixedDrive(filePath) || file::GetSize(filePath) > SLOW_TO_LOAD_FILE_SIZE;
+}
+
+// returns a view of the PDF document filePath in any window which
+// hasn't been modified since it's been loaded (or nullptr)
+static DisplayModel *FindUnmodifiedPdfDocument(const WCHAR *filePath)
+{
+    for (WindowInfo *win : gWindows) {
+        for (TabInfo *tab : win->tabs) {
+            DisplayModel *dm = tab->AsFixed();
+            if (dm && Engine_PDF == dm->engineType && !dm->userAnnotsModified &&
+                !tab->reloadOnFocus && str::Eq(dm->FilePath(), filePath)) {
+                return dm;
+            }
+        }
+    }
+    return nullptr;
+}
+
+static Controller *CreateControllerForFile(const WCHAR *filePath, PasswordUI *pwdUI, WindowInfo *win, bool isReload=false)
 {
     if (!win->cbHandler)
         win->cbHandler = new ControllerCallbackHandler(win);
 
     Controller *ctrl = nullptr;
-
-    EngineType engineType;
-    BaseEngine *engine = EngineManager::CreateEngine(filePath, pwdUI, &engineType,
-                                                     gGlobalPrefs->chmUI.useFixedPageUI,
-                                                     gGlobalPrefs->ebookUI.useFixedPageUI);
+    etw::Span span("LoadDocument", etw::KeywordIO, -1,
+                   etw::IsEnabled(etw::KeywordIO) ? file::GetSize(filePath) : 0, filePath);
+
+    // a document opened a second time is loaded as a clone of the first
+    // engine, so that both share display lists, decoded images and (through
+    // DisplayModel::documentId) rendered bitmaps (and no password is asked for)
+    DisplayModel *sameDoc = isReload ? nullptr : FindUnmodifiedPdfDocument(filePath);
+    EngineType engineType = Engine_None;
+    BaseEngine *engine = sameDoc ? sameDoc->GetEngine()->Clone() : nullptr;
+    if (engine)
+        engineType = sameDoc->engineType;
+    else {
+        sameDoc = nullptr;
+        engine = EngineManager::CreateEngine(filePath, pwdUI, &engineType,
+                                             gGlobalPrefs->chmUI.useFixedPageUI,
+                                             gGlobalPrefs->ebookUI.useFixedPageUI);
+    }
 
     if (engine) {
 LoadEngineInFixedPageUI:
         ctrl = new DisplayModel(engine, engineType, win->cbHandler);
         CrashIf(!ctrl || !ctrl->AsFixed() || ctrl->AsChm() || ctrl->AsEbook());
+        if (sameDoc)
+            ctrl->AsFixed()->ShareDocumentWith(sameDoc);
     }
     else if (ChmModel::IsSupportedFile(filePath) && !gGlobalPrefs->chmUI.useFixedPageUI) {
         ChmModel *chmModel = ChmModel::Create(filePath, win->cbHandler);
@@ -943,6 +1037,44 @@ static void UpdateUiForCurrentTab(WindowInfo *win)
     ToggleWindowStyle(win->hwndPageBox, ES_NUMBER, onlyNumbers);
 }
 
+// returns the number of the identical page in prevEngine for each of engine's pages
+// (or 0 if a page has changed), or nullptr if pages can't be compared at all
+static int *FindUnchangedPages(BaseEngine *prevEngine, BaseEngine *engine)
+{
+    int prevCount = prevEngine->PageCount();
+    ScopedMem<unsigned char> prevDigests(AllocArray<unsigned char>(16 * prevCount));
+    ScopedMem<bool> hasPrevDigest(AllocArray<bool>(prevCount));
+    if (!prevDigests || !hasPrevDigest)
+        return nullptr;
+    bool anyPrevDigest = false;
+    for (int n = 1; n <= prevCount; n++) {
+        hasPrevDigest[n - 1] = prevEngine->GetPageFingerprint(n, prevDigests + 16 * (n - 1));
+        anyPrevDigest = anyPrevDigest || hasPrevDigest[n - 1];
+    }
+    if (!anyPrevDigest)
+        return nullptr;
+
+    int count = engine->PageCount();
+    int *prevPageNos = AllocArray<int>(count);
+    if (!prevPageNos)
+        return nullptr;
+    for (int n = 1; n <= count; n++) {
+        unsigned char digest[16];
+        if (!engine->GetPageFingerprint(n, digest))
+            continue;
+        // usually, pages keep their number (else they've most likely been shifted)
+        if (n <= prevCount && hasPrevDigest[n - 1] && memeq(digest, prevDigests + 16 * (n - 1), 16)) {
+            prevPageNos[n - 1] = n;
+            continue;
+        }
+        for (int prevNo = 1; prevNo <= prevCount && !prevPageNos[n - 1]; prevNo++) {
+            if (hasPrevDigest[prevNo - 1] && memeq(digest, prevDigests + 16 * (prevNo - 1), 16))
+                prevPageNos[n - 1] = prevNo;
+        }
+    }
+    return prevPageNos;
+}
+
 // meaning of the internal values of LoadArgs:
 // isNewWindow : if true then 'win' refers to a newly created window that needs
 //   to be resized and placed
@@ -1014,19 +1146,29 @@ static void LoadDocIntoCurrentTab(LoadArgs& args, Controller *ctrl, DisplayState
     if (win->ctrl) {
         if (win->AsFixed()) {
             DisplayModel *dm = win->AsFixed();
-            int dpi = gGlobalPrefs->customScreenDPI > 0 ? dpi = gGlobalPrefs->customScreenDPI : DpiGetPreciseX(win->hwndFrame);
-            dm->SetInitialViewSettings(displayMode, ss.page, win->GetViewPortSize(), dpi);
+            dm->SetInitialViewSettings(displayMode, ss.page, win->GetViewPortSize(), GetScreenDpi(win));
             // TODO: also expose Manga Mode for image folders?
             if (tab->GetEngineType() == Engine_ComicBook || tab->GetEngineType() == Engine_ImageDir)
                 dm->SetDisplayR2L(state ? state->displayR2L : gGlobalPrefs->comicBookUI.cbxMangaMode);
-            if (prevCtrl && prevCtrl->AsFixed() && str::Eq(win->ctrl->FilePath(), prevCtrl->FilePath())) {
-                gRenderCache.KeepForDisplayModel(prevCtrl->AsFixed(), dm);
-                dm->CopyNavHistory(*prevCtrl->AsFixed());
-            }
             // reload user annotations
             dm->userAnnots = LoadFileModifications(args.fileName);
             dm->userAnnotsModified = false;
             dm->GetEngine()->UpdateUserAnnotations(dm->userAnnots);
+            if (prevCtrl && prevCtrl->AsFixed() && str::Eq(win->ctrl->FilePath(), prevCtrl->FilePath())) {
+                DisplayModel *prevDm = prevCtrl->AsFixed();
+                // only pages that have actually changed have to be rendered and extracted again
+                ScopedMem<int> prevPageNos(FindUnchangedPages(prevDm->GetEngine(), dm->GetEngine()));
+                gRenderCache.KeepForDisplayModel(prevDm, dm, prevPageNos);
+                if (prevPageNos)
+                    dm->textCache->CopyUnchangedPages(prevDm->textCache, prevPageNos);
+                dm->CopyNavHistory(*prevDm);
+            }
+            // make searching and selecting text instant once the document has been open for a while
+            // (or right away, if a text index has been saved when the document was last opened)
+            ScopedMem<WCHAR> indexPath;
+            if (HasPermission(Perm_SavePreferences | Perm_DiskAccess) && gGlobalPrefs->rememberOpenedFiles)
+                indexPath.Set(GetTextIndexPath(dm->FilePath()));
+            dm->textCache->StartPrefetching(ss.page, indexPath);
             // tell UI Automation about content change
             if (win->uia_provider)
                 win->uia_provider->OnDocumentLoad(dm);
@@ -1036,6 +1178,11 @@ static void LoadDocIntoCurrentTab(LoadArgs& args, Controller *ctrl, DisplayState
             win->ctrl->SetDisplayMode(displayMode);
             ss.page = limitValue(ss.page, 1, win->ctrl->PageCount());
             win->ctrl->GoToPage(ss.page, false);
+            // allow searching all topics at once (cf. OnMenuFindInDocuments)
+            if (HasPermission(Perm_SavePreferences | Perm_DiskAccess) && gGlobalPrefs->rememberOpenedFiles) {
+                ScopedMem<WCHAR> indexPath(GetTextIndexPath(win->ctrl->FilePath()));
+                win->AsChm()->StartIndexing(indexPath);
+            }
         }
         else if (win->AsEbook()) {
             if (prevCtrl && prevCtrl->AsEbook() && str::Eq(win->ctrl->FilePath(), prevCtrl->FilePath()))
@@ -1083,6 +1230,10 @@ static void LoadDocIntoCurrentTab(LoadArgs& args, Controller *ctrl, DisplayState
     if (win->AsEbook()) {
         // start ebook UI layout after UpdateUiForCurrentTab
         // (prevents the need for an instant re-layout)
+        if (HasPermission(Perm_SavePreferences | Perm_DiskAccess) && gGlobalPrefs->rememberOpenedFiles) {
+            ScopedMem<WCHAR> layoutPath(GetEbookLayoutPath(win->ctrl->FilePath()));
+            win->AsEbook()->SetLayoutCachePath(layoutPath);
+        }
         win->AsEbook()->StartLayouting(state ? state->reparseIdx : 0, displayMode);
     }
 
@@ -1138,6 +1289,7 @@ static void LoadDocIntoCurrentTab(LoadArgs& args, Controller *ctrl, DisplayState
 
 void ReloadDocument(WindowInfo *win, bool autorefresh)
 {
+    ScopedHangOperation hangOp("ReloadDocument");
     TabInfo *tab = win->currentTab;
     if (!win->IsDocLoaded()) {
         if (!autorefresh && tab) {
@@ -1149,7 +1301,7 @@ void ReloadDocument(WindowInfo *win, bool autorefresh)
     }
 
     HwndPasswordUI pwdUI(win->hwndFrame);
-    Controller *ctrl = CreateControllerForFile(tab->filePath, &pwdUI, win);
+    Controller *ctrl = CreateControllerForFile(tab->filePath, &pwdUI, win, true);
     // We don't allow PDF-repair if it is an autorefresh because
     // a refresh event can occur before the file is finished being written,
     // in which case the repair could fail. Instead, if the file is broken,
@@ -1322,6 +1474,7 @@ WindowInfo *CreateAndShowWindowInfo(SessionData *data)
     if (!win)
         return nullptr;
     CrashIf(windowState != gGlobalPrefs->windowState);
+    RecordStartupPhase("window created");
 
     if (data) {
         windowState = data->windowState;
@@ -1379,11 +1532,12 @@ static void RenameFileInHistory(const WCHAR *oldPath, const WCHAR *newPath)
     }
     ds = gFileHistory.Find(oldPath);
     if (ds) {
-        str::ReplacePtr(&ds->filePath, newPath);
+        gFileHistory.UpdateFilePath(ds, newPath);
         // merge Frequently Read data, so that a file
         // doesn't accidentally vanish from there
         ds->isPinned = ds->isPinned || oldIsPinned;
         ds->openCount += oldOpenCount;
+        gFileHistory.InvalidateFrequencyOrder();
         // the thumbnail is recreated by LoadDocument
         delete ds->thumbnail;
         ds->thumbnail = nullptr;
@@ -1513,13 +1667,32 @@ WindowInfo* LoadDocument(LoadArgs& args)
         }
     }
 
+    // parsing large documents or documents on network or removable drives
+    // can take a while, so let the user know that something is happening
+    bool showProgress = IsWindowVisible(win->hwndFrame) && IsSlowToLoad(fullPath);
+    if (showProgress) {
+        ScopedMem<WCHAR> msg(str::Format(_TR("Loading %s ..."), path::GetBaseName(fullPath)));
+        win->ShowNotification(msg, NOS_PERSIST, NG_LOAD_PROGRESS);
+        win->RedrawAll(true);
+    }
+
     HwndPasswordUI pwdUI(win->hwndFrame);
+    ScopedHangOperation hangOp("LoadDocument");
+    Timer loadTimer;
     Controller *ctrl = CreateControllerForFile(fullPath, &pwdUI, win);
     // don't fail if a user tries to load an SMX file instead
     if (!ctrl && IsModificationsFile(fullPath)) {
         *(WCHAR *)path::GetExt(fullPath) = '\0';
         ctrl = CreateControllerForFile(fullPath, &pwdUI, win);
     }
+    if (showProgress)
+        win->notifications->RemoveForGroup(NG_LOAD_PROGRESS);
+    RecordStartupPhase("document loaded");
+    if (ctrl) {
+        EngineType engineType = ctrl->AsFixed() ? ctrl->AsFixed()->engineType :
+                                ctrl->AsEbook() ? ctrl->AsEbook()->GetEngineType() : Engine_Chm;
+        perfstats::Record(PerfStat_LoadTime, engineType, loadTimer.GetTimeInMs());
+    }
 
     CrashIf(openNewTab && args.forceReuse);
     if (win->IsAboutWindow()) {
@@ -1547,6 +1720,7 @@ WindowInfo* LoadDocument(LoadArgs& args)
     // TODO: stop remembering/restoring window positions when using tabs?
     args.placeWindow = !gGlobalPrefs->useTabs;
     LoadDocIntoCurrentTab(args, ctrl);
+    win->currentTab->loadTimeMs = loadTimer.GetTimeInMs();
 
     if (gPluginMode) {
         // hide the menu for embedded documents opened from the plugin
@@ -1556,14 +1730,14 @@ WindowInfo* LoadDocument(LoadArgs& args)
 
     if (!ctrl) {
         if (gFileHistory.MarkFileInexistent(fullPath))
-            prefs::Save();
+            prefs::SaveDelayed();
         return win;
     }
 
     CrashIf(win->currentTab->watcher);
     if (gGlobalPrefs->reloadModifiedDocuments) {
         TabReloadHandler *observer = new TabReloadHandler(win->currentTab);
-        win->currentTab->watcher = FileWatcherSubscribe(win->currentTab->filePath, observer);
+        win->currentTab->watcher = FileWatcherSubscribe(win->currentTab->filePath, observer, gGlobalPrefs->reloadDelay);
     }
 
     if (gGlobalPrefs->rememberOpenedFiles) {
@@ -1571,7 +1745,7 @@ WindowInfo* LoadDocument(LoadArgs& args)
         DisplayState *ds = gFileHistory.MarkFileLoaded(fullPath);
         if (gGlobalPrefs->showStartPage)
             CreateThumbnailForFile(*win, *ds);
-        prefs::Save();
+        prefs::SaveDelayed();
     }
 
     // Add the file also to Windows' recently used documents (this doesn't
@@ -1582,6 +1756,48 @@ WindowInfo* LoadDocument(LoadArgs& args)
     return win;
 }
 
+// restores the view settings saved for a tab in a session
+void ApplyTabState(WindowInfo *win, TabState *state)
+{
+    TabInfo *tab = win->currentTab;
+    if (!tab || !tab->ctrl)
+        return;
+
+    tab->tocState = *state->tocState;
+    SetSidebarVisibility(win, state->showToc, gGlobalPrefs->showFavorites);
+
+    DisplayMode displayMode = prefs::conv::ToDisplayMode(state->displayMode, DM_AUTOMATIC);
+    if (displayMode != DM_AUTOMATIC)
+        SwitchToDisplayMode(win, displayMode);
+    // TODO: make EbookController::GoToPage not crash
+    if (!tab->AsEbook())
+        tab->ctrl->GoToPage(state->pageNo, true);
+    float zoom = prefs::conv::ToZoom(state->zoom, INVALID_ZOOM);
+    if (zoom != INVALID_ZOOM) {
+        if (tab->AsFixed())
+            tab->AsFixed()->Relayout(zoom, state->rotation);
+        else
+            tab->ctrl->SetZoomVirtual(zoom);
+    }
+    if (tab->AsFixed())
+        tab->AsFixed()->SetScrollState(ScrollState(state->pageNo, state->scrollPos.x, state->scrollPos.y));
+}
+
+// loads the document of a tab restored from a session when it's first selected
+static void LoadPendingTab(WindowInfo *win, TabInfo *tab)
+{
+    CrashIf(win->currentTab != tab || tab->ctrl);
+    TabState *state = tab->pendingState;
+    tab->pendingState = nullptr;
+    tab->canvasRc = win->canvasRc;
+
+    LoadArgs args(state->filePath, win);
+    args.forceReuse = true;
+    if (LoadDocument(args) && win->currentTab == tab)
+        ApplyTabState(win, state);
+    DeleteTabState(state);
+}
+
 // Loads document data into the WindowInfo.
 void LoadModelIntoTab(WindowInfo *win, TabInfo *tdata)
 {
@@ -1592,6 +1808,11 @@ void LoadModelIntoTab(WindowInfo *win, TabInfo *tdata)
     win->currentTab = tdata;
     win->ctrl = tdata->ctrl;
 
+    if (tdata->pendingState) {
+        LoadPendingTab(win, tdata);
+        return;
+    }
+
     if (win->AsChm())
         win->AsChm()->SetParentHwnd(win->hwndCanvas);
     // prevent the ebook UI from redrawing before win->RedrawAll at the bottom
@@ -1612,6 +1833,9 @@ void LoadModelIntoTab(WindowInfo *win, TabInfo *tdata)
         if (tdata->canvasRc != win->canvasRc)
             win->ctrl->SetViewPortSize(win->GetViewPortSize());
         DisplayModel *dm = win->AsFixed();
+        dm->GetEngine()->ReleaseCaches(false);
+        dm->UpdatePageMediaboxes();
+        dm->SetScreenDpi(GetScreenDpi(win));
         dm->SetScrollState(dm->GetScrollState());
         if (dm->GetPresentationMode() != (win->presentation != PM_DISABLED))
             dm->SetPresentationMode(!dm->GetPresentationMode());
@@ -1633,6 +1857,10 @@ void LoadModelIntoTab(WindowInfo *win, TabInfo *tdata)
     SetFocus(win->hwndFrame);
     win->RedrawAll(true);
 
+    // tabs that remain in the background for a while release most of their caches
+    if (win->tabs.Count() > 1)
+        SetTimer(win->hwndCanvas, RELEASE_CACHES_TIMER_ID, RELEASE_CACHES_DELAY_IN_MS, nullptr);
+
     if (tdata->reloadOnFocus) {
         tdata->reloadOnFocus = false;
         ReloadDocument(win, true);
@@ -1736,6 +1964,10 @@ static void RememberSessionState()
             continue;
         SessionData *data = NewSessionData();
         for (TabInfo *tab : win->tabs) {
+            if (tab->pendingState) {
+                data->tabStates->Append(CopyTabState(tab->pendingState));
+                continue;
+            }
             DisplayState *ds = NewDisplayState(tab->filePath);
             if (tab->ctrl)
                 tab->ctrl->UpdateDisplayState(ds);
@@ -2220,7 +2452,10 @@ void CloseWindow(WindowInfo *win, bool quitIfLast, bool forceClose)
         // also don't remember a single document (unless quitting through Menu -> Exit)
         if (quitIfLast && gGlobalPrefs->sessionData->Count() == 0 && win->tabs.Count() > 1)
             RememberSessionState();
-        prefs::Save();
+        if (quitIfLast)
+            prefs::Save();
+        else
+            prefs::SaveDelayed();
     }
     else {
         // this happens otherwise in prefs::Save
@@ -2287,6 +2522,7 @@ static bool AppendFileFilterForDoc(Controller *ctrl, str::Str<WCHAR>& fileFilter
 
 static void OnMenuSaveAs(WindowInfo& win)
 {
+    ScopedHangOperation hangOp("SaveAs");
     if (!HasPermission(Perm_DiskAccess)) return;
     if (!win.IsDocLoaded()) return;
 
@@ -2931,6 +3167,22 @@ static void OnMenuViewShowHideToolbar()
     }
 }
 
+static void TogglePerfOverlay()
+{
+    gShowPerfOverlay = !gShowPerfOverlay;
+    gShowFrameRate = gShowPerfOverlay;
+    for (WindowInfo *win : gWindows) {
+        if (gShowPerfOverlay && !win->frameRateWnd) {
+            win->frameRateWnd = AllocFrameRateWnd(win->hwndCanvas);
+            CreateFrameRateWnd(win->frameRateWnd);
+        }
+        if (!gShowPerfOverlay)
+            ShowFrameRateInfo(win->frameRateWnd, nullptr);
+        SetFrameRateWndVisible(win->frameRateWnd, gShowPerfOverlay);
+        win->RedrawAll(true);
+    }
+}
+
 static void OnMenuAdvancedOptions()
 {
     if (!HasPermission(Perm_DiskAccess) || !HasPermission(Perm_SavePreferences))
@@ -3941,6 +4193,14 @@ static LRESULT FrameOnCommand(WindowInfo *win, HWND hwnd, UINT msg, WPARAM wPara
             OnMenuFindSel(win, FIND_BACKWARD);
             break;
 
+        case IDM_FIND_IN_TABS:
+            OnMenuFindInDocuments(win, false);
+            break;
+
+        case IDM_FIND_IN_HISTORY:
+            OnMenuFindInDocuments(win, true);
+            break;
+
         case IDM_VISIT_WEBSITE:
             LaunchBrowser(WEBSITE_MAIN_URL);
             break;
@@ -3953,6 +4213,10 @@ static LRESULT FrameOnCommand(WindowInfo *win, HWND hwnd, UINT msg, WPARAM wPara
             LaunchBrowser(WEBSITE_TRANSLATIONS_URL);
             break;
 
+        case IDM_SHOW_PERF_STATS:
+            perfstats::ShowReport();
+            break;
+
         case IDM_ABOUT:
 #ifdef ENABLE_ALTERNATIVE_ABOUT_DIALOG
             OnMenuAbout2();
@@ -4036,6 +4300,10 @@ static LRESULT FrameOnCommand(WindowInfo *win, HWND hwnd, UINT msg, WPARAM wPara
             OnSelectAll(win);
             break;
 
+        case IDM_DEBUG_PERF_OVERLAY:
+            TogglePerfOverlay();
+            break;
+
 #ifdef SHOW_DEBUG_MENU_ITEMS
         case IDM_DEBUG_SHOW_LINKS:
             gDebugShowLinks = !gDebugShowLinks;
@@ -4128,6 +4396,17 @@ LRESULT CALLBACK WndProcFrame(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
                 RememberDefaultWindowPosition(*win);
             break;
 
+        case WM_DPICHANGED:
+            if (win) {
+                // move to the suggested position first and only relayout the
+                // document once no further DPI changes are coming in
+                RECT *suggested = (RECT *)lParam;
+                SetWindowPos(hwnd, nullptr, suggested->left, suggested->top, RectDx(*suggested), RectDy(*suggested),
+                             SWP_NOZORDER | SWP_NOACTIVATE);
+                SetTimer(win->hwndCanvas, DPI_CHANGED_TIMER_ID, DPI_CHANGED_DELAY_IN_MS, nullptr);
+            }
+            return 0;
+
         case WM_INITMENUPOPUP:
             UpdateMenu(win, (HMENU)wParam);
             break;
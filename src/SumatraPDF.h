@@ -44,6 +44,18 @@
 
 #define EBOOK_LAYOUT_TIMER_ID       7
 
+#define RELEASE_CACHES_TIMER_ID     8
+#define RELEASE_CACHES_DELAY_IN_MS  (60 * 1000)
+
+#define SCROLL_ANIM_TIMER_ID        9
+#define SCROLL_ANIM_DURATION_IN_MS  150
+#define SCROLL_ANIM_FPS             60
+
+// WM_DPICHANGED arrives repeatedly while a window is dragged across
+// monitors, so the layout is only updated once the DPI has settled
+#define DPI_CHANGED_TIMER_ID        10
+#define DPI_CHANGED_DELAY_IN_MS     250
+
 // permissions that can be revoked through sumatrapdfrestrict.ini or the -restrict command line flag
 enum {
     // enables Update checks, crash report submitting and hyperlinks
@@ -99,10 +111,12 @@ class RenderCache;
 class TabInfo;
 struct LabelWithCloseWnd;
 struct SessionData;
+struct TabState;
 
 // all defined in SumatraPDF.cpp
 extern bool                     gDebugShowLinks;
 extern bool                     gShowFrameRate;
+extern bool                     gShowPerfOverlay;
 
 extern const WCHAR *            gPluginURL;
 extern Vec<WindowInfo*>         gWindows;
@@ -170,12 +184,16 @@ struct LoadArgs
 };
 
 WindowInfo* LoadDocument(LoadArgs& args);
+void ApplyTabState(WindowInfo *win, TabState *state);
 WindowInfo *CreateAndShowWindowInfo(SessionData *data=nullptr);
 
 UINT MbRtlReadingMaybe();
 void MessageBoxWarning(HWND hwnd, const WCHAR *msg, const WCHAR *title = nullptr);
 void UpdateCursorPositionHelper(WindowInfo *win, PointI pos, NotificationWnd *wnd);
 bool DocumentPathExists(const WCHAR *path);
+// renders the page a hovered link points to ahead of time (0 cancels that)
+void PrefetchDestinationPage(WindowInfo *win, int pageNo);
+void UpdateScreenDpi(WindowInfo *win);
 void EnterFullScreen(WindowInfo* win, bool presentation=false);
 void ExitFullScreen(WindowInfo* win);
 void SetCurrentLang(const char *langCode);
@@ -4,6 +4,8 @@
 // utils
 #include "BaseUtil.h"
 #include "FileUtil.h"
+#include "ThreadUtil.h"
+#include "UITask.h"
 #include "WinUtil.h"
 // rendering engines
 #include "BaseEngine.h"
@@ -46,8 +48,14 @@ public:
 
 class PropertiesLayout : public Vec<PropertyEl *> {
 public:
-    PropertiesLayout() : hwnd(nullptr), hwndParent(nullptr) { }
-    ~PropertiesLayout() { DeleteVecMembers(*this); }
+    PropertiesLayout() : hwnd(nullptr), hwndParent(nullptr), fontListToken(nullptr) { }
+    ~PropertiesLayout() {
+        if (fontListToken) {
+            fontListToken->Cancel();
+            fontListToken->Release();
+        }
+        DeleteVecMembers(*this);
+    }
 
     void AddProperty(const WCHAR *key, WCHAR *value, bool isPath=false) {
         // don't display value-less properties
@@ -66,6 +74,8 @@ public:
 
     HWND    hwnd;
     HWND    hwndParent;
+    // set while the font list is extracted in the background
+    CancelToken *fontListToken;
 };
 
 static Vec<PropertiesLayout*> gPropertiesWindows;
@@ -365,6 +375,26 @@ static void UpdatePropertiesLayout(PropertiesLayout *layoutData, HDC hdc, RectI
     SelectObject(hdc, origFont);
 }
 
+static void FitPropertiesWindow(PropertiesLayout *layoutData)
+{
+    HWND hwnd = layoutData->hwnd;
+
+    // get the dimensions required for the properties' content
+    RectI rc;
+    HDC hdc = GetDC(hwnd);
+    UpdatePropertiesLayout(layoutData, hdc, &rc);
+    ReleaseDC(hwnd, hdc);
+
+    // resize the window to just match these dimensions
+    // (as long as they fit into the current monitor's work area)
+    WindowRect wRc(hwnd);
+    ClientRect cRc(hwnd);
+    RectI work = GetWorkAreaRect(WindowRect(layoutData->hwndParent));
+    wRc.dx = std::min(rc.dx + wRc.dx - cRc.dx, work.dx);
+    wRc.dy = std::min(rc.dy + wRc.dy - cRc.dy, work.dy);
+    MoveWindow(hwnd, wRc.x, wRc.y, wRc.dx, wRc.dy, FALSE);
+}
+
 static bool CreatePropertiesWindow(HWND hParent, PropertiesLayout* layoutData)
 {
     CrashIf(layoutData->hwnd);
@@ -382,21 +412,7 @@ static bool CreatePropertiesWindow(HWND hParent, PropertiesLayout* layoutData)
     layoutData->hwndParent = hParent;
     ToggleWindowStyle(hwnd, WS_EX_LAYOUTRTL | WS_EX_NOINHERITLAYOUT, IsUIRightToLeft(), GWL_EXSTYLE);
 
-    // get the dimensions required for the about box's content
-    RectI rc;
-    PAINTSTRUCT ps;
-    HDC hdc = BeginPaint(hwnd, &ps);
-    UpdatePropertiesLayout(layoutData, hdc, &rc);
-    EndPaint(hwnd, &ps);
-
-    // resize the new window to just match these dimensions
-    // (as long as they fit into the current monitor's work area)
-    WindowRect wRc(hwnd);
-    ClientRect cRc(hwnd);
-    RectI work = GetWorkAreaRect(WindowRect(hParent));
-    wRc.dx = std::min(rc.dx + wRc.dx - cRc.dx, work.dx);
-    wRc.dy = std::min(rc.dy + wRc.dy - cRc.dy, work.dy);
-    MoveWindow(hwnd, wRc.x, wRc.y, wRc.dx, wRc.dy, FALSE);
+    FitPropertiesWindow(layoutData);
     CenterDialog(hwnd, hParent);
 
     ShowWindow(hwnd, SW_SHOW);
@@ -482,19 +498,82 @@ static void GetProps(Controller *ctrl, PropertiesLayout *layoutData, bool extend
 
 #if defined(DEBUG) || defined(ENABLE_EXTENDED_PROPERTIES)
     if (extended) {
-        // TODO: FontList extraction can take a while
-        str = ctrl->GetProperty(Prop_FontList);
+        // FontList extraction can take a while, so for fixed page
+        // documents it's done in the background (cf. StartFontListExtraction)
+        str = ctrl->AsFixed() ? str::Dup(L"...") : ctrl->GetProperty(Prop_FontList);
         if (str) {
             // add a space between basic and extended file properties
             layoutData->AddProperty(L" ", str::Dup(L" "));
         }
         layoutData->AddProperty(_TR("Fonts:"), str);
+        str = ctrl->GetProperty(Prop_CacheStatistics);
+        layoutData->AddProperty(_TR("Cache:"), str);
     }
 #else
     UNUSED(extended);
 #endif
 }
 
+#if defined(DEBUG) || defined(ENABLE_EXTENDED_PROPERTIES)
+// takes ownership of fonts
+static void SetFontListProperty(PropertiesLayout *layoutData, WCHAR *fonts)
+{
+    for (size_t i = 0; i < layoutData->Count(); i++) {
+        PropertyEl *el = layoutData->At(i);
+        if (!str::Eq(el->leftTxt, _TR("Fonts:")))
+            continue;
+        if (!str::IsEmpty(fonts)) {
+            el->rightTxt.Set(fonts);
+            return;
+        }
+        // don't display the placeholder nor the space above it
+        delete layoutData->PopAt(i);
+        if (i > 0 && str::Eq(layoutData->At(i - 1)->leftTxt, L" "))
+            delete layoutData->PopAt(i - 1);
+        break;
+    }
+    free(fonts);
+}
+
+// extracting the font list walks through the resources of all pages which takes
+// a while for large documents, so it's done on a clone of the engine while the
+// dialog is already displayed (the result is cached by the PDF engine)
+static void StartFontListExtraction(PropertiesLayout *layoutData, BaseEngine *engine)
+{
+    CrashIf(layoutData->fontListToken);
+    BaseEngine *clone = engine->Clone();
+    if (!clone) {
+        SetFontListProperty(layoutData, engine->GetProperty(Prop_FontList));
+        FitPropertiesWindow(layoutData);
+        InvalidateRect(layoutData->hwnd, nullptr, TRUE);
+        return;
+    }
+
+    // the token is canceled when the dialog is closed
+    CancelToken *token = new CancelToken();
+    layoutData->fontListToken = token;
+    token->AddRef();
+    RunAsync([=] {
+        WCHAR *fonts = nullptr;
+        if (!token->IsCanceled())
+            fonts = clone->GetProperty(Prop_FontList);
+        delete clone;
+        uitask::Post([=] {
+            if (token->IsCanceled()) {
+                free(fonts);
+            } else {
+                layoutData->fontListToken = nullptr;
+                token->Release();
+                SetFontListProperty(layoutData, fonts);
+                FitPropertiesWindow(layoutData);
+                InvalidateRect(layoutData->hwnd, nullptr, TRUE);
+            }
+            token->Release();
+        });
+    });
+}
+#endif
+
 static void ShowProperties(HWND parent, Controller *ctrl, bool extended=false)
 {
     PropertiesLayout *layoutData = FindPropertyWindowByParent(parent);
@@ -509,8 +588,14 @@ static void ShowProperties(HWND parent, Controller *ctrl, bool extended=false)
     gPropertiesWindows.Append(layoutData);
     GetProps(ctrl, layoutData, extended);
 
-    if (!CreatePropertiesWindow(parent, layoutData))
+    if (!CreatePropertiesWindow(parent, layoutData)) {
         delete layoutData;
+        return;
+    }
+#if defined(DEBUG) || defined(ENABLE_EXTENDED_PROPERTIES)
+    if (extended && ctrl->AsFixed())
+        StartFontListExtraction(layoutData, ctrl->AsFixed()->GetEngine());
+#endif
 }
 
 void OnMenuProperties(WindowInfo *win)
@@ -7,6 +7,7 @@
 #include "CmdLineParser.h"
 #include "DbgHelpDyn.h"
 #include "Dpi.h"
+#include "EtwTrace.h"
 #include "FileUtil.h"
 #include "FileWatcher.h"
 #include "HtmlParserLookup.h"
@@ -19,7 +20,10 @@
 #include "WinUtil.h"
 // rendering engines
 #include "BaseEngine.h"
+#include "DjVuEngine.h"
 #include "EngineManager.h"
+#include "ImagesEngine.h"
+#include "PdfEngine.h"
 // layout controllers
 #include "SettingsStructs.h"
 #include "Controller.h"
@@ -43,6 +47,7 @@
 #include "CrashHandler.h"
 #include "FileThumbnails.h"
 #include "Notifications.h"
+#include "PerfStats.h"
 #include "Print.h"
 #include "Search.h"
 #include "Selection.h"
@@ -64,6 +69,9 @@
 #define ABOUT_BG_GRAY_COLOR     RGB(0xF2, 0xF2, 0xF2)
 
 #define CRASH_DUMP_FILE_NAME         L"sumatrapdfcrash.dmp"
+#define HANG_LOG_FILE_NAME           L"sumatrapdfhangs.txt"
+// UI thread stalls longer than this are logged to HANG_LOG_FILE_NAME
+#define HANG_DETECTOR_TIMEOUT_MS     2000
 
 #ifdef DEBUG
 static bool TryLoadMemTrace()
@@ -190,6 +198,12 @@ static bool RegisterWinClass()
     atom = RegisterClassEx(&wcex);
     CrashIf(!atom);
 
+    FillWndClassEx(wcex, SEARCH_RESULTS_CLASS_NAME, WndProcSearchResults);
+    wcex.hIcon = LoadIcon(GetModuleHandle(nullptr), MAKEINTRESOURCE(IDI_SUMATRAPDF));
+    CrashIf(!wcex.hIcon);
+    atom = RegisterClassEx(&wcex);
+    CrashIf(!atom);
+
     RegisterNotificationsWndClass();
     RegisterSplitterWndClass();
     RegisterLabelWithCloseWnd();
@@ -275,6 +289,28 @@ static void OpenUsingDde(HWND targetWnd, const WCHAR *filePath, CommandLineInfo&
     DDEExecute(PDFSYNC_DDE_SERVICE, PDFSYNC_DDE_TOPIC, cmd.Get());
 }
 
+// -reuse-instance requests (as used by TeX editors for forward search) only have
+// to be passed on to the running instance, so do that before doing any of the
+// expensive initialization (settings, translations, GDI+, etc.)
+static bool ForwardToPrevInstanceEarly(CommandLineInfo& i)
+{
+    if (!i.reuseDdeInstance || 0 == i.fileNames.Count())
+        return false;
+    // these are handled by this instance itself
+    if (i.printDialog || i.printerName || i.stressTestPath || i.benchStartup || i.hwndPluginParent ||
+        i.testRenderPage || i.testExtractPage || i.pathsToBenchmark.Count() > 0 ||
+        i.makeDefault || i.showConsole || i.exitImmediately) {
+        return false;
+    }
+    HWND hPrevWnd = FindWindow(FRAME_CLASS_NAME, nullptr);
+    if (!hPrevWnd)
+        return false;
+    for (size_t n = 0; n < i.fileNames.Count(); n++) {
+        OpenUsingDde(hPrevWnd, i.fileNames.At(n), i, 0 == n);
+    }
+    return true;
+}
+
 static WindowInfo *LoadOnStartup(const WCHAR *filePath, CommandLineInfo& i, bool isFirstWin)
 {
     LoadArgs args(filePath);
@@ -323,31 +359,23 @@ static WindowInfo *LoadOnStartup(const WCHAR *filePath, CommandLineInfo& i, bool
 static void RestoreTabOnStartup(WindowInfo *win, TabState *state)
 {
     LoadArgs args(state->filePath, win);
-    if (!LoadDocument(args))
-        return;
-    TabInfo *tab = win->currentTab;
-    if (!tab || !tab->ctrl)
-        return;
+    if (LoadDocument(args))
+        ApplyTabState(win, state);
+}
 
+// adds a tab for a background document of a restored session without loading
+// the document (which happens only once the tab is selected, cf. LoadModelIntoTab)
+static void RestorePendingTab(WindowInfo *win, TabState *state)
+{
+    ScopedMem<WCHAR> fullPath(path::Normalize(state->filePath));
+    TabInfo *tab = CreateNewTab(win, fullPath);
+    tab->pendingState = CopyTabState(state);
+    tab->showToc = state->showToc;
     tab->tocState = *state->tocState;
-    SetSidebarVisibility(win, state->showToc, gGlobalPrefs->showFavorites);
-
-    DisplayMode displayMode = prefs::conv::ToDisplayMode(state->displayMode, DM_AUTOMATIC);
-    if (displayMode != DM_AUTOMATIC)
-        SwitchToDisplayMode(win, displayMode);
-    // TODO: make EbookController::GoToPage not crash
-    if (!tab->AsEbook())
-        tab->ctrl->GoToPage(state->pageNo, true);
-    float zoom = prefs::conv::ToZoom(state->zoom, INVALID_ZOOM);
-    if (zoom != INVALID_ZOOM) {
-        if (tab->AsFixed())
-            tab->AsFixed()->Relayout(zoom, state->rotation);
-        else
-            tab->ctrl->SetZoomVirtual(zoom);
-    }
-    if (tab->AsFixed())
-        tab->AsFixed()->SetScrollState(ScrollState(state->pageNo, state->scrollPos.x, state->scrollPos.y));
-
+    // pending tabs are the least recently selected ones
+    win->tabSelectionHistory->InsertAt(0, tab);
+    // CreateNewTab selects the new tab, so restore the selection of the current one
+    TabCtrl_SetCurSel(win->hwndTabBar, win->tabs.Find(win->currentTab));
 }
 
 static bool SetupPluginMode(CommandLineInfo& i)
@@ -570,6 +598,143 @@ static bool AutoUpdateMain()
 }
 #endif
 
+// cache the page sizes of large DjVu, PDF and comic book documents along with thumbnails
+// (checked for every document, as the preferences might change)
+static WCHAR *GetDjVuPageDataCachePath(const WCHAR *filePath)
+{
+    if (!HasPermission(Perm_SavePreferences | Perm_DiskAccess) || !gGlobalPrefs->rememberOpenedFiles)
+        return nullptr;
+    return GetDjVuPageDataPath(filePath);
+}
+
+static WCHAR *GetPdfPageDataCachePath(const WCHAR *filePath)
+{
+    if (!HasPermission(Perm_SavePreferences | Perm_DiskAccess) || !gGlobalPrefs->rememberOpenedFiles)
+        return nullptr;
+    return GetPdfPageDataPath(filePath);
+}
+
+static WCHAR *GetCbxIndexCachePath(const WCHAR *filePath)
+{
+    if (!HasPermission(Perm_SavePreferences | Perm_DiskAccess) || !gGlobalPrefs->rememberOpenedFiles)
+        return nullptr;
+    return GetCbxIndexPath(filePath);
+}
+
+// documents up to this size are read completely into the system's file cache
+// while the UI is being set up, larger ones only where loading starts
+#define PREWARM_MAX_FILE_SIZE   (32 * 1024 * 1024)
+#define PREWARM_RANGE_SIZE      (1024 * 1024)
+#define PREWARM_MAX_FIRST_PAGE  (16 * 1024 * 1024)
+
+// the document that's going to be loaded first (cf. WinMain)
+static const WCHAR *GetFirstStartupDocument(CommandLineInfo& i)
+{
+    if (i.hwndPluginParent || i.benchStartup)
+        return nullptr;
+    Vec<WCHAR *> *reopenOnce = gGlobalPrefs->reopenOnce;
+    bool restoreSession = gGlobalPrefs->restoreSession;
+    if (reopenOnce->Count() == 1 && str::EqI(reopenOnce->At(0), L"SessionData"))
+        restoreSession = true;
+    if (restoreSession && gGlobalPrefs->sessionData->Count() > 0) {
+        SessionData *data = gGlobalPrefs->sessionData->At(0);
+        if (data->tabStates->Count() > 0) {
+            int tabIndex = limitValue(data->tabIndex - 1, 0, (int)data->tabStates->Count() - 1);
+            return data->tabStates->At(tabIndex)->filePath;
+        }
+    }
+    if (i.fileNames.Count() > 0)
+        return i.fileNames.At(0);
+    if (reopenOnce->Count() > 0 && !restoreSession)
+        return reopenOnce->Last();
+    return nullptr;
+}
+
+static void ReadIntoFileCache(HANDLE h, int64 offset, int64 len, char *buf, DWORD bufSize)
+{
+    LARGE_INTEGER off;
+    off.QuadPart = offset;
+    if (!SetFilePointerEx(h, off, nullptr, FILE_BEGIN))
+        return;
+    while (len > 0) {
+        DWORD read;
+        if (!ReadFile(h, buf, (DWORD)std::min(len, (int64)bufSize), &read, nullptr) || 0 == read)
+            return;
+        len -= read;
+    }
+}
+
+// linearized PDF documents store everything needed for displaying
+// the first page at the file's start, up to the offset given by /E
+static int64 GetPdfFirstPageEnd(const char *data, size_t len)
+{
+    ScopedMem<char> head(str::DupN(data, len));
+    if (!str::Find(head, "/Linearized"))
+        return 0;
+    for (const char *s = str::Find(head, "/E"); s; s = str::Find(s + 2, "/E")) {
+        const char *num = s + 2;
+        while (str::IsWs(*num)) {
+            num++;
+        }
+        if (str::IsDigit(*num))
+            return _atoi64(num);
+    }
+    return 0;
+}
+
+static void PrewarmFile(const WCHAR *filePath)
+{
+    HANDLE h = CreateFile(filePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                          nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (INVALID_HANDLE_VALUE == h)
+        return;
+    LARGE_INTEGER size;
+    ScopedMem<char> buf(AllocArray<char>(PREWARM_RANGE_SIZE));
+    if (!buf || !GetFileSizeEx(h, &size)) {
+        CloseHandle(h);
+        return;
+    }
+
+    if (size.QuadPart <= PREWARM_MAX_FILE_SIZE) {
+        ReadIntoFileCache(h, 0, size.QuadPart, buf, PREWARM_RANGE_SIZE);
+        CloseHandle(h);
+        return;
+    }
+
+    // PDF documents are parsed starting from the trailer at the end
+    DWORD read = 0;
+    int64 firstPageEnd = 0;
+    if (ReadFile(h, buf, 1024, &read, nullptr))
+        firstPageEnd = GetPdfFirstPageEnd(buf, read);
+    ReadIntoFileCache(h, size.QuadPart - PREWARM_RANGE_SIZE, PREWARM_RANGE_SIZE, buf, PREWARM_RANGE_SIZE);
+    int64 headSize = limitValue(firstPageEnd, (int64)PREWARM_RANGE_SIZE, (int64)PREWARM_MAX_FIRST_PAGE);
+    ReadIntoFileCache(h, read, headSize - read, buf, PREWARM_RANGE_SIZE);
+    CloseHandle(h);
+}
+
+// on a cold start, reading the document to be restored (and its cached
+// page data) in the background overlaps that I/O with setting up the UI
+static void PrewarmStartupDocument(CommandLineInfo& i)
+{
+    const WCHAR *filePath = GetFirstStartupDocument(i);
+    if (!filePath || !HasPermission(Perm_DiskAccess))
+        return;
+
+    WCHAR *docPath = str::Dup(filePath);
+    WCHAR *pageDataPath = nullptr;
+    if (PdfEngine::IsSupportedFile(filePath))
+        pageDataPath = GetPdfPageDataCachePath(filePath);
+    else if (DjVuEngine::IsSupportedFile(filePath))
+        pageDataPath = GetDjVuPageDataCachePath(filePath);
+    RunAsync([docPath, pageDataPath] {
+        PrewarmFile(docPath);
+        if (pageDataPath)
+            PrewarmFile(pageDataPath);
+        free(docPath);
+        free(pageDataPath);
+    }, TaskPriority::Interactive);
+}
+
 static void ShutdownCommon() {
     mui::Destroy();
     uitask::Destroy();
@@ -596,6 +761,7 @@ int APIENTRY WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
 #endif
 
     InitDynCalls();
+    etw::Register();
 
     DisableDataExecution();
     // ensure that C functions behave consistently under all OS locales
@@ -625,6 +791,12 @@ int APIENTRY WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
     }
 #endif
 
+    CommandLineInfo i;
+    i.ParseCommandLine(GetCommandLine());
+
+    if (ForwardToPrevInstanceEarly(i))
+        return 0;
+
     srand((unsigned int)time(nullptr));
 
 #ifdef DEBUG
@@ -638,9 +810,7 @@ int APIENTRY WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
     ScopedGdiPlus gdiPlus(true);
     mui::Initialize();
     uitask::Initialize();
-
-    CommandLineInfo i;
-    i.ParseCommandLine(GetCommandLine());
+    RecordStartupPhase("init");
 
     if (i.testRenderPage) {
         TestRenderPage(i);
@@ -657,10 +827,18 @@ int APIENTRY WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
     InitializePolicies(i.restrictedUse);
     if (i.appdataDir)
         SetAppDataPath(i.appdataDir);
+    if (i.benchStartup) {
+        // don't save file history and preference changes
+        RestrictPolicies(Perm_SavePreferences);
+        StartBenchStartup();
+    }
 
     prefs::Load();
     prefs::UpdateGlobalPrefs(i);
+    perfstats::Load();
+    RecordStartupPhase("settings");
     SetCurrentLang(i.lang ? i.lang : gGlobalPrefs->uiLanguage);
+    RecordStartupPhase("translations");
 
     // This allows ad-hoc comparison of gdi, gdi+ and gdi+ quick when used
     // in layout
@@ -678,15 +856,44 @@ int APIENTRY WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
     if (i.makeDefault)
         AssociateExeWithPdfExtension();
     if (i.pathsToBenchmark.Count() > 0) {
-        BenchFileOrDir(i.pathsToBenchmark);
+        BenchFileOrDir(i);
         if (i.showConsole)
             system("pause");
     }
+    if (i.renderBatchPath) {
+        // the exit code is the number of files which failed to render
+        retCode = RenderBatch(i);
+        goto Exit;
+    }
+    if (i.renderServerPipe) {
+        retCode = RunRenderServer(i);
+        goto Exit;
+    }
+    if (i.stressTestPath && i.stressThreadCount > 0) {
+        retCode = RunConcurrentStressTest(i);
+        goto Exit;
+    }
     if (i.exitImmediately)
         goto Exit;
     gCrashOnOpen = i.crashOnOpen;
 
+    PrewarmStartupDocument(i);
+
     GetFixedPageUiColors(gRenderCache.textColor, gRenderCache.backgroundColor);
+    gRenderCache.StartRenderThreads(gGlobalPrefs->performance.renderThreads);
+    size_t renderCacheSize = (size_t)std::max(gGlobalPrefs->performance.renderCacheSize, 16) * 1024 * 1024;
+    gRenderCache.SetMaxCacheSize(renderCacheSize);
+    gRenderCache.EnableGpuScaling(gGlobalPrefs->performance.gpuScaling);
+    // decoded images are charged against the same budget (cf. RenderCache::GetMaxCacheSize)
+    // and may take up to half of it
+    ImageEngine::SetMaxPageCacheMemory(renderCacheSize / 2);
+    PdfEngine::SetMaxPageRunMemory((size_t)std::max(gGlobalPrefs->performance.displayListCacheSize, 1) * 1024 * 1024);
+    PdfEngine::SetMaxGlyphCacheMemory((size_t)std::max(gGlobalPrefs->performance.glyphCacheSize, 1) * 1024 * 1024);
+    PdfEngine::EnableThreadPoolDecoding();
+    DjVuEngine::SetPageDataCache(GetDjVuPageDataCachePath);
+    PdfEngine::SetPageDataCache(GetPdfPageDataCachePath);
+    CbxEngine::SetArchiveIndexCache(GetCbxIndexCachePath);
+    PageTextCache::SetMaxMemory((size_t)std::max(gGlobalPrefs->performance.textCacheSize, 1) * 1024 * 1024);
 
     if (!RegisterWinClass())
         goto Exit;
@@ -714,7 +921,7 @@ int APIENTRY WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
 
     HANDLE hMutex = nullptr;
     HWND hPrevWnd = nullptr;
-    if (i.printDialog || i.stressTestPath || gPluginMode) {
+    if (i.printDialog || i.stressTestPath || i.benchStartup || gPluginMode) {
         // TODO: pass print request through to previous instance?
     }
     else if (i.reuseDdeInstance) {
@@ -734,7 +941,7 @@ int APIENTRY WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
     }
 
     bool restoreSession = false;
-    if (gGlobalPrefs->sessionData->Count() > 0 && !gPluginURL) {
+    if (gGlobalPrefs->sessionData->Count() > 0 && !gPluginURL && !i.benchStartup) {
         restoreSession = gGlobalPrefs->restoreSession;
     }
     if (gGlobalPrefs->reopenOnce->Count() > 0 && !gPluginURL) {
@@ -759,10 +966,23 @@ int APIENTRY WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
     if (restoreSession) {
         for (SessionData *data : *gGlobalPrefs->sessionData) {
             win = CreateAndShowWindowInfo(data);
-            for (TabState *state : *data->tabStates) {
-                RestoreTabOnStartup(win, state);
+            // only load the document of the selected tab, the others are loaded on demand
+            int tabIndex = limitValue(data->tabIndex - 1, 0, (int)data->tabStates->Count() - 1);
+            for (size_t n = 0; n < data->tabStates->Count(); n++) {
+                TabState *state = data->tabStates->At(n);
+                if (gGlobalPrefs->useTabs && (int)n != tabIndex)
+                    RestorePendingTab(win, state);
+                else
+                    RestoreTabOnStartup(win, state);
+            }
+            if (!win->currentTab && win->tabs.Count() > 0) {
+                // the selected document couldn't be loaded
+                TabCtrl_SetCurSel(win->hwndTabBar, 0);
+                LoadModelIntoTab(win, win->tabs.At(0));
+            }
+            else if (!gGlobalPrefs->useTabs) {
+                TabsSelect(win, tabIndex);
             }
-            TabsSelect(win, data->tabIndex - 1);
         }
     }
     ResetSessionState(gGlobalPrefs->sessionData);
@@ -788,6 +1008,15 @@ int APIENTRY WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
     }
     if (i.printDialog && i.exitWhenDone)
         goto Exit;
+    if (i.benchStartup && !win->IsDocLoaded()) {
+        fprintf(stderr, "Error: failed to load %ls\n", i.fileNames.At(0));
+        goto Exit;
+    }
+    if (i.benchStartup && win->AsChm()) {
+        // CHM documents are painted by the embedded browser,
+        // so being loaded is as close as we get
+        OnStartupPaint(true);
+    }
 
     if (!win) {
         win = CreateAndShowWindowInfo();
@@ -818,7 +1047,12 @@ int APIENTRY WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
     // call this once it's clear whether Perm_SavePreferences has been granted
     prefs::RegisterForFileChanges();
 
+    StartHangDetector(ScopedMem<WCHAR>(AppGenDataFilename(HANG_LOG_FILE_NAME)), HANG_DETECTOR_TIMEOUT_MS);
     retCode = RunMessageLoop();
+    StopHangDetector();
+    // write out a still pending delayed save
+    prefs::Flush();
+    perfstats::Save();
 
     SafeCloseHandle(&hMutex);
     CleanUpThumbnailCache(gFileHistory);
@@ -829,6 +1063,7 @@ Exit:
     while (gWindows.Count() > 0) {
         DeleteWindowInfo(gWindows.At(0));
     }
+    etw::Unregister();
 
 #ifndef DEBUG
 
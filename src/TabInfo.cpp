@@ -27,7 +27,8 @@ TabInfo::TabInfo(const WCHAR *filePath) :
     filePath(str::Dup(filePath)), ctrl(nullptr),
     showToc(false), showTocPresentation(false), tocRoot(nullptr),
     reloadOnFocus(false), watcher(nullptr), selectionOnPage(nullptr),
-    prevZoomVirtual(INVALID_ZOOM), prevDisplayMode(DM_AUTOMATIC)
+    prevZoomVirtual(INVALID_ZOOM), prevDisplayMode(DM_AUTOMATIC),
+    pendingState(nullptr), loadTimeMs(0)
 {
 }
 
@@ -39,6 +40,7 @@ TabInfo::~TabInfo()
     delete tocRoot;
     delete selectionOnPage;
     delete ctrl;
+    DeleteTabState(pendingState);
 }
 
 EngineType TabInfo::GetEngineType() const
@@ -3,6 +3,7 @@
 
 struct SelectionOnPage;
 struct WatchedFile;
+struct TabState;
 
 /* Data related to a single document loaded into a tab/window */
 /* (none of these depend on WindowInfo, so that a TabInfo could
@@ -31,6 +32,11 @@ public:
     // previous View settings, needed when unchecking the Fit Width/Page toolbar buttons
     float prevZoomVirtual;
     DisplayMode prevDisplayMode;
+    // saved session state of a tab whose document hasn't been loaded yet
+    // (the document is loaded when the tab is selected for the first time)
+    TabState *pendingState;
+    // how long it took to load the document (shown in the performance overlay)
+    double loadTimeMs;
 
     TabInfo(const WCHAR *filePath=nullptr);
     ~TabInfo();
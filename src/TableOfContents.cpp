@@ -220,9 +220,11 @@ static HTREEITEM AddTocItemToView(HWND hwnd, DocTocItem *entry, HTREEITEM parent
     TV_INSERTSTRUCT tvinsert;
     tvinsert.hParent = parent;
     tvinsert.hInsertAfter = TVI_LAST;
-    tvinsert.itemex.mask = TVIF_TEXT | TVIF_PARAM | TVIF_STATE;
+    tvinsert.itemex.mask = TVIF_TEXT | TVIF_PARAM | TVIF_STATE | TVIF_CHILDREN;
     tvinsert.itemex.state = entry->child && entry->open != toggleItem ? TVIS_EXPANDED : 0;
     tvinsert.itemex.stateMask = TVIS_EXPANDED;
+    // children of collapsed items are only inserted once they're expanded
+    tvinsert.itemex.cChildren = entry->child ? 1 : 0;
     tvinsert.itemex.lParam = (LPARAM)entry;
     // Replace unprintable whitespace with regular spaces
     str::NormalizeWS(entry->title);
@@ -241,15 +243,31 @@ static HTREEITEM AddTocItemToView(HWND hwnd, DocTocItem *entry, HTREEITEM parent
     return TreeView_InsertItem(hwnd, &tvinsert);
 }
 
+// only inserts the items which are visible (i.e. which don't have a collapsed
+// ancestor), so that huge outlines don't have to be inserted at once
 static void PopulateTocTreeView(HWND hwnd, DocTocItem *entry, Vec<int>& tocState, HTREEITEM parent = nullptr)
 {
     for (; entry; entry = entry->next) {
         bool toggle = tocState.Contains(entry->id);
         HTREEITEM node = AddTocItemToView(hwnd, entry, parent, toggle);
-        PopulateTocTreeView(hwnd, entry->child, tocState, node);
+        if (entry->child && entry->open != toggle)
+            PopulateTocTreeView(hwnd, entry->child, tocState, node);
     }
 }
 
+static void OnTocItemExpanding(WindowInfo *win, LPNMTREEVIEW pnmtv)
+{
+    if (!(pnmtv->action & TVE_EXPAND) || !win->currentTab)
+        return;
+    DocTocItem *tocItem = (DocTocItem *)pnmtv->itemNew.lParam;
+    HTREEITEM hItem = pnmtv->itemNew.hItem;
+    if (!tocItem || !tocItem->child || TreeView_GetChild(win->hwndTocTree, hItem))
+        return;
+    // the item's descendants haven't been changed since the tree was loaded,
+    // so the tab's tocState still applies to them
+    PopulateTocTreeView(win->hwndTocTree, tocItem->child, win->currentTab->tocState, hItem);
+}
+
 static void TreeItemForPageNoRec(WindowInfo *win, HTREEITEM hItem, int pageNo, HTREEITEM& bestMatchItem, int& bestMatchPageNo)
 {
     while (hItem && bestMatchPageNo < pageNo) {
@@ -300,7 +318,20 @@ void UpdateTocSelection(WindowInfo *win, int currPageNo)
     TreeView_SelectItem(win->hwndTocTree, hItem);
 }
 
-void UpdateTocExpansionState(TabInfo *tab, HWND hwndTocTree, HTREEITEM hItem)
+// the descendants of items which have never been expanded aren't in the
+// tree view and retain their previously saved expansion state
+static void KeepTocExpansionState(Vec<int>& tocState, Vec<int>& prevState, DocTocItem *tocItem)
+{
+    for (; tocItem; tocItem = tocItem->next) {
+        if (!tocItem->child)
+            continue;
+        if (prevState.Contains(tocItem->id))
+            tocState.Append(tocItem->id);
+        KeepTocExpansionState(tocState, prevState, tocItem->child);
+    }
+}
+
+static void UpdateTocExpansionStateRec(Vec<int>& tocState, Vec<int>& prevState, HWND hwndTocTree, HTREEITEM hItem)
 {
     while (hItem) {
         TVITEM item;
@@ -314,14 +345,25 @@ void UpdateTocExpansionState(TabInfo *tab, HWND hwndTocTree, HTREEITEM hItem)
             // add the ids of toggled items to tocState
             bool wasToggled = !(item.state & TVIS_EXPANDED) == tocItem->open;
             if (wasToggled)
-                tab->tocState.Append(tocItem->id);
-            UpdateTocExpansionState(tab, hwndTocTree, TreeView_GetChild(hwndTocTree, hItem));
+                tocState.Append(tocItem->id);
+            HTREEITEM hChild = TreeView_GetChild(hwndTocTree, hItem);
+            if (hChild)
+                UpdateTocExpansionStateRec(tocState, prevState, hwndTocTree, hChild);
+            else
+                KeepTocExpansionState(tocState, prevState, tocItem->child);
         }
 
         hItem = TreeView_GetNextSibling(hwndTocTree, hItem);
     }
 }
 
+void UpdateTocExpansionState(TabInfo *tab, HWND hwndTocTree, HTREEITEM hItem)
+{
+    Vec<int> prevState(tab->tocState);
+    tab->tocState.Reset();
+    UpdateTocExpansionStateRec(tab->tocState, prevState, hwndTocTree, hItem);
+}
+
 void UpdateTocColors(WindowInfo *win)
 {
     COLORREF labelBgCol = GetSysColor(COLOR_BTNFACE);
@@ -477,10 +519,37 @@ static LRESULT OnTocTreeNotify(WindowInfo *win, LPNMTREEVIEW pnmtv)
         case TVN_GETINFOTIP:
             CustomizeTocInfoTip((LPNMTVGETINFOTIP)pnmtv);
             break;
+
+        case TVN_ITEMEXPANDING:
+            OnTocItemExpanding(win, pnmtv);
+            break;
     }
     return -1;
 }
 
+// renders the page of the item under the cursor ahead of time
+static void PrefetchTocItemUnderCursor(WindowInfo *win, HWND hTV, LPARAM lParam)
+{
+    TVHITTESTINFO ht = { 0 };
+    ht.pt.x = GET_X_LPARAM(lParam);
+    ht.pt.y = GET_Y_LPARAM(lParam);
+    HTREEITEM hItem = TreeView_HitTest(hTV, &ht);
+    DocTocItem *tocItem = nullptr;
+    if (hItem && (ht.flags & TVHT_ONITEM)) {
+        TVITEM item;
+        item.hItem = hItem;
+        item.mask = TVIF_PARAM;
+        TreeView_GetItem(hTV, &item);
+        tocItem = (DocTocItem *)item.lParam;
+    }
+    int pageNo = 0;
+    if (tocItem && tocItem->GetLink())
+        pageNo = tocItem->GetLink()->GetDestPageNo();
+    else if (tocItem)
+        pageNo = tocItem->pageNo;
+    PrefetchDestinationPage(win, pageNo);
+}
+
 static WNDPROC DefWndProcTocTree = nullptr;
 static LRESULT CALLBACK WndProcTocTree(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
 {
@@ -519,6 +588,13 @@ static LRESULT CALLBACK WndProcTocTree(HWND hwnd, UINT message, WPARAM wParam, L
             if (!IsCursorOverWindow(win->hwndTocTree))
                 return SendMessage(win->hwndCanvas, message, wParam, lParam);
             break;
+        case WM_MOUSEMOVE:
+            if (win->AsFixed())
+                PrefetchTocItemUnderCursor(win, hwnd, lParam);
+            break;
+        case WM_MOUSELEAVE:
+            PrefetchDestinationPage(win, 0);
+            break;
 #ifdef DISPLAY_TOC_PAGE_NUMBERS
         case WM_SIZE:
         case WM_HSCROLL:
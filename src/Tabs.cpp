@@ -686,7 +686,6 @@ void SaveCurrentTabInfo(WindowInfo *win)
     TabInfo *tdata = win->currentTab;
     CrashIf(!tdata);
     if (win->tocLoaded) {
-        tdata->tocState.Reset();
         HTREEITEM hRoot = TreeView_GetRoot(win->hwndTocTree);
         if (hRoot)
             UpdateTocExpansionState(tdata, win->hwndTocTree, hRoot);
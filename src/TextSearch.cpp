@@ -3,42 +3,652 @@
 
 // utils
 #include "BaseUtil.h"
+#include <emmintrin.h>
+#include "EtwTrace.h"
+#include "ThreadUtil.h"
 // layout controllers
 #include "BaseEngine.h"
 #include "TextSelection.h"
 #include "TextSearch.h"
 
-enum { SEARCH_PAGE, SKIP_PAGE };
+// CLAIMED_PAGE marks pages being scanned by a TextSearchWorker
+enum { SEARCH_PAGE, SKIP_PAGE, CLAIMED_PAGE };
+
+// don't bother starting workers if fewer pages are left to search
+#define MIN_PARALLEL_SEARCH_PAGES 16
+// workers leave pages taking longer than this to FindStartingAtPage
+#define SCAN_AHEAD_TIMEOUT_MS 250
 
 #define SkipWhitespace(c) for (; str::IsWs(*(c)); (c)++)
 // ignore spaces between CJK glyphs but not between Latin, Greek, Cyrillic, etc. letters
 // cf. http://code.google.com/p/sumatrapdf/issues/detail?id=959
 #define isnoncjkwordchar(c) (isWordChar(c) && (unsigned short)(c) < 0x2E80)
 
+/* TextRegex is a regular expression compiled into a DFA over case-folded WCHARs.
+   Supported are literals, ., [...] and [^...] (with ranges), \d \w \s \D \W \S \n \t,
+   alternatives (|), groups, * + ? and \b at the very start and end of a pattern.
+   A literal space matches any amount of whitespace (including line breaks), as it
+   does for literal searches. Matches are leftmost-longest and never empty. */
+
+// the DFA has up to MAX_REGEX_STATES * MAX_REGEX_CLASSES transitions
+#define MAX_REGEX_STATES    1024
+#define MAX_REGEX_CLASSES   256
+#define MAX_REGEX_NODES     4096
+#define MAX_REGEX_NESTING   64
+
+#define REGEX_DEAD_STATE    0
+#define REGEX_START_STATE   1
+
+class TextRegex {
+public:
+    // the equivalence class of every WCHAR (after folding its case); class 0
+    // is for the terminating zero and chars which are never matched
+    BYTE classOf[65536];
+    int classCount;
+    // classCount transitions per state
+    uint16 *transitions;
+    bool *accepting;
+    bool wordStart, wordEnd;
+
+    TextRegex() : classCount(0), transitions(nullptr), accepting(nullptr),
+        wordStart(false), wordEnd(false) { }
+    ~TextRegex() {
+        free(transitions);
+        free(accepting);
+    }
+
+    // returns the length of the longest match at start or -1
+    int MatchLen(const WCHAR *start, const WCHAR *textStart) const;
+
+    // returns nullptr if the pattern is invalid, too complex or matches the empty string
+    static TextRegex *Compile(const WCHAR *pattern, bool caseSensitive);
+};
+
+static bool IsWordBoundary(const WCHAR *pos, const WCHAR *textStart)
+{
+    bool before = pos > textStart && isWordChar(pos[-1]);
+    return before != (*pos && isWordChar(*pos));
+}
+
+int TextRegex::MatchLen(const WCHAR *start, const WCHAR *textStart) const
+{
+    if (wordStart && !IsWordBoundary(start, textStart))
+        return -1;
+    int state = REGEX_START_STATE, len = -1;
+    for (const WCHAR *s = start; *s; s++) {
+        state = transitions[state * classCount + classOf[*s]];
+        if (REGEX_DEAD_STATE == state)
+            break;
+        if (accepting[state] && (!wordEnd || IsWordBoundary(s + 1, textStart)))
+            len = (int)(s + 1 - start);
+    }
+    return len;
+}
+
+struct RegexRange {
+    WCHAR lo, hi;
+};
+
+enum RegexNodeType { Regex_Set, Regex_Concat, Regex_Alt, Regex_Star, Regex_Plus, Regex_Quest };
+
+struct RegexNode {
+    RegexNodeType type;
+    // the child nodes (right is unused for Star, Plus and Quest) resp.
+    // the node's ranges [left, right) in RegexParser::ranges for Set
+    int left, right;
+};
+
+static bool IsRegexDigit(WCHAR c) { return '0' <= c && c <= '9'; }
+static bool IsRegexWordChar(WCHAR c) { return isWordChar(c); }
+static bool IsRegexSpace(WCHAR c) { return str::IsWs(c); }
+static bool IsRegexAnyChar(WCHAR c) { return c != '\n'; }
+
+static int cmpRegexRanges(const void *a, const void *b)
+{
+    return (int)((const RegexRange *)a)->lo - (int)((const RegexRange *)b)->lo;
+}
+
+static int cmpInts(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+// a recursive descent parser turning a pattern into RegexNodes
+class RegexParser {
+    const WCHAR *s;
+    bool caseSensitive;
+    int nesting;
+
+    int AddNode(RegexNodeType type, int left, int right=0) {
+        if (left < 0 || right < 0 || nodes.Count() >= MAX_REGEX_NODES)
+            return -1;
+        RegexNode node = { type, left, right };
+        nodes.Append(node);
+        return (int)nodes.Count() - 1;
+    }
+
+    void AddRange(WCHAR lo, WCHAR hi) {
+        // the DFA sees case-folded text, so fold the ranges as well (as far as it's cheap)
+        if (!caseSensitive && hi - lo < 0x100) {
+            for (int c = lo; c <= hi; c++) {
+                WCHAR f = (WCHAR)(UINT_PTR)CharLower((LPWSTR)(UINT_PTR)c);
+                RegexRange r = { f, f };
+                ranges.Append(r);
+            }
+            return;
+        }
+        RegexRange r = { lo, hi };
+        ranges.Append(r);
+    }
+
+    void AddPredicate(bool (*pred)(WCHAR c), bool negate) {
+        for (int c = 1; c <= 0xFFFF; c++) {
+            if (pred((WCHAR)c) == negate)
+                continue;
+            int lo = c;
+            for (; c < 0xFFFF && pred((WCHAR)(c + 1)) != negate; c++)
+                ;
+            RegexRange r = { (WCHAR)lo, (WCHAR)c };
+            ranges.Append(r);
+        }
+    }
+
+    int AddSet(size_t firstRange, bool negate);
+    int ParseEscape();
+    int ParseClassChar(WCHAR *c);
+    int ParseClass();
+    int ParseAtom();
+    int ParseConcat();
+
+public:
+    Vec<RegexNode> nodes;
+    Vec<RegexRange> ranges;
+
+    RegexParser(const WCHAR *pattern, bool caseSensitive) :
+        s(pattern), caseSensitive(caseSensitive), nesting(0) { }
+
+    // returns the root node or -1 if the pattern is invalid
+    int Parse() {
+        int root = ParseAlt();
+        return *s ? -1 : root;
+    }
+    int ParseAlt();
+};
+
+// turns ranges [firstRange, ranges.Count()) into a set node (sorting, merging and negating them)
+int RegexParser::AddSet(size_t firstRange, bool negate)
+{
+    Vec<RegexRange> set;
+    set.Append(ranges.LendData() + firstRange, ranges.Count() - firstRange);
+    ranges.RemoveAt(firstRange, ranges.Count() - firstRange);
+    set.Sort(cmpRegexRanges);
+
+    Vec<RegexRange> merged;
+    for (RegexRange& r : set) {
+        if (merged.Count() > 0 && r.lo <= (int)merged.Last().hi + 1)
+            merged.Last().hi = std::max(merged.Last().hi, r.hi);
+        else
+            merged.Append(r);
+    }
+    if (!negate) {
+        ranges.Append(merged.LendData(), merged.Count());
+    }
+    else {
+        // the complement within [1, 0xFFFF] (the terminating zero never matches)
+        int next = 1;
+        for (RegexRange& r : merged) {
+            if (r.lo > next) {
+                RegexRange gap = { (WCHAR)next, (WCHAR)(r.lo - 1) };
+                ranges.Append(gap);
+            }
+            next = r.hi + 1;
+        }
+        if (next <= 0xFFFF) {
+            RegexRange gap = { (WCHAR)next, 0xFFFF };
+            ranges.Append(gap);
+        }
+    }
+    if (ranges.Count() == firstRange)
+        return -1;
+    return AddNode(Regex_Set, (int)firstRange, (int)ranges.Count());
+}
+
+// parses the char after a backslash; returns 0 for a single char,
+// 1 for a class of chars and -1 for unsupported escape sequences
+int RegexParser::ParseEscape()
+{
+    WCHAR c = *s++;
+    switch (c) {
+    case 'n': AddRange('\n', '\n'); return 0;
+    case 'r': AddRange('\r', '\r'); return 0;
+    case 't': AddRange('\t', '\t'); return 0;
+    case 'd': AddPredicate(IsRegexDigit, false); return 1;
+    case 'D': AddPredicate(IsRegexDigit, true); return 1;
+    case 'w': AddPredicate(IsRegexWordChar, false); return 1;
+    case 'W': AddPredicate(IsRegexWordChar, true); return 1;
+    case 's': AddPredicate(IsRegexSpace, false); return 1;
+    case 'S': AddPredicate(IsRegexSpace, true); return 1;
+    }
+    // other escaped word chars (e.g. \b within a pattern) are unsupported
+    if (!c || isWordChar(c))
+        return -1;
+    AddRange(c, c);
+    return 0;
+}
+
+// parses a single char within [...] (returns -1 on failure and 1 for classes such as \d)
+int RegexParser::ParseClassChar(WCHAR *c)
+{
+    if ('\\' != *s) {
+        *c = *s++;
+        return *c ? 0 : -1;
+    }
+    s++;
+    size_t count = ranges.Count();
+    int res = ParseEscape();
+    if (0 == res) {
+        // the range is added by ParseClass
+        *c = ranges.At(count).lo;
+        ranges.RemoveAt(count, ranges.Count() - count);
+    }
+    return res;
+}
+
+int RegexParser::ParseClass()
+{
+    size_t firstRange = ranges.Count();
+    bool negate = '^' == *s;
+    if (negate)
+        s++;
+    // a leading ] is a literal
+    for (bool first = true; first || *s != ']'; first = false) {
+        WCHAR lo, hi;
+        int res = ParseClassChar(&lo);
+        if (res < 0)
+            return -1;
+        if (res > 0)
+            continue;
+        hi = lo;
+        if ('-' == *s && s[1] && s[1] != ']') {
+            s++;
+            if (ParseClassChar(&hi) != 0 || hi < lo)
+                return -1;
+        }
+        AddRange(lo, hi);
+    }
+    s++;
+    return AddSet(firstRange, negate);
+}
+
+int RegexParser::ParseAtom()
+{
+    size_t firstRange = ranges.Count();
+    WCHAR c = *s++;
+    switch (c) {
+    case '(': {
+        if (++nesting > MAX_REGEX_NESTING)
+            return -1;
+        int node = ParseAlt();
+        nesting--;
+        if (*s++ != ')')
+            return -1;
+        return node;
+    }
+    case '[':
+        return ParseClass();
+    case '.':
+        AddPredicate(IsRegexAnyChar, false);
+        return AddSet(firstRange, false);
+    case '\\':
+        if (ParseEscape() < 0)
+            return -1;
+        return AddSet(firstRange, false);
+    case ' ':
+        for (; ' ' == *s; s++)
+            ;
+        AddPredicate(IsRegexSpace, false);
+        return AddNode(Regex_Plus, AddSet(firstRange, false));
+    case '\0': case ')': case '|': case '*': case '+': case '?':
+        return -1;
+    }
+    AddRange(c, c);
+    return AddSet(firstRange, false);
+}
+
+int RegexParser::ParseConcat()
+{
+    int node = -1;
+    while (*s && *s != '|' && *s != ')') {
+        int atom = ParseAtom();
+        for (; '*' == *s || '+' == *s || '?' == *s; s++) {
+            atom = AddNode('*' == *s ? Regex_Star : '+' == *s ? Regex_Plus : Regex_Quest, atom);
+        }
+        if (atom < 0)
+            return -1;
+        node = -1 == node ? atom : AddNode(Regex_Concat, node, atom);
+    }
+    return node;
+}
+
+int RegexParser::ParseAlt()
+{
+    int node = ParseConcat();
+    while ('|' == *s) {
+        s++;
+        node = AddNode(Regex_Alt, node, ParseConcat());
+    }
+    return node;
+}
+
+enum NfaStateType { Nfa_Set, Nfa_Split, Nfa_Match };
+
+struct NfaState {
+    NfaStateType type;
+    int out, out1;
+    // bitset of the matched classes (for Nfa_Set)
+    BYTE classes[MAX_REGEX_CLASSES / 8];
+};
+
+// Thompson construction of an NFA and subset construction of the DFA
+class RegexCompiler {
+    const RegexParser& parser;
+    // chars in [bounds[i], bounds[i + 1]) belong to class i + 1
+    Vec<int> bounds;
+    Vec<NfaState> states;
+
+    int AddState(NfaStateType type, int out, int out1=-1) {
+        NfaState state = { type, out, out1 };
+        states.Append(state);
+        return (int)states.Count() - 1;
+    }
+    int ClassOfChar(int c) const;
+    // builds the states for node, continuing with state next (returns the first state)
+    int CompileNode(int node, int next);
+    void AddClosure(int state, Vec<int>& set, Vec<BYTE>& seen) const;
+
+public:
+    int classCount;
+
+    explicit RegexCompiler(const RegexParser& parser);
+    // returns the NFA's start state
+    int CompileNfa(int root) { return CompileNode(root, AddState(Nfa_Match, -1)); }
+    void FillClasses(BYTE *classOf, bool caseSensitive) const;
+    bool BuildDfa(int start, Vec<uint16>& transitions, Vec<bool>& accepting) const;
+};
+
+// the equivalence classes are delimited by the start and end of all ranges
+RegexCompiler::RegexCompiler(const RegexParser& parser) : parser(parser), classCount(0)
+{
+    for (size_t i = 0; i < parser.ranges.Count(); i++) {
+        bounds.Append(parser.ranges.At(i).lo);
+        bounds.Append(parser.ranges.At(i).hi + 1);
+    }
+    bounds.Sort(cmpInts);
+    for (size_t i = 1; i < bounds.Count(); ) {
+        if (bounds.At(i) == bounds.At(i - 1))
+            bounds.RemoveAt(i);
+        else
+            i++;
+    }
+    classCount = std::max((int)bounds.Count(), 1);
+}
+
+int RegexCompiler::ClassOfChar(int c) const
+{
+    int lo = 0, hi = (int)bounds.Count() - 1;
+    if (hi < 0 || c < bounds.At(0) || c >= bounds.At(hi))
+        return 0;
+    while (lo + 1 < hi) {
+        int mid = (lo + hi) / 2;
+        if (bounds.At(mid) <= c)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo + 1;
+}
+
+int RegexCompiler::CompileNode(int node, int next)
+{
+    const RegexNode& n = parser.nodes.At(node);
+    switch (n.type) {
+    case Regex_Set: {
+        int state = AddState(Nfa_Set, next);
+        BYTE *classes = states.At(state).classes;
+        for (int i = n.left; i < n.right; i++) {
+            RegexRange r = parser.ranges.At(i);
+            for (int cls = ClassOfChar(r.lo); cls <= ClassOfChar(r.hi); cls++) {
+                classes[cls / 8] |= 1 << (cls % 8);
+            }
+        }
+        return state;
+    }
+    case Regex_Concat:
+        return CompileNode(n.left, CompileNode(n.right, next));
+    case Regex_Alt:
+        return AddState(Nfa_Split, CompileNode(n.left, next), CompileNode(n.right, next));
+    case Regex_Star:
+    case Regex_Plus: {
+        int loop = AddState(Nfa_Split, -1, next);
+        int body = CompileNode(n.left, loop);
+        states.At(loop).out = body;
+        return Regex_Star == n.type ? loop : body;
+    }
+    case Regex_Quest:
+        return AddState(Nfa_Split, CompileNode(n.left, next), next);
+    }
+    CrashIf(true);
+    return next;
+}
+
+void RegexCompiler::FillClasses(BYTE *classOf, bool caseSensitive) const
+{
+    ScopedMem<WCHAR> folded(AllocArray<WCHAR>(65536));
+    for (int c = 0; c < 65536; c++) {
+        folded[c] = (WCHAR)c;
+    }
+    if (!caseSensitive)
+        CharLowerBuff(folded + 1, 65535);
+    classOf[0] = 0;
+    for (int c = 1; c < 65536; c++) {
+        classOf[c] = (BYTE)ClassOfChar(folded[c]);
+    }
+}
+
+// adds the non-split states reachable from state without consuming a char
+void RegexCompiler::AddClosure(int state, Vec<int>& set, Vec<BYTE>& seen) const
+{
+    Vec<int> stack;
+    stack.Append(state);
+    while (stack.Count() > 0) {
+        int s = stack.Pop();
+        if (seen.At(s))
+            continue;
+        seen.At(s) = 1;
+        const NfaState& ns = states.At(s);
+        if (Nfa_Split == ns.type) {
+            stack.Append(ns.out1);
+            stack.Append(ns.out);
+        }
+        else {
+            set.Append(s);
+        }
+    }
+}
+
+static uint32 HashStateSet(Vec<int> *set)
+{
+    uint32 hash = 0;
+    for (int s : *set) {
+        hash = hash * 31 + s;
+    }
+    return hash;
+}
+
+// DFA state 0 is the dead state (no NFA states) and state 1 the start state
+bool RegexCompiler::BuildDfa(int start, Vec<uint16>& transitions, Vec<bool>& accepting) const
+{
+    Vec<Vec<int> *> sets;
+    Vec<uint32> hashes;
+    sets.Append(new Vec<int>());
+    hashes.Append(0);
+    Vec<BYTE> seen;
+    seen.AppendBlanks(states.Count());
+    Vec<int> *startSet = new Vec<int>();
+    AddClosure(start, *startSet, seen);
+    startSet->Sort(cmpInts);
+    sets.Append(startSet);
+    hashes.Append(HashStateSet(startSet));
+    transitions.AppendBlanks(2 * classCount);
+    accepting.AppendBlanks(2);
+
+    bool ok = true;
+    for (size_t i = REGEX_START_STATE; i < sets.Count() && ok; i++) {
+        Vec<int> *set = sets.At(i);
+        for (int s : *set) {
+            if (Nfa_Match == states.At(s).type)
+                accepting.At(i) = true;
+        }
+        // class 0 never matches and thus always leads to the dead state
+        for (int cls = 1; cls < classCount && ok; cls++) {
+            memset(seen.AtPtr(0), 0, seen.Count());
+            Vec<int> *next = new Vec<int>();
+            for (int s : *set) {
+                const NfaState& ns = states.At(s);
+                if (Nfa_Set == ns.type && (ns.classes[cls / 8] & (1 << (cls % 8))))
+                    AddClosure(ns.out, *next, seen);
+            }
+            next->Sort(cmpInts);
+            uint32 hash = HashStateSet(next);
+            size_t j;
+            for (j = 0; j < sets.Count(); j++) {
+                if (hashes.At(j) == hash && sets.At(j)->Count() == next->Count() &&
+                    (0 == next->Count() || 0 == memcmp(sets.At(j)->AtPtr(0), next->AtPtr(0), next->Count() * sizeof(int)))) {
+                    break;
+                }
+            }
+            if (j < sets.Count()) {
+                delete next;
+            }
+            else if (sets.Count() < MAX_REGEX_STATES) {
+                sets.Append(next);
+                hashes.Append(hash);
+                transitions.AppendBlanks(classCount);
+                accepting.Append(false);
+            }
+            else {
+                delete next;
+                ok = false;
+            }
+            transitions.At(i * classCount + cls) = (uint16)j;
+        }
+    }
+    DeleteVecMembers(sets);
+    return ok;
+}
+
+TextRegex *TextRegex::Compile(const WCHAR *pattern, bool caseSensitive)
+{
+    ScopedPtr<TextRegex> re(new TextRegex());
+    if (str::StartsWith(pattern, L"\\b")) {
+        re->wordStart = true;
+        pattern += 2;
+    }
+    ScopedMem<WCHAR> pat(str::Dup(pattern));
+    // the final b must be preceded by an odd number of backslashes
+    size_t len = str::Len(pat), backslashes = 0;
+    for (; backslashes + 1 < len && '\\' == pat[len - 2 - backslashes]; backslashes++)
+        ;
+    if (len >= 2 && 'b' == pat[len - 1] && backslashes % 2 == 1) {
+        re->wordEnd = true;
+        pat[len - 2] = '\0';
+    }
+
+    RegexParser parser(pat, caseSensitive);
+    int root = parser.Parse();
+    if (root < 0)
+        return nullptr;
+    RegexCompiler compiler(parser);
+    if (compiler.classCount > MAX_REGEX_CLASSES)
+        return nullptr;
+    re->classCount = compiler.classCount;
+    compiler.FillClasses(re->classOf, caseSensitive);
+
+    int start = compiler.CompileNfa(root);
+    Vec<uint16> transitions;
+    Vec<bool> accepting;
+    if (!compiler.BuildDfa(start, transitions, accepting))
+        return nullptr;
+    // matching the empty string would match everywhere
+    if (accepting.At(REGEX_START_STATE))
+        return nullptr;
+    re->transitions = transitions.StealData();
+    re->accepting = accepting.StealData();
+    return re.Detach();
+}
+
 TextSearch::TextSearch(BaseEngine *engine, PageTextCache *textCache) :
     TextSelection(engine, textCache),
-    findText(nullptr), anchor(nullptr), pageText(nullptr),
+    findText(nullptr), anchor(nullptr), pageText(nullptr), pageOffsets(nullptr),
     caseSensitive(false), forward(true),
     matchWordStart(false), matchWordEnd(false),
-    findPage(0), findIndex(0), lastText(nullptr)
+    findPage(0), findIndex(0), lastText(nullptr), normalizedText(nullptr), foldedAnchor(nullptr),
+    isRegex(false), regex(nullptr),
+    parallelSearch(false), workerCount(0), aheadPageNo(0)
 {
     findCache = AllocArray<BYTE>(this->engine->PageCount());
+    ZeroMemory(workers, sizeof(workers));
+    ZeroMemory(engineClones, sizeof(engineClones));
 }
 
 TextSearch::~TextSearch()
 {
+    CrashIf(workerCount > 0);
+    for (int i = 0; i < MAX_SEARCH_WORKERS; i++) {
+        delete engineClones[i];
+    }
     Clear();
     free(findCache);
 }
 
+void TextSearch::Clear()
+{
+    str::ReplacePtr(&findText, nullptr);
+    str::ReplacePtr(&anchor, nullptr);
+    str::ReplacePtr(&normalizedText, nullptr);
+    str::ReplacePtr(&foldedAnchor, nullptr);
+    str::ReplacePtr(&lastText, nullptr);
+    delete regex;
+    regex = nullptr;
+    isRegex = false;
+    Reset();
+}
+
 void TextSearch::Reset()
 {
     pageText = nullptr;
+    pageOffsets = nullptr;
     TextSelection::Reset();
 }
 
 void TextSearch::SetText(const WCHAR *text)
 {
+    // search text enclosed in slashes is a regular expression (cf. TextRegex)
+    size_t len = str::Len(text);
+    if (len > 2 && '/' == text[0] && '/' == text[len - 1]) {
+        this->matchWordStart = this->matchWordEnd = false;
+        if (str::Eq(this->lastText, text))
+            return;
+        this->Clear();
+        this->lastText = str::Dup(text);
+        this->findText = str::DupN(text + 1, len - 2);
+        this->isRegex = true;
+        // an invalid pattern just never matches
+        this->regex = TextRegex::Compile(this->findText, caseSensitive);
+        memset(this->findCache, SEARCH_PAGE, this->engine->PageCount());
+        return;
+    }
+
     // search text starting with a single space enables the 'Match word start'
     // and search text ending in a single space enables the 'Match word end' option
     // (that behavior already "kind of" exists without special treatment, but
@@ -71,11 +681,14 @@ void TextSearch::SetText(const WCHAR *text)
         anchor = nullptr;
     else
         anchor = str::DupN(text, 1);
+    if (anchor)
+        foldedAnchor = PageTextCache::Normalize(anchor);
 
     if (str::Len(this->findText) >= INT_MAX)
         this->findText[(unsigned)INT_MAX - 1] = '\0';
     if (str::EndsWith(this->findText, L" "))
         this->findText[str::Len(this->findText) - 1] = '\0';
+    this->normalizedText = PageTextCache::Normalize(this->findText);
 
     memset(this->findCache, SEARCH_PAGE, this->engine->PageCount());
 }
@@ -85,6 +698,11 @@ void TextSearch::SetSensitive(bool sensitive)
     if (caseSensitive == sensitive)
         return;
     this->caseSensitive = sensitive;
+    // regular expressions are compiled for matching case-folded text
+    if (isRegex) {
+        delete regex;
+        regex = TextRegex::Compile(findText, caseSensitive);
+    }
 
     memset(this->findCache, SEARCH_PAGE, this->engine->PageCount());
 }
@@ -99,6 +717,29 @@ void TextSearch::SetDirection(TextSearchDirection direction)
         findIndex += (int)str::Len(findText) * (forward ? 1 : -1);
 }
 
+// converts the match [start, start + len) within GetSearchText's text into glyph indices
+static void GetMatchGlyphs(const int *offsets, int start, int len, int *glyphOut, int *glyphEndOut)
+{
+    *glyphOut = offsets ? offsets[start] : start;
+    *glyphEndOut = offsets ? offsets[start + len - 1] + 1 : start + len;
+}
+
+// returns the index of the first char in GetSearchText's text which doesn't precede glyph
+static int GlyphToIndex(const int *offsets, int len, int glyph)
+{
+    if (!offsets)
+        return glyph;
+    int lo = 0, hi = len;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (offsets[mid] < glyph)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
 void TextSearch::SetLastResult(TextSelection *sel)
 {
     CopySelection(sel);
@@ -108,18 +749,22 @@ void TextSearch::SetLastResult(TextSelection *sel)
     SetText(selection);
 
     findPage = std::min(startPage, endPage);
-    findIndex = (findPage == startPage ? startGlyph : endGlyph) + (int)str::Len(findText);
-    pageText = textCache->GetData(findPage);
+    int glyph = findPage == startPage ? startGlyph : endGlyph;
+    int len = 0;
+    pageText = GetSearchText(findPage, &len, &pageOffsets);
+    findIndex = GlyphToIndex(pageOffsets, len, glyph) + (int)str::Len(caseSensitive ? findText : normalizedText);
     forward = true;
 }
 
 // try to match "findText" from "start" with whitespace tolerance
 // (ignore all whitespace except after alphanumeric characters)
-int TextSearch::MatchLen(const WCHAR *start) const
+int TextSearch::MatchLen(const WCHAR *start, const WCHAR *textStart) const
 {
-    const WCHAR *match = findText, *end = start;
+    const WCHAR *match = caseSensitive ? findText : normalizedText, *end = start;
 
-    if (matchWordStart && start > pageText && isWordChar(start[-1]) && isWordChar(start[0]))
+    if (isRegex)
+        return regex ? regex->MatchLen(start, textStart) : -1;
+    if (matchWordStart && start > textStart && isWordChar(start[-1]) && isWordChar(start[0]))
         return -1;
 
     if (!match)
@@ -128,7 +773,8 @@ int TextSearch::MatchLen(const WCHAR *start) const
     while (*match) {
         if (!*end)
             return -1;
-        if (caseSensitive ? *match == *end : CharLower((LPWSTR)LOWORD(*match)) == CharLower((LPWSTR)LOWORD(*end)))
+        // (case-insensitive searches compare against normalized text, cf. GetSearchText)
+        if (*match == *end)
             /* characters are identical */;
         else if (str::IsWs(*match) && str::IsWs(*end))
             /* treat all whitespace as identical */;
@@ -155,12 +801,71 @@ int TextSearch::MatchLen(const WCHAR *start) const
         }
     }
 
-    if (matchWordEnd && end > pageText && isWordChar(end[-1]) && isWordChar(end[0]))
+    if (matchWordEnd && end > textStart && isWordChar(end[-1]) && isWordChar(end[0]))
         return -1;
 
     return (int)(end - start);
 }
 
+// returns the first occurrence of c in the zero-terminated s or nullptr,
+// comparing 8 WCHARs at a time where SSE2 is available
+static const WCHAR *FindFirstChar(const WCHAR *s, WCHAR c)
+{
+    CrashIf(!c);
+    if (!HasSSE2() || ((UINT_PTR)s & 1) != 0)
+        return str::FindChar(s, c);
+
+    // scalar until s is 16-byte aligned, so that the aligned loads below
+    // never cross into the next memory page after the terminating zero
+    for (; ((UINT_PTR)s & 15) != 0; s++) {
+        if (*s == c)
+            return s;
+        if (!*s)
+            return nullptr;
+    }
+
+    __m128i needle = _mm_set1_epi16((short)c);
+    __m128i zero = _mm_setzero_si128();
+    for (;; s += 8) {
+        __m128i chunk = _mm_load_si128((const __m128i *)s);
+        __m128i hits = _mm_or_si128(_mm_cmpeq_epi16(chunk, needle), _mm_cmpeq_epi16(chunk, zero));
+        int mask = _mm_movemask_epi8(hits);
+        if (mask != 0) {
+            unsigned long idx;
+            _BitScanForward(&idx, mask);
+            s += idx / 2;
+            return *s ? s : nullptr;
+        }
+    }
+}
+
+static const WCHAR *FindSubstring(const WCHAR *s, const WCHAR *find)
+{
+    size_t findLen = str::Len(find);
+    for (s = FindFirstChar(s, find[0]); s; s = FindFirstChar(s + 1, find[0])) {
+        if (str::EqN(s, find, findLen))
+            return s;
+    }
+    return nullptr;
+}
+
+// text must have been returned by GetSearchText
+const WCHAR *TextSearch::FindAnchorForward(const WCHAR *text, int offset) const
+{
+    CrashIf(!anchor);
+    return FindSubstring(text + offset, caseSensitive ? anchor : foldedAnchor);
+}
+
+// case-insensitive searches scan a page's normalized text (cf. PageTextCache::GetNormalizedData)
+// whose chars are mapped to glyphs through offsetsOut (nullptr when searching the page's text)
+const WCHAR *TextSearch::GetSearchText(int pageNo, int *lenOut, const int **offsetsOut)
+{
+    *offsetsOut = nullptr;
+    if (caseSensitive || isRegex)
+        return textCache->GetData(pageNo, lenOut);
+    return textCache->GetNormalizedData(pageNo, lenOut, offsetsOut);
+}
+
 static const WCHAR *GetNextIndex(const WCHAR *base, int offset, bool forward)
 {
     const WCHAR *c = base + offset + (forward ? 0 : -1);
@@ -171,7 +876,7 @@ static const WCHAR *GetNextIndex(const WCHAR *base, int offset, bool forward)
 
 bool TextSearch::FindTextInPage(int pageNo)
 {
-    if (str::IsEmpty(findText))
+    if (str::IsEmpty(findText) || !pageText)
         return false;
     if (!pageNo)
         pageNo = findPage;
@@ -183,18 +888,19 @@ bool TextSearch::FindTextInPage(int pageNo)
         if (!anchor)
             found = GetNextIndex(pageText, findIndex, forward);
         else if (forward)
-            found = (caseSensitive ? StrStr : StrStrI)(pageText + findIndex, anchor);
+            found = FindAnchorForward(pageText, findIndex);
         else
-            found = StrRStrI(pageText, pageText + findIndex, anchor);
+            found = StrRStrI(pageText, pageText + findIndex, caseSensitive ? anchor : foldedAnchor);
         if (!found)
             return false;
         findIndex = (int)(found - pageText) + (forward ? 1 : 0);
-        length = MatchLen(found);
+        length = MatchLen(found, pageText);
     } while (length <= 0);
 
-    int offset = (int)(found - pageText);
-    StartAt(pageNo, offset);
-    SelectUpTo(pageNo, offset + length);
+    int offset = (int)(found - pageText), glyph, glyphEnd;
+    GetMatchGlyphs(pageOffsets, offset, length, &glyph, &glyphEnd);
+    StartAt(pageNo, glyph);
+    SelectUpTo(pageNo, glyphEnd);
     findIndex = offset + (forward ? length : 0);
 
     // try again if the found text is completely outside the page's mediabox
@@ -204,34 +910,176 @@ bool TextSearch::FindTextInPage(int pageNo)
     return true;
 }
 
+// uses the trigrams of already extracted text for ruling out pages without having to
+// search them (as MatchLen never skips whitespace between word characters, each run
+// of word characters in findText must appear unchanged in a page's text)
+bool TextSearch::MightMatchInPage(int pageNo)
+{
+    if (isRegex)
+        return regex != nullptr;
+    const WCHAR *end;
+    for (const WCHAR *s = findText; *s; s = *end ? end + 1 : end) {
+        for (end = s; isnoncjkwordchar(*end); end++)
+            ;
+        if (end - s >= 3 && !textCache->MightContain(pageNo, s, end - s))
+            return false;
+    }
+    return true;
+}
+
+// checks whether a page contains a match at all (without modifying the search state)
+bool TextSearch::HasMatchInPage(int pageNo)
+{
+    if (!MightMatchInPage(pageNo))
+        return false;
+    int len;
+    const int *offsets;
+    const WCHAR *text = GetSearchText(pageNo, &len, &offsets);
+    if (!text)
+        return false;
+
+    for (int offset = 0; offset < len; ) {
+        const WCHAR *found = anchor ? FindAnchorForward(text, offset) : text + offset;
+        if (!found)
+            return false;
+        if (MatchLen(found, text) > 0)
+            return true;
+        offset = (int)(found - text) + 1;
+    }
+    return false;
+}
+
+class TextSearchWorker : public ThreadBase {
+    TextSearch *ts;
+    BaseEngine **clone;
+
+public:
+    TextSearchWorker(TextSearch *ts, BaseEngine **clone) :
+        ThreadBase("TextSearchWorker"), ts(ts), clone(clone) { }
+    virtual void Run() override;
+};
+
+void TextSearchWorker::Run()
+{
+    // cloning the engine on the worker allows for several clones to be created at once
+    if (!*clone)
+        *clone = ts->engine->Clone();
+
+    while (!WasCancelRequested()) {
+        int pageNo = ts->ClaimPageAhead();
+        if (!pageNo)
+            break;
+        ts->ScanPageAhead(pageNo, *clone);
+    }
+}
+
+void TextSearch::StartWorkers(int pageNo)
+{
+    CrashIf(workerCount > 0);
+    int pagesLeft = forward ? engine->PageCount() - pageNo : pageNo - 1;
+    if (!parallelSearch || pagesLeft < MIN_PARALLEL_SEARCH_PAGES)
+        return;
+
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    // the current thread searches as well
+    int count = limitValue((int)si.dwNumberOfProcessors - 1, 0, MAX_SEARCH_WORKERS);
+
+    aheadPageNo = pageNo;
+    for (int i = 0; i < count; i++) {
+        workers[i] = new TextSearchWorker(this, &engineClones[i]);
+        workers[i]->Start();
+    }
+    workerCount = count;
+}
+
+void TextSearch::StopWorkers()
+{
+    for (int i = 0; i < workerCount; i++) {
+        workers[i]->RequestCancel();
+    }
+    for (int i = 0; i < workerCount; i++) {
+        workers[i]->Join();
+        delete workers[i];
+        workers[i] = nullptr;
+    }
+    workerCount = 0;
+}
+
+// returns the next page for a worker to scan (or 0 when all pages have been claimed)
+int TextSearch::ClaimPageAhead()
+{
+    int total = engine->PageCount();
+    for (;;) {
+        int pageNo = forward ? InterlockedIncrement(&aheadPageNo) : InterlockedDecrement(&aheadPageNo);
+        if (pageNo < 1 || pageNo > total)
+            return 0;
+        // note: if FindStartingAtPage has already got this far, the page
+        // is just scanned twice (worker verdicts are never wrong)
+        if (SKIP_PAGE != findCache[pageNo - 1]) {
+            findCache[pageNo - 1] = CLAIMED_PAGE;
+            return pageNo;
+        }
+    }
+}
+
+// extracts a page's text and determines whether it has to be searched at all
+void TextSearch::ScanPageAhead(int pageNo, BaseEngine *clone)
+{
+    // instead of holding up the other pages, a pathologically complex page
+    // is extracted once FindStartingAtPage gets to it
+    if (!textCache->ExtractWithClone(pageNo, clone, SCAN_AHEAD_TIMEOUT_MS)) {
+        findCache[pageNo - 1] = SEARCH_PAGE;
+        return;
+    }
+    findCache[pageNo - 1] = HasMatchInPage(pageNo) ? SEARCH_PAGE : SKIP_PAGE;
+}
+
 bool TextSearch::FindStartingAtPage(int pageNo, ProgressUpdateUI *tracker)
 {
     if (str::IsEmpty(findText))
         return false;
 
     int total = engine->PageCount();
+    bool found = false;
+    StartWorkers(pageNo);
     while (1 <= pageNo && pageNo <= total && (!tracker || !tracker->WasCanceled())) {
         if (tracker)
             tracker->UpdateProgress(pageNo, total);
 
+        // wait for a worker that's already extracting this page's text
+        while (CLAIMED_PAGE == findCache[pageNo - 1] && (!tracker || !tracker->WasCanceled())) {
+            Sleep(1);
+        }
+
         if (SKIP_PAGE == findCache[pageNo - 1]) {
             pageNo += forward ? 1 : -1;
             continue;
         }
+        if (!MightMatchInPage(pageNo)) {
+            findCache[pageNo - 1] = SKIP_PAGE;
+            pageNo += forward ? 1 : -1;
+            continue;
+        }
 
         Reset();
 
-        pageText = textCache->GetData(pageNo, &findIndex);
+        pageText = GetSearchText(pageNo, &findIndex, &pageOffsets);
         if (pageText) {
             if (forward)
                 findIndex = 0;
-            if (FindTextInPage(pageNo))
-                return true;
+            if (FindTextInPage(pageNo)) {
+                found = true;
+                break;
+            }
             findCache[pageNo - 1] = SKIP_PAGE;
         }
 
         pageNo += forward ? 1 : -1;
     }
+    StopWorkers();
+    if (found)
+        return true;
 
     // allow for the first/last page to be included in the next search
     findPage = forward ? total + 1 : 0;
@@ -241,15 +1089,85 @@ bool TextSearch::FindStartingAtPage(int pageNo, ProgressUpdateUI *tracker)
 
 TextSel *TextSearch::FindFirst(int page, const WCHAR *text, ProgressUpdateUI *tracker)
 {
+    etw::Span span("TextSearchFindFirst", etw::KeywordSearch, page);
     SetText(text);
 
+    ScopedTextCachePin pin(textCache);
     if (FindStartingAtPage(page, tracker))
         return &result;
     return nullptr;
 }
 
+int TextSearch::FindAllInPage(int pageNo, TextSearchResults *results)
+{
+    int len;
+    const int *offsets;
+    const WCHAR *text = GetSearchText(pageNo, &len, &offsets);
+    if (!text)
+        return 0;
+
+    // use a separate selection so that FindNext's result is left untouched
+    TextSelection sel(engine, textCache);
+    int count = 0;
+    for (int offset = 0; offset < len; ) {
+        const WCHAR *found = anchor ? FindAnchorForward(text, offset) : text + offset;
+        if (!found)
+            break;
+        int start = (int)(found - text);
+        int length = MatchLen(found, text);
+        if (length <= 0) {
+            offset = start + 1;
+            continue;
+        }
+        int glyph, glyphEnd;
+        GetMatchGlyphs(offsets, start, length, &glyph, &glyphEnd);
+        sel.StartAt(pageNo, glyph);
+        sel.SelectUpTo(pageNo, glyphEnd);
+        // ignore text completely outside the page's mediabox (as FindTextInPage does)
+        if (sel.result.len > 0) {
+            results->Append(pageNo, glyph, glyphEnd - glyph, sel.result);
+            count++;
+        }
+        offset = start + length;
+    }
+    return count;
+}
+
+int TextSearch::FindAll(const WCHAR *text, TextSearchResults *results, ProgressUpdateUI *tracker)
+{
+    SetText(text);
+    if (str::IsEmpty(findText))
+        return 0;
+
+    ScopedTextCachePin pin(textCache);
+    bool wasForward = forward;
+    forward = true;
+    int total = engine->PageCount();
+    int count = 0;
+    // workers scan the pages starting at page 1
+    StartWorkers(0);
+    for (int pageNo = 1; pageNo <= total && (!tracker || !tracker->WasCanceled()); pageNo++) {
+        if (tracker)
+            tracker->UpdateProgress(pageNo, total);
+        while (CLAIMED_PAGE == findCache[pageNo - 1] && (!tracker || !tracker->WasCanceled())) {
+            Sleep(1);
+        }
+        if (SKIP_PAGE == findCache[pageNo - 1] || !MightMatchInPage(pageNo))
+            continue;
+        int found = FindAllInPage(pageNo, results);
+        if (0 == found)
+            findCache[pageNo - 1] = SKIP_PAGE;
+        count += found;
+    }
+    StopWorkers();
+    forward = wasForward;
+
+    return count;
+}
+
 TextSel *TextSearch::FindNext(ProgressUpdateUI *tracker)
 {
+    etw::Span span("TextSearchFindNext", etw::KeywordSearch, findPage);
     CrashIf(!findText);
     if (!findText)
         return nullptr;
@@ -260,9 +1178,76 @@ TextSel *TextSearch::FindNext(ProgressUpdateUI *tracker)
         tracker->UpdateProgress(findPage, engine->PageCount());
     }
 
+    ScopedTextCachePin pin(textCache);
+    // the page's text might have been evicted since the previous search
+    if (pageText && 1 <= findPage && findPage <= engine->PageCount()) {
+        // (this also switches between normalized and original text after SetSensitive)
+        int len = 0;
+        pageText = GetSearchText(findPage, &len, &pageOffsets);
+        findIndex = std::min(findIndex, len);
+    }
     if (FindTextInPage())
         return &result;
     if (FindStartingAtPage(findPage + (forward ? 1 : -1), tracker))
         return &result;
     return nullptr;
 }
+
+TextSearchResults::TextSearchResults()
+{
+    InitializeCriticalSection(&access);
+}
+
+TextSearchResults::~TextSearchResults()
+{
+    DeleteCriticalSection(&access);
+}
+
+size_t TextSearchResults::Count()
+{
+    ScopedCritSec scope(&access);
+    return hits.Count();
+}
+
+bool TextSearchResults::GetHit(size_t idx, TextSearchHit *hitOut)
+{
+    ScopedCritSec scope(&access);
+    if (idx >= hits.Count())
+        return false;
+    *hitOut = hits.At(idx);
+    return true;
+}
+
+void TextSearchResults::GetPageRects(int pageNo, Vec<RectI>& rectsOut)
+{
+    ScopedCritSec scope(&access);
+    // hits are sorted by page, so binary search for the page's first hit
+    size_t lo = 0, hi = hits.Count();
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (hits.At(mid).pageNo < pageNo)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (size_t i = lo; i < hits.Count() && hits.At(i).pageNo == pageNo; i++) {
+        TextSearchHit& hit = hits.At(i);
+        rectsOut.Append(rects.AtPtr(hit.rectsIdx), hit.rectsCount);
+    }
+}
+
+void TextSearchResults::Append(int pageNo, int glyph, int len, const TextSel& sel)
+{
+    ScopedCritSec scope(&access);
+    CrashIf(hits.Count() > 0 && hits.Last().pageNo > pageNo);
+    TextSearchHit hit = { pageNo, glyph, len, (int)rects.Count(), sel.len };
+    hits.Append(hit);
+    rects.Append(sel.rects, sel.len);
+}
+
+void TextSearchResults::Reset()
+{
+    ScopedCritSec scope(&access);
+    hits.Reset();
+    rects.Reset();
+}
@@ -14,8 +14,45 @@ public:
     virtual ~ProgressUpdateUI() { }
 };
 
+struct TextSearchHit {
+    int pageNo;
+    // the match's glyph range in the page's text (cf. PageTextCache::GetData)
+    int glyph, len;
+    // the match's rectangles (in TextSel::rects coordinates) are
+    // TextSearchResults::rects[rectsIdx, rectsIdx + rectsCount)
+    int rectsIdx, rectsCount;
+};
+
+// collects the matches of TextSearch::FindAll in document order;
+// can be read from other threads while the search is still running
+class TextSearchResults
+{
+    Vec<TextSearchHit> hits;
+    Vec<RectI> rects;
+    CRITICAL_SECTION access;
+
+public:
+    TextSearchResults();
+    ~TextSearchResults();
+
+    size_t Count();
+    bool GetHit(size_t idx, TextSearchHit *hitOut);
+    // appends the rectangles of all matches on a page (for highlighting them all at once)
+    void GetPageRects(int pageNo, Vec<RectI>& rectsOut);
+    void Append(int pageNo, int glyph, int len, const TextSel& sel);
+    void Reset();
+};
+
+// upper limit for the number of threads scanning pages ahead of a search
+#define MAX_SEARCH_WORKERS 4
+
+class TextSearchWorker;
+class TextRegex;
+
 class TextSearch : public TextSelection
 {
+    friend TextSearchWorker;
+
 public:
     TextSearch(BaseEngine *engine, PageTextCache *textCache);
     ~TextSearch();
@@ -25,6 +62,13 @@ public:
     void SetLastResult(TextSelection *sel);
     TextSel *FindFirst(int page, const WCHAR *text, ProgressUpdateUI *tracker=nullptr);
     TextSel *FindNext(ProgressUpdateUI *tracker=nullptr);
+    // appends all matches of text to results (while they're being found); returns the
+    // number of matches (note: FindFirst must be called before FindNext afterwards)
+    int FindAll(const WCHAR *text, TextSearchResults *results, ProgressUpdateUI *tracker=nullptr);
+    // lets worker threads extract and scan the pages ahead of the current one, each
+    // using its own clone of engine (only for engines which can be cloned cheaply
+    // and which don't serialize text extraction across instances)
+    void EnableParallelSearch() { parallelSearch = true; }
 
     // note: the result might not be a valid page number!
     int GetCurrentPageNo() const { return findPage; }
@@ -32,6 +76,10 @@ public:
 protected:
     WCHAR *findText;
     WCHAR *anchor;
+    // findText and anchor after PageTextCache::Normalize (for matching
+    // against PageTextCache::GetNormalizedData in case-insensitive searches)
+    WCHAR *normalizedText;
+    WCHAR *foldedAnchor;
     int findPage;
     bool forward;
     bool caseSensitive;
@@ -40,25 +88,42 @@ protected:
     // combining them yields a 'Whole words' search
     bool matchWordStart;
     bool matchWordEnd;
+    // set when findText is a regular expression (nullptr if it's invalid)
+    bool isRegex;
+    TextRegex *regex;
 
     void SetText(const WCHAR *text);
     bool FindTextInPage(int pageNo = 0);
+    bool MightMatchInPage(int pageNo);
     bool FindStartingAtPage(int pageNo, ProgressUpdateUI *tracker);
-    int MatchLen(const WCHAR *start) const;
-
-    void Clear()
-    {
-        str::ReplacePtr(&findText, nullptr);
-        str::ReplacePtr(&anchor, nullptr);
-        str::ReplacePtr(&lastText, nullptr);
-        Reset();
-    }
+    int MatchLen(const WCHAR *start, const WCHAR *textStart) const;
+    const WCHAR *FindAnchorForward(const WCHAR *text, int offset) const;
+    const WCHAR *GetSearchText(int pageNo, int *lenOut, const int **offsetsOut);
+    bool HasMatchInPage(int pageNo);
+    int FindAllInPage(int pageNo, TextSearchResults *results);
+
+    void Clear();
     void Reset();
 
 private:
+    // the text being searched (cf. GetSearchText)
     const WCHAR *pageText;
+    const int *pageOffsets;
     int findIndex;
 
     WCHAR *lastText;
     BYTE *findCache;
+
+    bool parallelSearch;
+    TextSearchWorker *workers[MAX_SEARCH_WORKERS];
+    int workerCount;
+    // reused for all searches (created by the workers when needed)
+    BaseEngine *engineClones[MAX_SEARCH_WORKERS];
+    // the page most recently claimed by a worker
+    LONG aheadPageNo;
+
+    void StartWorkers(int pageNo);
+    void StopWorkers();
+    int ClaimPageAhead();
+    void ScanPageAhead(int pageNo, BaseEngine *clone);
 };
@@ -3,35 +3,632 @@
 
 // utils
 #include "BaseUtil.h"
+#include "FileUtil.h"
+#include "ThreadUtil.h"
+#include "UITask.h"
 // layout controllers
 #include "BaseEngine.h"
 #include "TextSelection.h"
+#include "DebugLog.h"
 
-PageTextCache::PageTextCache(BaseEngine *engine) : engine(engine)
+#define TRIGRAM_BITS 4096
+// the background extraction puts off pages which take longer than this
+#define TEXT_PREFETCH_TIMEOUT_MS 500
+
+/* A text index file consists of a TextIndexHeader followed by a TextIndexPage
+   for every page and the data these point to. All offsets are relative to the
+   start of the file, so that an index could also be used from a memory mapping. */
+#define TEXT_INDEX_MAGIC    0x49545053 /* 'SPTI' */
+// version 3: trigrams of normalized text (cf. NormalizeChar)
+#define TEXT_INDEX_VERSION  3
+
+struct TextIndexHeader {
+    uint32      magic;
+    uint32      version;
+    uint32      pageCount;
+    uint32      indexSize;
+    // the document's size and modification time when the index was created
+    int64       fileSize;
+    FILETIME    fileTime;
+};
+
+struct TextIndexPage {
+    // point to WCHAR[len + 1], a GlyphCoords (or 0) and BYTE[TRIGRAM_BITS / 8]
+    uint32      textOffset;
+    uint32      coordsOffset;
+    uint32      trigramsOffset;
+    uint32      len;
+    uint32      coordsSize;
+};
+
+#define EMPTY_GLYPH_DX 0xFFFF
+
+static inline const GlyphRun *GetRuns(const GlyphCoords *gc)
+{
+    return (const GlyphRun *)(gc + 1);
+}
+
+static inline const GlyphPos *GetPositions(const GlyphCoords *gc)
+{
+    return (const GlyphPos *)(GetRuns(gc) + gc->runCount);
+}
+
+RectI GlyphCoords::At(int glyph) const
+{
+    CrashIf(glyph < 0 || glyph >= glyphCount);
+    if (runCount < 0)
+        return ((const RectI *)(this + 1))[glyph];
+
+    const GlyphPos& pos = GetPositions(this)[glyph];
+    if (EMPTY_GLYPH_DX == pos.dx)
+        return RectI();
+    // find the last run starting at or before glyph
+    const GlyphRun *runs = GetRuns(this);
+    int lo = 0, hi = runCount - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (runs[mid].glyph <= glyph)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return RectI(runs[lo].x + pos.dx, runs[lo].y, pos.width, runs[lo].dy);
+}
+
+size_t GlyphCoords::DataSize() const
+{
+    if (runCount < 0)
+        return sizeof(GlyphCoords) + glyphCount * sizeof(RectI);
+    return sizeof(GlyphCoords) + runCount * sizeof(GlyphRun) + glyphCount * sizeof(GlyphPos);
+}
+
+GlyphCoords *GlyphCoords::Compress(const RectI *coords, int len)
+{
+    if (!coords)
+        return nullptr;
+
+    Vec<GlyphRun> runs;
+    ScopedMem<GlyphPos> positions(AllocArray<GlyphPos>(len + 1));
+    bool isCompact = positions != nullptr;
+    for (int i = 0; i < len && isCompact; i++) {
+        const RectI& rc = coords[i];
+        GlyphRun *run = runs.Count() > 0 ? &runs.Last() : nullptr;
+        if (!rc.x && !rc.y && !rc.dx && !rc.dy) {
+            if (!run) {
+                GlyphRun newRun = { i, 0, 0, 0 };
+                runs.Append(newRun);
+            }
+            positions[i].dx = EMPTY_GLYPH_DX;
+            continue;
+        }
+        if (rc.dx < 0 || rc.dx > 0xFFFF) {
+            isCompact = false;
+            break;
+        }
+        if (!run || rc.y != run->y || rc.dy != run->dy || rc.x < run->x ||
+            (int64)rc.x - run->x >= EMPTY_GLYPH_DX) {
+            GlyphRun newRun = { i, rc.x, rc.y, rc.dy };
+            runs.Append(newRun);
+            run = &runs.Last();
+        }
+        positions[i].dx = (uint16)(rc.x - run->x);
+        positions[i].width = (uint16)rc.dx;
+    }
+
+    GlyphCoords *gc;
+    if (!isCompact) {
+        gc = (GlyphCoords *)malloc(sizeof(GlyphCoords) + len * sizeof(RectI));
+        if (!gc)
+            return nullptr;
+        gc->runCount = -1;
+        memcpy(gc + 1, coords, len * sizeof(RectI));
+    }
+    else {
+        size_t runsSize = runs.Count() * sizeof(GlyphRun);
+        gc = (GlyphCoords *)malloc(sizeof(GlyphCoords) + runsSize + len * sizeof(GlyphPos));
+        if (!gc)
+            return nullptr;
+        gc->runCount = (int)runs.Count();
+        if (runsSize > 0)
+            memcpy(gc + 1, runs.AtPtr(0), runsSize);
+        memcpy((char *)(gc + 1) + runsSize, positions.Get(), len * sizeof(GlyphPos));
+    }
+    gc->glyphCount = len;
+    return gc;
+}
+
+GlyphCoords *GlyphCoords::FromData(const char *data, size_t len, int glyphCount)
+{
+    const GlyphCoords *gc = (const GlyphCoords *)data;
+    if (len < sizeof(GlyphCoords) || gc->glyphCount != glyphCount || gc->runCount < -1 ||
+        gc->runCount > glyphCount || gc->DataSize() != len) {
+        return nullptr;
+    }
+    // At relies on runs being sorted and the first run starting at glyph 0
+    const GlyphRun *runs = GetRuns(gc);
+    if (0 == gc->runCount && glyphCount > 0 || gc->runCount > 0 && runs[0].glyph != 0)
+        return nullptr;
+    for (int i = 1; i < gc->runCount; i++) {
+        if (runs[i].glyph <= runs[i - 1].glyph || runs[i].glyph >= glyphCount)
+            return nullptr;
+    }
+    return (GlyphCoords *)memdup(data, len);
+}
+
+// aim for a few glyphs per cell
+#define GLYPHS_PER_CELL 4
+#define MAX_GRID_CELLS (1 << 16)
+// glyphs overlapping more cells are checked for every query
+#define MAX_CELLS_PER_GLYPH 16
+
+static inline int *GetCenterStarts(const GlyphGrid *gg)
+{
+    return (int *)(gg + 1);
+}
+
+static inline int *GetCenterGlyphs(const GlyphGrid *gg)
+{
+    return GetCenterStarts(gg) + gg->cols * gg->rows + 1;
+}
+
+static inline int *GetAreaStarts(const GlyphGrid *gg)
+{
+    return GetCenterGlyphs(gg) + gg->centerCount;
+}
+
+static inline int *GetAreaGlyphs(const GlyphGrid *gg)
+{
+    return GetAreaStarts(gg) + gg->cols * gg->rows + 1;
+}
+
+static inline int *GetLargeGlyphs(const GlyphGrid *gg)
+{
+    return GetAreaGlyphs(gg) + gg->areaCount;
+}
+
+static inline bool IsEmptyGlyph(const RectI& rc)
+{
+    return !rc.x && !rc.dx;
+}
+
+static inline int GetCellCol(const GlyphGrid *gg, int x)
+{
+    return limitValue((x - gg->left) / gg->cellSize, 0, gg->cols - 1);
+}
+
+static inline int GetCellRow(const GlyphGrid *gg, int y)
+{
+    return limitValue((y - gg->top) / gg->cellSize, 0, gg->rows - 1);
+}
+
+// prefers the smaller index among glyphs at the same distance (as a linear scan does)
+static inline void UpdateClosest(int glyph, unsigned int dist, int *result, unsigned int *maxDist)
+{
+    if (dist < *maxDist || dist == *maxDist && glyph < *result) {
+        *result = glyph;
+        *maxDist = dist;
+    }
+}
+
+int GlyphGrid::FindClosest(const GlyphCoords *coords, double x, double y) const
+{
+    PointI pti = PointD(x, y).ToInt();
+    int result = -1;
+    unsigned int maxDist = UINT_MAX;
+
+    // prefer glyphs the cursor is actually over
+    int right = left + (cols * cellSize - 1), bottom = top + (rows * cellSize - 1);
+    if (left <= pti.x && pti.x <= right && top <= pti.y && pti.y <= bottom) {
+        int cell = GetCellRow(this, pti.y) * cols + GetCellCol(this, pti.x);
+        const int *starts = GetAreaStarts(this), *glyphs = GetAreaGlyphs(this);
+        for (int i = starts[cell]; i < starts[cell + 1]; i++) {
+            RectI rc = coords->At(glyphs[i]);
+            if (rc.Contains(pti))
+                UpdateClosest(glyphs[i], distSq((int)x - rc.x - rc.dx / 2, (int)y - rc.y - rc.dy / 2), &result, &maxDist);
+        }
+    }
+    for (int i = 0; i < largeCount; i++) {
+        int glyph = GetLargeGlyphs(this)[i];
+        RectI rc = coords->At(glyph);
+        if (rc.Contains(pti))
+            UpdateClosest(glyph, distSq((int)x - rc.x - rc.dx / 2, (int)y - rc.y - rc.dy / 2), &result, &maxDist);
+    }
+    if (result != -1)
+        return result;
+
+    // else search for the closest glyph center in rings of cells around the cursor
+    // (centers in ring r + 1 are at least r * cellSize away from the cursor)
+    int col = GetCellCol(this, (int)x), row = GetCellRow(this, (int)y);
+    const int *starts = GetCenterStarts(this), *glyphs = GetCenterGlyphs(this);
+    for (int r = 0; r < std::max(cols, rows); r++) {
+        int64 minDist = (int64)std::max(r - 1, 0) * cellSize;
+        if (result != -1 && minDist * minDist > (int64)maxDist)
+            break;
+        for (int cy = std::max(row - r, 0); cy <= std::min(row + r, rows - 1); cy++) {
+            // only visit the ring's border
+            int step = cy == row - r || cy == row + r ? 1 : 2 * r;
+            for (int cx = col - r; cx <= col + r; cx += std::max(step, 1)) {
+                if (cx < 0 || cx >= cols)
+                    continue;
+                int cell = cy * cols + cx;
+                for (int i = starts[cell]; i < starts[cell + 1]; i++) {
+                    RectI rc = coords->At(glyphs[i]);
+                    UpdateClosest(glyphs[i], distSq((int)x - rc.x - rc.dx / 2, (int)y - rc.y - rc.dy / 2), &result, &maxDist);
+                }
+            }
+        }
+    }
+    return result;
+}
+
+size_t GlyphGrid::DataSize() const
+{
+    return sizeof(GlyphGrid) + (2 * (cols * rows + 1) + centerCount + areaCount + largeCount) * sizeof(int);
+}
+
+GlyphGrid *GlyphGrid::Build(const GlyphCoords *coords)
+{
+    if (!coords)
+        return nullptr;
+
+    // the grid covers the bounding box of all glyphs (including their right/bottom edges)
+    // (RectI::Union ignores glyphs without an extent, which must be covered as well)
+    int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+    int count = 0;
+    for (int i = 0; i < coords->glyphCount; i++) {
+        RectI rc = coords->At(i);
+        if (IsEmptyGlyph(rc))
+            continue;
+        if (rc.dx < 0 || rc.dy < 0)
+            return nullptr;
+        x0 = count ? std::min(x0, rc.x) : rc.x;
+        y0 = count ? std::min(y0, rc.y) : rc.y;
+        x1 = count ? std::max(x1, rc.x + rc.dx) : rc.x + rc.dx;
+        y1 = count ? std::max(y1, rc.y + rc.dy) : rc.y + rc.dy;
+        count++;
+    }
+    int64 width = (int64)x1 - x0 + 1, height = (int64)y1 - y0 + 1;
+    double size = ceil(sqrt((double)width * height * GLYPHS_PER_CELL / std::max(count, 1)));
+    int cellSize = (int)limitValue(size, 1.0, (double)(INT_MAX / 4));
+    while (((width - 1) / cellSize + 1) * ((height - 1) / cellSize + 1) > MAX_GRID_CELLS) {
+        cellSize *= 2;
+    }
+    int cols = (int)((width - 1) / cellSize + 1), rows = (int)((height - 1) / cellSize + 1);
+    if ((int64)cols * cellSize > INT_MAX / 2 || (int64)rows * cellSize > INT_MAX / 2)
+        return nullptr;
+
+    GlyphGrid tmp = { x0, y0, cellSize, cols, rows, 0, 0, 0 };
+    int cellCount = cols * rows;
+    ScopedMem<int> centerCounts(AllocArray<int>(cellCount + 1));
+    ScopedMem<int> areaCounts(AllocArray<int>(cellCount + 1));
+    if (!centerCounts || !areaCounts)
+        return nullptr;
+
+    // first count the lists' lengths...
+    for (int i = 0; i < coords->glyphCount; i++) {
+        RectI rc = coords->At(i);
+        if (IsEmptyGlyph(rc))
+            continue;
+        centerCounts[GetCellRow(&tmp, rc.y + rc.dy / 2) * cols + GetCellCol(&tmp, rc.x + rc.dx / 2)]++;
+        tmp.centerCount++;
+        int col0 = GetCellCol(&tmp, rc.x), col1 = GetCellCol(&tmp, rc.x + rc.dx);
+        int row0 = GetCellRow(&tmp, rc.y), row1 = GetCellRow(&tmp, rc.y + rc.dy);
+        if ((col1 - col0 + 1) * (row1 - row0 + 1) > MAX_CELLS_PER_GLYPH) {
+            tmp.largeCount++;
+            continue;
+        }
+        for (int row = row0; row <= row1; row++) {
+            for (int col = col0; col <= col1; col++) {
+                areaCounts[row * cols + col]++;
+            }
+        }
+        tmp.areaCount += (col1 - col0 + 1) * (row1 - row0 + 1);
+    }
+
+    GlyphGrid *gg = (GlyphGrid *)malloc(tmp.DataSize());
+    if (!gg)
+        return nullptr;
+    *gg = tmp;
+    // ...then fill them in (with the glyphs in ascending order)
+    int *centerStarts = GetCenterStarts(gg), *areaStarts = GetAreaStarts(gg);
+    centerStarts[0] = areaStarts[0] = 0;
+    for (int i = 0; i < cellCount; i++) {
+        centerStarts[i + 1] = centerStarts[i] + centerCounts[i];
+        areaStarts[i + 1] = areaStarts[i] + areaCounts[i];
+        centerCounts[i] = centerStarts[i];
+        areaCounts[i] = areaStarts[i];
+    }
+    int largeCount = 0;
+    for (int i = 0; i < coords->glyphCount; i++) {
+        RectI rc = coords->At(i);
+        if (IsEmptyGlyph(rc))
+            continue;
+        GetCenterGlyphs(gg)[centerCounts[GetCellRow(gg, rc.y + rc.dy / 2) * cols + GetCellCol(gg, rc.x + rc.dx / 2)]++] = i;
+        int col0 = GetCellCol(gg, rc.x), col1 = GetCellCol(gg, rc.x + rc.dx);
+        int row0 = GetCellRow(gg, rc.y), row1 = GetCellRow(gg, rc.y + rc.dy);
+        if ((col1 - col0 + 1) * (row1 - row0 + 1) > MAX_CELLS_PER_GLYPH) {
+            GetLargeGlyphs(gg)[largeCount++] = i;
+            continue;
+        }
+        for (int row = row0; row <= row1; row++) {
+            for (int col = col0; col <= col1; col++) {
+                GetAreaGlyphs(gg)[areaCounts[row * cols + col]++] = i;
+            }
+        }
+    }
+    return gg;
+}
+
+// the most chars NormalizeChar produces for a single char
+#define MAX_NORMALIZED_CHARS 4
+
+// folds case, removes diacritics (e.g. e-acute becomes e) and expands ligatures
+// (e.g. U+FB01 becomes fi) and typographic dashes and quotes, so that text
+// matches what users usually type into the find box
+static int NormalizeChar(WCHAR c, WCHAR *out)
+{
+    if (c < 0x80) {
+        out[0] = 'A' <= c && c <= 'Z' ? c + ('a' - 'A') : c;
+        return 1;
+    }
+    // HYPHEN, NON-BREAKING HYPHEN, FIGURE DASH, EN DASH and EM DASH
+    if (0x2010 <= c && c <= 0x2014) {
+        out[0] = '-';
+        return 1;
+    }
+    // LEFT/RIGHT SINGLE and DOUBLE QUOTATION MARKS
+    if (0x2018 <= c && c <= 0x201b) {
+        out[0] = '\'';
+        return 1;
+    }
+    if (0x201c <= c && c <= 0x201f) {
+        out[0] = '"';
+        return 1;
+    }
+
+    WCHAR expanded[8];
+    int count = FoldString(MAP_EXPAND_LIGATURES, &c, 1, expanded, dimof(expanded));
+    if (count <= 0) {
+        expanded[0] = c;
+        count = 1;
+    }
+    int len = 0;
+    for (int i = 0; i < count && len < MAX_NORMALIZED_CHARS; i++) {
+        WCHAR decomposed[8];
+        int n = FoldString(MAP_COMPOSITE | MAP_FOLDCZONE, &expanded[i], 1, decomposed, dimof(decomposed));
+        if (n <= 0) {
+            decomposed[0] = expanded[i];
+            n = 1;
+        }
+        // keep the base character but drop all combining diacritical marks
+        for (int j = 0; j < n && len < MAX_NORMALIZED_CHARS; j++) {
+            if (0 == j || decomposed[j] < 0x0300 || decomposed[j] > 0x036F)
+                out[len++] = decomposed[j];
+        }
+    }
+    CharLowerBuff(out, len);
+    return len;
+}
+
+struct NormalizedText {
+    int len;
+    // the glyph index for each char of text (followed by the original text's length)
+    int *offsets;
+    WCHAR *text;
+
+    size_t DataSize() const {
+        return sizeof(NormalizedText) + (len + 1) * (sizeof(int) + sizeof(WCHAR));
+    }
+};
+
+// allocates the NormalizedText with its offsets and text in a single block
+static NormalizedText *NormalizeText(const WCHAR *s, int len)
+{
+    Vec<WCHAR> chars(len + 1);
+    Vec<int> offsets(len + 1);
+    WCHAR buf[MAX_NORMALIZED_CHARS];
+    for (int i = 0; i < len; i++) {
+        int count = NormalizeChar(s[i], buf);
+        chars.Append(buf, count);
+        for (int j = 0; j < count; j++) {
+            offsets.Append(i);
+        }
+    }
+    offsets.Append(len);
+
+    int count = (int)chars.Count();
+    NormalizedText *nt = (NormalizedText *)malloc(sizeof(NormalizedText) + (count + 1) * (sizeof(int) + sizeof(WCHAR)));
+    if (!nt)
+        return nullptr;
+    nt->len = count;
+    nt->offsets = (int *)(nt + 1);
+    nt->text = (WCHAR *)(nt->offsets + count + 1);
+    memcpy(nt->offsets, offsets.LendData(), (count + 1) * sizeof(int));
+    memcpy(nt->text, chars.LendData(), count * sizeof(WCHAR));
+    nt->text[count] = '\0';
+    return nt;
+}
+
+// collects the trigrams of all runs of non-whitespace characters after normalizing
+// them, which covers all trigrams TextSearch::MatchLen could match in normalized
+// text (since it never skips whitespace between word characters)
+static BYTE *BuildTrigrams(const WCHAR *s, int len)
+{
+    BYTE *bits = AllocArray<BYTE>(TRIGRAM_BITS / 8);
+    if (!bits)
+        return nullptr;
+    WCHAR c1 = 0, c2 = 0;
+    int run = 0;
+    for (int i = 0; i < len; i++) {
+        if (str::IsWs(s[i])) {
+            run = 0;
+            continue;
+        }
+        WCHAR chars[MAX_NORMALIZED_CHARS];
+        int count = NormalizeChar(s[i], chars);
+        for (int j = 0; j < count; j++) {
+            WCHAR c3 = chars[j];
+            if (++run >= 3) {
+                uint32 hash = ((uint32)c1 * 961 + (uint32)c2 * 31 + c3) * 2654435761U;
+                uint32 bit = (hash >> 16) % TRIGRAM_BITS;
+                bits[bit / 8] |= 1 << (bit % 8);
+            }
+            c1 = c2;
+            c2 = c3;
+        }
+    }
+    return bits;
+}
+
+static bool IsInIndex(uint32 offset, size_t len, size_t indexSize)
+{
+    return offset <= indexSize && len <= indexSize - offset;
+}
+
+// all PageTextCaches share a single memory budget
+struct TextCacheRegistry {
+    CRITICAL_SECTION access;
+    Vec<PageTextCache *> caches;
+
+    TextCacheRegistry() { InitializeCriticalSection(&access); }
+    ~TextCacheRegistry() { DeleteCriticalSection(&access); }
+};
+
+static TextCacheRegistry gTextCaches;
+// sum of all caches' cacheBytes
+static LONG gTextCacheBytes = 0;
+static LONG gMaxTextCacheBytes = 64 * 1024 * 1024;
+static LONG gEvictionPending = 0;
+
+static void RequestEviction()
+{
+    if (gTextCacheBytes > gMaxTextCacheBytes && 0 == InterlockedExchange(&gEvictionPending, 1))
+        uitask::Post([] { PageTextCache::EvictPages(); });
+}
+
+class TextPrefetchThread : public ThreadBase {
+    PageTextCache *tc;
+    int startPageNo;
+    ScopedMem<WCHAR> indexPath;
+
+public:
+    TextPrefetchThread(PageTextCache *tc, int startPageNo, const WCHAR *indexPath) :
+        ThreadBase("TextPrefetchThread"), tc(tc), startPageNo(startPageNo),
+        indexPath(str::Dup(indexPath)) { }
+    virtual void Run() override;
+};
+
+void TextPrefetchThread::Run()
+{
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_IDLE);
+
+    // extracting pages that haven't arrived yet would only fail
+    while (tc->engine->IsLoadingProgressively() && !WasCancelRequested()) {
+        Sleep(100);
+    }
+
+    // with a valid index, the content streams don't have to be parsed at all
+    // (pages are loaded from the index when they're needed)
+    if (indexPath && tc->MapIndex(indexPath))
+        return;
+    // saving an index requires the text of all pages at once
+    if (indexPath)
+        tc->Pin();
+
+    int pageCount = tc->engine->PageCount();
+    // pages which took longer than TEXT_PREFETCH_TIMEOUT_MS are extracted
+    // once all other pages are done (unless they're needed earlier)
+    Vec<int> slowPages;
+    // visit startPageNo, startPageNo + 1, startPageNo - 1, startPageNo + 2, ...
+    for (int i = 0; i < 2 * pageCount && !WasCancelRequested(); i++) {
+        int pageNo = startPageNo + (i % 2 ? (i + 1) / 2 : -(i / 2));
+        if (pageNo < 1 || pageNo > pageCount || tc->HasData(pageNo))
+            continue;
+        // prefetching beyond the memory limit would only evict other pages
+        if (!indexPath && gTextCacheBytes > gMaxTextCacheBytes)
+            break;
+        // yield to whoever needs text right away
+        while (tc->foregroundRequests > 0 && !WasCancelRequested()) {
+            Sleep(10);
+        }
+        if (!WasCancelRequested() && !tc->ExtractData(pageNo, nullptr, TEXT_PREFETCH_TIMEOUT_MS))
+            slowPages.Append(pageNo);
+    }
+    for (size_t i = 0; i < slowPages.Count() && !WasCancelRequested(); i++) {
+        if (tc->HasData(slowPages.At(i)))
+            continue;
+        if (!indexPath && gTextCacheBytes > gMaxTextCacheBytes)
+            break;
+        while (tc->foregroundRequests > 0 && !WasCancelRequested()) {
+            Sleep(10);
+        }
+        if (!WasCancelRequested())
+            tc->ExtractData(slowPages.At(i));
+    }
+
+    if (indexPath) {
+        if (!WasCancelRequested() && tc->SaveIndex(indexPath))
+            tc->MapIndex(indexPath);
+        tc->Unpin();
+    }
+}
+
+PageTextCache::PageTextCache(BaseEngine *engine) : engine(engine),
+    cacheBytes(0), pinCount(0), indexFile(INVALID_HANDLE_VALUE), indexMapping(nullptr),
+    indexData(nullptr), foregroundRequests(0), cachedCount(0), prefetcher(nullptr)
 {
     int count = engine->PageCount();
-    coords = AllocArray<RectI *>(count);
+    coords = AllocArray<GlyphCoords *>(count);
     text = AllocArray<WCHAR *>(count);
     lens = AllocArray<int>(count);
-#ifdef DEBUG
-    debug_size = count * (sizeof(RectI *) + sizeof(WCHAR *) + sizeof(int));
-#endif
+    trigrams = AllocArray<BYTE *>(count);
+    normalized = AllocArray<NormalizedText *>(count);
+    grids = AllocArray<GlyphGrid *>(count);
+    lastUsed = AllocArray<DWORD>(count);
 
     InitializeCriticalSection(&access);
+
+    ScopedCritSec scope(&gTextCaches.access);
+    gTextCaches.caches.Append(this);
 }
 
 PageTextCache::~PageTextCache()
 {
+    EnterCriticalSection(&gTextCaches.access);
+    gTextCaches.caches.Remove(this);
+    LeaveCriticalSection(&gTextCaches.access);
+
+    if (prefetcher) {
+        prefetcher->RequestCancel();
+        prefetcher->Join();
+        delete prefetcher;
+    }
+
     EnterCriticalSection(&access);
 
     for (int i = 0; i < engine->PageCount(); i++) {
         free(coords[i]);
         free(text[i]);
+        free(trigrams[i]);
+        free(normalized[i]);
+        free(grids[i]);
     }
 
     free(coords);
     free(text);
     free(lens);
+    free(trigrams);
+    free(normalized);
+    free(grids);
+    free(lastUsed);
+    InterlockedExchangeAdd(&gTextCacheBytes, -(LONG)cacheBytes);
+
+    if (indexData)
+        UnmapViewOfFile(indexData);
+    if (indexMapping)
+        CloseHandle(indexMapping);
+    if (indexFile != INVALID_HANDLE_VALUE)
+        CloseHandle(indexFile);
 
     LeaveCriticalSection(&access);
     DeleteCriticalSection(&access);
@@ -43,24 +640,371 @@ bool PageTextCache::HasData(int pageNo)
     return text[pageNo - 1] != nullptr;
 }
 
-const WCHAR *PageTextCache::GetData(int pageNo, int *lenOut, RectI **coordsOut)
+// the text is extracted without holding access, so that requests for
+// other pages don't have to wait (extracted data is only freed on the
+// UI thread while the cache isn't pinned, so callers may use it without
+// holding access)
+// returns false if the text couldn't be extracted within timeoutMs
+// (pathologically complex pages are then left for a later request without time limit)
+bool PageTextCache::ExtractData(int pageNo, BaseEngine *fromEngine, DWORD timeoutMs)
+{
+    if (indexData && LoadIndexPage(pageNo))
+        return true;
+
+    if (!fromEngine)
+        fromEngine = engine;
+    ScopedMemTraceTag memTag(MemTag_TextCache);
+    RectI *rawCoords = nullptr;
+    WCHAR *newText;
+    if (INFINITE == timeoutMs) {
+        newText = fromEngine->ExtractPageText(pageNo, L"\n", &rawCoords);
+    }
+    else {
+        bool partial = false;
+        newText = fromEngine->ExtractPageTextLimited(pageNo, L"\n", &rawCoords, timeoutMs, &partial);
+        // searching and selecting partial text would be misleading
+        if (partial) {
+            free(newText);
+            free(rawCoords);
+            return false;
+        }
+    }
+    // try again once the page's data has arrived (cf. GetData)
+    if (!newText && fromEngine->IsLoadingProgressively())
+        return true;
+    int newLen = newText ? (int)str::Len(newText) : 0;
+    if (!newText)
+        newText = str::Dup(L"");
+    GlyphCoords *newCoords = GlyphCoords::Compress(rawCoords, newLen);
+    free(rawCoords);
+    BYTE *newTrigrams = BuildTrigrams(newText, newLen);
+
+    StoreData(pageNo, newText, newLen, newCoords, newTrigrams);
+    RequestEviction();
+    return true;
+}
+
+// takes ownership of the data (which is freed if the page has been stored concurrently)
+bool PageTextCache::StoreData(int pageNo, WCHAR *newText, int newLen, GlyphCoords *newCoords, BYTE *newTrigrams)
 {
     ScopedCritSec scope(&access);
+    if (text[pageNo - 1]) {
+        free(newText);
+        free(newCoords);
+        free(newTrigrams);
+        return false;
+    }
+    coords[pageNo - 1] = newCoords;
+    lens[pageNo - 1] = newLen;
+    trigrams[pageNo - 1] = newTrigrams;
+    // set last, as HasData checks it without holding access
+    text[pageNo - 1] = newText;
+    cachedCount++;
 
-    if (!text[pageNo - 1]) {
-        text[pageNo - 1] = engine->ExtractPageText(pageNo, L"\n", &coords[pageNo - 1]);
-        if (!text[pageNo - 1]) {
-            text[pageNo - 1] = str::Dup(L"");
-            lens[pageNo - 1] = 0;
+    size_t bytes = GetPageBytes(pageNo);
+    cacheBytes += bytes;
+    InterlockedExchangeAdd(&gTextCacheBytes, (LONG)bytes);
+    return true;
+}
+
+// approximate amount of memory used for a page that's been stored
+size_t PageTextCache::GetPageBytes(int pageNo)
+{
+    int i = pageNo - 1;
+    size_t bytes = (lens[i] + 1) * sizeof(WCHAR);
+    if (normalized[i])
+        bytes += normalized[i]->DataSize();
+    if (coords[i])
+        bytes += coords[i]->DataSize();
+    if (trigrams[i])
+        bytes += TRIGRAM_BITS / 8;
+    if (grids[i])
+        bytes += grids[i]->DataSize();
+    return bytes;
+}
+
+void PageTextCache::EvictPage(int pageNo)
+{
+    ScopedCritSec scope(&access);
+    int i = pageNo - 1;
+    if (pinCount > 0 || !text[i])
+        return;
+
+    size_t bytes = GetPageBytes(pageNo);
+    cacheBytes -= bytes;
+    InterlockedExchangeAdd(&gTextCacheBytes, -(LONG)bytes);
+    cachedCount--;
+
+    // reset text first, as HasData checks it without holding access
+    WCHAR *oldText = text[i];
+    text[i] = nullptr;
+    free(oldText);
+    free(coords[i]);
+    coords[i] = nullptr;
+    free(trigrams[i]);
+    trigrams[i] = nullptr;
+    free(normalized[i]);
+    normalized[i] = nullptr;
+    free(grids[i]);
+    grids[i] = nullptr;
+    lens[i] = 0;
+}
+
+void PageTextCache::EvictAll()
+{
+    for (int pageNo = 1; pageNo <= engine->PageCount(); pageNo++) {
+        EvictPage(pageNo);
+    }
+}
+
+void PageTextCache::CopyUnchangedPages(PageTextCache *prev, const int *prevPageNos)
+{
+    ScopedCritSec scope(&prev->access);
+    for (int i = 0; i < engine->PageCount(); i++) {
+        int prevPageNo = prevPageNos[i];
+        if (!prevPageNo || !prev->HasData(prevPageNo) || HasData(i + 1))
+            continue;
+        int j = prevPageNo - 1;
+        WCHAR *pageText = (WCHAR *)memdup(prev->text[j], (prev->lens[j] + 1) * sizeof(WCHAR));
+        GlyphCoords *pageCoords = nullptr;
+        if (prev->coords[j])
+            pageCoords = (GlyphCoords *)memdup(prev->coords[j], prev->coords[j]->DataSize());
+        BYTE *pageTrigrams = nullptr;
+        if (prev->trigrams[j])
+            pageTrigrams = (BYTE *)memdup(prev->trigrams[j], TRIGRAM_BITS / 8);
+        if (!pageText || prev->coords[j] && !pageCoords || prev->trigrams[j] && !pageTrigrams) {
+            free(pageText);
+            free(pageCoords);
+            free(pageTrigrams);
+            continue;
         }
-        else {
-            lens[pageNo - 1] = (int)str::Len(text[pageNo - 1]);
+        StoreData(i + 1, pageText, prev->lens[j], pageCoords, pageTrigrams);
+    }
+    RequestEviction();
+}
+
+void PageTextCache::Pin()
+{
+    ScopedCritSec scope(&access);
+    pinCount++;
+}
+
+void PageTextCache::Unpin()
+{
+    EnterCriticalSection(&access);
+    CrashIf(pinCount <= 0);
+    pinCount--;
+    LeaveCriticalSection(&access);
+    RequestEviction();
+}
+
+void PageTextCache::SetMaxMemory(size_t maxBytes)
+{
+    gMaxTextCacheBytes = (LONG)std::min(maxBytes, (size_t)(INT_MAX / 2));
+    RequestEviction();
+}
+
+struct EvictionCandidate {
+    PageTextCache *tc;
+    int pageNo;
+    // time since the page's most recent use
+    DWORD age;
+};
+
+static int cmpEvictionCandidates(const void *a, const void *b)
+{
+    DWORD ageA = ((const EvictionCandidate *)a)->age, ageB = ((const EvictionCandidate *)b)->age;
+    return ageA > ageB ? -1 : ageA < ageB ? 1 : 0;
+}
+
+void PageTextCache::EvictPages()
+{
+    InterlockedExchange(&gEvictionPending, 0);
+
+    ScopedCritSec scope(&gTextCaches.access);
+    if (gTextCacheBytes <= gMaxTextCacheBytes)
+        return;
+
+    DWORD now = GetTickCount();
+    Vec<EvictionCandidate> candidates;
+    for (PageTextCache *tc : gTextCaches.caches) {
+        ScopedCritSec scope2(&tc->access);
+        if (tc->pinCount > 0)
+            continue;
+        for (int i = 0; i < tc->engine->PageCount(); i++) {
+            if (tc->text[i]) {
+                EvictionCandidate c = { tc, i + 1, now - tc->lastUsed[i] };
+                candidates.Append(c);
+            }
+        }
+    }
+    candidates.Sort(cmpEvictionCandidates);
+
+    // evict down to 3/4 of the limit, so that eviction isn't needed for every new page
+    LONG target = gMaxTextCacheBytes / 4 * 3;
+    for (size_t i = 0; i < candidates.Count() && gTextCacheBytes > target; i++) {
+        candidates.At(i).tc->EvictPage(candidates.At(i).pageNo);
+    }
+}
+
+static bool IsValidIndex(const char *data, size_t size, int count, const WCHAR *filePath)
+{
+    if (size < sizeof(TextIndexHeader))
+        return false;
+    const TextIndexHeader *hdr = (const TextIndexHeader *)data;
+    if (hdr->magic != TEXT_INDEX_MAGIC || hdr->version != TEXT_INDEX_VERSION ||
+        hdr->pageCount != (uint32)count || hdr->indexSize != size ||
+        (size - sizeof(TextIndexHeader)) / sizeof(TextIndexPage) < (size_t)count) {
+        return false;
+    }
+    // the document mustn't have changed since the index was created
+    FILETIME fileTime = file::GetModificationTime(filePath);
+    if (hdr->fileSize != file::GetSize(filePath) || CompareFileTime(&hdr->fileTime, &fileTime) != 0)
+        return false;
+
+    // validate all pages before using any of them
+    const TextIndexPage *pages = (const TextIndexPage *)(hdr + 1);
+    for (int i = 0; i < count; i++) {
+        const TextIndexPage& page = pages[i];
+        if (page.len >= INT_MAX / sizeof(RectI) ||
+            !IsInIndex(page.textOffset, (page.len + 1) * sizeof(WCHAR), size) ||
+            page.coordsOffset && !IsInIndex(page.coordsOffset, page.coordsSize, size) ||
+            !IsInIndex(page.trigramsOffset, TRIGRAM_BITS / 8, size) ||
+            ((const WCHAR *)(data + page.textOffset))[page.len] != '\0') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the index remains mapped until the cache is destroyed
+bool PageTextCache::MapIndex(const WCHAR *indexPath)
+{
+    const WCHAR *filePath = engine->FileName();
+    if (!filePath || indexData)
+        return false;
+
+    HANDLE hFile = CreateFile(indexPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (INVALID_HANDLE_VALUE == hFile)
+        return false;
+    LARGE_INTEGER size;
+    HANDLE hMap = nullptr;
+    const char *data = nullptr;
+    if (GetFileSizeEx(hFile, &size) && size.QuadPart <= INT_MAX)
+        hMap = CreateFileMapping(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (hMap)
+        data = (const char *)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+    if (!data || !IsValidIndex(data, (size_t)size.QuadPart, engine->PageCount(), filePath)) {
+        if (data)
+            UnmapViewOfFile(data);
+        if (hMap)
+            CloseHandle(hMap);
+        CloseHandle(hFile);
+        return false;
+    }
+
+    ScopedCritSec scope(&access);
+    indexFile = hFile;
+    indexMapping = hMap;
+    indexData = data;
+    return true;
+}
+
+bool PageTextCache::LoadIndexPage(int pageNo)
+{
+    CrashIf(!indexData);
+    const TextIndexHeader *hdr = (const TextIndexHeader *)indexData;
+    const TextIndexPage& page = ((const TextIndexPage *)(hdr + 1))[pageNo - 1];
+    WCHAR *pageText = (WCHAR *)memdup(indexData + page.textOffset, (page.len + 1) * sizeof(WCHAR));
+    GlyphCoords *pageCoords = nullptr;
+    if (page.coordsOffset)
+        pageCoords = GlyphCoords::FromData(indexData + page.coordsOffset, page.coordsSize, (int)page.len);
+    BYTE *pageTrigrams = (BYTE *)memdup(indexData + page.trigramsOffset, TRIGRAM_BITS / 8);
+    if (!pageText || page.coordsOffset && !pageCoords || !pageTrigrams) {
+        // leave the page to the engine
+        free(pageText);
+        free(pageCoords);
+        free(pageTrigrams);
+        return false;
+    }
+    StoreData(pageNo, pageText, (int)page.len, pageCoords, pageTrigrams);
+    RequestEviction();
+    return true;
+}
+
+// only saves the index once the text of all pages has been extracted
+bool PageTextCache::SaveIndex(const WCHAR *indexPath)
+{
+    const WCHAR *filePath = engine->FileName();
+    if (!filePath)
+        return false;
+    int count = engine->PageCount();
+    for (int i = 0; i < count; i++) {
+        if (!HasData(i + 1))
+            return false;
+    }
+
+    TextIndexHeader hdr = { 0 };
+    hdr.magic = TEXT_INDEX_MAGIC;
+    hdr.version = TEXT_INDEX_VERSION;
+    hdr.pageCount = count;
+    hdr.fileSize = file::GetSize(filePath);
+    hdr.fileTime = file::GetModificationTime(filePath);
+
+    // the cache is pinned while the index is created, so access isn't needed
+    // (note: Vec limits the index's size to INT_MAX, so that offsets fit an uint32)
+    Vec<char> data;
+    data.AppendBlanks(sizeof(TextIndexHeader) + count * sizeof(TextIndexPage));
+    for (int i = 0; i < count; i++) {
+        TextIndexPage page = { 0 };
+        page.len = lens[i];
+        // GlyphCoords and WCHAR data stays aligned, as data.Size() is always a multiple of 4
+        if (coords[i]) {
+            page.coordsOffset = (uint32)data.Size();
+            page.coordsSize = (uint32)coords[i]->DataSize();
+            if (!data.AppendChecked((const char *)coords[i], page.coordsSize))
+                return false;
         }
-#ifdef DEBUG
-        debug_size += (lens[pageNo - 1] + 1) * (sizeof(WCHAR) + sizeof(RectI));
-#endif
+        page.trigramsOffset = (uint32)data.Size();
+        if (trigrams[i])
+            data.Append((const char *)trigrams[i], TRIGRAM_BITS / 8);
+        else
+            memset(data.AppendBlanks(TRIGRAM_BITS / 8), 0xFF, TRIGRAM_BITS / 8);
+        page.textOffset = (uint32)data.Size();
+        if (!data.AppendChecked((const char *)text[i], (lens[i] + 1) * sizeof(WCHAR)))
+            return false;
+        if (data.Size() % 4 != 0)
+            data.AppendBlanks(4 - data.Size() % 4);
+        memcpy(data.AtPtr(sizeof(TextIndexHeader) + i * sizeof(TextIndexPage)), &page, sizeof(page));
     }
+    hdr.indexSize = (uint32)data.Size();
+    memcpy(data.AtPtr(0), &hdr, sizeof(hdr));
+
+    ScopedMem<WCHAR> indexDir(path::GetDir(indexPath));
+    if (!dir::Create(indexDir))
+        return false;
+    return file::WriteAll(indexPath, data.AtPtr(0), data.Size());
+}
 
+const WCHAR *PageTextCache::GetData(int pageNo, int *lenOut, const GlyphCoords **coordsOut)
+{
+    if (!text[pageNo - 1]) {
+        InterlockedIncrement(&foregroundRequests);
+        ExtractData(pageNo);
+        InterlockedDecrement(&foregroundRequests);
+    }
+
+    ScopedCritSec scope(&access);
+    if (!text[pageNo - 1]) {
+        // the page hasn't been loaded yet
+        if (lenOut)
+            *lenOut = 0;
+        if (coordsOut)
+            *coordsOut = nullptr;
+        return L"";
+    }
+    lastUsed[pageNo - 1] = GetTickCount();
     if (lenOut)
         *lenOut = lens[pageNo - 1];
     if (coordsOut)
@@ -68,6 +1012,115 @@ const WCHAR *PageTextCache::GetData(int pageNo, int *lenOut, RectI **coordsOut)
     return text[pageNo - 1];
 }
 
+bool PageTextCache::ExtractWithClone(int pageNo, BaseEngine *clone, DWORD timeoutMs)
+{
+    if (text[pageNo - 1])
+        return true;
+    InterlockedIncrement(&foregroundRequests);
+    bool ok = ExtractData(pageNo, clone, timeoutMs);
+    InterlockedDecrement(&foregroundRequests);
+    return ok;
+}
+
+// normalizing text once per page instead of for every comparison makes
+// case-insensitive searching about as fast as case-sensitive searching
+const WCHAR *PageTextCache::GetNormalizedData(int pageNo, int *lenOut, const int **offsetsOut)
+{
+    int len;
+    const WCHAR *pageText = GetData(pageNo, &len);
+    // (pages that haven't been loaded yet aren't normalized either)
+    if (pageText && text[pageNo - 1] && !normalized[pageNo - 1]) {
+        NormalizedText *newNormalized = NormalizeText(pageText, len);
+        if (!newNormalized)
+            return nullptr;
+
+        ScopedCritSec scope(&access);
+        if (normalized[pageNo - 1]) {
+            free(newNormalized);
+        }
+        else {
+            normalized[pageNo - 1] = newNormalized;
+            cacheBytes += newNormalized->DataSize();
+            InterlockedExchangeAdd(&gTextCacheBytes, (LONG)newNormalized->DataSize());
+        }
+    }
+
+    NormalizedText *nt = normalized[pageNo - 1];
+    if (!nt)
+        return nullptr;
+    if (lenOut)
+        *lenOut = nt->len;
+    if (offsetsOut)
+        *offsetsOut = nt->offsets;
+    return nt->text;
+}
+
+WCHAR *PageTextCache::Normalize(const WCHAR *s)
+{
+    str::Str<WCHAR> result(str::Len(s) + 1);
+    WCHAR chars[MAX_NORMALIZED_CHARS];
+    for (; *s; s++) {
+        int count = NormalizeChar(*s, chars);
+        result.Append(chars, count);
+    }
+    return result.StealData();
+}
+
+// hit testing happens for every mouse move, so it mustn't have to visit all glyphs
+const GlyphGrid *PageTextCache::GetGlyphGrid(int pageNo)
+{
+    const GlyphCoords *pageCoords;
+    if (!GetData(pageNo, nullptr, &pageCoords) || grids[pageNo - 1])
+        return grids[pageNo - 1];
+
+    GlyphGrid *newGrid = GlyphGrid::Build(pageCoords);
+    if (!newGrid)
+        return nullptr;
+
+    ScopedCritSec scope(&access);
+    if (grids[pageNo - 1]) {
+        free(newGrid);
+    }
+    else {
+        grids[pageNo - 1] = newGrid;
+        cacheBytes += newGrid->DataSize();
+        InterlockedExchangeAdd(&gTextCacheBytes, (LONG)newGrid->DataSize());
+    }
+    return grids[pageNo - 1];
+}
+
+bool PageTextCache::MightContain(int pageNo, const WCHAR *s, size_t len)
+{
+    CrashIf(pageNo < 1 || pageNo > engine->PageCount());
+    if (len < 3 || len > INT_MAX)
+        return true;
+    const BYTE *pageBits = text[pageNo - 1] ? trigrams[pageNo - 1] : nullptr;
+    if (!pageBits && indexData) {
+        // pages which haven't been loaded yet can still be checked against the index
+        const TextIndexPage *pages = (const TextIndexPage *)((const TextIndexHeader *)indexData + 1);
+        pageBits = (const BYTE *)indexData + pages[pageNo - 1].trigramsOffset;
+    }
+    if (!pageBits)
+        return true;
+
+    ScopedMem<BYTE> bits(BuildTrigrams(s, (int)len));
+    if (!bits)
+        return true;
+    for (int i = 0; i < TRIGRAM_BITS / 8; i++) {
+        if ((bits[i] & pageBits[i]) != bits[i])
+            return false;
+    }
+    return true;
+}
+
+void PageTextCache::StartPrefetching(int startPageNo, const WCHAR *indexPath)
+{
+    if (prefetcher)
+        return;
+    prefetcher = new TextPrefetchThread(this, limitValue(startPageNo, 1, engine->PageCount()), indexPath);
+    prefetcher->Start();
+}
+
 TextSelection::TextSelection(BaseEngine *engine, PageTextCache *textCache) :
     engine(engine), textCache(textCache), startPage(-1),
     endPage(-1), startGlyph(-1), endGlyph(-1)
@@ -97,7 +1150,7 @@ void TextSelection::Reset()
 int TextSelection::FindClosestGlyph(int pageNo, double x, double y)
 {
     int textLen;
-    RectI *coords;
+    const GlyphCoords *coords;
     textCache->GetData(pageNo, &textLen, &coords);
     PointD pt = PointD(x, y);
 
@@ -106,20 +1159,25 @@ int TextSelection::FindClosestGlyph(int pageNo, double x, double y)
     bool overGlyph = false;
     int result = -1;
 
-    for (int i = 0; i < textLen; i++) {
-        if (!coords[i].x && !coords[i].dx)
+    const GlyphGrid *grid = textLen > 0 ? textCache->GetGlyphGrid(pageNo) : nullptr;
+    if (grid)
+        result = grid->FindClosest(coords, x, y);
+    // fall back to visiting all glyphs if the grid couldn't be built
+    for (int i = 0; i < textLen && !grid; i++) {
+        RectI rc = coords->At(i);
+        if (!rc.x && !rc.dx)
             continue;
-        if (overGlyph && !coords[i].Contains(pti))
+        if (overGlyph && !rc.Contains(pti))
             continue;
 
-        unsigned int dist = distSq((int)x - coords[i].x - coords[i].dx / 2,
-                                   (int)y - coords[i].y - coords[i].dy / 2);
+        unsigned int dist = distSq((int)x - rc.x - rc.dx / 2,
+                                   (int)y - rc.y - rc.dy / 2);
         if (dist < maxDist) {
             result = i;
             maxDist = dist;
         }
         // prefer glyphs the cursor is actually over
-        if (!overGlyph && coords[i].Contains(pti)) {
+        if (!overGlyph && rc.Contains(pti)) {
             overGlyph = true;
             result = i;
             maxDist = dist;
@@ -131,34 +1189,40 @@ int TextSelection::FindClosestGlyph(int pageNo, double x, double y)
     CrashIf(result < 0 || result >= textLen);
 
     // the result indexes the first glyph to be selected in a forward selection
-    RectD bbox = engine->Transform(coords[result].Convert<double>(), pageNo, 1.0, 0);
+    RectD bbox = engine->Transform(coords->At(result).Convert<double>(), pageNo, 1.0, 0);
     pt = engine->Transform(pt, pageNo, 1.0, 0);
     if (pt.x > bbox.x + 0.5 * bbox.dx) {
         result++;
         // for some (DjVu) documents, all glyphs of a word share the same bbox
-        while (result < textLen && coords[result - 1] == coords[result])
+        while (result < textLen && coords->At(result - 1) == coords->At(result))
             result++;
     }
-    CrashIf(result > 0 && result < textLen && coords[result] == coords[result - 1]);
+    CrashIf(result > 0 && result < textLen && coords->At(result) == coords->At(result - 1));
 
     return result;
 }
 
+static inline bool IsLineBreak(const RectI& rc)
+{
+    return !rc.x && !rc.dx;
+}
+
 void TextSelection::FillResultRects(int pageNo, int glyph, int length, WStrVec *lines)
 {
     int len;
-    RectI *coords;
+    const GlyphCoords *coords;
     const WCHAR *text = textCache->GetData(pageNo, &len, &coords);
     CrashIf(len < glyph + length);
     RectI mediabox = engine->PageMediabox(pageNo).Round();
-    RectI *c = &coords[glyph], *end = c + length;
+    int c = glyph, end = glyph + length;
     while (c < end) {
         // skip line breaks
-        for (; c < end && !c->x && !c->dx; c++);
+        for (; c < end && IsLineBreak(coords->At(c)); c++);
 
-        RectI bbox, *c0 = c;
-        for (; c < end && (c->x || c->dx); c++) {
-            bbox = bbox.Union(*c);
+        RectI bbox;
+        int c0 = c;
+        for (; c < end && !IsLineBreak(coords->At(c)); c++) {
+            bbox = bbox.Union(coords->At(c));
         }
         bbox = bbox.Intersect(mediabox);
         // skip text that's completely outside a page's mediabox
@@ -166,13 +1230,14 @@ void TextSelection::FillResultRects(int pageNo, int glyph, int length, WStrVec *
             continue;
 
         if (lines) {
-            lines->Push(str::DupN(text + (c0 - coords), c - c0));
+            lines->Push(str::DupN(text + c0, c - c0));
             continue;
         }
 
         // cut the right edge, if it overlaps the next character
-        if (c < coords + len && (c->x || c->dx) && bbox.x < c->x && bbox.x + bbox.dx > c->x)
-            bbox.dx = c->x - bbox.x;
+        RectI next = c < len ? coords->At(c) : RectI();
+        if (!IsLineBreak(next) && bbox.x < next.x && bbox.x + bbox.dx > next.x)
+            bbox.dx = next.x - bbox.x;
 
         result.len++;
         int *newPages = (int *)realloc(result.pages, sizeof(int) * result.len);
@@ -189,18 +1254,18 @@ void TextSelection::FillResultRects(int pageNo, int glyph, int length, WStrVec *
 bool TextSelection::IsOverGlyph(int pageNo, double x, double y)
 {
     int textLen;
-    RectI *coords;
+    const GlyphCoords *coords;
     textCache->GetData(pageNo, &textLen, &coords);
 
     int glyphIx = FindClosestGlyph(pageNo, x, y);
     PointI pt = PointD(x, y).ToInt();
     // when over the right half of a glyph, FindClosestGlyph returns the
     // index of the next glyph, in which case glyphIx must be decremented
-    if (glyphIx == textLen || !coords[glyphIx].Contains(pt))
+    if (glyphIx == textLen || !coords->At(glyphIx).Contains(pt))
         glyphIx--;
     if (-1 == glyphIx)
         return false;
-    return coords[glyphIx].Contains(pt);
+    return coords->At(glyphIx).Contains(pt);
 }
 
 void TextSelection::StartAt(int pageNo, int glyphIx)
@@ -279,17 +1344,27 @@ WCHAR *TextSelection::ExtractText(const WCHAR *lineSep)
     GetGlyphRange(&fromPage, &fromGlyph, &toPage, &toGlyph);
 
     for (int page = fromPage; page <= toPage; page++) {
-        int textLen;
-        textCache->GetData(page, &textLen);
-        int glyph = page == fromPage ? fromGlyph : 0;
-        int length = (page == toPage ? toGlyph : textLen) - glyph;
-        if (length > 0)
-            FillResultRects(page, glyph, length, &lines);
+        ExtractPageLines(page, &lines);
     }
 
     return lines.Join(lineSep);
 }
 
+void TextSelection::ExtractPageLines(int pageNo, WStrVec *lines)
+{
+    int fromPage, fromGlyph, toPage, toGlyph;
+    GetGlyphRange(&fromPage, &fromGlyph, &toPage, &toGlyph);
+    if (pageNo < fromPage || pageNo > toPage)
+        return;
+
+    int textLen;
+    textCache->GetData(pageNo, &textLen);
+    int glyph = pageNo == fromPage ? fromGlyph : 0;
+    int length = (pageNo == toPage ? toGlyph : textLen) - glyph;
+    if (length > 0)
+        FillResultRects(pageNo, glyph, length, lines);
+}
+
 void TextSelection::GetGlyphRange(int *fromPage, int *fromGlyph, int *toPage, int *toGlyph) const
 {
     *fromPage = std::min(startPage, endPage);
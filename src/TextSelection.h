@@ -5,23 +5,155 @@ inline unsigned int distSq(int x, int y) { return x * x + y * y; }
 // underscore is mainly used for programming and is thus considered a word character
 inline bool isWordChar(WCHAR c) { return IsCharAlphaNumeric(c) || c == '_'; }
 
+/* Compact storage for the coordinates of a page's glyphs: glyphs are grouped into
+   runs sharing the same y and dy (usually a line), so that for each glyph only the
+   16-bit x-offset (relative to its run) and width have to be stored. A GlyphCoords
+   is a single allocation (to be free()d) which is followed by either GlyphRun[runCount]
+   and GlyphPos[glyphCount] or by RectI[glyphCount] if runCount is -1 (for glyphs
+   that can't be represented this way, e.g. because they're wider than 64k). */
+struct GlyphRun {
+    // index of the run's first glyph
+    int glyph;
+    int x, y, dy;
+};
+
+struct GlyphPos {
+    // 0xFFFF for empty glyphs (line breaks)
+    uint16 dx;
+    uint16 width;
+};
+
+class GlyphCoords {
+public:
+    int glyphCount;
+    int runCount;
+
+    RectI At(int glyph) const;
+    size_t DataSize() const;
+
+    static GlyphCoords *Compress(const RectI *coords, int len);
+    // returns a copy of serialized data (or nullptr if data isn't valid)
+    static GlyphCoords *FromData(const char *data, size_t len, int glyphCount);
+};
+
+/* Spatial index over a page's glyphs for hit testing: the glyphs' bounding box is
+   divided into square cells, each listing the glyphs with their center in the cell
+   and the glyphs overlapping the cell (glyphs overlapping too many cells are listed
+   separately). A GlyphGrid is a single allocation (to be free()d) which is followed
+   by int arrays for the cells' starting offsets and the glyph lists. */
+class GlyphGrid {
+public:
+    int left, top, cellSize;
+    int cols, rows;
+    int centerCount, areaCount, largeCount;
+
+    // returns the same glyph as TextSelection::FindClosestGlyph's linear scan
+    // (or -1 if the page has no glyphs)
+    int FindClosest(const GlyphCoords *coords, double x, double y) const;
+    size_t DataSize() const;
+
+    static GlyphGrid *Build(const GlyphCoords *coords);
+};
+
+class TextPrefetchThread;
+struct NormalizedText;
+
 class PageTextCache {
+    friend TextPrefetchThread;
+
     BaseEngine* engine;
-    RectI    ** coords;
+    GlyphCoords ** coords;
     WCHAR    ** text;
     int       * lens;
-#ifdef DEBUG
-    size_t      debug_size;
-#endif
+    // bitsets of the (case folded) trigrams in each page's text
+    BYTE     ** trigrams;
+    // text prepared for case-insensitive searching (calculated on demand by GetNormalizedData)
+    NormalizedText ** normalized;
+    // spatial indexes over coords (calculated on demand by GetGlyphGrid)
+    GlyphGrid ** grids;
+    // time of the most recent GetData (for LRU eviction)
+    DWORD     * lastUsed;
+    // memory used by all pages' data (counted against the budget shared by all caches)
+    size_t      cacheBytes;
+    // while pinned, no data is evicted (cf. Pin)
+    int         pinCount;
+
+    // a mapped text index from which pages are loaded instead of extracting them
+    HANDLE      indexFile;
+    HANDLE      indexMapping;
+    const char *indexData;
 
     CRITICAL_SECTION access;
 
+    // number of GetData and ExtractWithClone calls currently extracting text
+    // (the prefetcher pauses as long as this isn't 0)
+    LONG        foregroundRequests;
+    LONG        cachedCount;
+    TextPrefetchThread *prefetcher;
+
+    bool ExtractData(int pageNo, BaseEngine *fromEngine=nullptr, DWORD timeoutMs=INFINITE);
+    bool StoreData(int pageNo, WCHAR *newText, int newLen, GlyphCoords *newCoords, BYTE *newTrigrams);
+    size_t GetPageBytes(int pageNo);
+    void EvictPage(int pageNo);
+    bool LoadIndexPage(int pageNo);
+    bool SaveIndex(const WCHAR *indexPath);
+
 public:
     explicit PageTextCache(BaseEngine *engine);
     ~PageTextCache();
 
     bool HasData(int pageNo);
-    const WCHAR *GetData(int pageNo, int *lenOut=nullptr, RectI **coordsOut=nullptr);
+    const WCHAR *GetData(int pageNo, int *lenOut=nullptr, const GlyphCoords **coordsOut=nullptr);
+    // returns the text with its case folded, diacritics removed and ligatures expanded
+    // (cf. Normalize); offsetsOut receives the glyph index for every char (and the length
+    // of GetData's text at offsetsOut[*lenOut])
+    const WCHAR *GetNormalizedData(int pageNo, int *lenOut=nullptr, const int **offsetsOut=nullptr);
+    // returns a spatial index over the page's glyph coordinates (or nullptr)
+    const GlyphGrid *GetGlyphGrid(int pageNo);
+    // extracts a page's text using a clone of engine (so that several threads can extract
+    // text at once); falls back to engine if clone is nullptr
+    // returns false if extraction took longer than timeoutMs (and nothing was stored)
+    bool ExtractWithClone(int pageNo, BaseEngine *clone, DWORD timeoutMs=INFINITE);
+    // returns false if the page's text can't contain the string s (without whitespace),
+    // true if it might contain it or if the page's text hasn't been extracted yet
+    bool MightContain(int pageNo, const WCHAR *s, size_t len);
+
+    // extracts the text of all pages in the background at idle priority,
+    // starting at startPageNo and working outward; if indexPath is given,
+    // the text is loaded from there instead (when valid) or saved there
+    void StartPrefetching(int startPageNo, const WCHAR *indexPath=nullptr);
+    // loads the pages from indexPath instead of extracting them (if the index is valid)
+    bool MapIndex(const WCHAR *indexPath);
+    // number of pages with extracted text (for reporting prefetching progress)
+    int CachedPageCount() const { return cachedCount; }
+    // memory used by this cache's data (e.g. for the performance overlay)
+    size_t CacheBytes() const { return cacheBytes; }
+
+    // prevents data from being evicted, so that pointers returned by GetData
+    // remain valid on background threads (eviction only happens on the UI thread)
+    void Pin();
+    void Unpin();
+
+    // normalizes a search string the same way GetNormalizedData normalizes text
+    static WCHAR *Normalize(const WCHAR *s);
+
+    // limits the memory used by all PageTextCaches together (in bytes)
+    static void SetMaxMemory(size_t maxBytes);
+    // evicts the least recently used pages of unpinned caches while over the limit
+    static void EvictPages();
+    // evicts all pages (unless pinned), e.g. for documents in background tabs
+    void EvictAll();
+    // copies the data of pages which haven't changed since a reload from the previous
+    // document's cache (prevPageNos contains the previous number for each page or 0)
+    void CopyUnchangedPages(PageTextCache *prev, const int *prevPageNos);
+};
+
+class ScopedTextCachePin {
+    PageTextCache *tc;
+
+public:
+    explicit ScopedTextCachePin(PageTextCache *tc) : tc(tc) { tc->Pin(); }
+    ~ScopedTextCachePin() { tc->Unpin(); }
 };
 
 struct TextSel {
@@ -48,6 +180,9 @@ public:
     void SelectWordAt(int pageNo, double x, double y);
     void CopySelection(TextSelection *orig);
     WCHAR *ExtractText(const WCHAR *lineSep);
+    // appends the selected lines of a single page (for extracting
+    // large selections page by page, cf. ExtractText)
+    void ExtractPageLines(int pageNo, WStrVec *lines);
     void Reset();
 
     TextSel result;
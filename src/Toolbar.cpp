@@ -5,6 +5,7 @@
 #include "BaseUtil.h"
 #include "WinDynCalls.h"
 #include "Dpi.h"
+#include "StrFormat.h"
 #include "WinUtil.h"
 // rendering engines
 #include "BaseEngine.h"
@@ -473,28 +474,30 @@ void UpdateToolbarPageText(WindowInfo *win, int pageCount, bool updateOnly)
     int pos_x = r.right + 10;
     int pos_y = (r.bottom - pageWndRect.dy) / 2;
 
-    WCHAR *buf;
+    ScopedMem<WCHAR> prevText;
+    fmt::Buf<WCHAR, 64> buf;
     SizeI size2;
     if (-1 == pageCount) {
         // preserve hwndPageTotal's text and size
-        buf = win::GetText(win->hwndPageTotal);
+        prevText.Set(win::GetText(win->hwndPageTotal));
         size2 = ClientRect(win->hwndPageTotal).Size();
         size2.dx -= TB_TEXT_PADDING_RIGHT;
-    } else if (!pageCount)
-        buf = str::Dup(L"");
-    else if (!win->ctrl || !win->ctrl->HasPageLabels())
-        buf = str::Format(L" / %d", pageCount);
-    else {
-        buf = str::Format(L" (%d / %d)", win->ctrl->CurrentPageNo(), pageCount);
-        ScopedMem<WCHAR> buf2(str::Format(L" (%d / %d)", pageCount, pageCount));
+    } else if (!pageCount) {
+        // leave empty
+    } else if (!win->ctrl || !win->ctrl->HasPageLabels()) {
+        buf.s(L" / ").i(pageCount);
+    } else {
+        fmt::Buf<WCHAR, 64> buf2;
+        buf2.s(L" (").i(pageCount).s(L" / ").i(pageCount).c(')');
         size2 = TextSizeInHwnd(win->hwndPageTotal, buf2);
+        buf.s(L" (").i(win->ctrl->CurrentPageNo()).s(L" / ").i(pageCount).c(')');
     }
 
-    win::SetText(win->hwndPageTotal, buf);
+    const WCHAR *text = prevText ? prevText.Get() : buf.Get();
+    win::SetText(win->hwndPageTotal, text);
     if (0 == size2.dx)
-        size2 = TextSizeInHwnd(win->hwndPageTotal, buf);
+        size2 = TextSizeInHwnd(win->hwndPageTotal, text);
     size2.dx += TB_TEXT_PADDING_RIGHT;
-    free(buf);
 
     int padding = GetSystemMetrics(SM_CXEDGE);
     MoveWindow(win->hwndPageText, pos_x, (pageWndRect.dy - size.dy + 1) / 2 + pos_y, size.dx, size.dy, FALSE);
@@ -84,6 +84,12 @@ const char **           gCurrLangStrings = nullptr;
 // WCHAR ** gLangsTransCache[LANGS_COUNT];
 WCHAR ***               gLangsTransCache = nullptr;
 
+// maps English strings to their index in GetOriginalStrings() so that
+// _TR() doesn't have to compare against every string. Open addressing with
+// a power-of-2 number of slots, each slot is 0 if empty or index + 1
+static uint16_t *       gEnglishStringsHash = nullptr;
+static uint32_t         gEnglishStringsHashMask = 0;
+
 #if COMPRESSED == 1
 // const char *gLangsStringsUncompressed[LANGS_COUNT];
 const unsigned char *   GetTranslationsForLang(int langIdx, uint32_t *uncompressedSizeOut, uint32_t *compressedSizeOut);
@@ -178,6 +184,7 @@ static void FreeTransCache()
     }
     free(gLangsTransCache);
     free(gCurrLangStrings);
+    free(gEnglishStringsHash);
 #if COMPRESSED == 1
     free(gLangsStringsUncompressed);
 #endif
@@ -311,12 +318,35 @@ const char *DetectUserLang()
     return "en";
 }
 
-static int GetEnglishStringIndex(const char* txt)
+static void BuildEnglishStringsHash()
 {
+    CrashIf(gStringsCount >= UINT16_MAX);
+    uint32_t size = 16;
+    while (size < (uint32_t)gStringsCount * 2)
+        size *= 2;
+    gEnglishStringsHash = AllocArray<uint16_t>(size);
+    gEnglishStringsHashMask = size - 1;
+
     const char **origStrings = GetOriginalStrings();
     for (int idx = 0; idx < gStringsCount; idx++) {
         const char *s = origStrings[idx];
-        if (str::Eq(s, txt))
+        uint32_t slot = MurmurHash2(s, str::Len(s)) & gEnglishStringsHashMask;
+        while (gEnglishStringsHash[slot] != 0)
+            slot = (slot + 1) & gEnglishStringsHashMask;
+        gEnglishStringsHash[slot] = (uint16_t)(idx + 1);
+    }
+}
+
+static int GetEnglishStringIndex(const char* txt)
+{
+    if (!gEnglishStringsHash)
+        BuildEnglishStringsHash();
+
+    const char **origStrings = GetOriginalStrings();
+    uint32_t slot = MurmurHash2(txt, str::Len(txt)) & gEnglishStringsHashMask;
+    for (; gEnglishStringsHash[slot] != 0; slot = (slot + 1) & gEnglishStringsHashMask) {
+        int idx = gEnglishStringsHash[slot] - 1;
+        if (str::Eq(origStrings[idx], txt))
             return idx;
     }
     return -1;
@@ -64,6 +64,38 @@ static void ParseCommandLineTest()
         utassert(str::Eq(L"1,3,8-34", i.pathsToBenchmark.At(3)));
     }
 
+    {
+        CommandLineInfo i;
+        i.ParseCommandLine(L"SumatraPDF.exe -bench foo.pdf 1-3 -bench-format json -bench-repeat 5 -bench-warmup 2 -bench-cpu 1");
+        utassert(2 == i.pathsToBenchmark.Count());
+        utassert(str::Eq(L"1-3", i.pathsToBenchmark.At(1)));
+        utassert(str::Eq(L"json", i.benchFormat));
+        utassert(5 == i.benchRepeat);
+        utassert(2 == i.benchWarmup);
+        utassert(1 == i.benchCpu);
+    }
+
+    {
+        CommandLineInfo i;
+        i.ParseCommandLine(L"SumatraPDF.exe -render-batch @files.txt out 1-3,7 72dpi jpg -n 4");
+        utassert(str::Eq(L"@files.txt", i.renderBatchPath));
+        utassert(str::Eq(L"out", i.renderBatchOutDir));
+        utassert(str::Eq(L"1-3,7", i.renderBatchRanges));
+        utassert(72 == i.renderBatchDpi);
+        utassert(str::Eq(L"jpg", i.renderBatchFormat));
+        utassert(4 == i.renderBatchWorkers);
+        utassert(i.exitImmediately);
+        utassert(0 == i.fileNames.Count());
+    }
+
+    {
+        CommandLineInfo i;
+        i.ParseCommandLine(L"SumatraPDF.exe -render-server sumatra-render");
+        utassert(str::Eq(L"sumatra-render", i.renderServerPipe));
+        utassert(i.exitImmediately);
+        utassert(0 == i.fileNames.Count());
+    }
+
     {
         CommandLineInfo i;
         utassert(false == i.invertColors);
@@ -7,6 +7,7 @@
 #include <UIAutomationCoreApi.h>
 #include "FileUtil.h"
 #include "FrameRateWnd.h"
+#include "FrameTimeoutCalculator.h"
 #include "WinUtil.h"
 // rendering engines
 #include "BaseEngine.h"
@@ -56,6 +57,8 @@ WindowInfo::WindowInfo(HWND hwnd) :
     hwndCaption(nullptr), caption(nullptr), extendedFrameHeight(0)
 {
     touchState.panStarted = false;
+    scrollAnim.timing = nullptr;
+    scrollAnim.ctrl = nullptr;
     buffer = new DoubleBuffer(hwndCanvas, canvasRc);
     linkHandler = new LinkHandler(*this);
     notifications = new Notifications();
@@ -79,6 +82,7 @@ WindowInfo::~WindowInfo()
 
     delete linkHandler;
     delete buffer;
+    delete scrollAnim.timing;
     delete notifications;
     delete tabSelectionHistory;
     delete caption;
@@ -122,6 +126,7 @@ void WindowInfo::UpdateCanvasSize()
     // about the change of the canvas size
     delete buffer;
     buffer = new DoubleBuffer(hwndCanvas, canvasRc);
+    bufferViewPort = RectI();
 
     if (IsDocLoaded()) {
         // the display model needs to know the full size (including scroll bars)
@@ -10,6 +10,7 @@ struct FrameRateWnd;
 struct LabelWithCloseWnd;
 struct SplitterWnd;
 class CaptionInfo;
+class FrameTimeoutCalculator;
 
 class PageElement;
 class PageDestination;
@@ -34,6 +35,8 @@ enum MouseAction {
 enum NotificationGroup {
     NG_RESPONSE_TO_ACTION = 1,
     NG_FIND_PROGRESS,
+    NG_COPY_PROGRESS,
+    NG_LOAD_PROGRESS,
     NG_PERSISTENT_WARNING,
     NG_PAGE_INFO_HELPER,
     NG_CURSOR_POS_HELPER,
@@ -63,6 +66,14 @@ struct TouchState {
     double  startArg;
 };
 
+// animated scrolling with the mouse wheel (cf. FixedPageUI.SmoothScroll)
+struct ScrollAnimation {
+    FrameTimeoutCalculator *timing; // nullptr while no animation is running
+    Controller *ctrl;
+    PointI      start;
+    PointI      target;
+};
+
 /* Describes position, the target (URL or file path) and infotip of a "hyperlink" */
 struct StaticLinkInfo {
     StaticLinkInfo() : target(nullptr), infotip(nullptr) { }
@@ -151,6 +162,9 @@ public:
     bool            isMenuHidden; // not persisted at shutdown
 
     DoubleBuffer *  buffer;
+    /* the document's view port when buffer was last painted (empty if buffer
+       doesn't hold a frame which can be reused after scrolling) */
+    RectI           bufferViewPort;
 
     MouseAction     mouseAction;
     bool            dragStartPending;
@@ -217,6 +231,7 @@ public:
     StressTest *    stressTest;
 
     TouchState      touchState;
+    ScrollAnimation scrollAnim;
 
     FrameRateWnd *  frameRateWnd;
 
@@ -226,6 +241,7 @@ public:
     SizeI GetViewPortSize();
     void  RedrawAll(bool update=false);
     void  RepaintAsync(UINT delay=0);
+    void  RepaintScrolledAsync();
 
     void ChangePresentationMode(PresentationMode mode);
 
@@ -23,6 +23,10 @@ VOID CEpubFilter::CleanUp()
         m_epubDoc = nullptr;
     }
     m_state = STATE_EPUB_END;
+    m_chapterIdx = 0;
+    m_tagNesting.Reset();
+    m_text.Reset();
+    m_textOffset = 0;
 }
 
 HRESULT CEpubFilter::OnInit()
@@ -48,6 +52,7 @@ HRESULT CEpubFilter::OnInit()
     if (!m_epubDoc)
         return E_FAIL;
 
+    m_limits.Init();
     m_state = STATE_EPUB_START;
     return S_OK;
 }
@@ -63,15 +68,14 @@ static bool IsoDateParse(const WCHAR *isoDate, SYSTEMTIME *timeOut)
     // don't bother about the day of week, we won't display it anyway
 }
 
-static WCHAR *ExtractHtmlText(EpubDoc *doc)
+static void ExtractHtmlText(EpubDoc *doc, size_t chapterIdx, str::Str<char>& text, Vec<HtmlTag>& tagNesting)
 {
     size_t len;
-    const char *data = doc->GetHtmlData(&len);
-
-    str::Str<char> text(len / 2);
+    const char *data = doc->GetChapterData(chapterIdx, &len);
+    if (!data)
+        return;
     HtmlPullParser p(data, len);
     HtmlToken *t;
-    Vec<HtmlTag> tagNesting;
     while ((t = p.Next()) != nullptr && !t->IsError()) {
         if (t->IsText() && !tagNesting.Contains(Tag_Head) && !tagNesting.Contains(Tag_Script) && !tagNesting.Contains(Tag_Style)) {
             // trim whitespace (TODO: also normalize within text?)
@@ -107,8 +111,29 @@ static WCHAR *ExtractHtmlText(EpubDoc *doc)
                 tagNesting.Pop();
         }
     }
+}
 
-    return str::conv::FromUtf8(text.Get());
+// go through the document one spine item at a time so that it never has
+// to be decompressed as a whole (nor its text be held in memory at once)
+void CEpubFilter::ExtractMoreText()
+{
+    m_text.RemoveAt(0, m_textOffset);
+    m_textOffset = 0;
+
+    str::Str<char> utf8;
+    str::Str<WCHAR> chapterText;
+    while (m_text.Size() < m_limits.chunkSize && m_chapterIdx < m_epubDoc->GetChapterCount()) {
+        if (0 == m_limits.RemainingMs()) {
+            m_chapterIdx = m_epubDoc->GetChapterCount();
+            break;
+        }
+        utf8.Clear();
+        ExtractHtmlText(m_epubDoc, m_chapterIdx++, utf8, m_tagNesting);
+        if (utf8.Size() > 0) {
+            str::conv::FromUtf8(utf8.Get(), utf8.Size(), chapterText);
+            m_text.Append(chapterText.Get(), chapterText.Size());
+        }
+    }
 }
 
 HRESULT CEpubFilter::GetNextChunkValue(CChunkValue &chunkValue)
@@ -156,12 +181,10 @@ HRESULT CEpubFilter::GetNextChunkValue(CChunkValue &chunkValue)
         // fall through
 
     case STATE_EPUB_CONTENT:
-        m_state = STATE_EPUB_END;
-        str.Set(ExtractHtmlText(m_epubDoc));
-        if (!str::IsEmpty(str.Get())) {
-            chunkValue.SetTextValue(PKEY_Search_Contents, str, CHUNK_TEXT);
+        ExtractMoreText();
+        if (SetNextTextChunk(chunkValue, m_text, m_textOffset, m_limits.chunkSize))
             return S_OK;
-        }
+        m_state = STATE_EPUB_END;
         // fall through
 
     case STATE_EPUB_END:
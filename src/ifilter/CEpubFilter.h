@@ -9,7 +9,7 @@ class CEpubFilter : public CFilterBase
 {
 public:
     CEpubFilter(long *plRefCount) : CFilterBase(plRefCount),
-        m_state(STATE_EPUB_END), m_epubDoc(nullptr) { }
+        m_state(STATE_EPUB_END), m_epubDoc(nullptr), m_chapterIdx(0), m_textOffset(0) { }
     ~CEpubFilter()  override { CleanUp(); }
 
     HRESULT OnInit() override;
@@ -23,6 +23,15 @@ public:
     }
 
 private:
+    void ExtractMoreText();
+
     EPUB_FILTER_STATE m_state;
     EpubDoc *m_epubDoc;
+    FilterLimits m_limits;
+    // the spine item to extract text from next
+    size_t m_chapterIdx;
+    Vec<HtmlTag> m_tagNesting;
+    // cf. CPdfFilter::m_text
+    str::Str<WCHAR> m_text;
+    size_t m_textOffset;
 };
@@ -19,6 +19,8 @@ VOID CPdfFilter::CleanUp()
         m_pdfEngine = nullptr;
     }
     m_state = STATE_PDF_END;
+    m_text.Reset();
+    m_textOffset = 0;
 }
 
 HRESULT CPdfFilter::OnInit()
@@ -40,15 +42,45 @@ HRESULT CPdfFilter::OnInit()
     if (!stream)
         return E_FAIL;
 
-    m_pdfEngine = PdfEngine::CreateFromStream(stream);
+    m_pdfEngine = PdfEngine::CreateFromStream(stream, nullptr, true);
     if (!m_pdfEngine)
         return E_FAIL;
+    // pages are never rendered, so keep MuPDF's resource store as small
+    // as for a document in the background (and don't cache page runs)
+    m_pdfEngine->ReleaseCaches(true);
 
+    m_limits.Init();
     m_state = STATE_PDF_START;
     m_iPageNo = 0;
     return S_OK;
 }
 
+// extracts pages until there's at least a chunk's worth of text (so that
+// only a few pages' text is ever held in memory) or until a limit is reached
+void CPdfFilter::ExtractMoreText()
+{
+    m_text.RemoveAt(0, m_textOffset);
+    m_textOffset = 0;
+
+    while (m_text.Size() < m_limits.chunkSize && m_iPageNo < m_pdfEngine->PageCount()) {
+        DWORD timeoutMs = m_limits.RemainingMs();
+        if (0 == timeoutMs || !m_limits.IsPageAllowed(m_iPageNo + 1)) {
+            // stop gracefully, the text extracted so far still gets indexed
+            m_iPageNo = m_pdfEngine->PageCount();
+            break;
+        }
+        bool partial = false;
+        ScopedMem<WCHAR> pageText(m_pdfEngine->ExtractPageTextLimited(++m_iPageNo, L"\r\n", nullptr, timeoutMs, &partial));
+        if (!str::IsEmpty(pageText.Get())) {
+            if (m_text.Size() > 0)
+                m_text.Append(L"\r\n");
+            m_text.Append(pageText);
+        }
+        if (partial)
+            m_iPageNo = m_pdfEngine->PageCount();
+    }
+}
+
 // copied from SumatraProperties.cpp
 static bool PdfDateParse(const WCHAR *pdfDate, SYSTEMTIME *timeOut)
 {
@@ -106,13 +138,9 @@ HRESULT CPdfFilter::GetNextChunkValue(CChunkValue &chunkValue)
         // fall through
 
     case STATE_PDF_CONTENT:
-        while (++m_iPageNo <= m_pdfEngine->PageCount()) {
-            str.Set(m_pdfEngine->ExtractPageText(m_iPageNo, L"\r\n"));
-            if (str::IsEmpty(str.Get()))
-                continue;
-            chunkValue.SetTextValue(PKEY_Search_Contents, str, CHUNK_TEXT);
+        ExtractMoreText();
+        if (SetNextTextChunk(chunkValue, m_text, m_textOffset, m_limits.chunkSize))
             return S_OK;
-        }
         m_state = STATE_PDF_END;
         // fall through
 
@@ -9,7 +9,7 @@ class CPdfFilter : public CFilterBase
 {
 public:
     CPdfFilter(long *plRefCount) : CFilterBase(plRefCount),
-        m_state(STATE_PDF_END), m_iPageNo(-1), m_pdfEngine(nullptr) { }
+        m_state(STATE_PDF_END), m_iPageNo(-1), m_pdfEngine(nullptr), m_textOffset(0) { }
     ~CPdfFilter()  override { CleanUp(); }
 
     HRESULT OnInit() override;
@@ -23,7 +23,14 @@ public:
     }
 
 private:
+    void ExtractMoreText();
+
     PDF_FILTER_STATE m_state;
     int m_iPageNo;
     BaseEngine *m_pdfEngine;
+    FilterLimits m_limits;
+    // text of the last extracted page(s), of which
+    // everything before m_textOffset has been returned
+    str::Str<WCHAR> m_text;
+    size_t m_textOffset;
 };
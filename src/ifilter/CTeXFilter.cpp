@@ -9,33 +9,92 @@
 #include "PdfFilter.h"
 #include "CTeXFilter.h"
 
+// size of the window of decoded text
+#define TEX_WINDOW_SIZE     (64 * 1024)
+// how far the parser may look ahead (e.g. for the end of a bracketed parameter)
+#define TEX_LOOKAHEAD       (16 * 1024)
+// room for what a single parsing step can append to a full chunk
+#define TEX_CHUNK_SLACK     16
+
 HRESULT CTeXFilter::OnInit()
 {
     if (!m_pData) {
-        // load content of LaTeX file into m_pData
-        HRESULT res;
-        size_t len;
-        void *data = GetDataFromStream(m_pStream, &len, &res);
-        if (!data)
-            return res;
-
-        m_pData = str::ToWideChar((char *)data, CP_ACP);
-        m_pBuffer = AllocArray<WCHAR>(len + 1);
-        free(data);
-
-        if (!m_pData || !m_pBuffer) {
+        FilterLimits limits;
+        limits.Init();
+        m_chunkSize = limits.chunkSize;
+
+        m_pData = AllocArray<WCHAR>(TEX_WINDOW_SIZE + 1);
+        m_pRaw = AllocArray<char>(TEX_WINDOW_SIZE);
+        m_pBuffer = AllocArray<WCHAR>(m_chunkSize + TEX_CHUNK_SLACK + 1);
+        if (!m_pData || !m_pRaw || !m_pBuffer) {
             CleanUp();
             return E_OUTOFMEMORY;
         }
+        m_pBufferEnd = m_pBuffer + m_chunkSize + TEX_CHUNK_SLACK;
     }
 
     m_state = STATE_TEX_START;
-    m_pPtr = m_pData;
-    m_iDepth = 0;
+    return Rewind();
+}
 
+// restarts parsing at the beginning of the file
+HRESULT CTeXFilter::Rewind()
+{
+    LARGE_INTEGER zero = { 0 };
+    HRESULT res = m_pStream->Seek(zero, STREAM_SEEK_SET, nullptr);
+    if (FAILED(res))
+        return res;
+
+    m_pPtr = m_pEnd = m_pData;
+    *m_pEnd = '\0';
+    m_rawLen = 0;
+    m_eof = false;
+    m_iDepth = 0;
+    FillWindow();
     return S_OK;
 }
 
+// makes sure that at least TEX_LOOKAHEAD characters (or the rest
+// of the file) are available at m_pPtr
+void CTeXFilter::FillWindow()
+{
+    size_t avail = m_pEnd - m_pPtr;
+    if (avail >= TEX_LOOKAHEAD || m_eof)
+        return;
+
+    memmove(m_pData, m_pPtr, avail * sizeof(WCHAR));
+    m_pPtr = m_pData;
+    m_pEnd = m_pData + avail;
+
+    // a byte never decodes to more than a single WCHAR
+    size_t space = TEX_WINDOW_SIZE - avail;
+    ULONG read = 0;
+    HRESULT res = m_pStream->Read(m_pRaw + m_rawLen, (ULONG)(space - m_rawLen), &read);
+    if (FAILED(res))
+        read = 0;
+    if (0 == read)
+        m_eof = true;
+    size_t total = m_rawLen + read;
+
+    // don't split double-byte characters
+    size_t convLen = total;
+    if (!m_eof) {
+        for (convLen = 0; convLen < total; convLen++) {
+            if (IsDBCSLeadByte(m_pRaw[convLen])) {
+                if (convLen + 1 == total)
+                    break;
+                convLen++;
+            }
+        }
+    }
+    if (convLen > 0)
+        m_pEnd += MultiByteToWideChar(CP_ACP, 0, m_pRaw, (int)convLen, m_pEnd, (int)space);
+    *m_pEnd = '\0';
+
+    m_rawLen = total - convLen;
+    memmove(m_pRaw, m_pRaw + convLen, m_rawLen);
+}
+
 #define iscmdchar(c) (iswalnum(c) || (c) == '_')
 #define skipspace(pc) for (; str::IsWs(*(pc)) && *(pc) != '\n'; (pc)++)
 #define skipcomment(pc) while (*(pc) && *(pc)++ != '\n')
@@ -54,18 +113,19 @@ static inline void addsinglespace(WCHAR *base, WCHAR **cur)
         *(*cur)++ = ' ';
 }
 
-// extracts a text block contained within a pair of braces
-// (may contain nested braces)
-WCHAR *CTeXFilter::ExtractBracedBlock()
+// extracts text into out until the nesting depth drops below minDepth
+// or until (at least) maxLen characters have been extracted
+WCHAR *CTeXFilter::ExtractText(WCHAR *out, int minDepth, size_t maxLen)
 {
-    m_iDepth++;
-
-    WCHAR *result = m_pBuffer + (m_pPtr - m_pData);
+    WCHAR *result = out;
     WCHAR *rptr = result;
+    // leave room for what a single step might append
+    WCHAR *rend = m_pBufferEnd - 4;
 
-    int currDepth = m_iDepth;
-
-    while (*m_pPtr && m_iDepth >= currDepth) {
+    while (m_iDepth >= minDepth && (size_t)(rptr - result) < maxLen && rptr < rend) {
+        FillWindow();
+        if (!*m_pPtr)
+            break;
         switch (*m_pPtr++) {
         case '\\':
             // skip all LaTeX/TeX commands
@@ -73,7 +133,7 @@ WCHAR *CTeXFilter::ExtractBracedBlock()
                 // ignore the content of \begin{...} and \end{...}
                 if (str::StartsWith(m_pPtr, L"begin{") || str::StartsWith(m_pPtr, L"end{")) {
                     m_pPtr = wcschr(m_pPtr, '{') + 1;
-                    ExtractBracedBlock();
+                    ExtractBracedBlock(rptr);
                     addsingleNL(result, &rptr);
                     break;
                 }
@@ -159,9 +219,18 @@ WCHAR *CTeXFilter::ExtractBracedBlock()
         }
     }
 
+    *rptr = '\0';
+    return result;
+}
+
+// extracts a text block contained within a pair of braces
+// (may contain nested braces)
+WCHAR *CTeXFilter::ExtractBracedBlock(WCHAR *out)
+{
+    m_iDepth++;
+    WCHAR *result = ExtractText(out, m_iDepth, (size_t)-1);
     if (*m_pPtr == '}')
         m_pPtr++;
-    *rptr = '\0';
     return result;
 }
 
@@ -170,11 +239,10 @@ HRESULT CTeXFilter::GetNextChunkValue(CChunkValue &chunkValue)
     WCHAR *start, *end;
 
 ContinueParsing:
+    FillWindow();
     if (!*m_pPtr && m_state == STATE_TEX_PREAMBLE) {
         // if there was no preamble, treat the whole document as content
-        m_pPtr = m_pData;
-        m_iDepth = 0;
-        m_state = STATE_TEX_CONTENT;
+        m_state = FAILED(Rewind()) ? STATE_TEX_END : STATE_TEX_CONTENT;
     }
     else if (!*m_pPtr) {
         m_state = STATE_TEX_END;
@@ -190,7 +258,10 @@ ContinueParsing:
         // the preamble (i.e. everything before \begin{document}) may contain
         // \author{...} and \title{...} commands
         start = end = nullptr;
-        while (*m_pPtr && !start) {
+        while (!start) {
+            FillWindow();
+            if (!*m_pPtr)
+                break;
             switch (*m_pPtr++){
             case '\\':
                 if (iscmdchar(*m_pPtr)) {
@@ -202,7 +273,7 @@ ContinueParsing:
                     m_pPtr++;
                 break;
             case '{':
-                ExtractBracedBlock();
+                ExtractBracedBlock(m_pBuffer);
                 break;
             case '%':
                 skipcomment(m_pPtr);
@@ -216,16 +287,24 @@ ContinueParsing:
             goto ContinueParsing;
         m_pPtr++;
 
+        // start points into the window which ExtractBracedBlock may move
         if (!wcsncmp(start, L"author", end - start) || !wcsncmp(start, L"title", end - start)) {
-            chunkValue.SetTextValue(*start == 'a' ? PKEY_Author : PKEY_Title, ExtractBracedBlock());
+            REFPROPERTYKEY pkey = *start == 'a' ? PKEY_Author : PKEY_Title;
+            chunkValue.SetTextValue(pkey, ExtractBracedBlock(m_pBuffer));
             return S_OK;
         }
 
-        if (!wcsncmp(start, L"begin", end - start) && str::Eq(ExtractBracedBlock(), L"document"))
+        if (!wcsncmp(start, L"begin", end - start) && str::Eq(ExtractBracedBlock(m_pBuffer), L"document"))
             m_state = STATE_TEX_CONTENT;
         goto ContinueParsing;
     case STATE_TEX_CONTENT:
-        chunkValue.SetTextValue(PKEY_Search_Contents, ExtractBracedBlock(), CHUNK_TEXT);
+        // the content is handed out in chunks of limited size, each
+        // continuing where the previous one ended
+        if (m_iDepth < 1)
+            m_iDepth = 1;
+        chunkValue.SetTextValue(PKEY_Search_Contents, ExtractText(m_pBuffer, 1, m_chunkSize), CHUNK_TEXT);
+        if (m_iDepth < 1 && *m_pPtr == '}')
+            m_pPtr++;
         return S_OK;
     default:
         return FILTER_E_END_OF_CHUNKS;
@@ -7,8 +7,9 @@ class CTeXFilter : public CFilterBase
 {
 public:
     CTeXFilter(long *plRefCount) : CFilterBase(plRefCount),
-        m_state(STATE_TEX_END), m_pData(nullptr), m_pPtr(nullptr),
-        m_pBuffer(nullptr), m_iDepth(0) { }
+        m_state(STATE_TEX_END), m_pData(nullptr), m_pPtr(nullptr), m_pEnd(nullptr),
+        m_pRaw(nullptr), m_rawLen(0), m_eof(false), m_pBuffer(nullptr),
+        m_pBufferEnd(nullptr), m_chunkSize(0), m_iDepth(0) { }
     ~CTeXFilter() override { CleanUp(); }
 
     HRESULT OnInit() override;
@@ -18,10 +19,12 @@ public:
     {
         free(m_pData);
         m_pData = nullptr;
+        free(m_pRaw);
+        m_pRaw = nullptr;
         free(m_pBuffer);
         m_pBuffer = nullptr;
     }
-    WCHAR *ExtractBracedBlock();
+    WCHAR *ExtractBracedBlock(WCHAR *out);
 
     // IPersist
     IFACEMETHODIMP GetClassID(CLSID *pClassID) {
@@ -29,7 +32,21 @@ public:
     }
 
 private:
+    HRESULT Rewind();
+    void FillWindow();
+    WCHAR *ExtractText(WCHAR *out, int minDepth, size_t maxLen);
+
     TEX_FILTER_STATE m_state;
-    WCHAR *m_pData, *m_pPtr, *m_pBuffer;
+    // the file is decoded in blocks into a window of limited size (so that
+    // memory use doesn't depend on the file's size), m_pPtr being the
+    // current position and m_pEnd the end of the decoded data
+    WCHAR *m_pData, *m_pPtr, *m_pEnd;
+    // bytes read but not decoded yet (e.g. a lead byte without its trail byte)
+    char *m_pRaw;
+    size_t m_rawLen;
+    bool m_eof;
+    // extracted text (at most one chunk at a time)
+    WCHAR *m_pBuffer, *m_pBufferEnd;
+    size_t m_chunkSize;
     int m_iDepth;
 };
@@ -13,3 +13,34 @@
 #define SZ_EPUB_FILTER_CLSID   L"{FE4C7847-4260-43e3-A449-08ED76009F94}"
 #define SZ_EPUB_FILTER_HANDLER L"{FF68D1A0-DA54-4fbf-A406-06CFDB764CA9}"
 #endif
+
+// Windows Search's filter host only gives a filter so much time and memory,
+// so text is handed out in chunks of limited size (instead of a single chunk
+// for a whole document) and extraction can be stopped after a number of pages
+// or seconds. The limits can be set through the DWORD values MaxPages,
+// MaxSeconds (both 0 for no limit) and ChunkSize (in characters) in
+// HKLM\Software\SumatraPDF\IFilter
+#define SZ_FILTER_LIMITS_KEY    L"Software\\SumatraPDF\\IFilter"
+#define DEFAULT_CHUNK_SIZE      (64 * 1024)
+
+struct FilterLimits {
+    DWORD maxPages;    // 0 for no limit
+    DWORD maxTimeMs;   // INFINITE for no limit
+    size_t chunkSize;  // in WCHARs
+    DWORD startTime;
+
+    FilterLimits() : maxPages(0), maxTimeMs(INFINITE), chunkSize(DEFAULT_CHUNK_SIZE), startTime(0) { }
+
+    // (re)reads the limits from the registry and restarts the timer
+    void Init();
+    bool IsPageAllowed(int pageNo) const { return 0 == maxPages || (DWORD)pageNo <= maxPages; }
+    // returns INFINITE for no limit and 0 once the time is up
+    DWORD RemainingMs() const;
+};
+
+class CChunkValue;
+
+// sets chunkValue to the next at most chunkSize characters of text (starting at offset
+// and preferably ending after a whitespace) and advances offset past them
+// returns false if there's no text left
+bool SetNextTextChunk(CChunkValue& chunkValue, str::Str<WCHAR>& text, size_t& offset, size_t chunkSize);
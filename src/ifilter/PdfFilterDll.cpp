@@ -4,6 +4,7 @@
 // utils
 #include "BaseUtil.h"
 #include "FileUtil.h"
+#include "HtmlParserLookup.h"
 #include "WinUtil.h"
 // ui
 #include "FilterBase.h"
@@ -18,6 +19,60 @@
 
 long g_lRefCount = 0;
 
+// don't bother with chunks too small to be worth the overhead
+#define MIN_CHUNK_SIZE 1024
+
+void FilterLimits::Init()
+{
+    DWORD value;
+    maxPages = 0;
+    if (ReadRegDWORD(HKEY_LOCAL_MACHINE, SZ_FILTER_LIMITS_KEY, L"MaxPages", value))
+        maxPages = value;
+    maxTimeMs = INFINITE;
+    if (ReadRegDWORD(HKEY_LOCAL_MACHINE, SZ_FILTER_LIMITS_KEY, L"MaxSeconds", value) && value > 0)
+        maxTimeMs = std::min(value, (DWORD)(INFINITE / 1000 - 1)) * 1000;
+    chunkSize = DEFAULT_CHUNK_SIZE;
+    if (ReadRegDWORD(HKEY_LOCAL_MACHINE, SZ_FILTER_LIMITS_KEY, L"ChunkSize", value))
+        chunkSize = std::max(value, (DWORD)MIN_CHUNK_SIZE);
+    startTime = GetTickCount();
+}
+
+DWORD FilterLimits::RemainingMs() const
+{
+    if (INFINITE == maxTimeMs)
+        return INFINITE;
+    DWORD elapsed = GetTickCount() - startTime;
+    return elapsed < maxTimeMs ? maxTimeMs - elapsed : 0;
+}
+
+bool SetNextTextChunk(CChunkValue& chunkValue, str::Str<WCHAR>& text, size_t& offset, size_t chunkSize)
+{
+    if (offset >= text.Size())
+        return false;
+    WCHAR *s = text.Get() + offset;
+    size_t len = text.Size() - offset;
+    if (len > chunkSize) {
+        // prefer not to split words, as Windows Search treats chunks separately
+        len = chunkSize;
+        for (size_t i = chunkSize; i > chunkSize / 2; i--) {
+            if (str::IsWs(s[i - 1])) {
+                len = i;
+                break;
+            }
+        }
+        // never split a surrogate pair
+        if (len == chunkSize && IS_HIGH_SURROGATE(s[len - 1]))
+            len--;
+    }
+    // temporarily terminate the chunk instead of copying it
+    WCHAR c = s[len];
+    s[len] = '\0';
+    chunkValue.SetTextValue(PKEY_Search_Contents, s, CHUNK_TEXT);
+    s[len] = c;
+    offset += len;
+    return true;
+}
+
 class CClassFactory : public IClassFactory
 {
 public:
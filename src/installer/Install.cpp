@@ -51,12 +51,82 @@ static inline void ProgressStep()
         PostMessage(gHwndProgressBar, PBM_STEPIT, 0, 0);
 }
 
+#define MAX_EXTRACT_WORKERS 4
+
+enum ExtractResult { Extract_Ok, Extract_Corrupted, Extract_WriteFailed };
+
+// decompresses a file straight into a mapped view of the destination file
+// (so that there's no need for an intermediary copy of the uncompressed data)
+static ExtractResult ExtractFile(FileTransaction& trans, lzma::SimpleArchive *archive, int idx, const WCHAR *extPath)
+{
+    lzma::FileInfo *fi = &archive->files[idx];
+    ScopedHandle hFile(trans.CreateFile(extPath, GENERIC_READ | GENERIC_WRITE, CREATE_ALWAYS));
+    if (!hFile.IsValid())
+        return Extract_WriteFailed;
+
+    if (fi->uncompressedSize > 0) {
+        ScopedHandle hMap(CreateFileMapping(hFile, nullptr, PAGE_READWRITE, 0, fi->uncompressedSize, nullptr));
+        if (!hMap.IsValid())
+            return Extract_WriteFailed;
+        char *data = (char *)MapViewOfFile(hMap, FILE_MAP_WRITE, 0, 0, 0);
+        if (!data)
+            return Extract_WriteFailed;
+        bool ok = lzma::DecompressFileByIdx(archive, idx, data);
+        UnmapViewOfFile(data);
+        if (!ok)
+            return Extract_Corrupted;
+    }
+
+    if (!SetFileTime(hFile, nullptr, nullptr, &fi->ftModified))
+        return Extract_WriteFailed;
+    return Extract_Ok;
+}
+
+// the files of the archive are compressed independently of each other,
+// so they can be extracted on several threads at once
+struct ExtractJob {
+    lzma::SimpleArchive *archive;
+    FileTransaction *trans;
+    Vec<int> files;
+    // index of the next file to extract (shared between all workers)
+    LONG nextFile;
+    // the first failure (if any) and the file it happened for
+    LONG result;
+    int failedIdx;
+
+    ExtractJob(lzma::SimpleArchive *archive, FileTransaction *trans) :
+        archive(archive), trans(trans), nextFile(0), result(Extract_Ok), failedIdx(-1) { }
+
+    void Run() {
+        LONG i;
+        while (Extract_Ok == result && (i = InterlockedIncrement(&nextFile) - 1) < (LONG)files.Count()) {
+            int idx = files.At(i);
+            ScopedMem<WCHAR> filePath(str::conv::FromUtf8(archive->files[idx].name));
+            ScopedMem<WCHAR> extPath(path::Join(gGlobalData.installDir, filePath));
+            ExtractResult res = ExtractFile(*trans, archive, idx, extPath);
+            if (res != Extract_Ok) {
+                if (Extract_Ok == InterlockedCompareExchange(&result, res, Extract_Ok))
+                    failedIdx = idx;
+                break;
+            }
+            ProgressStep();
+        }
+    }
+};
+
+class ExtractWorker : public ThreadBase {
+    ExtractJob *job;
+
+public:
+    explicit ExtractWorker(ExtractJob *job) : ThreadBase("ExtractWorker"), job(job) { }
+
+    virtual void Run() override { job->Run(); }
+};
+
 static bool ExtractFiles(lzma::SimpleArchive *archive)
 {
-    lzma::FileInfo *fi;
-    char *uncompressed;
-
     FileTransaction trans;
+    ExtractJob job(archive, &trans);
     for (int i = 0; gPayloadData[i].fileName; i++) {
         if (!gPayloadData[i].install)
             continue;
@@ -65,25 +135,34 @@ static bool ExtractFiles(lzma::SimpleArchive *archive)
             NotifyFailed(_TR("Some files to be installed are damaged or missing"));
             return false;
         }
+        job.files.Append(idx);
+    }
 
-        fi = &archive->files[idx];
-        uncompressed = lzma::GetFileDataByIdx(archive, idx, nullptr);
-        if (!uncompressed) {
-            NotifyFailed(_TR("The installer has been corrupted. Please download it again.\nSorry for the inconvenience!"));
-            return false;
-        }
-        ScopedMem<WCHAR> filePath(str::conv::FromUtf8(fi->name));
-        ScopedMem<WCHAR> extPath(path::Join(gGlobalData.installDir, filePath));
-        bool ok = trans.WriteAll(extPath, uncompressed, fi->uncompressedSize);
-        free(uncompressed);
-        if (!ok) {
-            ScopedMem<WCHAR> msg(str::Format(_TR("Couldn't write %s to disk"), filePath));
-            NotifyFailed(msg);
-            return false;
-        }
-        trans.SetModificationTime(extPath, fi->ftModified);
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    int workerCount = std::min(limitValue((int)si.dwNumberOfProcessors, 1, MAX_EXTRACT_WORKERS), (int)job.files.Count());
+    // the current thread extracts files as well
+    Vec<ExtractWorker *> workers;
+    for (int i = 1; i < workerCount; i++) {
+        ExtractWorker *worker = new ExtractWorker(&job);
+        workers.Append(worker);
+        worker->Start();
+    }
+    job.Run();
+    for (ExtractWorker *worker : workers) {
+        worker->Join();
+        delete worker;
+    }
 
-        ProgressStep();
+    if (Extract_Corrupted == job.result) {
+        NotifyFailed(_TR("The installer has been corrupted. Please download it again.\nSorry for the inconvenience!"));
+        return false;
+    }
+    if (Extract_WriteFailed == job.result) {
+        ScopedMem<WCHAR> filePath(str::conv::FromUtf8(archive->files[job.failedIdx].name));
+        ScopedMem<WCHAR> msg(str::Format(_TR("Couldn't write %s to disk"), filePath));
+        NotifyFailed(msg);
+        return false;
     }
 
     return trans.Commit();
@@ -28,6 +28,7 @@ The installer is good enough for production but it doesn't mean it couldn't be i
 #include "Translations.h"
 #include "Resource.h"
 #include "Timer.h"
+#include "ThreadUtil.h"
 #include "Version.h"
 #include "WinUtil.h"
 #include "Installer.h"
@@ -29,6 +29,23 @@ namespace MemTraceCollector
             FreeData = 2,
         };
 
+        // must match MemTraceTag in src/utils/DebugLog.h
+        public enum MemTag : ushort {
+            None = 0,
+            RenderCache,
+            DisplayLists,
+            TextCache,
+            EbookLayout,
+            ImageCache,
+            Count
+        };
+
+        public struct AllocInfo
+        {
+            public UInt32 Size;
+            public MemTag Tag;
+        }
+
         public class PipeClient
         {
             public SafeFileHandle FileHandle;
@@ -36,7 +53,8 @@ namespace MemTraceCollector
             public event NewMessageHandler NewMessage;
             public event ClientDisconnectedHandler ClientDisconnected;
             public UInt64 CurrAllocated;
-            public Dictionary<UInt32, UInt32> CurrAllocsMap = new Dictionary<uint, uint>(16 * 1024);
+            public Dictionary<UInt32, AllocInfo> CurrAllocsMap = new Dictionary<uint, AllocInfo>(16 * 1024);
+            public UInt64[] TagTotals = new UInt64[(int)MemTag.Count];
 
             public void NotifyNewMessage(byte[] msg)
             {
@@ -98,6 +116,7 @@ namespace MemTraceCollector
             int allocs = client.CurrAllocsMap.Count;
             ulong currAllocated = client.CurrAllocated;
             labelCurrAllocated.Text = String.Format("Currently allocated: {0} in {1} allocations", currAllocated, allocs);
+            ShowTagTotals(client);
         }
 
         void pipeClient_NewMessage(PipeClient client, byte[] msg)
@@ -109,29 +128,52 @@ namespace MemTraceCollector
         {
             UInt32 size = BitConverter.ToUInt32(msg, 2);
             UInt32 addr = BitConverter.ToUInt32(msg, 2 + 4);
+            MemTag tag = MemTag.None;
+            // older versions of memtrace.dll don't send the tag
+            if (msg.Length >= 2 + 4 + 4 + 2)
+                tag = (MemTag)BitConverter.ToUInt16(msg, 2 + 4 + 4);
+            if (tag >= MemTag.Count)
+                tag = MemTag.None;
             client.CurrAllocated += size;
-            client.CurrAllocsMap[addr] = size;
-            UpdateCurrAllocated(client.CurrAllocated);
+            client.TagTotals[(int)tag] += size;
+            AllocInfo info = new AllocInfo();
+            info.Size = size;
+            info.Tag = tag;
+            client.CurrAllocsMap[addr] = info;
+            UpdateCurrAllocated(client);
         }
 
         void DecodeFreeDataMsg(PipeClient client, byte[] msg)
         {
             UInt32 addr = BitConverter.ToUInt32(msg, 2);
-            UInt32 size;
-            if (!client.CurrAllocsMap.TryGetValue(addr, out size))
+            AllocInfo info;
+            if (!client.CurrAllocsMap.TryGetValue(addr, out info))
                 return;
-            client.CurrAllocated -= size;
+            client.CurrAllocated -= info.Size;
+            client.TagTotals[(int)info.Tag] -= info.Size;
             client.CurrAllocsMap.Remove(addr);
-            UpdateCurrAllocated(client.CurrAllocated);
+            UpdateCurrAllocated(client);
+        }
+
+        void ShowTagTotals(PipeClient client)
+        {
+            StringBuilder sb = new StringBuilder();
+            for (int i = 0; i < (int)MemTag.Count; i++)
+            {
+                sb.AppendFormat("{0}: {1}", (MemTag)i, client.TagTotals[i]);
+                sb.AppendLine();
+            }
+            tbFromClients.Text = sb.ToString();
         }
 
         DateTime currAllocatedLastUpdateTime = DateTime.Now;
-        void UpdateCurrAllocated(ulong currAllocated)
+        void UpdateCurrAllocated(PipeClient client)
         {
             TimeSpan diff = DateTime.Now - currAllocatedLastUpdateTime;
             if (diff.TotalMilliseconds < 1000)
                 return;
-            labelCurrAllocated.Text = String.Format("Currently allocated: {0}", currAllocated);
+            labelCurrAllocated.Text = String.Format("Currently allocated: {0}", client.CurrAllocated);
+            ShowTagTotals(client);
             currAllocatedLastUpdateTime = DateTime.Now;
         }
 
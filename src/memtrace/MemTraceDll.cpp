@@ -17,6 +17,10 @@ The data sent via named pipe is framed as messages (packets):
 uint16  messageLen; // length of the data follows
 uint16  msgId;      // determines how the data is to be decoded
 byte    data[];     // bytes for a given message
+
+An app can attribute allocations to its subsystems by calling the exported
+MemTraceSetTag() at the entry points of those subsystems (cf. ScopedMemTraceTag
+in DebugLog.h). The tag is kept per thread and sent along with every allocation.
 */
 
 #include "BaseUtil.h"
@@ -53,6 +57,8 @@ struct MemBlock {
 struct PerThreadData {
     bool        inAlloc;
     bool        inFree;
+    // set by the app through MemTraceSetTag
+    int         tag;
 };
 
 static HANDLE           gModule;
@@ -103,6 +109,7 @@ static PerThreadData *GetPerThreadData(PerThreadData *threadDataEmergency)
     PerThreadData *tmp = (PerThreadData*)data;
     tmp->inAlloc = false;
     tmp->inFree = false;
+    tmp->tag = 0;
     return tmp;
 }
 
@@ -212,6 +219,7 @@ enum SerializeMsgId {
 struct AllocData {
     uint32    size;
     uint32    addr;
+    uint16    tag;
 };
 
 struct FreeData {
@@ -240,6 +248,7 @@ struct TypeSerializeInfo {
 MemberSerializeInfo allocDataSerMemberInfo[] = {
     { MemberSerializeInfo::UInt32, offsetof(AllocData, size) },
     { MemberSerializeInfo::UInt32, offsetof(AllocData, addr) },
+    { MemberSerializeInfo::UInt16, offsetof(AllocData, tag) },
     SERIALIZEINFO_SENTINEL
 };
 
@@ -473,7 +482,7 @@ PVOID WINAPI RtlAllocateHeapHook(PVOID heapHandle, ULONG flags, SIZE_T size)
     if (!gPipe || (gHeap == heapHandle) || gStopSendThread)
         return gRtlAllocateHeapOrig(heapHandle, flags, size);
 
-    PerThreadData threadDataEmergency = { true, true };
+    PerThreadData threadDataEmergency = { true, true, 0 };
     PerThreadData *threadData = GetPerThreadData(&threadDataEmergency);
     bool inAlloc = threadData->inAlloc;
     // prevent infinite recursion
@@ -483,7 +492,7 @@ PVOID WINAPI RtlAllocateHeapHook(PVOID heapHandle, ULONG flags, SIZE_T size)
     if (inAlloc)
         return res;
 
-    AllocData d = { (uint32)size, (uint32)res };
+    AllocData d = { (uint32)size, (uint32)res, (uint16)threadData->tag };
     Vec<byte> msg;
     SerializeType((byte*)&d, &allocDataTypeInfo, msg);
     QueueMessageForSending(msg);
@@ -496,7 +505,7 @@ BOOLEAN WINAPI RtlFreeHeapHook(PVOID heapHandle, ULONG flags, PVOID heapBase)
     if (!gPipe || (gHeap == heapHandle) || gStopSendThread)
         return gRtlFreeHeapOrig(heapHandle, flags, heapBase);
 
-    PerThreadData threadDataEmergency = { true, true };
+    PerThreadData threadDataEmergency = { true, true, 0 };
     PerThreadData *threadData = GetPerThreadData(&threadDataEmergency);
     bool inFree = threadData->inFree;
     // prevent infinite recursion
@@ -513,6 +522,18 @@ BOOLEAN WINAPI RtlFreeHeapHook(PVOID heapHandle, ULONG flags, PVOID heapBase)
     return res;
 }
 
+// sets the tag sent with the calling thread's allocations and returns the previous one
+extern "C" __declspec(dllexport) int MemTraceSetTag(int tag)
+{
+    if (!gPipe)
+        return 0;
+    PerThreadData threadDataEmergency = { true, true, 0 };
+    PerThreadData *threadData = GetPerThreadData(&threadDataEmergency);
+    int prevTag = threadData->tag;
+    threadData->tag = tag;
+    return prevTag;
+}
+
 static void InstallHooks()
 {
     gNtdllIntercept.Init("ntdll.dll");
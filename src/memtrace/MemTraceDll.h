@@ -1,2 +1,5 @@
 /* Copyright 2015 the SumatraPDF project authors (see AUTHORS file).
    License: Simplified BSD (see COPYING.BSD) */
+
+// the only export of memtrace.dll (see MemTraceDll.cpp)
+extern "C" __declspec(dllexport) int MemTraceSetTag(int tag);
@@ -103,12 +103,16 @@ void FreeGraphicsForMeasureText(Graphics *g) {
 // allow for calls to mui::Initialize and mui::Destroy to be nested
 static LONG gMiniMuiRefCount = 0;
 
-void Initialize() { InterlockedIncrement(&gMiniMuiRefCount); }
+void Initialize() {
+    if (InterlockedIncrement(&gMiniMuiRefCount) == 1)
+        InitializeTextRender();
+}
 
 void Destroy() {
     if (InterlockedDecrement(&gMiniMuiRefCount) != 0)
         return;
 
+    DestroyTextRender();
     delete gFontCache;
     gFontCache = nullptr;
     delete gGraphicsHack;
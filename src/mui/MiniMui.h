@@ -33,6 +33,9 @@ CachedFont *GetCachedFont(const WCHAR *name, float sizePt, Gdiplus::FontStyle st
 void InitGraphicsMode(Gdiplus::Graphics *g);
 Gdiplus::Graphics *AllocGraphicsForMeasureText();
 void FreeGraphicsForMeasureText(Gdiplus::Graphics *g);
+
+void InitializeTextRender();
+void DestroyTextRender();
 };
 
 class ScopedMiniMui {
@@ -42,6 +42,7 @@ static bool gDebugPaint = false;
 
 void Initialize() {
     InitializeBase();
+    InitializeTextRender();
     css::Initialize();
 }
 
@@ -49,6 +50,7 @@ void Destroy() {
     FreeControlCreators();
     FreeLayoutCreators();
     css::Destroy();
+    DestroyTextRender();
     DestroyBase();
 }
 
@@ -32,6 +32,8 @@ namespace mui {
 TextRenderGdi *TextRenderGdi::Create(Graphics *gfx) {
     TextRenderGdi *res = new TextRenderGdi();
     res->gfx = gfx;
+    res->method = TextRenderMethodGdi;
+    res->widthCache.Init(res->method, gfx->GetDpiY());
     // default to red to make mistakes stand out
     res->SetTextColor(Color(0xff, 0xff, 0x0, 0x0));
     res->CreateHdcForTextMeasure(); // could do lazily, but that's more things to track, so not
@@ -111,6 +113,10 @@ float TextRenderGdi::GetCurrFontLineSpacing() {
 }
 
 RectF TextRenderGdi::Measure(const WCHAR *s, size_t sLen) {
+    return widthCache.Measure(this, currFont, s, sLen);
+}
+
+RectF TextRenderGdi::MeasureUncached(const WCHAR *s, size_t sLen) {
     SIZE txtSize;
     GetTextExtentPoint32W(hdcForTextMeasure, s, (int)sLen, &txtSize);
     RectF res(0.0f, 0.0f, (float)txtSize.cx, (float)txtSize.cy);
@@ -187,6 +193,39 @@ void TextRenderGdi::Draw(const char *s, size_t sLen, RectF &bb, bool isRtl) {
 #endif
 }
 
+// draws all parts with a single ExtTextOut call, using the cached
+// character widths for the distances between adjacent characters
+void TextRenderGdi::DrawRun(const WCHAR *s, const TextRunPart *parts, size_t partsCount) {
+    CrashIf(!hdcGfxLocked); // hasn't been Lock()ed
+    if (partsCount < 2 || !GetRunCharPositions(widthCache, this, currFont, s, parts, partsCount, runXs)) {
+        ITextRender::DrawRun(s, parts, partsCount);
+        return;
+    }
+
+    size_t sLen = runXs.Count() - 1;
+    runDx.Reset();
+    INT *dx = runDx.AppendBlanks(sLen);
+    // round the same way as Draw() does for the start of every part
+    size_t partIdx = 0, partEnd = parts[0].len;
+    int partX = (int)parts[0].bbox.X;
+    int x = partX;
+    for (size_t i = 0; i < sLen; i++) {
+        int next;
+        if (i + 1 == partEnd && partIdx + 1 < partsCount) {
+            partEnd += parts[++partIdx].len;
+            partX = (int)parts[partIdx].bbox.X;
+            next = partX;
+        } else {
+            next = partX + (int)floorf(runXs.At(i + 1) - parts[partIdx].bbox.X + 0.5f);
+        }
+        dx[i] = next - x;
+        x = next;
+    }
+
+    int y = (int)parts[0].bbox.Y;
+    ExtTextOut(hdcGfxLocked, (int)parts[0].bbox.X, y, ETO_OPAQUE, nullptr, s, (UINT)sLen, dx);
+}
+
 void TextRenderGdi::FreeMemBmp() { DeleteObject(memBmp); }
 
 void TextRenderGdi::CreateClearBmpOfSize(int dx, int dy) {
@@ -283,6 +322,8 @@ TextRenderGdiplus *TextRenderGdiplus::Create(Graphics *gfx,
         res->measureAlgo = MeasureTextAccurate;
     else
         res->measureAlgo = measureAlgo;
+    res->method = MeasureTextQuick == res->measureAlgo ? TextRenderMethodGdiplusQuick : TextRenderMethodGdiplus;
+    res->widthCache.Init(res->method, gfx->GetDpiY());
     // default to red to make mistakes stand out
     res->SetTextColor(Color(0xff, 0xff, 0x0, 0x0));
     return res;
@@ -296,6 +337,11 @@ void TextRenderGdiplus::SetFont(mui::CachedFont *font) {
 float TextRenderGdiplus::GetCurrFontLineSpacing() { return currFont->font->GetHeight(gfx); }
 
 RectF TextRenderGdiplus::Measure(const WCHAR *s, size_t sLen) {
+    CrashIf(!currFont);
+    return widthCache.Measure(this, currFont, s, sLen);
+}
+
+RectF TextRenderGdiplus::MeasureUncached(const WCHAR *s, size_t sLen) {
     CrashIf(!currFont);
     return MeasureText(gfx, currFont->font, s, sLen, measureAlgo);
 }
@@ -303,7 +349,7 @@ RectF TextRenderGdiplus::Measure(const WCHAR *s, size_t sLen) {
 RectF TextRenderGdiplus::Measure(const char *s, size_t sLen) {
     CrashIf(!currFont);
     size_t strLen = str::Utf8ToWcharBuf(s, sLen, txtConvBuf, dimof(txtConvBuf));
-    return MeasureText(gfx, currFont->font, txtConvBuf, strLen, measureAlgo);
+    return Measure(txtConvBuf, strLen);
 }
 
 TextRenderGdiplus::~TextRenderGdiplus() { ::delete textColorBrush; }
@@ -335,6 +381,36 @@ void TextRenderGdiplus::Draw(const char *s, size_t sLen, RectF &bb, bool isRtl)
     Draw(txtConvBuf, strLen, bb, isRtl);
 }
 
+// draws all parts with a single DrawDriverString call, using the cached
+// character widths for positioning the individual characters
+void TextRenderGdiplus::DrawRun(const WCHAR *s, const TextRunPart *parts, size_t partsCount) {
+    bool canBatch = partsCount > 1 && GetRunCharPositions(widthCache, this, currFont, s, parts, partsCount, runXs);
+    // unlike DrawString, DrawDriverString doesn't fall back to other
+    // fonts for missing glyphs, so only batch the most common scripts
+    size_t sLen = canBatch ? runXs.Count() - 1 : 0;
+    for (size_t i = 0; i < sLen && canBatch; i++) {
+        canBatch = s[i] < 0x0590;
+    }
+    if (!canBatch) {
+        ITextRender::DrawRun(s, parts, partsCount);
+        return;
+    }
+
+    // DrawString positions text by its top, DrawDriverString by its baseline
+    FontFamily family;
+    currFont->font->GetFamily(&family);
+    INT style = currFont->font->GetStyle();
+    REAL ascent = currFont->font->GetHeight(gfx) * family.GetCellAscent(style) / family.GetLineSpacing(style);
+
+    runPoints.Reset();
+    PointF *points = runPoints.AppendBlanks(sLen);
+    for (size_t i = 0; i < sLen; i++) {
+        points[i] = PointF(runXs.At(i), parts[0].bbox.Y + ascent);
+    }
+    gfx->DrawDriverString((const UINT16 *)s, (INT)sLen, currFont->font, textColorBrush, points,
+                          DriverStringOptionsCmapLookup, nullptr);
+}
+
 void TextRenderHdc::Lock() {
     int dx = bmi.bmiHeader.biWidth;
     int dy = bmi.bmiHeader.biHeight;
@@ -350,6 +426,8 @@ void TextRenderHdc::Unlock() {
 TextRenderHdc *TextRenderHdc::Create(Graphics *gfx, int dx, int dy) {
     TextRenderHdc *res = new TextRenderHdc();
     res->gfx = gfx;
+    res->method = TextRenderMethodHdc;
+    res->widthCache.Init(res->method, gfx->GetDpiY());
 
     HDC hdc = gfx->GetHDC();
     res->hdc = CreateCompatibleDC(hdc);
@@ -415,6 +493,10 @@ Gdiplus::RectF TextRenderHdc::Measure(const char *s, size_t sLen) {
 }
 
 Gdiplus::RectF TextRenderHdc::Measure(const WCHAR *s, size_t sLen) {
+    return widthCache.Measure(this, currFont, s, sLen);
+}
+
+Gdiplus::RectF TextRenderHdc::MeasureUncached(const WCHAR *s, size_t sLen) {
     SIZE txtSize;
     CrashIf(!hdc);
     GetTextExtentPoint32W(hdc, s, (int)sLen, &txtSize);
@@ -447,6 +529,297 @@ TextRenderHdc::~TextRenderHdc() {
     DeleteDC(hdc);
 }
 
+// only characters whose width doesn't depend on their neighbors (beyond what
+// pair adjustments account for) are measured through the CharWidthCache,
+// i.e. no combining marks, surrogates, bidi controls or scripts requiring shaping
+static bool IsCacheableChar(WCHAR c) {
+    if (c < 0x20)
+        return false;
+    if (c < 0x0300)
+        return true;
+    if (c < 0x0370)
+        return false;
+    if (c < 0x0590)
+        return true;
+    if (c >= 0x1E00 && c < 0x2070)
+        return (c < 0x200B || c > 0x200F) && (c < 0x202A || c > 0x202E);
+    if (c >= 0x3000 && c < 0xD800)
+        return true;
+    if (c >= 0xF900 && c < 0xFB00)
+        return true;
+    return c >= 0xFF00 && c < 0xFFF0;
+}
+
+static size_t PairHash(uint32 key) { return (size_t)(key * 2654435761u); }
+
+struct FontWidths {
+    CachedFont *font;
+    TextRenderMethod method;
+    float dpi;
+    // number of CharWidthCaches using these widths
+    int refCount;
+    // protects everything below, as the widths are measured by
+    // whichever thread first needs them
+    CRITICAL_SECTION cs;
+
+    float height;
+    // blocks of 256 advance widths (negative if not yet measured)
+    float *blocks[256];
+    // open addressing hash table for pairs, keyed by (c1 << 16) | c2
+    uint32 *pairKeys;
+    float *pairAdjusts;
+    size_t pairCount;
+    size_t pairCap;
+};
+
+// unused widths are evicted once there are more than that many
+#define MAX_SHARED_FONT_WIDTHS 128
+
+// Global, thread-safe cache of measured font widths. CachedFont objects
+// live forever, so it's safe to key the widths by the font's address
+static CRITICAL_SECTION gFontWidthsCs;
+static Vec<FontWidths *> *gFontWidths = nullptr;
+
+static void FreeFontWidths(FontWidths *fw) {
+    for (size_t i = 0; i < dimof(fw->blocks); i++) {
+        free(fw->blocks[i]);
+    }
+    free(fw->pairKeys);
+    free(fw->pairAdjusts);
+    DeleteCriticalSection(&fw->cs);
+    free(fw);
+}
+
+void InitializeTextRender() {
+    InitializeCriticalSection(&gFontWidthsCs);
+    gFontWidths = new Vec<FontWidths *>();
+}
+
+void DestroyTextRender() {
+    for (FontWidths *fw : *gFontWidths) {
+        FreeFontWidths(fw);
+    }
+    delete gFontWidths;
+    gFontWidths = nullptr;
+    DeleteCriticalSection(&gFontWidthsCs);
+}
+
+static FontWidths *AcquireFontWidths(CachedFont *font, TextRenderMethod method, float dpi) {
+    if (!gFontWidths)
+        return nullptr;
+    ScopedCritSec scope(&gFontWidthsCs);
+
+    for (FontWidths *fw : *gFontWidths) {
+        if (fw->font == font && fw->method == method && fw->dpi == dpi) {
+            fw->refCount++;
+            return fw;
+        }
+    }
+
+    if (gFontWidths->Count() >= MAX_SHARED_FONT_WIDTHS) {
+        for (size_t i = 0; i < gFontWidths->Count();) {
+            FontWidths *fw = gFontWidths->At(i);
+            if (0 == fw->refCount) {
+                FreeFontWidths(fw);
+                gFontWidths->RemoveAt(i);
+            } else {
+                i++;
+            }
+        }
+    }
+
+    FontWidths *fw = AllocStruct<FontWidths>();
+    if (!fw)
+        return nullptr;
+    fw->font = font;
+    fw->method = method;
+    fw->dpi = dpi;
+    fw->refCount = 1;
+    InitializeCriticalSection(&fw->cs);
+    gFontWidths->Append(fw);
+    return fw;
+}
+
+static void ReleaseFontWidths(FontWidths *fw) {
+    ScopedCritSec scope(&gFontWidthsCs);
+    CrashIf(fw->refCount <= 0);
+    fw->refCount--;
+}
+
+CharWidthCache::~CharWidthCache() {
+    for (FontWidths *fw : fonts) {
+        ReleaseFontWidths(fw);
+    }
+}
+
+void CharWidthCache::Init(TextRenderMethod method, float dpi) {
+    CrashIf(fonts.Count() > 0);
+    this->method = method;
+    this->dpi = dpi;
+}
+
+FontWidths *CharWidthCache::GetFontWidths(CachedFont *font) {
+    if (lastFont && lastFont->font == font)
+        return lastFont;
+    for (FontWidths *fw : fonts) {
+        if (fw->font == font) {
+            lastFont = fw;
+            return fw;
+        }
+    }
+    FontWidths *fw = AcquireFontWidths(font, method, dpi);
+    if (!fw)
+        return nullptr;
+    fonts.Append(fw);
+    lastFont = fw;
+    return fw;
+}
+
+// the caller must hold fw->cs
+static float CharWidth(FontWidths *fw, ITextRender *tr, WCHAR c) {
+    float *&block = fw->blocks[c >> 8];
+    if (!block) {
+        block = AllocArray<float>(256);
+        if (!block)
+            return tr->MeasureUncached(&c, 1).Width;
+        for (int i = 0; i < 256; i++) {
+            block[i] = -1;
+        }
+    }
+    float &dx = block[c & 0xFF];
+    if (dx < 0) {
+        RectF bbox = tr->MeasureUncached(&c, 1);
+        dx = bbox.Width;
+        if (bbox.Height > fw->height)
+            fw->height = bbox.Height;
+    }
+    return dx;
+}
+
+// the difference between the width of two characters measured
+// together and the sum of their individual widths (the caller must hold fw->cs)
+static float PairAdjust(FontWidths *fw, ITextRender *tr, WCHAR c1, WCHAR c2) {
+    // keys are never 0, as both characters are >= 0x20
+    uint32 key = ((uint32)c1 << 16) | c2;
+    size_t mask = fw->pairCap - 1;
+    if (fw->pairCap > 0) {
+        for (size_t i = PairHash(key) & mask; fw->pairKeys[i]; i = (i + 1) & mask) {
+            if (fw->pairKeys[i] == key)
+                return fw->pairAdjusts[i];
+        }
+    }
+
+    WCHAR pair[2] = { c1, c2 };
+    float adjust = tr->MeasureUncached(pair, 2).Width - CharWidth(fw, tr, c1) - CharWidth(fw, tr, c2);
+
+    // keep the table at most half full
+    if ((fw->pairCount + 1) * 2 > fw->pairCap) {
+        size_t newCap = fw->pairCap > 0 ? fw->pairCap * 2 : 1024;
+        uint32 *keys = AllocArray<uint32>(newCap);
+        float *adjusts = AllocArray<float>(newCap);
+        if (!keys || !adjusts) {
+            free(keys);
+            free(adjusts);
+            return adjust;
+        }
+        mask = newCap - 1;
+        for (size_t i = 0; i < fw->pairCap; i++) {
+            if (!fw->pairKeys[i])
+                continue;
+            size_t j = PairHash(fw->pairKeys[i]) & mask;
+            while (keys[j]) {
+                j = (j + 1) & mask;
+            }
+            keys[j] = fw->pairKeys[i];
+            adjusts[j] = fw->pairAdjusts[i];
+        }
+        free(fw->pairKeys);
+        free(fw->pairAdjusts);
+        fw->pairKeys = keys;
+        fw->pairAdjusts = adjusts;
+        fw->pairCap = newCap;
+    }
+    size_t i = PairHash(key) & mask;
+    while (fw->pairKeys[i]) {
+        i = (i + 1) & mask;
+    }
+    fw->pairKeys[i] = key;
+    fw->pairAdjusts[i] = adjust;
+    fw->pairCount++;
+    return adjust;
+}
+
+RectF CharWidthCache::Measure(ITextRender *tr, CachedFont *font, const WCHAR *s, size_t sLen) {
+    if (0 == sLen || !font)
+        return tr->MeasureUncached(s, sLen);
+    for (size_t i = 0; i < sLen; i++) {
+        if (!IsCacheableChar(s[i]))
+            return tr->MeasureUncached(s, sLen);
+    }
+    FontWidths *fw = GetFontWidths(font);
+    if (!fw)
+        return tr->MeasureUncached(s, sLen);
+
+    ScopedCritSec scope(&fw->cs);
+    float dx = CharWidth(fw, tr, s[0]);
+    for (size_t i = 1; i < sLen; i++) {
+        dx += CharWidth(fw, tr, s[i]) + PairAdjust(fw, tr, s[i - 1], s[i]);
+    }
+    return RectF(0.0f, 0.0f, dx, fw->height);
+}
+
+bool CharWidthCache::GetCharPositions(ITextRender *tr, CachedFont *font, const WCHAR *s, size_t sLen, float *xs) {
+    if (0 == sLen || !font)
+        return false;
+    for (size_t i = 0; i < sLen; i++) {
+        if (!IsCacheableChar(s[i]))
+            return false;
+    }
+    FontWidths *fw = GetFontWidths(font);
+    if (!fw)
+        return false;
+
+    ScopedCritSec scope(&fw->cs);
+    xs[0] = 0;
+    for (size_t i = 1; i < sLen; i++) {
+        xs[i] = xs[i - 1] + CharWidth(fw, tr, s[i - 1]) + PairAdjust(fw, tr, s[i - 1], s[i]);
+    }
+    xs[sLen] = xs[sLen - 1] + CharWidth(fw, tr, s[sLen - 1]);
+    return true;
+}
+
+void ITextRender::DrawRun(const WCHAR *s, const TextRunPart *parts, size_t partsCount) {
+    for (size_t i = 0; i < partsCount; i++) {
+        RectF bb = parts[i].bbox;
+        Draw(s, parts[i].len, bb, false);
+        s += parts[i].len;
+    }
+}
+
+// sets xs to the absolute horizontal positions of all characters of a run
+// followed by the position of its end (returns false if a part can't be
+// measured one character at a time)
+static bool GetRunCharPositions(CharWidthCache &cache, ITextRender *tr, CachedFont *font, const WCHAR *s,
+                                const TextRunPart *parts, size_t partsCount, Vec<float> &xs) {
+    size_t sLen = 0;
+    for (size_t i = 0; i < partsCount; i++) {
+        sLen += parts[i].len;
+    }
+    xs.Reset();
+    float *pos = xs.AppendBlanks(sLen + 1);
+    for (size_t i = 0; i < partsCount; i++) {
+        // the end position of a part is overwritten with the start of the next one
+        if (!cache.GetCharPositions(tr, font, s, parts[i].len, pos))
+            return false;
+        for (size_t j = 0; j <= parts[i].len; j++) {
+            pos[j] += parts[i].bbox.X;
+        }
+        s += parts[i].len;
+        pos += parts[i].len;
+    }
+    return true;
+}
+
 ITextRender *CreateTextRender(TextRenderMethod method, Graphics *gfx, int dx, int dy) {
     ITextRender *res = nullptr;
     if (TextRenderMethodGdiplus == method) {
@@ -461,44 +834,61 @@ ITextRender *CreateTextRender(TextRenderMethod method, Graphics *gfx, int dx, in
     if (TextRenderMethodHdc == method) {
         res = TextRenderHdc::Create(gfx, dx, dy);
     }
-    CrashIf(!res);
-    res->method = method;
+    CrashIf(!res || res->method != method);
     return res;
 }
 
+static bool IsIdeograph(WCHAR c) {
+    return (c >= 0x3040 && c < 0xA000) || (c >= 0xAC00 && c < 0xD7B0) || (c >= 0xF900 && c < 0xFB00);
+}
+
+// whether a line may be broken between c and next inside an unbroken run of
+// text, i.e. after URL and path delimiters, after CJK commas and full stops
+// and between two ideographs
+static bool IsBreakOpportunity(WCHAR c, WCHAR next) {
+    switch (c) {
+    case '/': case '\\': case '-': case '?': case '&': case '=':
+    case 0x3001: case 0x3002: case 0xFF0C: case 0xFF0E:
+        return true;
+    }
+    return IsIdeograph(c) && IsIdeograph(next);
+}
+
 // returns number of characters of string s that fits in a given width dx
-// note: could be speed up a bit because in our use case we already know
-// the width of the whole string so we could supply it to the function, but
-// this shouldn't happen often, so that's fine. It's also possible that
-// a smarter approach is possible, but this usually only does 3 MeasureText
-// calls, so it's not that bad
+// (at least 1, so that callers always make progress)
+// note: this does a binary search over measured prefixes, starting with a guess
+// based on the width of the whole string (which usually is a good guess), so
+// that long unbroken runs such as URLs or CJK text don't need a measurement per
+// character. The last break opportunity in the second half of the prefix that
+// fits is preferred, if there is one.
 size_t StringLenForWidth(ITextRender *textMeasure, const WCHAR *s, size_t len, float dx) {
     RectF r = textMeasure->Measure(s, len);
     if (r.Width <= dx)
         return len;
-    // make the best guess of the length that fits
+    // invariant: s[0..fits) fits within dx and s[0..tooLong) doesn't
+    size_t fits = 0, tooLong = len;
+    // probe the guess and its neighbor first, as the guess is usually close
     size_t n = (size_t)((dx / r.Width) * (float)len);
-    CrashIf((0 == n) || (n > len));
-    r = textMeasure->Measure(s, n);
-    // find the length len of s that fits within dx iff width of len+1 exceeds dx
-    int dir = 1; // increasing length
-    if (r.Width > dx)
-        dir = -1; // decreasing length
-    for (;;) {
-        n += dir;
+    for (int probes = 0; tooLong - fits > 1; probes++) {
+        if (probes > 1 || n <= fits || n >= tooLong)
+            n = fits + (tooLong - fits) / 2;
         r = textMeasure->Measure(s, n);
-        if (1 == dir) {
-            // if advancing length, we know that previous string did fit, so if
-            // the new one doesn't fit, the previous length was the right one
-            if (r.Width > dx)
-                return n - 1;
+        if (r.Width <= dx) {
+            fits = n;
+            n++;
         } else {
-            // if decreasing length, we know that previous string didn't fit, so if
-            // the one one fits, it's of the correct length
-            if (r.Width < dx)
-                return n;
+            tooLong = n;
+            n--;
         }
     }
+    if (0 == fits)
+        return 1;
+
+    for (size_t i = fits; i > fits / 2; i--) {
+        if (IsBreakOpportunity(s[i - 1], s[i]))
+            return i;
+    }
+    return fits;
 }
 
 // TODO: not quite sure why spaceDx1 != spaceDx2, using spaceDx2 because
@@ -10,6 +10,43 @@ enum TextRenderMethod {
     // TextRenderDirectDraw
 };
 
+class ITextRender;
+
+// one of several strings drawn with a single ITextRender::DrawRun call
+struct TextRunPart {
+    size_t len;
+    Gdiplus::RectF bbox;
+};
+
+struct FontWidths;
+
+// caches the advance widths of characters per font (in a dense table for
+// the BMP) as well as adjustments for pairs of characters (e.g. kerning),
+// so that most strings can be measured by summing up widths instead of
+// asking GDI or GDI+ to measure every single word.
+// The widths are shared between all caches (i.e. all threads, documents and
+// layouts) measuring the same font with the same method and resolution
+class CharWidthCache {
+    // the shared widths this cache holds a reference to
+    Vec<FontWidths *> fonts;
+    FontWidths *lastFont;
+    TextRenderMethod method;
+    float dpi;
+
+    FontWidths *GetFontWidths(CachedFont *font);
+
+  public:
+    CharWidthCache() : lastFont(nullptr), method(TextRenderMethodGdiplus), dpi(0) {}
+    ~CharWidthCache();
+
+    // must be called before measuring anything
+    void Init(TextRenderMethod method, float dpi);
+    Gdiplus::RectF Measure(ITextRender *tr, CachedFont *font, const WCHAR *s, size_t sLen);
+    // sets xs[i] to the offset of s[i] from the start of s and xs[sLen] to the
+    // width of s (returns false if s can't be measured one character at a time)
+    bool GetCharPositions(ITextRender *tr, CachedFont *font, const WCHAR *s, size_t sLen, float *xs);
+};
+
 class ITextRender {
   public:
     virtual void SetFont(CachedFont *font) = 0;
@@ -25,6 +62,8 @@ class ITextRender {
 
     virtual Gdiplus::RectF Measure(const char *s, size_t sLen) = 0;
     virtual Gdiplus::RectF Measure(const WCHAR *s, size_t sLen) = 0;
+    // measures without consulting the CharWidthCache
+    virtual Gdiplus::RectF MeasureUncached(const WCHAR *s, size_t sLen) = 0;
 
     // GDI+ calls cannot be done if we called Graphics::GetHDC(). However, getting/releasing
     // hdc is very expensive and kills performance if we do it for every Draw(). So we add
@@ -35,6 +74,10 @@ class ITextRender {
 
     virtual void Draw(const char *s, size_t sLen, RectF &bb, bool isRtl) = 0;
     virtual void Draw(const WCHAR *s, size_t sLen, RectF &bb, bool isRtl) = 0;
+    // draws several left-to-right strings of the same line in the current font with as
+    // few calls as possible (s contains the strings back to back, parts their lengths
+    // and positions). The default implementation draws them one by one
+    virtual void DrawRun(const WCHAR *s, const TextRunPart *parts, size_t partsCount);
 
     virtual ~ITextRender(){};
 
@@ -51,6 +94,9 @@ class TextRenderGdi : public ITextRender {
     Gdiplus::Color textColor;
     Gdiplus::Color textBgColor;
     WCHAR txtConvBuf[512];
+    CharWidthCache widthCache;
+    Vec<float> runXs;
+    Vec<INT> runDx;
 
     HDC memHdc;
     HGDIOBJ memHdcPrevFont;
@@ -92,12 +138,14 @@ class TextRenderGdi : public ITextRender {
 
     Gdiplus::RectF Measure(const char *s, size_t sLen) override;
     Gdiplus::RectF Measure(const WCHAR *s, size_t sLen) override;
+    Gdiplus::RectF MeasureUncached(const WCHAR *s, size_t sLen) override;
 
     void Lock() override;
     void Unlock() override;
 
     void Draw(const char *s, size_t sLen, RectF &bb, bool isRtl) override;
     void Draw(const WCHAR *s, size_t sLen, RectF &bb, bool isRtl) override;
+    void DrawRun(const WCHAR *s, const TextRunPart *parts, size_t partsCount) override;
 
     void DrawTransparent(const char *s, size_t sLen, RectF &bb, bool isRtl);
     void DrawTransparent(const WCHAR *s, size_t sLen, RectF &bb, bool isRtl);
@@ -115,6 +163,9 @@ class TextRenderGdiplus : public ITextRender {
     Gdiplus::Color textColor;
     Gdiplus::Brush *textColorBrush;
     WCHAR txtConvBuf[512];
+    CharWidthCache widthCache;
+    Vec<float> runXs;
+    Vec<Gdiplus::PointF> runPoints;
 
     TextRenderGdiplus()
         : gfx(nullptr), currFont(nullptr), textColorBrush(nullptr), textColor(0, 0, 0, 0) {}
@@ -133,12 +184,14 @@ class TextRenderGdiplus : public ITextRender {
 
     Gdiplus::RectF Measure(const char *s, size_t sLen) override;
     Gdiplus::RectF Measure(const WCHAR *s, size_t sLen) override;
+    Gdiplus::RectF MeasureUncached(const WCHAR *s, size_t sLen) override;
 
     void Lock() override {}
     void Unlock() override {}
 
     void Draw(const char *s, size_t sLen, RectF &bb, bool isRtl) override;
     void Draw(const WCHAR *s, size_t sLen, RectF &bb, bool isRtl) override;
+    void DrawRun(const WCHAR *s, const TextRunPart *parts, size_t partsCount) override;
 
     ~TextRenderGdiplus() override;
 };
@@ -159,6 +212,7 @@ class TextRenderHdc : public ITextRender {
     Gdiplus::Color textColor;
     Gdiplus::Color textBgColor;
     WCHAR txtConvBuf[512];
+    CharWidthCache widthCache;
 
     TextRenderHdc()
         : hdc(nullptr),
@@ -181,6 +235,7 @@ class TextRenderHdc : public ITextRender {
 
     Gdiplus::RectF Measure(const char *s, size_t sLen) override;
     Gdiplus::RectF Measure(const WCHAR *s, size_t sLen) override;
+    Gdiplus::RectF MeasureUncached(const WCHAR *s, size_t sLen) override;
 
     void Lock() override;
     void Unlock() override;
@@ -193,5 +248,8 @@ class TextRenderHdc : public ITextRender {
 
 ITextRender *CreateTextRender(TextRenderMethod method, Graphics *gfx, int dx, int dy);
 
+void InitializeTextRender();
+void DestroyTextRender();
+
 size_t StringLenForWidth(ITextRender *textRender, const WCHAR *s, size_t len, float dx);
 REAL GetSpaceDx(ITextRender *textRender);
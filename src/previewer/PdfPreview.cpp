@@ -3,6 +3,10 @@
 
 // utils
 #include "BaseUtil.h"
+#if defined(BUILD_EPUB_PREVIEW) || defined(BUILD_FB2_PREVIEW) || defined(BUILD_MOBI_PREVIEW)
+#include "ArchUtil.h"
+#include "GdiPlusUtil.h"
+#endif
 #include "WinUtil.h"
 // rendering engines
 #include "BaseEngine.h"
@@ -10,6 +14,9 @@
 #if defined(BUILD_EPUB_PREVIEW) || defined(BUILD_FB2_PREVIEW) || defined(BUILD_MOBI_PREVIEW)
 #include "MiniMui.h"
 #include "EbookEngine.h"
+#include "EbookBase.h"
+#include "EbookDoc.h"
+#include "MobiDoc.h"
 #endif
 #if defined(BUILD_CBZ_PREVIEW) || defined(BUILD_CBR_PREVIEW) || defined(BUILD_CB7_PREVIEW) || defined(BUILD_CBT_PREVIEW) || defined(BUILD_TGA_PREVIEW)
 #include "ImagesEngine.h"
@@ -18,15 +25,201 @@
 #include "PdfPreview.h"
 #include "PdfPreviewBase.h"
 
-IFACEMETHODIMP PreviewBase::GetThumbnail(UINT cx, HBITMAP *phbmp, WTS_ALPHATYPE *pdwAlpha)
+// Explorer creates a new preview handler for every file the user selects,
+// so the most recently previewed documents are kept loaded (together with
+// the last page rendered for them) for when the user returns to them
+#define ENGINE_CACHE_SIZE       4
+// documents are loaded from a copy in memory so that the files aren't kept open
+#define ENGINE_CACHE_MAX_DATA   (64 * 1024 * 1024)
+// idle engines keep the DLL from being unloaded for at most this long
+#define ENGINE_CACHE_IDLE_MS    (60 * 1000)
+
+struct CachedEngine {
+    // 0 for engines which aren't worth caching
+    uint64_t key;
+    size_t dataLen;
+    BaseEngine *engine;
+    // the page last rendered by a PageRenderer for this engine
+    RenderedBitmap *bmp;
+    int bmpPage;
+    SizeI bmpSize;
+    DWORD lastUsed;
+
+    CachedEngine(uint64_t key, size_t dataLen, BaseEngine *engine) : key(key),
+        dataLen(dataLen), engine(engine), bmp(nullptr), bmpPage(0), lastUsed(0) { }
+    ~CachedEngine() {
+        delete bmp;
+        delete engine;
+    }
+
+    size_t MemoryUse() const {
+        if (!bmp)
+            return dataLen;
+        SizeI size = bmp->Size();
+        return dataLen + size.dx * size.dy * 4;
+    }
+};
+
+// idle engines, the most recently used one first
+static Vec<CachedEngine *> gIdleEngines;
+static CRITICAL_SECTION gIdleEnginesAccess;
+
+void InitEngineCache()
 {
-    BaseEngine *engine = GetEngine();
-    if (!engine)
-        return E_FAIL;
+    InitializeCriticalSection(&gIdleEnginesAccess);
+}
 
-    RectD page = engine->Transform(engine->PageMediabox(1), 1, 1.0, 0);
-    float zoom = std::min(cx / (float)page.dx, cx / (float)page.dy) - 0.001f;
-    RectI thumb = RectD(0, 0, page.dx * zoom, page.dy * zoom).Round();
+void DeleteEngineCache()
+{
+    // DllCanUnloadNow only lets the DLL go once all idle engines have been freed
+    // (and engines mustn't be deleted while the loader lock is held)
+    DeleteCriticalSection(&gIdleEnginesAccess);
+}
+
+// identifies a document by its name, size and modification time or
+// (for streams without a name) by a digest of its content
+static uint64_t GetDocumentKey(const WCHAR *clsid, STATSTG& stat, const void *data, size_t len)
+{
+    struct {
+        uint64_t clsid;
+        uint64_t id;
+        FILETIME mtime;
+        ULARGE_INTEGER size;
+    } doc;
+    ZeroMemory(&doc, sizeof(doc));
+    doc.clsid = MurmurHash64(clsid, str::Len(clsid) * sizeof(WCHAR));
+    if (stat.pwcsName) {
+        doc.id = MurmurHash64(stat.pwcsName, str::Len(stat.pwcsName) * sizeof(WCHAR));
+        doc.mtime = stat.mtime;
+    }
+    else {
+        CrashIf(!data);
+        doc.id = MurmurHash64(data, len);
+    }
+    doc.size = stat.cbSize;
+    uint64_t key = MurmurHash64(&doc, sizeof(doc));
+    return key ? key : 1;
+}
+
+CachedEngine *PreviewBase::AcquireEngine()
+{
+    STATSTG stat;
+    HRESULT res = m_pStream->Stat(&stat, STATFLAG_DEFAULT);
+    if (FAILED(res) || stat.cbSize.QuadPart > ENGINE_CACHE_MAX_DATA / 2) {
+        if (SUCCEEDED(res))
+            CoTaskMemFree(stat.pwcsName);
+        BaseEngine *engine = LoadEngine(m_pStream);
+        return engine ? new CachedEngine(0, 0, engine) : nullptr;
+    }
+
+    // a document's content only has to be read if it isn't already cached
+    ScopedMem<void> data;
+    size_t len = 0;
+    if (!stat.pwcsName) {
+        data.Set(GetDataFromStream(m_pStream, &len));
+        if (!data) {
+            BaseEngine *engine = LoadEngine(m_pStream);
+            return engine ? new CachedEngine(0, 0, engine) : nullptr;
+        }
+    }
+    uint64_t key = GetDocumentKey(m_clsid, stat, data, len);
+    CoTaskMemFree(stat.pwcsName);
+
+    CachedEngine *cached = nullptr;
+    {
+        ScopedCritSec scope(&gIdleEnginesAccess);
+        for (size_t i = 0; i < gIdleEngines.Count() && !cached; i++) {
+            if (gIdleEngines.At(i)->key == key)
+                cached = gIdleEngines.PopAt(i);
+        }
+    }
+    if (cached) {
+        cached->engine->ReleaseCaches(false);
+        return cached;
+    }
+
+    if (!data) {
+        data.Set(GetDataFromStream(m_pStream, &len));
+        if (!data)
+            return nullptr;
+    }
+    ScopedComPtr<IStream> stream(CreateStreamFromData(data, len));
+    if (!stream)
+        return nullptr;
+    BaseEngine *engine = LoadEngine(stream);
+    return engine ? new CachedEngine(key, len, engine) : nullptr;
+}
+
+BaseEngine *PreviewBase::GetEngine()
+{
+    if (!m_engine && m_pStream)
+        m_engine = AcquireEngine();
+    return m_engine ? m_engine->engine : nullptr;
+}
+
+void ReleaseEngine(CachedEngine *cached)
+{
+    if (!cached)
+        return;
+    if (!cached->key) {
+        delete cached;
+        return;
+    }
+
+    cached->engine->ReleaseCaches(true);
+    cached->lastUsed = GetTickCount();
+
+    Vec<CachedEngine *> evicted;
+    {
+        ScopedCritSec scope(&gIdleEnginesAccess);
+        gIdleEngines.InsertAt(0, cached);
+        size_t memUse = 0;
+        for (size_t i = 0; i < gIdleEngines.Count(); i++) {
+            size_t entryMemUse = gIdleEngines.At(i)->MemoryUse();
+            if (i < ENGINE_CACHE_SIZE && memUse + entryMemUse <= ENGINE_CACHE_MAX_DATA)
+                memUse += entryMemUse;
+            else
+                evicted.Append(gIdleEngines.PopAt(i--));
+        }
+    }
+    // deleting an engine can take a while, so don't block other previewers
+    DeleteVecMembers(evicted);
+}
+
+bool FreeIdleEngines()
+{
+    Vec<CachedEngine *> expired;
+    bool isEmpty;
+    {
+        ScopedCritSec scope(&gIdleEnginesAccess);
+        DWORD now = GetTickCount();
+        for (size_t i = gIdleEngines.Count(); i > 0; i--) {
+            if (now - gIdleEngines.At(i - 1)->lastUsed >= ENGINE_CACHE_IDLE_MS)
+                expired.Append(gIdleEngines.PopAt(i - 1));
+        }
+        isEmpty = gIdleEngines.Count() == 0;
+    }
+    DeleteVecMembers(expired);
+    return isEmpty;
+}
+
+IFACEMETHODIMP PreviewBase::GetThumbnail(UINT cx, HBITMAP *phbmp, WTS_ALPHATYPE *pdwAlpha)
+{
+    RenderedBitmap *bmp = LoadThumbnail(cx);
+    if (!bmp) {
+        BaseEngine *engine = GetEngine();
+        if (!engine)
+            return E_FAIL;
+
+        RectD page = engine->Transform(engine->PageMediabox(1), 1, 1.0, 0);
+        float zoom = std::min(cx / (float)page.dx, cx / (float)page.dy) - 0.001f;
+        RectI thumb = RectD(0, 0, page.dx * zoom, page.dy * zoom).Round();
+        page = engine->Transform(thumb.Convert<double>(), 1, zoom, 0, true);
+        bmp = engine->RenderBitmap(1, zoom, 0, &page);
+        if (!bmp)
+            return E_NOTIMPL;
+    }
+    SizeI thumb = bmp->Size();
 
     BITMAPINFO bmi = { 0 };
     bmi.bmiHeader.biSize = sizeof(bmi.bmiHeader);
@@ -38,14 +231,13 @@ IFACEMETHODIMP PreviewBase::GetThumbnail(UINT cx, HBITMAP *phbmp, WTS_ALPHATYPE
 
     unsigned char *bmpData = nullptr;
     HBITMAP hthumb = CreateDIBSection(nullptr, &bmi, DIB_RGB_COLORS, (void **)&bmpData, nullptr, 0);
-    if (!hthumb)
+    if (!hthumb) {
+        delete bmp;
         return E_OUTOFMEMORY;
-
-    page = engine->Transform(thumb.Convert<double>(), 1, zoom, 0, true);
-    RenderedBitmap *bmp = engine->RenderBitmap(1, zoom, 0, &page);
+    }
 
     HDC hdc = GetDC(nullptr);
-    if (bmp && GetDIBits(hdc, bmp->GetBitmap(), 0, thumb.dy, bmpData, &bmi, DIB_RGB_COLORS)) {
+    if (GetDIBits(hdc, bmp->GetBitmap(), 0, thumb.dy, bmpData, &bmi, DIB_RGB_COLORS)) {
         // cf. http://msdn.microsoft.com/en-us/library/bb774612(v=VS.85).aspx
         for (int i = 0; i < thumb.dx * thumb.dy; i++)
             bmpData[4 * i + 3] = 0xFF;
@@ -69,19 +261,39 @@ IFACEMETHODIMP PreviewBase::GetThumbnail(UINT cx, HBITMAP *phbmp, WTS_ALPHATYPE
 #define PREVIEW_MARGIN  2
 #define UWM_PAINT_AGAIN (WM_USER + 1)
 
+// the page currently shown and the ones before and after it
+#define MAX_PREVIEW_PAGES 3
+
+// fits a page (at zoom 1.0) into the available area
+static float GetZoomToFit(RectD page, SizeI area)
+{
+    return (float)std::min(area.dx / page.dx, area.dy / page.dy) - 0.001f;
+}
+
 class PageRenderer {
+    CachedEngine *cached;
     BaseEngine *engine;
     HWND hwnd;
 
-    int currPage;
-    RenderedBitmap *currBmp;
-    // due to rounding differences, currBmp->Size() and currSize can differ slightly
-    SizeI currSize;
+    struct PageBitmap {
+        int pageNo;
+        // due to rounding differences, bmp->Size() and size can differ slightly
+        SizeI size;
+        // nullptr if rendering failed
+        RenderedBitmap *bmp;
+    };
+    // the most recently shown page first, followed by prefetched ones
+    Vec<PageBitmap> pages;
     int reqPage;
     float reqZoom;
     SizeI reqSize;
+    // the area available for a page (so that prefetched pages fit as well)
+    SizeI reqArea;
     bool reqAbort;
     AbortCookie *abortCookie;
+    // the page the render thread is prefetching (or 0)
+    int prefetchPage;
+    SizeI prefetchSize;
 
     CRITICAL_SECTION currAccess;
     HANDLE thread;
@@ -94,15 +306,31 @@ class PageRenderer {
     bool preventRecursion;
 
 public:
-    PageRenderer(BaseEngine *engine, HWND hwnd) : engine(engine), hwnd(hwnd),
-        currPage(0), currBmp(nullptr), reqPage(0), reqZoom(0), reqAbort(false),
-        abortCookie(nullptr), thread(nullptr), preventRecursion(false) {
+    PageRenderer(CachedEngine *cached, HWND hwnd) : cached(cached), engine(cached->engine),
+        hwnd(hwnd), reqPage(0), reqZoom(0), reqAbort(false), abortCookie(nullptr),
+        prefetchPage(0), thread(nullptr), preventRecursion(false) {
         InitializeCriticalSection(&currAccess);
+        // start with the page shown when the document was last previewed
+        if (cached->bmp) {
+            PageBitmap page = { cached->bmpPage, cached->bmpSize, cached->bmp };
+            pages.Append(page);
+            cached->bmp = nullptr;
+        }
     }
     ~PageRenderer() {
         if (thread)
             WaitForSingleObject(thread, INFINITE);
-        delete currBmp;
+        for (size_t i = 0; i < pages.Count(); i++) {
+            PageBitmap& page = pages.At(i);
+            if (i > 0 || !page.bmp) {
+                delete page.bmp;
+                continue;
+            }
+            delete cached->bmp;
+            cached->bmp = page.bmp;
+            cached->bmpPage = page.pageNo;
+            cached->bmpSize = page.size;
+        }
         DeleteCriticalSection(&currAccess);
     }
 
@@ -118,17 +346,26 @@ public:
         return bbox;
     }
 
-    void Render(HDC hdc, RectI target, int pageNo, float zoom) {
+    void Render(HDC hdc, RectI target, SizeI area, int pageNo, float zoom) {
         ScopedCritSec scope(&currAccess);
-        if (currBmp && currPage == pageNo && currSize == target.Size())
-            currBmp->StretchDIBits(hdc, target);
+        int idx = FindPage(pageNo, target.Size());
+        if (idx != -1) {
+            if (idx > 0)
+                pages.InsertAt(0, pages.PopAt(idx));
+            if (pages.At(0).bmp)
+                pages.At(0).bmp->StretchDIBits(hdc, target);
+        }
         else if (!thread) {
             reqPage = pageNo;
             reqZoom = zoom;
             reqSize = target.Size();
+            reqArea = area;
             reqAbort = false;
             thread = CreateThread(nullptr, 0, RenderThread, this, 0, 0);
         }
+        else if (prefetchPage == pageNo && prefetchSize == target.Size()) {
+            // the render thread will paint again once it's done
+        }
         else if (reqPage != pageNo || reqSize != target.Size()) {
             if (abortCookie)
                 abortCookie->Abort();
@@ -137,29 +374,78 @@ public:
     }
 
 protected:
-    static DWORD WINAPI RenderThread(LPVOID data) {
-        ScopedCom comScope; // because the engine reads data from a COM IStream
+    // must be called when currAccess is held
+    int FindPage(int pageNo, SizeI size) {
+        for (size_t i = 0; i < pages.Count(); i++) {
+            if (pages.At(i).pageNo == pageNo && pages.At(i).size == size)
+                return (int)i;
+        }
+        return -1;
+    }
 
-        PageRenderer *pr = (PageRenderer *)data;
-        RenderedBitmap *bmp = pr->engine->RenderBitmap(pr->reqPage, pr->reqZoom, 0, nullptr, Target_View, &pr->abortCookie);
+    // called on the render thread
+    void RenderPage(int pageNo, float zoom, SizeI size, bool prefetch) {
+        RenderedBitmap *bmp = engine->RenderBitmap(pageNo, zoom, 0, nullptr, Target_View, &abortCookie);
+        // ebook engines lay out pages in the background and only estimate the page count until done
+        int pageCount = engine->PageCount();
 
-        ScopedCritSec scope(&pr->currAccess);
+        ScopedCritSec scope(&currAccess);
 
-        if (!pr->reqAbort) {
-            delete pr->currBmp;
-            pr->currBmp = bmp;
-            pr->currPage = pr->reqPage;
-            pr->currSize = pr->reqSize;
+        if (!reqAbort) {
+            // prefetched pages mustn't push out the page currently shown
+            PageBitmap page = { pageNo, size, bmp };
+            pages.InsertAt(prefetch ? std::min((size_t)1, pages.Count()) : 0, page);
+            while (pages.Count() > MAX_PREVIEW_PAGES) {
+                delete pages.Last().bmp;
+                pages.Pop();
+            }
         }
         else
             delete bmp;
-        delete pr->abortCookie;
-        pr->abortCookie = nullptr;
+        delete abortCookie;
+        abortCookie = nullptr;
+
+        PostMessage(hwnd, UWM_PAINT_AGAIN, (WPARAM)pageCount, 0);
+    }
+
+    // called on the render thread
+    void Prefetch(int pageNo) {
+        if (pageNo < 1 || pageNo > engine->PageCount())
+            return;
+        RectD page = engine->Transform(engine->PageMediabox(pageNo), pageNo, 1.0, 0);
+        if (page.IsEmpty())
+            return;
+        float zoom = GetZoomToFit(page, reqArea);
+        SizeI size = RectD(0, 0, page.dx * zoom, page.dy * zoom).Round().Size();
+
+        {
+            ScopedCritSec scope(&currAccess);
+            if (reqAbort || FindPage(pageNo, size) != -1)
+                return;
+            prefetchPage = pageNo;
+            prefetchSize = size;
+        }
+        RenderPage(pageNo, zoom, size, true);
+
+        ScopedCritSec scope(&currAccess);
+        prefetchPage = 0;
+    }
+
+    static DWORD WINAPI RenderThread(LPVOID data) {
+        ScopedCom comScope; // because the engine reads data from a COM IStream
+
+        PageRenderer *pr = (PageRenderer *)data;
+        pr->RenderPage(pr->reqPage, pr->reqZoom, pr->reqSize, false);
+        // render the neighboring pages in advance so that scrolling
+        // through the document doesn't have to wait for each page
+        pr->Prefetch(pr->reqPage + 1);
+        pr->Prefetch(pr->reqPage - 1);
 
+        ScopedCritSec scope(&pr->currAccess);
         HANDLE thread = pr->thread;
         pr->thread = nullptr;
+        // a page requested while prefetching might still need rendering
         PostMessage(pr->hwnd, UWM_PAINT_AGAIN, 0, 0);
-
         CloseHandle(thread);
         return 0;
     }
@@ -181,13 +467,13 @@ static LRESULT OnPaint(HWND hwnd)
         RectD page = preview->renderer->GetPageRect(pageNo);
         if (!page.IsEmpty()) {
             rect.Inflate(-PREVIEW_MARGIN, -PREVIEW_MARGIN);
-            float zoom = (float)std::min(rect.dx / page.dx, rect.dy / page.dy) - 0.001f;
+            float zoom = GetZoomToFit(page, rect.Size());
             RectI onScreen = RectD(rect.x, rect.y, page.dx * zoom, page.dy * zoom).Round();
             onScreen.Offset((rect.dx - onScreen.dx) / 2, (rect.dy - onScreen.dy) / 2);
 
             RECT rcPage = onScreen.ToRECT();
             FillRect(hdc, &rcPage, brushWhite);
-            preview->renderer->Render(hdc, onScreen, pageNo, zoom);
+            preview->renderer->Render(hdc, onScreen, rect.Size(), pageNo, zoom);
         }
     }
 
@@ -267,6 +553,16 @@ static LRESULT CALLBACK PreviewWndProc(HWND hwnd, UINT message, WPARAM wParam, L
     case WM_DESTROY:
         return OnDestroy(hwnd);
     case UWM_PAINT_AGAIN:
+        if (wParam > 0) {
+            SCROLLINFO si = { 0 };
+            si.cbSize = sizeof(si);
+            si.fMask = SIF_RANGE;
+            GetScrollInfo(hwnd, SB_VERT, &si);
+            if (si.nMax != (int)wParam) {
+                si.nMax = (int)wParam;
+                SetScrollInfo(hwnd, SB_VERT, &si, TRUE);
+            }
+        }
         InvalidateRect(hwnd, nullptr, TRUE);
         UpdateWindow(hwnd);
         return 0;
@@ -298,7 +594,7 @@ IFACEMETHODIMP PreviewBase::DoPreview()
     int pageCount = 1;
     if (engine) {
         pageCount = engine->PageCount();
-        this->renderer = new PageRenderer(engine, m_hwnd);
+        this->renderer = new PageRenderer(m_engine, m_hwnd);
         // don't use the engine afterwards directly (cf. PageRenderer::preventRecursion)
         engine = nullptr;
     }
@@ -318,13 +614,13 @@ IFACEMETHODIMP PreviewBase::DoPreview()
 
 BaseEngine *CPdfPreview::LoadEngine(IStream *stream)
 {
-    return PdfEngine::CreateFromStream(stream);
+    return PdfEngine::CreateFromStream(stream, nullptr, true);
 }
 
 #ifdef BUILD_XPS_PREVIEW
 BaseEngine *CXpsPreview::LoadEngine(IStream *stream)
 {
-    return XpsEngine::CreateFromStream(stream);
+    return XpsEngine::CreateFromStream(stream, true);
 }
 #endif
 
@@ -337,6 +633,26 @@ BaseEngine *CDjVuPreview::LoadEngine(IStream *stream)
 }
 #endif
 
+#if defined(BUILD_EPUB_PREVIEW) || defined(BUILD_FB2_PREVIEW) || defined(BUILD_MOBI_PREVIEW)
+// ebook engines lay out the whole document when they're loaded, so
+// their cover images are extracted without loading an engine at all
+static RenderedBitmap *ThumbnailFromCoverImage(ImageData *cover, UINT cx)
+{
+    if (!cover)
+        return nullptr;
+    Bitmap *thumb = ThumbnailFromData(cover->data, cover->len, cx);
+    if (!thumb)
+        return nullptr;
+    HBITMAP hbmp;
+    Status ok = thumb->GetHBITMAP((ARGB)Color::White, &hbmp);
+    SizeI size(thumb->GetWidth(), thumb->GetHeight());
+    delete thumb;
+    if (ok != Ok)
+        return nullptr;
+    return new RenderedBitmap(hbmp, size);
+}
+#endif
+
 #ifdef BUILD_EPUB_PREVIEW
 
 CEpubPreview::CEpubPreview(long *plRefCount) : PreviewBase(plRefCount, SZ_EPUB_PREVIEW_CLSID)
@@ -354,6 +670,12 @@ BaseEngine *CEpubPreview::LoadEngine(IStream *stream)
 {
     return EpubEngine::CreateFromStream(stream);
 }
+
+RenderedBitmap *CEpubPreview::LoadThumbnail(UINT cx)
+{
+    ScopedPtr<EpubDoc> doc(m_pStream ? EpubDoc::CreateFromStream(m_pStream) : nullptr);
+    return doc ? ThumbnailFromCoverImage(doc->GetCoverImage(), cx) : nullptr;
+}
 #endif
 
 #ifdef BUILD_FB2_PREVIEW
@@ -373,6 +695,12 @@ BaseEngine *CFb2Preview::LoadEngine(IStream *stream)
 {
     return Fb2Engine::CreateFromStream(stream);
 }
+
+RenderedBitmap *CFb2Preview::LoadThumbnail(UINT cx)
+{
+    ScopedPtr<Fb2Doc> doc(m_pStream ? Fb2Doc::CreateFromStream(m_pStream) : nullptr);
+    return doc ? ThumbnailFromCoverImage(doc->GetCoverImage(), cx) : nullptr;
+}
 #endif
 
 #ifdef BUILD_MOBI_PREVIEW
@@ -392,6 +720,12 @@ BaseEngine *CMobiPreview::LoadEngine(IStream *stream)
 {
     return MobiEngine::CreateFromStream(stream);
 }
+
+RenderedBitmap *CMobiPreview::LoadThumbnail(UINT cx)
+{
+    ScopedPtr<MobiDoc> doc(m_pStream ? MobiDoc::CreateFromStream(m_pStream) : nullptr);
+    return doc ? ThumbnailFromCoverImage(doc->GetCoverImage(), cx) : nullptr;
+}
 #endif
 
 #if defined(BUILD_CBZ_PREVIEW) || defined(BUILD_CBR_PREVIEW) || defined(BUILD_CB7_PREVIEW) || defined(BUILD_CBT_PREVIEW)
@@ -4,6 +4,16 @@
 #include <Thumbcache.h>
 
 class PageRenderer;
+struct CachedEngine;
+
+// recently previewed documents are kept loaded so that returning
+// to one of them doesn't require parsing and rendering it anew
+void InitEngineCache();
+void DeleteEngineCache();
+void ReleaseEngine(CachedEngine *cached);
+// frees engines which haven't been used for a while and returns
+// whether no more idle engines are left (i.e. the DLL may be unloaded)
+bool FreeIdleEngines();
 
 class PreviewBase : public IThumbnailProvider, public IInitializeWithStream,
     public IObjectWithSite, public IPreviewHandler, public IOleWindow,
@@ -125,7 +135,7 @@ public:
             m_hwnd = nullptr;
         }
         m_pStream = nullptr;
-        delete m_engine;
+        ReleaseEngine(m_engine);
         m_engine = nullptr;
         return S_OK;
     }
@@ -198,18 +208,14 @@ public:
         return S_OK;
     }
 
-    BaseEngine *GetEngine() {
-        if (!m_engine && m_pStream)
-            m_engine = LoadEngine(m_pStream);
-        return m_engine;
-    }
+    BaseEngine *GetEngine();
 
     PageRenderer *renderer;
 
 protected:
     long m_lRef, * m_plModuleRef;
     ScopedComPtr<IStream> m_pStream;
-    BaseEngine *m_engine;
+    CachedEngine *m_engine;
     // engines based on ImagesEngine require GDI+ to be preloaded
     ScopedGdiPlus *m_gdiScope;
     // state for IPreviewHandler
@@ -222,6 +228,14 @@ protected:
     FILETIME    m_dateStamp;
 
     virtual BaseEngine *LoadEngine(IStream *stream) = 0;
+    CachedEngine *AcquireEngine();
+    // many documents contain a ready-made thumbnail or cover image which is
+    // much cheaper to decode than page 1 is to render (returns nullptr if
+    // there's none at least cx pixels large)
+    virtual RenderedBitmap *LoadThumbnail(UINT cx) {
+        BaseEngine *engine = GetEngine();
+        return engine ? engine->GetEmbeddedThumbnail(1, cx) : nullptr;
+    }
 };
 
 class CPdfPreview : public PreviewBase {
@@ -262,6 +276,7 @@ public:
 
 protected:
     virtual BaseEngine *LoadEngine(IStream *stream);
+    virtual RenderedBitmap *LoadThumbnail(UINT cx);
 };
 #endif
 
@@ -273,6 +288,7 @@ public:
 
 protected:
     virtual BaseEngine *LoadEngine(IStream *stream);
+    virtual RenderedBitmap *LoadThumbnail(UINT cx);
 };
 #endif
 
@@ -284,6 +300,7 @@ public:
 
 protected:
     virtual BaseEngine *LoadEngine(IStream *stream);
+    virtual RenderedBitmap *LoadThumbnail(UINT cx);
 };
 #endif
 
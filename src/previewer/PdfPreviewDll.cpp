@@ -114,6 +114,10 @@ STDAPI_(BOOL) DllMain(HINSTANCE hInstance, DWORD dwReason, LPVOID lpReserved)
     UNUSED(lpReserved);
     if (dwReason == DLL_PROCESS_ATTACH) {
         CrashIf(hInstance != GetInstance());
+        InitEngineCache();
+    }
+    else if (dwReason == DLL_PROCESS_DETACH) {
+        DeleteEngineCache();
     }
 
     return TRUE;
@@ -121,7 +125,10 @@ STDAPI_(BOOL) DllMain(HINSTANCE hInstance, DWORD dwReason, LPVOID lpReserved)
 
 STDAPI DllCanUnloadNow(VOID)
 {
-    return g_lRefCount == 0 ? S_OK : S_FALSE;
+    if (g_lRefCount != 0)
+        return S_FALSE;
+    // keep recently previewed documents loaded for a while
+    return FreeIdleEngines() ? S_OK : S_FALSE;
 }
 
 // disable warning C6387 which is wrongly issued due to a compiler bug; cf.
@@ -25,14 +25,19 @@ To write new regression test:
 #include "GdiPlusUtil.h"
 #include "HtmlParserLookup.h"
 #include "Mui.h"
+#include "Timer.h"
 #include "WinUtil.h"
 // rendering engines
 #include "BaseEngine.h"
+#include "EngineManager.h"
 #include "EbookBase.h"
 #include "EbookDoc.h"
 #include "HtmlFormatter.h"
 #include "EbookFormatter.h"
 #include "Doc.h"
+#include "TextSelection.h"
+#include "TextSearch.h"
+#include "StressTesting.h"
 
 static WCHAR *gTestFilesDir;
 
@@ -169,12 +174,14 @@ static void UninstallCrashHandler()
 }
 
 #include "Regress00.cpp"
+#include "Regress03.cpp"
 
 static void RunTests()
 {
     Regress00();
     Regress01();
     Regress02();
+    Regress03();
 }
 
 int RegressMain()
@@ -192,6 +199,13 @@ int RegressMain()
 
     RunTests();
 
+    if (gPerfRegressionCount > 0) {
+        printf("%d performance regressions found!\n", gPerfRegressionCount);
+        mui::Destroy();
+        UninstallCrashHandler();
+        system("pause");
+        return 1;
+    }
     printflush("All tests completed successfully!\n");
     mui::Destroy();
     UninstallCrashHandler();
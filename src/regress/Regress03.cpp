@@ -0,0 +1,172 @@
+/* Copyright 2015 the SumatraPDF project authors (see AUTHORS file).
+   License: Simplified BSD (see COPYING.BSD) */
+
+// must be #included from Regress.cpp
+
+/* Performance regression tests: all documents in the "perf" directory of the test
+files are loaded, rendered at several zoom levels, have their text extracted and
+searched and (for ebooks) laid out. The medians over PERF_RUNS runs are compared
+against the timings in perf\baselines.txt (lines of "<path>\t<metric>\t<ms>").
+A metric fails if it's more than PERF_TOLERANCE_PERCENT slower than its baseline
+(and more than PERF_TOLERANCE_MS, so that noise in short timings is ignored).
+All measured timings are written to perf\baselines-new.txt, which can be renamed
+to baselines.txt to accept them as new baselines. */
+
+#define PERF_RUNS               5
+#define PERF_MAX_PAGES          10
+#define PERF_TOLERANCE_PERCENT  15
+#define PERF_TOLERANCE_MS       5.0
+#define PERF_SEARCH_TEXT        L"the"
+
+static const float gPerfZooms[] = { 0.5f, 1.0f, 2.0f };
+static const WCHAR *gPerfZoomNames[] = { L"render@50%", L"render@100%", L"render@200%" };
+
+static int gPerfRegressionCount = 0;
+
+struct PerfBaselines {
+    // "<path>\t<metric>"
+    WStrVec keys;
+    Vec<double> values;
+    // all measured timings (in the format of baselines.txt)
+    str::Str<WCHAR> measured;
+};
+
+static void LoadPerfBaselines(const WCHAR *filePath, PerfBaselines& baselines)
+{
+    ScopedMem<char> data(file::ReadAll(filePath, nullptr));
+    ScopedMem<WCHAR> text(data ? str::conv::FromUtf8(data) : nullptr);
+    if (!text)
+        return;
+    WStrVec lines;
+    lines.Split(text, L"\n", true);
+    for (size_t i = 0; i < lines.Count(); i++) {
+        WCHAR *line = lines.At(i);
+        str::TrimWS(line);
+        WCHAR *sep = str::FindCharLast(line, '\t');
+        if ('#' == *line || !sep)
+            continue;
+        baselines.keys.Append(str::DupN(line, sep - line));
+        baselines.values.Append(_wtof(sep + 1));
+    }
+}
+
+static int cmpPerfTimes(const void *a, const void *b)
+{
+    double diff = *(const double *)a - *(const double *)b;
+    return diff < 0 ? -1 : diff > 0 ? 1 : 0;
+}
+
+// compares the median of the measured runs against the baseline
+static void CheckPerfMetric(const WCHAR *relPath, const WCHAR *metric, Vec<double>& runsMs, PerfBaselines& baselines)
+{
+    if (0 == runsMs.Count())
+        return;
+    runsMs.Sort(cmpPerfTimes);
+    double medianMs = runsMs.At(runsMs.Count() / 2);
+    baselines.measured.AppendFmt(L"%s\t%s\t%.2f\n", relPath, metric, medianMs);
+
+    ScopedMem<WCHAR> key(str::Format(L"%s\t%s", relPath, metric));
+    int idx = baselines.keys.Find(key);
+    if (-1 == idx) {
+        wprintf(L"  %-12s %9.2f ms (no baseline)\n", metric, medianMs);
+        return;
+    }
+    double baselineMs = baselines.values.At(idx);
+    bool isRegression = medianMs > baselineMs * (100 + PERF_TOLERANCE_PERCENT) / 100 &&
+                        medianMs - baselineMs > PERF_TOLERANCE_MS;
+    wprintf(L"  %-12s %9.2f ms (baseline %9.2f ms)%s\n", metric, medianMs, baselineMs,
+            isRegression ? L" SLOWER!" : L"");
+    fflush(stdout);
+    if (isRegression)
+        gPerfRegressionCount++;
+}
+
+static void RegressPerfFile(const WCHAR *filePath, const WCHAR *relPath, PerfBaselines& baselines)
+{
+    wprintf(L"%s\n", relPath);
+    Vec<double> loadMs, textMs, searchMs, layoutMs;
+    Vec<double> renderMs[dimof(gPerfZooms)];
+
+    for (int run = 0; run < PERF_RUNS; run++) {
+        Timer t;
+        BaseEngine *engine = EngineManager::CreateEngine(filePath, nullptr, nullptr, false);
+        if (engine) {
+            loadMs.Append(t.Stop());
+            int pageCount = std::min(engine->PageCount(), PERF_MAX_PAGES);
+            for (size_t z = 0; z < dimof(gPerfZooms); z++) {
+                double renderTotal = 0, textTotal = 0;
+                for (int pageNo = 1; pageNo <= pageCount; pageNo++) {
+                    BenchPageTimes times = { 0 };
+                    if (!BenchLoadRender(engine, pageNo, gPerfZooms[z], &times)) {
+                        wprintf(L"Error: failed to render page %d of %s\n", pageNo, relPath);
+                        gPerfRegressionCount++;
+                    }
+                    renderTotal += times.renderMs;
+                    textTotal += times.textMs;
+                }
+                renderMs[z].Append(renderTotal);
+                if (1.0f == gPerfZooms[z])
+                    textMs.Append(textTotal);
+            }
+
+            PageTextCache textCache(engine);
+            TextSearch search(engine, &textCache);
+            TextSearchResults results;
+            t.Start();
+            search.FindAll(PERF_SEARCH_TEXT, &results);
+            searchMs.Append(t.Stop());
+            delete engine;
+        }
+        if (Doc::IsSupportedFile(filePath)) {
+            double timeMs = BenchEbookLayoutTime(filePath);
+            if (timeMs >= 0)
+                layoutMs.Append(timeMs);
+        }
+    }
+
+    if (0 == loadMs.Count() && 0 == layoutMs.Count()) {
+        wprintf(L"Error: failed to load %s\n", relPath);
+        gPerfRegressionCount++;
+        return;
+    }
+    CheckPerfMetric(relPath, L"load", loadMs, baselines);
+    for (size_t z = 0; z < dimof(gPerfZooms); z++) {
+        CheckPerfMetric(relPath, gPerfZoomNames[z], renderMs[z], baselines);
+    }
+    CheckPerfMetric(relPath, L"text", textMs, baselines);
+    CheckPerfMetric(relPath, L"search", searchMs, baselines);
+    CheckPerfMetric(relPath, L"layout", layoutMs, baselines);
+}
+
+// performance regressions against the baselines of the "perf" corpus
+static void Regress03()
+{
+    ScopedMem<WCHAR> perfDir(path::Join(TestFilesDir(), L"perf"));
+    if (!dir::Exists(perfDir)) {
+        printflush("Skipping performance tests (no perf directory in the test files)\n");
+        return;
+    }
+
+    PerfBaselines baselines;
+    ScopedMem<WCHAR> baselinesPath(path::Join(perfDir, L"baselines.txt"));
+    LoadPerfBaselines(baselinesPath, baselines);
+
+    WStrVec files;
+    DirIter di(perfDir, true /* recursive */);
+    for (const WCHAR *filePath = di.First(); filePath; filePath = di.Next()) {
+        if (EngineManager::IsSupportedFile(filePath) || Doc::IsSupportedFile(filePath))
+            files.Append(str::Dup(filePath));
+    }
+    files.SortNatural();
+
+    for (size_t i = 0; i < files.Count(); i++) {
+        const WCHAR *relPath = files.At(i) + str::Len(perfDir);
+        while (path::IsSep(*relPath))
+            relPath++;
+        RegressPerfFile(files.At(i), relPath, baselines);
+    }
+
+    ScopedMem<WCHAR> measuredPath(path::Join(perfDir, L"baselines-new.txt"));
+    ScopedMem<char> measured(str::conv::ToUtf8(baselines.measured.Get()));
+    file::WriteAll(measuredPath, measured, str::Len(measured));
+}
@@ -38,6 +38,7 @@
 #define IDM_VIEW_FULLSCREEN             421
 #define IDM_SELECT_ALL                  422
 #define IDM_VIEW_SHOW_HIDE_MENUBAR      423
+#define IDM_SAVE_IMAGE                  424
 #define IDM_COPY_IMAGE                  427
 #define IDM_COPY_LINK_TARGET            428
 #define IDM_COPY_COMMENT                429
@@ -96,6 +97,8 @@
 #define IDM_RENAME_FILE                 580
 #define IDM_FIND_NEXT_SEL               581
 #define IDM_FIND_PREV_SEL               582
+#define IDM_FIND_IN_TABS                583
+#define IDM_FIND_IN_HISTORY             584
 #define IDM_DEBUG_SHOW_LINKS            590
 #define IDM_DEBUG_CRASH_ME              592
 #define IDM_LOAD_MOBI_SAMPLE            593
@@ -103,6 +106,8 @@
 #define IDM_DEBUG_MUI                   595
 #define IDM_DEBUG_ANNOTATION            596
 #define IDM_ADVANCED_OPTIONS            597
+#define IDM_DEBUG_PERF_OVERLAY          598
+#define IDM_SHOW_PERF_STATS             599
 #define IDM_FAV_FIRST                   600
 #define IDM_FAV_LAST                    800
 #define IDC_GOTO_PAGE_EDIT              1000
@@ -152,6 +157,7 @@
 #define IDC_PRINT_SCALE_FIT             1062
 #define IDC_PRINT_SCALE_NONE            1063
 #define IDC_SECTION_PRINT_COMPATIBILITY 1070
+#define IDC_PRINT_PREVIEW               1071
 #define IDC_TOC_BOX                     1100
 #define IDC_TOC_LABEL_WITH_CLOSE        1101
 #define IDC_TOC_TREE                    1102
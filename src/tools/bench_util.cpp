@@ -0,0 +1,360 @@
+/* Copyright 2015 the SumatraPDF project authors (see AUTHORS file).
+   License: GPLv3 */
+
+// bench_util runs repeatable micro-benchmarks for the hot-path primitives
+// in src/utils so that optimizing them can be measured rather than guessed.
+
+// Usage: bench_util [-iter <n>] [-filter <name>] [file.epub|file.mobi|file.html ...]
+// The given ebooks are used as input for the HtmlPullParser benchmark,
+// all other input is generated deterministically.
+
+#include "BaseUtil.h"
+#include "CmdLineParser.h"
+#include "CssParser.h"
+#include "Dict.h"
+#include "FileUtil.h"
+#include "HtmlParserLookup.h"
+#include "HtmlPullParser.h"
+#include "JsonParser.h"
+#include "SquareTreeParser.h"
+#include "Timer.h"
+#include "VarintGob.h"
+// rendering engines
+#include "BaseEngine.h"
+#include "EbookBase.h"
+#include "EbookDoc.h"
+#include "MobiDoc.h"
+
+#define Out(msg, ...) printf(msg "\n", __VA_ARGS__)
+#define ErrOut(msg, ...) fwprintf(stderr, TEXT(msg) TEXT("\n"), __VA_ARGS__)
+
+#define DEFAULT_ITERATIONS  10
+
+// results are accumulated here so that the compiler can't optimize the work away
+static volatile size_t gSink;
+
+// pseudo-random numbers which are the same for every run
+static uint32_t gRandState;
+
+static uint32_t NextRand()
+{
+    gRandState = gRandState * 1103515245 + 12345;
+    return gRandState >> 8;
+}
+
+struct HtmlInput {
+    ScopedMem<WCHAR> name;
+    ScopedMem<char> data;
+    size_t len;
+};
+
+struct BenchInput {
+    Vec<HtmlInput *> html;
+    str::Str<char> css;
+    str::Str<char> json;
+    str::Str<char> squareTree;
+    Vec<char *> keys;
+
+    ~BenchInput() {
+        DeleteVecMembers(html);
+        keys.FreeMembers();
+    }
+};
+
+static void BenchVecGrowth(BenchInput *)
+{
+    Vec<int> v;
+    for (int i = 0; i < 1000000; i++) {
+        v.Append(i);
+    }
+    Vec<RectD> rects;
+    for (int i = 0; i < 100000; i++) {
+        rects.AppendBlanks(1);
+    }
+    gSink += v.Count() + rects.Count();
+}
+
+static void BenchStrAppend(BenchInput *)
+{
+    str::Str<char> s;
+    for (int i = 0; i < 200000; i++) {
+        s.Append("lorem ipsum ");
+        s.Append((char)('a' + i % 26));
+    }
+    str::Str<WCHAR> ws;
+    for (int i = 0; i < 200000; i++) {
+        ws.Append(L"dolor sit amet ", 15);
+    }
+    gSink += s.Size() + ws.Size();
+}
+
+static void BenchMapStrToInt(BenchInput *in)
+{
+    dict::MapStrToInt map;
+    for (size_t i = 0; i < in->keys.Count(); i++) {
+        map.Insert(in->keys.At(i), (int)i);
+    }
+    int val, sum = 0;
+    for (size_t i = 0; i < in->keys.Count(); i++) {
+        if (map.Get(in->keys.At(i), &val))
+            sum += val;
+    }
+    gSink += map.Count() + sum;
+}
+
+static void BenchStringInterner(BenchInput *in)
+{
+    StringInterner interner;
+    // every key is interned several times, as is the case for e.g. CSS class names
+    for (int round = 0; round < 4; round++) {
+        for (size_t i = 0; i < in->keys.Count(); i++) {
+            gSink += interner.Intern(in->keys.At(i));
+        }
+    }
+    gSink += interner.StringsCount();
+}
+
+static void BenchHtmlPullParser(BenchInput *in)
+{
+    size_t tokens = 0;
+    for (size_t i = 0; i < in->html.Count(); i++) {
+        HtmlInput *html = in->html.At(i);
+        HtmlPullParser parser(html->data, html->len);
+        HtmlToken *tok;
+        while ((tok = parser.Next()) != nullptr && !tok->IsError()) {
+            // ebook layout looks up a few attributes for most start tags
+            if (tok->IsStartTag() && tok->GetAttrByName("class"))
+                tokens++;
+            tokens++;
+        }
+    }
+    gSink += tokens;
+}
+
+static void BenchCssPullParser(BenchInput *in)
+{
+    size_t props = 0;
+    CssPullParser parser(in->css.Get(), in->css.Size());
+    while (parser.NextRule()) {
+        const CssSelector *sel;
+        while ((sel = parser.NextSelector()) != nullptr) {
+            props += sel->sLen;
+        }
+        while (parser.NextProperty()) {
+            props++;
+        }
+    }
+    gSink += props;
+}
+
+class JsonCounter : public json::ValueVisitor {
+public:
+    size_t count;
+    JsonCounter() : count(0) { }
+    virtual bool Visit(const char *path, const char *value, json::DataType type) {
+        UNUSED(path); UNUSED(type);
+        count += value ? 1 : 0;
+        return true;
+    }
+};
+
+static void BenchJsonParser(BenchInput *in)
+{
+    JsonCounter counter;
+    bool ok = json::Parse(in->json.Get(), &counter);
+    CrashIf(!ok);
+    gSink += counter.count;
+}
+
+static void BenchSquareTree(BenchInput *in)
+{
+    SquareTree tree(in->squareTree.Get());
+    CrashIf(!tree.root);
+    gSink += tree.root->data.Count();
+}
+
+static void BenchVarintGob(BenchInput *)
+{
+    uint8_t buf[16];
+    gRandState = 42;
+    for (int i = 0; i < 1000000; i++) {
+        int64_t val = (int64_t)NextRand() << (i % 32);
+        if (i % 2)
+            val = -val;
+        int n = VarintGobEncode(val, buf, dimof(buf));
+        int64_t res;
+        n = VarintGobDecode(buf, n, &res);
+        CrashIf(res != val);
+        gSink += n;
+    }
+}
+
+typedef void (* BenchFunc)(BenchInput *in);
+
+static struct {
+    const char *name;
+    BenchFunc func;
+} gBenchmarks[] = {
+    { "VecGrowth",      BenchVecGrowth },
+    { "StrAppend",      BenchStrAppend },
+    { "MapStrToInt",    BenchMapStrToInt },
+    { "StringInterner", BenchStringInterner },
+    { "HtmlPullParser", BenchHtmlPullParser },
+    { "CssPullParser",  BenchCssPullParser },
+    { "JsonParser",     BenchJsonParser },
+    { "SquareTree",     BenchSquareTree },
+    { "VarintGob",      BenchVarintGob },
+};
+
+static void GenerateInput(BenchInput *in)
+{
+    gRandState = 1;
+    for (int i = 0; i < 50000; i++) {
+        in->keys.Append(str::Format("key-%d-%x", i % 12000, NextRand()));
+    }
+
+    for (int i = 0; i < 20000; i++) {
+        in->css.AppendFmt("p.c%d, div > span.s%d { margin: %dpx 0; color: #%06x; font-style: italic }\n",
+                          i, i % 100, i % 20, NextRand() & 0xFFFFFF);
+    }
+
+    in->json.Append("{ \"items\": [");
+    for (int i = 0; i < 20000; i++) {
+        in->json.AppendFmt("%s{ \"id\": %d, \"name\": \"item \\u00e4 %d\", \"visible\": %s, \"tags\": [null, 1.5e3] }",
+                           i ? ", " : "", i, NextRand(), i % 3 ? "true" : "false");
+    }
+    in->json.Append("] }");
+
+    for (int i = 0; i < 5000; i++) {
+        in->squareTree.AppendFmt("File [\n\tFilePath = C:\\docs\\file%d.pdf\n\tPageNo = %d\n\tZoom = fit page\n"
+                                 "\tFavorites [\n\t\t[\n\t\t\tName = chapter %d\n\t\t\tPageNo = %d\n\t\t]\n\t]\n]\n",
+                                 i, NextRand() % 500, i, i % 50);
+    }
+}
+
+static HtmlInput *LoadHtml(const WCHAR *filePath)
+{
+    ScopedMem<char> data;
+    size_t len = 0;
+    if (EpubDoc::IsSupportedFile(filePath)) {
+        ScopedPtr<EpubDoc> doc(EpubDoc::CreateFromFile(filePath));
+        if (doc) {
+            const char *html = doc->GetHtmlData(&len);
+            data.Set((char *)memdup(html, len));
+        }
+    }
+    else if (MobiDoc::IsSupportedFile(filePath)) {
+        ScopedPtr<MobiDoc> doc(MobiDoc::CreateFromFile(filePath));
+        if (doc) {
+            const char *html = doc->GetHtmlData(len);
+            data.Set((char *)memdup(html, len));
+        }
+    }
+    else {
+        data.Set(file::ReadAll(filePath, &len));
+    }
+    if (!data)
+        return nullptr;
+
+    HtmlInput *html = new HtmlInput();
+    html->name.Set(str::Dup(filePath));
+    html->data.Set(data.StealData());
+    html->len = len;
+    return html;
+}
+
+// generated html for when no ebooks are given on the command line
+static HtmlInput *GenerateHtml()
+{
+    str::Str<char> s;
+    s.Append("<html><head><title>generated</title></head><body>\n");
+    for (int i = 0; i < 20000; i++) {
+        s.AppendFmt("<p class=\"c%d\">Paragraph %d with <b>bold</b>, <i>italic</i> &amp; <a href=\"#n%d\">a link</a>.</p>\n",
+                    i % 7, i, i);
+        if (i % 100 == 0)
+            s.AppendFmt("<h2 id=\"n%d\">Chapter</h2><img src=\"img%d.jpg\" /><br/>\n", i, i);
+    }
+    s.Append("</body></html>");
+
+    HtmlInput *html = new HtmlInput();
+    html->name.Set(str::Dup(L"generated"));
+    html->len = s.Size();
+    html->data.Set(s.StealData());
+    return html;
+}
+
+static int CompareDoubles(const void *a, const void *b)
+{
+    double d1 = *(double *)a, d2 = *(double *)b;
+    return d1 < d2 ? -1 : d1 > d2 ? 1 : 0;
+}
+
+static void RunBenchmark(const char *name, BenchFunc func, BenchInput *in, int iterations)
+{
+    // the first run warms up caches and the heap and isn't counted
+    func(in);
+
+    Vec<double> times;
+    for (int i = 0; i < iterations; i++) {
+        Timer t;
+        func(in);
+        times.Append(t.Stop());
+    }
+    qsort(times.LendData(), times.Count(), sizeof(double), CompareDoubles);
+    double total = 0;
+    for (size_t i = 0; i < times.Count(); i++) {
+        total += times.At(i);
+    }
+    Out("%-16s min %8.2f ms  median %8.2f ms  avg %8.2f ms", name,
+        times.At(0), times.At(times.Count() / 2), total / times.Count());
+}
+
+int main(int argc, char **argv)
+{
+    UNUSED(argc); UNUSED(argv);
+
+    WStrVec argList;
+    ParseCmdLine(GetCommandLine(), argList);
+
+    int iterations = DEFAULT_ITERATIONS;
+    ScopedMem<char> filter;
+    BenchInput in;
+    for (size_t i = 1; i < argList.Count(); i++) {
+        if (str::Eq(argList.At(i), L"-iter") && i + 1 < argList.Count()) {
+            iterations = _wtoi(argList.At(++i));
+            if (iterations < 1)
+                goto Usage;
+        }
+        else if (str::Eq(argList.At(i), L"-filter") && i + 1 < argList.Count())
+            filter.Set(str::conv::ToUtf8(argList.At(++i)));
+        else if (str::StartsWith(argList.At(i), L"-"))
+            goto Usage;
+        else {
+            HtmlInput *html = LoadHtml(argList.At(i));
+            if (!html) {
+                ErrOut("Error: failed to load %s", argList.At(i));
+                return 1;
+            }
+            in.html.Append(html);
+        }
+    }
+
+    GenerateInput(&in);
+    if (in.html.Count() == 0)
+        in.html.Append(GenerateHtml());
+    for (size_t i = 0; i < in.html.Count(); i++) {
+        Out("html input: %S (%d bytes)", in.html.At(i)->name.Get(), (int)in.html.At(i)->len);
+    }
+
+    for (size_t i = 0; i < dimof(gBenchmarks); i++) {
+        if (filter && !str::FindI(gBenchmarks[i].name, filter))
+            continue;
+        RunBenchmark(gBenchmarks[i].name, gBenchmarks[i].func, &in, iterations);
+    }
+    return 0;
+
+Usage:
+    ErrOut("%s [-iter <n>][-filter <name>] [file.epub|file.mobi|file.html ...]",
+        path::GetBaseName(argList.At(0)));
+    return 2;
+}
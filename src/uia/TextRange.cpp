@@ -95,13 +95,29 @@ bool SumatraUIAutomationTextRange::IsEmptyRange() const
     return (startPage == endPage && startGlyph == endGlyph);
 }
 
-int SumatraUIAutomationTextRange::GetPageGlyphCount(int pageNum)
+bool SumatraUIAutomationTextRange::IsPageTextAvailable(int pageNum)
+{
+    DisplayModel *dm = document->GetDM();
+    return dm->PageVisibleNearby(pageNum) || dm->textCache->HasData(pageNum);
+}
+
+// pages without available text are treated as empty
+const WCHAR *SumatraUIAutomationTextRange::GetPageText(int pageNum, int *lenOut)
 {
     AssertCrash(document->IsDocumentLoaded());
     AssertCrash(pageNum > 0);
 
+    if (!IsPageTextAvailable(pageNum)) {
+        *lenOut = 0;
+        return L"";
+    }
+    return document->GetDM()->textCache->GetData(pageNum, lenOut);
+}
+
+int SumatraUIAutomationTextRange::GetPageGlyphCount(int pageNum)
+{
     int pageLen;
-    document->GetDM()->textCache->GetData(pageNum, &pageLen);
+    GetPageText(pageNum, &pageLen);
     return pageLen;
 }
 
@@ -134,7 +150,8 @@ int SumatraUIAutomationTextRange::FindPreviousWordEndpoint(int pageno, int idx,
 {
     // based on TextSelection::SelectWordAt
     int textLen;
-    const WCHAR *pageText = document->GetDM()->textCache->GetData(pageno, &textLen);
+    const WCHAR *pageText = GetPageText(pageno, &textLen);
+    idx = std::min(idx, textLen);
 
     if (dontReturnInitial) {
         for (; idx > 0; idx--) {
@@ -153,7 +170,8 @@ int SumatraUIAutomationTextRange::FindPreviousWordEndpoint(int pageno, int idx,
 int SumatraUIAutomationTextRange::FindNextWordEndpoint(int pageno, int idx, bool dontReturnInitial)
 {
     int textLen;
-    const WCHAR *pageText = document->GetDM()->textCache->GetData(pageno, &textLen);
+    const WCHAR *pageText = GetPageText(pageno, &textLen);
+    idx = std::min(idx, textLen);
 
     if (dontReturnInitial) {
         for (; idx < textLen; idx++) {
@@ -172,7 +190,8 @@ int SumatraUIAutomationTextRange::FindNextWordEndpoint(int pageno, int idx, bool
 int SumatraUIAutomationTextRange::FindPreviousLineEndpoint(int pageno, int idx, bool dontReturnInitial)
 {
     int textLen;
-    const WCHAR *pageText = document->GetDM()->textCache->GetData(pageno, &textLen);
+    const WCHAR *pageText = GetPageText(pageno, &textLen);
+    idx = std::min(idx, textLen);
 
     if (dontReturnInitial)
     {
@@ -194,7 +213,8 @@ int SumatraUIAutomationTextRange::FindPreviousLineEndpoint(int pageno, int idx,
 int SumatraUIAutomationTextRange::FindNextLineEndpoint(int pageno, int idx, bool dontReturnInitial)
 {
     int textLen;
-    const WCHAR *pageText = document->GetDM()->textCache->GetData(pageno, &textLen);
+    const WCHAR *pageText = GetPageText(pageno, &textLen);
+    idx = std::min(idx, textLen);
 
     if (dontReturnInitial) {
         for (; idx < textLen; idx++)
@@ -438,31 +458,49 @@ HRESULT STDMETHODCALLTYPE SumatraUIAutomationTextRange::GetText(int maxLength, B
     if (!document->IsDocumentLoaded())
         return E_FAIL;
 
+    // -1 and [0, inf) are allowed
+    if (maxLength < -1)
+        return E_INVALIDARG;
+
     if (IsNullRange() || IsEmptyRange()) {
         *text = SysAllocString(L""); // 0-sized not-null string
         return S_OK;
     }
 
+    // screen readers tend to request the whole document's text, so only the text
+    // up to maxLength and up to the first page without available text is returned
+    // (the first page's text is extracted if needed, so that reading can progress)
+    int toPage = startPage, toGlyph = startGlyph;
+    for (int page = startPage, count = 0; page <= endPage; page++) {
+        int pageLen;
+        if (page == startPage)
+            document->GetDM()->textCache->GetData(page, &pageLen);
+        else if (IsPageTextAvailable(page))
+            GetPageText(page, &pageLen);
+        else
+            break;
+        toPage = page;
+        toGlyph = page == endPage ? std::min(endGlyph, pageLen) : pageLen;
+        count += toGlyph - (page == startPage ? std::min(startGlyph, toGlyph) : 0);
+        if (maxLength != -1 && count >= maxLength)
+            break;
+    }
+
     TextSelection selection(document->GetDM()->GetEngine(), document->GetDM()->textCache);
     selection.StartAt(startPage, startGlyph);
-    selection.SelectUpTo(endPage, endGlyph);
+    selection.SelectUpTo(toPage, toGlyph);
 
     ScopedMem<WCHAR> selected_text(selection.ExtractText(L"\r\n"));
     size_t selected_text_length = str::Len(selected_text);
 
-    // -1 and [0, inf) are allowed
-    if (maxLength > -2) {
-        if (maxLength != -1 && selected_text_length > (size_t)maxLength)
-            selected_text[maxLength] = '\0'; // truncate
+    if (maxLength != -1 && selected_text_length > (size_t)maxLength)
+        selected_text[maxLength] = '\0'; // truncate
 
-        *text = SysAllocString(selected_text);
-        if (*text)
-            return S_OK;
-        else
-            return E_OUTOFMEMORY;
-    } else {
-        return E_INVALIDARG;
-    }
+    *text = SysAllocString(selected_text);
+    if (*text)
+        return S_OK;
+    else
+        return E_OUTOFMEMORY;
 }
 
 HRESULT STDMETHODCALLTYPE SumatraUIAutomationTextRange::Move(enum TextUnit unit,int count, int *moved)
@@ -33,6 +33,11 @@ public:
     bool IsNullRange() const;
     bool IsEmptyRange() const;
 
+    // text is only extracted on demand for pages close to the viewport, for all
+    // other pages it's used once the background prefetcher has extracted it (so
+    // that document wide requests don't block the UI thread for long documents)
+    bool IsPageTextAvailable(int pageNum);
+    const WCHAR *GetPageText(int pageNum, int *lenOut);
     int GetPageGlyphCount(int pageNum);
     int GetPageCount();
 
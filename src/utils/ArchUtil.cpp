@@ -13,16 +13,26 @@ extern "C" {
 // fails to open or extract and uses that as a fallback
 #define ENABLE_UNRARDLL_FALLBACK
 
-#ifdef ENABLE_UNRARDLL_FALLBACK
 #include "FileUtil.h"
-#endif
+#include "WinUtil.h"
 
-ArchFile::ArchFile(ar_stream *data, ar_archive *(* openFormat)(ar_stream *)) : data(data), ar(nullptr)
+ArchFile::ArchFile(ar_stream *data, ar_archive *(* openFormat)(ar_stream *), const ArchEntries *entries) : data(data),
+    ar(nullptr), arMoves(0), entriesRestored(false), extractForward(false), cacheFile(INVALID_HANDLE_VALUE),
+    cacheSize(0), nextToCache(0)
 {
     if (data && openFormat)
         ar = openFormat(data);
     if (!ar)
         return;
+    // entries are looked up by offset anyway, so the headers don't have to be scanned
+    if (entries && entries->names.Count() > 0 && entries->names.Count() == entries->offsets.Count()) {
+        for (size_t i = 0; i < entries->names.Count(); i++) {
+            filenames.Append(str::Dup(entries->names.At(i)));
+            filepos.Append(entries->offsets.At(i));
+        }
+        entriesRestored = true;
+        return;
+    }
     while (ar_parse_entry(ar)) {
         const char *name = ar_entry_get_name(ar);
         if (name)
@@ -37,6 +47,8 @@ ArchFile::ArchFile(ar_stream *data, ar_archive *(* openFormat)(ar_stream *)) : d
 
 ArchFile::~ArchFile()
 {
+    if (cacheFile != INVALID_HANDLE_VALUE)
+        CloseHandle(cacheFile);
     ar_close_archive(ar);
     ar_close(data);
 }
@@ -46,6 +58,15 @@ size_t ArchFile::GetFileIndex(const WCHAR *fileName)
     return filenames.FindI(fileName);
 }
 
+void ArchFile::GetEntries(ArchEntries& entries) const
+{
+    CrashIf(filenames.Count() != filepos.Count());
+    for (size_t i = 0; i < filenames.Count(); i++) {
+        entries.names.Append(str::Dup(filenames.At(i)));
+        entries.offsets.Append(filepos.At(i));
+    }
+}
+
 size_t ArchFile::GetFileCount() const
 {
     CrashIf(filenames.Count() != filepos.Count());
@@ -69,8 +90,24 @@ char *ArchFile::GetFileDataByIdx(size_t fileindex, size_t *len)
     if (fileindex >= filenames.Count())
         return nullptr;
 
-    if (!ar || !ar_parse_entry_at(ar, filepos.At(fileindex)))
+    char *data = extractForward ? ExtractForward(fileindex, len) : UncompressEntry(fileindex, len);
+    if (!data)
         return GetFileFromFallback(fileindex, len);
+    return data;
+}
+
+bool ArchFile::ParseEntry(size_t fileindex)
+{
+    if (!ar || -1 == filepos.At(fileindex))
+        return false;
+    arMoves++;
+    return ar_parse_entry_at(ar, filepos.At(fileindex));
+}
+
+char *ArchFile::UncompressEntry(size_t fileindex, size_t *len)
+{
+    if (!ParseEntry(fileindex))
+        return nullptr;
 
     size_t size = ar_entry_get_size(ar);
     if (size > SIZE_MAX - 3)
@@ -79,7 +116,94 @@ char *ArchFile::GetFileDataByIdx(size_t fileindex, size_t *len)
     if (!data)
         return nullptr;
     if (!ar_entry_uncompress(ar, data, size))
-        return GetFileFromFallback(fileindex, len);
+        return nullptr;
+    // zero-terminate for convenience
+    data[size] = data[size + 1] = data[size + 2] = '\0';
+
+    if (len)
+        *len = size;
+    return data.StealData();
+}
+
+char *ArchFile::ExtractForward(size_t fileindex, size_t *len)
+{
+    char *data = ReadFromCache(fileindex, len);
+    if (data)
+        return data;
+
+    // uncompressing the skipped entries now is much cheaper than having
+    // to restart decompression from the first entry when they're requested
+    for (; nextToCache < fileindex && extractForward; nextToCache++) {
+        if (-1 == filepos.At(nextToCache))
+            continue;
+        size_t size;
+        ScopedMem<char> skipped(UncompressEntry(nextToCache, &size));
+        if (skipped)
+            WriteToCache(nextToCache, skipped, size);
+    }
+
+    size_t size;
+    data = UncompressEntry(fileindex, &size);
+    if (data && fileindex >= nextToCache) {
+        WriteToCache(fileindex, data, size);
+        nextToCache = fileindex + 1;
+    }
+    if (data && len)
+        *len = size;
+    return data;
+}
+
+bool ArchFile::WriteToCache(size_t fileindex, const char *data, size_t len)
+{
+    if (INVALID_HANDLE_VALUE == cacheFile) {
+        ScopedMem<WCHAR> cachePath(path::GetTempPath(L"arc"));
+        if (cachePath) {
+            cacheFile = CreateFile(cachePath, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                                   FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+        }
+        if (INVALID_HANDLE_VALUE == cacheFile) {
+            // fall back to extracting entries on demand
+            extractForward = false;
+            return false;
+        }
+    }
+    if (len > UINT_MAX)
+        return false;
+
+    LARGE_INTEGER pos;
+    pos.QuadPart = cacheSize;
+    DWORD written;
+    if (!SetFilePointerEx(cacheFile, pos, nullptr, FILE_BEGIN) ||
+        !WriteFile(cacheFile, data, (DWORD)len, &written, nullptr) || written != len) {
+        return false;
+    }
+
+    while (cachePos.Count() <= fileindex) {
+        cachePos.Append(-1);
+        cacheLen.Append(0);
+    }
+    cachePos.At(fileindex) = cacheSize;
+    cacheLen.At(fileindex) = len;
+    cacheSize += len;
+    return true;
+}
+
+char *ArchFile::ReadFromCache(size_t fileindex, size_t *len)
+{
+    if (fileindex >= cachePos.Count() || -1 == cachePos.At(fileindex))
+        return nullptr;
+
+    size_t size = cacheLen.At(fileindex);
+    ScopedMem<char> data((char *)malloc(size + 3));
+    if (!data)
+        return nullptr;
+    LARGE_INTEGER pos;
+    pos.QuadPart = cachePos.At(fileindex);
+    DWORD read;
+    if (!SetFilePointerEx(cacheFile, pos, nullptr, FILE_BEGIN) ||
+        !ReadFile(cacheFile, data, (DWORD)size, &read, nullptr) || read != size) {
+        return nullptr;
+    }
     // zero-terminate for convenience
     data[size] = data[size + 1] = data[size + 2] = '\0';
 
@@ -96,7 +220,7 @@ FILETIME ArchFile::GetFileTime(const WCHAR *fileName)
 FILETIME ArchFile::GetFileTime(size_t fileindex)
 {
     FILETIME ft = { (DWORD)-1, (DWORD)-1 };
-    if (ar && fileindex < filepos.Count() && ar_parse_entry_at(ar, filepos.At(fileindex))) {
+    if (fileindex < filepos.Count() && ParseEntry(fileindex)) {
         time64_t filetime = ar_entry_get_filetime(ar);
         LocalFileTimeToFileTime((FILETIME *)&filetime, &ft);
     }
@@ -107,6 +231,7 @@ char *ArchFile::GetComment(size_t *len)
 {
     if (!ar)
         return nullptr;
+    arMoves++;
     size_t commentLen = ar_get_global_comment(ar, nullptr, 0);
     if (0 == commentLen || (size_t)-1 == commentLen)
         return nullptr;
@@ -122,19 +247,174 @@ char *ArchFile::GetComment(size_t *len)
     return comment.StealData();
 }
 
+// amount of most recently uncompressed data an ArchEntryStream keeps around
+// (so that seeking back a bit, e.g. after sniffing a header, is cheap)
+#define ENTRY_STREAM_WINDOW (64 * 1024)
+#define ENTRY_STREAM_CHUNK  (ENTRY_STREAM_WINDOW / 4)
+
+// unarr can only uncompress an entry from its start and doesn't allow to checkpoint
+// the decoder's state, so seeking back beyond the window restarts uncompression
+class ArchEntryStream : public IStream {
+    LONG refCount;
+    ArchFile *arch;
+    size_t fileindex;
+    uint64_t size;
+    // current read position
+    uint64_t pos;
+    // number of bytes uncompressed so far (the last ENTRY_STREAM_WINDOW of which
+    // are kept in window at the offset modulo ENTRY_STREAM_WINDOW)
+    uint64_t done;
+    // the value of arch->arMoves when arch->ar was last positioned for this stream
+    int arMoves;
+    char window[ENTRY_STREAM_WINDOW];
+
+    bool Restart() {
+        done = 0;
+        if (!arch->ParseEntry(fileindex))
+            return false;
+        arMoves = arch->arMoves;
+        return true;
+    }
+
+    bool UncompressChunk() {
+        // someone else has used the archive in the meantime
+        if (arMoves != arch->arMoves && !Restart())
+            return false;
+        size_t offset = (size_t)(done % ENTRY_STREAM_WINDOW);
+        size_t len = (size_t)std::min((uint64_t)ENTRY_STREAM_CHUNK, size - done);
+        len = std::min(len, ENTRY_STREAM_WINDOW - offset);
+        if (!ar_entry_uncompress(arch->ar, window + offset, len))
+            return false;
+        done += len;
+        return true;
+    }
+
+public:
+    ArchEntryStream(ArchFile *arch, size_t fileindex, uint64_t size) : refCount(1),
+        arch(arch), fileindex(fileindex), size(size), pos(0), done(0), arMoves(arch->arMoves) { }
+    virtual ~ArchEntryStream() { }
+
+    // IUnknown
+    IFACEMETHODIMP QueryInterface(REFIID riid, void **ppv) {
+        if (!ppv)
+            return E_POINTER;
+        if (IID_IUnknown == riid || IID_ISequentialStream == riid || IID_IStream == riid) {
+            *ppv = static_cast<IStream *>(this);
+            AddRef();
+            return S_OK;
+        }
+        *ppv = nullptr;
+        return E_NOINTERFACE;
+    }
+    IFACEMETHODIMP_(ULONG) AddRef() { return InterlockedIncrement(&refCount); }
+    IFACEMETHODIMP_(ULONG) Release() {
+        LONG newCount = InterlockedDecrement(&refCount);
+        if (0 == newCount)
+            delete this;
+        return newCount;
+    }
+
+    // ISequentialStream
+    IFACEMETHODIMP Read(void *pv, ULONG cb, ULONG *pcbRead) {
+        ULONG read = 0;
+        bool ok = true;
+        while (read < cb && pos < size && ok) {
+            if (done > ENTRY_STREAM_WINDOW && pos < done - ENTRY_STREAM_WINDOW)
+                ok = Restart();
+            else if (pos >= done)
+                ok = UncompressChunk();
+            else {
+                size_t offset = (size_t)(pos % ENTRY_STREAM_WINDOW);
+                size_t len = (size_t)std::min(done - pos, (uint64_t)(cb - read));
+                len = std::min(len, ENTRY_STREAM_WINDOW - offset);
+                memcpy((char *)pv + read, window + offset, len);
+                pos += len;
+                read += (ULONG)len;
+            }
+        }
+        if (pcbRead)
+            *pcbRead = read;
+        if (!ok)
+            return E_FAIL;
+        return read == cb ? S_OK : S_FALSE;
+    }
+    IFACEMETHODIMP Write(const void *pv, ULONG cb, ULONG *pcbWritten) {
+        UNUSED(pv); UNUSED(cb); UNUSED(pcbWritten);
+        return STG_E_ACCESSDENIED;
+    }
+
+    // IStream
+    IFACEMETHODIMP Seek(LARGE_INTEGER dlibMove, DWORD dwOrigin, ULARGE_INTEGER *plibNewPosition) {
+        int64_t newPos;
+        switch (dwOrigin) {
+        case STREAM_SEEK_SET: newPos = dlibMove.QuadPart; break;
+        case STREAM_SEEK_CUR: newPos = (int64_t)pos + dlibMove.QuadPart; break;
+        case STREAM_SEEK_END: newPos = (int64_t)size + dlibMove.QuadPart; break;
+        default: return STG_E_INVALIDFUNCTION;
+        }
+        if (newPos < 0)
+            return STG_E_INVALIDFUNCTION;
+        pos = (uint64_t)newPos;
+        if (plibNewPosition)
+            plibNewPosition->QuadPart = pos;
+        return S_OK;
+    }
+    IFACEMETHODIMP SetSize(ULARGE_INTEGER libNewSize) { UNUSED(libNewSize); return STG_E_ACCESSDENIED; }
+    IFACEMETHODIMP CopyTo(IStream *pstm, ULARGE_INTEGER cb, ULARGE_INTEGER *pcbRead, ULARGE_INTEGER *pcbWritten) {
+        UNUSED(pstm); UNUSED(cb); UNUSED(pcbRead); UNUSED(pcbWritten);
+        return E_NOTIMPL;
+    }
+    IFACEMETHODIMP Commit(DWORD grfCommitFlags) { UNUSED(grfCommitFlags); return S_OK; }
+    IFACEMETHODIMP Revert() { return E_NOTIMPL; }
+    IFACEMETHODIMP LockRegion(ULARGE_INTEGER libOffset, ULARGE_INTEGER cb, DWORD dwLockType) {
+        UNUSED(libOffset); UNUSED(cb); UNUSED(dwLockType);
+        return STG_E_INVALIDFUNCTION;
+    }
+    IFACEMETHODIMP UnlockRegion(ULARGE_INTEGER libOffset, ULARGE_INTEGER cb, DWORD dwLockType) {
+        UNUSED(libOffset); UNUSED(cb); UNUSED(dwLockType);
+        return STG_E_INVALIDFUNCTION;
+    }
+    IFACEMETHODIMP Stat(STATSTG *pstatstg, DWORD grfStatFlag) {
+        UNUSED(grfStatFlag);
+        ZeroMemory(pstatstg, sizeof(*pstatstg));
+        pstatstg->type = STGTY_STREAM;
+        pstatstg->cbSize.QuadPart = size;
+        pstatstg->grfMode = STGM_READ;
+        return S_OK;
+    }
+    IFACEMETHODIMP Clone(IStream **ppstm) { UNUSED(ppstm); return E_NOTIMPL; }
+};
+
+IStream *ArchFile::GetFileStream(size_t fileindex)
+{
+    if (fileindex >= filenames.Count())
+        return nullptr;
+    if (!extractForward && ParseEntry(fileindex))
+        return new ArchEntryStream(this, fileindex, ar_entry_get_size(ar));
+
+    // solid archives (and entries only available through a fallback)
+    // have to be uncompressed at once
+    size_t len;
+    ScopedMem<char> data(GetFileDataByIdx(fileindex, &len));
+    if (!data)
+        return nullptr;
+    return CreateStreamFromData(data, len);
+}
+
 ///// format specific handling /////
 
 static ar_archive *ar_open_zip_archive_any(ar_stream *stream) { return ar_open_zip_archive(stream, false); }
 static ar_archive *ar_open_zip_archive_deflated(ar_stream *stream) { return ar_open_zip_archive(stream, true); }
 #define GetZipOpener(deflatedOnly) ((deflatedOnly) ? ar_open_zip_archive_deflated : ar_open_zip_archive_any)
 
-ZipFile::ZipFile(const WCHAR *path, bool deflatedOnly) : ArchFile(ar_open_file_w(path), GetZipOpener(deflatedOnly)) { }
+ZipFile::ZipFile(const WCHAR *path, bool deflatedOnly, const ArchEntries *entries) :
+    ArchFile(ar_open_file_w(path), GetZipOpener(deflatedOnly), entries) { }
 ZipFile::ZipFile(IStream *stream, bool deflatedOnly) : ArchFile(ar_open_istream(stream), GetZipOpener(deflatedOnly)) { }
 
-_7zFile::_7zFile(const WCHAR *path) : ArchFile(ar_open_file_w(path), ar_open_7z_archive) { }
+_7zFile::_7zFile(const WCHAR *path, const ArchEntries *entries) : ArchFile(ar_open_file_w(path), ar_open_7z_archive, entries) { }
 _7zFile::_7zFile(IStream *stream) : ArchFile(ar_open_istream(stream), ar_open_7z_archive) { }
 
-TarFile::TarFile(const WCHAR *path) : ArchFile(ar_open_file_w(path), ar_open_tar_archive) { }
+TarFile::TarFile(const WCHAR *path, const ArchEntries *entries) : ArchFile(ar_open_file_w(path), ar_open_tar_archive, entries) { }
 TarFile::TarFile(IStream *stream) : ArchFile(ar_open_istream(stream), ar_open_tar_archive) { }
 
 #ifdef ENABLE_UNRARDLL_FALLBACK
@@ -149,16 +429,33 @@ public:
 class UnRarDll { };
 #endif
 
-RarFile::RarFile(const WCHAR *path) : ArchFile(ar_open_file_w(path), ar_open_rar_archive),
+RarFile::RarFile(const WCHAR *path, const ArchEntries *entries) : ArchFile(ar_open_file_w(path), ar_open_rar_archive, entries),
     path(str::Dup(path)), fallback(nullptr) { ExtractFilenamesWithFallback(); }
 RarFile::RarFile(IStream *stream) : ArchFile(ar_open_istream(stream), ar_open_rar_archive),
     path(nullptr), fallback(nullptr) { ExtractFilenamesWithFallback(); }
 RarFile::~RarFile() { delete fallback; }
 
+// checks the MHD_SOLID flag of a RAR 1.5 - 4.x main archive header
+static bool IsSolidRarArchive(ar_stream *stream)
+{
+    unsigned char header[12];
+    if (!ar_seek(stream, 0, SEEK_SET) || ar_read(stream, header, sizeof(header)) != sizeof(header))
+        return false;
+    if (memcmp(header, "Rar!\x1A\x07\x00", 7) != 0 || header[9] != 0x73)
+        return false;
+    uint16_t flags = header[10] | (header[11] << 8);
+    return (flags & 0x0008) != 0;
+}
+
 void RarFile::ExtractFilenamesWithFallback()
 {
-    if (!ar || !ar_at_eof(ar))
+    // restored entry lists already include the names found by the fallback
+    if (entriesRestored)
+        extractForward = IsSolidRarArchive(data);
+    else if (!ar || !ar_at_eof(ar))
         (void)GetFileFromFallback((size_t)-1);
+    else
+        extractForward = IsSolidRarArchive(data);
 }
 
 char *RarFile::GetFileFromFallback(size_t fileindex, size_t *len)
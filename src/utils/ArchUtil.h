@@ -6,19 +6,52 @@ typedef struct ar_stream_s ar_stream;
 typedef struct ar_archive_s ar_archive;
 }
 
+class ArchEntryStream;
+
+// the names and offsets of an archive's entries, so that they can be cached
+// and the archive be reopened without scanning all entry headers again
+// (offsets are -1 for entries only available through a fallback)
+struct ArchEntries {
+    WStrVec names;
+    Vec<int64_t> offsets;
+};
+
 class ArchFile {
+    friend class ArchEntryStream;
+
 protected:
     WStrList filenames;
     Vec<int64_t> filepos;
 
     ar_stream *data;
     ar_archive *ar;
+    // incremented whenever ar is moved to a different entry, so that
+    // entry streams know when to reposition it (cf. ArchEntryStream)
+    int arMoves;
+    // the entry list has been restored from an ArchEntries
+    bool entriesRestored;
+
+    bool ParseEntry(size_t fileindex);
+
+    // solid archives can only be decompressed in order, so all entries up
+    // to the requested one are extracted once into a temporary file
+    bool extractForward;
+    HANDLE cacheFile;
+    int64_t cacheSize;
+    Vec<int64_t> cachePos;
+    Vec<size_t> cacheLen;
+    size_t nextToCache;
+
+    char *UncompressEntry(size_t fileindex, size_t *len);
+    char *ExtractForward(size_t fileindex, size_t *len);
+    bool WriteToCache(size_t fileindex, const char *data, size_t len);
+    char *ReadFromCache(size_t fileindex, size_t *len);
 
     // call with fileindex = -1 for filename extraction using the fallback
     virtual char *GetFileFromFallback(size_t fileIndex, size_t *len = nullptr) { UNUSED(fileIndex); UNUSED(len); return nullptr; }
 
 public:
-    ArchFile(ar_stream *data, ar_archive *(* openFormat)(ar_stream *));
+    ArchFile(ar_stream *data, ar_archive *(* openFormat)(ar_stream *), const ArchEntries *entries=nullptr);
     virtual ~ArchFile();
 
     size_t GetFileCount() const;
@@ -26,10 +59,17 @@ public:
     const WCHAR *GetFileName(size_t fileindex);
     // reverts GetFileName
     size_t GetFileIndex(const WCHAR *filename);
+    // copies the entry list for reopening the same archive later
+    void GetEntries(ArchEntries& entries) const;
 
     // caller must free() the result
     char *GetFileDataByName(const WCHAR *filename, size_t *len=nullptr);
     char *GetFileDataByIdx(size_t fileindex, size_t *len=nullptr);
+    // returns a stream which uncompresses the entry incrementally while it's
+    // being read, so that large entries don't have to be uncompressed at once
+    // (the stream may only be used while the ArchFile exists and not concurrently
+    // with it; solid archives fall back to uncompressing the entire entry)
+    IStream *GetFileStream(size_t fileindex);
 
     FILETIME GetFileTime(const WCHAR *filename);
     FILETIME GetFileTime(size_t fileindex);
@@ -40,19 +80,19 @@ public:
 
 class ZipFile : public ArchFile {
 public:
-    explicit ZipFile(const WCHAR *path, bool deflatedOnly=false);
+    explicit ZipFile(const WCHAR *path, bool deflatedOnly=false, const ArchEntries *entries=nullptr);
     explicit ZipFile(IStream *stream, bool deflatedOnly=false);
 };
 
 class _7zFile : public ArchFile {
 public:
-    explicit _7zFile(const WCHAR *path);
+    explicit _7zFile(const WCHAR *path, const ArchEntries *entries=nullptr);
     explicit _7zFile(IStream *stream);
 };
 
 class TarFile : public ArchFile {
 public:
-    explicit TarFile(const WCHAR *path);
+    explicit TarFile(const WCHAR *path, const ArchEntries *entries=nullptr);
     explicit TarFile(IStream *stream);
 };
 
@@ -66,7 +106,7 @@ class RarFile : public ArchFile {
     virtual char *GetFileFromFallback(size_t fileindex, size_t *len=nullptr);
 
 public:
-    explicit RarFile(const WCHAR *path);
+    explicit RarFile(const WCHAR *path, const ArchEntries *entries=nullptr);
     explicit RarFile(IStream *stream);
     virtual ~RarFile();
 };
@@ -129,6 +129,143 @@ void *PoolAllocator::FindNthPieceOfSize(size_t size, size_t n) const {
     return nullptr;
 }
 
+// blocks are allocated in at least this size (larger blocks
+// are only allocated for larger pieces and freed sooner)
+#define SCRATCH_BLOCK_SIZE  (64 * 1024)
+// each piece is preceded by its size (rounded up for alignment)
+#define SCRATCH_HEADER_SIZE 8
+
+static volatile LONG gScratchTlsIndex = TLS_OUT_OF_INDEXES;
+
+ScratchArena::~ScratchArena() {
+    while (first) {
+        Block *next = first->next;
+        free(first);
+        first = next;
+    }
+}
+
+void *ScratchArena::Alloc(size_t size) {
+    CrashIf(0 == scopeDepth);
+    size_t needed = SCRATCH_HEADER_SIZE + RoundUp(size, 8);
+    if (!curr || curr->size - curr->used < needed) {
+        Block *next = curr ? curr->next : first;
+        if (next && next->size >= needed) {
+            curr = next;
+        }
+        else {
+            size_t blockSize = std::max(needed, (size_t)SCRATCH_BLOCK_SIZE);
+            Block *block = (Block *)malloc(sizeof(Block) + blockSize);
+            if (!block)
+                return nullptr;
+            block->size = blockSize;
+            // keep any following block for reuse
+            block->next = next;
+            if (curr)
+                curr->next = block;
+            else
+                first = block;
+            curr = block;
+        }
+        curr->used = 0;
+    }
+
+    char *mem = curr->DataStart() + curr->used;
+    *(size_t *)mem = size;
+    curr->used += needed;
+    last = mem + SCRATCH_HEADER_SIZE;
+    return last;
+}
+
+void *ScratchArena::Realloc(void *mem, size_t size) {
+    if (!mem)
+        return Alloc(size);
+    size_t *header = (size_t *)((char *)mem - SCRATCH_HEADER_SIZE);
+    size_t oldSize = *header;
+    if (mem == last) {
+        // grow or shrink the most recent piece in place
+        size_t used = curr->used - RoundUp(oldSize, 8) + RoundUp(size, 8);
+        if (used <= curr->size) {
+            curr->used = used;
+            *header = size;
+            return mem;
+        }
+    }
+    else if (size <= oldSize) {
+        return mem;
+    }
+    void *newMem = Alloc(size);
+    if (newMem)
+        memcpy(newMem, mem, std::min(oldSize, size));
+    return newMem;
+}
+
+void ScratchArena::Free(void *mem) {
+    // only the most recent piece can be given back
+    if (!mem || mem != last)
+        return;
+    size_t size = *(size_t *)((char *)mem - SCRATCH_HEADER_SIZE);
+    curr->used -= SCRATCH_HEADER_SIZE + RoundUp(size, 8);
+    last = nullptr;
+}
+
+ScratchArena::Mark ScratchArena::Enter() {
+    scopeDepth++;
+    // pieces allocated before a scope mustn't grow into it
+    last = nullptr;
+    Mark mark = { curr, curr ? curr->used : 0 };
+    return mark;
+}
+
+void ScratchArena::Leave(Mark mark) {
+    CrashIf(scopeDepth <= 0);
+    scopeDepth--;
+    last = nullptr;
+    curr = mark.block;
+    if (curr)
+        curr->used = mark.used;
+    if (scopeDepth > 0)
+        return;
+    // free the blocks which were only needed for large pieces
+    // and keep a single regular block for the next scope
+    Block **link = &first;
+    int kept = 0;
+    while (*link) {
+        Block *block = *link;
+        if (block->size == SCRATCH_BLOCK_SIZE && 0 == kept++) {
+            link = &block->next;
+            continue;
+        }
+        *link = block->next;
+        free(block);
+    }
+    curr = nullptr;
+}
+
+ScratchArena *ScratchArena::ForCurrentThread() {
+    if (TLS_OUT_OF_INDEXES == (DWORD)gScratchTlsIndex) {
+        DWORD idx = TlsAlloc();
+        CrashAlwaysIf(TLS_OUT_OF_INDEXES == idx);
+        if (InterlockedCompareExchange(&gScratchTlsIndex, (LONG)idx, (LONG)TLS_OUT_OF_INDEXES) != (LONG)TLS_OUT_OF_INDEXES)
+            TlsFree(idx);
+    }
+    ScratchArena *arena = (ScratchArena *)TlsGetValue(gScratchTlsIndex);
+    if (!arena) {
+        arena = new ScratchArena();
+        TlsSetValue(gScratchTlsIndex, arena);
+    }
+    return arena;
+}
+
+void ScratchArena::FreeForCurrentThread() {
+    if (TLS_OUT_OF_INDEXES == (DWORD)gScratchTlsIndex)
+        return;
+    ScratchArena *arena = (ScratchArena *)TlsGetValue(gScratchTlsIndex);
+    CrashIf(arena && arena->scopeDepth != 0);
+    delete arena;
+    TlsSetValue(gScratchTlsIndex, nullptr);
+}
+
 size_t RoundToPowerOf2(size_t size)
 {
     size_t n = 1;
@@ -196,3 +333,62 @@ uint32_t MurmurHash2(const void *key, size_t len)
 
     return h;
 }
+
+/* 64-bit variant of MurmurHash2 (MurmurHash64A) which mixes in 8 bytes at
+ * a time. Use it for cache keys where 32 bits could collide too easily
+ * (it has the same limitations as MurmurHash2 and isn't cryptographic
+ * either, so don't use it where the data might be crafted to collide). */
+uint64_t MurmurHash64(const void *key, size_t len)
+{
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+
+    uint64_t h = hash_function_seed ^ (len * m);
+
+    const uint8_t *data = (const uint8_t *)key;
+    const uint8_t *end = data + (len & ~(size_t)7);
+
+    while (data != end) {
+        uint64_t k;
+        memcpy(&k, data, sizeof(k));
+
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+
+        h ^= k;
+        h *= m;
+
+        data += 8;
+    }
+
+    switch (len & 7) {
+    case 7: h ^= (uint64_t)data[6] << 48;
+    case 6: h ^= (uint64_t)data[5] << 40;
+    case 5: h ^= (uint64_t)data[4] << 32;
+    case 4: h ^= (uint64_t)data[3] << 24;
+    case 3: h ^= (uint64_t)data[2] << 16;
+    case 2: h ^= (uint64_t)data[1] << 8;
+    case 1: h ^= (uint64_t)data[0]; h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+
+    return h;
+}
+
+bool HasSSE2()
+{
+#ifdef _WIN64
+    return true;
+#else
+    // 32-bit builds are compiled with /arch:IA32, so that they still run on
+    // CPUs without SSE2; code using SSE2 intrinsics must check this first
+    static int hasSSE2 = -1;
+    if (-1 == hasSSE2)
+        hasSSE2 = IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE) ? 1 : 0;
+    return hasSSE2 != 0;
+#endif
+}
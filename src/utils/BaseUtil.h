@@ -220,6 +220,9 @@ inline bool memeq(const void *s1, const void *s2, size_t len)
 
 size_t      RoundToPowerOf2(size_t size);
 uint32_t    MurmurHash2(const void *key, size_t len);
+uint64_t    MurmurHash64(const void *key, size_t len);
+// whether SSE2 instructions may be used (always true for 64-bit builds)
+bool        HasSSE2();
 
 static inline size_t RoundUp(size_t n, size_t rounding)
 {
@@ -391,6 +394,69 @@ public:
     }
 };
 
+// ScratchArena is a bump allocator for short-lived temporary allocations
+// (e.g. for building up text or instructions which are copied out once
+// complete). There's one per thread (cf. ForCurrentThread), so that hot
+// paths running on several threads don't contend for the heap lock.
+// Memory must only be allocated while a ScopedScratch is alive and is
+// released in bulk once it goes out of scope.
+// The most recent allocation can be grown and freed in place, which makes
+// ScratchArena well suited as allocator for a growing Vec.
+class ScratchArena : public Allocator {
+    struct Block {
+        Block *  next;
+        size_t   size;
+        size_t   used;
+        char *   DataStart() { return (char *)this + sizeof(Block); }
+        // data follows here
+    };
+
+    // blocks after curr are kept for reuse until the outermost scope ends
+    Block *     first;
+    Block *     curr;
+    void *      last;
+    int         scopeDepth;
+
+    ScratchArena() : first(nullptr), curr(nullptr), last(nullptr), scopeDepth(0) { }
+    virtual ~ScratchArena() override;
+
+    friend class ScopedScratch;
+    struct Mark {
+        Block * block;
+        size_t  used;
+    };
+    Mark Enter();
+    void Leave(Mark mark);
+
+public:
+    virtual void *Alloc(size_t size) override;
+    virtual void *Realloc(void *mem, size_t size) override;
+    virtual void Free(void *mem) override;
+
+    static ScratchArena *ForCurrentThread();
+    // to be called before a thread exits which might have used a ScratchArena
+    static void FreeForCurrentThread();
+};
+
+// releases everything allocated from the current thread's ScratchArena
+// during its lifetime (scopes must be strictly nested)
+class ScopedScratch {
+    ScratchArena *      arena;
+    ScratchArena::Mark  mark;
+    int                 depth;
+
+public:
+    ScopedScratch() : arena(ScratchArena::ForCurrentThread()) {
+        mark = arena->Enter();
+        depth = arena->scopeDepth;
+    }
+    ~ScopedScratch() {
+        CrashIf(arena->scopeDepth != depth);
+        arena->Leave(mark);
+    }
+    Allocator *Get() const { return arena; }
+};
+
 // A helper for allocating an array of elements of type T
 // either on stack (if they fit within StackBufInBytes)
 // or in memory. Allocating on stack is a perf optimization
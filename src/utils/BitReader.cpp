@@ -39,35 +39,15 @@ size_t BitReader::BitsLeft() {
 // If asked for more bits than we have left, the extra bits will be 0
 uint32_t BitReader::Peek(size_t bitsCount) {
     assert(bitsCount <= 32);
+    if (0 == bitsCount)
+        return 0;
+    // the requested bits are always contained in the next 5 bytes
     size_t currBytePos = currBitPos / 8;
-    uint8_t currByte = GetByte(currBytePos);
-    uint8_t currBit = currBitPos % 8;
-    currByte = currByte << currBit;
-    uint8_t bitsLeft = 8 - currBit;
-    uint32_t ret = 0;
-    while (bitsCount > 0) {
-        assert(bitsLeft >= 0);
-        if (0 == bitsLeft) {
-            ++currBytePos;
-            currByte = GetByte(currBytePos);
-            bitsLeft = 8;
-        }
-        // being conservative here, could probably handle
-        // bitsLeft other than 8
-        if ((8 == bitsLeft) && (bitsCount >= 8)) {
-            // fast path - 8 bits at a time
-            ret = (ret << 8) | currByte;
-            bitsLeft = 0;
-            bitsCount -= 8;
-        } else {
-            // slow path - 1 bit at a time
-            ret = ret << 1;
-            if ((0x80 & currByte) != 0)
-                ret |= 1;
-            currByte = currByte << 1;
-            --bitsLeft;
-            --bitsCount;
-        }
+    uint64_t v = 0;
+    for (size_t i = 0; i < 5; i++) {
+        v = (v << 8) | GetByte(currBytePos + i);
     }
-    return ret;
+    size_t currBit = currBitPos % 8;
+    v = v >> (40 - currBit - bitsCount);
+    return (uint32_t)(v & ((1ULL << bitsCount) - 1));
 }
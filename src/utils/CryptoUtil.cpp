@@ -76,43 +76,85 @@ void CalcSHA1Digest(const unsigned char *data, size_t byteCount, unsigned char d
 #define CALG_SHA_256    (ALG_CLASS_HASH | ALG_TYPE_ANY | ALG_SID_SHA_256)
 #endif
 
-// MD5 digest that uses Windows' CryptoAPI. It's good for code that doesn't already
-// have MD5 code (smaller code) and it's probably faster than most other implementations
-// TODO: could try to use CryptoNG available starting in Vista. But then again, would that be worth it?
-void CalcMD5DigestWin(const void *data, size_t byteCount, unsigned char digest[16])
+CryptoHash::CryptoHash(Algorithm alg) : hProv(0), hHash(0)
 {
-    HCRYPTPROV hProv = 0;
-    HCRYPTHASH hHash = 0;
+    BOOL ok = FALSE;
+    ALG_ID algId = CALG_MD5;
+    switch (alg) {
+    case MD5:
+        // http://stackoverflow.com/questions/9794745/ms-cryptoapi-doesnt-work-on-windows-xp-with-cryptacquirecontext
+        ok = CryptAcquireContext(&hProv, nullptr, MS_DEF_PROV, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT);
+        if (!ok)
+            ok = CryptAcquireContext(&hProv, nullptr, MS_ENH_RSA_AES_PROV_XP, PROV_RSA_AES, CRYPT_VERIFYCONTEXT);
+        algId = CALG_MD5;
+        break;
+    case SHA1:
+        ok = CryptAcquireContext(&hProv, nullptr, MS_DEF_PROV, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT);
+        algId = CALG_SHA1;
+        break;
+    case SHA2:
+        ok = CryptAcquireContext(&hProv, nullptr, MS_ENH_RSA_AES_PROV, PROV_RSA_AES, CRYPT_VERIFYCONTEXT);
+        if (!ok) {
+            // TODO: test this on XP SP3
+            ok = CryptAcquireContext(&hProv, nullptr, MS_ENH_RSA_AES_PROV_XP, PROV_RSA_AES, CRYPT_VERIFYCONTEXT);
+        }
+        algId = CALG_SHA_256;
+        break;
+    }
+    if (!ok) {
+        hProv = 0;
+        return;
+    }
+    if (!CryptCreateHash(hProv, algId, 0, 0, &hHash))
+        hHash = 0;
+}
 
-    // http://stackoverflow.com/questions/9794745/ms-cryptoapi-doesnt-work-on-windows-xp-with-cryptacquirecontext
-    BOOL ok = CryptAcquireContext(&hProv, nullptr, MS_DEF_PROV, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT);
-    if (!ok)
-        ok = CryptAcquireContext(&hProv, nullptr, MS_ENH_RSA_AES_PROV_XP, PROV_RSA_AES, CRYPT_VERIFYCONTEXT);
+CryptoHash::~CryptoHash()
+{
+    if (hHash)
+        CryptDestroyHash(hHash);
+    if (hProv)
+        CryptReleaseContext(hProv, 0);
+}
 
-    CrashAlwaysIf(!ok);
-    ok = CryptCreateHash(hProv, CALG_MD5, 0, 0, &hHash);
-    CrashAlwaysIf(!ok);
+bool CryptoHash::Update(const void *data, size_t byteCount)
+{
+    if (!hHash)
+        return false;
 #ifdef _WIN64
     for (; byteCount > DWORD_MAX; data = (const BYTE *)data + DWORD_MAX, byteCount -= DWORD_MAX) {
-        ok = CryptHashData(hHash, (const BYTE *)data, DWORD_MAX, 0);
-        CrashAlwaysIf(!ok);
+        if (!CryptHashData(hHash, (const BYTE *)data, DWORD_MAX, 0))
+            return false;
     }
 #endif
-    CrashAlwaysIf(byteCount > DWORD_MAX);
-    ok = CryptHashData(hHash, (const BYTE*)data, (DWORD)byteCount, 0);
-    CrashAlwaysIf(!ok);
+    return CryptHashData(hHash, (const BYTE *)data, (DWORD)byteCount, 0) != FALSE;
+}
 
+bool CryptoHash::Final(unsigned char *digest, size_t digestLen)
+{
+    if (!hHash)
+        return false;
     DWORD hashLen;
     DWORD argSize = sizeof(DWORD);
-    ok = CryptGetHashParam(hHash, HP_HASHSIZE, (BYTE *)&hashLen, &argSize, 0);
-    CrashIf(sizeof(DWORD) != argSize);
-    CrashAlwaysIf(!ok);
-    CrashAlwaysIf(16 != hashLen);
+    BOOL ok = CryptGetHashParam(hHash, HP_HASHSIZE, (BYTE *)&hashLen, &argSize, 0);
+    CrashIf(ok && sizeof(DWORD) != argSize);
+    if (!ok || hashLen != digestLen)
+        return false;
     ok = CryptGetHashParam(hHash, HP_HASHVAL, digest, &hashLen, 0);
-    CrashAlwaysIf(!ok);
-    CrashAlwaysIf(16 != hashLen);
+    // the hash can't be updated any further after its value has been retrieved
     CryptDestroyHash(hHash);
-    CryptReleaseContext(hProv,0);
+    hHash = 0;
+    return ok && hashLen == digestLen;
+}
+
+// MD5 digest that uses Windows' CryptoAPI. It's good for code that doesn't already
+// have MD5 code (smaller code) and it's probably faster than most other implementations
+// TODO: could try to use CryptoNG available starting in Vista. But then again, would that be worth it?
+void CalcMD5DigestWin(const void *data, size_t byteCount, unsigned char digest[16])
+{
+    CryptoHash hash(CryptoHash::MD5);
+    bool ok = hash.Update(data, byteCount) && hash.Final(digest, 16);
+    CrashAlwaysIf(!ok);
 }
 
 // SHA1 digest that uses Windows' CryptoAPI. It's good for code that doesn't already
@@ -120,70 +162,16 @@ void CalcMD5DigestWin(const void *data, size_t byteCount, unsigned char digest[1
 // TODO: hasn't been tested for corectness
 void CalcSha1DigestWin(const void *data, size_t byteCount, unsigned char digest[20])
 {
-    HCRYPTPROV hProv = 0;
-    HCRYPTHASH hHash = 0;
-
-    BOOL ok = CryptAcquireContext(&hProv, nullptr, MS_DEF_PROV, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT);
-    CrashAlwaysIf(!ok);
-    ok = CryptCreateHash(hProv, CALG_SHA1, 0, 0, &hHash);
-    CrashAlwaysIf(!ok);
-#ifdef _WIN64
-    for (; byteCount > DWORD_MAX; data = (const BYTE *)data + DWORD_MAX, byteCount -= DWORD_MAX) {
-        ok = CryptHashData(hHash, (const BYTE *)data, DWORD_MAX, 0);
-        CrashAlwaysIf(!ok);
-    }
-#endif
-    CrashAlwaysIf(byteCount > DWORD_MAX);
-    ok = CryptHashData(hHash, (const BYTE*)data, (DWORD)byteCount, 0);
-    CrashAlwaysIf(!ok);
-
-    DWORD hashLen;
-    DWORD argSize = sizeof(DWORD);
-    ok = CryptGetHashParam(hHash, HP_HASHSIZE, (BYTE *)&hashLen, &argSize, 0);
-    CrashIf(sizeof(DWORD) != argSize);
+    CryptoHash hash(CryptoHash::SHA1);
+    bool ok = hash.Update(data, byteCount) && hash.Final(digest, 20);
     CrashAlwaysIf(!ok);
-    CrashAlwaysIf(20 != hashLen);
-    ok = CryptGetHashParam(hHash, HP_HASHVAL, digest, &hashLen, 0);
-    CrashAlwaysIf(!ok);
-    CrashAlwaysIf(20 != hashLen);
-    CryptDestroyHash(hHash);
-    CryptReleaseContext(hProv,0);
 }
 
 void CalcSha2DigestWin(const void *data, size_t byteCount, unsigned char digest[32])
 {
-    HCRYPTPROV hProv = 0;
-    HCRYPTHASH hHash = 0;
-
-    BOOL ok = CryptAcquireContext(&hProv, nullptr, MS_ENH_RSA_AES_PROV, PROV_RSA_AES, CRYPT_VERIFYCONTEXT);
-    if (!ok) {
-        // TODO: test this on XP SP3
-        ok = CryptAcquireContext(&hProv, nullptr, MS_ENH_RSA_AES_PROV_XP, PROV_RSA_AES, CRYPT_VERIFYCONTEXT);
-    }
-    CrashAlwaysIf(!ok);
-    ok = CryptCreateHash(hProv, CALG_SHA_256, 0, 0, &hHash);
+    CryptoHash hash(CryptoHash::SHA2);
+    bool ok = hash.Update(data, byteCount) && hash.Final(digest, 32);
     CrashAlwaysIf(!ok);
-#ifdef _WIN64
-    for (; byteCount > DWORD_MAX; data = (const BYTE *)data + DWORD_MAX, byteCount -= DWORD_MAX) {
-        ok = CryptHashData(hHash, (const BYTE *)data, DWORD_MAX, 0);
-        CrashAlwaysIf(!ok);
-    }
-#endif
-    CrashAlwaysIf(byteCount > DWORD_MAX);
-    ok = CryptHashData(hHash, (const BYTE*)data, (DWORD)byteCount, 0);
-    CrashAlwaysIf(!ok);
-
-    DWORD hashLen;
-    DWORD argSize = sizeof(DWORD);
-    ok = CryptGetHashParam(hHash, HP_HASHSIZE, (BYTE *)&hashLen, &argSize, 0);
-    CrashIf(sizeof(DWORD) != argSize);
-    CrashAlwaysIf(!ok);
-    CrashAlwaysIf(32 != hashLen);
-    ok = CryptGetHashParam(hHash, HP_HASHVAL, digest, &hashLen, 0);
-    CrashAlwaysIf(!ok);
-    CrashAlwaysIf(32 != hashLen);
-    CryptDestroyHash(hHash);
-    CryptReleaseContext(hProv,0);
 }
 
 static bool ExtractSignature(const char *hexSignature, const void *data, size_t& dataLen, ScopedMem<BYTE>& signature, size_t& signatureLen)
@@ -9,4 +9,25 @@ void CalcMD5DigestWin(const void *data, size_t byteCount, unsigned char digest[1
 void CalcSha1DigestWin(const void *data, size_t byteCount, unsigned char digest[20]);
 void CalcSha2DigestWin(const void *data, size_t byteCount, unsigned char digest[32]);
 
+// computes a digest with Windows' CryptoAPI incrementally, so that large
+// files can be hashed chunk by chunk instead of having to be read at once
+class CryptoHash {
+    ULONG_PTR hProv; // HCRYPTPROV
+    ULONG_PTR hHash; // HCRYPTHASH
+
+public:
+    enum Algorithm { MD5, SHA1, SHA2 };
+
+    explicit CryptoHash(Algorithm alg);
+    ~CryptoHash();
+
+    CryptoHash(const CryptoHash&) = delete;
+    CryptoHash& operator=(const CryptoHash&) = delete;
+
+    bool IsValid() const { return hHash != 0; }
+    bool Update(const void *data, size_t byteCount);
+    // digestLen must match the algorithm's (16, 20 or 32)
+    bool Final(unsigned char *digest, size_t digestLen);
+};
+
 bool VerifySHA1Signature(const void *data, size_t dataLen, const char *hexSignature, const void *pubkey, size_t pubkeyLen);
@@ -303,7 +303,7 @@ static void GetAddressInfo(str::Str<char>& s, DWORD64 addr)
 }
 
 static bool GetStackFrameInfo(str::Str<char>& s, STACKFRAME64 *stackFrame,
-                              CONTEXT *ctx, HANDLE hThread)
+                              CONTEXT *ctx, HANDLE hThread, PREAD_PROCESS_MEMORY_ROUTINE64 readMemory)
 {
 #if defined(_WIN64)
     int machineType = IMAGE_FILE_MACHINE_AMD64;
@@ -311,7 +311,7 @@ static bool GetStackFrameInfo(str::Str<char>& s, STACKFRAME64 *stackFrame,
     int machineType = IMAGE_FILE_MACHINE_I386;
 #endif
     BOOL ok = DynStackWalk64(machineType, GetCurrentProcess(), hThread,
-        stackFrame, ctx, nullptr, DynSymFunctionTableAccess64,
+        stackFrame, ctx, readMemory, DynSymFunctionTableAccess64,
         DynSymGetModuleBase64, nullptr);
     if (!ok)
         return false;
@@ -328,7 +328,8 @@ static bool GetStackFrameInfo(str::Str<char>& s, STACKFRAME64 *stackFrame,
     return true;
 }
 
-static bool GetCallstack(str::Str<char>& s, CONTEXT& ctx, HANDLE hThread)
+static bool GetCallstack(str::Str<char>& s, CONTEXT& ctx, HANDLE hThread,
+                         PREAD_PROCESS_MEMORY_ROUTINE64 readMemory=nullptr)
 {
     if (!CanStackWalk()) {
         s.Append("GetCallstack(): CanStackWalk() returned false");
@@ -354,7 +355,7 @@ static bool GetCallstack(str::Str<char>& s, CONTEXT& ctx, HANDLE hThread)
     static const int maxFrames = 32;
     while (framesCount < maxFrames)
     {
-        if (!GetStackFrameInfo(s, &stackFrame, &ctx, hThread))
+        if (!GetStackFrameInfo(s, &stackFrame, &ctx, hThread, readMemory))
             break;
         framesCount++;
     }
@@ -365,6 +366,51 @@ static bool GetCallstack(str::Str<char>& s, CONTEXT& ctx, HANDLE hThread)
     return true;
 }
 
+// While a thread is suspended, it might hold locks (e.g. the heap lock) which
+// StackWalk64 and the symbol lookups need, so only its registers and the top
+// of its stack are copied (into a preallocated buffer) before it's resumed
+// and its callstack is determined from that copy
+#define STACK_COPY_SIZE (64 * 1024)
+
+static char gStackCopy[STACK_COPY_SIZE];
+static DWORD64 gStackCopyAddr = 0;
+static size_t gStackCopyLen = 0;
+// only one thread at a time may use gStackCopy
+static LONG gStackCopyInUse = 0;
+
+static BOOL CALLBACK ReadStackCopyMemory(HANDLE hProcess, DWORD64 addr, PVOID buf, DWORD size, LPDWORD bytesRead)
+{
+    if (addr >= gStackCopyAddr && addr + size <= gStackCopyAddr + gStackCopyLen) {
+        memcpy(buf, gStackCopy + (addr - gStackCopyAddr), size);
+        *bytesRead = size;
+        return TRUE;
+    }
+    // e.g. unwind data of loaded modules
+    SIZE_T read = 0;
+    BOOL ok = ReadProcessMemory(hProcess, (LPCVOID)addr, buf, size, &read);
+    *bytesRead = (DWORD)read;
+    return ok;
+}
+
+// doesn't allocate, as the thread owning the stack is suspended
+static void CopyStack(CONTEXT& ctx)
+{
+#ifdef _WIN64
+    DWORD64 sp = ctx.Rsp;
+#else
+    DWORD64 sp = ctx.Esp;
+#endif
+    gStackCopyAddr = sp;
+    gStackCopyLen = 0;
+    MEMORY_BASIC_INFORMATION mbi;
+    if (!VirtualQuery((LPCVOID)sp, &mbi, sizeof(mbi)) || mbi.State != MEM_COMMIT)
+        return;
+    // the committed part of a stack ends at the stack's base
+    DWORD64 end = (DWORD64)mbi.BaseAddress + mbi.RegionSize;
+    gStackCopyLen = (size_t)std::min(end - sp, (DWORD64)STACK_COPY_SIZE);
+    memcpy(gStackCopy, (const void *)sp, gStackCopyLen);
+}
+
 void GetThreadCallstack(str::Str<char>& s, DWORD threadId)
 {
     if (threadId == GetCurrentThreadId())
@@ -372,10 +418,16 @@ void GetThreadCallstack(str::Str<char>& s, DWORD threadId)
 
     s.AppendFmt("\r\nThread: %x\r\n", threadId);
 
+    if (InterlockedCompareExchange(&gStackCopyInUse, 1, 0) != 0) {
+        s.Append("Another callstack is being determined\r\n");
+        return;
+    }
+
     DWORD access = THREAD_GET_CONTEXT | THREAD_QUERY_INFORMATION | THREAD_SUSPEND_RESUME;
     HANDLE hThread = OpenThread(access, false, threadId);
     if (!hThread) {
         s.Append("Failed to OpenThread()\r\n");
+        InterlockedExchange(&gStackCopyInUse, 0);
         return;
     }
 
@@ -387,13 +439,16 @@ void GetThreadCallstack(str::Str<char>& s, DWORD threadId)
         ctx.ContextFlags = CONTEXT_FULL;
         BOOL ok = GetThreadContext(hThread, &ctx);
         if (ok)
-            GetCallstack(s, ctx, hThread);
+            CopyStack(ctx);
+        ResumeThread(hThread);
+
+        if (ok)
+            GetCallstack(s, ctx, hThread, ReadStackCopyMemory);
         else
             s.Append("Failed to GetThreadContext()\r\n");
-
-        ResumeThread(hThread);
     }
     CloseHandle(hThread);
+    InterlockedExchange(&gStackCopyInUse, 0);
 }
 
 // we disable optimizations for this function as it calls RtlCaptureContext()
@@ -66,3 +66,34 @@ const char *GetCrashLog()
 }
 
 } // namespace dbglog
+
+// exported by memtrace.dll: sets the calling thread's tag and returns the previous one
+typedef int (__cdecl *Sig_MemTraceSetTag)(int tag);
+
+static Sig_MemTraceSetTag GetMemTraceSetTag()
+{
+    // memtrace.dll is loaded at startup (if at all), so it only has to be looked up once
+    static Sig_MemTraceSetTag memTraceSetTag = nullptr;
+    static bool lookedUp = false;
+    if (!lookedUp) {
+        HMODULE h = GetModuleHandle(L"memtrace.dll");
+        if (h)
+            memTraceSetTag = (Sig_MemTraceSetTag)GetProcAddress(h, "MemTraceSetTag");
+        lookedUp = true;
+    }
+    return memTraceSetTag;
+}
+
+ScopedMemTraceTag::ScopedMemTraceTag(MemTraceTag tag) : prevTag(MemTag_None)
+{
+    Sig_MemTraceSetTag memTraceSetTag = GetMemTraceSetTag();
+    if (memTraceSetTag)
+        prevTag = memTraceSetTag(tag);
+}
+
+ScopedMemTraceTag::~ScopedMemTraceTag()
+{
+    Sig_MemTraceSetTag memTraceSetTag = GetMemTraceSetTag();
+    if (memTraceSetTag)
+        memTraceSetTag(prevTag);
+}
@@ -43,6 +43,28 @@ const char *GetCrashLog();
 
 } // namespace dbglog
 
+// subsystems to which memtrace.dll attributes allocations
+// (keep in sync with MemTag in src/memtrace/MemTraceCollector/Form1.cs)
+enum MemTraceTag {
+    MemTag_None = 0,
+    MemTag_RenderCache,
+    MemTag_DisplayLists,
+    MemTag_TextCache,
+    MemTag_EbookLayout,
+    MemTag_ImageCache,
+};
+
+// while in scope, allocations on the current thread are reported to
+// the memtrace collector with the given tag (a no-op unless memtrace.dll
+// has been loaded, cf. TryLoadMemTrace)
+class ScopedMemTraceTag {
+    int prevTag;
+
+public:
+    explicit ScopedMemTraceTag(MemTraceTag tag);
+    ~ScopedMemTraceTag();
+};
+
 // short names are important for this use case
 #if NOLOG == 1
 inline void lf(const char *, ...) {
@@ -15,9 +15,10 @@ hash table. The actual dict class is a wrapper that provides
 a type-safe API and handles policy decisions like allocations
 (if they are necessary).
 
-Our hash table uses the same parameters as the one in redis
-(but without complexity of incremental hashing):
-- we use chaining on collisions
+Our hash table:
+- uses open addressing with robin hood hashing and backward shift
+  deletion, storing the entries (including their hash) inline so that
+  lookups touch few cache lines and inserts don't allocate nodes
 - size of the hash table is power of two
 
 TODO:
@@ -63,18 +64,22 @@ class WStrKeyHasherComparator : public HasherComparator {
 static StrKeyHasherComparator gStrKeyHasherComparator;
 static WStrKeyHasherComparator gWStrKeyHasherComparator;
 
+// entries are stored inline in the table (open addressing) and collisions are
+// resolved with robin hood hashing: on insertion, an entry takes the slot of
+// any entry which is closer to its ideal slot than the new one, which keeps
+// probe sequences short even at high load factors
 struct HashTableEntry {
     uintptr_t key;
     uintptr_t val;
-    struct HashTableEntry *next;
+    // 0 marks an empty slot (cf. GetHash)
+    uint32_t hash;
 };
 
 // not a class so that it can be allocated with an allocator
 struct HashTable {
-    HashTableEntry **entries;
-    HashTableEntry *freeList;
+    HashTableEntry *entries;
 
-    size_t nEntries;
+    size_t nEntries; // always a power of 2
     size_t nUsed; // total number of inserted entries
 
     // for debugging
@@ -82,15 +87,27 @@ struct HashTable {
     size_t nCollisions;
 };
 
+static inline uint32_t GetHash(HasherComparator *hc, uintptr_t key)
+{
+    uint32_t hash = (uint32_t)hc->Hash(key);
+    return hash != 0 ? hash : 1;
+}
+
+// how far the entry at pos has been displaced from its ideal slot
+static inline size_t ProbeDistance(HashTable *h, uint32_t hash, size_t pos)
+{
+    return (pos - hash) & (h->nEntries - 1);
+}
+
 static HashTable *NewHashTable(size_t size, Allocator *allocator)
 {
     CrashIf(!allocator); // we'll leak otherwise
     HashTable *h = (HashTable*)Allocator::AllocZero(allocator, sizeof(HashTable));
     // number of hash table entries should be power of 2
-    size = RoundToPowerOf2(size);
+    size = RoundToPowerOf2(std::max(size, (size_t)4));
     // entries are not allocated with allocator since those are large blocks
     // and we don't want to waste their memory after
-    h->entries = AllocArray<HashTableEntry*>(size);
+    h->entries = AllocArray<HashTableEntry>(size);
     h->nEntries = size;
     return h;
 }
@@ -101,100 +118,105 @@ static void DeleteHashTable(HashTable *h)
     // the rest is freed by allocator
 }
 
-static void HashTableResize(HashTable *h, HasherComparator *hc)
+static HashTableEntry *FindEntry(HashTable *h, HasherComparator *hc, uintptr_t key, uint32_t hash)
+{
+    size_t mask = h->nEntries - 1;
+    for (size_t pos = hash & mask, dist = 0; ; pos = (pos + 1) & mask, dist++) {
+        HashTableEntry *e = &h->entries[pos];
+        // with robin hood hashing, the key would have been placed
+        // before any entry which is closer to its own ideal slot
+        if (0 == e->hash || ProbeDistance(h, e->hash, pos) < dist)
+            return nullptr;
+        if (e->hash == hash && hc->Equal(key, e->key))
+            return e;
+    }
+}
+
+// inserts an entry for a key not yet in the table and returns where it's been placed
+// note: there must be at least one empty slot left (cf. HashTableResizeIfNeeded)
+static HashTableEntry *InsertEntry(HashTable *h, uintptr_t key, uintptr_t val, uint32_t hash)
 {
-    size_t newSize = RoundToPowerOf2(h->nEntries + 1);
-    CrashIf(newSize <= h->nEntries);
-    HashTableEntry **newEntries = AllocArray<HashTableEntry*>(newSize);
-    HashTableEntry *e, *next;
-    size_t hash, pos;
-    for (size_t i = 0; i < h->nEntries; i++) {
-        e = h->entries[i];
-        while (e) {
-            next = e->next;
-            hash = hc->Hash(e->key);
-            pos = hash % newSize;
-            e->next = newEntries[pos];
-            newEntries[pos] = e;
-            e = next;
+    HashTableEntry toInsert = { key, val, hash };
+    HashTableEntry *inserted = nullptr;
+    size_t mask = h->nEntries - 1;
+    for (size_t pos = hash & mask, dist = 0; ; pos = (pos + 1) & mask, dist++) {
+        HashTableEntry *e = &h->entries[pos];
+        if (0 == e->hash) {
+            *e = toInsert;
+            return inserted ? inserted : e;
+        }
+        size_t existingDist = ProbeDistance(h, e->hash, pos);
+        if (existingDist < dist) {
+            // take the slot and continue with placing the displaced entry
+            std::swap(toInsert, *e);
+            if (!inserted)
+                inserted = e;
+            dist = existingDist;
         }
     }
-    free(h->entries);
-    h->entries = newEntries;
-    h->nEntries = newSize;
+}
+
+static void HashTableResize(HashTable *h)
+{
+    HashTableEntry *oldEntries = h->entries;
+    size_t oldSize = h->nEntries;
+    h->nEntries = RoundToPowerOf2(oldSize + 1);
+    CrashIf(h->nEntries <= oldSize);
+    h->entries = AllocArray<HashTableEntry>(h->nEntries);
+    CrashAlwaysIf(!h->entries);
+    // the hashes are stored, so keys don't have to be hashed again
+    for (size_t i = 0; i < oldSize; i++) {
+        HashTableEntry *e = &oldEntries[i];
+        if (e->hash != 0)
+            InsertEntry(h, e->key, e->val, e->hash);
+    }
+    free(oldEntries);
     h->nResizes += 1;
 
-    CrashIf(h->nUsed >= (h->nEntries * 3) / 2);
+    CrashIf(h->nUsed >= (h->nEntries * 3) / 4);
 }
 
 // micro optimization: this is called often, so we want this check inlined. Resizing logic
 // is called rarely, so doesn't need to be inlined
-static inline void HashTableResizeIfNeeded(HashTable *h, HasherComparator *hc)
+static inline void HashTableResizeIfNeeded(HashTable *h)
 {
-    // per http://stackoverflow.com/questions/1603712/when-should-i-do-rehashing-of-entire-hash-table/1604428#1604428
-    // when using collision chaining, load factor can be 150%
-    if (h->nUsed < (h->nEntries * 3) / 2)
+    // with open addressing, probe sequences grow quickly above a load factor of 75%
+    // (robin hood hashing just keeps their lengths more even)
+    if (h->nUsed + 1 < (h->nEntries * 3) / 4)
         return;
-    HashTableResize(h, hc);
+    HashTableResize(h);
 }
 
-// note: allocator must be nullptr for get, non-nullptr for create
-static HashTableEntry *GetOrCreateEntry(HashTable *h, HasherComparator *hc, uintptr_t key, Allocator *allocator, bool& newEntry)
+// note: key must not be in the table yet
+static HashTableEntry *AddEntry(HashTable *h, uintptr_t key, uintptr_t val, uint32_t hash)
 {
-    bool shouldCreate = (allocator != nullptr);
-    size_t hash = hc->Hash(key);
-    size_t pos = hash % h->nEntries;
-    HashTableEntry *e = h->entries[pos];
-    newEntry = false;
-    while (e) {
-        if (hc->Equal(key, e->key))
-            return e;
-        e = e->next;
-    }
-    if (!shouldCreate)
-        return nullptr;
-
-    if (h->freeList) {
-        e = h->freeList;
-        h->freeList = h->freeList->next;
-    } else {
-        e = (HashTableEntry*)Allocator::AllocZero(allocator, sizeof(HashTableEntry));
-    }
-    e->next = h->entries[pos];
-    h->entries[pos] = e;
-    h->nUsed++;
-    if (e->next != nullptr)
+    HashTableResizeIfNeeded(h);
+    if (h->entries[hash & (h->nEntries - 1)].hash != 0)
         h->nCollisions++;
-    newEntry = true;
-    return e;
+    h->nUsed++;
+    return InsertEntry(h, key, val, hash);
 }
 
 static bool RemoveEntry(HashTable *h, HasherComparator *hc, uintptr_t key, uintptr_t *removedValOut)
 {
-    size_t hash = hc->Hash(key);
-    size_t pos = hash % h->nEntries;
-    HashTableEntry *e = h->entries[pos];
-    while (e) {
-        if (hc->Equal(key, e->key))
-            break;
-        e = e->next;
-    }
+    HashTableEntry *e = FindEntry(h, hc, key, GetHash(hc, key));
     if (!e)
         return false;
+    *removedValOut = e->val;
 
-    // remove the the entry from the list
-    HashTableEntry *e2 = h->entries[pos];
-    if (e2 == e) {
-        h->entries[pos] = e->next;
-    } else {
-        while (e2->next != e) {
-            e2 = e2->next;
-        }
-        e2->next = e->next;
+    // shift the following entries back by one slot until one is in its ideal
+    // slot (instead of leaving a tombstone, which would lengthen future probes)
+    size_t mask = h->nEntries - 1;
+    size_t pos = e - h->entries;
+    for (;;) {
+        size_t next = (pos + 1) & mask;
+        HashTableEntry *n = &h->entries[next];
+        if (0 == n->hash || 0 == ProbeDistance(h, n->hash, next))
+            break;
+        h->entries[pos] = *n;
+        pos = next;
     }
-    e->next = h->freeList;
-    h->freeList = e;
-    *removedValOut = e->val;
+    ZeroMemory(&h->entries[pos], sizeof(HashTableEntry));
     CrashIf(0 == h->nUsed);
     h->nUsed -= 1;
     return true;
@@ -231,21 +253,19 @@ size_t MapStrToInt::Count() const
 //   * sets existingKeyOut to (interned) key
 bool MapStrToInt::Insert(const char *key, int val, int *existingValOut, const char **existingKeyOut)
 {
-    bool newEntry;
-    HashTableEntry *e = GetOrCreateEntry(h, &gStrKeyHasherComparator, (uintptr_t)key, allocator, newEntry);
-    if (!newEntry) {
+    uint32_t hash = GetHash(&gStrKeyHasherComparator, (uintptr_t)key);
+    HashTableEntry *e = FindEntry(h, &gStrKeyHasherComparator, (uintptr_t)key, hash);
+    if (e) {
         if (existingValOut)
             *existingValOut = (int)e->val;
         if (existingKeyOut)
             *existingKeyOut = (const char *)e->key;
         return false;
     }
-    e->key = (intptr_t)Allocator::StrDup(allocator, key);
-    e->val = (intptr_t)val;
+    const char *keyCopy = Allocator::StrDup(allocator, key);
+    AddEntry(h, (uintptr_t)keyCopy, (uintptr_t)val, hash);
     if (existingKeyOut)
-        *existingKeyOut = (const char *)e->key;
-
-    HashTableResizeIfNeeded(h, &gStrKeyHasherComparator);
+        *existingKeyOut = keyCopy;
     return true;
 }
 
@@ -260,9 +280,7 @@ bool MapStrToInt::Remove(const char *key, int *removedValOut)
 
 bool MapStrToInt::Get(const char *key, int* valOut)
 {
-    StrKeyHasherComparator hc;
-    bool newEntry;
-    HashTableEntry *e = GetOrCreateEntry(h, &hc, (uintptr_t)key, nullptr, newEntry);
+    HashTableEntry *e = FindEntry(h, &gStrKeyHasherComparator, (uintptr_t)key, GetHash(&gStrKeyHasherComparator, (uintptr_t)key));
     if (!e)
         return false;
     *valOut = (int)e->val;
@@ -291,24 +309,21 @@ size_t MapWStrToInt::Count() const
 
 bool MapWStrToInt::Insert(const WCHAR *key, int val, int *prevVal)
 {
-    bool newEntry;
-    HashTableEntry *e = GetOrCreateEntry(h, &gWStrKeyHasherComparator, (uintptr_t)key, allocator, newEntry);
-    if (!newEntry) {
+    uint32_t hash = GetHash(&gWStrKeyHasherComparator, (uintptr_t)key);
+    HashTableEntry *e = FindEntry(h, &gWStrKeyHasherComparator, (uintptr_t)key, hash);
+    if (e) {
         if (prevVal)
             *prevVal = (int)e->val;
         return false;
     }
-    e->key = (intptr_t)Allocator::StrDup(allocator, key);
-    e->val = (intptr_t)val;
-
-    HashTableResizeIfNeeded(h, &gWStrKeyHasherComparator);
+    AddEntry(h, (uintptr_t)Allocator::StrDup(allocator, key), (uintptr_t)val, hash);
     return true;
 }
 
 bool MapWStrToInt::Remove(const WCHAR *key, int *removedValOut)
 {
     uintptr_t removedVal;
-    bool removed = RemoveEntry(h, &gStrKeyHasherComparator, (uintptr_t)key, &removedVal);
+    bool removed = RemoveEntry(h, &gWStrKeyHasherComparator, (uintptr_t)key, &removedVal);
     if (removed && removedValOut)
         *removedValOut = (int)removedVal;
     return removed;
@@ -316,9 +331,7 @@ bool MapWStrToInt::Remove(const WCHAR *key, int *removedValOut)
 
 bool MapWStrToInt::Get(const WCHAR *key, int* valOut)
 {
-    WStrKeyHasherComparator hc;
-    bool newEntry;
-    HashTableEntry *e = GetOrCreateEntry(h, &hc, (uintptr_t)key, nullptr, newEntry);
+    HashTableEntry *e = FindEntry(h, &gWStrKeyHasherComparator, (uintptr_t)key, GetHash(&gWStrKeyHasherComparator, (uintptr_t)key));
     if (!e)
         return false;
     *valOut = (int)e->val;
@@ -0,0 +1,205 @@
+/* Copyright 2015 the SumatraPDF project authors (see AUTHORS file).
+   License: Simplified BSD (see COPYING.BSD) */
+
+#include "BaseUtil.h"
+#include "EtwTrace.h"
+
+/*
+TraceLoggingProvider.h requires the Windows 10 SDK and imports the ETW
+functions statically (they don't exist on XP), so the TraceLogging
+metadata is encoded by hand here and the Event* functions are loaded
+dynamically. The layout of the metadata follows TraceLoggingProvider.h:
+events are written on channel 11 and carry the provider traits and the
+event's metadata as their first two data descriptors.
+*/
+
+namespace etw {
+
+// the types from evntprov.h (which only declares them for WINVER >= 0x0600)
+struct EventDescriptor {
+    USHORT    id;
+    UCHAR     version;
+    UCHAR     channel;
+    UCHAR     level;
+    UCHAR     opcode;
+    USHORT    task;
+    ULONGLONG keyword;
+};
+
+struct EventDataDescriptor {
+    ULONGLONG ptr;
+    ULONG     size;
+    // the descriptor type (in the lowest byte)
+    ULONG     reserved;
+};
+
+typedef void (WINAPI *EnableCallback)(LPCGUID sourceId, ULONG isEnabled, UCHAR level,
+                                      ULONGLONG matchAnyKeyword, ULONGLONG matchAllKeyword,
+                                      void *filterData, void *context);
+
+typedef ULONG (WINAPI *Sig_EventRegister)(LPCGUID providerId, EnableCallback enableCallback,
+                                          void *context, ULONGLONG *regHandle);
+typedef ULONG (WINAPI *Sig_EventUnregister)(ULONGLONG regHandle);
+typedef ULONG (WINAPI *Sig_EventWrite)(ULONGLONG regHandle, const EventDescriptor *desc,
+                                       ULONG dataCount, EventDataDescriptor *data);
+typedef ULONG (WINAPI *Sig_EventSetInformation)(ULONGLONG regHandle, int infoClass,
+                                                void *info, ULONG infoLen);
+
+#define EVENT_DATA_TYPE_EVENT_METADATA      1
+#define EVENT_DATA_TYPE_PROVIDER_METADATA   2
+#define EVENT_PROVIDER_SET_TRAITS           2
+#define TRACELOGGING_CHANNEL                11
+#define EVENT_LEVEL_VERBOSE                 5
+#define EVENT_OPCODE_START                  1
+#define EVENT_OPCODE_STOP                   2
+
+// TraceLogging field types
+#define TLG_IN_UNICODESTRING    1
+#define TLG_IN_INT32            7
+#define TLG_IN_INT64            9
+
+// the GUID of "SumatraPDF" as derived by EventSource/TraceLogging from the name
+static const GUID gProviderId = { 0x2c8cb327, 0x928d, 0x5ca4, { 0x6c, 0xc5, 0xce, 0xca, 0xaf, 0xe7, 0x1b, 0x6b } };
+// size (including the size field) followed by the provider's name
+// (including its terminating zero)
+static const char gProviderTraits[] = "\x0d\x00" "SumatraPDF";
+
+static Sig_EventUnregister gEventUnregister = nullptr;
+static Sig_EventWrite gEventWrite = nullptr;
+static ULONGLONG gRegHandle = 0;
+
+// updated by ETW whenever a session enables or disables the provider
+static volatile bool gEnabled = false;
+static volatile UCHAR gEnabledLevel = 0;
+static volatile ULONGLONG gMatchAnyKeyword = 0;
+static volatile ULONGLONG gMatchAllKeyword = 0;
+
+static void WINAPI OnEnable(LPCGUID sourceId, ULONG isEnabled, UCHAR level, ULONGLONG matchAnyKeyword,
+                            ULONGLONG matchAllKeyword, void *filterData, void *context)
+{
+    UNUSED(sourceId); UNUSED(filterData); UNUSED(context);
+    // 0 disables, 1 enables and 2 requests a capture state (which doesn't apply)
+    if (2 == isEnabled)
+        return;
+    gEnabledLevel = level;
+    gMatchAnyKeyword = matchAnyKeyword;
+    gMatchAllKeyword = matchAllKeyword;
+    gEnabled = isEnabled != 0;
+}
+
+void Register()
+{
+    if (gEventWrite)
+        return;
+    HMODULE h = LoadLibrary(L"advapi32.dll");
+    if (!h)
+        return;
+    Sig_EventRegister eventRegister = (Sig_EventRegister)GetProcAddress(h, "EventRegister");
+    Sig_EventSetInformation eventSetInformation = (Sig_EventSetInformation)GetProcAddress(h, "EventSetInformation");
+    gEventUnregister = (Sig_EventUnregister)GetProcAddress(h, "EventUnregister");
+    Sig_EventWrite eventWrite = (Sig_EventWrite)GetProcAddress(h, "EventWrite");
+    // not available before Windows Vista
+    if (!eventRegister || !gEventUnregister || !eventWrite)
+        return;
+    if (eventRegister(&gProviderId, OnEnable, nullptr, &gRegHandle) != ERROR_SUCCESS)
+        return;
+    // lets Windows 8 and later decode the events without scanning for channel 11
+    if (eventSetInformation)
+        eventSetInformation(gRegHandle, EVENT_PROVIDER_SET_TRAITS, (void *)gProviderTraits, sizeof(gProviderTraits));
+    gEventWrite = eventWrite;
+}
+
+void Unregister()
+{
+    if (!gEventWrite)
+        return;
+    gEnabled = false;
+    gEventWrite = nullptr;
+    gEventUnregister(gRegHandle);
+    gRegHandle = 0;
+}
+
+bool IsEnabled(Keyword kw)
+{
+    if (!gEnabled)
+        return false;
+    if (gEnabledLevel != 0 && gEnabledLevel < EVENT_LEVEL_VERBOSE)
+        return false;
+    if (0 == gMatchAnyKeyword)
+        return true;
+    return (kw & gMatchAnyKeyword) != 0 && (kw & gMatchAllKeyword) == gMatchAllKeyword;
+}
+
+static size_t AppendMeta(char *meta, size_t len, size_t maxLen, const char *s)
+{
+    size_t sLen = str::Len(s) + 1;
+    CrashIf(len + sLen > maxLen);
+    if (len + sLen > maxLen)
+        return len;
+    memcpy(meta + len, s, sLen);
+    return len + sLen;
+}
+
+static size_t AppendField(char *meta, size_t len, size_t maxLen, const char *name, BYTE type)
+{
+    len = AppendMeta(meta, len, maxLen, name);
+    if (len < maxLen)
+        meta[len++] = (char)type;
+    return len;
+}
+
+static void WriteEvent(const char *name, UCHAR opcode, Keyword kw, int pageNo, int64 size, const WCHAR *detail)
+{
+    Sig_EventWrite eventWrite = gEventWrite;
+    if (!eventWrite)
+        return;
+
+    // the event's metadata: total size, tags, the event's name
+    // and then the name and type of every field
+    char meta[128];
+    size_t len = 2;
+    meta[len++] = 0;
+    len = AppendMeta(meta, len, sizeof(meta), name);
+    len = AppendField(meta, len, sizeof(meta), "Page", TLG_IN_INT32);
+    len = AppendField(meta, len, sizeof(meta), "Size", TLG_IN_INT64);
+    len = AppendField(meta, len, sizeof(meta), "Detail", TLG_IN_UNICODESTRING);
+    meta[0] = (char)(len & 0xFF);
+    meta[1] = (char)(len >> 8);
+
+    if (!detail)
+        detail = L"";
+    EventDataDescriptor data[5];
+    data[0].ptr = (ULONGLONG)(UINT_PTR)gProviderTraits;
+    data[0].size = sizeof(gProviderTraits);
+    data[0].reserved = EVENT_DATA_TYPE_PROVIDER_METADATA;
+    data[1].ptr = (ULONGLONG)(UINT_PTR)meta;
+    data[1].size = (ULONG)len;
+    data[1].reserved = EVENT_DATA_TYPE_EVENT_METADATA;
+    data[2].ptr = (ULONGLONG)(UINT_PTR)&pageNo;
+    data[2].size = sizeof(pageNo);
+    data[2].reserved = 0;
+    data[3].ptr = (ULONGLONG)(UINT_PTR)&size;
+    data[3].size = sizeof(size);
+    data[3].reserved = 0;
+    data[4].ptr = (ULONGLONG)(UINT_PTR)detail;
+    data[4].size = (ULONG)((str::Len(detail) + 1) * sizeof(WCHAR));
+    data[4].reserved = 0;
+
+    EventDescriptor desc = { 0, 0, TRACELOGGING_CHANNEL, EVENT_LEVEL_VERBOSE, opcode, 0, (ULONGLONG)kw };
+    eventWrite(gRegHandle, &desc, dimof(data), data);
+}
+
+Span::Span(const char *name, Keyword kw, int pageNo, int64 size, const WCHAR *detail) :
+    name(name), kw(kw), pageNo(pageNo), size(size), enabled(IsEnabled(kw))
+{
+    if (enabled)
+        WriteEvent(name, EVENT_OPCODE_START, kw, pageNo, size, detail);
+}
+
+Span::~Span()
+{
+    if (enabled)
+        WriteEvent(name, EVENT_OPCODE_STOP, kw, pageNo, size, nullptr);
+}
+
+} // namespace etw
@@ -0,0 +1,57 @@
+/* Copyright 2015 the SumatraPDF project authors (see AUTHORS file).
+   License: Simplified BSD (see COPYING.BSD) */
+
+/* Low-overhead ETW tracing for profiling release builds with WPR/WPA.
+
+The events are self-describing (TraceLogging format) and are written by
+a provider named "SumatraPDF" (GUID 2c8cb327-928d-5ca4-6cc5-cecaafe71b6b,
+derived from the name), so e.g.
+
+  xperf -on PROC_THREAD+LOADER+DISK_IO -start sumatra -on 2c8cb327-928d-5ca4-6cc5-cecaafe71b6b
+  (reproduce the issue)
+  xperf -stop sumatra -stop -d sumatra.etl
+
+records them together with the system's CPU and disk events (the same
+works with a custom WPR profile). As long as no trace session has enabled
+the provider, creating an etw::Span costs a single check.
+
+Usage:
+
+  etw::Span span("RenderBitmap", etw::KeywordRender, pageNo);
+  ...
+  span.SetSize(bmpBytes);
+*/
+
+namespace etw {
+
+enum Keyword {
+    KeywordRender = 0x1,
+    KeywordLayout = 0x2,
+    KeywordSearch = 0x4,
+    KeywordIO     = 0x8,
+};
+
+// call once at startup and exit (tracing is a no-op without Register)
+void Register();
+void Unregister();
+
+bool IsEnabled(Keyword kw);
+
+// writes a Start event when created and a matching Stop event when destroyed;
+// pageNo (-1 if not applicable), size and detail are included as payload
+class Span {
+    const char *name;
+    Keyword kw;
+    int pageNo;
+    int64 size;
+    bool enabled;
+
+public:
+    Span(const char *name, Keyword kw, int pageNo=-1, int64 size=0, const WCHAR *detail=nullptr);
+    ~Span();
+
+    // changes the size reported with the Stop event (e.g. for a rendered bitmap)
+    void SetSize(int64 newSize) { size = newSize; }
+};
+
+} // namespace etw
@@ -53,6 +53,19 @@ bool FileTransaction::WriteAll(const WCHAR *filePath, const void *data, size_t d
     return ok && dataLen == (size_t)size;
 }
 
+bool FileTransaction::AppendAll(const WCHAR *filePath, const void *data, size_t dataLen)
+{
+    ScopedHandle hFile(CreateFile(filePath, FILE_APPEND_DATA, OPEN_EXISTING));
+    if (INVALID_HANDLE_VALUE == hFile)
+        return false;
+
+    DWORD size;
+    BOOL ok = WriteFile(hFile, data, (DWORD)dataLen, &size, nullptr);
+    assert(!ok || (dataLen == (size_t)size));
+
+    return ok && dataLen == (size_t)size;
+}
+
 bool FileTransaction::Delete(const WCHAR *filePath)
 {
     if (hTrans) {
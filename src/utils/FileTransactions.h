@@ -20,6 +20,8 @@ public:
     HANDLE CreateFile(const WCHAR *filePath, DWORD dwDesiredAccess, DWORD dwCreationDisposition);
     // same signatures as in FileUtil.h
     bool WriteAll(const WCHAR *filePath, const void *data, size_t dataLen);
+    // appends data to an existing file (fails if the file doesn't exist)
+    bool AppendAll(const WCHAR *filePath, const void *data, size_t dataLen);
     bool Delete(const WCHAR *filePath);
     bool SetModificationTime(const WCHAR *filePath, FILETIME lastMod);
 };
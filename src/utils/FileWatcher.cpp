@@ -30,17 +30,20 @@ worker thread so must be protected via g_threadCritSec.
 ReadDirectChangesW() doesn't always work for files on network drives,
 so for those files, we do manual checks, by using a timeout to
 periodically wake up thread.
+
+A single write can generate many notifications for the same file (e.g. a
+copy f2.pdf f.pdf generates 3 notifications if f2.pdf is 2 MB and build
+tools often write a PDF in many chunks), so we don't notify the observer
+right away. Instead a change marks the file as pending and we wait until
+the file has stayed unchanged (same size and modification time) for the
+file's debounce delay and can be opened without other writers before
+calling OnFileChanged() once. Further changes while pending restart the wait.
 */
 
 /*
 TODO:
   - should I end the thread when there are no files to watch?
 
-  - a single file copy can generate multiple notifications for the same
-    file. add some delay mechanism so that subsequent change notifications
-    cancel a previous, delayed one ? E.g. a copy f2.pdf f.pdf generates 3
-    notifications if f2.pdf is 2 MB.
-
   - try to handle short file names as well: http://blogs.msdn.com/b/ericgu/archive/2005/10/07/478396.aspx
     but how to test it?
 
@@ -51,6 +54,8 @@ TODO:
 
 // there's a balance between responsiveness to changes and efficiency
 #define FILEWATCH_DELAY_IN_MS       1000
+// notify anyway if a file keeps changing (or stays locked) for this long
+#define FILEWATCH_MAX_PENDING_IN_MS 10000
 
 // Some people use overlapped.hEvent to store data but I'm playing it safe.
 struct OverlappedEx {
@@ -83,6 +88,13 @@ struct WatchedFile {
     // file state for changes
     bool                    isManualCheck;
     FileState               fileState;
+
+    // a change has been seen but not yet reported to the observer
+    bool                    isPending;
+    DWORD                   pendingSince;
+    DWORD                   lastChangeTime;
+    FileState               pendingState;
+    DWORD                   debounceMs;
 };
 
 static HANDLE           g_threadHandle = 0;
@@ -99,6 +111,8 @@ static WatchedFile *    g_watchedFiles = nullptr;
 
 static LONG             gRemovalsPending = 0;
 
+static DWORD            gLastManualCheck = 0;
+
 static void StartMonitoringDirForChanges(WatchedDir *wd);
 
 static void AwakeWatcherThread()
@@ -138,14 +152,61 @@ static bool FileStateChanged(const WCHAR *filePath, FileState *fs)
     return true;
 }
 
+// returns false if another process still has the file open for writing
+static bool IsFileDoneWriting(const WCHAR *filePath)
+{
+    HANDLE h = CreateFile(filePath, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                          OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (INVALID_HANDLE_VALUE == h)
+        return false;
+    CloseHandle(h);
+    return true;
+}
+
+static void MarkFilePending(WatchedFile *wf)
+{
+    DWORD now = GetTickCount();
+    if (!wf->isPending) {
+        wf->isPending = true;
+        wf->pendingSince = now;
+    }
+    wf->lastChangeTime = now;
+    GetFileState(wf->filePath, &wf->pendingState);
+}
+
+// calls OnFileChanged() for pending files which have settled down
+static void NotifyAboutPendingFiles()
+{
+    ScopedCritSec cs(&g_threadCritSec);
+
+    DWORD now = GetTickCount();
+    for (WatchedFile *wf = g_watchedFiles; wf; wf = wf->next) {
+        if (!wf->isPending)
+            continue;
+        bool overdue = now - wf->pendingSince >= FILEWATCH_MAX_PENDING_IN_MS;
+        if (!overdue && now - wf->lastChangeTime < wf->debounceMs)
+            continue;
+        if (!overdue && FileStateChanged(wf->filePath, &wf->pendingState)) {
+            lf(L"NotifyAboutPendingFiles() %s is still changing", wf->filePath);
+            wf->lastChangeTime = now;
+            continue;
+        }
+        if (!overdue && !IsFileDoneWriting(wf->filePath)) {
+            lf(L"NotifyAboutPendingFiles() %s is still being written", wf->filePath);
+            wf->lastChangeTime = now;
+            continue;
+        }
+        wf->isPending = false;
+        if (wf->isManualCheck)
+            wf->fileState = wf->pendingState;
+        lf(L"NotifyAboutPendingFiles() %s changed", wf->filePath);
+        wf->observer->OnFileChanged();
+    }
+}
+
 // TODO: per internet, fileName could be short, 8.3 dos-style name
 // and we don't handle that. On the other hand, I've only seen references
 // to it wrt. to rename/delete operation, which we don't get notified about
-//
-// TODO: to collapse multiple notifications for the same file, could put it on a
-// queue, restart the thread with a timeout, restart the process if we
-// get notified again before timeout expires, call OnFileChanges() when
-// timeout expires
 static void NotifyAboutFile(WatchedDir *d, const WCHAR *fileName)
 {
     lf(L"NotifyAboutFile(): %s", fileName);
@@ -162,7 +223,7 @@ static void NotifyAboutFile(WatchedDir *d, const WCHAR *fileName)
         // because the time granularity is so big that this can cause genuine
         // file notifications to be ignored. (This happens for instance for
         // PDF files produced by pdftex from small.tex document)
-        wf->observer->OnFileChanged();
+        MarkFilePending(wf);
     }
 }
 
@@ -260,23 +321,38 @@ static void StartMonitoringDirForChanges(WatchedDir *wd)
 static DWORD GetTimeoutInMs()
 {
     ScopedCritSec cs(&g_threadCritSec);
+    DWORD timeout = INFINITE;
+    DWORD now = GetTickCount();
     for (WatchedFile *wf = g_watchedFiles; wf; wf = wf->next) {
-        if (wf->isManualCheck)
-            return FILEWATCH_DELAY_IN_MS;
+        if (wf->isManualCheck) {
+            DWORD elapsed = now - gLastManualCheck;
+            timeout = std::min(timeout, elapsed < FILEWATCH_DELAY_IN_MS ? FILEWATCH_DELAY_IN_MS - elapsed : 0);
+        }
+        if (wf->isPending) {
+            DWORD elapsed = now - wf->lastChangeTime;
+            timeout = std::min(timeout, elapsed < wf->debounceMs ? wf->debounceMs - elapsed : 0);
+            elapsed = now - wf->pendingSince;
+            timeout = std::min(timeout, elapsed < FILEWATCH_MAX_PENDING_IN_MS ? FILEWATCH_MAX_PENDING_IN_MS - elapsed : 0);
+        }
     }
-    return INFINITE;
+    return timeout;
 }
 
 static void RunManualCheck()
 {
     ScopedCritSec cs(&g_threadCritSec);
 
+    DWORD now = GetTickCount();
+    if (now - gLastManualCheck < FILEWATCH_DELAY_IN_MS)
+        return;
+    gLastManualCheck = now;
+
     for (WatchedFile *wf = g_watchedFiles; wf; wf = wf->next) {
-        if (!wf->isManualCheck)
+        if (!wf->isManualCheck || wf->isPending)
             continue;
         if (FileStateChanged(wf->filePath, &wf->fileState)) {
             lf(L"RunManualCheck() %s changed", wf->filePath);
-            wf->observer->OnFileChanged();
+            MarkFilePending(wf);
         }
     }
 }
@@ -294,11 +370,13 @@ static DWORD WINAPI FileWatcherThread(void *param)
         DWORD obj = WaitForMultipleObjectsEx(1, handles, FALSE, timeout, alertable);
         if (WAIT_TIMEOUT == obj) {
             RunManualCheck();
+            NotifyAboutPendingFiles();
             continue;
         }
 
         if (WAIT_IO_COMPLETION == obj) {
-            // APC complete. Nothing to do
+            // APC complete. Pending notifications are handled once
+            // the wait times out
             lf("FileWatcherThread(): APC complete");
             continue;
         }
@@ -369,7 +447,7 @@ static WatchedDir *NewWatchedDir(const WCHAR *dirPath)
     return wd;
 }
 
-static WatchedFile *NewWatchedFile(const WCHAR *filePath, FileChangeObserver *observer)
+static WatchedFile *NewWatchedFile(const WCHAR *filePath, FileChangeObserver *observer, int debounceMs)
 {
     bool isManualCheck = PathIsNetworkPath(filePath);
     ScopedMem<WCHAR> dirPath(path::GetDir(filePath));
@@ -390,6 +468,7 @@ static WatchedFile *NewWatchedFile(const WCHAR *filePath, FileChangeObserver *ob
     wf->observer = observer;
     wf->watchedDir = wd;
     wf->isManualCheck = isManualCheck;
+    wf->debounceMs = (DWORD)std::max(debounceMs, 0);
 
     ListInsert(&g_watchedFiles, wf);
 
@@ -412,14 +491,14 @@ static void DeleteWatchedFile(WatchedFile *wf)
 }
 
 /* Subscribe for notifications about file changes. When a file changes, we'll
-call observer->OnFileChanged().
+call observer->OnFileChanged() once it hasn't changed for debounceMs.
 
 We take ownership of observer object.
 
 Returns a cancellation token that can be used in FileWatcherUnsubscribe(). That
 way we can support multiple callers subscribing to the same file.
 */
-WatchedFile *FileWatcherSubscribe(const WCHAR *path, FileChangeObserver *observer)
+WatchedFile *FileWatcherSubscribe(const WCHAR *path, FileChangeObserver *observer, int debounceMs)
 {
     CrashIf(!observer);
 
@@ -433,7 +512,7 @@ WatchedFile *FileWatcherSubscribe(const WCHAR *path, FileChangeObserver *observe
     StartThreadIfNecessary();
 
     ScopedCritSec cs(&g_threadCritSec);
-    return NewWatchedFile(path, observer);
+    return NewWatchedFile(path, observer, debounceMs);
 }
 
 static bool IsWatchedDirReferenced(WatchedDir *wd)
@@ -9,6 +9,9 @@ public:
 
 struct WatchedFile;
 
-WatchedFile *FileWatcherSubscribe(const WCHAR *path, FileChangeObserver *observer);
+#define FILEWATCH_DEFAULT_DEBOUNCE_IN_MS 500
+
+WatchedFile *FileWatcherSubscribe(const WCHAR *path, FileChangeObserver *observer,
+                                  int debounceMs=FILEWATCH_DEFAULT_DEBOUNCE_IN_MS);
 void         FileWatcherUnsubscribe(WatchedFile *wf);
 void         FileWatcherWaitForShutdown();
@@ -18,7 +18,7 @@ using namespace Gdiplus;
 
 namespace fitz {
 
-static Bitmap *ImageFromJpegData(fz_context *ctx, const char *data, int len)
+static Bitmap *ImageFromJpegData(fz_context *ctx, const char *data, int len, int l2factor)
 {
     int w = 0, h = 0, xres = 0, yres = 0;
     fz_colorspace *cs = nullptr;
@@ -30,7 +30,12 @@ static Bitmap *ImageFromJpegData(fz_context *ctx, const char *data, int len)
     fz_try(ctx) {
         fz_load_jpeg_info(ctx, (unsigned char *)data, len, &w, &h, &xres, &yres, &cs);
         stm = fz_open_memory(ctx, (unsigned char *)data, len);
-        stm = fz_open_dctd(stm, -1, 0, nullptr);
+        stm = fz_open_dctd(stm, -1, l2factor, nullptr);
+        // libjpeg rounds the size of scaled images up
+        w = (w + (1 << l2factor) - 1) >> l2factor;
+        h = (h + (1 << l2factor) - 1) >> l2factor;
+        xres >>= l2factor;
+        yres >>= l2factor;
     }
     fz_catch(ctx) {
         fz_drop_colorspace(ctx, cs);
@@ -98,7 +103,7 @@ static Bitmap *ImageFromJpegData(fz_context *ctx, const char *data, int len)
     return bmp.Clone(0, 0, w, h, fmt);
 }
 
-static Bitmap *ImageFromJp2Data(fz_context *ctx, const char *data, int len)
+static Bitmap *ImageFromJp2Data(fz_context *ctx, const char *data, int len, int l2factor)
 {
     fz_pixmap *pix = nullptr;
     fz_pixmap *pix_argb = nullptr;
@@ -107,7 +112,7 @@ static Bitmap *ImageFromJp2Data(fz_context *ctx, const char *data, int len)
     fz_var(pix_argb);
 
     fz_try(ctx) {
-        pix = fz_load_jpx(ctx, (unsigned char *)data, len, nullptr, 0);
+        pix = fz_load_jpx_reduced(ctx, (unsigned char *)data, len, nullptr, 0, l2factor);
     }
     fz_catch(ctx) {
         return nullptr;
@@ -145,10 +150,12 @@ static Bitmap *ImageFromJp2Data(fz_context *ctx, const char *data, int len)
     return bmp.Clone(0, 0, w, h, PixelFormat32bppARGB);
 }
 
-Bitmap *ImageFromData(const char *data, size_t len)
+Bitmap *ImageFromData(const char *data, size_t len, int l2factor)
 {
     if (len > INT_MAX || len < 12)
         return nullptr;
+    // libjpeg can only scale down to 1/8
+    l2factor = limitValue(l2factor, 0, 3);
 
     fz_context *ctx = fz_new_context(nullptr, nullptr, 0);
     if (!ctx)
@@ -156,9 +163,9 @@ Bitmap *ImageFromData(const char *data, size_t len)
 
     Bitmap *result = nullptr;
     if (str::StartsWith(data, "\xFF\xD8"))
-        result = ImageFromJpegData(ctx, data, (int)len);
+        result = ImageFromJpegData(ctx, data, (int)len, l2factor);
     else if (memeq(data, "\0\0\0\x0CjP  \x0D\x0A\x87\x0A", 12))
-        result = ImageFromJp2Data(ctx, data, (int)len);
+        result = ImageFromJp2Data(ctx, data, (int)len, l2factor);
 
     fz_free_context(ctx);
 
@@ -170,7 +177,7 @@ Bitmap *ImageFromData(const char *data, size_t len)
 #else
 
 namespace fitz {
-    Gdiplus::Bitmap *ImageFromData(const char *data, size_t len) { UNUSED(data); UNUSED(len); return nullptr; }
+    Gdiplus::Bitmap *ImageFromData(const char *data, size_t len, int l2factor) { UNUSED(data); UNUSED(len); UNUSED(l2factor); return nullptr; }
 }
 
 #endif
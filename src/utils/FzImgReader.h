@@ -3,6 +3,7 @@
 
 namespace fitz {
 
-Gdiplus::Bitmap *ImageFromData(const char *data, size_t len);
+// JPEG and JPEG 2000 images can be decoded at 1/2^l2factor of their size (up to 1/8)
+Gdiplus::Bitmap *ImageFromData(const char *data, size_t len, int l2factor=0);
 
 }
@@ -364,8 +364,60 @@ Bitmap *BitmapFromData(const char *data, size_t len)
     return bmp;
 }
 
+// decodes JPEG images at 1/2^l2factor of their size (up to 1/8) and updates
+// l2factor to the reduction actually applied (i.e. 0 for all other formats)
+Bitmap *ScaledBitmapFromData(const char *data, size_t len, int& l2factor)
+{
+    if (l2factor > 0 && Img_JPEG == GfxFormatFromData(data, len)) {
+        l2factor = std::min(l2factor, 3);
+        Bitmap *bmp = fitz::ImageFromData(data, len, l2factor);
+        if (bmp)
+            return bmp;
+    }
+    l2factor = 0;
+    return BitmapFromData(data, len);
+}
+
+// decodes an image scaled down to fit into a size x size square (JPEG images
+// are already decoded at a reduced size, if possible); returns nullptr if the
+// image is smaller than that, as it would look blurry when scaled up
+Bitmap *ThumbnailFromData(const char *data, size_t len, int size)
+{
+    Size imgSize = BitmapSizeFromHeader(data, len);
+    if (imgSize.Width <= 0 || imgSize.Height <= 0)
+        imgSize = BitmapSizeFromData(data, len);
+    if (size <= 0 || std::max(imgSize.Width, imgSize.Height) < size)
+        return nullptr;
+
+    int l2factor = 0;
+    while (std::max(imgSize.Width, imgSize.Height) >> (l2factor + 1) >= size)
+        l2factor++;
+    Bitmap *bmp = ScaledBitmapFromData(data, len, l2factor);
+    if (!bmp)
+        return nullptr;
+
+    float zoom = std::min(size / (float)imgSize.Width, size / (float)imgSize.Height);
+    int dx = std::max((int)(imgSize.Width * zoom + 0.5f), 1);
+    int dy = std::max((int)(imgSize.Height * zoom + 0.5f), 1);
+    Bitmap *thumb = new Bitmap(dx, dy, PixelFormat24bppRGB);
+    Graphics g(thumb);
+    // transparent images are shown on white (as pages are)
+    g.Clear(Color::White);
+    g.SetInterpolationMode(InterpolationModeHighQualityBicubic);
+    g.SetPixelOffsetMode(PixelOffsetModeHalf);
+    Status ok = g.DrawImage(bmp, Rect(0, 0, dx, dy), 0, 0, bmp->GetWidth(), bmp->GetHeight(), UnitPixel);
+    delete bmp;
+    if (ok != Ok) {
+        delete thumb;
+        return nullptr;
+    }
+    return thumb;
+}
+
 // adapted from http://cpansearch.perl.org/src/RJRAY/Image-Size-3.230/lib/Image/Size.pm
-Size BitmapSizeFromData(const char *data, size_t len)
+// determines an image's size from its header only (so that data may be
+// just the beginning of an image file); returns an empty size on failure
+Size BitmapSizeFromHeader(const char *data, size_t len)
 {
     Size result;
     ByteReader r(data, len);
@@ -496,6 +548,12 @@ Size BitmapSizeFromData(const char *data, size_t len)
         break;
     }
 
+    return result;
+}
+
+Size BitmapSizeFromData(const char *data, size_t len)
+{
+    Size result = BitmapSizeFromHeader(data, len);
     if (result.Empty()) {
         // let GDI+ extract the image size if we've failed
         // (currently happens for animated GIF)
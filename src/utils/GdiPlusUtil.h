@@ -22,5 +22,8 @@ void     GetBaseTransform(Matrix& m, RectF pageRect, float zoom, int rotation);
 const WCHAR * GfxFileExtFromData(const char *data, size_t len);
 bool          IsGdiPlusNativeFormat(const char *data, size_t len);
 Bitmap *      BitmapFromData(const char *data, size_t len);
+Bitmap *      ScaledBitmapFromData(const char *data, size_t len, int& l2factor);
+Bitmap *      ThumbnailFromData(const char *data, size_t len, int size);
+Size          BitmapSizeFromHeader(const char *data, size_t len);
 Size          BitmapSizeFromData(const char *data, size_t len);
 CLSID         GetEncoderClsid(const WCHAR *format);
@@ -193,6 +193,108 @@ bool IsInlineTag(HtmlTag item)
     }
 }
 
+HtmlAttrId FindHtmlAttr(const char *name, size_t len)
+{
+    uint32_t key = 0 == len ? 0 : 1 == len ? STR1i(name) :
+                   2 == len ? STR2i(name) : 3 == len ? STR3i(name) : STR4i(name);
+    switch (key) {
+    case CS4('a','l','i','g'):
+        if (5 == len && CS1('n') == STR1i(name + 4)) return Attr_Align;
+        break;
+    case CS3('a','l','t'): return Attr_Alt;
+    case CS4('b','g','c','o'):
+        if (7 == len && CS3('l','o','r') == STR3i(name + 4)) return Attr_Bgcolor;
+        break;
+    case CS4('b','o','r','d'):
+        if (6 == len && CS2('e','r') == STR2i(name + 4)) return Attr_Border;
+        break;
+    case CS4('c','l','a','s'):
+        if (5 == len && CS1('s') == STR1i(name + 4)) return Attr_Class;
+        break;
+    case CS4('c','l','e','a'):
+        if (5 == len && CS1('r') == STR1i(name + 4)) return Attr_Clear;
+        break;
+    case CS4('c','o','l','o'):
+        if (5 == len && CS1('r') == STR1i(name + 4)) return Attr_Color;
+        break;
+    case CS4('c','o','l','s'):
+        if (7 == len && CS3('p','a','n') == STR3i(name + 4)) return Attr_Colspan;
+        break;
+    case CS4('c','o','n','t'):
+        if (7 == len && CS3('e','n','t') == STR3i(name + 4)) return Attr_Content;
+        if (8 == len && CS4('r','o','l','s') == STR4i(name + 4)) return Attr_Controls;
+        break;
+    case CS3('d','i','r'): return Attr_Dir;
+    case CS4('f','a','c','e'):
+        if (4 == len) return Attr_Face;
+        break;
+    case CS4('f','i','l','e'):
+        if (7 == len && CS3('p','o','s') == STR3i(name + 4)) return Attr_Filepos;
+        break;
+    case CS4('h','e','i','g'):
+        if (6 == len && CS2('h','t') == STR2i(name + 4)) return Attr_Height;
+        break;
+    case CS4('h','i','d','d'):
+        if (6 == len && CS2('e','n') == STR2i(name + 4)) return Attr_Hidden;
+        break;
+    case CS4('h','r','e','f'):
+        if (4 == len) return Attr_Href;
+        break;
+    case CS4('h','t','t','p'):
+        if (10 == len && str::EqNI(name + 4, "-equiv", 6)) return Attr_Http_Equiv;
+        break;
+    case CS2('i','d'): return Attr_Id;
+    case CS4('l','a','n','g'):
+        if (4 == len) return Attr_Lang;
+        break;
+    case CS4('l','i','n','k'):
+        if (4 == len) return Attr_Link;
+        break;
+    case CS4('m','e','d','i'):
+        if (13 == len && str::EqNI(name + 4, "arecindex", 9)) return Attr_Mediarecindex;
+        break;
+    case CS4('n','a','m','e'):
+        if (4 == len) return Attr_Name;
+        break;
+    case CS4('r','e','c','i'):
+        if (8 == len && CS4('n','d','e','x') == STR4i(name + 4)) return Attr_Recindex;
+        break;
+    case CS3('r','e','l'): return Attr_Rel;
+    case CS4('r','o','w','s'):
+        if (7 == len && CS3('p','a','n') == STR3i(name + 4)) return Attr_Rowspan;
+        break;
+    case CS4('s','i','z','e'):
+        if (4 == len) return Attr_Size;
+        break;
+    case CS3('s','r','c'): return Attr_Src;
+    case CS4('s','t','y','l'):
+        if (5 == len && CS1('e') == STR1i(name + 4)) return Attr_Style;
+        break;
+    case CS4('t','i','t','l'):
+        if (5 == len && CS1('e') == STR1i(name + 4)) return Attr_Title;
+        break;
+    case CS4('t','y','p','e'):
+        if (4 == len) return Attr_Type;
+        break;
+    case CS4('v','a','l','i'):
+        if (6 == len && CS2('g','n') == STR2i(name + 4)) return Attr_Valign;
+        break;
+    case CS4('v','a','l','u'):
+        if (5 == len && CS1('e') == STR1i(name + 4)) return Attr_Value;
+        break;
+    case CS4('v','l','i','n'):
+        if (5 == len && CS1('k') == STR1i(name + 4)) return Attr_Vlink;
+        break;
+    case CS4('w','i','d','t'):
+        if (5 == len && CS1('h') == STR1i(name + 4)) return Attr_Width;
+        break;
+    case CS4('x','m','l','n'):
+        if (5 == len && CS1('s') == STR1i(name + 4)) return Attr_Xmlns;
+        break;
+    }
+    return Attr_NotFound;
+}
+
 AlignAttr FindAlignAttr(const char *name, size_t len)
 {
     uint32_t key = 0 == len ? 0 : 1 == len ? STR1i(name) :
@@ -20,6 +20,17 @@ enum HtmlTag {
     Tag_U, Tag_Ul, Tag_Video, Tag_NotFound
 };
 
+enum HtmlAttrId {
+    Attr_Align, Attr_Alt, Attr_Bgcolor, Attr_Border, Attr_Class,
+    Attr_Clear, Attr_Color, Attr_Colspan, Attr_Content, Attr_Controls,
+    Attr_Dir, Attr_Face, Attr_Filepos, Attr_Height, Attr_Hidden,
+    Attr_Href, Attr_Http_Equiv, Attr_Id, Attr_Lang, Attr_Link,
+    Attr_Mediarecindex, Attr_Name, Attr_Recindex, Attr_Rel, Attr_Rowspan,
+    Attr_Size, Attr_Src, Attr_Style, Attr_Title, Attr_Type,
+    Attr_Valign, Attr_Value, Attr_Vlink, Attr_Width, Attr_Xmlns,
+    Attr_NotFound
+};
+
 enum AlignAttr {
     Align_Center, Align_Justify, Align_Left, Align_Right, Align_NotFound
 };
@@ -27,6 +38,7 @@ enum AlignAttr {
 HtmlTag         FindHtmlTag(const char *name, size_t len);
 bool            IsTagSelfClosing(HtmlTag item);
 bool            IsInlineTag(HtmlTag item);
+HtmlAttrId      FindHtmlAttr(const char *name, size_t len);
 AlignAttr       FindAlignAttr(const char *name, size_t len);
 uint32_t        FindHtmlEntityRune(const char *name, size_t len);
 
@@ -2,6 +2,7 @@
    License: Simplified BSD (see COPYING.BSD) */
 
 #include "BaseUtil.h"
+#include <emmintrin.h>
 #include "HtmlParserLookup.h"
 #include "HtmlPullParser.h"
 
@@ -31,11 +32,60 @@ int HtmlEntityNameToRune(const WCHAR *name, size_t nameLen)
     return FindHtmlEntityRune(asciiName, nameLen);
 }
 
-bool SkipUntil(const char*& s, const char *end, char c)
+// returns the first occurrence of c in [s, end) or end,
+// comparing 16 chars at a time where SSE2 is available
+static const char *FindCharInRange(const char *s, const char *end, char c)
 {
+    if (HasSSE2()) {
+        __m128i needle = _mm_set1_epi8(c);
+        for (; s + 16 <= end; s += 16) {
+            __m128i chunk = _mm_loadu_si128((const __m128i *)s);
+            int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+            if (mask != 0) {
+                unsigned long idx;
+                _BitScanForward(&idx, mask);
+                return s + idx;
+            }
+        }
+    }
     while ((s < end) && (*s != c)) {
         ++s;
     }
+    return s;
+}
+
+// returns the first non-whitespace character in [s, end) or end
+// (cf. str::IsWs), checking 16 chars at a time where SSE2 is available
+static const char *FindNonWsInRange(const char *s, const char *end)
+{
+    // whitespace runs are mostly short, so don't bother for a single character
+    if (HasSSE2() && s + 1 < end && str::IsWs(s[1])) {
+        __m128i space = _mm_set1_epi8(' ');
+        __m128i tab = _mm_set1_epi8('\t');
+        __m128i range = _mm_set1_epi8('\r' - '\t');
+        for (; s + 16 <= end; s += 16) {
+            __m128i chunk = _mm_loadu_si128((const __m128i *)s);
+            // '\t' <= c && c <= '\r' if (unsigned)(c - '\t') <= '\r' - '\t'
+            __m128i offset = _mm_sub_epi8(chunk, tab);
+            __m128i isCtrlWs = _mm_cmpeq_epi8(_mm_min_epu8(offset, range), offset);
+            __m128i isWs = _mm_or_si128(_mm_cmpeq_epi8(chunk, space), isCtrlWs);
+            int mask = ~_mm_movemask_epi8(isWs) & 0xFFFF;
+            if (mask != 0) {
+                unsigned long idx;
+                _BitScanForward(&idx, mask);
+                return s + idx;
+            }
+        }
+    }
+    while ((s < end) && str::IsWs(*s)) {
+        ++s;
+    }
+    return s;
+}
+
+bool SkipUntil(const char*& s, const char *end, char c)
+{
+    s = FindCharInRange(s, end, c);
     return *s == c;
 }
 
@@ -53,9 +103,7 @@ bool SkipUntil(const char*& s, const char *end, char *term)
 bool SkipWs(const char* & s, const char *end)
 {
     const char *start = s;
-    while ((s < end) && str::IsWs(*s)) {
-        ++s;
-    }
+    s = FindNonWsInRange(s, end);
     return start != s;
 }
 
@@ -219,6 +267,7 @@ void HtmlToken::SetTag(TokenType new_type, const char *new_s, const char *end)
     nLen = new_s - s;
     tag = FindHtmlTag(s, nLen);
     nextAttr = nullptr;
+    attrsDecoded = false;
 }
 
 void HtmlToken::SetText(const char *new_s, const char *end)
@@ -285,6 +334,32 @@ AttrInfo *HtmlToken::GetAttrByNameNS(const char *name, const char *attrNS)
     return nullptr;
 }
 
+AttrInfo *HtmlToken::GetAttr(HtmlAttrId attr)
+{
+    CrashIf(attr >= Attr_NotFound);
+    if (!attrsDecoded)
+        DecodeAttrs();
+    if (!attrIdx[attr])
+        return nullptr;
+    return &attrs[attrIdx[attr] - 1];
+}
+
+void HtmlToken::DecodeAttrs()
+{
+    memset(attrIdx, 0, sizeof(attrIdx));
+    uint8_t count = 0;
+    nextAttr = nullptr; // start from the beginning
+    for (AttrInfo *a = NextAttr(); a; a = NextAttr()) {
+        HtmlAttrId attr = FindHtmlAttr(a->name, a->nameLen);
+        // like GetAttrByName, only consider the first occurrence
+        if (Attr_NotFound == attr || attrIdx[attr] != 0)
+            continue;
+        attrs[count++] = *a;
+        attrIdx[attr] = count;
+    }
+    attrsDecoded = true;
+}
+
 // We expect:
 // whitespace | attribute name | = | attribute value
 // where attribute value can be quoted
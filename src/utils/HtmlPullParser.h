@@ -32,6 +32,8 @@ struct HtmlToken {
         InvalidTag
     };
 
+    HtmlToken() : s(nullptr), sLen(0), nLen(0), nextAttr(nullptr), attrsDecoded(false) { }
+
     bool IsStartTag() const { return type == StartTag; }
     bool IsEndTag() const { return type == EndTag; }
     bool IsEmptyElementEndTag() const { return type == EmptyElementTag; }
@@ -57,11 +59,22 @@ struct HtmlToken {
     bool             NameIsNS(const char *name, const char *ns) const;
     AttrInfo *       GetAttrByName(const char *name);
     AttrInfo *       GetAttrByNameNS(const char *name, const char *attrNS);
+    // for attributes known to HtmlParserLookup: all of a tag's attributes are
+    // decoded the first time this is called, afterwards lookups are O(1)
+    // (the result remains valid until the next token)
+    AttrInfo *       GetAttr(HtmlAttrId attr);
 
 protected:
     AttrInfo *       NextAttr();
+    void             DecodeAttrs();
     const char *     nextAttr;
     AttrInfo         attrInfo;
+
+    // for GetAttr: the first occurrence of every known attribute and
+    // for each HtmlAttrId its index + 1 into attrs (or 0 if it's missing)
+    bool             attrsDecoded;
+    AttrInfo         attrs[Attr_NotFound];
+    uint8_t          attrIdx[Attr_NotFound];
 };
 
 /* A very simple pull html parser. Call Next() to get the next HtmlToken,
@@ -83,6 +96,9 @@ public:
     void         SetCurrPosOff(ptrdiff_t off) { currPos = start + off; }
     size_t       Len()   const { return len;   }
     const char * Start() const { return start; }
+    const char * CurrPos() const { return currPos; }
+    // for sources which grow in place (s must remain valid)
+    void         SetLen(size_t newLen) { len = newLen; end = start + newLen; }
 
     HtmlToken *  Next();
 };
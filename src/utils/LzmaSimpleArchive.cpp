@@ -182,6 +182,19 @@ int GetIdxFromName(SimpleArchive *archive, const char *fileName)
     return -1;
 }
 
+bool DecompressFileByIdx(SimpleArchive *archive, int idx, char *dst, Allocator *allocator)
+{
+    if (idx < 0 || idx >= archive->filesCount)
+        return false;
+
+    FileInfo *fi = &archive->files[idx];
+    if (!Decompress(fi->compressedData, fi->compressedSize, dst, fi->uncompressedSize, allocator))
+        return false;
+
+    uint32_t realCrc = crc32(0, (const uint8_t *)dst, fi->uncompressedSize);
+    return realCrc == fi->uncompressedCrc32;
+}
+
 char *GetFileDataByIdx(SimpleArchive *archive, int idx, Allocator *allocator)
 {
     if (idx >= archive->filesCount)
@@ -193,14 +206,7 @@ char *GetFileDataByIdx(SimpleArchive *archive, int idx, Allocator *allocator)
     if (!uncompressed)
         return nullptr;
 
-    bool ok = Decompress(fi->compressedData, fi->compressedSize, uncompressed, fi->uncompressedSize, allocator);
-    if (!ok) {
-        Allocator::Free(allocator, uncompressed);
-        return nullptr;
-    }
-
-    uint32_t realCrc = crc32(0, (const uint8_t *)uncompressed, fi->uncompressedSize);
-    if (realCrc != fi->uncompressedCrc32) {
+    if (!DecompressFileByIdx(archive, idx, uncompressed, allocator)) {
         Allocator::Free(allocator, uncompressed);
         return nullptr;
     }
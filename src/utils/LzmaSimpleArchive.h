@@ -24,6 +24,9 @@ struct SimpleArchive {
 bool   ParseSimpleArchive(const char *archiveHeader, size_t dataLen, SimpleArchive *archiveOut);
 int    GetIdxFromName(SimpleArchive *archive, const char *name);
 char * GetFileDataByIdx(SimpleArchive *archive, int idx, Allocator *allocator);
+// decompresses a file into dst (which must hold uncompressedSize bytes, e.g. a
+// mapped view of the destination file) and verifies its checksum
+bool   DecompressFileByIdx(SimpleArchive *archive, int idx, char *dst, Allocator *allocator=nullptr);
 char * GetFileDataByName(SimpleArchive *archive, const char *fileName, Allocator *allocator);
 // files is an array of char * entries, last element must be nullptr
 bool   ExtractFiles(const char *archivePath, const char *dstDir, const char **files, Allocator *allocator=nullptr);
@@ -12,6 +12,19 @@ public:
     ScopedMem() : ptr(nullptr) {}
     explicit ScopedMem(T* ptr) : ptr(ptr) {}
     ~ScopedMem() { free(ptr); }
+    // ownership can be passed on (e.g. when returning or collecting
+    // strings) but never shared
+    ScopedMem(ScopedMem&& other) : ptr(other.ptr) { other.ptr = nullptr; }
+    ScopedMem& operator=(ScopedMem&& other) {
+        if (this != &other) {
+            free(ptr);
+            ptr = other.ptr;
+            other.ptr = nullptr;
+        }
+        return *this;
+    }
+    ScopedMem(const ScopedMem&) = delete;
+    ScopedMem& operator=(const ScopedMem&) = delete;
     void Set(T *newPtr) {
         free(ptr);
         ptr = newPtr;
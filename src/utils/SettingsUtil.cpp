@@ -451,17 +451,37 @@ static void SerializeStructRec(str::Str<char>& out, const StructInfo *info, cons
     SerializeUnknownFields(out, prevNode, indent);
 }
 
+// fields are usually stored in the order in which they're declared, so
+// instead of always looking through all items, start after the ones that
+// have already been matched in sequence (and thus belong to other fields)
+static SquareTreeNode::DataItem *FindDataItem(SquareTreeNode *node, const char *key, bool isChild, size_t *matchedIdx)
+{
+    if (!node)
+        return nullptr;
+    for (size_t i = *matchedIdx; i < node->data.Count(); i++) {
+        SquareTreeNode::DataItem& item = node->data.At(i);
+        if (item.isChild == isChild && str::EqI(key, item.key)) {
+            if (i == *matchedIdx)
+                (*matchedIdx)++;
+            return &item;
+        }
+    }
+    return nullptr;
+}
+
 static void *DeserializeStructRec(const StructInfo *info, SquareTreeNode *node, uint8_t *base, bool useDefaults)
 {
     if (!base)
         base = AllocArray<uint8_t>(info->structSize);
 
+    size_t matchedIdx = 0;
     const char *fieldName = info->fieldNames;
     for (size_t i = 0; i < info->fieldCount; i++, fieldName += str::Len(fieldName) + 1) {
         const FieldInfo& field = info->fields[i];
         uint8_t *fieldPtr = base + field.offset;
         if (Type_Struct == field.type || Type_Prerelease == field.type) {
-            SquareTreeNode *child = node ? node->GetChild(fieldName) : nullptr;
+            SquareTreeNode::DataItem *item = FindDataItem(node, fieldName, true, &matchedIdx);
+            SquareTreeNode *child = item ? item->value.child : nullptr;
 #if !(defined(SVN_PRE_RELEASE_VER) || defined(DEBUG))
             if (Type_Prerelease == field.type)
                 child = nullptr;
@@ -469,6 +489,12 @@ static void *DeserializeStructRec(const StructInfo *info, SquareTreeNode *node,
             DeserializeStructRec(GetSubstruct(field), child, fieldPtr, useDefaults);
         }
         else if (Type_Array == field.type) {
+            // skip all the array's items for the following fields
+            for (; node && matchedIdx < node->data.Count(); matchedIdx++) {
+                SquareTreeNode::DataItem& item = node->data.At(matchedIdx);
+                if (!item.isChild || !str::EqI(fieldName, item.key))
+                    break;
+            }
             SquareTreeNode *parent = node, *child = nullptr;
             if (parent && (child = parent->GetChild(fieldName)) != nullptr &&
                 (0 == child->data.Count() || child->GetChild(""))) {
@@ -486,7 +512,8 @@ static void *DeserializeStructRec(const StructInfo *info, SquareTreeNode *node,
             }
         }
         else if (field.type != Type_Comment) {
-            const char *value = node ? node->GetValue(fieldName) : nullptr;
+            SquareTreeNode::DataItem *item = FindDataItem(node, fieldName, false, &matchedIdx);
+            const char *value = item ? item->value.str : nullptr;
             if (useDefaults || value)
                 DeserializeField(field, base, value);
         }
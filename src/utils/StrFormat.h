@@ -33,6 +33,14 @@ You can mix % and {} directives but beware, as the rule for assigning argument
 number to % directive is simple (n-th argument position for n-th % directive)
 but it's easy to mis-count when adding {} to the mix.
 
+fmt::Buf is for hot paths (per-page or per-frame formatting, logging): it appends
+values to a fixed-size buffer that lives on the stack, so it never allocates.
+There's no format string, so the type of each value is checked by the compiler.
+Output that doesn't fit is truncated (check IsTruncated() if that matters):
+fmt::Buf<WCHAR, 32> txt;
+txt.s(L" (").i(pageNo).s(L" / ").i(pageCount).c(')');
+SetWindowText(hwnd, txt.Get());
+
 */
 
 namespace fmt {
@@ -116,4 +124,80 @@ class Fmt {
     int currArgFromFormatNo; // counts from the end of args
     str::Str<char> res;
 };
+
+template <typename T, size_t N>
+class Buf {
+    T buf[N];
+    size_t len;
+    bool truncated;
+
+  public:
+    Buf() { Reset(); }
+
+    Buf &Reset() {
+        len = 0;
+        truncated = false;
+        buf[0] = 0;
+        return *this;
+    }
+
+    Buf &c(T c) {
+        if (len + 1 < N) {
+            buf[len++] = c;
+            buf[len] = 0;
+        } else {
+            truncated = true;
+        }
+        return *this;
+    }
+
+    Buf &s(const T *s, size_t sLen = (size_t)-1) {
+        if (!s)
+            return *this;
+        if ((size_t)-1 == sLen)
+            sLen = str::Len(s);
+        if (sLen > N - 1 - len) {
+            sLen = N - 1 - len;
+            truncated = true;
+        }
+        memcpy(buf + len, s, sLen * sizeof(T));
+        len += sLen;
+        buf[len] = 0;
+        return *this;
+    }
+
+    // minDigits pads with leading zeros
+    Buf &u(uint64 n, int minDigits = 0) { return Digits(n, 10, minDigits); }
+    Buf &hex(uint64 n, int minDigits = 0) { return Digits(n, 16, minDigits); }
+
+    Buf &i(int64 n, int minDigits = 0) {
+        if (n >= 0)
+            return u((uint64)n, minDigits);
+        c('-');
+        // negate as unsigned so that INT64_MIN works as well
+        return u(0 - (uint64)n, minDigits);
+    }
+
+    const T *Get() const { return buf; }
+    operator const T *() const { return buf; }
+    size_t Len() const { return len; }
+    bool IsTruncated() const { return truncated; }
+
+  private:
+    Buf &Digits(uint64 n, unsigned base, int minDigits) {
+        T digits[64];
+        int count = 0;
+        do {
+            digits[count++] = (T) "0123456789abcdef"[n % base];
+            n /= base;
+        } while (n != 0 && count < (int)dimof(digits));
+        while (count < minDigits && count < (int)dimof(digits)) {
+            digits[count++] = '0';
+        }
+        while (count > 0) {
+            c(digits[--count]);
+        }
+        return *this;
+    }
+};
 }
@@ -3,6 +3,7 @@
 
 /* The most basic things, including string handling functions */
 #include "BaseUtil.h"
+#include <emmintrin.h>
 
 namespace str {
 
@@ -338,12 +339,182 @@ WCHAR* ToLowerInPlace(WCHAR *s)
     return res;
 }
 
+// Most conversions are from and to UTF-8 and most of that text is ASCII.
+// The fast paths below convert in a single pass (instead of calling
+// MultiByteToWideChar/WideCharToMultiByte twice) and handle ASCII runs
+// 16 resp. 8 chars at a time. They give up on invalid input, which is then
+// converted by Windows as before (i.e. with the same replacement chars).
+
+// converts the leading ASCII chars of s and returns their number
+static size_t AsciiToWide(const char *s, size_t len, WCHAR *dst)
+{
+    size_t i = 0;
+    if (HasSSE2()) {
+        __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= len; i += 16) {
+            __m128i chunk = _mm_loadu_si128((const __m128i *)(s + i));
+            if (_mm_movemask_epi8(chunk) != 0)
+                break;
+            _mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi8(chunk, zero));
+            _mm_storeu_si128((__m128i *)(dst + i + 8), _mm_unpackhi_epi8(chunk, zero));
+        }
+    }
+    for (; i < len && (uint8)s[i] < 0x80; i++) {
+        dst[i] = (WCHAR)s[i];
+    }
+    return i;
+}
+
+static size_t AsciiToUtf8(const WCHAR *s, size_t len, char *dst)
+{
+    size_t i = 0;
+    if (HasSSE2()) {
+        __m128i nonAscii = _mm_set1_epi16((short)0xFF80);
+        __m128i zero = _mm_setzero_si128();
+        for (; i + 8 <= len; i += 8) {
+            __m128i chunk = _mm_loadu_si128((const __m128i *)(s + i));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(chunk, nonAscii), zero)) != 0xFFFF)
+                break;
+            _mm_storel_epi64((__m128i *)(dst + i), _mm_packus_epi16(chunk, chunk));
+        }
+    }
+    for (; i < len && s[i] < 0x80; i++) {
+        dst[i] = (char)s[i];
+    }
+    return i;
+}
+
+// dst must have space for len WCHARs (converting never needs more)
+// returns the number of converted WCHARs or -1 for invalid UTF-8
+static int Utf8ToWideFast(const char *src, size_t len, WCHAR *dst)
+{
+    const uint8 *s = (const uint8 *)src;
+    WCHAR *d = dst;
+    size_t i = 0;
+    for (;;) {
+        size_t n = AsciiToWide(src + i, len - i, d);
+        i += n;
+        d += n;
+        if (i == len)
+            break;
+
+        uint8 c = s[i];
+        size_t seqLen;
+        uint32 cp;
+        if (c >= 0xC2 && c <= 0xDF) {
+            seqLen = 2;
+            cp = c & 0x1F;
+        } else if (c >= 0xE0 && c <= 0xEF) {
+            seqLen = 3;
+            cp = c & 0x0F;
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            seqLen = 4;
+            cp = c & 0x07;
+        } else {
+            return -1;
+        }
+        if (seqLen > len - i)
+            return -1;
+        for (size_t k = 1; k < seqLen; k++) {
+            if ((s[i + k] & 0xC0) != 0x80)
+                return -1;
+            cp = (cp << 6) | (s[i + k] & 0x3F);
+        }
+        // reject overlong sequences, surrogates and code points beyond U+10FFFF
+        if (3 == seqLen && (cp < 0x800 || (cp >= 0xD800 && cp <= 0xDFFF)))
+            return -1;
+        if (4 == seqLen && (cp < 0x10000 || cp > 0x10FFFF))
+            return -1;
+
+        if (cp >= 0x10000) {
+            cp -= 0x10000;
+            *d++ = (WCHAR)(0xD800 + (cp >> 10));
+            *d++ = (WCHAR)(0xDC00 + (cp & 0x3FF));
+        } else {
+            *d++ = (WCHAR)cp;
+        }
+        i += seqLen;
+    }
+    return (int)(d - dst);
+}
+
+// returns the length of s encoded as UTF-8 or -1 if s contains unpaired surrogates
+static int Utf8LenFast(const WCHAR *s, size_t len)
+{
+    size_t res = 0;
+    for (size_t i = 0; i < len; i++) {
+        WCHAR c = s[i];
+        if (c < 0x80) {
+            res += 1;
+        } else if (c < 0x800) {
+            res += 2;
+        } else if (c < 0xD800 || c > 0xDFFF) {
+            res += 3;
+        } else if (c <= 0xDBFF && i + 1 < len && s[i + 1] >= 0xDC00 && s[i + 1] <= 0xDFFF) {
+            res += 4;
+            i++;
+        } else {
+            return -1;
+        }
+        if (res > INT_MAX)
+            return -1;
+    }
+    return (int)res;
+}
+
+// s must have been validated with Utf8LenFast
+static void WideToUtf8Fast(const WCHAR *s, size_t len, char *dst)
+{
+    size_t i = 0;
+    for (;;) {
+        size_t n = AsciiToUtf8(s + i, len - i, dst);
+        i += n;
+        dst += n;
+        if (i == len)
+            break;
+        int c = s[i++];
+        if (c >= 0xD800 && c <= 0xDBFF)
+            c = 0x10000 + ((c - 0xD800) << 10) + (s[i++] - 0xDC00);
+        Utf8Encode(dst, c);
+    }
+}
+
+static WCHAR *Utf8ToWide(const char *src, size_t len)
+{
+    WCHAR *res = AllocArray<WCHAR>(len + 1);
+    if (!res)
+        return nullptr;
+    int n = Utf8ToWideFast(src, len, res);
+    if (n < 0) {
+        free(res);
+        return nullptr;
+    }
+    // don't hold on to much more memory than needed (e.g. for CJK text)
+    if ((size_t)n < len / 2) {
+        WCHAR *shrunk = (WCHAR *)realloc(res, (n + 1) * sizeof(WCHAR));
+        if (shrunk)
+            res = shrunk;
+    }
+    return res;
+}
+
 /* Caller needs to free() the result */
 char *ToMultiByte(const WCHAR *txt, UINT codePage, int cchTxtLen)
 {
     AssertCrash(txt);
     if (!txt) return nullptr;
 
+    if (CP_UTF8 == codePage && cchTxtLen != 0) {
+        size_t len = cchTxtLen < 0 ? str::Len(txt) : (size_t)cchTxtLen;
+        int utf8Len = Utf8LenFast(txt, len);
+        if (utf8Len >= 0) {
+            char *res = AllocArray<char>(utf8Len + 1);
+            if (res)
+                WideToUtf8Fast(txt, len, res);
+            return res;
+        }
+    }
+
     int requiredBufSize = WideCharToMultiByte(codePage, 0, txt, cchTxtLen, nullptr, 0, nullptr, nullptr);
     if (0 == requiredBufSize)
         return nullptr;
@@ -354,6 +525,32 @@ char *ToMultiByte(const WCHAR *txt, UINT codePage, int cchTxtLen)
     return res;
 }
 
+char *ToMultiByte(const WCHAR *txt, UINT codePage, int cchTxtLen, Str<char>& dst)
+{
+    dst.Clear();
+    AssertCrash(txt);
+    if (!txt) return nullptr;
+
+    if (CP_UTF8 == codePage && cchTxtLen != 0) {
+        size_t len = cchTxtLen < 0 ? str::Len(txt) : (size_t)cchTxtLen;
+        int utf8Len = Utf8LenFast(txt, len);
+        if (utf8Len >= 0) {
+            WideToUtf8Fast(txt, len, dst.AppendBlanks(utf8Len));
+            return dst.Get();
+        }
+    }
+
+    int requiredBufSize = WideCharToMultiByte(codePage, 0, txt, cchTxtLen, nullptr, 0, nullptr, nullptr);
+    if (0 == requiredBufSize)
+        return nullptr;
+    char *res = dst.AppendBlanks(requiredBufSize);
+    WideCharToMultiByte(codePage, 0, txt, cchTxtLen, res, requiredBufSize, nullptr, nullptr);
+    // for cchTxtLen == -1 the terminating zero has been converted as well
+    if (cchTxtLen < 0)
+        dst.Pop();
+    return dst.Get();
+}
+
 /* Caller needs to free() the result */
 char *ToMultiByte(const char *src, UINT codePageSrc, UINT codePageDest)
 {
@@ -376,6 +573,13 @@ WCHAR *ToWideChar(const char *src, UINT codePage, int cbSrcLen)
     AssertCrash(src);
     if (!src) return nullptr;
 
+    if (CP_UTF8 == codePage && cbSrcLen != 0) {
+        size_t len = cbSrcLen < 0 ? str::Len(src) : (size_t)cbSrcLen;
+        WCHAR *res = Utf8ToWide(src, len);
+        if (res)
+            return res;
+    }
+
     int requiredBufSize = MultiByteToWideChar(codePage, 0, src, cbSrcLen, nullptr, 0);
     if (0 == requiredBufSize)
         return nullptr;
@@ -386,6 +590,33 @@ WCHAR *ToWideChar(const char *src, UINT codePage, int cbSrcLen)
     return res;
 }
 
+WCHAR *ToWideChar(const char *src, UINT codePage, int cbSrcLen, Str<WCHAR>& dst)
+{
+    dst.Clear();
+    AssertCrash(src);
+    if (!src) return nullptr;
+
+    if (CP_UTF8 == codePage && cbSrcLen != 0) {
+        size_t len = cbSrcLen < 0 ? str::Len(src) : (size_t)cbSrcLen;
+        int n = Utf8ToWideFast(src, len, dst.AppendBlanks(len));
+        if (n >= 0) {
+            dst.RemoveAt(n, len - n);
+            return dst.Get();
+        }
+        dst.Clear();
+    }
+
+    int requiredBufSize = MultiByteToWideChar(codePage, 0, src, cbSrcLen, nullptr, 0);
+    if (0 == requiredBufSize)
+        return nullptr;
+    WCHAR *res = dst.AppendBlanks(requiredBufSize);
+    MultiByteToWideChar(codePage, 0, src, cbSrcLen, res, requiredBufSize);
+    // for cbSrcLen == -1 the terminating zero has been converted as well
+    if (cbSrcLen < 0)
+        dst.Pop();
+    return dst.Get();
+}
+
 // Encode unicode character as utf8 to dst buffer and advance dst pointer.
 // The caller must ensure there is enough free space (4 bytes) in dst
 void Utf8Encode(char *& dst, int c)
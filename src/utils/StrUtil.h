@@ -5,6 +5,8 @@
 
 namespace str {
 
+template <typename T> class Str;
+
 enum TrimOpt {
     TrimLeft,
     TrimRight,
@@ -66,6 +68,10 @@ WCHAR* ToLowerInPlace(WCHAR *s);
 char *  ToMultiByte(const WCHAR *txt, UINT CodePage, int cchTxtLen=-1);
 char *  ToMultiByte(const char *src, UINT CodePageSrc, UINT CodePageDest);
 WCHAR * ToWideChar(const char *src, UINT CodePage, int cbSrcLen=-1);
+// these convert into dst (replacing its content) so that a single buffer
+// can be re-used when converting many strings; return dst.Get() or nullptr
+char *  ToMultiByte(const WCHAR *txt, UINT CodePage, int cchTxtLen, Str<char>& dst);
+WCHAR * ToWideChar(const char *src, UINT CodePage, int cbSrcLen, Str<WCHAR>& dst);
 void    Utf8Encode(char *& dst, int c);
 
 inline const char * FindChar(const char *str, const char c) {
@@ -173,6 +179,9 @@ inline WCHAR *  FromUtf8(const char *src, size_t cbSrcLen) { return ToWideChar(s
 inline WCHAR *  FromUtf8(const char *src) { return ToWideChar(src, CP_UTF8); }
 inline char *   ToUtf8(const WCHAR *src, size_t cchSrcLen) { return ToMultiByte(src, CP_UTF8, (int)cchSrcLen); }
 inline char *   ToUtf8(const WCHAR *src) { return ToMultiByte(src, CP_UTF8); }
+inline WCHAR *  FromCodePage(const char *src, size_t cbSrcLen, UINT cp, Str<WCHAR>& dst) { return ToWideChar(src, cp, (int)cbSrcLen, dst); }
+inline WCHAR *  FromUtf8(const char *src, size_t cbSrcLen, Str<WCHAR>& dst) { return ToWideChar(src, CP_UTF8, (int)cbSrcLen, dst); }
+inline char *   ToUtf8(const WCHAR *src, size_t cchSrcLen, Str<char>& dst) { return ToMultiByte(src, CP_UTF8, (int)cchSrcLen, dst); }
 inline WCHAR *  FromAnsi(const char *src, size_t cbSrcLen=(size_t)-1) { return ToWideChar(src, CP_ACP, (int)cbSrcLen); }
 inline char *   ToAnsi(const WCHAR *src) { return ToMultiByte(src, CP_ACP); }
 char *          UnknownToUtf8(const char *src, size_t len = 0);
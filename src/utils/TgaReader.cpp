@@ -3,6 +3,7 @@
 
 #include "BaseUtil.h"
 #include "TgaReader.h"
+#include "WinUtil.h"
 
 using namespace Gdiplus;
 
@@ -288,12 +289,47 @@ static void ReadPixel(ReadState& s, char *dst)
         s.data += s.n;
 }
 
-Gdiplus::Bitmap *ImageFromData(const char *data, size_t len)
+// expands a pixel in the image's pixel format to 32-bit BGRA in place
+static inline void ExpandPixel(char *dst, PixelFormat format)
+{
+    uint16_t v;
+    switch (format) {
+    case PixelFormat16bppRGB555: case PixelFormat16bppARGB1555:
+        v = *(uint16_t *)dst;
+        dst[0] = (char)(((v & 0x1F) << 3) | ((v & 0x1F) >> 2));
+        dst[1] = (char)((((v >> 5) & 0x1F) << 3) | (((v >> 5) & 0x1F) >> 2));
+        dst[2] = (char)((((v >> 10) & 0x1F) << 3) | (((v >> 10) & 0x1F) >> 2));
+        dst[3] = PixelFormat16bppARGB1555 == format && !(v & 0x8000) ? 0 : (char)0xFF;
+        break;
+    case PixelFormat24bppRGB: case PixelFormat32bppRGB:
+        dst[3] = (char)0xFF;
+        break;
+    }
+}
+
+// copies an uncompressed row of BGR pixels to BGRA, four pixels at a time
+static void ExpandRow24To32(uint32_t *dst, const char *src, int w)
+{
+    int x = 0;
+    for (; x + 4 <= w; x += 4, src += 12, dst += 4) {
+        uint32_t a = *(const uint32_t *)src;
+        uint32_t b = *(const uint32_t *)(src + 4);
+        uint32_t c = *(const uint32_t *)(src + 8);
+        dst[0] = a | 0xFF000000;
+        dst[1] = (a >> 24) | (b << 8) | 0xFF000000;
+        dst[2] = (b >> 16) | (c << 16) | 0xFF000000;
+        dst[3] = (c >> 8) | 0xFF000000;
+    }
+    for (; x < w; x++, src += 3, dst++) {
+        *dst = (uint8_t)src[0] | ((uint8_t)src[1] << 8) | ((uint8_t)src[2] << 16) | 0xFF000000;
+    }
+}
+
+static const TgaHeader *InitReadState(ReadState& s, const char *data, size_t len)
 {
     if (len < sizeof(TgaHeader))
         return nullptr;
 
-    ReadState s = { 0 };
     const TgaHeader *headerLE = (const TgaHeader *)data;
     s.data = data + sizeof(TgaHeader) + headerLE->idLength;
     s.end = data + len;
@@ -307,6 +343,71 @@ Gdiplus::Bitmap *ImageFromData(const char *data, size_t len)
     s.type = (ImageType)headerLE->imageType;
     s.n = (headerLE->bitDepth + 7) / 8;
     s.isRLE = headerLE->imageType >= 8;
+    return headerLE;
+}
+
+// writes the pixels either in the image's pixel format or (if toBGRA is set) as 32-bit BGRA
+static bool ReadPixels(ReadState& s, const TgaHeader *headerLE, PixelFormat format, char *scan0, int stride, bool toBGRA)
+{
+    int w = convLE(headerLE->width);
+    int h = convLE(headerLE->height);
+    int n = ((format >> 8) & 0x3F) / 8;
+    int outN = toBGRA ? 4 : n;
+    bool expand = toBGRA && format != PixelFormat32bppARGB && format != PixelFormat32bppPARGB;
+    bool invertX = (headerLE->flags & Flag_InvertX);
+    bool invertY = (headerLE->flags & Flag_InvertY);
+
+    for (int y = 0; y < h && !s.failed; y++) {
+        char *rowOut = scan0 + stride * (invertY ? y : h - 1 - y);
+        // uncompressed truecolor rows can be copied without per-pixel decoding
+        if (Type_Truecolor == s.type && !invertX && s.data + w * s.n <= s.end) {
+            if (!expand) {
+                memcpy(rowOut, s.data, w * n);
+                s.data += w * s.n;
+                continue;
+            }
+            if (3 == s.n) {
+                ExpandRow24To32((uint32_t *)rowOut, s.data, w);
+                s.data += w * s.n;
+                continue;
+            }
+        }
+        for (int x = 0; x < w; x++) {
+            char *dst = rowOut + outN * (invertX ? w - 1 - x : x);
+            ReadPixel(s, dst);
+            if (expand)
+                ExpandPixel(dst, format);
+        }
+    }
+    return !s.failed;
+}
+
+Size SizeFromData(const char *data, size_t len)
+{
+    if (!HasSignature(data, len))
+        return Size();
+    const TgaHeader *headerLE = (const TgaHeader *)data;
+    return Size(convLE(headerLE->width), convLE(headerLE->height));
+}
+
+bool DecodeInto(const char *data, size_t len, unsigned char *bgra, int stride, Size size)
+{
+    ReadState s = { 0 };
+    const TgaHeader *headerLE = InitReadState(s, data, len);
+    if (!headerLE)
+        return false;
+    PixelFormat format = GetPixelFormat(headerLE, GetAlphaType(data, len));
+    if (!format || convLE(headerLE->width) != size.Width || convLE(headerLE->height) != size.Height)
+        return false;
+    return ReadPixels(s, headerLE, format, (char *)bgra, stride, true);
+}
+
+Gdiplus::Bitmap *ImageFromData(const char *data, size_t len)
+{
+    ReadState s = { 0 };
+    const TgaHeader *headerLE = InitReadState(s, data, len);
+    if (!headerLE)
+        return nullptr;
 
     PixelFormat format = GetPixelFormat(headerLE, GetAlphaType(data, len));
     if (!format)
@@ -314,9 +415,6 @@ Gdiplus::Bitmap *ImageFromData(const char *data, size_t len)
 
     int w = convLE(headerLE->width);
     int h = convLE(headerLE->height);
-    int n = ((format >> 8) & 0x3F) / 8;
-    bool invertX = (headerLE->flags & Flag_InvertX);
-    bool invertY = (headerLE->flags & Flag_InvertY);
 
     Bitmap bmp(w, h, format);
     Rect bmpRect(0, 0, w, h);
@@ -324,14 +422,9 @@ Gdiplus::Bitmap *ImageFromData(const char *data, size_t len)
     Status ok = bmp.LockBits(&bmpRect, ImageLockModeWrite, format, &bmpData);
     if (ok != Ok)
         return nullptr;
-    for (int y = 0; y < h; y++) {
-        char *rowOut = (char *)bmpData.Scan0 + bmpData.Stride * (invertY ? y : h - 1 - y);
-        for (int x = 0; x < w; x++) {
-            ReadPixel(s, rowOut + n * (invertX ? w - 1 - x : x));
-        }
-    }
+    bool read = ReadPixels(s, headerLE, format, (char *)bmpData.Scan0, bmpData.Stride, false);
     bmp.UnlockBits(&bmpData);
-    if (s.failed)
+    if (!read)
         return nullptr;
     CopyMetadata(data, len, &bmp);
     // hack to avoid the use of ::new (because there won't be a corresponding ::delete)
@@ -357,20 +450,35 @@ unsigned char *SerializeBitmap(HBITMAP hbmp, size_t *bmpBytesOut)
     if (!bmpData)
         return nullptr;
 
-    BITMAPINFO bmi = { 0 };
-    bmi.bmiHeader.biSize = sizeof(bmi.bmiHeader);
-    bmi.bmiHeader.biWidth = w;
-    bmi.bmiHeader.biHeight = h;
-    bmi.bmiHeader.biPlanes = 1;
-    bmi.bmiHeader.biBitCount = 24;
-    bmi.bmiHeader.biCompression = BI_RGB;
-
-    HDC hDC = GetDC(nullptr);
-    if (!GetDIBits(hDC, hbmp, 0, h, bmpData, &bmi, DIB_RGB_COLORS)) {
+    int dibStride, dibBpp;
+    const uint8 *dibPixels = GetDIBSectionPixels(hbmp, &dibStride, &dibBpp);
+    if (dibPixels && 32 == dibBpp) {
+        // read 32-bit DIB sections (e.g. rendered pages) directly
+        // instead of having GDI copy them (bottom-up rows as for GDI)
+        for (int k = 0; k < h; k++) {
+            const uint8 *in = dibPixels + (h - 1 - k) * dibStride;
+            char *out = bmpData + k * stride;
+            for (int i = 0; i < w; i++, in += 4, out += 3) {
+                memcpy(out, in, 3);
+            }
+        }
+    }
+    else {
+        BITMAPINFO bmi = { 0 };
+        bmi.bmiHeader.biSize = sizeof(bmi.bmiHeader);
+        bmi.bmiHeader.biWidth = w;
+        bmi.bmiHeader.biHeight = h;
+        bmi.bmiHeader.biPlanes = 1;
+        bmi.bmiHeader.biBitCount = 24;
+        bmi.bmiHeader.biCompression = BI_RGB;
+
+        HDC hDC = GetDC(nullptr);
+        if (!GetDIBits(hDC, hbmp, 0, h, bmpData, &bmi, DIB_RGB_COLORS)) {
+            ReleaseDC(nullptr, hDC);
+            return nullptr;
+        }
         ReleaseDC(nullptr, hDC);
-        return nullptr;
     }
-    ReleaseDC(nullptr, hDC);
 
     TgaHeader headerLE = { 0 };
     headerLE.imageType = Type_Truecolor_RLE;
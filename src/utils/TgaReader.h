@@ -8,7 +8,11 @@
 namespace tga {
 
 bool                HasSignature(const char *data, size_t len);
+Gdiplus::Size       SizeFromData(const char *data, size_t len);
 Gdiplus::Bitmap *   ImageFromData(const char *data, size_t len);
+// decodes into a caller-provided 32-bit BGRA buffer (e.g. the pixels of a DIB section)
+// which must match SizeFromData; stride is negative for bottom-up buffers
+bool                DecodeInto(const char *data, size_t len, unsigned char *bgra, int stride, Gdiplus::Size size);
 
 unsigned char *     SerializeBitmap(HBITMAP hbmp, size_t *bmpBytesOut);
 
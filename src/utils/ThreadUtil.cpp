@@ -70,6 +70,7 @@ DWORD WINAPI ThreadBase::ThreadProc(void *data) {
     if (thread->threadName)
         SetThreadName(GetCurrentThreadId(), thread->threadName);
     thread->Run();
+    ScratchArena::FreeForCurrentThread();
     return 0;
 }
 
@@ -88,14 +89,204 @@ bool ThreadBase::Join(DWORD waitMs) {
     return false;
 }
 
-static DWORD WINAPI ThreadFunc(void *data) {
-    auto *func = reinterpret_cast<std::function<void()> *>(data);
-    (*func)();
-    delete func;
-    return 0;
+#define MAX_POOL_WORKERS 16
+#define MIN_POOL_WORKERS 4
+#define TASK_PRIORITY_COUNT 3
+
+struct PoolTask {
+    std::function<void()> func;
+    TaskPriority prio;
+    // both can be nullptr
+    CancelToken *token;
+    HANDLE hDone;
+};
+
+struct PoolWorker {
+    HANDLE hThread;
+    DWORD threadId;
+    CRITICAL_SECTION access;
+    // the owner takes its most recently queued tasks first, others
+    // steal the oldest ones
+    Vec<PoolTask *> queues[TASK_PRIORITY_COUNT];
+};
+
+static PoolWorker gWorkers[MAX_POOL_WORKERS];
+static int gWorkerCount = 0;
+// 0: not started, 1: starting, 2: running
+static volatile LONG gPoolState = 0;
+// released whenever there might be a task for a waiting worker
+static HANDLE gPoolWakeup = nullptr;
+static volatile LONG gQueuedTasks = 0;
+// number of running background and idle tasks
+static volatile LONG gLowPrioRunning = 0;
+static volatile LONG gIdleRunning = 0;
+static volatile LONG gNextWorker = 0;
+
+static const int gThreadPriorities[TASK_PRIORITY_COUNT] = {
+    THREAD_PRIORITY_NORMAL, THREAD_PRIORITY_BELOW_NORMAL, THREAD_PRIORITY_LOWEST
+};
+
+static bool TryIncrementBelow(volatile LONG *count, LONG max) {
+    for (;;) {
+        LONG curr = *count;
+        if (curr >= max)
+            return false;
+        if (InterlockedCompareExchange(count, curr + 1, curr) == curr)
+            return true;
+    }
+}
+
+// background and idle tasks leave one worker for interactive
+// tasks and idle tasks may use at most half of the workers
+static bool TryReserveSlot(int prio) {
+    if (prio == (int)TaskPriority::Interactive)
+        return true;
+    if (prio == (int)TaskPriority::Idle && !TryIncrementBelow(&gIdleRunning, std::max(gWorkerCount / 2, 1)))
+        return false;
+    if (TryIncrementBelow(&gLowPrioRunning, gWorkerCount - 1))
+        return true;
+    if (prio == (int)TaskPriority::Idle)
+        InterlockedDecrement(&gIdleRunning);
+    return false;
+}
+
+static void ReleaseSlot(int prio) {
+    if (prio == (int)TaskPriority::Interactive)
+        return;
+    if (prio == (int)TaskPriority::Idle)
+        InterlockedDecrement(&gIdleRunning);
+    InterlockedDecrement(&gLowPrioRunning);
+}
+
+static PoolTask *TakeTask(PoolWorker *w, int prio, bool steal) {
+    ScopedCritSec scope(&w->access);
+    Vec<PoolTask *>& queue = w->queues[prio];
+    if (queue.Count() == 0)
+        return nullptr;
+    if (steal)
+        return queue.PopAt(0);
+    return queue.Pop();
+}
+
+static PoolTask *FindTask(int self) {
+    for (int prio = 0; prio < TASK_PRIORITY_COUNT; prio++) {
+        if (!TryReserveSlot(prio))
+            continue;
+        for (int i = 0; i < gWorkerCount; i++) {
+            int idx = (self + i) % gWorkerCount;
+            PoolTask *task = TakeTask(&gWorkers[idx], prio, idx != self);
+            if (task) {
+                InterlockedDecrement(&gQueuedTasks);
+                return task;
+            }
+        }
+        ReleaseSlot(prio);
+    }
+    return nullptr;
+}
+
+static void RunPoolTask(PoolTask *task) {
+    int prio = (int)task->prio;
+    SetThreadPriority(GetCurrentThread(), gThreadPriorities[prio]);
+    if (!task->token || !task->token->IsCanceled())
+        task->func();
+    ReleaseSlot(prio);
+    if (task->hDone) {
+        SetEvent(task->hDone);
+        CloseHandle(task->hDone);
+    }
+    if (task->token)
+        task->token->Release();
+    delete task;
+    // a task of lower priority might have been waiting for this slot
+    if (gQueuedTasks > 0)
+        ReleaseSemaphore(gPoolWakeup, 1, nullptr);
+}
+
+static DWORD WINAPI PoolWorkerProc(void *data) {
+    int self = (int)(INT_PTR)data;
+    SetThreadName(GetCurrentThreadId(), "PoolWorker");
+    for (;;) {
+        PoolTask *task = FindTask(self);
+        if (task)
+            RunPoolTask(task);
+        else
+            WaitForSingleObject(gPoolWakeup, INFINITE);
+    }
+}
+
+static void StartThreadPool() {
+    if (2 == gPoolState)
+        return;
+    if (InterlockedCompareExchange(&gPoolState, 1, 0) != 0) {
+        while (gPoolState != 2) {
+            Sleep(0);
+        }
+        return;
+    }
+
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    gWorkerCount = limitValue((int)si.dwNumberOfProcessors, MIN_POOL_WORKERS, MAX_POOL_WORKERS);
+    gPoolWakeup = CreateSemaphore(nullptr, 0, LONG_MAX, nullptr);
+    for (int i = 0; i < gWorkerCount; i++) {
+        InitializeCriticalSection(&gWorkers[i].access);
+    }
+    for (int i = 0; i < gWorkerCount; i++) {
+        PoolWorker *w = &gWorkers[i];
+        w->hThread = CreateThread(nullptr, 0, PoolWorkerProc, (void *)(INT_PTR)i, 0, &w->threadId);
+        CrashAlwaysIf(!w->hThread);
+    }
+    InterlockedExchange(&gPoolState, 2);
+}
+
+static void QueuePoolTask(PoolTask *task) {
+    StartThreadPool();
+    // tasks queued from a worker go to its own queue, others are distributed
+    int idx = -1;
+    DWORD threadId = GetCurrentThreadId();
+    for (int i = 0; i < gWorkerCount && idx < 0; i++) {
+        if (gWorkers[i].threadId == threadId)
+            idx = i;
+    }
+    if (idx < 0)
+        idx = (int)((DWORD)InterlockedIncrement(&gNextWorker) % gWorkerCount);
+
+    PoolWorker *w = &gWorkers[idx];
+    EnterCriticalSection(&w->access);
+    w->queues[(int)task->prio].Append(task);
+    LeaveCriticalSection(&w->access);
+    InterlockedIncrement(&gQueuedTasks);
+    ReleaseSemaphore(gPoolWakeup, 1, nullptr);
 }
 
-void RunAsync(const std::function<void()> &func) {
-    auto fp = new std::function<void()>(func);
-    ScopedHandle h(CreateThread(nullptr, 0, ThreadFunc, fp, 0, 0));
+static PoolTask *NewPoolTask(const std::function<void()> &func, TaskPriority prio, CancelToken *token) {
+    PoolTask *task = new PoolTask();
+    task->func = func;
+    task->prio = prio;
+    task->token = token;
+    if (token)
+        token->AddRef();
+    task->hDone = nullptr;
+    return task;
+}
+
+void RunAsync(const std::function<void()> &func, TaskPriority prio, CancelToken *token) {
+    QueuePoolTask(NewPoolTask(func, prio, token));
+}
+
+HANDLE RunAsyncWaitable(const std::function<void()> &func, TaskPriority prio, CancelToken *token) {
+    PoolTask *task = NewPoolTask(func, prio, token);
+    HANDLE hDone = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    HANDLE hProcess = GetCurrentProcess();
+    if (!hDone || !DuplicateHandle(hProcess, hDone, hProcess, &task->hDone, 0, FALSE, DUPLICATE_SAME_ACCESS)) {
+        if (hDone)
+            CloseHandle(hDone);
+        if (token)
+            token->Release();
+        delete task;
+        return nullptr;
+    }
+    QueuePoolTask(task);
+    return hDone;
 }
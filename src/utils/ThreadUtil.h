@@ -46,4 +46,43 @@ class ThreadBase {
 
 void SetThreadName(DWORD threadId, const char *threadName);
 
-void RunAsync(const std::function<void()> &);
+// Tasks run on a bounded pool of shared worker threads. Workers prefer tasks
+// of higher priority and steal tasks from each other's queues when their own
+// runs dry. Background and idle tasks run at a lower thread priority and
+// never occupy all workers, so that they can't delay interactive tasks
+// (or rendering, which uses its own threads).
+enum class TaskPriority {
+    // the user is waiting for the result (e.g. find or copying text)
+    Interactive,
+    Background,
+    // may be delayed arbitrarily
+    Idle,
+};
+
+// a ref-counted flag for telling tasks to stop; tasks which haven't
+// been started yet when it's set are skipped altogether
+class CancelToken {
+    volatile LONG refCount;
+    volatile LONG canceled;
+
+    ~CancelToken() {}
+
+  public:
+    CancelToken() : refCount(1), canceled(0) {}
+
+    void AddRef() { InterlockedIncrement(&refCount); }
+    void Release() {
+        if (0 == InterlockedDecrement(&refCount))
+            delete this;
+    }
+
+    void Cancel() { InterlockedExchange(&canceled, 1); }
+    bool IsCanceled() const { return canceled != 0; }
+};
+
+void RunAsync(const std::function<void()> &, TaskPriority prio = TaskPriority::Background,
+              CancelToken *token = nullptr);
+// returns an event which is signaled once the task has finished (or been
+// skipped) and which the caller has to CloseHandle()
+HANDLE RunAsyncWaitable(const std::function<void()> &, TaskPriority prio = TaskPriority::Background,
+                        CancelToken *token = nullptr);
@@ -14,6 +14,10 @@ Not really meant for general use.
 
 name/val pointers inside Element/Attr structs refer to
 memory inside HtmlParser::s, so they don't need to be freed.
+Elements and attributes themselves are allocated from a pool
+which is freed at once, and known names are also stored as
+HtmlParserLookup ids, so that even huge CHM ToCs and indices
+(which are mostly long lists of siblings) are parsed quickly.
 */
 
 bool HtmlElement::NameIs(const char *name) const
@@ -62,11 +66,12 @@ static WCHAR IntToChar(int codepoint)
     return (WCHAR)codepoint;
 }
 
-// caller needs to free() the result
-WCHAR *DecodeHtmlEntitites(const char *string, UINT codepage)
+// decoding never makes the string longer, so it can be done in place
+// returns the new end of the string
+static WCHAR *DecodeHtmlEntititesInPlace(WCHAR *s)
 {
-    WCHAR *fixed = str::conv::FromCodePage(string, codepage), *dst = fixed;
-    const WCHAR *src = fixed;
+    WCHAR *dst = s;
+    const WCHAR *src = s;
 
     while (*src) {
         if (*src != '&') {
@@ -103,9 +108,45 @@ WCHAR *DecodeHtmlEntitites(const char *string, UINT codepage)
     }
     *dst = '\0';
 
+    return dst;
+}
+
+// caller needs to free() the result
+WCHAR *DecodeHtmlEntitites(const char *string, UINT codepage)
+{
+    WCHAR *fixed = str::conv::FromCodePage(string, codepage);
+    if (fixed)
+        DecodeHtmlEntititesInPlace(fixed);
     return fixed;
 }
 
+namespace str {
+    namespace conv {
+
+// caller needs to free() the result
+WCHAR *FromHtmlUtf8(const char *s, size_t len)
+{
+    if (0 == len)
+        return str::Dup(L"");
+    WCHAR *res = str::conv::FromUtf8(s, len);
+    if (res)
+        DecodeHtmlEntititesInPlace(res);
+    return res;
+}
+
+WCHAR *FromHtmlUtf8(const char *s, size_t len, str::Str<WCHAR>& dst)
+{
+    dst.Clear();
+    if (len > 0 && !str::conv::FromUtf8(s, len, dst))
+        return nullptr;
+    size_t newLen = DecodeHtmlEntititesInPlace(dst.Get()) - dst.Get();
+    dst.RemoveAt(newLen, dst.Count() - newLen);
+    return dst.Get();
+}
+
+    }
+}
+
 HtmlParser::HtmlParser() : html(nullptr), freeHtml(false), rootElement(nullptr),
     currElement(nullptr), elementsCount(0), attributesCount(0), codepage(CP_ACP),
     error(ErrParsingNoError), errorContext(nullptr)
@@ -131,9 +172,10 @@ void HtmlParser::Reset()
     allocator.FreeAll();
 }
 
-HtmlAttr *HtmlParser::AllocAttr(char *name, HtmlAttr *next)
+HtmlAttr *HtmlParser::AllocAttr(char *name, size_t nameLen, HtmlAttr *next)
 {
     HtmlAttr *attr = allocator.AllocStruct<HtmlAttr>();
+    attr->id = FindHtmlAttr(name, nameLen);
     attr->name = name;
     attr->next = next;
     ++attributesCount;
@@ -143,8 +185,9 @@ HtmlAttr *HtmlParser::AllocAttr(char *name, HtmlAttr *next)
 // caller needs to free() the result
 WCHAR *HtmlElement::GetAttribute(const char *name) const
 {
+    HtmlAttrId id = FindHtmlAttr(name, str::Len(name));
     for (HtmlAttr *attr = firstAttr; attr; attr = attr->next) {
-        if (str::EqI(attr->name, name))
+        if (Attr_NotFound != id ? id == attr->id : str::EqI(attr->name, name))
             return DecodeHtmlEntitites(attr->val, codepage);
     }
     return nullptr;
@@ -193,14 +236,11 @@ void HtmlParser::StartTag(HtmlToken *tok)
         // and all its children will be ignored
     } else if (nullptr == parent->down) {
         // parent has no children => set as a first child
-        parent->down = currElement;
+        parent->down = parent->lastDown = currElement;
     } else {
         // parent has children => set as a sibling
-        HtmlElement *tmp = parent->down;
-        while (tmp->next) {
-            tmp = tmp->next;
-        }
-        tmp->next = currElement;
+        parent->lastDown->next = currElement;
+        parent->lastDown = currElement;
     }
 }
 
@@ -224,9 +264,9 @@ void HtmlParser::CloseTag(HtmlToken *tok)
     // ignore the unexpected closing tag
 }
 
-void HtmlParser::AppendAttr(char *name, char *value)
+void HtmlParser::AppendAttr(char *name, size_t nameLen, char *value)
 {
-    currElement->firstAttr = AllocAttr(name, currElement->firstAttr);
+    currElement->firstAttr = AllocAttr(name, nameLen, currElement->firstAttr);
     currElement->firstAttr->val = value;
 }
 
@@ -263,13 +303,13 @@ HtmlElement *HtmlParser::ParseInPlace(char *s, UINT codepage)
 
             while (attr) {
                 char *name = (char *)attr->name;
-                char *nameEnd = name + attr->nameLen;
+                size_t nameLen = attr->nameLen;
                 char *value = (char *)attr->val;
                 char *valueEnd = value + attr->valLen;
                 attr = tok->NextAttr();
 
-                *nameEnd = *valueEnd = '\0';
-                AppendAttr(name, value);
+                name[nameLen] = *valueEnd = '\0';
+                AppendAttr(name, nameLen, value);
             }
         }
         if (!tok->IsStartTag() || IsTagSelfClosing(tok->tag)) {
@@ -300,12 +340,14 @@ HtmlElement *HtmlParser::FindElementByName(const char *name, HtmlElement *from)
 HtmlElement *HtmlParser::FindElementByNameNS(const char *name, const char *ns, HtmlElement *from)
 {
     HtmlElement *el = from ? from : rootElement;
+    // look the tag up only once instead of in NameIs for every element
+    HtmlTag tag = FindHtmlTag(name, str::Len(name));
     if (from)
         goto FindNext;
     if (!el)
         return nullptr;
 CheckNext:
-    if (el->NameIs(name) || ns && el->NameIsNS(name, ns))
+    if ((el->name ? str::EqI(el->name, name) : tag == el->tag) || ns && el->NameIsNS(name, ns))
         return el;
 FindNext:
     if (el->down) {
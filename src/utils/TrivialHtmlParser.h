@@ -15,6 +15,7 @@ enum HtmlParseError {
 struct HtmlToken;
 
 struct HtmlAttr {
+    HtmlAttrId id; // Attr_NotFound for names unknown to HtmlParserLookup
     char *name;
     char *val;
     HtmlAttr *next;
@@ -25,6 +26,8 @@ struct HtmlElement {
     char *name; // name is nullptr whenever tag != Tag_NotFound
     HtmlAttr *firstAttr;
     HtmlElement *up, *down, *next;
+    // the last child (for appending further children while parsing)
+    HtmlElement *lastDown;
     UINT codepage;
 
     bool NameIs(const char *name) const;
@@ -52,11 +55,11 @@ class HtmlParser {
     HtmlElement *currElement;
 
     HtmlElement *AllocElement(HtmlTag tag, char *name, HtmlElement *parent);
-    HtmlAttr *AllocAttr(char *name, HtmlAttr *next);
+    HtmlAttr *AllocAttr(char *name, size_t nameLen, HtmlAttr *next);
 
     void CloseTag(HtmlToken *tok);
     void StartTag(HtmlToken *tok);
-    void AppendAttr(char *name, char *value);
+    void AppendAttr(char *name, size_t nameLen, char *value);
 
     HtmlElement *FindParent(HtmlToken *tok);
     HtmlElement *ParseError(HtmlParseError err) {
@@ -93,11 +96,9 @@ WCHAR *DecodeHtmlEntitites(const char *string, UINT codepage);
 namespace str {
     namespace conv {
 
-inline WCHAR *FromHtmlUtf8(const char *s, size_t len)
-{
-    ScopedMem<char> tmp(str::DupN(s, len));
-    return DecodeHtmlEntitites(tmp, CP_UTF8);
-}
+WCHAR *FromHtmlUtf8(const char *s, size_t len);
+// decodes into dst (replacing its content) so that the buffer can be re-used
+WCHAR *FromHtmlUtf8(const char *s, size_t len, str::Str<WCHAR>& dst);
 
     }
 }
@@ -12,11 +12,110 @@ static HWND gTaskDispatchHwnd = nullptr;
 #define UITASK_CLASS_NAME L"UITask_Wnd_Class"
 #define WM_EXECUTE_TASK (WM_USER + 1)
 
+// Tasks are queued in a bounded multi-producer, single-consumer ring buffer
+// (cf. http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue)
+// and only the first task after the queue has been drained posts a message,
+// so that chatty background threads don't flood the message queue
+#define TASK_QUEUE_SIZE 256 // must be a power of two
+// max number of tasks to run per message so that the UI stays responsive
+// when tasks keep being queued
+#define MAX_TASKS_PER_BATCH TASK_QUEUE_SIZE
+
+struct TaskCell {
+    // == pos: free for the producer claiming pos
+    // == pos + 1: holds the task for the consumer at pos
+    volatile LONG seq;
+    std::function<void()> func;
+};
+
+static TaskCell gTasks[TASK_QUEUE_SIZE];
+static volatile LONG gEnqueuePos = 0;
+// only accessed by the UI thread
+static LONG gDequeuePos = 0;
+// set once a wake-up message has been posted and not yet handled
+static volatile LONG gWakeupPending = 0;
+// number of tasks posted individually because the queue was full
+static volatile LONG gOverflowPending = 0;
+
+static void InitQueue() {
+    for (LONG i = 0; i < TASK_QUEUE_SIZE; i++) {
+        gTasks[i].seq = i;
+    }
+    gEnqueuePos = gDequeuePos = 0;
+    gWakeupPending = gOverflowPending = 0;
+}
+
+static bool TryEnqueue(const std::function<void()> &f) {
+    LONG pos = gEnqueuePos;
+    for (;;) {
+        TaskCell *cell = &gTasks[pos & (TASK_QUEUE_SIZE - 1)];
+        LONG diff = cell->seq - pos;
+        if (diff == 0) {
+            LONG prev = InterlockedCompareExchange(&gEnqueuePos, pos + 1, pos);
+            if (prev == pos) {
+                cell->func = f;
+                InterlockedExchange(&cell->seq, pos + 1);
+                return true;
+            }
+            pos = prev;
+        } else if (diff < 0) {
+            // the queue is full
+            return false;
+        } else {
+            pos = gEnqueuePos;
+        }
+    }
+}
+
+static bool TryDequeue(std::function<void()> &f) {
+    TaskCell *cell = &gTasks[gDequeuePos & (TASK_QUEUE_SIZE - 1)];
+    if (cell->seq - (gDequeuePos + 1) < 0) {
+        // empty or the producer hasn't finished storing the task yet
+        // (in which case it'll post a wake-up message afterwards)
+        return false;
+    }
+    f = std::move(cell->func);
+    cell->func = nullptr;
+    InterlockedExchange(&cell->seq, gDequeuePos + TASK_QUEUE_SIZE);
+    gDequeuePos++;
+    return true;
+}
+
+static void PostWakeup() {
+    if (0 == InterlockedExchange(&gWakeupPending, 1)) {
+        PostMessage(gTaskDispatchHwnd, WM_EXECUTE_TASK, 0, 0);
+    }
+}
+
+// returns false if the batch limit was reached before the queue was empty
+static bool ExecuteTasks(int maxTasks) {
+    std::function<void()> func;
+    for (int i = 0; i < maxTasks; i++) {
+        if (!TryDequeue(func)) {
+            return true;
+        }
+        func();
+        func = nullptr;
+    }
+    return false;
+}
+
 static LRESULT CALLBACK WndProcTaskDispatch(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
+    if (WM_EXECUTE_TASK == msg && !lParam) {
+        // reset before draining so that tasks queued from now on post a new message
+        InterlockedExchange(&gWakeupPending, 0);
+        if (!ExecuteTasks(MAX_TASKS_PER_BATCH)) {
+            PostWakeup();
+        }
+        return 0;
+    }
     if (WM_EXECUTE_TASK == msg) {
+        // an overflowing task: all tasks queued before it must run first
+        ExecuteTasks(INT_MAX);
         auto func = (std::function<void()> *)lParam;
         (*func)();
         delete func;
+        InterlockedDecrement(&gOverflowPending);
         return 0;
     }
     return DefWindowProc(hwnd, msg, wParam, lParam);
@@ -28,6 +127,7 @@ void Initialize() {
     RegisterClassEx(&wcex);
 
     CrashIf(gTaskDispatchHwnd);
+    InitQueue();
     gTaskDispatchHwnd =
         CreateWindow(UITASK_CLASS_NAME, L"UITask Dispatch Window", WS_OVERLAPPED, 0, 0, 0, 0,
                      HWND_MESSAGE, nullptr, GetModuleHandle(nullptr), nullptr);
@@ -48,6 +148,14 @@ void Destroy() {
 }
 
 void Post(const std::function<void()> &f) {
+    // once a task has overflown, keep posting tasks individually until
+    // it has run so that tasks are executed in the order they were posted
+    if (0 == gOverflowPending && TryEnqueue(f)) {
+        PostWakeup();
+        return;
+    }
+    // never block the posting thread, as the UI thread might be waiting for it
+    InterlockedIncrement(&gOverflowPending);
     auto func = new std::function<void()>(f);
     PostMessage(gTaskDispatchHwnd, WM_EXECUTE_TASK, 0, (LPARAM)func);
 }
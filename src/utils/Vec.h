@@ -11,8 +11,23 @@ We always pad the elements with a single 0 value. This makes
 Vec<char> and Vec<WCHAR> a C-compatible string. Although it's
 not useful for other types, the code is simpler if we always do it
 (rather than have it an optional behavior).
+
+The first INLINE_CAP elements are stored inside the Vec itself, avoiding an
+allocation for small vectors. By default, that's up to 15 elements for small
+types but less for larger ones (cf. VecInlineCap). Use an INLINE_CAP of 0
+for vectors which are known to always grow large anyway.
 */
+
+// maximum size in bytes of the inline buffer of a Vec by default
+#define VEC_INLINE_BYTES 128
+
 template <typename T>
+struct VecInlineCap {
+    static const size_t value = sizeof(T) * 16 <= VEC_INLINE_BYTES ? 15 :
+                                VEC_INLINE_BYTES / sizeof(T) > 1 ? VEC_INLINE_BYTES / sizeof(T) - 1 : 0;
+};
+
+template <typename T, size_t INLINE_CAP = VecInlineCap<T>::value>
 class Vec {
 protected:
     static const size_t PADDING = 1;
@@ -21,7 +36,7 @@ protected:
     size_t      cap;
     size_t      capacityHint;
     T *         els;
-    T           buf[16];
+    T           buf[INLINE_CAP + PADDING];
     Allocator * allocator;
 
     bool EnsureCapTry(size_t needed) {
@@ -104,6 +119,23 @@ public:
         memcpy(els, orig.els, sizeof(T) * (len = orig.len));
     }
 
+    // takes over orig's heap allocated elements (if any) and leaves orig empty
+    Vec(Vec&& orig) : capacityHint(orig.capacityHint), allocator(orig.allocator) {
+        els = buf;
+        Reset();
+        if (orig.els == orig.buf) {
+            memcpy(buf, orig.buf, sizeof(buf));
+            len = orig.len;
+        }
+        else {
+            els = orig.els;
+            len = orig.len;
+            cap = orig.cap;
+            orig.els = orig.buf;
+        }
+        orig.Reset();
+    }
+
     // this frees all elements and clears the array.
     // only applicable where T is a pointer. Otherwise will fail to compile
     void FreeMembers() {
@@ -124,6 +156,24 @@ public:
         return *this;
     }
 
+    Vec& operator=(Vec&& that) {
+        if (this == &that)
+            return *this;
+        if (that.els == that.buf || that.allocator != allocator) {
+            // there's nothing to take over (or it can't be freed with our allocator)
+            *this = (const Vec&)that;
+        }
+        else {
+            FreeEls();
+            els = that.els;
+            len = that.len;
+            cap = that.cap;
+            that.els = that.buf;
+        }
+        that.Reset();
+        return *this;
+    }
+
     T& operator[](size_t idx) {
         CrashIf(idx >= len);
         return els[idx];
@@ -137,6 +187,12 @@ public:
         memset(buf, 0, sizeof(buf));
     }
 
+    // like Reset() but keeps the allocated memory for re-use
+    void Clear() {
+        memset(els, 0, len * sizeof(T));
+        len = 0;
+    }
+
     // use &At() if you need a pointer to the element (e.g. if T is a struct)
     T& At(size_t idx) const {
         CrashIf(idx >= len);
@@ -253,6 +309,12 @@ public:
         return els;
     }
 
+    // returns a malloc()ed copy of the elements (including the zero padding),
+    // e.g. for returning data which has been collected with a ScratchArena
+    T *DupData() const {
+        return (T *)Allocator::Dup(nullptr, els, (len + PADDING) * sizeof(T));
+    }
+
     int Find(T el, size_t startAt=0) const {
         for (size_t i = startAt; i < len; i++) {
             if (els[i] == el)
@@ -294,11 +356,11 @@ public:
 
     // cf. http://www.cprogramming.com/c++11/c++11-ranged-for-loop.html
     class Iter {
-        Vec<T> *vec;
+        Vec *vec;
         size_t pos;
 
     public:
-        Iter(Vec<T> *vec, size_t pos) : vec(vec), pos(pos) { }
+        Iter(Vec *vec, size_t pos) : vec(vec), pos(pos) { }
 
         bool operator!=(const Iter& other) const {
             return pos != other.pos;
@@ -321,8 +383,8 @@ public:
 };
 
 // only suitable for T that are pointers to C++ objects
-template <typename T>
-inline void DeleteVecMembers(Vec<T>& v)
+template <typename T, size_t INLINE_CAP>
+inline void DeleteVecMembers(Vec<T, INLINE_CAP>& v)
 {
     for (T& el : v) {
         delete el;
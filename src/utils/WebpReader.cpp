@@ -24,6 +24,29 @@ Size SizeFromData(const char *data, size_t len)
     return size;
 }
 
+bool DecodeInto(const char *data, size_t len, unsigned char *bgra, int stride, Size size)
+{
+    WebPDecoderConfig config;
+    if (!WebPInitDecoderConfig(&config))
+        return false;
+    if (WebPGetFeatures((const uint8_t *)data, len, &config.input) != VP8_STATUS_OK)
+        return false;
+    if (config.input.width != size.Width || config.input.height != size.Height)
+        return false;
+
+    config.output.colorspace = MODE_BGRA;
+    config.output.is_external_memory = 1;
+    config.output.u.RGBA.rgba = bgra;
+    config.output.u.RGBA.stride = stride;
+    config.output.u.RGBA.size = (size_t)abs(stride) * size.Height;
+    // filter lossy images in a second thread
+    config.options.use_threads = 1;
+
+    VP8StatusCode status = WebPDecode((const uint8_t *)data, len, &config);
+    WebPFreeDecBuffer(&config.output);
+    return VP8_STATUS_OK == status;
+}
+
 Bitmap *ImageFromData(const char *data, size_t len)
 {
     int w, h;
@@ -36,9 +59,10 @@ Bitmap *ImageFromData(const char *data, size_t len)
     Status ok = bmp.LockBits(&bmpRect, ImageLockModeWrite, PixelFormat32bppARGB, &bmpData);
     if (ok != Ok)
         return nullptr;
-    if (!WebPDecodeBGRAInto((const uint8_t *)data, len, (uint8_t *)bmpData.Scan0, bmpData.Stride * h, bmpData.Stride))
-        return nullptr;
+    bool decoded = DecodeInto(data, len, (unsigned char *)bmpData.Scan0, bmpData.Stride, Size(w, h));
     bmp.UnlockBits(&bmpData);
+    if (!decoded)
+        return nullptr;
 
     // hack to avoid the use of ::new (because there won't be a corresponding ::delete)
     return bmp.Clone(0, 0, w, h, PixelFormat32bppARGB);
@@ -52,6 +76,9 @@ namespace webp {
     bool HasSignature(const char *data, size_t len) { UNUSED(data); UNUSED(len); return false; }
     Gdiplus::Size SizeFromData(const char *data, size_t len) { UNUSED(data); UNUSED(len); return Gdiplus::Size(); }
     Gdiplus::Bitmap *ImageFromData(const char *data, size_t len) { UNUSED(data); UNUSED(len); return nullptr; }
+    bool DecodeInto(const char *data, size_t len, unsigned char *bgra, int stride, Gdiplus::Size size) {
+        UNUSED(data); UNUSED(len); UNUSED(bgra); UNUSED(stride); UNUSED(size); return false;
+    }
 }
 
 #endif
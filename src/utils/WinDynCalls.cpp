@@ -16,6 +16,7 @@ KTMW32_API_LIST(API_DECLARATION)
 USER32_API_LIST(API_DECLARATION)
 DWMAPI_API_LIST(API_DECLARATION)
 UIA_API_LIST(API_DECLARATION)
+D2D1_API_LIST(API_DECLARATION)
 DBGHELP_API_LIST(API_DECLARATION)
 
 #undef API_DECLARATION
@@ -72,6 +73,11 @@ void InitDynCalls() {
         UIA_API_LIST(API_LOAD)
     }
 
+    h = SafeLoadLibrary(L"d2d1.dll");
+    if (h) {
+        D2D1_API_LIST(API_LOAD)
+    }
+
 #if 0
     WCHAR *dbghelpPath = L"C:\\Program Files (x86)\\Microsoft Visual Studio 10.0\\Team Tools\\Performance Tools\\dbghelp.dll";
     h = LoadLibrary(dbghelpPath);
@@ -190,6 +196,13 @@ HRESULT GetWindowAttribute(HWND hwnd, DWORD dwAttribute, void *pvAttribute, DWOR
         return E_NOTIMPL;
     return DynDwmGetWindowAttribute(hwnd, dwAttribute, pvAttribute, cbAttribute);
 }
+
+// waits for the next composition pass (fails if composition is disabled)
+HRESULT Flush() {
+    if (!DynDwmFlush)
+        return E_NOTIMPL;
+    return DynDwmFlush();
+}
 };
 
 namespace uia {
@@ -228,3 +241,14 @@ HRESULT GetReservedNotSupportedValue(IUnknown **punkNotSupportedValue) {
     return DynUiaGetReservedNotSupportedValue(punkNotSupportedValue);
 }
 };
+
+namespace d2d {
+
+bool IsAvailable() { return DynD2D1CreateFactory != nullptr; }
+
+HRESULT CreateFactory(D2D1_FACTORY_TYPE factoryType, ID2D1Factory **factory) {
+    if (!DynD2D1CreateFactory)
+        return E_NOTIMPL;
+    return DynD2D1CreateFactory(factoryType, __uuidof(ID2D1Factory), nullptr, (void **)factory);
+}
+};
@@ -17,6 +17,7 @@ The intent is to standardize how we do it.
 #include <UIAutomationCore.h>
 #include <UIAutomationCoreApi.h>
 #include <OleAcc.h>
+#include <d2d1.h>
 
 // dbghelp.h is included here so that warning C4091 can be disabled in a single location
 #pragma warning(push)
@@ -25,6 +26,7 @@ The intent is to standardize how we do it.
 #include <dbghelp.h>
 #pragma warning(pop)
 #include <tlhelp32.h>
+#include <psapi.h>
 
 // kernel32.dll
 #ifndef PROCESS_DEP_ENABLE
@@ -43,6 +45,9 @@ typedef HANDLE(WINAPI *Sig_CreateFileTransactedW)(LPCWSTR lpFileName, DWORD dwDe
                                                   HANDLE hTransaction, PUSHORT pusMiniVersion,
                                                   PVOID pExtendedParameter);
 typedef BOOL(WINAPI *Sig_DeleteFileTransactedW)(LPCWSTR lpFileName, HANDLE hTransaction);
+// only available in kernel32.dll since Windows 7 (in psapi.dll before)
+typedef BOOL(WINAPI *Sig_K32GetProcessMemoryInfo)(HANDLE Process, PPROCESS_MEMORY_COUNTERS ppsmemCounters,
+                                                  DWORD cb);
 
 #define KERNEL32_API_LIST(V)                                                                       \
     V(SetProcessDEPPolicy)                                                                         \
@@ -50,7 +55,8 @@ typedef BOOL(WINAPI *Sig_DeleteFileTransactedW)(LPCWSTR lpFileName, HANDLE hTran
     V(SetDllDirectoryW)                                                                            \
     V(RtlCaptureContext)                                                                           \
     V(CreateFileTransactedW)                                                                       \
-    V(DeleteFileTransactedW)
+    V(DeleteFileTransactedW)                                                                       \
+    V(K32GetProcessMemoryInfo)
 
 // ntdll.dll
 #define PROCESS_EXECUTE_FLAGS 0x22
@@ -110,12 +116,14 @@ typedef BOOL(WINAPI *Sig_DwmDefWindowProc)(HWND hwnd, UINT msg, WPARAM wParam, L
                                            LRESULT *plResult);
 typedef HRESULT(WINAPI *Sig_DwmGetWindowAttribute)(HWND hwnd, DWORD dwAttribute, void *pvAttribute,
                                                    DWORD cbAttribute);
+typedef HRESULT(WINAPI *Sig_DwmFlush)();
 
 #define DWMAPI_API_LIST(V)                                                                         \
     V(DwmIsCompositionEnabled)                                                                     \
     V(DwmExtendFrameIntoClientArea)                                                                \
     V(DwmDefWindowProc)                                                                            \
-    V(DwmGetWindowAttribute)
+    V(DwmGetWindowAttribute)                                                                       \
+    V(DwmFlush)
 
 // normaliz.dll
 typedef int(WINAPI *Sig_NormalizeString)(int, LPCWSTR, int, LPWSTR, int);
@@ -265,6 +273,13 @@ typedef BOOL(WINAPI *Sig_SetGestureConfig)(HWND hwnd, DWORD dwReserved, UINT cID
     V(CloseGestureInfoHandle)                                                                      \
     V(SetGestureConfig)
 
+// d2d1.dll, only available since Windows 7 (and Vista with the Platform Update)
+typedef HRESULT(WINAPI *Sig_D2D1CreateFactory)(D2D1_FACTORY_TYPE factoryType, REFIID riid,
+                                               const D2D1_FACTORY_OPTIONS *pFactoryOptions,
+                                               void **ppIFactory);
+
+#define D2D1_API_LIST(V) V(D2D1CreateFactory)
+
 // dbghelp.dll,  may not be available under Win2000
 typedef BOOL(WINAPI *Sig_MiniDumpWriteDump)(HANDLE hProcess, DWORD ProcessId, HANDLE hFile,
                                             LONG DumpType,
@@ -333,6 +348,7 @@ NORMALIZ_API_LIST(API_DECLARATION)
 KTMW32_API_LIST(API_DECLARATION)
 USER32_API_LIST(API_DECLARATION)
 UIA_API_LIST(API_DECLARATION)
+D2D1_API_LIST(API_DECLARATION)
 DBGHELP_API_LIST(API_DECLARATION)
 #undef API_DECLARATION
 
@@ -357,6 +373,7 @@ BOOL IsCompositionEnabled();
 HRESULT ExtendFrameIntoClientArea(HWND hwnd, const MARGINS *pMarInset);
 BOOL DefWindowProc_(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam, LRESULT *plResult);
 HRESULT GetWindowAttribute(HWND hwnd, DWORD dwAttribute, void *pvAttribute, DWORD cbAttribute);
+HRESULT Flush();
 };
 
 // Touch Gesture API, only available in Windows 7
@@ -381,3 +398,9 @@ HRESULT RaiseStructureChangedEvent(IRawElementProviderSimple *pProvider,
                                    int cRuntimeIdLen);
 HRESULT GetReservedNotSupportedValue(IUnknown **punkNotSupportedValue);
 };
+
+namespace d2d {
+
+bool IsAvailable();
+HRESULT CreateFactory(D2D1_FACTORY_TYPE factoryType, ID2D1Factory **factory);
+};
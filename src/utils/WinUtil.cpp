@@ -7,6 +7,7 @@
 #include "WinDynCalls.h"
 #include "WinUtil.h"
 #include <mlang.h>
+#include <emmintrin.h>
 
 #include "DebugLog.h"
 
@@ -651,6 +652,38 @@ bool CopyImageToClipboard(HBITMAP hbmp, bool appendOnly) {
     return ok;
 }
 
+// for data in a registered clipboard format (e.g. "JFIF" for JPEG images)
+bool CopyDataToClipboard(const WCHAR *format, const void *data, size_t len, bool appendOnly) {
+    UINT cf = RegisterClipboardFormat(format);
+    if (!cf)
+        return false;
+
+    if (!appendOnly) {
+        if (!OpenClipboard(nullptr))
+            return false;
+        EmptyClipboard();
+    }
+
+    HGLOBAL handle = GlobalAlloc(GMEM_MOVEABLE, len);
+    if (handle) {
+        void *globalData = GlobalLock(handle);
+        if (globalData) {
+            memcpy(globalData, data, len);
+        }
+        GlobalUnlock(handle);
+
+        if (!SetClipboardData(cf, handle)) {
+            GlobalFree(handle);
+            handle = nullptr;
+        }
+    }
+
+    if (!appendOnly)
+        CloseClipboard();
+
+    return handle != nullptr;
+}
+
 void ToggleWindowStyle(HWND hwnd, DWORD flag, bool enable, int type) {
     DWORD style = GetWindowLong(hwnd, type);
     DWORD newStyle;
@@ -715,6 +748,21 @@ void DoubleBuffer::Flush(HDC hdc) {
         BitBlt(hdc, rect.x, rect.y, rect.dx, rect.dy, hdcBuffer, 0, 0, SRCCOPY);
 }
 
+// only copies the part of the buffer covering area (in target coordinates)
+void DoubleBuffer::Flush(HDC hdc, RectI area) {
+    assert(hdc != hdcBuffer);
+    area = area.Intersect(rect);
+    if (hdcBuffer && !area.IsEmpty())
+        BitBlt(hdc, area.x, area.y, area.dx, area.dy, hdcBuffer, area.x - rect.x, area.y - rect.y, SRCCOPY);
+}
+
+// moves the buffer's content by (dx, dy), the uncovered parts have to be repainted
+bool DoubleBuffer::Scroll(int dx, int dy) {
+    if (!hdcBuffer)
+        return false;
+    return ScrollDC(hdcBuffer, dx, dy, nullptr, nullptr, nullptr, nullptr) != 0;
+}
+
 DeferWinPosHelper::DeferWinPosHelper() { hdwp = ::BeginDeferWindowPos(32); }
 
 DeferWinPosHelper::~DeferWinPosHelper() { End(); }
@@ -1001,6 +1049,24 @@ COLORREF GetPixel(BitmapPixels *bitmap, int x, int y) {
     return c;
 }
 
+// zero-copy access to the pixels of a DIB section (returns nullptr for device
+// dependent bitmaps). The result always points to the top row of pixels,
+// stride is negative for bottom-up DIB sections
+uint8 *GetDIBSectionPixels(HBITMAP hbmp, int *stride, int *bitsPerPixel) {
+    DIBSECTION info = { 0 };
+    if (GetObject(hbmp, sizeof(info), &info) != sizeof(info) || !info.dsBm.bmBits)
+        return nullptr;
+    uint8 *pixels = (uint8 *)info.dsBm.bmBits;
+    *stride = info.dsBm.bmWidthBytes;
+    if (info.dsBmih.biHeight > 0) {
+        pixels += (info.dsBm.bmHeight - 1) * info.dsBm.bmWidthBytes;
+        *stride = -*stride;
+    }
+    if (bitsPerPixel)
+        *bitsPerPixel = info.dsBm.bmBitsPixel;
+    return pixels;
+}
+
 BitmapPixels *GetBitmapPixels(HBITMAP hbmp) {
     BitmapPixels *res = AllocStruct<BitmapPixels>();
 
@@ -1060,6 +1126,48 @@ BitmapPixels *GetBitmapPixels(HBITMAP hbmp) {
     return res;
 }
 
+// SSE2 version of RemapPixels32 for 16 bytes at a time (with exactly the same
+// rounding as mul255); returns the number of pixels that have been remapped
+static size_t RemapPixels32SSE2(uint8 *data, size_t nPixels, const int base[4], const int diff[4]) {
+    __m128i zero = _mm_setzero_si128();
+    // multiplicands for _mm_madd_epi16: (diff[k], 0) pairs of 16-bit values
+    __m128i diffv = _mm_setr_epi16((short)diff[0], 0, (short)diff[1], 0, (short)diff[2], 0,
+                                   (short)diff[3], 0);
+    __m128i basev = _mm_setr_epi32(base[0], base[1], base[2], base[3]);
+    __m128i round = _mm_set1_epi32(128);
+
+    size_t i = 0;
+    for (; i + 4 <= nPixels; i += 4) {
+        __m128i px = _mm_loadu_si128((const __m128i *)(data + i * 4));
+        __m128i words[2] = { _mm_unpacklo_epi8(px, zero), _mm_unpackhi_epi8(px, zero) };
+        __m128i res[2];
+        for (int j = 0; j < 2; j++) {
+            __m128i p[2] = { _mm_unpacklo_epi16(words[j], zero), _mm_unpackhi_epi16(words[j], zero) };
+            for (int n = 0; n < 2; n++) {
+                __m128i x = _mm_add_epi32(_mm_madd_epi16(p[n], diffv), round);
+                x = _mm_add_epi32(x, _mm_srai_epi32(x, 8));
+                p[n] = _mm_add_epi32(basev, _mm_srai_epi32(x, 8));
+            }
+            res[j] = _mm_packs_epi32(p[0], p[1]);
+        }
+        _mm_storeu_si128((__m128i *)(data + i * 4), _mm_packus_epi16(res[0], res[1]));
+    }
+    return i;
+}
+
+// maps every byte x of 32-bit pixels to base[k] + mul255(x, diff[k]) (with k being
+// the byte's channel)
+static void RemapPixels32(uint8 *data, size_t nPixels, const int base[4], const int diff[4]) {
+    size_t i = 0;
+    if (HasSSE2())
+        i = RemapPixels32SSE2(data, nPixels, base, diff);
+    for (uint8 *px = data + i * 4; i < nPixels; i++) {
+        for (int k = 0; k < 4; k++, px++) {
+            *px = (uint8)(base[k] + mul255(*px, diff[k]));
+        }
+    }
+}
+
 void UpdateBitmapColors(HBITMAP hbmp, COLORREF textColor, COLORREF bgColor) {
     if ((textColor & 0xFFFFFF) == WIN_COL_BLACK && (bgColor & 0xFFFFFF) == WIN_COL_WHITE)
         return;
@@ -1078,12 +1186,7 @@ void UpdateBitmapColors(HBITMAP hbmp, COLORREF textColor, COLORREF bgColor) {
     // for mapped 32-bit DI bitmaps: directly access the pixel data
     if (ret >= sizeof(info.dsBm) && info.dsBm.bmBits && 32 == info.dsBm.bmBitsPixel &&
         size.dx * 4 == info.dsBm.bmWidthBytes) {
-        int bmpBytes = size.dx * size.dy * 4;
-        uint8 *bmpData = (uint8 *)info.dsBm.bmBits;
-        for (int i = 0; i < bmpBytes; i++) {
-            int k = i % 4;
-            bmpData[i] = (uint8)(base[k] + mul255(bmpData[i], diff[k]));
-        }
+        RemapPixels32((uint8 *)info.dsBm.bmBits, (size_t)size.dx * size.dy, base, diff);
         return;
     }
 
@@ -1133,10 +1236,7 @@ void UpdateBitmapColors(HBITMAP hbmp, COLORREF textColor, COLORREF bgColor) {
     CrashIf(!bmpData);
 
     if (GetDIBits(hDC, hbmp, 0, size.dy, bmpData, &bmi, DIB_RGB_COLORS)) {
-        for (int i = 0; i < bmpBytes; i++) {
-            int k = i % 4;
-            bmpData[i] = (uint8)(base[k] + mul255(bmpData[i], diff[k]));
-        }
+        RemapPixels32(bmpData, (size_t)size.dx * size.dy, base, diff);
         SetDIBits(hDC, hbmp, 0, size.dy, bmpData, &bmi, DIB_RGB_COLORS);
     }
 
@@ -8,6 +8,9 @@
 #ifndef WM_MOUSEHWHEEL
 #define WM_MOUSEHWHEEL 0x020E
 #endif
+#ifndef WM_DPICHANGED
+#define WM_DPICHANGED 0x02E0
+#endif
 
 #define NO_COLOR (COLORREF) - 1
 
@@ -86,6 +89,7 @@ void CenterDialog(HWND hDlg, HWND hParent = nullptr);
 WCHAR *GetDefaultPrinterName();
 bool CopyTextToClipboard(const WCHAR *text, bool appendOnly = false);
 bool CopyImageToClipboard(HBITMAP hbmp, bool appendOnly);
+bool CopyDataToClipboard(const WCHAR *format, const void *data, size_t len, bool appendOnly);
 void ToggleWindowStyle(HWND hwnd, DWORD flag, bool enable, int type = GWL_STYLE);
 RectI ChildPosWithinParent(HWND hwnd);
 HFONT GetDefaultGuiFont();
@@ -143,6 +147,8 @@ class DoubleBuffer {
 
     HDC GetDC() const { return hdcBuffer ? hdcBuffer : hdcCanvas; }
     void Flush(HDC hdc);
+    void Flush(HDC hdc, RectI area);
+    bool Scroll(int dx, int dy);
 };
 
 class DeferWinPosHelper {
@@ -172,6 +178,7 @@ struct BitmapPixels {
 void InitAllCommonControls();
 SizeI GetBitmapSize(HBITMAP hbmp);
 BitmapPixels *GetBitmapPixels(HBITMAP hbmp);
+uint8 *GetDIBSectionPixels(HBITMAP hbmp, int *stride, int *bitsPerPixel);
 void FinalizeBitmapPixels(BitmapPixels* bitmapPixels);
 COLORREF GetPixel(BitmapPixels *bitmap, int x, int y);
 void UpdateBitmapColors(HBITMAP hbmp, COLORREF textColor, COLORREF bgColor);
@@ -80,6 +80,39 @@ static void GeomTest()
     }
 }
 
+static void ScratchArenaTest()
+{
+    ScratchArena *arena = ScratchArena::ForCurrentThread();
+    utassert(arena && arena == ScratchArena::ForCurrentThread());
+
+    char *outer;
+    {
+        ScopedScratch scratch;
+        outer = (char *)Allocator::Alloc(scratch.Get(), 10);
+        memcpy(outer, "outer", 6);
+        {
+            ScopedScratch nested;
+            // growing a Vec reallocates its most recent piece in place
+            Vec<int> v(0, nested.Get());
+            for (int i = 0; i < 100000; i++)
+                v.Append(i);
+            utassert(v.Count() == 100000 && v.At(99999) == 99999);
+            str::Str<WCHAR> s(0, nested.Get());
+            s.Append(L"scratch");
+            utassert(str::Eq(s.Get(), L"scratch"));
+            utassert(str::Eq(outer, "outer"));
+        }
+        // memory is reused after a nested scope ends
+        char *reused = (char *)Allocator::Alloc(scratch.Get(), 10);
+        utassert(reused == outer + 24);
+        utassert(str::Eq(outer, "outer"));
+    }
+
+    ScratchArena::FreeForCurrentThread();
+    utassert(ScratchArena::ForCurrentThread() != nullptr);
+    ScratchArena::FreeForCurrentThread();
+}
+
 void BaseUtilTest()
 {
     utassert(RoundToPowerOf2(0) == 1);
@@ -92,6 +125,11 @@ void BaseUtilTest()
 
     utassert(MurmurHash2(nullptr, 0) == 0x342CE6C);
     utassert(MurmurHash2("test", 4) != MurmurHash2("Test", 4));
+    utassert(MurmurHash64(nullptr, 0) == 0x62F65C6903420D05ULL);
+    utassert(MurmurHash64("test", 4) == 0xD1A34073F1B5B1AFULL);
+    utassert(MurmurHash64("The quick brown fox jumps over the lazy dog", 43) == 0x164E047CF8B93FEAULL);
+    utassert(MurmurHash64("test", 4) != MurmurHash64("Test", 4));
 
     GeomTest();
+    ScratchArenaTest();
 }
@@ -31,6 +31,24 @@ static bool TestDigestSHA2(const char *data, size_t size, const char *verify)
     return str::Eq(hash, verify);
 }
 
+// feeds data to CryptoHash in chunks of chunkSize bytes
+static bool TestCryptoHash(CryptoHash::Algorithm alg, const char *data, size_t size, size_t chunkSize, const char *verify)
+{
+    CryptoHash hash(alg);
+    if (!hash.IsValid())
+        return false;
+    for (size_t i = 0; i < size; i += chunkSize) {
+        if (!hash.Update(data + i, std::min(chunkSize, size - i)))
+            return false;
+    }
+    unsigned char digest[32];
+    size_t digestLen = CryptoHash::MD5 == alg ? 16 : CryptoHash::SHA1 == alg ? 20 : 32;
+    if (!hash.Final(digest, digestLen))
+        return false;
+    ScopedMem<char> hex(str::MemToHex(digest, digestLen));
+    return str::Eq(hex, verify);
+}
+
 void CryptoUtilTest()
 {
     utassert(TestDigestMD5("", 0, "d41d8cd98f00b204e9800998ecf8427e"));
@@ -44,4 +62,15 @@ void CryptoUtilTest()
     utassert(TestDigestSHA2("", 0, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"));
     utassert(TestDigestSHA2("The quick brown fox jumps over the lazy dog", 43, "d7a8fbb307d7809469ca9abcb0082e4f8d5651e46d3cdb762d02d0bf37c9e592"));
     utassert(TestDigestSHA2("The quick brown fox jumps over the lazy dog.", 44, "ef537f25c895bfa782526529a9b63d97aa631564d5d789c2b765448c8635fb6c"));
+
+    const char *fox = "The quick brown fox jumps over the lazy dog";
+    utassert(TestCryptoHash(CryptoHash::MD5, fox, 43, 43, "9e107d9d372bb6826bd81d3542a419d6"));
+    utassert(TestCryptoHash(CryptoHash::MD5, fox, 43, 5, "9e107d9d372bb6826bd81d3542a419d6"));
+    utassert(TestCryptoHash(CryptoHash::SHA1, fox, 43, 7, "2fd4e1c67a2d28fced849ee1bb76e7391b93eb12"));
+    utassert(TestCryptoHash(CryptoHash::SHA2, fox, 43, 1, "d7a8fbb307d7809469ca9abcb0082e4f8d5651e46d3cdb762d02d0bf37c9e592"));
+    utassert(TestCryptoHash(CryptoHash::SHA2, "", 0, 1, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"));
+    // the requested digest length must match the algorithm's
+    CryptoHash hash(CryptoHash::MD5);
+    unsigned char digest[32];
+    utassert(hash.Update(fox, 43) && !hash.Final(digest, 32));
 }
@@ -80,7 +80,40 @@ void DictTestMapStrToInt()
     toRemove.FreeMembers();
 }
 
+static void DictTestMapWStrToInt()
+{
+    dict::MapWStrToInt d(4);
+    bool ok;
+    int val;
+
+    // remove keys in a different order than they were inserted in
+    // so that entries have to be moved back into their ideal slots
+    for (int i = 0; i < 500; i++) {
+        ScopedMem<WCHAR> key(str::Format(L"key%d", i));
+        ok = d.Insert(key, i, nullptr);
+        utassert(ok);
+    }
+    utassert(500 == d.Count());
+    for (int i = 0; i < 500; i += 3) {
+        ScopedMem<WCHAR> key(str::Format(L"key%d", i));
+        ok = d.Remove(key, &val);
+        utassert(ok && val == i);
+    }
+    for (int i = 0; i < 500; i++) {
+        ScopedMem<WCHAR> key(str::Format(L"key%d", i));
+        ok = d.Get(key, &val);
+        utassert(ok == (i % 3 != 0));
+        utassert(!ok || val == i);
+    }
+    ok = d.Insert(L"key1", 5, &val);
+    utassert(!ok && val == 1);
+    ok = d.Insert(L"key0", 5, &val);
+    utassert(ok);
+    utassert(d.Count() == 500 - 167 + 1);
+}
+
 void DictTest()
 {
     DictTestMapStrToInt();
+    DictTestMapWStrToInt();
 }
@@ -124,6 +124,46 @@ static void Test03()
     utassert(!t);
 }
 
+static void Test04()
+{
+    // continue parsing after the source has grown
+    const char *s = "<p>first</p><p>second";
+    HtmlPullParser parser(s, 12);
+    HtmlToken *t = parser.Next();
+    utassert(t && t->IsStartTag() && Tag_P == t->tag);
+    t = parser.Next();
+    utassert(t && t->IsText() && str::EqNIx(t->s, t->sLen, "first"));
+    t = parser.Next();
+    utassert(t && t->IsEndTag() && Tag_P == t->tag);
+    utassert(!parser.Next());
+    parser.SetLen(str::Len(s));
+    t = parser.Next();
+    utassert(t && t->IsStartTag() && Tag_P == t->tag);
+    t = parser.Next();
+    utassert(t && t->IsText() && str::EqNIx(t->s, t->sLen, "second"));
+    utassert(!parser.Next());
+}
+
+static void Test05()
+{
+    const char *s = "<a CLASS=c1 href='x.html' class=c2 style=\"s\" epub:type=t>";
+    HtmlPullParser parser(s, str::Len(s));
+    HtmlToken *t = parser.Next();
+    utassert(t && t->IsStartTag() && Tag_A == t->tag);
+    AttrInfo *classAttr = t->GetAttr(Attr_Class);
+    AttrInfo *styleAttr = t->GetAttr(Attr_Style);
+    utassert(classAttr && classAttr->ValIs("c1"));
+    utassert(styleAttr && styleAttr->ValIs("s"));
+    AttrInfo *a = t->GetAttr(Attr_Href);
+    utassert(a && a->ValIs("x.html"));
+    // looking up other attributes doesn't invalidate the previous results
+    utassert(t->GetAttrByName("epub:type"));
+    utassert(classAttr->ValIs("c1"));
+    utassert(!t->GetAttr(Attr_Type));
+    utassert(!t->GetAttr(Attr_Id));
+    utassert(!parser.Next());
+}
+
 void HtmlPullParser_UnitTests()
 {
     Test00("<p a1='>' foo=bar />", HtmlToken::EmptyElementTag);
@@ -135,4 +175,6 @@ void HtmlPullParser_UnitTests()
     Test01();
     Test02();
     Test03();
+    Test04();
+    Test05();
 }
@@ -189,4 +189,25 @@ Key = Value";
         utassert(data->boolean == ((i % 2) == 0));
         FreeStruct(&gSutStructInfo, data);
     }
+
+    // fields in a different order than declared (first value wins)
+    static const char *unorderedData = "\
+Integer = 1\r\n\
+Point [\r\n\
+\tY = 2\r\n\
+\tX = 3\r\n\
+]\r\n\
+Color = #010203\r\n\
+Integer = 4\r\n\
+Boolean = false\r\n\
+Unknown = 5\r\n\
+Point [\r\n\
+\tX = 6\r\n\
+]\r\n\
+FloatingPoint = 7\r\n";
+    data = (SutStruct *)DeserializeStruct(&gSutStructInfo, unorderedData);
+    utassert(!data->boolean && RGB(1, 2, 3) == data->color);
+    utassert(7.f == data->floatingPoint && 1 == data->integer);
+    utassert(PointI(3, 2) == data->point);
+    FreeStruct(&gSutStructInfo, data);
 }
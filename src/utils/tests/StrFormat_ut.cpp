@@ -28,4 +28,17 @@ void StrFormatTest()
     s = f.ParseFormat("c: %c, i: %d, f: %f, d: %f, s: %s, ws: %s, c: {0}, i: {1}, f: {2}, d: {3}, s: {4}, ws: {5}, i: {1}").c('x').i(-18).f(3.45).f(-18.38).s("str").s(L"wstr").GetDup();
     check(s, "c: x, i: -18, f: 3.45, d: -18.38, s: str, ws: wstr, c: x, i: -18, f: 3.45, d: -18.38, s: str, ws: wstr, i: -18");
     free(s);
+
+    fmt::Buf<WCHAR, 32> wb;
+    wb.s(L" (").i(12).s(L" / ").i(345).c(')');
+    check(wb.Get(), L" (12 / 345)");
+    utassert(11 == wb.Len() && !wb.IsTruncated());
+    check(wb.Reset().i(-7, 3).c(' ').hex(0xbeef).c(' ').hex(10, 2).c(' ').u(0), L"-007 beef 0a 0");
+    check(wb.Reset().i(INT64_MIN), L"-9223372036854775808");
+
+    fmt::Buf<char, 8> cb;
+    check(cb.s("abc").u(12345).Get(), "abc1234");
+    utassert(7 == cb.Len() && cb.IsTruncated());
+    check(cb.c('x').s("yz"), "abc1234");
+    check(cb.Reset().s("abcdef", 3).s(nullptr), "abc");
 }
@@ -129,6 +129,46 @@ static void StrConvTest()
     utassert(conv == 0 && str::Eq(cbuf, ""));
     conv = str::WcharToUtf8Buf(L"abcd", cbuf, dimof(cbuf));
     utassert(conv == 0 && str::Eq(cbuf, ""));
+
+    // converting into a re-used buffer
+    str::Str<WCHAR> wstr;
+    WCHAR *ws = str::conv::FromUtf8("a fairly long string which is converted first", (size_t)-1, wstr);
+    utassert(ws == wstr.Get() && str::Eq(ws, L"a fairly long string which is converted first"));
+    WCHAR *wels = wstr.LendData();
+    ws = str::conv::FromUtf8("ab\xE2\x82\xACcd", 4, wstr);
+    utassert(ws == wels && 2 == wstr.Count() && str::Eq(ws, L"ab"));
+    ws = str::conv::FromUtf8("ab\xE2\x82\xACcd", 5, wstr);
+    utassert(3 == wstr.Count() && str::Eq(ws, L"ab\u20AC"));
+    ws = str::conv::FromUtf8("", (size_t)-1, wstr);
+    utassert(ws && 0 == wstr.Count() && str::Eq(ws, L""));
+    str::Str<char> cstr;
+    char *cs = str::conv::ToUtf8(L"ab\u20AC", (size_t)-1, cstr);
+    utassert(cs == cstr.Get() && 5 == cstr.Count() && str::Eq(cs, "ab\xE2\x82\xAC"));
+    cs = str::conv::ToUtf8(L"xyz", 2, cstr);
+    utassert(2 == cstr.Count() && str::Eq(cs, "xy"));
+    utassert(!str::conv::FromCodePage("abc", 3, 12345, wstr) && 0 == wstr.Count());
+
+    // UTF-8 fast paths (ASCII runs, multi-byte sequences, invalid input)
+    const char *utf8 = "more than sixteen ASCII chars \xC3\xA4\xE2\x82\xAC\xF0\x9F\x98\x80 and then some more ASCII";
+    const WCHAR *utf16 = L"more than sixteen ASCII chars \xE4\u20AC\xD83D\xDE00 and then some more ASCII";
+    ScopedMem<WCHAR> wconv(str::conv::FromUtf8(utf8));
+    utassert(str::Eq(wconv, utf16));
+    ScopedMem<char> cconv(str::conv::ToUtf8(utf16));
+    utassert(str::Eq(cconv, utf8));
+    wconv.Set(str::conv::FromUtf8("ab\0cd", 5));
+    utassert(str::Eq(wconv, L"ab") && str::Eq(wconv + 3, L"cd"));
+    utassert(!str::conv::FromUtf8("abc", 0));
+    wconv.Set(str::conv::FromUtf8("invalid \xC0\xAF and \xE2\x82"));
+    utassert(wconv && str::StartsWith(wconv.Get(), L"invalid "));
+    const WCHAR loneSurrogate[] = { 'a', 0xD800, 'b', 0 };
+    cconv.Set(str::conv::ToUtf8(loneSurrogate));
+    utassert(cconv && 'a' == cconv[0]);
+
+    ScopedMem<char> owned(str::Dup("moved"));
+    ScopedMem<char> moved(std::move(owned));
+    utassert(!owned && str::Eq(moved, "moved"));
+    owned = std::move(moved);
+    utassert(!moved && str::Eq(owned, "moved"));
 }
 
 static void StrUrlExtractTest()
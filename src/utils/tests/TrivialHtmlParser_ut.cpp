@@ -167,6 +167,17 @@ static void HtmlParser08()
 {
     ScopedMem<WCHAR> val(DecodeHtmlEntitites("&auml&test;&&ouml-", CP_ACP));
     utassert(str::Eq(val, L"\xE4&test;&\xF6-"));
+
+    const char *s = "&lt;b&gt; &amp;&#x20AC;&unknown; tail";
+    val.Set(str::conv::FromHtmlUtf8(s, 32));
+    utassert(str::Eq(val, L"<b> &\u20AC&unknown;"));
+    str::Str<WCHAR> buf;
+    WCHAR *res = str::conv::FromHtmlUtf8(s, 32, buf);
+    utassert(res == buf.Get() && str::Eq(res, val) && buf.Count() == str::Len(val));
+    res = str::conv::FromHtmlUtf8(s, 0, buf);
+    utassert(res && 0 == buf.Count() && str::Eq(res, L""));
+    val.Set(str::conv::FromHtmlUtf8(s, 0));
+    utassert(str::Eq(val, L""));
 }
 
 static void HtmlParser09()
@@ -217,6 +228,29 @@ static void HtmlParser11()
     utassert(!root);
 }
 
+static void HtmlParser12()
+{
+    HtmlParser p;
+    HtmlElement *root = p.Parse("<ul><li name=a><li NAME=b data-x=c><li name=c></ul>");
+    utassert(4 == p.ElementsCount());
+    utassert(4 == p.TotalAttrCount());
+    utassert(root && root->NameIs("ul"));
+    HtmlElement *el = root->down;
+    ScopedMem<WCHAR> val(el->GetAttribute("name"));
+    utassert(str::Eq(val, L"a"));
+    el = el->next;
+    val.Set(el->GetAttribute("Name"));
+    utassert(str::Eq(val, L"b"));
+    val.Set(el->GetAttribute("data-x"));
+    utassert(str::Eq(val, L"c"));
+    utassert(!el->GetAttribute("data"));
+    el = el->next;
+    val.Set(el->GetAttribute("name"));
+    utassert(str::Eq(val, L"c"));
+    utassert(!el->next);
+    utassert(el == p.FindElementByName("LI", root->down->next));
+}
+
 static void HtmlParserFile()
 {
     WCHAR *fileName = L"HtmlParseTest00.html";
@@ -271,6 +305,7 @@ static void HtmlParserFile()
 void TrivialHtmlParser_UnitTests()
 {
     HtmlParserFile();
+    HtmlParser12();
     HtmlParser11();
     HtmlParser10();
     HtmlParser09();
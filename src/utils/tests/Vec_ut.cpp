@@ -248,6 +248,39 @@ void VecTest()
         utassert(v.Count() == 3 && v.At(0) == 0 && v.At(2) == 2);
     }
 
+    {
+        utassert(VecInlineCap<int>::value == 15 && VecInlineCap<void *>::value == 15);
+        utassert(VecInlineCap<RectI>::value == 7);
+        struct Big { char data[200]; };
+        utassert(VecInlineCap<Big>::value == 0);
+        utassert(sizeof(Vec<Big>) < sizeof(Big) * 2);
+
+        Vec<int, 0> v;
+        utassert(v.Count() == 0 && v.LendData()[0] == 0);
+        for (int i = 0; i < 100; i++)
+            v.Append(i);
+        utassert(v.Count() == 100 && v.At(99) == 99 && v.LendData()[100] == 0);
+        v.RemoveAt(0, 99);
+        utassert(v.Count() == 1 && v.At(0) == 99);
+        v.Reset();
+        utassert(v.Count() == 0 && v.LendData()[0] == 0);
+    }
+
+    {
+        Vec<int> v;
+        for (int i = 0; i < 100; i++)
+            v.Append(i);
+        int *data = v.LendData();
+        Vec<int> v2(std::move(v));
+        utassert(v2.LendData() == data && v2.Count() == 100 && v2.At(99) == 99);
+        utassert(v.Count() == 0 && v.LendData() != data);
+        v.Append(5);
+        v2 = std::move(v);
+        utassert(v2.Count() == 1 && v2.At(0) == 5 && v.Count() == 0);
+        v = std::move(v2);
+        utassert(v.Count() == 1 && v.At(0) == 5 && v2.Count() == 0);
+    }
+
     WStrVecTest();
     StrListTest();
 }
@@ -49,4 +49,44 @@ void WinUtilTest()
         c = AdjustLightness(RGB(255, 255, 255), 0.5f);
         utassert(c == RGB(128, 128, 128));
     }
+
+    {
+        // an odd number of pixels, so that both the vectorized and the scalar code are used
+        const int dx = 7, dy = 3;
+        BITMAPINFO bmi = { 0 };
+        bmi.bmiHeader.biSize = sizeof(bmi.bmiHeader);
+        bmi.bmiHeader.biWidth = dx;
+        bmi.bmiHeader.biHeight = -dy;
+        bmi.bmiHeader.biPlanes = 1;
+        bmi.bmiHeader.biBitCount = 32;
+        bmi.bmiHeader.biCompression = BI_RGB;
+        uint8 *bits = nullptr;
+        HBITMAP hbmp = CreateDIBSection(nullptr, &bmi, DIB_RGB_COLORS, (void **)&bits, nullptr, 0);
+        utassert(hbmp && bits);
+        for (int i = 0; i < dx * dy * 4; i++) {
+            bits[i] = (uint8)(i * 37);
+        }
+        // inverted colors
+        UpdateBitmapColors(hbmp, WIN_COL_WHITE, WIN_COL_BLACK);
+        for (int i = 0; i < dx * dy * 4; i++) {
+            uint8 orig = (uint8)(i * 37);
+            utassert(bits[i] == (i % 4 == 3 ? orig : 255 - orig));
+        }
+        UpdateBitmapColors(hbmp, WIN_COL_WHITE, WIN_COL_BLACK);
+        // black on white stays unchanged
+        UpdateBitmapColors(hbmp, WIN_COL_BLACK, WIN_COL_WHITE);
+        for (int i = 0; i < dx * dy * 4; i++) {
+            utassert(bits[i] == (uint8)(i * 37));
+        }
+        // pure black and white pixels map to text and background color
+        memset(bits, 0, dx * 4);
+        memset(bits + dx * 4, 0xFF, dx * 4);
+        UpdateBitmapColors(hbmp, RGB(0x10, 0x20, 0x30), RGB(0xF0, 0xE0, 0xD0));
+        for (int x = 0; x < dx; x++) {
+            utassert(bits[x * 4] == 0x30 && bits[x * 4 + 1] == 0x20 && bits[x * 4 + 2] == 0x10);
+            uint8 *px = bits + (dx + x) * 4;
+            utassert(px[0] == 0xD0 && px[1] == 0xE0 && px[2] == 0xF0);
+        }
+        DeleteObject(hbmp);
+    }
 }
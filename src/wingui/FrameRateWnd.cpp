@@ -9,6 +9,7 @@
 
 #include "BaseUtil.h"
 #include "FrameRateWnd.h"
+#include "StrFormat.h"
 #include "WinUtil.h"
 
 /*
@@ -28,6 +29,15 @@ that it's actually a part of that window.
 #define COL_WHITE RGB(0xff, 0xff, 0xff)
 #define COL_BLACK RGB(0, 0, 0)
 
+typedef fmt::Buf<WCHAR, 256> FrameRateText;
+
+// formatted on the stack, as this happens for every frame
+static void GetFrameRateText(FrameRateWnd *w, FrameRateText& txt) {
+    txt.i(w->frameRate);
+    if (w->info)
+        txt.s(L" fps\n").s(w->info);
+}
+
 static RECT GetClientRect(HWND hwnd) {
     RECT r;
     GetClientRect(hwnd, &r);
@@ -43,7 +53,14 @@ static void FrameRatePaint(FrameRateWnd *w, HDC hdc, PAINTSTRUCT &ps) {
     SetTextColor(hdc, COL_WHITE);
 
     ScopedHdcSelect selFont(hdc, w->font);
-    ScopedMem<WCHAR> txt(str::Format(L"%d", w->frameRate));
+    FrameRateText txt;
+    GetFrameRateText(w, txt);
+    if (w->info) {
+        rc.left += 4;
+        rc.top += 2;
+        DrawText(hdc, txt, -1, &rc, DT_LEFT | DT_NOPREFIX);
+        return;
+    }
     DrawCenteredText(hdc, rc, txt);
 }
 
@@ -54,9 +71,20 @@ static void PositionWindow(FrameRateWnd *w, SIZE s) {
     MoveWindow(w->hwnd, p.x, p.y, s.cx, s.cy, TRUE);
 }
 
+static SizeI MultiLineTextSize(FrameRateWnd *w, const WCHAR *txt) {
+    HDC hdc = GetWindowDC(w->hwnd);
+    HGDIOBJ prev = SelectObject(hdc, w->font);
+    RECT rc = { 0 };
+    DrawText(hdc, txt, -1, &rc, DT_LEFT | DT_NOPREFIX | DT_CALCRECT);
+    SelectObject(hdc, prev);
+    ReleaseDC(w->hwnd, hdc);
+    return SizeI(rc.right - rc.left, rc.bottom - rc.top);
+}
+
 static SIZE GetIdealSize(FrameRateWnd *w) {
-    WCHAR *txt = str::Format(L"%d", w->frameRate);
-    SizeI s = TextSizeInHwnd(w->hwnd, txt);
+    FrameRateText txt;
+    GetFrameRateText(w, txt);
+    SizeI s = w->info ? MultiLineTextSize(w, txt) : TextSizeInHwnd(w->hwnd, txt);
 
     // add padding
     s.dy += 4;
@@ -70,7 +98,6 @@ static SIZE GetIdealSize(FrameRateWnd *w) {
     if (s.dy > w->maxSizeSoFar.cy) {
         w->maxSizeSoFar.cy = s.dy;
     }
-    free(txt);
     return w->maxSizeSoFar;
 }
 
@@ -88,6 +115,27 @@ void ShowFrameRateDur(FrameRateWnd *w, double durMs) {
     ShowFrameRate(w, FrameRateFromDuration(durMs));
 }
 
+void ShowFrameRateInfo(FrameRateWnd *w, const WCHAR *info) {
+    if (!w || str::Eq(w->info, info)) {
+        return;
+    }
+    free(w->info);
+    w->info = str::Dup(info);
+    if (!info) {
+        // shrink back to the size of a single number
+        w->maxSizeSoFar.cx = w->maxSizeSoFar.cy = 0;
+    }
+    SIZE s = GetIdealSize(w);
+    PositionWindow(w, s);
+    ScheduleRepaint(w->hwnd);
+}
+
+void SetFrameRateWndVisible(FrameRateWnd *w, bool visible) {
+    if (w && w->hwnd) {
+        ShowWindow(w->hwnd, visible ? SW_SHOWNA : SW_HIDE);
+    }
+}
+
 static void FrameRateOnPaint(FrameRateWnd *w) {
     PAINTSTRUCT ps;
     HDC hdc = BeginPaint(w->hwnd, &ps);
@@ -196,6 +244,7 @@ bool CreateFrameRateWnd(FrameRateWnd *w) {
 void DeleteFrameRateWnd(FrameRateWnd *w) {
     if (w) {
         RemoveWindowSubclass(w->hwndAssociatedWithTopLevel, WndProcFrameRateAssociated, 0);
+        free(w->info);
         free(w);
     }
 }
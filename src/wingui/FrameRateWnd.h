@@ -10,6 +10,8 @@ struct FrameRateWnd {
 
     SIZE maxSizeSoFar;
     int frameRate;
+    // additional lines shown below the frame rate (cf. ShowFrameRateInfo)
+    WCHAR *info;
 };
 
 FrameRateWnd *AllocFrameRateWnd(HWND hwndAssociatedWith);
@@ -17,5 +19,8 @@ bool CreateFrameRateWnd(FrameRateWnd *);
 void DeleteFrameRateWnd(FrameRateWnd *);
 void ShowFrameRate(FrameRateWnd *, int frameRate);
 void ShowFrameRateDur(FrameRateWnd *, double durMs);
+// info can contain several lines (or be nullptr to only show the frame rate)
+void ShowFrameRateInfo(FrameRateWnd *, const WCHAR *info);
+void SetFrameRateWndVisible(FrameRateWnd *, bool visible);
 
 int FrameRateFromDuration(double durMs);